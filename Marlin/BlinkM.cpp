@@ -15,6 +15,11 @@
 
 void SendColors(byte red, byte grn, byte blu)
 {
+#ifdef TWI_QUEUE
+  const uint8_t data[5] = { 'o', 'n', red, grn, blu }; // 'o' disables the ongoing script
+  twi_queue_init();
+  twi_queue_write(0x09, data, sizeof(data));
+#else
   Wire.begin(); 
   Wire.beginTransmission(0x09);
   Wire.write('o');                    //to disable ongoing script, only needs to be used once
@@ -23,6 +28,7 @@ void SendColors(byte red, byte grn, byte blu)
   Wire.write(grn);
   Wire.write(blu);
   Wire.endTransmission();
+#endif
 }
 
 #endif //BLINKM
@@ -8,7 +8,11 @@
   # include "WProgram.h"
 #endif
 
-#include "Wire.h"
+#ifdef TWI_QUEUE
+  #include "twi_queue.h"
+#else
+  #include "Wire.h"
+#endif
 
 void SendColors(byte red, byte grn, byte blu);
 
@@ -23,6 +23,12 @@
 // Serial port 0 is still used by the Arduino bootloader regardless of this setting.
 #define SERIAL_PORT 0
 
+// SERIAL_PORT_2 takes commands from a second UART at the same time, for instance a WiFi bridge next to USB.
+// Each port assembles its own lines and keeps its own line numbers, the answers to a command go back to
+// the port it came from. Binary frames and the resend history are only used on SERIAL_PORT.
+//#define SERIAL_PORT_2 1
+#define SERIAL_PORT_2_BAUDRATE 115200
+
 // This determines the communication speed of the printer
 // This determines the communication speed of the printer
 #define BAUDRATE 250000
@@ -94,6 +100,17 @@
 // Define this to have the electronics keep the power supply off on startup. If you don't know what this is leave it.
 // #define PS_DEFAULT_OFF
 
+// Switch the power supply (PS_ON_PIN) on as soon as a command that moves or heats is queued, and off
+// again once nothing moved or was queued to move for AUTO_POWER_IDLE_TIME, no heater has a target and
+// all are below AUTO_POWER_SAFE_TEMP. The first command that heats a cold machine sets its target as
+// it is queued, so heating starts while the commands before it run. M80 and M81 still work.
+//#define AUTO_POWER_CONTROL
+#ifdef AUTO_POWER_CONTROL
+  #define AUTO_POWER_DELAY 500       // ms the supply gets before the command it was switched on for runs
+  #define AUTO_POWER_IDLE_TIME 600   // s
+  #define AUTO_POWER_SAFE_TEMP 50    // C, the hotend fan runs from the supply until then
+#endif
+
 //===========================================================================
 //=============================Thermal Settings  ============================
 //===========================================================================
@@ -128,14 +145,18 @@
 // 1010 is Pt1000 with 1k pullup (non standard)
 // 147 is Pt100 with 4k7 pullup
 // 110 is Pt100 with 1k pullup (non standard)
+// 1000 is a custom thermistor, set up by THERMISTOR_CUSTOM_* in Configuration_adv.h
 
 #define TEMP_SENSOR_0 -1
 #define TEMP_SENSOR_1 -1
 #define TEMP_SENSOR_2 0
 #define TEMP_SENSOR_BED 0
 
-// This makes temp sensor 1 a redundant sensor for sensor 0. If the temperatures difference between these sensors is to high the print will be aborted.
-//#define TEMP_SENSOR_1_AS_REDUNDANT
+// A second sensor for a heater, on a sensor input (0, 1 or 2) no hotend uses, with TEMP_SENSOR_<input> set to the
+// type of the heater's own sensor. If the temperatures difference between these sensors is to high the print will be aborted.
+//#define REDUNDANT_SENSOR_0 1    // hotend 0 is checked against sensor input 1
+//#define REDUNDANT_SENSOR_BED 2  // the bed against sensor input 2
+//#define TEMP_SENSOR_1_AS_REDUNDANT  // the same as REDUNDANT_SENSOR_0 1
 #define MAX_REDUNDANT_TEMP_SENSOR_DIFF 10
 
 // Actual temperature must be close to target for this long before M109 returns success
@@ -253,6 +274,22 @@
 // Uncomment the following line to enable CoreXY kinematics
 // #define COREXY
 
+// Uncomment the following line for a SCARA arm: the X motor turns the upper arm at the shoulder, the
+// Y motor the forearm at the elbow. Moves are cut into segments like on a delta, the joint angles of
+// each come from table lookups instead of acos() and atan2(). The X and Y steps per unit, feedrates,
+// accelerations and jerk are per degree of the joints, X_MIN_POS .. Y_MAX_POS are the bed.
+// G28 homes the shoulder, then the elbow, to their endstops.
+//#define SCARA
+#ifdef SCARA
+  #define SCARA_LINKAGE_1 150.0           // mm, shoulder to elbow
+  #define SCARA_LINKAGE_2 150.0           // mm, elbow to nozzle
+  #define SCARA_OFFSET_X -100.0           // mm, position of the shoulder axis on the bed
+  #define SCARA_OFFSET_Y 100.0
+  #define SCARA_SHOULDER_HOME_ANGLE -90.0 // degrees of the upper arm from +X at its endstop
+  #define SCARA_ELBOW_HOME_ANGLE 150.0    // degrees of the forearm from the upper arm at its endstop
+  #define SCARA_SEGMENTS_PER_SECOND 200
+#endif
+
 // coarse Endstop Settings
 #define ENDSTOPPULLUPS // Comment this out (using // at the start of the line) to disable the endstop pullup resistors
 
@@ -364,6 +401,18 @@ const bool Z_MAX_ENDSTOP_INVERTING = true; // set to true to invert the logic of
      // I wouldn't see a reason to go above 3 (=9 probing points on the bed)
     #define AUTO_BED_LEVELING_GRID_POINTS 2
 
+    // Instead of fitting a plane, keep the probed heights as a mesh and follow it with bilinear
+    // interpolation, for beds that are warped rather than just tilted. Moves are split where they
+    // cross grid lines. Outside the probed rectangle the heights at its edge are used.
+    //#define MESH_BED_LEVELING
+
+    // G29 L<left> R<right> F<front> B<back> probes only the grid points around that rectangle, the
+    // area of the print, at the usual spacing. Without them the ;MINX: ;MAXX: ;MINY: ;MAXY: lines in
+    // the header of the selected SD file are used (Cura writes them, see SD_FILE_HEADER), and
+    // without those the whole grid. A mesh keeps the heights at the edge of the probed part for
+    // the rest of the bed.
+    //#define AUTO_BED_LEVELING_ADAPTIVE
+
 
   #else  // not AUTO_BED_LEVELING_GRID
     // with no grid, just probe 3 arbitrary points.  A simple cross-product
@@ -392,6 +441,17 @@ const bool Z_MAX_ENDSTOP_INVERTING = true; // set to true to invert the logic of
   #define Z_RAISE_BEFORE_PROBING 15    //How much the extruder will be raised before traveling to the first probing point.
   #define Z_RAISE_BETWEEN_PROBINGS 5  //How much the extruder will be raised when traveling from between next probing points
 
+  // Each point is probed twice: approached at Z_PROBE_SPEED_FAST until the probe triggers, raised by
+  // Z_PROBE_RETRACT and probed again at Z_PROBE_SPEED_SLOW (mm/min). Without these the Z homing
+  // feedrate, a quarter of it and Z_HOME_RETRACT_MM are used.
+  //#define Z_PROBE_SPEED_FAST (4*60)
+  //#define Z_PROBE_SPEED_SLOW 60
+  //#define Z_PROBE_RETRACT 1
+
+  // Keep the last G29 result, stored in EEPROM by M500 and read back at boot, so that M420 can apply
+  // it again after homing instead of probing the bed
+  //#define BED_LEVEL_EEPROM
+
 
   //If defined, the Probe servo will be turned on only during movement and then turned off to avoid jerk
   //The value is the delay to turn the servo off after powered on - depends on the servo speed; 300ms is good value, but you can try lower it.
@@ -469,6 +529,22 @@ const bool Z_MAX_ENDSTOP_INVERTING = true; // set to true to invert the logic of
 //to disable EEPROM Serial responses and decrease program space by ~1700 byte: comment this out:
 // please keep turned on if you can.
 //#define EEPROM_CHITCHAT
+// Let M500 write the EEPROM from the main loop, one changed byte whenever the EEPROM is ready,
+// instead of waiting for every write. "Settings Stored" is printed once all of it has been written.
+//#define EEPROM_BACKGROUND_STORE
+// M808 keeps the heater targets in EEPROM for the next boot, which sets them right after tp_init()
+// instead of waiting for the host. The record is used once, and not at all after a power-up, brown-out
+// or watchdog reset, so only a restart the host asked for heats up by itself.
+//#define BOOT_PREHEAT
+// Totals over the life of the machine: jobs started, completed and failed, print time, the longest job,
+// filament fed and time switched on. A job is an SD print, or what the host runs between M820 S1 and
+// M820 S2. They are kept in a record of their own below the settings, written at the start and end of
+// each job and every PRINT_STATISTICS_SAVE_MINUTES, to two copies in turn, and only the bytes that
+// changed. M820 reports them.
+//#define PRINT_STATISTICS
+#ifdef PRINT_STATISTICS
+  #define PRINT_STATISTICS_SAVE_MINUTES 60
+#endif
 
 // Preheat Constants
 #define PLA_PREHEAT_HOTEND_TEMP 180
@@ -701,6 +777,13 @@ const bool Z_MAX_ENDSTOP_INVERTING = true; // set to true to invert the logic of
 //#define SERVO_ENDSTOPS {-1, -1, 0} // Servo index for X, Y, Z. Disable with -1
 //#define SERVO_ENDSTOP_ANGLES {0,0, 0,0, 70,0} // X,Y,Z Axis Extend and Retract angles
 
+// Drive servos on the output compare pins of timers 3 and 4 (pins 2, 3, 5, 6, 7 and 8 on a 1280/2560)
+// with hardware PWM instead of the servo interrupt, which then only runs for servos on other pins.
+// Detaching such a servo stops its pulses, so set PROBE_SERVO_DEACTIVATION_DELAY to keep the probe
+// servo quiet between probes. The timer runs at 50Hz, so the other pins of the same timer can no
+// longer be used with analogWrite() or FAST_PWM_FAN.
+//#define SERVO_HARDWARE_PWM
+
 #include "Configuration_adv.h"
 #include "thermistortables.h"
 
@@ -3,27 +3,75 @@
 #include "temperature.h"
 #include "ultralcd.h"
 #include "ConfigurationStore.h"
+#include <util/crc16.h>
 
+static uint16_t eeprom_crc; // CRC of the bytes written or read since it was last cleared
+
+#ifdef EEPROM_BACKGROUND_STORE
+// A background store makes passes over the settings and starts at most one byte write per pass
+static bool eeprom_store_stepping = false;
+static bool eeprom_store_stop;   // this pass started a write, the following bytes are left for the next one
+static int eeprom_store_skip = 0; // bytes below this matched in the last pass and are not compared again
+#endif
+
+// Only bytes that differ are written, each write takes about 3.3 ms and wears the cell
 void _EEPROM_writeData(int &pos, uint8_t* value, uint8_t size)
 {
     do
     {
-        eeprom_write_byte((unsigned char*)pos, *value);
+        eeprom_crc = _crc16_update(eeprom_crc, *value);
+      #ifdef EEPROM_BACKGROUND_STORE
+        if (eeprom_store_stepping && (eeprom_store_stop || pos < eeprom_store_skip))
+            ;
+        else
+      #endif
+        if (eeprom_read_byte((unsigned char*)(uintptr_t)pos) != *value)
+        {
+            eeprom_write_byte((unsigned char*)(uintptr_t)pos, *value);
+          #ifdef EEPROM_BACKGROUND_STORE
+            if (eeprom_store_stepping)
+            {
+                eeprom_store_stop = true;
+                eeprom_store_skip = pos + 1;
+            }
+          #endif
+        }
         pos++;
         value++;
     }while(--size);
 }
-#define EEPROM_WRITE_VAR(pos, value) _EEPROM_writeData(pos, (uint8_t*)&value, sizeof(value))
 void _EEPROM_readData(int &pos, uint8_t* value, uint8_t size)
 {
     do
     {
-        *value = eeprom_read_byte((unsigned char*)pos);
+        *value = eeprom_read_byte((unsigned char*)(uintptr_t)pos);
+        eeprom_crc = _crc16_update(eeprom_crc, *value);
         pos++;
         value++;
     }while(--size);
 }
-#define EEPROM_READ_VAR(pos, value) _EEPROM_readData(pos, (uint8_t*)&value, sizeof(value))
+
+// The settings are kept in sections, each written and read through EEPROM_VAR() by one function
+enum EepromMode { EEPROM_MEASURE, EEPROM_WRITE, EEPROM_READ };
+static EepromMode eeprom_mode;
+static void _EEPROM_data(int &pos, uint8_t* value, uint8_t size)
+{
+    if (eeprom_mode == EEPROM_WRITE)
+        _EEPROM_writeData(pos, value, size);
+    else if (eeprom_mode == EEPROM_READ)
+        _EEPROM_readData(pos, value, size);
+    else
+    {
+        // only the length and the CRC of what would be written
+        pos += size;
+        do
+        {
+            eeprom_crc = _crc16_update(eeprom_crc, *value);
+            value++;
+        }while(--size);
+    }
+}
+#define EEPROM_VAR(pos, value) _EEPROM_data(pos, (uint8_t*)&value, sizeof(value))
 //======================================================================================
 
 
@@ -32,73 +80,341 @@ void _EEPROM_readData(int &pos, uint8_t* value, uint8_t size)
 #define EEPROM_OFFSET 100
 
 
-// IMPORTANT:  Whenever there are changes made to the variables stored in EEPROM
-// in the functions below, also increment the version number. This makes sure that
-// the default values are used whenever there is a change to the data, to prevent
-// wrong data being written to the variables.
-// ALSO:  always make sure the variables in the Store and retrieve sections are in the same order.
+// Layout: EEPROM_VERSION, the number of sections, a table with id, offset, length and CRC of each
+// section, then the sections. A build loads the sections it has whose length and CRC match and
+// takes the defaults for the rest, so an upgrade that only adds or changes some sections keeps the
+// others.
+// IMPORTANT:  Whenever the meaning of the variables of a section changes, give it a new id. Only a
+// change of the layout itself needs a new version number.
+#define EEPROM_VERSION "V20"
+
+#define EEPROM_SECTION_MOTION    1
+#define EEPROM_SECTION_DELTA     2
+#define EEPROM_SECTION_PREHEAT   3
+#define EEPROM_SECTION_PROBE     4
+#define EEPROM_SECTION_PID       5
+#define EEPROM_SECTION_LCD       6
+#define EEPROM_SECTION_BED_LEVEL 7
+
+#ifdef EEPROM_SETTINGS
+static void Config_Motion(int &i)
+{
+  EEPROM_VAR(i,axis_steps_per_unit);
+  EEPROM_VAR(i,max_feedrate);
+  EEPROM_VAR(i,max_acceleration_units_per_sq_second);
+  EEPROM_VAR(i,acceleration);
+  EEPROM_VAR(i,retract_acceleration);
+  EEPROM_VAR(i,minimumfeedrate);
+  EEPROM_VAR(i,mintravelfeedrate);
+  EEPROM_VAR(i,minsegmenttime);
+  EEPROM_VAR(i,max_xy_jerk);
+  EEPROM_VAR(i,max_z_jerk);
+  EEPROM_VAR(i,max_e_jerk);
+  EEPROM_VAR(i,add_homeing);
+}
 #ifdef DELTA
-#define EEPROM_VERSION "V11"
-#else
-#define EEPROM_VERSION "V10"
+static void Config_Delta(int &i)
+{
+  EEPROM_VAR(i,endstop_adj);
+  EEPROM_VAR(i,delta_radius);
+  EEPROM_VAR(i,delta_diagonal_rod);
+  EEPROM_VAR(i,delta_segments_per_second);
+  EEPROM_VAR(i,delta_radius_trim);
+  EEPROM_VAR(i,delta_tower_angle_trim);
+  EEPROM_VAR(i,delta_diagonal_rod_trim);
+}
+#endif
+#ifdef ULTIPANEL
+static void Config_Preheat(int &i)
+{
+  EEPROM_VAR(i,plaPreheatHotendTemp);
+  EEPROM_VAR(i,plaPreheatHPBTemp);
+  EEPROM_VAR(i,plaPreheatFanSpeed);
+  EEPROM_VAR(i,absPreheatHotendTemp);
+  EEPROM_VAR(i,absPreheatHPBTemp);
+  EEPROM_VAR(i,absPreheatFanSpeed);
+}
+#endif
+static void Config_Probe(int &i)
+{
+  EEPROM_VAR(i,zprobe_zoffset);
+}
+#ifdef PIDTEMP
+static void Config_PID(int &i)
+{
+  // the values in EEPROM are already scaled
+  // (with PID_FIXED_POINT the integer gains are rebuilt from them by updatePID())
+  EEPROM_VAR(i,Kp);
+  EEPROM_VAR(i,Ki);
+  EEPROM_VAR(i,Kd);
+}
+#endif
+#ifdef DOGLCD
+static void Config_LCD(int &i)
+{
+  EEPROM_VAR(i,lcd_contrast);
+}
+#endif
+#ifdef BED_LEVEL_EEPROM
+// The last G29 result
+static void Config_BedLevel(int &i)
+{
+  EEPROM_VAR(i,bed_level_stored);
+  EEPROM_VAR(i,bed_level_stored_matrix);
+  #ifdef MESH_BED_LEVELING
+  for (int8_t row = 0; row < AUTO_BED_LEVELING_GRID_POINTS; row++)
+    EEPROM_VAR(i,bed_level_mesh[row]);
+  #endif
+}
 #endif
 
-#ifdef EEPROM_SETTINGS
-void Config_StoreSettings() 
+struct eeprom_section_t
 {
-  char ver[4]= "000";
-  int i=EEPROM_OFFSET;
-  EEPROM_WRITE_VAR(i,ver); // invalidate data first 
-  EEPROM_WRITE_VAR(i,axis_steps_per_unit);  
-  EEPROM_WRITE_VAR(i,max_feedrate);  
-  EEPROM_WRITE_VAR(i,max_acceleration_units_per_sq_second);
-  EEPROM_WRITE_VAR(i,acceleration);
-  EEPROM_WRITE_VAR(i,retract_acceleration);
-  EEPROM_WRITE_VAR(i,minimumfeedrate);
-  EEPROM_WRITE_VAR(i,mintravelfeedrate);
-  EEPROM_WRITE_VAR(i,minsegmenttime);
-  EEPROM_WRITE_VAR(i,max_xy_jerk);
-  EEPROM_WRITE_VAR(i,max_z_jerk);
-  EEPROM_WRITE_VAR(i,max_e_jerk);
-  EEPROM_WRITE_VAR(i,add_homeing);
+  uint8_t id;
+  void (*data)(int &pos);
+};
+static const eeprom_section_t eeprom_sections[] = {
+  { EEPROM_SECTION_MOTION, Config_Motion },
   #ifdef DELTA
-  EEPROM_WRITE_VAR(i,endstop_adj);
-  EEPROM_WRITE_VAR(i,delta_radius);
-  EEPROM_WRITE_VAR(i,delta_diagonal_rod);
-  EEPROM_WRITE_VAR(i,delta_segments_per_second);
+  { EEPROM_SECTION_DELTA, Config_Delta },
   #endif
-  #ifndef ULTIPANEL
-  int plaPreheatHotendTemp = PLA_PREHEAT_HOTEND_TEMP, plaPreheatHPBTemp = PLA_PREHEAT_HPB_TEMP, plaPreheatFanSpeed = PLA_PREHEAT_FAN_SPEED;
-  int absPreheatHotendTemp = ABS_PREHEAT_HOTEND_TEMP, absPreheatHPBTemp = ABS_PREHEAT_HPB_TEMP, absPreheatFanSpeed = ABS_PREHEAT_FAN_SPEED;
+  #ifdef ULTIPANEL
+  { EEPROM_SECTION_PREHEAT, Config_Preheat },
   #endif
-  EEPROM_WRITE_VAR(i,plaPreheatHotendTemp);
-  EEPROM_WRITE_VAR(i,plaPreheatHPBTemp);
-  EEPROM_WRITE_VAR(i,plaPreheatFanSpeed);
-  EEPROM_WRITE_VAR(i,absPreheatHotendTemp);
-  EEPROM_WRITE_VAR(i,absPreheatHPBTemp);
-  EEPROM_WRITE_VAR(i,absPreheatFanSpeed);
-  EEPROM_WRITE_VAR(i,zprobe_zoffset);
+  { EEPROM_SECTION_PROBE, Config_Probe },
   #ifdef PIDTEMP
-    EEPROM_WRITE_VAR(i,Kp);
-    EEPROM_WRITE_VAR(i,Ki);
-    EEPROM_WRITE_VAR(i,Kd);
-  #else
-		float dummy = 3000.0f;
-    EEPROM_WRITE_VAR(i,dummy);
-		dummy = 0.0f;
-    EEPROM_WRITE_VAR(i,dummy);
-    EEPROM_WRITE_VAR(i,dummy);
+  { EEPROM_SECTION_PID, Config_PID },
+  #endif
+  #ifdef DOGLCD
+  { EEPROM_SECTION_LCD, Config_LCD },
   #endif
-  #ifndef DOGLCD
-    int lcd_contrast = 32;
+  #ifdef BED_LEVEL_EEPROM
+  { EEPROM_SECTION_BED_LEVEL, Config_BedLevel },
   #endif
-  EEPROM_WRITE_VAR(i,lcd_contrast);
-  char ver2[4]=EEPROM_VERSION;
-  i=EEPROM_OFFSET;
-  EEPROM_WRITE_VAR(i,ver2); // validate data
+};
+#define EEPROM_SECTION_COUNT (sizeof(eeprom_sections) / sizeof(eeprom_sections[0]))
+#define EEPROM_SECTION_TABLE_MAX 16 // more than any build has, a larger count means the table is garbage
+
+struct eeprom_section_entry_t
+{
+  uint8_t id;
+  uint16_t offset;
+  uint16_t length;
+  uint16_t crc;
+};
+
+static void Config_WriteVersion(const char *version)
+{
+  char ver[4];
+  strncpy(ver, version, sizeof(ver));
+  int i=EEPROM_OFFSET;
+  eeprom_mode = EEPROM_WRITE;
+  EEPROM_VAR(i,ver);
+}
+
+// Everything after the version: the section table, then the sections
+static void Config_WriteSettings()
+{
+  int i=EEPROM_OFFSET+4;
+  uint8_t count = EEPROM_SECTION_COUNT;
+  int data = i + sizeof(count) + count * sizeof(eeprom_section_entry_t);
+  eeprom_mode = EEPROM_WRITE;
+  EEPROM_VAR(i,count);
+  for (uint8_t s = 0; s < count; s++)
+  {
+    eeprom_section_entry_t entry;
+    entry.id = eeprom_sections[s].id;
+    entry.offset = data;
+    eeprom_mode = EEPROM_MEASURE;
+    eeprom_crc = 0;
+    eeprom_sections[s].data(data);
+    entry.length = data - entry.offset;
+    entry.crc = eeprom_crc;
+    eeprom_mode = EEPROM_WRITE;
+    EEPROM_VAR(i,entry);
+  }
+  for (uint8_t s = 0; s < count; s++)
+    eeprom_sections[s].data(i);
+}
+
+#ifdef EEPROM_BACKGROUND_STORE
+enum StoreState { STORE_IDLE, STORE_INVALIDATE, STORE_DATA, STORE_VALIDATE };
+static StoreState store_state = STORE_IDLE;
+
+void Config_StoreSettings()
+{
+  // a store already going on simply picks up the current values
+  if (store_state == STORE_IDLE)
+    store_state = STORE_INVALIDATE;
+  eeprom_store_skip = 0;
+}
+
+// Called from manage_inactivity(). Compares the settings with the EEPROM whenever it is ready
+// for the next byte and starts writing the first one that differs, finishing once a whole pass
+// over the data needs no write.
+void Config_StoreStep()
+{
+  if (store_state == STORE_IDLE || !eeprom_is_ready())
+    return;
+  eeprom_store_stepping = true;
+  eeprom_store_stop = false;
+  switch (store_state)
+  {
+    case STORE_INVALIDATE:
+      Config_WriteVersion("000"); // invalidate data first
+      if (!eeprom_store_stop)
+      {
+        store_state = STORE_DATA;
+        eeprom_store_skip = 0;
+      }
+      break;
+    case STORE_DATA:
+      Config_WriteSettings();
+      if (!eeprom_store_stop)
+      {
+        // the bytes skipped this pass could have changed since, compare all of them once more
+        if (eeprom_store_skip == 0)
+          store_state = STORE_VALIDATE;
+        eeprom_store_skip = 0;
+      }
+      break;
+    default:
+      Config_WriteVersion(EEPROM_VERSION); // validate data
+      if (!eeprom_store_stop)
+      {
+        store_state = STORE_IDLE;
+        eeprom_store_skip = 0;
+        SERIAL_ECHO_START;
+        SERIAL_ECHOLNPGM("Settings Stored");
+      }
+      break;
+  }
+  eeprom_store_stepping = false;
+}
+
+void Config_FinishStore()
+{
+  while (store_state != STORE_IDLE)
+    idle(); // heaters and the rest go on, manage_inactivity() runs Config_StoreStep()
+}
+#else
+void Config_StoreSettings() 
+{
+  Config_WriteVersion("000"); // invalidate data first
+  Config_WriteSettings();
+  Config_WriteVersion(EEPROM_VERSION); // validate data
   SERIAL_ECHO_START;
   SERIAL_ECHOLNPGM("Settings Stored");
 }
+#endif //EEPROM_BACKGROUND_STORE
+
+#ifdef BOOT_PREHEAT
+// The targets for the next boot are a record of their own below the settings, so arming it
+// is a few byte writes that leave the settings and a background M500 alone.
+typedef struct {
+  uint8_t armed;
+  int hotend[EXTRUDERS];
+  int bed;
+} boot_preheat_t;
+#define EEPROM_BOOT_PREHEAT_OFFSET (EEPROM_OFFSET - sizeof(boot_preheat_t) - sizeof(uint16_t))
+
+void Config_StoreBootPreheat(const int *hotend, int bed)
+{
+  boot_preheat_t preheat;
+  preheat.armed = hotend != NULL;
+  for (int8_t e = 0; e < EXTRUDERS; e++)
+    preheat.hotend[e] = hotend ? hotend[e] : 0;
+  preheat.bed = hotend ? bed : 0;
+  int i=EEPROM_BOOT_PREHEAT_OFFSET;
+  eeprom_mode = EEPROM_WRITE;
+  eeprom_crc = 0;
+  EEPROM_VAR(i,preheat);
+  uint16_t crc = eeprom_crc;
+  EEPROM_VAR(i,crc);
+}
+
+void Config_BootPreheat(uint8_t mcusr)
+{
+  boot_preheat_t preheat;
+  uint16_t crc;
+  int i=EEPROM_BOOT_PREHEAT_OFFSET;
+  eeprom_mode = EEPROM_READ;
+  eeprom_crc = 0;
+  EEPROM_VAR(i,preheat);
+  uint16_t data_crc = eeprom_crc;
+  EEPROM_VAR(i,crc);
+  if (crc != data_crc || !preheat.armed)
+    return;
+  Config_StoreBootPreheat(NULL, 0); // once only, also when this boot fails
+  if (mcusr & (1 | 4 | 8)) // power-up, brown-out or watchdog: the firmware hung or the power failed
+    return;
+  for (int8_t e = 0; e < EXTRUDERS; e++)
+    setTargetHotend(preheat.hotend[e], e);
+  setTargetBed(preheat.bed);
+  setWatch();
+  SERIAL_ECHO_START;
+  SERIAL_ECHOLNPGM("Boot preheat started");
+}
+#endif //BOOT_PREHEAT
+
+#ifdef PRINT_STATISTICS
+// Two copies of the totals below the boot preheat record, each with a sequence number and a CRC.
+// A store goes to the older copy, so each one is written half as often and a store cut short by a
+// reset still leaves the other.
+typedef struct {
+  uint8_t sequence;
+  print_stats_t stats;
+} print_stats_record_t;
+#define EEPROM_PRINT_STATS_SLOT (sizeof(print_stats_record_t) + sizeof(uint16_t))
+#define EEPROM_PRINT_STATS_OFFSET (EEPROM_OFFSET - 80) // 2 * 27 bytes, clear of the boot preheat record
+static uint8_t print_stats_sequence = 0; // of the newest copy
+static uint8_t print_stats_slot = 1;     // the newest copy
+
+static bool Config_ReadPrintStats(uint8_t slot, print_stats_record_t &record)
+{
+  uint16_t crc;
+  int i=EEPROM_PRINT_STATS_OFFSET + slot * EEPROM_PRINT_STATS_SLOT;
+  eeprom_mode = EEPROM_READ;
+  eeprom_crc = 0;
+  EEPROM_VAR(i,record);
+  uint16_t data_crc = eeprom_crc;
+  EEPROM_VAR(i,crc);
+  return crc == data_crc;
+}
+
+void Config_StorePrintStats(const print_stats_t &stats)
+{
+  print_stats_record_t record;
+  record.sequence = ++print_stats_sequence;
+  record.stats = stats;
+  print_stats_slot ^= 1;
+  int i=EEPROM_PRINT_STATS_OFFSET + print_stats_slot * EEPROM_PRINT_STATS_SLOT;
+  eeprom_mode = EEPROM_WRITE;
+  eeprom_crc = 0;
+  EEPROM_VAR(i,record);
+  uint16_t crc = eeprom_crc;
+  EEPROM_VAR(i,crc);
+}
+
+void Config_RetrievePrintStats(print_stats_t &stats)
+{
+  print_stats_record_t record[2];
+  bool valid[2];
+  for (uint8_t slot = 0; slot < 2; slot++)
+    valid[slot] = Config_ReadPrintStats(slot, record[slot]);
+  if (valid[0] && valid[1])
+    print_stats_slot = (int8_t)(record[1].sequence - record[0].sequence) > 0;
+  else if (valid[0] || valid[1])
+    print_stats_slot = valid[1];
+  else
+  {
+    memset(&stats, 0, sizeof(stats));
+    return;
+  }
+  print_stats_sequence = record[print_stats_slot].sequence;
+  stats = record[print_stats_slot].stats;
+}
+#endif //PRINT_STATISTICS
 #endif //EEPROM_SETTINGS
 
 
@@ -171,6 +487,19 @@ void Config_PrintSettings()
 	SERIAL_ECHOPAIR(" R" ,delta_radius );
 	SERIAL_ECHOPAIR(" S" ,delta_segments_per_second );
 	SERIAL_ECHOLN("");
+	SERIAL_ECHO_START;
+	SERIAL_ECHOLNPGM("Delta tower trims: A B C=diagonal rod, I J K=angle, U V W=radius");
+	SERIAL_ECHO_START;
+	SERIAL_ECHOPAIR("  M665 A" ,delta_diagonal_rod_trim[0] );
+	SERIAL_ECHOPAIR(" B" ,delta_diagonal_rod_trim[1] );
+	SERIAL_ECHOPAIR(" C" ,delta_diagonal_rod_trim[2] );
+	SERIAL_ECHOPAIR(" I" ,delta_tower_angle_trim[0] );
+	SERIAL_ECHOPAIR(" J" ,delta_tower_angle_trim[1] );
+	SERIAL_ECHOPAIR(" K" ,delta_tower_angle_trim[2] );
+	SERIAL_ECHOPAIR(" U" ,delta_radius_trim[0] );
+	SERIAL_ECHOPAIR(" V" ,delta_radius_trim[1] );
+	SERIAL_ECHOPAIR(" W" ,delta_radius_trim[2] );
+	SERIAL_ECHOLN("");
 #endif
 #ifdef PIDTEMP
     SERIAL_ECHO_START;
@@ -188,63 +517,74 @@ void Config_PrintSettings()
 #ifdef EEPROM_SETTINGS
 void Config_RetrieveSettings()
 {
+    Config_FinishStore();
     int i=EEPROM_OFFSET;
     char stored_ver[4];
     char ver[4]=EEPROM_VERSION;
-    EEPROM_READ_VAR(i,stored_ver); //read stored version
+    eeprom_mode = EEPROM_READ;
+    EEPROM_VAR(i,stored_ver); //read stored version
     //  SERIAL_ECHOLN("Version: [" << ver << "] Stored version: [" << stored_ver << "]");
+    #ifdef BED_LEVEL_EEPROM
+    bed_level_stored = false;
+    #endif
+    uint8_t count = 0;
     if (strncmp(ver,stored_ver,3) == 0)
+        EEPROM_VAR(i,count);
+    if (count > 0 && count <= EEPROM_SECTION_TABLE_MAX)
     {
-        // version number match
-        EEPROM_READ_VAR(i,axis_steps_per_unit);  
-        EEPROM_READ_VAR(i,max_feedrate);  
-        EEPROM_READ_VAR(i,max_acceleration_units_per_sq_second);
-        
+        // version number match, look up the sections of this build and check their length and CRC
+        eeprom_section_entry_t found[EEPROM_SECTION_COUNT];
+        uint8_t valid = 0;
+        for (uint8_t t = 0; t < count; t++)
+        {
+            eeprom_section_entry_t entry;
+            eeprom_mode = EEPROM_READ;
+            EEPROM_VAR(i,entry);
+            for (uint8_t s = 0; s < EEPROM_SECTION_COUNT; s++)
+            {
+                if (eeprom_sections[s].id != entry.id)
+                    continue;
+                int length = 0;
+                eeprom_mode = EEPROM_MEASURE;
+                eeprom_sections[s].data(length);
+                uint16_t crc = 0;
+                for (uint16_t n = 0; n < entry.length; n++)
+                    crc = _crc16_update(crc, eeprom_read_byte((unsigned char*)(uintptr_t)(entry.offset + n)));
+                if (length == entry.length && crc == entry.crc)
+                {
+                    found[s] = entry;
+                    valid |= 1 << s;
+                }
+            }
+        }
+        if (valid != (1 << EEPROM_SECTION_COUNT) - 1)
+        {
+            SERIAL_ECHO_START;
+            SERIAL_ECHOLNPGM("Stored settings incomplete or damaged");
+            Config_ResetDefault();
+        }
+        eeprom_mode = EEPROM_READ;
+        for (uint8_t s = 0; s < EEPROM_SECTION_COUNT; s++)
+        {
+            if (!(valid & (1 << s)))
+                continue;
+            int pos = found[s].offset;
+            eeprom_sections[s].data(pos);
+        }
+
         // steps per sq second need to be updated to agree with the units per sq second (as they are what is used in the planner)
-		reset_acceleration_rates();
-        
-        EEPROM_READ_VAR(i,acceleration);
-        EEPROM_READ_VAR(i,retract_acceleration);
-        EEPROM_READ_VAR(i,minimumfeedrate);
-        EEPROM_READ_VAR(i,mintravelfeedrate);
-        EEPROM_READ_VAR(i,minsegmenttime);
-        EEPROM_READ_VAR(i,max_xy_jerk);
-        EEPROM_READ_VAR(i,max_z_jerk);
-        EEPROM_READ_VAR(i,max_e_jerk);
-        EEPROM_READ_VAR(i,add_homeing);
+        reset_acceleration_rates();
+        reset_extrusion_factors();
         #ifdef DELTA
-		EEPROM_READ_VAR(i,endstop_adj);
-		EEPROM_READ_VAR(i,delta_radius);
-		EEPROM_READ_VAR(i,delta_diagonal_rod);
-		EEPROM_READ_VAR(i,delta_segments_per_second);
+        recalc_delta_settings(delta_radius, delta_diagonal_rod);
         #endif
-        #ifndef ULTIPANEL
-        int plaPreheatHotendTemp, plaPreheatHPBTemp, plaPreheatFanSpeed;
-        int absPreheatHotendTemp, absPreheatHPBTemp, absPreheatFanSpeed;
-        #endif
-        EEPROM_READ_VAR(i,plaPreheatHotendTemp);
-        EEPROM_READ_VAR(i,plaPreheatHPBTemp);
-        EEPROM_READ_VAR(i,plaPreheatFanSpeed);
-        EEPROM_READ_VAR(i,absPreheatHotendTemp);
-        EEPROM_READ_VAR(i,absPreheatHPBTemp);
-        EEPROM_READ_VAR(i,absPreheatFanSpeed);
-        EEPROM_READ_VAR(i,zprobe_zoffset);
-        #ifndef PIDTEMP
-        float Kp,Ki,Kd;
-        #endif
-        // do not need to scale PID values as the values in EEPROM are already scaled		
-        EEPROM_READ_VAR(i,Kp);
-        EEPROM_READ_VAR(i,Ki);
-        EEPROM_READ_VAR(i,Kd);
-        #ifndef DOGLCD
-        int lcd_contrast;
-        #endif
-        EEPROM_READ_VAR(i,lcd_contrast);
-
 		// Call updatePID (similar to when we have processed M301)
 		updatePID();
-        SERIAL_ECHO_START;
-        SERIAL_ECHOLNPGM("Stored settings retrieved");
+        if (valid)
+        {
+            SERIAL_ECHO_START;
+            SERIAL_ECHOLNPGM("Stored settings retrieved");
+        }
     }
     else
     {
@@ -270,6 +610,7 @@ void Config_ResetDefault()
     
     // steps per sq second need to be updated to agree with the units per sq second
     reset_acceleration_rates();
+    reset_extrusion_factors();
     
     acceleration=DEFAULT_ACCELERATION;
     retract_acceleration=DEFAULT_RETRACT_ACCELERATION;
@@ -285,6 +626,8 @@ void Config_ResetDefault()
 	delta_radius= DELTA_RADIUS;
 	delta_diagonal_rod= DELTA_DIAGONAL_ROD;
 	delta_segments_per_second= DELTA_SEGMENTS_PER_SECOND;
+	for (short i=0;i<3;i++)
+	  delta_radius_trim[i] = delta_tower_angle_trim[i] = delta_diagonal_rod_trim[i] = 0;
 	recalc_delta_settings(delta_radius, delta_diagonal_rod);
 #endif
 #ifdef ULTIPANEL
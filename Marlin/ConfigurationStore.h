@@ -14,6 +14,29 @@ FORCE_INLINE void Config_PrintSettings() {}
 #ifdef EEPROM_SETTINGS
 void Config_StoreSettings();
 void Config_RetrieveSettings();
+  #ifdef BOOT_PREHEAT
+  void Config_StoreBootPreheat(const int *hotend, int bed); // M808: targets for the next boot, NULL for none
+  void Config_BootPreheat(uint8_t mcusr);   // sets the stored targets once, call after tp_init()
+  #endif
+  #ifdef PRINT_STATISTICS
+  typedef struct {
+    unsigned long jobs_started;
+    unsigned long jobs_completed;   // the others failed, or are running now
+    unsigned long print_seconds;    // from the start to the end of each job, pauses included
+    unsigned long longest_seconds;
+    unsigned long on_seconds;
+    float filament_mm;              // net of retractions
+  } print_stats_t;
+  void Config_StorePrintStats(const print_stats_t &stats);
+  void Config_RetrievePrintStats(print_stats_t &stats); // all zero without a valid record
+  #endif
+  #ifdef EEPROM_BACKGROUND_STORE
+  void Config_StoreStep();   // writes the next changed byte of a pending M500, call from the main loop
+  void Config_FinishStore(); // waits until a pending M500 is done
+  #else
+  FORCE_INLINE void Config_StoreStep() {}
+  FORCE_INLINE void Config_FinishStore() {}
+  #endif
 #else
 FORCE_INLINE void Config_StoreSettings() {}
 FORCE_INLINE void Config_RetrieveSettings() { Config_ResetDefault(); Config_PrintSettings(); }
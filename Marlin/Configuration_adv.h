@@ -10,6 +10,24 @@
 #endif
 #define BED_CHECK_INTERVAL 5000 //ms between checks in bang-bang control
 
+// With PIDTEMPBED, run the bed PID every BED_PID_INTERVAL ms instead of on every temperature
+// reading. The bed responds in minutes, so a slower loop costs no control quality. The bed
+// Ki and Kd are scaled to this interval, so retune (M303 E-1) after changing it.
+//#define BED_PID_INTERVAL 1000
+#ifdef BED_PID_INTERVAL
+  #define BED_PID_dT (BED_PID_INTERVAL / 1000.0)
+#else
+  #define BED_PID_dT PID_dT
+#endif
+
+// Switch the bed with a slow time-proportioning cycle from manage_heater() instead of the
+// soft PWM interrupt: on for the duty share of every BED_SLOW_PWM_PERIOD ms, so an SSR or
+// relay switches at most twice per period.
+//#define BED_SLOW_PWM
+#ifdef BED_SLOW_PWM
+  #define BED_SLOW_PWM_PERIOD 2000 // ms
+#endif
+
 //// Heating sanity check:
 // This waits for the watch period in milliseconds whenever an M104 or M109 increases the target temperature
 // If the temperature has not increased at the end of that period, the target temperature is set to zero.
@@ -18,15 +36,116 @@
 //#define WATCH_TEMP_PERIOD 40000 //40 seconds
 //#define WATCH_TEMP_INCREASE 10  //Heat up at least 10 degree in 20 seconds
 
+// Thermal runaway protection: switch everything off and stop if a heater does not respond.
+// While heating towards a new target the temperature must rise THERMAL_RUNAWAY_INCREASE degrees
+// in every THERMAL_RUNAWAY_PERIOD seconds; once within THERMAL_RUNAWAY_HYSTERESIS of the target
+// it must not stay below that band for longer than THERMAL_RUNAWAY_PERIOD seconds.
+//#define THERMAL_RUNAWAY_PROTECTION
+#ifdef THERMAL_RUNAWAY_PROTECTION
+  #define THERMAL_RUNAWAY_PERIOD 40         // seconds
+  #define THERMAL_RUNAWAY_INCREASE 2        // degC
+  #define THERMAL_RUNAWAY_HYSTERESIS 4      // degC
+  #define THERMAL_RUNAWAY_BED_PERIOD 120    // seconds, the bed heats much slower
+  #define THERMAL_RUNAWAY_BED_HYSTERESIS 2  // degC
+#endif
+
 #ifdef PIDTEMP
   // this adds an experimental additional term to the heating power, proportional to the extrusion speed.
   // if Kc is chosen well, the additional required power due to increased melting should be compensated.
   #define PID_ADD_EXTRUSION_RATE
   #ifdef PID_ADD_EXTRUSION_RATE
     #define  DEFAULT_Kc (1) //heating power=Kc*(e_speed)
+
+    // Apply Kc ahead of time: the hotend gets Kc * the filament rate (mm/s) averaged over the
+    // moves planned for the next PID_FEEDFORWARD_MS, so it is already heating harder when a fast
+    // segment starts instead of waiting for the temperature to sag. Set this to about the time
+    // the hotend takes to respond; it can be changed with M301 L<ms>.
+    //#define PID_EXTRUSION_FEEDFORWARD
+    #define PID_FEEDFORWARD_MS 2000
+  #endif
+
+  // Run the hotend PID loop in 32 bit fixed point instead of software floats. Kp, Ki and Kd
+  // keep their meaning (M301, EEPROM and the LCD still use the float values); updatePID()
+  // converts them. Temperatures and terms are in 1/256 degree/PWM steps. Kp and Kd are
+  // stored in 1/256, Ki in 1/65536 steps.
+  //#define PID_FIXED_POINT
+
+  // Heat a hotend up at full power until the rise it still makes after the power is cut (its
+  // heating rate times PID_BOOST_LAG) would take it to the target, closer than PID_FUNCTIONAL_RANGE
+  // when it heats slowly and earlier when it heats fast. The PID then starts with its integral at
+  // the output that holds the target instead of at 0. That output is learned per hotend while it
+  // holds a temperature, starting from PID_BOOST_HOLD.
+  //#define PID_BOOST_HEATUP
+  #ifdef PID_BOOST_HEATUP
+    #define PID_BOOST_LAG 3     // s the temperature keeps rising after the heater is switched off
+    #define PID_BOOST_HOLD 0.4  // PID output (0-255) per degree above 25C that holds a temperature
   #endif
 #endif
 
+// Let M303 stop a heater as soon as Ku and Tu of two cycles in a row agree within this many percent, C is then
+// the most cycles run. M303 A S<temp> B<bed temp> tunes all hotends and the bed at once, mind the power supply.
+// Either way the result is the mean of the last 3 cycles with their spread, a large spread means retune.
+//#define PID_AUTOTUNE_CONVERGENCE 5
+
+// Sample the temperature sensors from the ADC conversion complete interrupt instead of the
+// timer0 state machine. Conversions are started by timer0 overflow (about 1kHz, twice the old
+// rate) and follow a schedule in which each sensor takes ADC_SLOTS_* conversions per round, so
+// hotends can be sampled more often than the bed. Each reading averages ADC_OVERSAMPLE_* samples
+// (a power of 2, at most 64) and is scaled to OVERSAMPLENR samples, so the thermistor tables and
+// PID_dT stay as they are; the PID simply gets the newest complete reading.
+//#define ADC_FREE_RUNNING
+#ifdef ADC_FREE_RUNNING
+  #define ADC_SLOTS_HOTEND 3
+  #define ADC_SLOTS_BED 1
+  #define ADC_OVERSAMPLE_HOTEND 32
+  #define ADC_OVERSAMPLE_BED 16
+#endif
+
+// The timer0 temperature interrupt writes the soft PWM edges, then masks itself and runs the sensor
+// sampling, the temperature checks and the button polling with the other interrupts enabled, so a
+// step is never held up by more than the PWM part. TEMP_ISR_SLOW_DIVIDER runs that slow part on only
+// every Nth interrupt; PID_dT follows, and an encoder without pin change interrupts is read less often.
+//#define TEMP_ISR_SPLIT
+#ifdef TEMP_ISR_SPLIT
+  #define TEMP_ISR_SLOW_DIVIDER 1   // 1 keeps the old sampling rate
+  #undef PID_dT
+  #define PID_dT ((OVERSAMPLENR * 8.0 * TEMP_ISR_SLOW_DIVIDER)/(F_CPU / 64.0 / 256.0))
+#endif
+
+// Let M109 and M190 return at once and wait in the background instead. The bed and hotends heat
+// in parallel and other commands, homing and probing included, keep running; any command that
+// extrudes (G0-G3 with E, G10/G11) stays queued until every pending wait is met.
+//#define NONBLOCKING_HEATUP
+
+// M155 S<seconds> makes the firmware print the M105 temperature line on its own every S
+// seconds, so hosts can stop polling with M105 and free the command buffer for moves.
+//#define AUTO_REPORT_TEMPERATURES
+
+// Compose the temperatures and powers of the M105 line (and the M155 report) with integer formatting,
+// at most once per temperature reading, and send the same text again to hosts that poll faster than
+// that. Saves the float printing of every field on each M105, for about 20 bytes of RAM per heater.
+//#define TEMP_REPORT_CACHE
+
+// M700 S<hotend> B<bed> [T<extruder>] [P]: start heating, home (and with P probe the bed
+// with G29) while the heaters ramp, then wait for the targets as M190 and M109 would. Nothing
+// extrudes during homing or probing, and plan_buffer_line() still refuses cold extrusion.
+//#define HEAT_AND_HOME
+
+// Drive the soft PWM outputs (heaters, and the fan with FAN_SOFT_PWM) with one write per port
+// and tick, using bitmasks worked out at compile time, instead of one WRITE() per pin.
+//#define SOFT_PWM_PORTS
+#ifdef SOFT_PWM_PORTS
+  // Carry the part of each duty cycle that SOFT_PWM_SCALE drops over to the following
+  // periods, so the average output keeps the full 128 step resolution.
+  //#define SOFT_PWM_DITHER
+
+  // Stagger the heaters in each soft PWM period instead of switching them all on at its start: the
+  // hotends come first and the bed after them. Whenever the heaters that are on would draw more than
+  // this many watts together (EXTRUDER_WATTS, BED_WATTS), their on-times are kept from overlapping and
+  // what does not fit in the period is cut, from the bed first, so the hotends keep their power.
+  //#define HEATER_POWER_BUDGET 240
+#endif
+
 
 //automatic temperature: The hot end target temperature is calculated by all the buffered lines of gcode.
 //The maximum buffered steps/sec of the extruder motor are called "se".
@@ -40,6 +159,26 @@
   #define AUTOTEMP_OLDWEIGHT 0.98
 #endif
 
+// Plan printing moves slower while their hotend is more than TEMP_FEEDRATE_LIMIT_BAND degrees below its
+// target: TEMP_FEEDRATE_LIMIT_GAIN less speed per degree beyond that, down to TEMP_FEEDRATE_LIMIT_MIN.
+// The moves planned once the hotend has caught up run at full speed again. Travel and retracts are
+// not slowed.
+//#define TEMP_FEEDRATE_LIMIT
+#ifdef TEMP_FEEDRATE_LIMIT
+  #define TEMP_FEEDRATE_LIMIT_BAND 3   // degC below the target that is still printed at full speed
+  #define TEMP_FEEDRATE_LIMIT_GAIN 0.1 // speed factor taken off per degC beyond the band
+  #define TEMP_FEEDRATE_LIMIT_MIN 0.3  // slowest speed factor
+#endif
+
+// Slow down moves that would push more plastic through a hotend than VOLUMETRIC_FLOW_MAX mm^3 per second.
+// The filament area comes from M200 D, or from VOLUMETRIC_FLOW_FILAMENT_DIA without it. Change the limit
+// of an extruder with M200 L<mm^3/s> T<extruder>; L0 turns it off.
+//#define VOLUMETRIC_FLOW_LIMIT
+#ifdef VOLUMETRIC_FLOW_LIMIT
+  #define VOLUMETRIC_FLOW_MAX 15.0          // mm^3/s, for every extruder
+  #define VOLUMETRIC_FLOW_FILAMENT_DIA 1.75 // mm
+#endif
+
 //Show Temperature ADC value
 //The M105 command return, besides traditional information, the ADC value read from temperature sensors.
 //#define SHOW_TEMP_ADC_VALUES
@@ -58,6 +197,17 @@
 #define TEMP_SENSOR_AD595_OFFSET 0.0
 #define TEMP_SENSOR_AD595_GAIN   1.0
 
+// Sensor type 1000: a thermistor given by its resistance at 25C and beta, or by its Steinhart-Hart coefficients
+// when THERMISTOR_CUSTOM_SH_A is defined. The compiler works out its table, a temperature every
+// THERMISTOR_CUSTOM_ADC_STEP ADC counts, which is looked up by index instead of searched.
+#define THERMISTOR_CUSTOM_R25 100000.0   // ohm
+#define THERMISTOR_CUSTOM_BETA 4092.0
+//#define THERMISTOR_CUSTOM_SH_A 0.000722378300319346
+//#define THERMISTOR_CUSTOM_SH_B 0.000216301852054578
+//#define THERMISTOR_CUSTOM_SH_C 0.000000092641025635702
+#define THERMISTOR_CUSTOM_PULLUP 4700.0  // ohm
+#define THERMISTOR_CUSTOM_ADC_STEP 16    // 8, 16 or 32: 129, 65 or 33 table entries
+
 //This is for controlling a fan to cool down the stepper drivers
 //it will turn on when any driver is enabled
 //and turn off after the set amount of seconds from last driver being disabled again
@@ -70,6 +220,36 @@
 // before setting a PWM value. (Does not work with software PWM for fan on Sanguinololu)
 //#define FAN_KICKSTART_TIME 100
 
+// Set the fan to the speed of each move as the stepper interrupt starts it, instead of when the main loop
+// next looks at the queue, so M106/M107 between moves switch exactly at the move boundary. While no move
+// is queued the main loop still sets the fan, FAN_KICKSTART_TIME only works then.
+//#define FAN_SYNC_WITH_MOVES
+
+// Hold M42 pin changes and M117 messages sent between moves until the moves queued before them are done,
+// instead of applying them as soon as they are read, far ahead of the print. Nothing waits for the planner
+// to drain, up to STATE_SYNC_WITH_MOVES changes can be pending. A message replaces one still pending.
+//#define STATE_SYNC_WITH_MOVES 4
+
+// Drive a laser or spindle from LASER_PIN, which must be a hardware PWM pin. M3 S<0-255> sets the power of
+// the moves that follow and M5 turns it off. The stepper interrupt switches to the power of each move as
+// it starts it and turns the output off when the queue runs dry. With LASER_POWER_FOLLOWS_SPEED the power
+// is scaled by the step rate over the nominal rate along the trapezoid, so the burn per mm stays the same
+// while accelerating and decelerating. Costs 1 byte of RAM per block, 5 following the speed.
+//#define LASER_PWM
+#ifdef LASER_PWM
+  #define LASER_PIN 44
+  #define LASER_POWER_FOLLOWS_SPEED
+
+  // G7 X Y F D<hex> engraves a row of pixels in one move: D carries two lower case hex digits per pixel,
+  // 00-ff of the M3 power, spread evenly along the move. The stepper interrupt changes the power as it
+  // reaches each pixel, so one line carries what took a G1 S line per pixel. The pixels of the queued
+  // moves wait in a ring of LASER_RASTER_BUFFER bytes, a power of 2 up to 128. Costs 6 bytes per block.
+  //#define LASER_RASTER
+  #ifdef LASER_RASTER
+    #define LASER_RASTER_BUFFER 128
+  #endif
+#endif
+
 // Extruder cooling fans
 // Configure fan pin outputs to automatically turn on/off when the associated
 // extruder temperature is above/below EXTRUDER_AUTO_FAN_TEMPERATURE.
@@ -88,6 +268,29 @@
 
 #define ENDSTOPS_ONLY_FOR_HOMING // If defined the endstops will only be used for homing
 
+// Latch endstop changes with pin change or external interrupts, so the stepper interrupt only reads the
+// endstop pins after one changed, when a block starts and while a pin reads as hit. Endstops on pins with
+// neither interrupt (on a Mega a pin change interrupt on 10-13, 50-53, A8-A15, an external one on 2, 3
+// and 18-21) are still read on every step.
+//#define ENDSTOP_INTERRUPTS
+
+// Quadrature encoders on the X, Y and Z motors, counted by pin change interrupts (on a Mega pins
+// 10-13, 50-53 and A8-A15). While an axis is homed the main loop compares the encoder with the steps
+// the motor was given, and a difference over AXIS_ENCODER_MAX_ERROR mm is reported as skipped steps
+// and the axis is no longer counted as homed. M821 reports the counts and differences.
+//#define AXIS_ENCODERS
+#ifdef AXIS_ENCODERS
+  #define X_ENCODER_A_PIN -1 // -1 for a motor without an encoder
+  #define X_ENCODER_B_PIN -1
+  #define Y_ENCODER_A_PIN -1
+  #define Y_ENCODER_B_PIN -1
+  #define Z_ENCODER_A_PIN -1
+  #define Z_ENCODER_B_PIN -1
+  #define AXIS_ENCODER_STEPS_PER_COUNT {4, 4, 4} // motor steps per count, negative if it counts the other way
+  #define AXIS_ENCODER_MAX_ERROR 0.5 // mm, more than the lag of a motor under load
+  //#define AXIS_ENCODER_PAUSE // pause the SD print as well
+#endif
+
 
 //// AUTOSET LOCATIONS OF LIMIT SWITCHES
 //// Added by ZetaPhoenix 09-15-2012
@@ -137,6 +340,11 @@
 
 
 //#define Z_LATE_ENABLE // Enable Z the last moment. Needed if your Z driver overheats.
+#ifdef Z_LATE_ENABLE
+  // Z is enabled once a block moving it is this many blocks from the stepper, so the stepper only
+  // waits 1 ms for the driver when the planner could not enable it ahead
+  #define Z_LATE_ENABLE_BLOCKS 3
+#endif
 
 // A single Z stepper driver is usually used to drive 2 stepper motors.
 // Uncomment this define to utilize a separate stepper driver for each Z axis motor.
@@ -148,6 +356,23 @@
 #ifdef Z_DUAL_STEPPER_DRIVERS
   #undef EXTRUDERS
   #define EXTRUDERS 1
+
+  // G34 levels the gantry: it probes next to each Z screw and raises the low side alone by the
+  // difference, until both read within Z_DUAL_ALIGN_ACCURACY or after Z_DUAL_ALIGN_ITERATIONS rounds.
+  // The points are probe positions, as close to the screws as the probe reaches; the difference is
+  // scaled from them out to the screws. Needs ENABLE_AUTO_BED_LEVELING for the probe. Home Z and
+  // probe the bed with G29 again afterwards.
+  //#define Z_DUAL_AUTO_ALIGN
+  #ifdef Z_DUAL_AUTO_ALIGN
+    #define Z_DUAL_ALIGN_X1 20.0        // probe point next to the Z screw
+    #define Z_DUAL_ALIGN_Y1 100.0
+    #define Z_DUAL_ALIGN_X2 180.0       // next to the Z2 screw
+    #define Z_DUAL_ALIGN_Y2 100.0
+    #define Z_DUAL_ALIGN_SCREW_X1 0.0   // X of the Z screw
+    #define Z_DUAL_ALIGN_SCREW_X2 200.0 // X of the Z2 screw
+    #define Z_DUAL_ALIGN_ITERATIONS 3
+    #define Z_DUAL_ALIGN_ACCURACY 0.02  // mm
+  #endif
 #endif
 
 // Same again but for Y Axis.
@@ -196,6 +421,8 @@
 //    Mode 2: Duplication mode. The firmware will transparently make the second x-carriage and extruder copy all
 //                           actions of the first x-carriage. This allows the printer to print 2 arbitrary items at
 //                           once. (2nd extruder x offset and temp offset are set using: M605 S2 [Xnnn] [Rmmm])
+//    Mode 3: Mirrored mode. As duplication mode, but the second x-carriage moves the other way and prints a mirror
+//                           image of the first item. (M605 S3 [Xnnn] [Rmmm], Xnnn is the spacing at the X home position)
 
 // This is the default power-up mode which can be later using M605.
 #define DEFAULT_DUAL_X_CARRIAGE_MODE 0
@@ -212,12 +439,34 @@
 
 #endif //DUAL_X_CARRIAGE
 
+// Change tools (T<n>) without waiting for the queued moves: the extruder offset shifts the planned position and
+// the stepper counts instead of setting them once the queue ran dry, the moves after it (and the parking moves of
+// DUAL_X_CARRIAGE auto-park mode) are queued behind the ones before with the new tool in their blocks.
+//#define PLANNED_TOOLCHANGE
+
+// Put the hotend of a tool that is changed away from on standby: its target drops to the temperature set with
+// M104 T<extruder> R<temp> and comes back when the tool is picked again. It is already heating back as soon as
+// the T<n> is read into the command buffer, while the moves before it print. An M104/M109 S for the tool wins.
+//#define TOOL_STANDBY
+#if defined(TOOL_STANDBY) && EXTRUDERS < 2
+  #error "TOOL_STANDBY needs EXTRUDERS > 1"
+#endif
+
 //homing hits the endstop, then retracts by this distance, before it tries to slowly bump again:
 #define X_HOME_RETRACT_MM 5
 #define Y_HOME_RETRACT_MM 5
 #define Z_HOME_RETRACT_MM 1
+//and the slow bump runs at the homing feedrate divided by this:
+#define X_HOME_BUMP_DIVISOR 2
+#define Y_HOME_BUMP_DIVISOR 2
+#define Z_HOME_BUMP_DIVISOR 2
 //#define QUICK_HOME  //if this is defined, if both x and y are to be homed, a diagonal move will be performed initially.
 
+// Home X and Y at once when both are to be homed. They move together at their homing feedrates and each
+// stops on its own endstop: the first hit ends the move, the other axis goes on alone. The retract and
+// the slow bump are done for both together too. Not for COREXY, DUAL_X_CARRIAGE or with QUICK_HOME.
+//#define HOME_XY_TOGETHER
+
 #define AXIS_RELATIVE_MODES {false, false, false, false}
 
 #define MAX_STEP_FREQUENCY 40000 // Max step frequency for Ultimaker (5000 pps / half step)
@@ -244,10 +493,11 @@
     #define ULTIPANEL_FEEDMULTIPLY
 #endif
 
-// minimum time in microseconds that a movement needs to take if the buffer is emptied.
+// Longest time in microseconds SLOWDOWN stretches a movement to when the buffer is emptied.
 #define DEFAULT_MINSEGMENTTIME        20000
 
-// If defined the movements slow down when the look ahead buffer is only half full
+// If defined the movements slow down when the look ahead buffer is under half full and new moves are
+// arriving more slowly than the planned ones finish, so the buffer would otherwise run empty
 #define SLOWDOWN
 
 // Frequency limit
@@ -260,6 +510,36 @@
 // if unwanted behavior is observed on a user's machine when running at very slow speeds.
 #define MINIMUM_PLANNER_SPEED 0.05// (mm/sec)
 
+// Limit the speed at the junction of two moves by the centripetal acceleration around a circle that
+// stays within JUNCTION_DEVIATION_MM of the corner, instead of by the XY, Z and E jerk limits.
+// The jerk checks are then left out. Moves of E alone start and end at MINIMUM_PLANNER_SPEED.
+//#define JUNCTION_DEVIATION
+#ifdef JUNCTION_DEVIATION
+  #define JUNCTION_DEVIATION_MM 0.02 // (mm)
+#endif
+
+// Remember up to which block the junction speeds are final, so the lookahead passes only revisit
+// the blocks that can still change instead of the whole buffer on every new move.
+//#define PLANNER_INCREMENTAL_RECALC
+
+// Compute the acceleration and deceleration distances of each trapezoid with exact integer math
+// instead of float divides. Motion only differs by rounding. Falls back to float for step rates above 46340.
+//#define TRAPEZOID_INTEGER_MATH
+
+// S-curve acceleration: the speed follows a 5th order Bezier curve (6 control points) through each
+// acceleration and deceleration instead of a straight line, so the acceleration itself ramps up from
+// and back down to zero. The ramps keep the duration and distance of the trapezoid, which puts the
+// peak acceleration at 1.875 times the configured one. Adds a few multiplies to every stepper
+// interrupt that changes speed.
+//#define S_CURVE_ACCELERATION
+
+// Apply a lower feedrate override (M220, the display) to the blocks already planned, the running one
+// included: the stepper stretches them in time, which scales every speed and shrinks the accelerations,
+// and eases into the new speed at the acceleration of the block. A higher override than a block was
+// planned with only applies to the blocks planned after the change. Adds a compare to every stepper
+// interrupt, and a few multiplies while a block runs slowed down.
+//#define REALTIME_FEEDRATE_OVERRIDE
+
 // MS1 MS2 Stepper Driver Microstepping mode table
 #define MICROSTEP1 LOW,LOW
 #define MICROSTEP2 HIGH,LOW
@@ -270,6 +550,17 @@
 // Microstep setting (Only functional when stepper driver microstep pins are connected to MCU.
 #define MICROSTEP_MODES {16,16,16,16,16} // [1,2,4,8,16]
 
+// Run long and fast travel moves (X and Y only) at TRAVEL_MICROSTEP_FACTOR times coarser X and Y microsteps,
+// switched through the MS pins, so they fit under the step rate of the board. The move is split where both
+// drivers are at a step of the coarse mode, the few steps before and after run at the MICROSTEP_MODES
+// resolution. The microstep a driver is at is counted from power up, so the drivers must not be reset
+// apart from the board. The coarse mode (e.g. 16 / 4 = 1/4) has to be one the drivers have.
+//#define TRAVEL_MICROSTEP_FACTOR 4
+#ifdef TRAVEL_MICROSTEP_FACTOR
+  #define TRAVEL_MICROSTEP_MIN_LENGTH 20   // mm
+  #define TRAVEL_MICROSTEP_MIN_RATE 10000  // steps/s the fastest axis would need at the normal microsteps
+#endif
+
 // Motor Current setting (Only functional when motor driver current ref pins are connected to a digital trimpot on supported boards)
 #define DIGIPOT_MOTOR_CURRENT {135,135,135,135,135} // Values 0-255 (RAMBO 135 = ~0.75A, 185 = ~1A)
 
@@ -280,6 +571,31 @@
 // actual motor currents in Amps, need as many here as DIGIPOT_I2C_NUM_CHANNELS
 #define DIGIPOT_I2C_MOTOR_CURRENTS {1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0}
 
+// Lower the current of a digipot (SPI, I2C or PWM) driven motor to IDLE_CURRENT_PERCENT of its M907 setting once its
+// axis had no queued moves for IDLE_CURRENT_DELAY seconds. The full current is back when a move for it is queued,
+// IDLE_CURRENT_LEAD_MS before it starts when no other move is ahead of it. Holding torque drops with the current.
+//#define IDLE_CURRENT_PERCENT 50
+#ifdef IDLE_CURRENT_PERCENT
+  #define IDLE_CURRENT_DELAY 5     // seconds
+  #define IDLE_CURRENT_LEAD_MS 5
+#endif
+
+// Send the I2C writes of DIGIPOT_I2C and BLINKM from the TWI interrupt through a small queue instead of
+// waiting in the Wire library until the bus is done. Not usable together with an I2C LCD, whose
+// driver library needs Wire and with it the TWI interrupt.
+//#define TWI_QUEUE
+#ifdef TWI_QUEUE
+  #define TWI_QUEUE_SIZE 8        // transfers that can wait, must be at least 2
+  #define TWI_QUEUE_MAX_BYTES 5   // longest transfer (BlinkM colour)
+  #define TWI_QUEUE_FREQ 100000L  // bus clock in Hz
+#endif
+
+// Share the hardware SPI bus between the SD card (and an SPI digipot) and a MAX6675 thermocouple. The
+// temperature interrupt only queues the MAX6675 read, which runs from the SPI interrupt while the SD
+// card does not hold the bus, so it never lands in the middle of an SD transfer and nothing waits on
+// the bus in the temperature interrupt. The temperature read is one MAX6675 interval (250ms) behind.
+//#define SPI_BUS_ARBITER
+
 //===========================================================================
 //=============================Additional Features===========================
 //===========================================================================
@@ -290,11 +606,195 @@
 #define SD_FINISHED_STEPPERRELEASE true  //if sd support and the file is finished: disable steppers?
 #define SD_FINISHED_RELEASECOMMAND "M84 X Y Z E" // You might want to keep the z enabled so your bed stays in place.
 
+// Keep a multiple block read (CMD18) open while printing from SD and fill a second 512 byte
+// buffer with the next block while the current one is parsed, so block boundaries no longer
+// stall the command queue. Costs 1kB of RAM.
+//#define SD_STREAMING_READ
+
+// Check the CRC of every block read from the SD card and send one with every block written,
+// so wiring that corrupts data at full speed no longer goes unnoticed. A corrupted block is
+// read again, and after SD_CRC_SLOWDOWN of them in a row the SPI clock is halved until the
+// card is initialized again (M21). M809 reports the errors and the clock divider.
+//#define SD_CHECK_CRC
+#ifdef SD_CHECK_CRC
+  #define SD_CRC_RETRIES 3  // times a corrupted block is read again before the read fails
+  #define SD_CRC_SLOWDOWN 2 // corrupted blocks in a row that halve the SPI clock
+#endif
+
+// Time every single block read, block of a streamed read, wait for the card to be ready and miss of
+// the FAT/directory block cache, and count them in histograms of power of 2 steps from 128us to 0.5s.
+// M817 prints the longest time and the counts of each, M817 S0 clears them. Shows whether pauses of
+// an SD print come from the card being busy or from FAT lookups. Takes 128 bytes of RAM.
+//#define SD_LATENCY_HISTOGRAM
+
+// M819 <file> reads the file to its end through the same open and line reading code as a print and
+// reports KB/s, lines/s and the slowest line read. M819 W<KB> writes that much to a scratch file and
+// reports KB/s and the slowest write; both can be given, "M819 W256 test.g". Run it on a new card to
+// find slow ones before they stutter in a print. The heaters are kept up while it runs.
+//#define SD_BENCHMARK
+
+// Number of contiguous cluster runs of the printed file remembered when it is opened, so
+// reading it never has to look up the FAT (and evict the data block from the cache).
+// 8 bytes of RAM each. A defragmented file needs only one.
+//#define SD_CLUSTER_RUN_CACHE 8
+
+// Remember where the first this many entries of the current directory are, so the LCD
+// SD menu can fetch a file name without rescanning the directory. 3 bytes of RAM each.
+//#define SD_DIR_INDEX 64
+
+// Keep the names of this many files the LCD SD menu showed last, so redrawing and scrolling
+// it reads only the line that came into view. About 42 bytes of RAM each, LCD_HEIGHT is enough.
+//#define SD_NAME_CACHE 4
+
+// Read the print time (;TIME:), filament (;Filament used:) and area (;MINX: ;MAXX: ;MINY: ;MAXY:)
+// from the comments at the start of a file when it is selected, as Cura writes them. M27 reports
+// them and the LCD status line shows them until the print starts. Only the first
+// SD_FILE_HEADER_BYTES are read, and the values of this many files are kept, so selecting a file
+// again reads nothing. 33 bytes of RAM each.
+//#define SD_FILE_HEADER 4
+#if defined(AUTO_BED_LEVELING_ADAPTIVE) && !defined(SD_FILE_HEADER)
+  #define SD_FILE_HEADER 1 // for the print area
+#endif
+#ifdef SD_FILE_HEADER
+  #define SD_FILE_HEADER_BYTES 1024
+#endif
+
+// Keep this many files called as subroutines with M32 P open, so calling one again (a wipe routine
+// every layer) starts at once instead of walking the directories for it. About 36 bytes of RAM each.
+// The calling file is kept open during the call in any case and is not looked up again either.
+//#define SD_SUBCALL_CACHE 4
+
+// Sort the files of a directory for M20 and the LCD SD menu, by name or newest first.
+// Sorting works on the SD_DIR_INDEX, a directory with more files is listed unsorted.
+//#define SDCARD_SORT_ALPHA
+//#define SDCARD_SORT_NEWEST_FIRST
+
+// List this many files per pass of the main loop for M20 instead of the whole card at once, so moves,
+// heaters and the serial input keep going while a host lists a large card. The "ok" of M20 comes after
+// "End file list" as without it, the commands after M20 wait for the listing. Lists unsorted.
+//#define SD_LIST_CHUNK 4
+
+// Print files starting with the "MBJ1" header are binary jobs prepared on the host: moves are
+// fixed-point records that bypass the G-code parser, everything else is stored as text lines.
+//#define SD_BINARY_JOB
+
+// Collect M28/M928 uploads in a 512 byte buffer and write whole blocks with multiple block
+// writes, into runs of this many clusters that are reserved and pre-erased at once.
+// M28 S<bytes> <filename> allocates the whole file in one piece and writes it as one run.
+// Costs 512 bytes of RAM.
+//#define SD_WRITE_BEHIND 16
+
+// Write M28/M928 files through a second file handle, so a host can upload the next job while
+// the current one prints from SD. Lines read from the card keep being printed, only the host's
+// lines go to the new file. Reading and writing alternate through the card's one block cache.
+//#define SD_BACKGROUND_UPLOAD
+
+// Track the bytes and moves per second of an SD print over a sliding window of samples and
+// report the remaining time with M27 and on the status screen.
+//#define SD_PRINT_ETA
+#ifdef SD_PRINT_ETA
+  #define SD_ETA_SAMPLES 8         // samples in the window
+  #define SD_ETA_SAMPLE_MS 2000    // time between samples
+#endif
+
+// Keep a journal of the SD print in POWER_LOSS_FILE, two blocks in the root directory that are allocated
+// once and then only overwritten in place, so a checkpoint is a single block write that never touches the
+// FAT. Every POWER_LOSS_INTERVAL the file position, position, temperatures, fan and feedrate after the
+// last command are kept until the stepper has run the moves of that command, and written once the planner
+// queue is at least half full, so the main loop never stalls on the card with the queue running dry.
+// M807 reports the journal, M807 S1 heats up, lifts Z, homes X and Y and continues the print, M807 S0
+// discards it. Z must not have moved while the power was off. With ENABLE_AUTO_BED_LEVELING the rest of
+// the print runs without the leveling: it is not in the journal and homing X and Y resets it.
+// Costs 55 bytes of RAM plus 4 per BUFSIZE.
+//#define POWER_LOSS_RECOVERY
+#ifdef POWER_LOSS_RECOVERY
+  #define POWER_LOSS_FILE "recover.bin"
+  #define POWER_LOSS_INTERVAL 10000 // ms between checkpoints
+  #define POWER_LOSS_ZLIFT 2        // mm Z is lifted while X and Y home
+#endif
+
+// Log a 32 byte binary record (telemetry_t in cardreader.h: time, temperatures, heater power, position,
+// feedrate override, queue depths, fan) every SD_TELEMETRY_INTERVAL to SD_TELEMETRY_FILE, a ring of blocks
+// in the root directory that is allocated in one contiguous piece once and then only overwritten, so
+// logging never touches the FAT. Records collect in a 512 byte buffer, written as the next block of a
+// pre-erased multiple block write once it is full and the planner queue is at least half full. The log
+// starts with the card and goes on after the newest record in the file. M810 reports it, S0 stops it,
+// S1 starts it again and P<ms> sets the interval. Costs 530 bytes of RAM.
+//#define SD_TELEMETRY
+#ifdef SD_TELEMETRY
+  #define SD_TELEMETRY_FILE "telemetry.bin"
+  #define SD_TELEMETRY_BLOCKS 8192   // 4MB, 16 records per block: 36 hours at one record a second
+  #define SD_TELEMETRY_INTERVAL 1000 // ms between records
+#endif
+
+// Print the jobs listed in SD_JOB_QUEUE_FILE in the root directory one after the other, one path a
+// line. The line of a finished job is marked done by overwriting its first character with ';', so after
+// a reset the queue goes on with the next job; a job cut off by the reset is printed again from its
+// start. SD_JOB_QUEUE_BETWEEN, if it is on the card, is printed after each job to eject the part or
+// clear the bed and wait for it to cool (M190 R40). M813 starts the queue, at once or after the print
+// that runs, and M813 S0 stops it after the job that is printing.
+//#define SD_JOB_QUEUE
+#ifdef SD_JOB_QUEUE
+  #define SD_JOB_QUEUE_FILE "queue.txt"
+  #define SD_JOB_QUEUE_BETWEEN "between.g"
+#endif
+
+// Remember in every block the file position of the SD command that planned it, so M27 reports the
+// command the stepper is running rather than how far the file has been read, which is BUFSIZE commands
+// and the whole block buffer ahead. Costs 4 bytes of RAM per block and per BUFSIZE.
+//#define SD_EXECUTED_POSITION
+
+// Boot without waiting: the splash screen stays up for its second while the main loop already
+// answers the host and runs the heaters, and the SD card is started from setup() and brought up
+// by the main loop one command per pass instead of in one go, which takes two seconds without a
+// card. Autostart files are looked for once the card is ready; without a card M21 tries again.
+//#define FAST_BOOT
+
 #define SDCARD_RATHERRECENTFIRST  //reverse file order of sd card menu display. Its sorted practically after the file system block order.
 // if a file is deleted, it frees a block. hence, the order is not purely chronological. To still have auto0.g accessible, there is again the option to do that.
 // using:
 //#define MENU_ADDAUTOSTART
 
+// With DOGLCD, only redraw the status screen (at most once a second) when something it shows has
+// changed, instead of every second. The fan animation then only turns along with other changes.
+//#define DOGLCD_STATUS_DIRTY_CHECK
+
+// Take what the status screen shows (temperatures, fan, feedrate, position, SD progress, print time) into
+// a snapshot once a second, noting which of them changed, and draw the status screen of either kind of
+// LCD from the snapshot, only when something in it changed. A DOGLCD draws the screen page by page and no
+// longer reads the heaters and the SD card for every page. M105 and M27 still answer with the live values.
+//#define STATUS_SNAPSHOT
+
+// Spread an LCD redraw over several main loop passes (with DOGLCD one u8glib page per pass) and put
+// off the next slice while the planner holds fewer than LCD_SLICE_MIN_PLANNED moves, so the loop gets
+// back to feeding it first. A redraw is never put off more than LCD_SLICE_MAX_DEFER ms.
+//#define LCD_SLICED_UPDATE
+#ifdef LCD_SLICED_UPDATE
+  #define LCD_SLICE_MIN_PLANNED 4
+  #define LCD_SLICE_MAX_DEFER 500
+#endif
+
+// Decode the encoder of a NEWPANEL from its pin change interrupts instead of polling it in the temperature
+// interrupt, which then only reads the encoder pins that have none (on a 2560 ports A and C have none).
+// The click button and the keypad or panel shift registers are read in the main loop every
+// LCD_BUTTONS_READ_MS, so a shift register encoder counts only as fast as that.
+//#define ENCODER_INTERRUPTS
+#ifdef ENCODER_INTERRUPTS
+  #define LCD_BUTTONS_READ_MS 2
+#endif
+
+// Keep a copy of what is on a character LCD and after each redraw only send the characters that
+// changed. Worth it for I2C displays (e.g. LCD_I2C_PANELOLU2, LCD_I2C_VIKI), where every character
+// costs several blocking I2C transfers. Uses about LCD_HEIGHT*(LCD_WIDTH+4) bytes of RAM.
+//#define LCD_SHADOW_BUFFER
+
+// RepRapDiscount Full Graphic Smart Controller (U8GLIB_ST7920). ST7920_HARDWARE_SPI clocks the display from the
+// SPI unit of a 1280/2560 instead of bit-banging it: its E (clock) line goes to SCK (52) and R/W (data) to
+// MOSI (51), shared with the SD card, RS (chip select) stays on LCD_PINS_RS. ST7920_FRAME_BUFFER keeps a 1KB
+// copy of the display and only sends the pixel rows that changed since the last frame.
+//#define ST7920_HARDWARE_SPI
+//#define ST7920_FRAME_BUFFER
+
 // The hardware watchdog should reset the microcontroller disabling all outputs, in case the firmware gets stuck and doesn't do temperature regulation.
 //#define USE_WATCHDOG
 
@@ -316,10 +816,7 @@
   #define BABYSTEP_XY  //not only z, but also XY in the menu. more clutter, more functions
   #define BABYSTEP_INVERT_Z false  //true for inverse movements in Z
   #define BABYSTEP_Z_MULTIPLICATOR 2 //faster z movements
-
-  #ifdef COREXY
-    #error BABYSTEPPING not implemented for COREXY yet.
-  #endif
+  #define BABYSTEP_RATE 1000 //babysteps per second and axis, taken by the stepper interrupt between the steps of the moves
 
   #ifdef DELTA
     #ifdef BABYSTEP_XY
@@ -328,6 +825,148 @@
   #endif
 #endif
 
+// Measure how long the stepper interrupt takes (min/avg/max), how often it runs with 2 or 4 steps
+// per interrupt and how often it misses its next deadline. M800 reports the figures, M800 S0 clears them.
+// Adds a few microseconds to every stepper interrupt.
+//#define STEPPER_ISR_PROFILE
+
+// Build the fast step rate to timer table in RAM at startup, computed for the actual F_CPU and
+// kept in 1/16 timer ticks, instead of reading the PROGMEM table. calc_timer() then reads plain
+// RAM and the interpolated timer values are rounded instead of truncated. Costs 992 bytes of RAM.
+//#define SPEED_TABLE_RAM
+
+// Raise and lower the STEP pins of all axes that step on the same tick with one write per port,
+// using bitmasks worked out at compile time, instead of one WRITE() per pin and edge.
+//#define STEPPER_PORT_WRITES
+
+// Trace blocks of up to 32767 step events (most printing moves) with 16 bit Bresenham counters instead
+// of 32 bit ones, chosen when the block is loaded. Costs a second copy of the step loop in flash.
+//#define BRESENHAM_16BIT
+
+// Give blocks that move only E, only Z, or only X and Y a step loop of their own, chosen when the block
+// is loaded, which leaves out the axes that do not move and the error term of an axis moving alone.
+// Costs three more copies of the step loop in flash (six with BRESENHAM_16BIT).
+//#define AXIS_STEP_LOOPS
+
+// Blocks slow enough for it run the stepper interrupt up to 2^STEP_SMOOTHING_MAX times per step of
+// the leading axis, so the Bresenham tracer spreads the steps of the other axes more evenly in time.
+// Fast blocks still use the double and quad step loops. Not available with ADVANCE.
+//#define STEP_SMOOTHING
+#ifdef STEP_SMOOTHING
+  #define STEP_SMOOTHING_MAX 3      // at most 8 interrupts per step
+  #define STEP_SMOOTHING_RATE 10000 // highest interrupt rate smoothing may use; calc_timer() goes to double steps above it
+#endif
+
+// Slice the blocks in the main loop into segments with their timer value and number of step events
+// worked out ahead, so the stepper interrupt only plays them back instead of working out the speed on
+// every step. The speed changes once per segment while accelerating, the cruise is one segment. When
+// the main loop falls behind the interrupt prepares the next segment itself. Not available with
+// ADVANCE, LIN_ADVANCE, STEP_SMOOTHING, REALTIME_FEEDRATE_OVERRIDE, DRY_PLANNING or LASER_POWER_FOLLOWS_SPEED.
+//#define STEP_SEGMENTS
+#ifdef STEP_SEGMENTS
+  #define STEP_SEGMENT_US 1000    // length of the segments while the speed changes
+  #define STEP_SEGMENT_BUFFER 16  // segments prepared ahead, a power of 2
+#endif
+
+// Input shaping: the stepper interrupt splits every X and Y step into two impulses (three with
+// INPUT_SHAPING_ZVD) half a period of the ringing apart, which cancel the ringing the moves excite, so
+// the accelerations can go up. Set the frequency and damping ratio of each axis with M593, measured
+// from the ringing of a test print. Homing is not shaped. Costs 3 bytes of RAM per entry and axis.
+// Not available with DELTA, DUAL_X_CARRIAGE, STEPPER_PORT_WRITES or TRAVEL_MICROSTEP_FACTOR.
+//#define INPUT_SHAPING
+#ifdef INPUT_SHAPING
+  //#define INPUT_SHAPING_ZVD       // less sensitive to a wrong frequency, but twice the delay
+  #define INPUT_SHAPING_FREQ_X 40.0 // Hz, 0 for no shaping; at least 4 Hz (8 Hz with ZVD)
+  #define INPUT_SHAPING_FREQ_Y 40.0
+  #define INPUT_SHAPING_ZETA_X 0.1  // damping ratio
+  #define INPUT_SHAPING_ZETA_Y 0.1
+  #define INPUT_SHAPING_BUFFER 128  // stepper interrupts with steps an axis keeps for its echoes, a power of 2;
+                                    // M593 counts the overflows, make it larger when they go up
+#endif
+
+// Add up how long the stepper takes for every planned block, from its trapezoid, and for every block it
+// has finished. M805 reports the move time planned, executed and still queued, M805 S0 starts again
+// from the queued moves. Costs 4 bytes of RAM per block.
+//#define PRINT_TIME_ESTIMATE
+
+// M806 S1 turns on dry planning: the stepper interrupt retires each block as soon as it can take it, without
+// stepping, while the planner works as usual. Heater commands, dwells and the cold extrusion check are
+// skipped. Printing a file from SD this way gives its duration on any controller: the move time is
+// reported when the file ends and by M806. M806 S0 turns it off. Needs PRINT_TIME_ESTIMATE.
+//#define DRY_PLANNING
+
+// M818 S<lines> measures how fast the firmware takes in moves: the next <lines> commands from the host
+// are read, parsed and planned as usual but run dry as with M806 S1, then the lines and planner blocks
+// per second are reported and the position is set back to where it was. The host sends a burst of G1
+// lines right after the "ok" of M818; the time runs from that "ok" to the last line. Needs DRY_PLANNING.
+//#define THROUGHPUT_BENCHMARK
+
+// Measure the time spent in plan_buffer_line() and in each planner pass, and keep a histogram of the
+// number of queued blocks each time a move is added. M801 reports the figures, M801 S0 clears them.
+//#define PLANNER_PROFILE
+
+// Keep reading commands from the host into the command buffer while a command waits (st_synchronize(),
+// G4, M109, M190 and the other waits that call idle()). They are run once the waiting command is done,
+// so the host can keep the buffer full instead of timing out on a full serial buffer during G28 or M400.
+//#define BUFFER_COMMANDS_WHILE_WAITING
+
+// Send "echo:busy: processing" every HOST_KEEPALIVE_INTERVAL seconds while a command waits, so the host
+// knows the printer is alive and does not time out a long G28, G29, M109 or M400. M109 and M190 send
+// "busy: heating" instead, M0/M1 "busy: paused for user".
+//#define HOST_KEEPALIVE_INTERVAL 2
+
+// Run the background work of loop() and of the blocking waits (heaters, inactivity, endstop reports, LCD)
+// from one task table in Marlin_main.cpp, in priority order and each at its own interval, and measure the
+// time every task takes. M803 reports the figures, M803 S0 clears them.
+//#define MAIN_LOOP_TASKS
+
+// Measure the longest time between two passes of loop() and between two calls of manage_heater(), and which
+// part of the firmware took most of it: reading commands, the SD card, the command being run or one of the
+// background tasks. A gap between manage_heater() calls longer than LOOP_STALL_MS is reported at once as
+// "echo:Stall <ms>ms in <name>", long before the watchdog would notice. M811 reports the figures, M811 S0
+// clears them.
+//#define LOOP_LATENCY_MONITOR
+#ifdef LOOP_LATENCY_MONITOR
+  #define LOOP_STALL_MS 250
+#endif
+
+// Fill the free RAM between the heap and the stack with a pattern at boot. M812 then reports the deepest
+// the stack has been since, how much RAM it never touched, the heap and the size of the big buffers
+// (planner blocks, command buffer, serial rings, SD block cache), to see how far BLOCK_BUFFER_SIZE,
+// BUFSIZE or the G29 grid can grow on a board.
+//#define MEMORY_REPORT
+
+// Keep the last EVENT_TRACE_SIZE events of the pipeline in a ring, each with its micros() time: blocks
+// planned, replanned, started and finished by the stepper, the stepper running dry, SD block reads, lines
+// queued from the host and from SD and LCD redraws, with the time the slow ones took (see event_trace.h).
+// M822 dumps the ring in binary, M822 S0 clears it and M822 F clears it and freezes it a quarter ring after
+// the stepper next runs dry, so the trace of a stutter is still there to read. 7 bytes of RAM per event.
+//#define EVENT_TRACE
+#ifdef EVENT_TRACE
+  #define EVENT_TRACE_SIZE 32
+#endif
+
+// M804 times calc_timer(), analog2temp(), calculate_delta() (DELTA), code_value(), plan_buffer_line()
+// and mc_arc() call by call and prints min/avg/max of each in CPU cycles. It waits for the moves in the
+// buffer to finish; the moves it plans are dropped, not run. "make bench" runs the same on the host.
+//#define MATH_BENCHMARK
+
+// Keep the last THERMAL_HISTORY_SIZE samples of temperature, target and power of every heater,
+// one every THERMAL_HISTORY_MS. M802 prints min/max/mean per heater, M802 B dumps the samples in
+// binary and M802 S<ms> sets a new interval, clearing the history. Each sample takes 5 bytes of
+// RAM per heater (the bed counts as one).
+//#define THERMAL_HISTORY
+#ifdef THERMAL_HISTORY
+  #define THERMAL_HISTORY_SIZE 32
+  #define THERMAL_HISTORY_MS 1000
+#endif
+
+// Sum the power of every heater in the soft PWM interrupt, once per PWM period. M814 prints the mean
+// power and the share of time spent at full power of each heater since the job started, plus the
+// energy in Wh of the heaters with EXTRUDER_WATTS/BED_WATTS set; M814 S0 starts a new job. An SD
+// print starts one and prints the report when it finishes. Takes 8 bytes of RAM per heater.
+//#define HEATER_DUTY_STATS
+
 // extruder advance constant (s2/mm3)
 //
 // advance (steps) = STEPS_PER_CUBIC_MM_E * EXTUDER_ADVANCE_K * cubic mm per second ^ 2
@@ -347,10 +986,38 @@
 
 #endif // ADVANCE
 
+// Linear advance: run the extruder ahead by K seconds of its current feed, which builds the nozzle
+// pressure up while accelerating and lets it off while decelerating. The extra E steps are worked
+// out at each speed update of the stepper interrupt and sent from it, so unlike ADVANCE no timer 0
+// interrupt is used. M900 K<k> sets the factor at run time. Cannot be combined with ADVANCE.
+//#define LIN_ADVANCE
+
+#ifdef LIN_ADVANCE
+  #define LIN_ADVANCE_K 0.0 // s, 0 is off
+#endif
+
 // Arc interpretation settings:
 #define MM_PER_ARC_SEGMENT 1
 #define N_ARC_CORRECTION 25
 
+// Size arc segments from the radius instead of MM_PER_ARC_SEGMENT: each segment is as long as it can be
+// while its middle stays within ARC_CHORD_TOLERANCE of the arc, and long enough that no more than
+// ARC_SEGMENTS_PER_SECOND are needed at the feed rate, within MIN_/MAX_MM_PER_ARC_SEGMENT.
+//#define ARC_CHORD_TOLERANCE 0.01 // mm
+#ifdef ARC_CHORD_TOLERANCE
+  #define MIN_MM_PER_ARC_SEGMENT 0.1
+  #define MAX_MM_PER_ARC_SEGMENT 5
+  #define ARC_SEGMENTS_PER_SECOND 100
+#endif
+
+// G5 cubic Bezier moves, split into segments that get shorter where the curve bends more
+//#define BEZIER_CURVE_SUPPORT
+#ifdef BEZIER_CURVE_SUPPORT
+  #define BEZIER_TOLERANCE 0.05 // mm the middle of a segment may lie off the curve
+  #define BEZIER_MIN_STEP 0.002 // curve parameter steps, so 10 to 500 segments per curve
+  #define BEZIER_MAX_STEP 0.1
+#endif
+
 const unsigned int dropsegments=5; //everything with less than this number of steps will be ignored as move and joined with the next movement
 
 // If you are using a RAMPS board or cheap E-bay purchased boards that do not detect when an SD card is inserted
@@ -394,11 +1061,152 @@ const unsigned int dropsegments=5; //everything with less than this number of st
   #define BLOCK_BUFFER_SIZE 16 // maximize block buffer
 #endif
 
+// Shrink block_t by 4 bytes (10 with BARICUDA), so a larger BLOCK_BUFFER_SIZE fits the same SRAM:
+// the fan speed and the BARICUDA pressures are kept in a byte each and the two planner flags share one.
+//#define COMPACT_BLOCKS
+
+// Merge runs of short, nearly collinear moves with the same feed rate and extrusion per mm into one
+// planner block before queueing them. Each move is held back until the next one shows whether it
+// continues the line, but never while fewer than SEGMENT_MERGE_MIN_QUEUED blocks are planned.
+//#define SEGMENT_MERGE
+#ifdef SEGMENT_MERGE
+  #define SEGMENT_MERGE_DEVIATION 0.005 // mm the dropped corner may lie off the merged line
+  #define SEGMENT_MERGE_E_RATIO 0.05    // relative difference allowed in extrusion per mm
+  #define SEGMENT_MERGE_MAX 8           // moves merged into one block at most
+  #define SEGMENT_MERGE_MIN_QUEUED 3
+#endif
+
+// When a move is queued while the stepper is idle, hold the stepper until PLANNER_PRIMING_BLOCKS moves
+// are queued, PLANNER_PRIMING_MS have passed or the moves are waited for, so the first moves after a
+// pause are planned with some lookahead instead of each stopping at its end.
+//#define PLANNER_PRIMING
+#ifdef PLANNER_PRIMING
+  #define PLANNER_PRIMING_BLOCKS 4
+  #define PLANNER_PRIMING_MS 50
+#endif
+
+// Find the steps of a move from its distance to the last target in mm, carrying the fraction of a step
+// it was rounded by to the next move, instead of rounding the absolute position in mm times the steps
+// per mm, which is coarser than a step once that passes 2^24 (20 m of filament at 836 steps/mm).
+// With relative E (M83 or G91) the E position is also kept under 1 mm by moving its origin, so adding
+// up the extrusions does not lose precision on a long print: M114 shows only the fraction of a mm.
+//#define STEP_SPACE_POSITION
+
+// G4 queues a block without steps that the stepper takes its time over, instead of waiting for the
+// moves to finish and then for the time: the commands after it are read and planned meanwhile, and
+// the moves after a cooling pause start with the queue full. The moves stop at the dwell as before.
+// G4 without a time, or with P0 or S0, still waits for the moves to finish.
+//#define QUEUED_DWELL
+
+// Count, for moves from the host and from SD apart, the underruns: the stepper ran out of moves while
+// commands were queued or an SD print went on, and stood still until the next move came. Also count the moves queued too late for the move before them,
+// which the stepper had already started with a stop at its end; the second move after an idle stepper
+// is one of them unless PLANNER_PRIMING holds the first. Waiting for the moves on purpose, as
+// M400, G4 or homing do, is not counted. M815 reports them, M815 S0 clears them. The LCD status line
+// shows "Underrun <underruns>/<late moves>" whenever one is counted.
+//#define PLANNER_STARVATION_STATS
+
+// With ENABLE_AUTO_BED_LEVELING, apply a bed plane that rises less than this many mm per mm of X and Y as
+// a Z shear (z += a*x + b*y) instead of a full rotation of every move. X and Y then stay as given,
+// which at 0.01 differs from the rotation by under 10 um over 200 mm.
+//#define BED_LEVEL_SHEAR_MAX_TILT 0.01
+
 
 //The ASCII buffer for receiving from the serial:
 #define MAX_CMD_SIZE 96
 #define BUFSIZE 4
 
+// Pack the queued commands one after the other in a ring of COMMAND_RING bytes instead of giving each of
+// the BUFSIZE commands MAX_CMD_SIZE bytes. A G1 line takes 20-30 bytes, so the 384 bytes of four slots hold
+// 12-16 commands, and BUFSIZE is raised to 16 for that. A command is only taken in while MAX_CMD_SIZE bytes
+// are free in one piece. Options that keep RAM per BUFSIZE entry (TOKENIZED_COMMANDS) cost four times as much.
+//#define COMMAND_RING 384
+#ifdef COMMAND_RING
+  #undef BUFSIZE
+  #define BUFSIZE 16
+#endif
+
+// Size of the serial receive ring buffer in bytes (default 128). Use a power of 2.
+// Boards with more RAM (1284p, 2560) can raise this together with BUFSIZE to let the host queue further ahead.
+//#define RX_BUFFER_SIZE 256
+
+// On boards with native USB (AT90USB) built with an Arduino core that has USBCore.cpp, like the ones in
+// ArduinoAddons, read the host's bulk packets into a USB_CDC_BULK byte buffer (128 or 256) with one
+// USB_Recv() per packet and send output a line or 64 byte packet at a time, instead of the core's
+// per byte Serial. Not with Teensyduino, whose USB serial is not built on USBCore.
+//#define USB_CDC_BULK 256
+
+// Append the free planner blocks and command buffer slots to every "ok" (ok P<blocks> B<commands>)
+// so the host can keep both queues full instead of waiting for each acknowledgement.
+//#define ADVANCED_OK
+
+// Keep the line numbers and hashes of the last RESEND_HISTORY_SIZE lines taken in. After a checksum or
+// line number error the receive buffer is not flushed: the lines the host already sent after the bad one
+// are dropped quietly until the line asked for arrives, instead of each of them asking for another resend.
+// A line that comes again after it was taken in is acknowledged without being run a second time.
+//#define RESEND_HISTORY_SIZE 8
+
+// Count the bytes received, the bytes dropped because the receive buffer was full and the most bytes
+// ever waiting in it, and the lines taken in, the checksum and line number errors and the resends asked
+// for. M816 reports them with the bytes and lines per second since M816 S0 cleared them. The byte counts
+// are kept by the UART receive interrupt, not with native USB (AT90USB).
+//#define SERIAL_STATS
+
+// Binary G-code transport. Hosts that see "Cap:BINARY_GCODE:1" in the M115 report may send
+// framed binary commands (sync byte, letter, number, line number, parameter mask, floats, CRC16)
+// mixed with normal ASCII lines. Frames skip the text parser and are decoded in place in the command buffer.
+// Commands with string arguments (M23, M28, M117, ...) must still be sent as ASCII.
+//#define BINARY_GCODE
+#ifdef BINARY_GCODE
+  #define BINARY_GCODE_SYNC 0xA5 // first byte of a frame, never valid in an ASCII line
+#endif
+
+// Acknowledge the commands that reply nothing but "ok" and only set a value or queue moves (G10/G11,
+// G90-G92, M17, M42, M82/M83, M104, M106/M107, M117, M140, M201, M203-M209, M220/M221, the table is in
+// Marlin_main.cpp) as they come in, like G0-G3, so a fan or temperature change between short moves
+// doesn't stop the host until the moves before it have left the planner.
+//#define ACK_ON_RECEIPT
+
+// Keep host lines that the command buffer has no slot for in a COMMAND_LOOKAHEAD byte text buffer
+// (without line number and checksum). Those acknowledged as they come in (ACK_ON_RECEIPT, which this
+// sets) go there, so the host streams on past a full command buffer. Not with BINARY_GCODE.
+//#define COMMAND_LOOKAHEAD 256
+#ifdef COMMAND_LOOKAHEAD
+  #define ACK_ON_RECEIPT
+#endif
+#if defined(COMMAND_LOOKAHEAD) && defined(BINARY_GCODE)
+  #error "COMMAND_LOOKAHEAD can't hold BINARY_GCODE frames"
+#endif
+
+// Parse the parameters of each command once when it is queued instead of scanning the line
+// for every code_seen()/code_value() call. Costs about 134 bytes of RAM per BUFSIZE entry.
+//#define TOKENIZED_COMMANDS
+
+// Read parameter values, line numbers and checksums with a small decimal parser (blanks, sign,
+// digits, fraction) instead of the general strtod()/strtol(). Exponents, hex, "inf" and "nan" are not read.
+//#define FAST_NUMBER_PARSER
+
+// Store lines from the host and the SD card without line number, checksum and blanks, with the command
+// letter in upper case and no leading zeros ("N12 g01 X 10.5 Y05*33" is queued as "G1X10.5Y5"), so each
+// code_seen() scans less and COMMAND_RING holds more. Commands that take a string (M23, M28, M30, M32,
+// M117, M928) and lines written to a file by M28 are stored as they came. Needs FAST_NUMBER_PARSER,
+// strtod() would read "Y5E1" as 50.
+//#define COMPACT_COMMANDS
+
+// Act on a few lines as soon as the serial receive interrupt has them, however many commands and
+// moves are queued ahead: M112 kills at once, M410 drops the planned moves, S000 reports the stepper
+// position and state, P000 holds the feed (no new moves are planned, those planned already run out
+// and stop with their normal deceleration) and R000 resumes it. They may carry a line number and
+// checksum, are answered with ok when they are read and are not queued.
+//#define REALTIME_COMMANDS
+
+// While printing from SD, assemble host lines in a buffer of their own instead of the free command slot,
+// so a host line that is coming in no longer stops the card from being read. The card is read first and
+// leaves the last slot to the host while a host line is coming in. M105 and M27 without parameters are
+// answered as soon as they are read and take no slot, even with every slot taken, so a host polling
+// them never holds up the print. Costs MAX_CMD_SIZE bytes of RAM without SERIAL_PORT_2.
+//#define SD_HOST_INTAKE
+
 
 // Firmware based and LCD controlled retract
 // M207 and M208 can be used to define parameters for the retraction.
@@ -414,6 +1222,16 @@ const unsigned int dropsegments=5; //everything with less than this number of st
   #define RETRACT_ZLIFT 0                //default retract Z-lift
   #define RETRACT_RECOVER_LENGTH 0       //default additional recover length (mm, added to retract length when recovering)
   #define RETRACT_RECOVER_FEEDRATE 8*60  //default feedrate for recovering from retraction
+
+  // Without a Z-lift, hold G10 back until the next command. When that is an X/Y travel the filament
+  // is pulled back during its start instead of stopping for it.
+  //#define FWRETRACT_OVERLAP
+
+  // With a Z-lift, lift Z during the start of the X/Y travel after G10 and, when G11 is already
+  // queued behind the travel, lower it during the end of the travel, on slopes Z can follow at the
+  // travel speed, instead of stopping the head for each. Any other command that may move or wait, T
+  // and M600 too, lifts Z on its own first.
+  //#define FWRETRACT_ZLIFT_RAMP
 #endif
 
 //adds support for experimental filament exchange support M600; requires display
@@ -425,6 +1243,11 @@ const unsigned int dropsegments=5; //everything with less than this number of st
     #define FILAMENTCHANGE_ZADD 10
     #define FILAMENTCHANGE_FIRSTRETRACT -2
     #define FILAMENTCHANGE_FINALRETRACT -100
+    // M600 returns as soon as the park moves are planned. loop() keeps the heaters, the serial port
+    // and the display going and holds the commands after M600 until the click, instead of the
+    // command waiting in its own loop.
+    //#define FILAMENTCHANGE_NONBLOCKING
+    #define FILAMENTCHANGE_BEEP_INTERVAL 2500 // ms between the reminders while waiting
   #endif
 #endif
 
@@ -437,14 +1260,199 @@ const unsigned int dropsegments=5; //everything with less than this number of st
 //===========================================================================
 //=============================  Define Defines  ============================
 //===========================================================================
-#if EXTRUDERS > 1 && defined TEMP_SENSOR_1_AS_REDUNDANT
-  #error "You cannot use TEMP_SENSOR_1_AS_REDUNDANT if EXTRUDERS > 1"
+#if defined(TEMP_SENSOR_1_AS_REDUNDANT) && !defined(REDUNDANT_SENSOR_0)
+  #define REDUNDANT_SENSOR_0 1
+#endif
+#define _REDUNDANT_SENSOR_TYPE(n) TEMP_SENSOR_ ## n
+#define REDUNDANT_SENSOR_TYPE(n) _REDUNDANT_SENSOR_TYPE(n)
+#ifdef REDUNDANT_SENSOR_0
+  #if REDUNDANT_SENSOR_0 < EXTRUDERS || REDUNDANT_SENSOR_0 > 2 || REDUNDANT_SENSOR_TYPE(REDUNDANT_SENSOR_0) != TEMP_SENSOR_0
+    #error "REDUNDANT_SENSOR_0 must be an input no hotend uses, with the sensor type of TEMP_SENSOR_0"
+  #endif
+#endif
+#ifdef REDUNDANT_SENSOR_1
+  #if EXTRUDERS < 2 || REDUNDANT_SENSOR_1 < EXTRUDERS || REDUNDANT_SENSOR_1 > 2 || REDUNDANT_SENSOR_TYPE(REDUNDANT_SENSOR_1) != TEMP_SENSOR_1
+    #error "REDUNDANT_SENSOR_1 must be an input no hotend uses, with the sensor type of TEMP_SENSOR_1"
+  #endif
+#endif
+#ifdef REDUNDANT_SENSOR_2
+  #error "With 3 hotends there is no sensor input left for REDUNDANT_SENSOR_2"
+#endif
+#ifdef REDUNDANT_SENSOR_BED
+  #if REDUNDANT_SENSOR_BED < EXTRUDERS || REDUNDANT_SENSOR_BED > 2 || REDUNDANT_SENSOR_TYPE(REDUNDANT_SENSOR_BED) != TEMP_SENSOR_BED
+    #error "REDUNDANT_SENSOR_BED must be an input no hotend uses, with the sensor type of TEMP_SENSOR_BED"
+  #endif
+#endif
+#if (defined(REDUNDANT_SENSOR_0) && defined(REDUNDANT_SENSOR_1) && REDUNDANT_SENSOR_0 == REDUNDANT_SENSOR_1) \
+    || (defined(REDUNDANT_SENSOR_0) && defined(REDUNDANT_SENSOR_BED) && REDUNDANT_SENSOR_0 == REDUNDANT_SENSOR_BED) \
+    || (defined(REDUNDANT_SENSOR_1) && defined(REDUNDANT_SENSOR_BED) && REDUNDANT_SENSOR_1 == REDUNDANT_SENSOR_BED)
+  #error "Two heaters can't share a redundant sensor"
+#endif
+#if defined(REDUNDANT_SENSOR_0) || defined(REDUNDANT_SENSOR_1) || defined(REDUNDANT_SENSOR_BED)
+  #define REDUNDANT_SENSORS
 #endif
 
 #if EXTRUDERS > 1 && defined HEATERS_PARALLEL
   #error "You cannot use HEATERS_PARALLEL if EXTRUDERS > 1"
 #endif
 
+#if defined(STEP_SMOOTHING) && defined(ADVANCE)
+  #error "You cannot use STEP_SMOOTHING with ADVANCE"
+#endif
+
+#if defined(LIN_ADVANCE) && defined(ADVANCE)
+  #error "You cannot use LIN_ADVANCE with ADVANCE"
+#endif
+
+#if defined(STEP_SEGMENTS) && (defined(ADVANCE) || defined(LIN_ADVANCE) || defined(STEP_SMOOTHING) || defined(REALTIME_FEEDRATE_OVERRIDE) \
+    || defined(DRY_PLANNING) || defined(LASER_POWER_FOLLOWS_SPEED))
+  #error "You cannot use STEP_SEGMENTS with ADVANCE, LIN_ADVANCE, STEP_SMOOTHING, REALTIME_FEEDRATE_OVERRIDE, DRY_PLANNING or LASER_POWER_FOLLOWS_SPEED"
+#endif
+
+#ifdef LASER_RASTER
+  #if LASER_RASTER_BUFFER < 2 || LASER_RASTER_BUFFER > 128 || (LASER_RASTER_BUFFER & (LASER_RASTER_BUFFER - 1))
+    #error "LASER_RASTER_BUFFER must be a power of 2 up to 128"
+  #endif
+  #if !defined(LASER_PWM) || defined(DELTA) || defined(SCARA) || defined(SEGMENT_MERGE) || defined(MESH_BED_LEVELING) \
+      || defined(TRAVEL_MICROSTEP_FACTOR)
+    #error "LASER_RASTER needs LASER_PWM and can't be used with DELTA, SCARA, SEGMENT_MERGE, MESH_BED_LEVELING or TRAVEL_MICROSTEP_FACTOR"
+  #endif
+#endif
+
+#if defined(Z_DUAL_AUTO_ALIGN) && (!defined(Z_DUAL_STEPPER_DRIVERS) || !defined(ENABLE_AUTO_BED_LEVELING))
+  #error "Z_DUAL_AUTO_ALIGN needs Z_DUAL_STEPPER_DRIVERS and ENABLE_AUTO_BED_LEVELING"
+#endif
+
+#if defined(INPUT_SHAPING) && (defined(DELTA) || defined(DUAL_X_CARRIAGE) || defined(STEPPER_PORT_WRITES) || defined(TRAVEL_MICROSTEP_FACTOR))
+  #error "You cannot use INPUT_SHAPING with DELTA, DUAL_X_CARRIAGE, STEPPER_PORT_WRITES or TRAVEL_MICROSTEP_FACTOR"
+#endif
+
+#if defined(SCARA) && (defined(DELTA) || defined(COREXY) || defined(DUAL_X_CARRIAGE) || defined(QUICK_HOME) \
+    || defined(HOME_XY_TOGETHER) || defined(ENABLE_AUTO_BED_LEVELING) || defined(BABYSTEP_XY) \
+    || defined(TRAVEL_MICROSTEP_FACTOR) || defined(POWER_LOSS_RECOVERY))
+  #error "You cannot use SCARA with DELTA, COREXY, DUAL_X_CARRIAGE, QUICK_HOME, HOME_XY_TOGETHER, ENABLE_AUTO_BED_LEVELING, BABYSTEP_XY, TRAVEL_MICROSTEP_FACTOR or POWER_LOSS_RECOVERY"
+#endif
+
+#if defined(HOME_XY_TOGETHER) && (defined(COREXY) || defined(DUAL_X_CARRIAGE) || defined(QUICK_HOME) || defined(DELTA))
+  #error "You cannot use HOME_XY_TOGETHER with COREXY, DUAL_X_CARRIAGE, QUICK_HOME or DELTA"
+#endif
+
+#if defined(PLANNER_PRIMING) && PLANNER_PRIMING_BLOCKS >= BLOCK_BUFFER_SIZE
+  #error "PLANNER_PRIMING_BLOCKS must be less than BLOCK_BUFFER_SIZE"
+#endif
+
+#ifdef COMMAND_RING
+  #if COMMAND_RING < MAX_CMD_SIZE
+    #error "COMMAND_RING must hold at least MAX_CMD_SIZE bytes"
+  #endif
+  #ifdef COMMAND_LOOKAHEAD
+    #error "You cannot use COMMAND_RING with COMMAND_LOOKAHEAD"
+  #endif
+#endif
+
+#if defined(COMPACT_COMMANDS) && !defined(FAST_NUMBER_PARSER)
+  #error "COMPACT_COMMANDS needs FAST_NUMBER_PARSER"
+#endif
+
+#if defined(SERIAL_PORT_2) && SERIAL_PORT_2 == SERIAL_PORT
+  #error "SERIAL_PORT_2 must be another UART than SERIAL_PORT"
+#endif
+
+#if defined(SD_EXECUTED_POSITION) && !defined(SDSUPPORT)
+  #error "SD_EXECUTED_POSITION needs SDSUPPORT"
+#endif
+
+#if defined(SD_CHECK_CRC) && !defined(SDSUPPORT)
+  #error "SD_CHECK_CRC needs SDSUPPORT"
+#endif
+
+#if defined(SD_LATENCY_HISTOGRAM) && !defined(SDSUPPORT)
+  #error "SD_LATENCY_HISTOGRAM needs SDSUPPORT"
+#endif
+
+#if defined(SD_BENCHMARK) && !defined(SDSUPPORT)
+  #error "SD_BENCHMARK needs SDSUPPORT"
+#endif
+
+#ifdef SD_TELEMETRY
+  #ifndef SDSUPPORT
+    #error "SD_TELEMETRY needs SDSUPPORT"
+  #endif
+  #if EXTRUDERS > 3
+    #error "SD_TELEMETRY records at most 3 hotends"
+  #endif
+#endif
+
+#if defined(SD_JOB_QUEUE) && !defined(SDSUPPORT)
+  #error "SD_JOB_QUEUE needs SDSUPPORT"
+#endif
+
+#ifdef POWER_LOSS_RECOVERY
+  #ifndef SDSUPPORT
+    #error "POWER_LOSS_RECOVERY needs SDSUPPORT"
+  #endif
+  #ifdef DELTA
+    #error "POWER_LOSS_RECOVERY can't home X and Y alone on a DELTA"
+  #endif
+#endif
+
+#if defined(DRY_PLANNING) && !defined(PRINT_TIME_ESTIMATE)
+  #error "DRY_PLANNING needs PRINT_TIME_ESTIMATE"
+#endif
+
+#if defined(THROUGHPUT_BENCHMARK) && !defined(DRY_PLANNING)
+  #error "THROUGHPUT_BENCHMARK needs DRY_PLANNING"
+#endif
+
+#ifdef TRAVEL_MICROSTEP_FACTOR
+  #if TRAVEL_MICROSTEP_FACTOR < 2 || TRAVEL_MICROSTEP_FACTOR > 16 || (TRAVEL_MICROSTEP_FACTOR & (TRAVEL_MICROSTEP_FACTOR - 1))
+    #error "TRAVEL_MICROSTEP_FACTOR must be 2, 4, 8 or 16"
+  #endif
+  #if defined(COREXY) || defined(DELTA) || defined(DUAL_X_CARRIAGE) || defined(Y_DUAL_STEPPER_DRIVERS)
+    #error "You cannot use TRAVEL_MICROSTEP_FACTOR with COREXY, DELTA, DUAL_X_CARRIAGE or Y_DUAL_STEPPER_DRIVERS"
+  #endif
+#endif
+
+#if defined(BED_PID_INTERVAL) && !defined(PIDTEMPBED)
+  #error "BED_PID_INTERVAL needs PIDTEMPBED"
+#endif
+
+#if defined(EEPROM_BACKGROUND_STORE) && !defined(EEPROM_SETTINGS)
+  #error "EEPROM_BACKGROUND_STORE needs EEPROM_SETTINGS"
+#endif
+
+#if defined(BOOT_PREHEAT) && !defined(EEPROM_SETTINGS)
+  #error "BOOT_PREHEAT needs EEPROM_SETTINGS"
+#endif
+
+#if defined(PRINT_STATISTICS) && !defined(EEPROM_SETTINGS)
+  #error "PRINT_STATISTICS needs EEPROM_SETTINGS"
+#endif
+
+#if defined(SD_HOST_INTAKE) && !defined(SDSUPPORT)
+  #error "SD_HOST_INTAKE needs SDSUPPORT"
+#endif
+
+#if defined(SD_LIST_CHUNK) && (defined(SDCARD_SORT_ALPHA) || defined(SDCARD_SORT_NEWEST_FIRST))
+  #error "You cannot use SD_LIST_CHUNK with SDCARD_SORT_ALPHA or SDCARD_SORT_NEWEST_FIRST"
+#endif
+
+#if defined(HEATER_POWER_BUDGET) && (!defined(EXTRUDER_WATTS) || !defined(BED_WATTS) || defined(BED_SLOW_PWM))
+  #error "HEATER_POWER_BUDGET needs EXTRUDER_WATTS and BED_WATTS, and can't schedule BED_SLOW_PWM"
+#endif
+
+#if defined(DOGLCD_STATUS_DIRTY_CHECK) && !defined(DOGLCD)
+  #error "DOGLCD_STATUS_DIRTY_CHECK needs DOGLCD"
+#endif
+
+#if defined(STATUS_SNAPSHOT) && defined(DOGLCD_STATUS_DIRTY_CHECK)
+  #error "STATUS_SNAPSHOT already redraws only on changes, remove DOGLCD_STATUS_DIRTY_CHECK"
+#endif
+
+#if defined(TWI_QUEUE) && (defined(LCD_I2C_TYPE_PCF8575) || defined(LCD_I2C_TYPE_MCP23017) || defined(LCD_I2C_TYPE_MCP23008) || defined(LCD_I2C_TYPE_PCA8574))
+  #error "You cannot use TWI_QUEUE with an I2C LCD"
+#endif
+
 #if TEMP_SENSOR_0 > 0
   #define THERMISTORHEATER_0 TEMP_SENSOR_0
   #define HEATER_0_USES_THERMISTOR
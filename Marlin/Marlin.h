@@ -46,12 +46,17 @@
 #ifndef sbi
 #define sbi(sfr, bit) (_SFR_BYTE(sfr) |= _BV(bit))
 #endif
+#ifndef pgm_read_ptr // avr-libc before 1.8.1
+#define pgm_read_ptr(p) ((void *)pgm_read_word(p))
+#endif
 
 #include "WString.h"
 
 #ifdef AT90USB
    #ifdef BTENABLED
          #define MYSERIAL bt
+   #elif defined(USB_CDC_BULK)
+         #define MYSERIAL MSerial
    #else
          #define MYSERIAL Serial
    #endif // BTENABLED
@@ -103,6 +108,16 @@ void get_command();
 void process_commands();
 
 void manage_inactivity();
+void idle(); // the background tasks to run while waiting for something: heaters, inactivity and the LCD
+#ifdef MAIN_LOOP_TASKS
+void main_tasks_report();
+void main_tasks_reset();
+#endif
+#ifdef LOOP_LATENCY_MONITOR
+void latency_heater(); // called by manage_heater()
+void latency_report();
+void latency_reset();
+#endif
 
 #if defined(DUAL_X_CARRIAGE) && defined(X_ENABLE_PIN) && X_ENABLE_PIN > -1 \
     && defined(X2_ENABLE_PIN) && X2_ENABLE_PIN > -1
@@ -176,9 +191,16 @@ void ClearToSend();
 void get_coordinates();
 #ifdef DELTA
 void calculate_delta(float cartesian[3]);
+void calculate_delta_cartesian(const float carriage[3], float cartesian[3]);
 extern float delta[3];
 #endif
+#ifdef SCARA
+void calculate_scara(float cartesian[3]);
+void calculate_scara_cartesian(const float angles[3], float cartesian[3]);
+extern float scara_angles[3];
+#endif
 void prepare_move();
+void quickstop_moves(); // drop the planned moves, the position becomes where the steppers stopped
 void kill();
 void Stop();
 
@@ -186,7 +208,12 @@ bool IsStopped();
 
 void enquecommand(const char *cmd); //put an ASCII command at the end of the current buffer.
 void enquecommand_P(const char *cmd); //put an ASCII command at the end of the current buffer, read from flash
+bool code_seen(char code); //find a parameter of the command being processed
+float code_value(); //the value of the parameter code_seen() found
 void prepare_arc_move(char isclockwise);
+#ifdef BEZIER_CURVE_SUPPORT
+void prepare_bezier_move(const float *control);
+#endif
 void clamp_to_software_endstops(float target[3]);
 
 void refresh_cmd_timeout(void);
@@ -200,6 +227,10 @@ void setPwmFrequency(uint8_t pin, int val);
   #define CRITICAL_SECTION_END    SREG = _sreg;
 #endif //CRITICAL_SECTION_START
 
+// Keep the compiler from moving memory accesses across this point. The AVR itself never reorders them,
+// so this is all the ordering needed between the main loop and an interrupt sharing data without cli().
+#define MEMORY_BARRIER() __asm__ __volatile__("" ::: "memory")
+
 extern float homing_feedrate[];
 extern bool axis_relative_modes[];
 extern int feedmultiply;
@@ -213,13 +244,20 @@ extern float endstop_adj[3];
 extern float delta_radius;
 extern float delta_diagonal_rod;
 extern float delta_segments_per_second;
+extern float delta_radius_trim[3];
+extern float delta_tower_angle_trim[3];
+extern float delta_diagonal_rod_trim[3];
 void recalc_delta_settings(float radius, float diagonal_rod);
 #endif
 extern float min_pos[3];
 extern float max_pos[3];
 extern bool axis_known_position[3];
+extern const char axis_codes[NUM_AXIS];
 extern float zprobe_zoffset;
 extern int fanSpeed;
+#ifdef LASER_PWM
+extern unsigned char laser_power;
+#endif
 #ifdef BARICUDA
 extern int ValvePressure;
 extern int EtoPPressure;
@@ -245,6 +283,9 @@ extern uint8_t active_extruder;
 #ifdef DIGIPOT_I2C
 extern void digipot_i2c_set_current( int channel, float current );
 extern void digipot_i2c_init();
+#ifdef IDLE_CURRENT_PERCENT
+extern void digipot_i2c_set_idle( uint8_t channels ); // these channels at the idle current, the others at the full one
+#endif
 #endif
 
 #endif
@@ -22,6 +22,9 @@
 
 #include "Marlin.h"
 #include "MarlinSerial.h"
+#ifdef REALTIME_COMMANDS
+#include "planner.h"
+#endif
 
 #ifndef AT90USB
 // this next line disables the entire HardwareSerial.cpp, 
@@ -30,39 +33,173 @@
 
 #if UART_PRESENT(SERIAL_PORT)
   ring_buffer rx_buffer  =  { { 0 }, 0, 0 };
+  #if TX_BUFFER_SIZE > 0
+    tx_ring_buffer tx_buffer  =  { { 0 }, 0, 0 };
+  #endif
+#endif
+#ifdef SERIAL_PORT_2
+  ring_buffer rx_buffer2  =  { { 0 }, 0, 0 };
+  #if TX_BUFFER_SIZE > 0
+    tx_ring_buffer tx_buffer2  =  { { 0 }, 0, 0 };
+  #endif
+  // the receive buffer of the port selected by MarlinSerial::port
+  #define RX_BUFFER (port ? rx_buffer2 : rx_buffer)
+#else
+  #define RX_BUFFER rx_buffer
 #endif
 
-FORCE_INLINE void store_char(unsigned char c)
+FORCE_INLINE void store_char(unsigned char c, ring_buffer *buffer)
 {
-  int i = (unsigned int)(rx_buffer.head + 1) % RX_BUFFER_SIZE;
+  int i = RX_BUFFER_WRAP(buffer->head + 1);
+  #ifdef SERIAL_STATS
+  rx_stats_count(buffer, i);
+  #endif
 
   // if we should be storing the received character into the location
   // just before the tail (meaning that the head would advance to the
   // current location of the tail), we're about to overflow the buffer
   // and so we don't write the character or advance the head.
-  if (i != rx_buffer.tail) {
-    rx_buffer.buffer[rx_buffer.head] = c;
-    rx_buffer.head = i;
+  if (i != buffer->tail) {
+    buffer->buffer[buffer->head] = c;
+    buffer->head = i;
   }
 }
 
+#ifdef REALTIME_COMMANDS
+volatile uint8_t realtime_pending = 0;
+
+// The receive interrupt looks at each line as it comes in, so the real-time lines act at once
+// however many commands and moves are queued ahead of them. A line number in front and a
+// checksum or parameters after a blank are skipped, the checksum is not checked.
+#define RT_START  0 // 1 to 4: that many letters of the command seen
+#define RT_NUMBER 5 // in the line number
+#define RT_TAIL   6 // after the command
+#define RT_OTHER  7 // not a real-time line
+struct realtime_watch_t
+{
+  uint8_t state;
+  uint8_t report; // the realtime_pending bit for S000 on this port
+  char command[4];
+};
+
+static void realtime_watch(unsigned char c, realtime_watch_t *watch)
+{
+  uint8_t state = watch->state;
+  if(c == '\n' || c == '\r') {
+    watch->state = RT_START;
+    if(state != 4 && state != RT_TAIL)
+      return;
+    if(!strncmp_P(watch->command, PSTR("M112"), 4))
+      kill(); // interrupts stay disabled, kill() does not return
+    else if(!strncmp_P(watch->command, PSTR("M410"), 4))
+      realtime_pending |= REALTIME_QUICKSTOP;
+    else if(!strncmp_P(watch->command, PSTR("S000"), 4))
+      realtime_pending |= watch->report;
+    else if(!strncmp_P(watch->command, PSTR("P000"), 4))
+      plan_feed_hold = true;
+    else if(!strncmp_P(watch->command, PSTR("R000"), 4))
+      plan_feed_hold = false;
+    return;
+  }
+  switch(state) {
+  case RT_NUMBER:
+    if((c >= '0' && c <= '9') || c == '-')
+      return;
+    state = RT_START; // the command may follow without a blank
+  case RT_START:
+    if(c == 'N')
+      state = RT_NUMBER;
+    else if(c != ' ')
+      watch->command[state++] = c;
+    break;
+  case 1:
+  case 2:
+  case 3:
+    watch->command[state++] = c;
+    break;
+  case 4:
+    state = (c == ' ' || c == '*') ? RT_TAIL : RT_OTHER;
+    break;
+  }
+  watch->state = state;
+}
+#endif
 
 //#elif defined(SIG_USART_RECV)
 #if defined(M_USARTx_RX_vect)
+  #ifdef REALTIME_COMMANDS
+  static realtime_watch_t realtime_watch1 = { RT_START, REALTIME_REPORT };
+  #endif
   // fixed by Mark Sproul this is on the 644/644p
   //SIGNAL(SIG_USART_RECV)
   SIGNAL(M_USARTx_RX_vect)
   {
     unsigned char c  =  M_UDRx;
-    store_char(c);
+    store_char(c, &rx_buffer);
+    #ifdef REALTIME_COMMANDS
+    realtime_watch(c, &realtime_watch1); // also when the buffer was full and c was dropped
+    #endif
+  }
+#endif
+
+#ifdef SERIAL_PORT_2
+  #ifdef REALTIME_COMMANDS
+  static realtime_watch_t realtime_watch2 = { RT_START, REALTIME_REPORT2 };
+  #endif
+  SIGNAL(M2_USARTx_RX_vect)
+  {
+    unsigned char c  =  M2_UDRx;
+    store_char(c, &rx_buffer2);
+    #ifdef REALTIME_COMMANDS
+    realtime_watch(c, &realtime_watch2);
+    #endif
+  }
+#endif
+
+#if TX_BUFFER_SIZE > 0
+// Moves the next queued byte into the UART, or stops the interrupt when nothing is left.
+FORCE_INLINE void tx_udr_empty()
+{
+  if (tx_buffer.head == tx_buffer.tail) {
+    cbi(M_UCSRxB, M_UDRIEx);
+    return;
+  }
+  M_UDRx = tx_buffer.buffer[tx_buffer.tail];
+  tx_buffer.tail = (tx_buffer.tail + 1) & (TX_BUFFER_SIZE - 1);
+}
+
+#if defined(M_USARTx_UDRE_vect)
+  ISR(M_USARTx_UDRE_vect)
+  {
+    tx_udr_empty();
+  }
+#endif
+
+#ifdef SERIAL_PORT_2
+FORCE_INLINE void tx_udr_empty2()
+{
+  if (tx_buffer2.head == tx_buffer2.tail) {
+    cbi(M2_UCSRxB, M2_UDRIEx);
+    return;
   }
+  M2_UDRx = tx_buffer2.buffer[tx_buffer2.tail];
+  tx_buffer2.tail = (tx_buffer2.tail + 1) & (TX_BUFFER_SIZE - 1);
+}
+
+ISR(M2_USARTx_UDRE_vect)
+{
+  tx_udr_empty2();
+}
 #endif
+#endif // TX_BUFFER_SIZE > 0
 
 // Constructors ////////////////////////////////////////////////////////////////
 
 MarlinSerial::MarlinSerial()
 {
-
+#ifdef SERIAL_PORT_2
+  port = 0;
+#endif
 }
 
 // Public Methods //////////////////////////////////////////////////////////////
@@ -80,6 +217,25 @@ void MarlinSerial::begin(long baud)
     useU2X = false;
   }
 #endif
+
+#ifdef SERIAL_PORT_2
+  if (port) {
+    if (useU2X) {
+      M2_UCSRxA = 1 << M2_U2Xx;
+      baud_setting = (F_CPU / 4 / baud - 1) / 2;
+    } else {
+      M2_UCSRxA = 0;
+      baud_setting = (F_CPU / 8 / baud - 1) / 2;
+    }
+    M2_UBRRxH = baud_setting >> 8;
+    M2_UBRRxL = baud_setting;
+
+    sbi(M2_UCSRxB, M2_RXENx);
+    sbi(M2_UCSRxB, M2_TXENx);
+    sbi(M2_UCSRxB, M2_RXCIEx);
+    return;
+  }
+#endif
   
   if (useU2X) {
     M_UCSRxA = 1 << M_U2Xx;
@@ -100,30 +256,112 @@ void MarlinSerial::begin(long baud)
 
 void MarlinSerial::end()
 {
+#ifdef SERIAL_PORT_2
+  if (port) {
+    cbi(M2_UCSRxB, M2_RXENx);
+    cbi(M2_UCSRxB, M2_TXENx);
+    cbi(M2_UCSRxB, M2_RXCIEx);
+  #if TX_BUFFER_SIZE > 0
+    cbi(M2_UCSRxB, M2_UDRIEx);
+  #endif
+    return;
+  }
+#endif
   cbi(M_UCSRxB, M_RXENx);
   cbi(M_UCSRxB, M_TXENx);
   cbi(M_UCSRxB, M_RXCIEx);  
+#if TX_BUFFER_SIZE > 0
+  cbi(M_UCSRxB, M_UDRIEx);
+#endif
+}
+
+#ifdef SERIAL_PORT_2
+// The buffered write of SERIAL_PORT_2, the same as the one of SERIAL_PORT below
+static void write2(uint8_t c)
+{
+#if TX_BUFFER_SIZE > 0
+  if (SREG & (1 << SREG_I)) {
+    uint8_t i = (tx_buffer2.head + 1) & (TX_BUFFER_SIZE - 1);
+    while (i == tx_buffer2.tail)
+      ;
+    tx_buffer2.buffer[tx_buffer2.head] = c;
+    tx_buffer2.head = i;
+    sbi(M2_UCSRxB, M2_UDRIEx);
+    return;
+  }
+  while (tx_buffer2.head != tx_buffer2.tail) {
+    while (!((M2_UCSRxA) & (1 << M2_UDREx)))
+      ;
+    tx_udr_empty2();
+  }
+#endif
+  while (!((M2_UCSRxA) & (1 << M2_UDREx)))
+    ;
+  M2_UDRx = c;
 }
+#endif
+
+#if TX_BUFFER_SIZE > 0 || defined(SERIAL_PORT_2)
+void MarlinSerial::write(uint8_t c)
+{
+#ifdef SERIAL_PORT_2
+  if (port) {
+    write2(c);
+    return;
+  }
+#endif
+#if TX_BUFFER_SIZE == 0
+  while (!((M_UCSRxA) & (1 << M_UDREx)))
+    ;
+  M_UDRx = c;
+#else
+  if (!(SREG & (1 << SREG_I))) {
+    // the interrupt cannot drain the buffer now, so empty it by polling and send directly
+    while (tx_buffer.head != tx_buffer.tail) {
+      while (!((M_UCSRxA) & (1 << M_UDREx)))
+        ;
+      tx_udr_empty();
+    }
+    while (!((M_UCSRxA) & (1 << M_UDREx)))
+      ;
+    M_UDRx = c;
+    return;
+  }
+
+  uint8_t i = (tx_buffer.head + 1) & (TX_BUFFER_SIZE - 1);
+
+  // buffer full, wait for the interrupt to send a byte
+  while (i == tx_buffer.tail)
+    ;
+
+  tx_buffer.buffer[tx_buffer.head] = c;
+  tx_buffer.head = i;
+  sbi(M_UCSRxB, M_UDRIEx);
+#endif // TX_BUFFER_SIZE == 0
+}
+#endif
 
 
 
 int MarlinSerial::peek(void)
 {
-  if (rx_buffer.head == rx_buffer.tail) {
+  ring_buffer &rx = RX_BUFFER;
+  if (rx.head == rx.tail) {
     return -1;
   } else {
-    return rx_buffer.buffer[rx_buffer.tail];
+    return rx.buffer[rx.tail];
   }
 }
 
 int MarlinSerial::read(void)
 {
+  ring_buffer &rx = RX_BUFFER;
   // if the head isn't ahead of the tail, we don't have any characters
-  if (rx_buffer.head == rx_buffer.tail) {
+  if (rx.head == rx.tail) {
     return -1;
   } else {
-    unsigned char c = rx_buffer.buffer[rx_buffer.tail];
-    rx_buffer.tail = (unsigned int)(rx_buffer.tail + 1) % RX_BUFFER_SIZE;
+    unsigned char c = rx.buffer[rx.tail];
+    rx.tail = RX_BUFFER_WRAP(rx.tail + 1);
     return c;
   }
 }
@@ -139,7 +377,8 @@ void MarlinSerial::flush()
   // the value to rx_buffer_tail; the previous value of rx_buffer_head
   // may be written to rx_buffer_tail, making it appear as if the buffer
   // were full, not empty.
-  rx_buffer.head = rx_buffer.tail;
+  ring_buffer &rx = RX_BUFFER;
+  rx.head = rx.tail;
 }
 
 
@@ -326,3 +565,96 @@ MarlinSerial MSerial;
    HardwareSerial bt;
 #endif
 
+#if defined(AT90USB) && defined(USB_CDC_BULK)
+#include "USBAPI.h"
+#include "USBDesc.h"
+
+#define USB_PACKET_SIZE 64 // of the CDC bulk endpoints
+
+uint8_t USB_SendSpace(uint8_t ep); // in USBCore.cpp, not in USBAPI.h
+
+static uint8_t usb_rx_buffer[USB_CDC_BULK];
+static uint8_t usb_rx_head = 0, usb_rx_tail = 0; // USB_CDC_BULK is at most 256
+static uint8_t usb_tx_buffer[USB_PACKET_SIZE];
+static uint8_t usb_tx_count = 0;
+static bool usb_tx_stalled = false; // the last send timed out, nobody reads the port
+
+#define USB_RX_USED() ((uint8_t)(usb_rx_head - usb_rx_tail) & (USB_CDC_BULK - 1))
+
+// Move what came in since the last call into usb_rx_buffer: first what the start of frame interrupt
+// put into the core's Serial buffer, then the rest of the endpoint's packet in one USB_Recv() per
+// contiguous part. Interrupts stay off so the interrupt can't take bytes from between the two.
+static void usb_receive()
+{
+  CRITICAL_SECTION_START;
+  while(USB_RX_USED() < USB_CDC_BULK - 1 && Serial.available()) {
+    usb_rx_buffer[usb_rx_head] = Serial.read();
+    usb_rx_head = (usb_rx_head + 1) & (USB_CDC_BULK - 1);
+  }
+  for(uint8_t part = 0; part < 2; part++) {
+    int room = USB_CDC_BULK - 1 - USB_RX_USED();
+    int contiguous = USB_CDC_BULK - usb_rx_head;
+    int got = USB_Recv(CDC_RX, &usb_rx_buffer[usb_rx_head], min(room, contiguous));
+    if(got <= 0)
+      break;
+    usb_rx_head = (usb_rx_head + got) & (USB_CDC_BULK - 1);
+  }
+  CRITICAL_SECTION_END;
+}
+
+int MarlinUSBSerial::available()
+{
+  if(USB_RX_USED() < USB_CDC_BULK - USB_PACKET_SIZE)
+    usb_receive();
+  return USB_RX_USED();
+}
+
+int MarlinUSBSerial::peek()
+{
+  if(usb_rx_head == usb_rx_tail)
+    return -1;
+  return usb_rx_buffer[usb_rx_tail];
+}
+
+int MarlinUSBSerial::read()
+{
+  if(usb_rx_head == usb_rx_tail)
+    return -1;
+  uint8_t c = usb_rx_buffer[usb_rx_tail];
+  usb_rx_tail = (usb_rx_tail + 1) & (USB_CDC_BULK - 1);
+  return c;
+}
+
+// Drop what was received, as MarlinSerial::flush()
+void MarlinUSBSerial::flush()
+{
+  usb_receive();
+  usb_rx_tail = usb_rx_head;
+}
+
+// Send the queued bytes with one USB_Send(), the start of frame interrupt sends a packet that is not full
+static void usb_send()
+{
+  if(usb_tx_stalled && !USB_SendSpace(CDC_TX)) {
+    usb_tx_count = 0; // don't wait for the timeout on every line
+    return;
+  }
+  if(!(SREG & (1 << SREG_I)) && USB_SendSpace(CDC_TX) < usb_tx_count) {
+    usb_tx_count = 0; // kill(): the delay() USB_Send() waits with would never end
+    return;
+  }
+  usb_tx_stalled = USB_Send(CDC_TX, usb_tx_buffer, usb_tx_count) < 0;
+  usb_tx_count = 0;
+}
+
+size_t MarlinUSBSerial::write(uint8_t c)
+{
+  usb_tx_buffer[usb_tx_count++] = c;
+  if(c == '\n' || usb_tx_count == USB_PACKET_SIZE)
+    usb_send();
+  return 1;
+}
+
+MarlinUSBSerial MSerial;
+#endif // AT90USB && USB_CDC_BULK
+
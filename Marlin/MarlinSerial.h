@@ -54,8 +54,35 @@
 #define M_UBRRxL SERIAL_REGNAME(UBRR,SERIAL_PORT,L)
 #define M_RXCx SERIAL_REGNAME(RXC,SERIAL_PORT,)
 #define M_USARTx_RX_vect SERIAL_REGNAME(USART,SERIAL_PORT,_RX_vect)
+#define M_UDRIEx SERIAL_REGNAME(UDRIE,SERIAL_PORT,)
+#define M_USARTx_UDRE_vect SERIAL_REGNAME(USART,SERIAL_PORT,_UDRE_vect)
 #define M_U2Xx SERIAL_REGNAME(U2X,SERIAL_PORT,)
 
+#ifdef SERIAL_PORT_2
+#if defined(AT90USB)
+  #error "SERIAL_PORT_2 is not supported on AT90USB"
+#elif !UART_PRESENT(SERIAL_PORT_2)
+  #error "SERIAL_PORT_2 is not a UART of this processor"
+#endif
+// The same registers of SERIAL_PORT_2, which always has a number
+#define SERIAL2_REGNAME(registerbase,number,suffix) SERIAL2_REGNAME_INTERNAL(registerbase,number,suffix)
+#define SERIAL2_REGNAME_INTERNAL(registerbase,number,suffix) registerbase##number##suffix
+#define M2_UCSRxA SERIAL2_REGNAME(UCSR,SERIAL_PORT_2,A)
+#define M2_UCSRxB SERIAL2_REGNAME(UCSR,SERIAL_PORT_2,B)
+#define M2_RXENx SERIAL2_REGNAME(RXEN,SERIAL_PORT_2,)
+#define M2_TXENx SERIAL2_REGNAME(TXEN,SERIAL_PORT_2,)
+#define M2_RXCIEx SERIAL2_REGNAME(RXCIE,SERIAL_PORT_2,)
+#define M2_UDREx SERIAL2_REGNAME(UDRE,SERIAL_PORT_2,)
+#define M2_UDRx SERIAL2_REGNAME(UDR,SERIAL_PORT_2,)
+#define M2_UBRRxH SERIAL2_REGNAME(UBRR,SERIAL_PORT_2,H)
+#define M2_UBRRxL SERIAL2_REGNAME(UBRR,SERIAL_PORT_2,L)
+#define M2_RXCx SERIAL2_REGNAME(RXC,SERIAL_PORT_2,)
+#define M2_USARTx_RX_vect SERIAL2_REGNAME(USART,SERIAL_PORT_2,_RX_vect)
+#define M2_UDRIEx SERIAL2_REGNAME(UDRIE,SERIAL_PORT_2,)
+#define M2_USARTx_UDRE_vect SERIAL2_REGNAME(USART,SERIAL_PORT_2,_UDRE_vect)
+#define M2_U2Xx SERIAL2_REGNAME(U2X,SERIAL_PORT_2,)
+#endif
+
 
 
 #define DEC 10
@@ -70,7 +97,28 @@
 // using a ring buffer (I think), in which rx_buffer_head is the index of the
 // location to which to write the next incoming character and rx_buffer_tail
 // is the index of the location from which to read.
+// RX_BUFFER_SIZE can be set in Configuration_adv.h, a power of 2 lets the index wrap with a mask.
+#ifndef RX_BUFFER_SIZE
 #define RX_BUFFER_SIZE 128
+#endif
+#if (RX_BUFFER_SIZE & (RX_BUFFER_SIZE - 1)) == 0
+  #define RX_BUFFER_WRAP(i) ((unsigned int)(i) & (RX_BUFFER_SIZE - 1))
+#else
+  #define RX_BUFFER_WRAP(i) ((unsigned int)(i) % RX_BUFFER_SIZE)
+#endif
+
+// Outgoing data is queued in a ring buffer of TX_BUFFER_SIZE bytes and sent from the
+// data register empty interrupt, so printing does not stall the main loop.
+// When the buffer is full write() waits until the interrupt has made room: output is never dropped.
+// While interrupts are disabled (inside an ISR, kill()) bytes are sent directly instead.
+// Must be a power of 2 up to 256, 0 disables the buffer and busy-waits on every byte.
+#ifndef TX_BUFFER_SIZE
+#define TX_BUFFER_SIZE 32
+#endif
+
+#if TX_BUFFER_SIZE > 0 && ((TX_BUFFER_SIZE & (TX_BUFFER_SIZE - 1)) != 0 || TX_BUFFER_SIZE > 256)
+  #error TX_BUFFER_SIZE must be a power of 2 up to 256
+#endif
 
 
 struct ring_buffer
@@ -78,10 +126,56 @@ struct ring_buffer
   unsigned char buffer[RX_BUFFER_SIZE];
   int head;
   int tail;
+  #ifdef SERIAL_STATS
+  unsigned long received; // bytes, the dropped ones too
+  unsigned int overflows; // bytes dropped because the buffer was full
+  int peak;               // most bytes waiting in the buffer
+  #endif
 };
 
+#if TX_BUFFER_SIZE > 0
+struct tx_ring_buffer
+{
+  unsigned char buffer[TX_BUFFER_SIZE];
+  volatile uint8_t head;
+  volatile uint8_t tail;
+};
+#endif
+
 #if UART_PRESENT(SERIAL_PORT)
   extern ring_buffer rx_buffer;
+  #if TX_BUFFER_SIZE > 0
+    extern tx_ring_buffer tx_buffer;
+  #endif
+#endif
+#ifdef SERIAL_PORT_2
+  extern ring_buffer rx_buffer2;
+  #if TX_BUFFER_SIZE > 0
+    extern tx_ring_buffer tx_buffer2;
+  #endif
+#endif
+
+#ifdef SERIAL_STATS
+// Count a byte taken from the UART; next is the head it would move the buffer to
+FORCE_INLINE void rx_stats_count(ring_buffer *buffer, int next)
+{
+  buffer->received++;
+  if (next == buffer->tail) {
+    buffer->overflows++;
+    return;
+  }
+  int waiting = RX_BUFFER_WRAP(next + RX_BUFFER_SIZE - buffer->tail);
+  if (waiting > buffer->peak)
+    buffer->peak = waiting;
+}
+#endif
+
+#ifdef REALTIME_COMMANDS
+// What the receive interrupts found for the main code to do, see realtime_commands_run()
+#define REALTIME_QUICKSTOP 1 // M410
+#define REALTIME_REPORT    2 // S000
+#define REALTIME_REPORT2   4 // S000 on SERIAL_PORT_2
+extern volatile uint8_t realtime_pending;
 #endif
 
 class MarlinSerial //: public Stream
@@ -89,6 +183,10 @@ class MarlinSerial //: public Stream
 
   public:
     MarlinSerial();
+#ifdef SERIAL_PORT_2
+    // 0 for SERIAL_PORT, 1 for SERIAL_PORT_2: the port begin(), end(), read(), write() and the rest work on
+    uint8_t port;
+#endif
     void begin(long);
     void end();
     int peek(void);
@@ -97,9 +195,16 @@ class MarlinSerial //: public Stream
     
     FORCE_INLINE int available(void)
     {
-      return (unsigned int)(RX_BUFFER_SIZE + rx_buffer.head - rx_buffer.tail) % RX_BUFFER_SIZE;
+#ifdef SERIAL_PORT_2
+      if (port)
+        return RX_BUFFER_WRAP(RX_BUFFER_SIZE + rx_buffer2.head - rx_buffer2.tail);
+#endif
+      return RX_BUFFER_WRAP(RX_BUFFER_SIZE + rx_buffer.head - rx_buffer.tail);
     }
     
+#if TX_BUFFER_SIZE > 0 || defined(SERIAL_PORT_2)
+    void write(uint8_t c);
+#else
     FORCE_INLINE void write(uint8_t c)
     {
       while (!((M_UCSRxA) & (1 << M_UDREx)))
@@ -107,13 +212,30 @@ class MarlinSerial //: public Stream
 
       M_UDRx = c;
     }
+#endif
     
     
     FORCE_INLINE void checkRx(void)
     {
+#ifdef SERIAL_PORT_2
+      if((M2_UCSRxA & (1<<M2_RXCx)) != 0) {
+        unsigned char c  =  M2_UDRx;
+        int i = RX_BUFFER_WRAP(rx_buffer2.head + 1);
+        #ifdef SERIAL_STATS
+        rx_stats_count(&rx_buffer2, i);
+        #endif
+        if (i != rx_buffer2.tail) {
+          rx_buffer2.buffer[rx_buffer2.head] = c;
+          rx_buffer2.head = i;
+        }
+      }
+#endif
       if((M_UCSRxA & (1<<M_RXCx)) != 0) {
         unsigned char c  =  M_UDRx;
-        int i = (unsigned int)(rx_buffer.head + 1) % RX_BUFFER_SIZE;
+        int i = RX_BUFFER_WRAP(rx_buffer.head + 1);
+        #ifdef SERIAL_STATS
+        rx_stats_count(&rx_buffer, i);
+        #endif
 
         // if we should be storing the received character into the location
         // just before the tail (meaning that the head would advance to the
@@ -181,9 +303,38 @@ class MarlinSerial //: public Stream
 extern MarlinSerial MSerial;
 #endif // !AT90USB
 
+#if defined(AT90USB) && defined(REALTIME_COMMANDS)
+  #error "REALTIME_COMMANDS needs a UART, it does not work with AT90USB"
+#endif
+
 // Use the UART for BT in AT90USB configurations
 #if defined(AT90USB) && defined (BTENABLED)
    extern HardwareSerial bt;
 #endif
 
+#if defined(AT90USB) && defined(USB_CDC_BULK)
+#if USB_CDC_BULK != 128 && USB_CDC_BULK != 256
+  #error "USB_CDC_BULK must be 128 or 256"
+#endif
+#ifdef BTENABLED
+  #error "You cannot use USB_CDC_BULK with BTENABLED"
+#endif
+// The native USB port of the Arduino USBCore (USBCON), read a bulk packet at a time instead of a
+// USB_Recv() per byte and written a packet or line at a time instead of a USB_Send() per byte.
+// Output is sent at each newline, all of Marlin's messages end in one.
+class MarlinUSBSerial : public Print
+{
+  public:
+    void begin(long) { }
+    int available();
+    int peek();
+    int read();
+    void flush();
+    virtual size_t write(uint8_t c);
+    using Print::write;
+};
+
+extern MarlinUSBSerial MSerial;
+#endif
+
 #endif
@@ -31,27 +31,32 @@
 
 #ifdef ENABLE_AUTO_BED_LEVELING
 #include "vector_3.h"
-  #ifdef AUTO_BED_LEVELING_GRID
+  #ifdef DELTA_AUTO_CALIBRATION
     #include "qr_solve.h"
   #endif
 #endif // ENABLE_AUTO_BED_LEVELING
 
 #include "ultralcd.h"
 #include "planner.h"
+#include "kinematics.h"
 #include "stepper.h"
 #include "temperature.h"
 #include "motion_control.h"
 #include "cardreader.h"
 #include "watchdog.h"
 #include "ConfigurationStore.h"
+#include "benchmark.h"
+#include "event_trace.h"
 #include "language.h"
 #include "pins_arduino.h"
 #include "math.h"
 
 #ifdef BLINKM
 #include "BlinkM.h"
+#ifndef TWI_QUEUE
 #include "Wire.h"
 #endif
+#endif
 
 #if NUM_SERVOS > 0
 #include "Servo.h"
@@ -61,6 +66,10 @@
 #include <SPI.h>
 #endif
 
+#ifdef BINARY_GCODE
+#include <util/crc16.h>
+#endif
+
 #define VERSION_STRING  "1.0.0"
 
 // look here for descriptions of G-codes: http://linuxcnc.org/handbook/gcode/g-code.html
@@ -73,11 +82,16 @@
 // G2  - CW ARC
 // G3  - CCW ARC
 // G4  - Dwell S<seconds> or P<milliseconds>
+// G5  - Cubic Bezier move X Y Z E, I J first control point offset from the start, P Q second control point offset from the end
+// G7  - Raster move X Y Z F, D<hex> pixel powers spread along it, two lower case hex digits each (LASER_RASTER)
 // G10 - retract filament according to settings of M207
 // G11 - retract recover filament according to settings of M208
-// G28 - Home all Axis
+// G28 - Home all Axis, O only if one of them lost its position since it was homed (steppers disabled, endstop hit)
 // G29 - Detailed Z-Probe, probes the bed at 3 or more points.  Will fail if you haven't homed yet.
+//       L R F B the left, right, front and back of the print, only the grid around it is probed (AUTO_BED_LEVELING_ADAPTIVE)
 // G30 - Single Z Probe, probes bed at current XY location.
+// G33 - Delta auto calibration: fit endstop adjustments, radius and tower angles (requires DELTA_AUTO_CALIBRATION)
+// G34 - Level the gantry of dual Z motors from two probed points (requires Z_DUAL_AUTO_ALIGN)
 // G90 - Use Absolute Coordinates
 // G91 - Use Relative Coordinates
 // G92 - Set current position to coordinates given
@@ -85,6 +99,8 @@
 // M Codes
 // M0   - Unconditional stop - Wait for user to press a button on the LCD (Only if ULTRA_LCD is enabled)
 // M1   - Same as M0
+// M3   - Set the laser power of the moves that follow, M3 S<0-255>, full power without S (LASER_PWM)
+// M5   - Turn the laser off for the moves that follow (LASER_PWM)
 // M17  - Enable/Power all stepper motors
 // M18  - Disable all stepper motors; same as M84
 // M20  - List SD card
@@ -95,7 +111,7 @@
 // M25  - Pause SD print
 // M26  - Set SD position in bytes (M26 S12345)
 // M27  - Report SD print status
-// M28  - Start SD write (M28 filename.g)
+// M28  - Start SD write (M28 filename.g), M28 S<bytes> filename.g allocates the file in one piece (requires SD_WRITE_BEHIND)
 // M29  - Stop SD write
 // M30  - Delete file from SD (M30 filename.g)
 // M31  - Output time since last M109 or SD card start to serial
@@ -104,7 +120,7 @@
 //        Call gcode file : "M32 P !filename#" and return to caller file after finishing (similar to #include).
 //        The '#' is necessary when calling from within sd files, as it stops buffer prereading
 // M42  - Change pin status via gcode Use M42 Px Sy to set pin x to value y, when omitting Px the onboard led will be used.
-// M80  - Turn on Power Supply
+// M80  - Turn on Power Supply (AUTO_POWER_CONTROL switches it on and off by itself as well)
 // M81  - Turn off Power Supply
 // M82  - Set E codes absolute (default)
 // M83  - Set E codes relative while in Absolute Coordinates (G90) mode
@@ -112,12 +128,13 @@
 //        or use S<seconds> to specify an inactivity timeout, after which the steppers will be disabled.  S0 to disable the timeout.
 // M85  - Set inactivity shutdown timer with parameter S<seconds>. To disable set zero (default)
 // M92  - Set axis_steps_per_unit - same syntax as G92
-// M104 - Set extruder target temp
+// M104 - Set extruder target temp. With TOOL_STANDBY, R<temp> sets the standby temperature of the T<extruder>
 // M105 - Read current temp
 // M106 - Fan on
 // M107 - Fan off
 // M109 - Sxxx Wait for extruder current temp to reach target temp. Waits only when heating
 //        Rxxx Wait for extruder current temp to reach target temp. Waits when heating and cooling
+// M112 - Emergency stop, acts as soon as it is received with REALTIME_COMMANDS
 // M114 - Output current position to serial port
 // M115 - Capabilities string
 // M117 - display message
@@ -127,10 +144,12 @@
 // M128 - EtoP Open (BariCUDA EtoP = electricity to air pressure transducer by jmil)
 // M129 - EtoP Closed (BariCUDA EtoP = electricity to air pressure transducer by jmil)
 // M140 - Set bed target temp
+// M155 - S<seconds> Report temperatures every S seconds without polling, S0 turns it off (requires AUTO_REPORT_TEMPERATURES)
 // M150 - Set BlinkM Color Output R: Red<0-255> U(!): Green<0-255> B: Blue<0-255> over i2c, G for green does not work.
 // M190 - Sxxx Wait for bed current temp to reach target temp. Waits only when heating
 //        Rxxx Wait for bed current temp to reach target temp. Waits when heating and cooling
 // M200 D<millimeters>- set filament diameter and set E axis units to cubic millimeters (use S0 to set back to millimeters).
+//        L<mm^3/s> T<extruder> sets the most plastic per second the hotend is given, L0 none (requires VOLUMETRIC_FLOW_LIMIT)
 // M201 - Set max acceleration in units/s^2 for print moves (M201 X1000 Y1000)
 // M202 - Set max acceleration in units/s^2 for travel moves (M202 X1000 Y1000) Unused in Marlin!!
 // M203 - Set maximum feedrate that your machine can sustain (M203 X200 Y200 Z300 E10000) in mm/sec
@@ -148,20 +167,25 @@
 // M250 - Set LCD contrast C<contrast value> (value 0..63)
 // M280 - set servo position absolute. P: servo index, S: angle or microseconds
 // M300 - Play beep sound S<frequency Hz> P<duration ms>
-// M301 - Set PID parameters P I and D
+// M301 - Set PID parameters P I and D (C extrusion rate gain, L feed-forward lookahead in ms)
 // M302 - Allow cold extrudes, or set the minimum extrude S<temperature>.
 // M303 - PID relay autotune S<temperature> sets the target temperature. (default target temperature = 150C)
+//        With PID_AUTOTUNE_CONVERGENCE, M303 A tunes all hotends to S and the bed to B<temperature> at once.
 // M304 - Set bed PID parameters P I and D
 // M400 - Finish all moves
 // M401 - Lower z-probe if present
 // M402 - Raise z-probe if present
+// M410 - Quick stop: drop all planned moves, acts as soon as it is received with REALTIME_COMMANDS
 // M500 - stores parameters in EEPROM
 // M501 - reads parameters from EEPROM (if you need reset them after you changed them temporarily).
 // M502 - reverts to the default "factory settings".  You still need to store them in EEPROM afterwards if you want to.
 // M503 - print the current settings (from memory not from EEPROM)
+// M420 - Apply the bed leveling of the last G29 again, also after a restart when stored with M500 (requires BED_LEVEL_EEPROM)
 // M540 - Use S[0|1] to enable or disable the stop SD card print on endstop hit (requires ABORT_ON_ENDSTOP_HIT_FEATURE_ENABLED)
+// M593 - X Y F<Hz> D<damping ratio> Set the input shaping of X and/or Y, F0 turns it off, reports it and the buffer overflows (requires INPUT_SHAPING)
 // M600 - Pause for filament change X[pos] Y[pos] Z[relative lift] E[initial retract] L[later retract distance for removal]
-// M665 - set delta configurations
+// M700 - Heat and home in parallel: S<hotend temp> B<bed temp> T<extruder>, P to also run G29 (requires HEAT_AND_HOME)
+// M665 - set delta configurations L<diagonal rod> R<radius> S<segments/s>, per tower A B C rod, I J K angle, U V W radius trims
 // M666 - set delta endstop adjustment
 // M605 - Set dual x-carriage movement mode: S<mode> [ X<duplication x-offset> R<duplication temp offset> ]
 // M907 - Set digital trimpot motor current using axis codes.
@@ -169,6 +193,30 @@
 // M350 - Set microstepping mode.
 // M351 - Toggle MS1 MS2 pins directly.
 // M928 - Start SD logging (M928 filename.g) - ended by M29
+// M800 - Report stepper interrupt timing (requires STEPPER_ISR_PROFILE), S0 clears the statistics
+// M801 - Report planner timing and queue depth histogram (requires PLANNER_PROFILE), S0 clears the statistics
+// M802 - Thermal history (requires THERMAL_HISTORY): min/max/mean per heater, B dumps the samples in binary, S<ms> sets the interval
+// M803 - Report main loop task timing (requires MAIN_LOOP_TASKS), S0 clears the statistics
+// M804 - Time the hot math functions call by call (requires MATH_BENCHMARK)
+// M805 - Report the move time planned, executed and queued (requires PRINT_TIME_ESTIMATE), S0 clears it
+// M806 - Dry planning (requires DRY_PLANNING): S1 retires blocks without stepping and skips heating and dwells, S0 ends it
+// M807 - Power-loss journal (requires POWER_LOSS_RECOVERY): report it, S1 heats, homes X Y and resumes the print, S0 discards it
+// M808 - Heat up to the current targets at the next reset (requires BOOT_PREHEAT), S<temp> B<temp> for the active hotend and bed instead, P0 cancels
+// M809 - Report the SD card blocks read with a CRC error and the SPI clock divider they left (requires SD_CHECK_CRC)
+// M810 - SD telemetry log (requires SD_TELEMETRY): report it, S0 stops it and writes the records still in RAM, S1 starts it, P<ms> interval
+// M811 - Report the longest loop() and manage_heater() gaps and what took them (requires LOOP_LATENCY_MONITOR), S0 clears them
+// M812 - Report the stack high-water mark, the heap and the sizes of the big buffers (requires MEMORY_REPORT)
+// M813 - SD job queue (requires SD_JOB_QUEUE): print the jobs of the queue file in a row, S0 stops after the current job
+// M814 - Report the mean power, time at full power and energy of each heater in this job (requires HEATER_DUTY_STATS), S0 starts a new job
+// M815 - Report the planner underruns and late moves from the host and from SD (requires PLANNER_STARVATION_STATS), S0 clears them
+// M816 - Report the serial bytes and lines per second, errors, resends, receive buffer overflows and peak (requires SERIAL_STATS), S0 clears them
+// M817 - Report the SD card access time histograms (requires SD_LATENCY_HISTOGRAM), S0 clears them
+// M818 - S<lines> Run the next lines from the host dry and report the lines and planner blocks per second (requires THROUGHPUT_BENCHMARK)
+// M819 - [W<KB>] [filename] Read the file like a print and write KB to a scratch file, report the speed and the slowest call (requires SD_BENCHMARK)
+// M820 - Report the print statistics kept in EEPROM (requires PRINT_STATISTICS), S1 the host starts a job, S2 it completed it, S0 clears them
+// M821 - Report the axis encoder counts and how far they are from the steps (requires AXIS_ENCODERS)
+// M822 - Dump the event trace in binary (requires EVENT_TRACE), S0 clears it, F clears it and freezes it after the stepper next runs dry
+// M900 - K<seconds> Set the linear advance factor, without K report it (requires LIN_ADVANCE)
 // M999 - Restart after being stopped by error
 
 //Stepper Movement Variables
@@ -188,6 +236,15 @@ float homing_feedrate[] = HOMING_FEEDRATE;
 bool axis_relative_modes[] = AXIS_RELATIVE_MODES;
 int feedmultiply=100; //100->1 200->2
 int saved_feedmultiply;
+#ifdef REALTIME_FEEDRATE_OVERRIDE
+static int override_multiply = 100; // the feedmultiply the planned blocks were last slowed to
+// The moves planned in between are slowed down again by later changes of feedmultiply
+#define FEED_MULTIPLY_BEGIN() plan_feed_multiply = feedmultiply
+#define FEED_MULTIPLY_END() plan_feed_multiply = 0
+#else
+#define FEED_MULTIPLY_BEGIN()
+#define FEED_MULTIPLY_END()
+#endif
 int extrudemultiply=100; //100->1 200->2
 int extruder_multiply[EXTRUDERS] = {100
   #if EXTRUDERS > 1
@@ -229,7 +286,14 @@ float extruder_offset[NUM_EXTRUDER_OFFSETS][EXTRUDERS] = {
 };
 #endif
 uint8_t active_extruder = 0;
+#ifdef TOOL_STANDBY
+static int standby_temperature[EXTRUDERS];  // M104 R, the tool drops to it when it is put away, 0 keeps it hot
+static int standby_resume[EXTRUDERS];       // the target a tool on standby gets back, 0 when it isn't on standby
+#endif
 int fanSpeed=0;
+#ifdef LASER_PWM
+unsigned char laser_power=0; // of the moves planned next
+#endif
 #ifdef SERVO_ENDSTOPS
   int servo_endstops[] = SERVO_ENDSTOPS;
   int servo_endstop_angles[] = SERVO_ENDSTOP_ANGLES;
@@ -247,6 +311,18 @@ int EtoPPressure=0;
   float retract_zlift = RETRACT_ZLIFT;
   float retract_recover_length = RETRACT_RECOVER_LENGTH;
   float retract_recover_feedrate = RETRACT_RECOVER_FEEDRATE;
+  #ifdef FWRETRACT_OVERLAP
+  static bool retract_pending = false; // retracted, but the filament is only pulled back with the next move
+  static void retract_flush();
+  void retract(bool retracting);
+  #endif
+  #ifdef FWRETRACT_ZLIFT_RAMP
+  #define ZLIFT_NONE 0
+  #define ZLIFT_PENDING 1 // retracted, Z is lifted with the next travel
+  #define ZLIFT_UP 2      // lifted: the head is retract_zlift above current_position
+  #define ZLIFT_DOWN 3    // lowered again at the end of the travel, G11 is next
+  static uint8_t zlift_state = ZLIFT_NONE;
+  #endif
 #endif
 
 #ifdef ULTIPANEL
@@ -272,6 +348,11 @@ int EtoPPressure=0;
   float delta_diagonal_rod= DELTA_DIAGONAL_ROD;
   float delta_diagonal_rod_2= sq(delta_diagonal_rod);
   float delta_segments_per_second= DELTA_SEGMENTS_PER_SECOND;
+  // Per tower corrections of the radius (mm), the tower angle (degrees) and the rod length (mm), set with M665
+  float delta_radius_trim[3] = {0.0, 0.0, 0.0};
+  float delta_tower_angle_trim[3] = {0.0, 0.0, 0.0};
+  float delta_diagonal_rod_trim[3] = {0.0, 0.0, 0.0};
+  static float delta_diagonal_rod_2_tower[3] = {delta_diagonal_rod_2, delta_diagonal_rod_2, delta_diagonal_rod_2};
 #endif					
 
 //===========================================================================
@@ -281,24 +362,299 @@ const char axis_codes[NUM_AXIS] = {'X', 'Y', 'Z', 'E'};
 static float destination[NUM_AXIS] = {  0.0, 0.0, 0.0, 0.0};
 static float offset[3] = {0.0, 0.0, 0.0};
 static bool home_all_axis = true;
+#ifdef HOME_XY_TOGETHER
+static bool home_xy_together = false; // G28 homes X and Y at once
+#else
+static const bool home_xy_together = false;
+#endif
 static float feedrate = 1500.0, next_feedrate, saved_feedrate;
 static long gcode_N, gcode_LastN, Stopped_gcode_LastN = 0;
 
 static bool relative_mode = false;  //Determines Absolute or Relative Coordinates
 
+#ifdef COMMAND_RING
+// The queued commands lie one after the other in cmdring and each slot points at its command. The slot
+// at bufindw is filled at cmdring_head, which always has MAX_CMD_SIZE bytes before the end of the ring.
+// cmdring_tail is where the oldest command starts.
+static char cmdring[COMMAND_RING];
+static char *cmdbuffer[BUFSIZE] = { cmdring };
+static char *cmdring_head = cmdring, *cmdring_tail = cmdring;
+#else
 static char cmdbuffer[BUFSIZE][MAX_CMD_SIZE];
+#endif
 static bool fromsd[BUFSIZE];
+#ifdef POWER_LOSS_RECOVERY
+static uint32_t cmdbuffer_sdpos[BUFSIZE]; // file position after each SD command
+#endif
+#ifdef SD_EXECUTED_POSITION
+static uint32_t cmdbuffer_sdstart[BUFSIZE]; // file position of each SD command
+#endif
 static int bufindr = 0;
 static int bufindw = 0;
 static int buflen = 0;
+
+#ifdef COMMAND_RING
+// A slot is left and a whole line fits at cmdring_head without reaching the oldest command
+#define COMMAND_SLOT_FREE() (buflen < BUFSIZE && \
+                             (!buflen || cmdring_head > cmdring_tail || cmdring_head + MAX_CMD_SIZE <= cmdring_tail))
+#else
+#define COMMAND_SLOT_FREE() (buflen < BUFSIZE)
+#endif
+
+#ifdef AUTO_POWER_CONTROL
+#if !defined(PS_ON_PIN) || PS_ON_PIN < 0
+  #error "AUTO_POWER_CONTROL needs PS_ON_PIN"
+#endif
+#ifdef PS_DEFAULT_OFF
+static bool auto_power_is_on = false;
+#else
+static bool auto_power_is_on = true;
+#endif
+static int auto_power_slot = -1; // of the command the supply was switched on for
+static unsigned long auto_power_on_ms;
+static unsigned long auto_power_used_ms; // last time something moved or was queued to
+
+static void auto_power_on()
+{
+  SET_OUTPUT(PS_ON_PIN);
+  WRITE(PS_ON_PIN, PS_ON_AWAKE);
+  auto_power_is_on = true;
+  auto_power_on_ms = millis();
+  #ifdef ULTIPANEL
+  powersupply = true;
+  #endif
+}
+
+static bool auto_power_heaters_off()
+{
+  for(uint8_t e = 0; e < EXTRUDERS; e++)
+    if(target_temperature[e])
+      return false;
+  return !target_temperature_bed;
+}
+
+// The command in the slot at bufindw was queued: switch the supply on for one that moves or heats,
+// and if it is the first to heat a cold machine start heating now
+static void auto_power_queued(const char *cmd)
+{
+  #ifdef SDSUPPORT
+    #ifdef SD_BACKGROUND_UPLOAD
+    if(card.saving && !fromsd[bufindw])
+    #else
+    if(card.saving)
+    #endif
+      return; // written to the file, not run
+  #endif
+  while(*cmd == ' ')
+    cmd++;
+  if(*cmd == 'N') // line number
+  {
+    cmd++;
+    while(*cmd == '-' || *cmd == ' ' || (*cmd >= '0' && *cmd <= '9'))
+      cmd++;
+  }
+  char letter = *cmd;
+  int code = strtol(cmd + 1, NULL, 10);
+  bool heats = letter == 'M' && (code == 104 || code == 109 || code == 140 || code == 190);
+  bool power = heats || letter == 'T' ||
+               (letter == 'G' && code != 4 && code != 20 && code != 21 && code != 90 && code != 91 && code != 92) ||
+               (letter == 'M' && (code == 17 || code == 303 || code == 700));
+  if(!power)
+    return;
+  auto_power_used_ms = millis();
+  if(!auto_power_is_on)
+  {
+    auto_power_on();
+    auto_power_slot = bufindw;
+  }
+  const char *s = strchr(cmd, 'S');
+  if(!heats || !s || IsStopped() || !auto_power_heaters_off())
+    return;
+  if(code == 140 || code == 190)
+    setTargetBed(strtod(s + 1, NULL));
+  else
+  {
+    const char *t = strchr(cmd, 'T');
+    uint8_t e = t ? strtol(t + 1, NULL, 10) : active_extruder;
+    if(e < EXTRUDERS)
+      setTargetHotend(strtod(s + 1, NULL), e);
+  }
+}
+
+// Before the command at bufindr runs: give the supply switched on for it time to come up
+static void auto_power_settle()
+{
+  if(bufindr != auto_power_slot)
+    return;
+  auto_power_slot = -1;
+  while(millis() - auto_power_on_ms < AUTO_POWER_DELAY)
+    idle();
+}
+
+// From manage_inactivity(): switch the supply off once the machine is idle and cool
+static void auto_power_check()
+{
+  if(!auto_power_is_on)
+    return;
+  if(blocks_queued())
+    auto_power_used_ms = millis();
+  if(millis() - auto_power_used_ms < AUTO_POWER_IDLE_TIME * 1000UL || !auto_power_heaters_off())
+    return;
+  for(uint8_t e = 0; e < EXTRUDERS; e++)
+    if(degHotend(e) >= AUTO_POWER_SAFE_TEMP)
+      return;
+  #if defined(TEMP_BED_PIN) && TEMP_BED_PIN > -1
+  if(degBed() >= AUTO_POWER_SAFE_TEMP)
+    return;
+  #endif
+  disable_x();
+  disable_y();
+  disable_z();
+  disable_e0();
+  disable_e1();
+  disable_e2();
+  fanSpeed = 0;
+  WRITE(PS_ON_PIN, PS_ON_ASLEEP);
+  auto_power_is_on = false;
+  #ifdef ULTIPANEL
+  powersupply = false;
+  #endif
+  SERIAL_ECHO_START;
+  SERIAL_ECHOLNPGM("Power supply off");
+}
+#endif //AUTO_POWER_CONTROL
+
+// The command in the slot at bufindw is complete, length bytes with its terminator. Move on to the next slot.
+static void command_queued(int length)
+{
+  #ifdef AUTO_POWER_CONTROL
+  auto_power_queued(cmdbuffer[bufindw]);
+  #endif
+  #ifdef COMMAND_RING
+  if(!buflen)
+    cmdring_tail = cmdbuffer[bufindw];
+  cmdring_head = cmdbuffer[bufindw] + length;
+  if(cmdring_head + MAX_CMD_SIZE > cmdring + COMMAND_RING)
+    cmdring_head = cmdring;
+  #endif
+  TRACE_EVENT(fromsd[bufindw] ? TRACE_SD_LINE : TRACE_HOST_LINE, buflen + 1);
+  bufindw = (bufindw + 1)%BUFSIZE;
+  buflen += 1;
+  #ifdef COMMAND_RING
+  if(buflen < BUFSIZE) // else the slot is still the oldest command's, it gets cmdring_head when that has run
+    cmdbuffer[bufindw] = cmdring_head;
+  #endif
+}
 //static int i = 0;
 static char serial_char;
 static int serial_count = 0;
 static boolean comment_mode = false;
+// Kept up to date as the characters of a host line come in: the XOR of those before '*', and where
+// the first 'N' and '*' are (-1 while there is none), so the line is checked without scanning it again
+static uint8_t serial_checksum;
+static int serial_n_at, serial_star_at;
 static char *strchr_pointer; // just a pointer to find chars in the command string like X, Y, Z, E, etc
 
+#ifdef SERIAL_PORT_2
+// Each port assembles its lines in its own buffer, a complete line is copied to cmdbuffer, so the
+// ports never write into the same slot. serial_count, comment_mode, the line check and gcode_LastN belong
+// to the selected port, serial_port_select() keeps those of the other one here.
+#define SERIAL_PORTS 2
+typedef struct {
+  char line[MAX_CMD_SIZE];
+  int count;
+  boolean comment_mode;
+  uint8_t checksum;
+  int n_at, star_at;
+  long last_n;
+} serial_port_t;
+static serial_port_t serial_ports[SERIAL_PORTS];
+static uint8_t serial_port = 0;          // the port lines are taken from and output goes to
+static uint8_t cmdbuffer_port[BUFSIZE];  // the port each queued line came from
+#define SERIAL_LINE serial_ports[serial_port].line
+#define SERIAL_ON_FIRST_PORT (serial_port == 0)
+static void serial_port_select(uint8_t port);
+#else
+#ifdef SD_HOST_INTAKE
+static char serial_line[MAX_CMD_SIZE]; // the host line being received, apart from the SD card's lines
+#define SERIAL_LINE serial_line
+#else
+#define SERIAL_LINE cmdbuffer[bufindw]
+#endif
+#define SERIAL_ON_FIRST_PORT true
+#endif
+#if defined(SERIAL_PORT_2) || defined(SD_HOST_INTAKE)
+#define SERIAL_LINE_APART // a complete host line is copied into the slot at bufindw
+#endif
+
+#ifdef COMMAND_LOOKAHEAD
+// Host lines that were acknowledged when they came in wait here, packed one after the other without
+// line number and checksum, while the command buffer is full. They move on into it as slots free up.
+// A line that must be acknowledged after it ran is held in the slot at bufindw until the lines taken
+// in before it have moved on, no more lines are read meanwhile.
+static char lookahead_buf[COMMAND_LOOKAHEAD];
+static uint16_t lookahead_head = 0, lookahead_tail = 0, lookahead_used = 0; // in bytes
+static uint8_t lookahead_lines = 0;
+static bool lookahead_held = false;
+static void lookahead_refill();
+#define LOOKAHEAD_HELD lookahead_held
+// loop() takes in more lines while a slot is left for the next one, or the lookahead can take it
+#define COMMAND_ROOM() (!lookahead_held && buflen < BUFSIZE && \
+                        (buflen < BUFSIZE-1 || lookahead_used + MAX_CMD_SIZE <= COMMAND_LOOKAHEAD))
+#else
+#define LOOKAHEAD_HELD false
+#define COMMAND_ROOM() (buflen < (BUFSIZE-1))
+#endif
+
+#ifdef BINARY_GCODE
+// Binary frame layout, multi-byte fields are little endian:
+//  [0]      BINARY_GCODE_SYNC
+//  [1]      command letter 'G', 'M' or 'T'
+//  [2..3]   command number (uint16)
+//  [4..7]   line number (int32), checked against gcode_LastN just like N in ASCII lines
+//  [8..11]  parameter mask, bit (letter-'A') is set for every parameter present
+//  [12..]   one float per set bit, in alphabetical order
+//  [last 2] CRC16 (xmodem) over bytes 1 up to the CRC
+// The frame stays in its cmdbuffer slot, code_seen() and code_value() read the fields from there.
+#define BINARY_HEADER_SIZE 12
+#define BINARY_MAX_PARAMS ((MAX_CMD_SIZE - BINARY_HEADER_SIZE - 2) / 4)
+#define IS_BINARY_FRAME(index) ((uint8_t)cmdbuffer[index][0] == BINARY_GCODE_SYNC)
+static bool binary_receiving = false;
+static uint8_t binary_frame_size = 0; // known once the header has been received
+#endif
+
+#ifdef TOKENIZED_COMMANDS
+// The parameters of every line are parsed once when it is queued, code_seen() and code_value()
+// then only look them up. offset keeps strchr_pointer valid for commands that take a string.
+typedef struct {
+  uint32_t seen;       // bit (letter-'A') is set for each letter present on the line
+  uint8_t offset[26];  // position of the first occurrence of each letter
+  float value[26];     // number following that first occurrence
+} command_tokens_t;
+static command_tokens_t cmdtokens[BUFSIZE];
+static float *token_value; // value of the letter last found by code_seen()
+#endif
+
 const int sensitive_pins[] = SENSITIVE_PINS; // Sensitive pin list for M42
 
+#ifdef STATE_SYNC_WITH_MOVES
+// M42 and M117 wait here for the moves queued before them, each marked with the planner's block count
+#define SYNC_PIN 0
+#define SYNC_MESSAGE 1
+typedef struct {
+  unsigned char mark;  // blocks_added when it was read, due once blocks_retired reaches it
+  unsigned char type;
+  int pin;
+  unsigned char value;
+} sync_event_t;
+static sync_event_t sync_events[STATE_SYNC_WITH_MOVES];
+static uint8_t sync_head = 0;
+static uint8_t sync_count = 0;
+#ifdef ULTRA_LCD
+static char sync_message[LCD_WIDTH+1];
+#endif
+#endif
+
 //static float tt = 0;
 //static float bt = 0;
 
@@ -306,6 +662,7 @@ const int sensitive_pins[] = SENSITIVE_PINS; // Sensitive pin list for M42
 static unsigned long previous_millis_cmd = 0;
 static unsigned long max_inactive_time = 0;
 static unsigned long stepper_inactive_time = DEFAULT_STEPPER_DEACTIVE_TIME*1000l;
+static unsigned long previous_millis_move = 0;
 
 unsigned long starttime=0;
 unsigned long stoptime=0;
@@ -322,6 +679,60 @@ bool Stopped=false;
 bool CooldownNoWait = true;
 bool target_direction;
 
+#ifdef HEAT_AND_HOME
+// M700 runs its steps from loop() once its own command is done
+#define START_IDLE 0xff
+enum { START_HOME, START_PROBE, START_WAIT_BED, START_WAIT_HOTEND, START_DONE };
+static uint8_t start_step = START_IDLE;
+static bool start_in_step = false;    // a step is executing, it must not send its own "ok"
+static bool start_probe;
+static int start_hotend_temp, start_bed_temp;  // -1 if not given
+static uint8_t start_extruder;
+#endif
+
+#ifdef POWER_LOSS_RECOVERY
+// A checkpoint is taken every POWER_LOSS_INTERVAL and held until the stepper has run the moves planned
+// up to it, so the journal never claims a move that was still in the queue when the power went
+static recovery_t recovery;
+static bool recovery_pending = false;
+static uint8_t recovery_head;              // block_buffer_head when the checkpoint was taken
+static uint32_t recovery_sdpos;            // file position after the last SD command processed
+static unsigned long recovery_next_ms = 0;
+static bool recovery_in_command = false;   // M807 runs a command, it must not send its own "ok"
+#endif
+
+#ifdef PRINT_STATISTICS
+// A job that never ends, as after an abort, a reset or Stop(), counts as started but not completed
+static print_stats_t print_stats;
+static bool print_job_active = false;
+static bool print_job_sd;                  // an SD print, over once the file is closed
+static unsigned long print_job_start_ms;
+static unsigned long print_stats_counted_ms = 0; // time up to here is in print_stats
+static unsigned long print_stats_save_ms = 0;
+#endif
+
+#ifdef SD_LIST_CHUNK
+static bool ls_ok_pending = false; // the ok of M20 goes out after "End file list", the commands after it wait
+#ifdef SERIAL_PORT_2
+static uint8_t ls_ok_port;
+#endif
+#endif
+
+#ifdef NONBLOCKING_HEATUP
+// Background M109/M190 waits: 0..EXTRUDERS-1 are the hotends, HEAT_WAIT_BED the bed
+#define HEAT_WAIT_BED EXTRUDERS
+static struct {
+  bool active;
+  bool heating;         // target_direction when the wait was set
+  bool cooldownNoWait;
+  #ifdef TEMP_RESIDENCY_TIME
+  long residencyStart;
+  #endif
+} heat_wait[EXTRUDERS + 1];
+static bool heat_waiting = false;   // any wait still pending, as of the last heat_wait_pending()
+static unsigned long heat_wait_report = 0;
+#endif
+
 //Insert variables if CHDK is defined
 #ifdef CHDK
 unsigned long chdkHigh = 0;
@@ -335,6 +746,70 @@ boolean chdkActive = false;
 void get_arc_coordinates();
 bool setTargetedHotend(int code);
 
+// Acknowledges a command. With ADVANCED_OK the free planner and command buffer space is reported as well;
+// running is set for the ok of the command being run, its slot counts as free as it is released right after.
+static void serial_ok(bool running = false)
+{
+  #ifdef ADVANCED_OK
+    SERIAL_PROTOCOLPGM(MSG_OK);
+    SERIAL_PROTOCOLPGM(" P");
+    SERIAL_PROTOCOL(int(BLOCK_BUFFER_SIZE - 1 - movesplanned()));
+    SERIAL_PROTOCOLPGM(" B");
+    SERIAL_PROTOCOLLN(BUFSIZE - buflen + running);
+  #else
+    SERIAL_PROTOCOLLNPGM(MSG_OK);
+  #endif
+}
+
+#ifdef RESEND_HISTORY_SIZE
+struct resend_history_t
+{
+  long line;
+  uint16_t hash;
+};
+static resend_history_t resend_history[RESEND_HISTORY_SIZE]; // the lines taken in last
+static uint8_t resend_history_next = 0;
+static bool resend_pending = false; // a resend was asked for and the line has not come yet
+static long cmdbuffer_line[BUFSIZE]; // line number of each queued command from the host, -1 once run
+
+static uint16_t line_hash(const char *line)
+{
+  uint16_t hash = 0;
+  while(*line)
+    hash = hash * 31 + (uint8_t)*line++;
+  return hash;
+}
+
+// Take note of the line being put in the command buffer
+static void resend_history_add(long line, uint16_t hash)
+{
+  resend_history[resend_history_next].line = line;
+  resend_history[resend_history_next].hash = hash;
+  resend_history_next = (resend_history_next + 1) % RESEND_HISTORY_SIZE;
+  cmdbuffer_line[bufindw] = line;
+  resend_pending = false;
+}
+
+// For a line that does not follow gcode_LastN: true when it is dropped without asking for a resend
+static bool resend_history_skip(long line, uint16_t hash)
+{
+  if(line > gcode_LastN)
+    return resend_pending; // sent before the host got the resend request, it comes again
+  for(uint8_t i = 0; i < RESEND_HISTORY_SIZE; i++)
+  {
+    if(resend_history[i].line != line || resend_history[i].hash != hash)
+      continue;
+    // sent again as the host missed its ok. A command still queued gets its ok when it is run.
+    for(uint8_t j = 0; j < buflen; j++)
+      if(cmdbuffer_line[(bufindr + j) % BUFSIZE] == line)
+        return true;
+    serial_ok();
+    return true;
+  }
+  return false;
+}
+#endif //RESEND_HISTORY_SIZE
+
 void serial_echopair_P(const char *s_P, float v)
     { serialprintPGM(s_P); SERIAL_ECHO(v); }
 void serial_echopair_P(const char *s_P, double v)
@@ -350,45 +825,344 @@ extern "C"{
   int freeMemory() {
     int free_memory;
 
-    if((int)__brkval == 0)
-      free_memory = ((int)&free_memory) - ((int)&__bss_end);
+    if(__brkval == 0)
+      free_memory = ((uintptr_t)&free_memory) - ((uintptr_t)&__bss_end);
     else
-      free_memory = ((int)&free_memory) - ((int)__brkval);
+      free_memory = ((uintptr_t)&free_memory) - ((uintptr_t)__brkval);
 
     return free_memory;
   }
 }
 
+#ifdef MEMORY_REPORT
+// setup() fills the free RAM below the stack with STACK_PAINT, the stack overwrites it as it grows
+#define STACK_PAINT 0xA5
+#define STACK_PAINT_MARGIN 32 // bytes right below the stack pointer left alone for the painting itself
+
+static uint8_t *heap_end()
+{
+  return __brkval ? (uint8_t *)__brkval : (uint8_t *)&__bss_end;
+}
+
+static void stack_paint()
+{
+  uint8_t *top = (uint8_t *)SP;
+  for(uint8_t *p = heap_end(); p + STACK_PAINT_MARGIN < top; p++)
+    *p = STACK_PAINT;
+}
+
+// Painted bytes above the heap the stack has never reached
+static unsigned int stack_untouched()
+{
+  uint8_t *top = (uint8_t *)SP;
+  uint8_t *p = heap_end();
+  while(p < top && *p == STACK_PAINT)
+    p++;
+  return p - heap_end();
+}
+
+static void memory_report()
+{
+  unsigned int untouched = stack_untouched();
+  SERIAL_ECHO_START;
+  SERIAL_ECHOPGM("Stack max:");
+  SERIAL_ECHO((int)(RAMEND + 1 - ((int)heap_end() + untouched)));
+  SERIAL_ECHOPGM(" never used:");
+  SERIAL_ECHO(untouched);
+  SERIAL_ECHOPGM(" free now:");
+  SERIAL_ECHO(freeMemory());
+  SERIAL_ECHOPGM(" heap:");
+  SERIAL_ECHOLN((int)(__brkval ? (int)__brkval - (int)&__heap_start : 0));
+  SERIAL_ECHO_START;
+  SERIAL_ECHOPGM("block_buffer:");
+  SERIAL_ECHO((int)sizeof(block_buffer));
+  SERIAL_ECHOPGM(" cmdbuffer:");
+  #ifdef COMMAND_RING
+  SERIAL_ECHO((int)(sizeof(cmdring) + sizeof(cmdbuffer)));
+  #else
+  SERIAL_ECHO((int)sizeof(cmdbuffer));
+  #endif
+  #if UART_PRESENT(SERIAL_PORT)
+  SERIAL_ECHOPGM(" rx:");
+  SERIAL_ECHO((int)sizeof(rx_buffer));
+  #if TX_BUFFER_SIZE > 0
+  SERIAL_ECHOPGM(" tx:");
+  SERIAL_ECHO((int)sizeof(tx_buffer));
+  #endif
+  #endif
+  #ifdef SERIAL_PORT_2
+  SERIAL_ECHOPGM(" rx2:");
+  SERIAL_ECHO((int)sizeof(rx_buffer2));
+  #if TX_BUFFER_SIZE > 0
+  SERIAL_ECHOPGM(" tx2:");
+  SERIAL_ECHO((int)sizeof(tx_buffer2));
+  #endif
+  #endif
+  #ifdef SDSUPPORT
+  SERIAL_ECHOPGM(" sd cache:");
+  SERIAL_ECHO((int)sizeof(cache_t));
+  #endif
+  SERIAL_ECHOLN("");
+}
+#endif //MEMORY_REPORT
+
+#ifdef FAST_NUMBER_PARSER
+// The numbers G-code uses: blanks, an optional sign, digits and an optional fraction. Up to nine
+// significant digits are kept, scaled by one power of ten, so "12.3" comes out as 123 / 10.0. That is
+// exact up to 2^24 and otherwise at most a unit in the last place away from what strtod() returns.
+static float parse_float(const char *p)
+{
+  while(*p == ' ' || *p == '\t') p++;
+  bool negative = (*p == '-');
+  if(negative || *p == '+') p++;
+  uint32_t mantissa = 0;
+  int8_t scale = 0; // power of ten of the last digit in mantissa
+  bool fraction = false;
+  for(;; p++)
+  {
+    uint8_t digit = (uint8_t)(*p - '0');
+    if(digit < 10)
+    {
+      if(mantissa < 100000000UL)
+      {
+        mantissa = mantissa * 10 + digit;
+        if(fraction) scale--;
+      }
+      else if(!fraction)
+        scale++; // digits beyond the kept ones only count in the integer part
+    }
+    else if(*p == '.' && !fraction)
+      fraction = true;
+    else
+      break;
+  }
+  float value = mantissa;
+  if(scale != 0)
+  {
+    float power = 1.0;
+    for(int8_t i = (scale < 0 ? -scale : scale); i > 0; i--)
+      power *= 10.0;
+    value = scale < 0 ? value / power : value * power;
+  }
+  return negative ? -value : value;
+}
+
+static long parse_long(const char *p)
+{
+  while(*p == ' ' || *p == '\t') p++;
+  bool negative = (*p == '-');
+  if(negative || *p == '+') p++;
+  long value = 0;
+  for(uint8_t digit; (digit = (uint8_t)(*p - '0')) < 10; p++)
+    value = value * 10 + digit;
+  return negative ? -value : value;
+}
+#else
+#define parse_float(p) strtod(p, NULL)
+#define parse_long(p) strtol(p, NULL, 10)
+#endif //FAST_NUMBER_PARSER
+
+#ifdef LASER_RASTER
+static int8_t hex_digit(char c)
+{
+  if(c >= '0' && c <= '9') return c - '0';
+  if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return -1;
+}
+
+// G7 pixel powers from pairs of lower case hex digits, up to the first character that is none
+static uint8_t raster_decode(const char *hex, unsigned char *pixels, uint8_t size)
+{
+  uint8_t count = 0;
+  for(; count < size; count++, hex += 2)
+  {
+    int8_t high = hex_digit(hex[0]);
+    int8_t low = high < 0 ? -1 : hex_digit(hex[1]);
+    if(low < 0)
+      break;
+    pixels[count] = (high << 4) | low;
+  }
+  return count;
+}
+#endif
+
+#ifdef COMPACT_COMMANDS
+// Rewrite a checked line in place without its line number, checksum and blanks, with the command letter
+// in upper case and the leading zeros of numbers dropped. Returns the new length.
+static uint8_t compact_command(char *line)
+{
+  #ifdef SDSUPPORT
+  if(card.saving)
+    return strlen(line); // goes to the file as it came
+  #endif
+  char *from = line, *to = line;
+  while(*from == ' ' || *from == '\t') from++;
+  if(*from == 'N')
+    do from++; while(*from == ' ' || *from == '\t' || *from == '-' || (uint8_t)(*from - '0') < 10);
+  if(*from >= 'a' && *from <= 'z')
+    *from -= 'a' - 'A';
+  if(*from == 'M')
+  {
+    long code = parse_long(from + 1);
+    if(code == 23 || code == 28 || code == 30 || code == 32 || code == 117 || code == 819 || code == 928)
+      return strlen(line); // the string is read from its place after "Mxx "
+  }
+  #ifdef LASER_RASTER
+  if(*from == 'G' && parse_long(from + 1) == 7)
+    return strlen(line); // zeros of the pixels are data
+  #endif
+  for(char c; (c = *from) != 0 && c != '*'; from++)
+  {
+    if(c == ' ' || c == '\t')
+      continue;
+    if(c == '0' && to > line && (uint8_t)(from[1] - '0') < 10 && to[-1] != '.' && (uint8_t)(to[-1] - '0') >= 10)
+      continue; // a leading zero
+    *to++ = c;
+  }
+  *to = 0;
+  return to - line;
+}
+#endif //COMPACT_COMMANDS
+
 //adds an command to the main command buffer
 //thats really done in a non-safe way.
 //needs overworking someday
+#ifdef TOKENIZED_COMMANDS
+static void tokenize_command(int index)
+{
+  command_tokens_t *tokens = &cmdtokens[index];
+  char *line = cmdbuffer[index];
+  tokens->seen = 0;
+  for(uint8_t i = 0; line[i] != 0; i++)
+  {
+    uint8_t bit = (uint8_t)(line[i] - 'A');
+    if(bit >= 26 || (tokens->seen & (1UL << bit)))
+      continue;
+    tokens->seen |= 1UL << bit;
+    tokens->offset[bit] = i;
+    tokens->value[bit] = parse_float(&line[i + 1]);
+  }
+}
+#endif //TOKENIZED_COMMANDS
+
+#ifdef ACK_ON_RECEIPT
+static bool cmdbuffer_acked[BUFSIZE]; // the command got its "ok" when it came in, no second one after it ran
+
+// Commands that answer nothing but "ok" and only queue moves or set a value. They are acknowledged as
+// they come in like G0-G3, so the host sends on instead of waiting until the moves before them are planned.
+static const uint8_t ack_g_codes[] PROGMEM = { 0, 1, 2, 3, 10, 11, 90, 91, 92 };
+static const uint8_t ack_m_codes[] PROGMEM = { 17, 42, 82, 83, 104, 106, 107, 117, 140, 201, 203, 204, 205,
+                                               206, 207, 208, 209, 220, 221 };
+
+static bool ack_code(int number, const uint8_t *codes, uint8_t count)
+{
+  for(uint8_t i = 0; i < count; i++)
+    if(pgm_read_byte(&codes[i]) == number)
+      return true;
+  return false;
+}
+
+static bool ack_on_receipt(const char *line)
+{
+  #ifdef SDSUPPORT
+  if(card.saving)
+    return false; // written to the file, they get their ok then
+  #endif
+  if(*line == 'N')
+    while(*line && *line != ' ') line++;
+  while(*line == ' ') line++;
+  int number = atoi(line + 1);
+  if(*line == 'G')
+    return ack_code(number, ack_g_codes, sizeof(ack_g_codes));
+  if(*line == 'M')
+    return ack_code(number, ack_m_codes, sizeof(ack_m_codes));
+  return false;
+}
+#endif //ACK_ON_RECEIPT
+
+#ifdef COMMAND_LOOKAHEAD
+
+// Put a line in the lookahead without its line number and checksum, false when it does not fit
+static bool lookahead_push(const char *line)
+{
+  if(*line == 'N')
+  {
+    while(*line && *line != ' ') line++;
+    while(*line == ' ') line++;
+  }
+  const char *end = strchr(line, '*');
+  if(!end)
+    end = line + strlen(line);
+  while(end > line && end[-1] == ' ') end--;
+  uint16_t length = end - line;
+  if(length + 1 > COMMAND_LOOKAHEAD - lookahead_used)
+    return false;
+  for(const char *c = line; c <= end; c++)
+  {
+    lookahead_buf[lookahead_head] = c < end ? *c : 0;
+    lookahead_head = (lookahead_head + 1) % COMMAND_LOOKAHEAD;
+  }
+  lookahead_used += length + 1;
+  lookahead_lines++;
+  return true;
+}
+
+// Move the oldest line of the lookahead into the command buffer slot at bufindw
+static void lookahead_pop()
+{
+  char *line = cmdbuffer[bufindw];
+  do {
+    *line = lookahead_buf[lookahead_tail];
+    lookahead_tail = (lookahead_tail + 1) % COMMAND_LOOKAHEAD;
+    lookahead_used--;
+  } while(*line++);
+  lookahead_lines--;
+  fromsd[bufindw] = false;
+  cmdbuffer_acked[bufindw] = true;
+  #ifdef SERIAL_PORT_2
+  cmdbuffer_port[bufindw] = 0;
+  #endif
+  #ifdef RESEND_HISTORY_SIZE
+  cmdbuffer_line[bufindw] = -1; // acknowledged, a resend of it only needs the ok again
+  #endif
+  #ifdef TOKENIZED_COMMANDS
+  tokenize_command(bufindw);
+  #endif
+  command_queued(line - cmdbuffer[bufindw]);
+}
+#endif //COMMAND_LOOKAHEAD
+
 void enquecommand(const char *cmd)
 {
-  if(buflen < BUFSIZE)
+  if(COMMAND_SLOT_FREE() && !LOOKAHEAD_HELD)
   {
     //this is dangerous if a mixing of serial and this happens
     strcpy(&(cmdbuffer[bufindw][0]),cmd);
+    #ifdef TOKENIZED_COMMANDS
+    tokenize_command(bufindw);
+    #endif
     SERIAL_ECHO_START;
     SERIAL_ECHOPGM("enqueing \"");
     SERIAL_ECHO(cmdbuffer[bufindw]);
     SERIAL_ECHOLNPGM("\"");
-    bufindw= (bufindw + 1)%BUFSIZE;
-    buflen += 1;
+    command_queued(strlen(cmdbuffer[bufindw]) + 1);
   }
 }
 
 void enquecommand_P(const char *cmd)
 {
-  if(buflen < BUFSIZE)
+  if(COMMAND_SLOT_FREE() && !LOOKAHEAD_HELD)
   {
     //this is dangerous if a mixing of serial and this happens
     strcpy_P(&(cmdbuffer[bufindw][0]),cmd);
+    #ifdef TOKENIZED_COMMANDS
+    tokenize_command(bufindw);
+    #endif
     SERIAL_ECHO_START;
     SERIAL_ECHOPGM("enqueing \"");
     SERIAL_ECHO(cmdbuffer[bufindw]);
     SERIAL_ECHOLNPGM("\"");
-    bufindw= (bufindw + 1)%BUFSIZE;
-    buflen += 1;
+    command_queued(strlen(cmdbuffer[bufindw]) + 1);
   }
 }
 
@@ -466,16 +1240,124 @@ void servo_init()
   #endif
 }
 
+#ifdef PRINT_STATISTICS
+// Add the time since the last call and the filament the planner took since then to the totals
+static void print_stats_update()
+{
+  unsigned long seconds = (millis() - print_stats_counted_ms) / 1000;
+  print_stats_counted_ms += seconds * 1000;
+  print_stats.on_seconds += seconds;
+  if(print_job_active)
+  {
+    print_stats.print_seconds += seconds;
+    unsigned long job_seconds = (print_stats_counted_ms - print_job_start_ms) / 1000;
+    if(job_seconds > print_stats.longest_seconds)
+      print_stats.longest_seconds = job_seconds;
+  }
+  print_stats.filament_mm += plan_filament_steps / axis_steps_per_unit[E_AXIS];
+  plan_filament_steps = 0;
+}
+
+static void print_stats_save()
+{
+  print_stats_update();
+  Config_StorePrintStats(print_stats);
+  print_stats_save_ms = millis();
+}
+
+// M24 also resumes a paused print, the job it belongs to goes on
+static void print_job_start(bool sd)
+{
+  if(print_job_active)
+    return;
+  print_stats_update();
+  print_job_active = true;
+  print_job_sd = sd;
+  print_job_start_ms = print_stats_counted_ms;
+  print_stats.jobs_started++;
+  print_stats_save();
+}
+
+static void print_job_end(bool completed)
+{
+  if(!print_job_active)
+    return;
+  print_stats_update();
+  print_job_active = false;
+  if(completed)
+    print_stats.jobs_completed++;
+  print_stats_save();
+}
+
+// From manage_inactivity(): a stopped or cancelled job is over, the totals are saved now and then
+static void print_stats_check()
+{
+  if(print_job_active && (Stopped
+  #ifdef SDSUPPORT
+     || (print_job_sd && !card.sdprinting && !card.isFileOpen())
+  #endif
+     ))
+    print_job_end(false);
+  else if(millis() - print_stats_save_ms >= PRINT_STATISTICS_SAVE_MINUTES * 60000UL)
+    print_stats_save();
+}
+
+static void print_stats_report()
+{
+  print_stats_update();
+  SERIAL_ECHO_START;
+  SERIAL_ECHOPGM("Print jobs:");
+  SERIAL_ECHO(print_stats.jobs_started);
+  SERIAL_ECHOPGM(" completed:");
+  SERIAL_ECHO(print_stats.jobs_completed);
+  SERIAL_ECHOPGM(" failed:");
+  SERIAL_ECHO(print_stats.jobs_started - print_stats.jobs_completed - print_job_active);
+  SERIAL_ECHOPGM(" time:");
+  SERIAL_ECHO(print_stats.print_seconds);
+  SERIAL_ECHOPGM("s longest:");
+  SERIAL_ECHO(print_stats.longest_seconds);
+  SERIAL_ECHOPGM("s on:");
+  SERIAL_ECHO(print_stats.on_seconds);
+  SERIAL_ECHOPGM("s utilization:");
+  SERIAL_ECHO(print_stats.on_seconds ? 100.0 * print_stats.print_seconds / print_stats.on_seconds : 0);
+  SERIAL_ECHOPGM("% filament:");
+  SERIAL_ECHO(print_stats.filament_mm / 1000);
+  SERIAL_ECHOLNPGM("m");
+}
+#endif //PRINT_STATISTICS
+
+#if defined(BOOT_PREHEAT) && defined(__AVR__)
+// MCUSR as the reset left it, taken in .init3 before the C runtime and the constructors run. Boot
+// preheat must not miss a watchdog reset, which code running before setup() may have cleared.
+static uint8_t mcusr_at_reset __attribute__ ((section (".noinit")));
+void save_mcusr() __attribute__ ((naked, used, section (".init3")));
+void save_mcusr()
+{
+  mcusr_at_reset = MCUSR;
+}
+#endif
+
 void setup()
 {
+  #ifdef MEMORY_REPORT
+  stack_paint();
+  #endif
   setup_killpin();
   setup_powerhold();
   MYSERIAL.begin(BAUDRATE);
+  #ifdef SERIAL_PORT_2
+  MYSERIAL.port = 1;
+  MYSERIAL.begin(SERIAL_PORT_2_BAUDRATE);
+  MYSERIAL.port = 0;
+  #endif
   SERIAL_PROTOCOLLNPGM("start");
   SERIAL_ECHO_START;
 
   // Check startup - does nothing if bootloader sets MCUSR to 0
   byte mcu = MCUSR;
+  #if defined(BOOT_PREHEAT) && defined(__AVR__)
+  mcu |= mcusr_at_reset;
+  #endif
   if(mcu & 1) SERIAL_ECHOLNPGM(MSG_POWERUP);
   if(mcu & 2) SERIAL_ECHOLNPGM(MSG_EXTERNAL_RESET);
   if(mcu & 4) SERIAL_ECHOLNPGM(MSG_BROWNOUT_RESET);
@@ -510,6 +1392,12 @@ void setup()
   Config_RetrieveSettings();
 
   tp_init();    // Initialize temperature loop
+  #ifdef BOOT_PREHEAT
+  Config_BootPreheat(mcu);
+  #endif
+  #ifdef PRINT_STATISTICS
+  Config_RetrievePrintStats(print_stats);
+  #endif
   plan_init();  // Initialize planner;
   watchdog_init();
   st_init();    // Initialize stepper, this enables interrupts!
@@ -517,7 +1405,13 @@ void setup()
   servo_init();
 
   lcd_init();
+  #ifdef FAST_BOOT
+    #ifdef SDSUPPORT
+    card.initsdStart();
+    #endif
+  #else
   _delay_ms(1000);	// wait 1sec to display the splash screen
+  #endif
 
   #if defined(CONTROLLERFAN_PIN) && CONTROLLERFAN_PIN > -1
     SET_OUTPUT(CONTROLLERFAN_PIN); //Set pin used for driver cooling fan
@@ -529,17 +1423,1099 @@ void setup()
 }
 
 
-void loop()
+#ifdef NONBLOCKING_HEATUP
+static void heat_wait_start(uint8_t heater)
 {
-  if(buflen < (BUFSIZE-1))
-    get_command();
-  #ifdef SDSUPPORT
-  card.checkautostart(false);
+  heat_wait[heater].active = true;
+  heat_wait[heater].heating = target_direction;
+  heat_wait[heater].cooldownNoWait = CooldownNoWait;
+  #ifdef TEMP_RESIDENCY_TIME
+  heat_wait[heater].residencyStart = -1;
+  #endif
+  heat_waiting = true;
+  heat_wait_report = millis();
+}
+
+// Same end conditions as the blocking loops of M109 and M190
+static bool heat_wait_done(uint8_t heater)
+{
+  bool heating = heat_wait[heater].heating;
+  bool noWait = heat_wait[heater].cooldownNoWait;
+  if(heater == HEAT_WAIT_BED)
+    return !(heating ? isHeatingBed() : (isCoolingBed() && !noWait));
+  #ifdef TEMP_RESIDENCY_TIME
+    long &residencyStart = heat_wait[heater].residencyStart;
+    if ((residencyStart == -1 &&  heating && (degHotend(heater) >= (degTargetHotend(heater)-TEMP_WINDOW))) ||
+        (residencyStart == -1 && !heating && (degHotend(heater) <= (degTargetHotend(heater)+TEMP_WINDOW))) ||
+        (residencyStart > -1 && labs(degHotend(heater) - degTargetHotend(heater)) > TEMP_HYSTERESIS) )
+    {
+      residencyStart = millis();
+    }
+    return residencyStart > -1 && ((unsigned int) (millis() - residencyStart)) >= (TEMP_RESIDENCY_TIME * 1000UL);
+  #else
+    return !(heating ? isHeatingHotend(heater) : (isCoolingHotend(heater) && !noWait));
+  #endif
+}
+
+// Retire the waits that are met and report the others once a second, as M109/M190 did
+static bool heat_wait_pending()
+{
+  if(!heat_waiting)
+    return false;
+  heat_waiting = false;
+  for(uint8_t heater = 0; heater <= HEAT_WAIT_BED; heater++)
+  {
+    if(!heat_wait[heater].active)
+      continue;
+    if(heat_wait_done(heater))
+    {
+      heat_wait[heater].active = false;
+      if(heater == HEAT_WAIT_BED)
+      {
+        LCD_MESSAGEPGM(MSG_BED_DONE);
+      }
+      else
+      {
+        LCD_MESSAGEPGM(MSG_HEATING_COMPLETE);
+        starttime=millis();
+      }
+      previous_millis_cmd = millis();
+    }
+    else
+      heat_waiting = true;
+  }
+  if(heat_waiting && (millis() - heat_wait_report) > 1000UL)
+  {
+    for(uint8_t heater = 0; heater < HEAT_WAIT_BED; heater++)
+    {
+      if(!heat_wait[heater].active)
+        continue;
+      SERIAL_PROTOCOLPGM("T:");
+      SERIAL_PROTOCOL_F(degHotend(heater),1);
+      SERIAL_PROTOCOLPGM(" E:");
+      SERIAL_PROTOCOL((int)heater);
+      #ifdef TEMP_RESIDENCY_TIME
+        SERIAL_PROTOCOLPGM(" W:");
+        if(heat_wait[heater].residencyStart > -1)
+          SERIAL_PROTOCOL(((TEMP_RESIDENCY_TIME * 1000UL) - (millis() - heat_wait[heater].residencyStart)) / 1000UL);
+        else
+          SERIAL_PROTOCOLPGM("?");
+      #endif
+      SERIAL_PROTOCOLPGM(" ");
+    }
+    if(heat_wait[HEAT_WAIT_BED].active)
+    {
+      SERIAL_PROTOCOLPGM("B:");
+      SERIAL_PROTOCOL_F(degBed(),1);
+    }
+    SERIAL_PROTOCOLLN("");
+    heat_wait_report = millis();
+  }
+  return heat_waiting;
+}
+
+// True if the command at bufindr extrudes and so has to wait for the heaters
+static bool heat_wait_holds_command()
+{
+  #ifdef SDSUPPORT
+  #ifdef SD_BACKGROUND_UPLOAD
+  if(card.saving && !fromsd[bufindr])
+  #else
+  if(card.saving)
+  #endif
+    return false;
+  #endif
+  if(code_seen('G'))
+  {
+    int code = (int)code_value();
+    if(code >= 0 && code <= 3)
+      return code_seen('E');
+    return code == 10 || code == 11;
+  }
+  return false;
+}
+#endif //NONBLOCKING_HEATUP
+
+#if defined(HEAT_AND_HOME) || defined(POWER_LOSS_RECOVERY)
+// Run line in the slot of the command at bufindr, for the commands M700 and M807 go on with
+static void process_command_line(char *line)
+{
+  #ifdef COMMAND_RING
+  char *queued = cmdbuffer[bufindr]; // its place in the ring may be too short for line
+  cmdbuffer[bufindr] = line;
+  #else
+  strcpy(cmdbuffer[bufindr], line);
+  #endif
+  #ifdef TOKENIZED_COMMANDS
+  tokenize_command(bufindr);
+  #endif
+  process_commands();
+  #ifdef COMMAND_RING
+  cmdbuffer[bufindr] = queued;
+  #endif
+}
+#endif
+
+#ifdef HEAT_AND_HOME
+// Execute the remaining M700 steps as commands in the slot M700 came from
+static void run_start_sequence()
+{
+  char line[24];
+  while(start_step != START_IDLE)
+  {
+    switch(start_step++)
+    {
+      case START_HOME:
+        strcpy_P(line, PSTR("G28"));
+        break;
+      case START_PROBE:
+        #ifdef ENABLE_AUTO_BED_LEVELING
+        if(start_probe)
+        {
+          strcpy_P(line, PSTR("G29"));
+          break;
+        }
+        #endif
+        continue;
+      case START_WAIT_BED:
+        if(start_bed_temp < 0)
+          continue;
+        sprintf_P(line, PSTR("M190 S%d"), start_bed_temp);
+        break;
+      case START_WAIT_HOTEND:
+        if(start_hotend_temp < 0)
+          continue;
+        sprintf_P(line, PSTR("M109 S%d T%d"), start_hotend_temp, (int)start_extruder);
+        break;
+      default:
+        start_step = START_IDLE;
+        continue;
+    }
+    start_in_step = true;
+    process_command_line(line);
+    start_in_step = false;
+    if(Stopped)
+      start_step = START_IDLE;
+  }
+}
+#endif //HEAT_AND_HOME
+
+#ifdef POWER_LOSS_RECOVERY
+static void recovery_checkpoint()
+{
+  if(!card.sdprinting)
+  {
+    recovery_pending = false; // paused or finished, the journal already tells where
+    return;
+  }
+  if(!recovery_pending)
+  {
+    if((long)(millis() - recovery_next_ms) < 0)
+      return;
+    recovery_next_ms = millis() + POWER_LOSS_INTERVAL;
+    #ifdef SEGMENT_MERGE
+    plan_flush_pending(); // the held move is part of the commands before the checkpoint, it has to be in recovery_head
+    #endif
+    recovery.magic = RECOVERY_MAGIC;
+    recovery.sdpos = recovery_sdpos;
+    memcpy(recovery.pos, current_position, sizeof(recovery.pos));
+    recovery.feedrate = feedrate;
+    for(uint8_t e = 0; e < EXTRUDERS; e++)
+      recovery.hotendTemp[e] = degTargetHotend(e);
+    recovery.bedTemp = degTargetBed();
+    recovery.feedmultiply = feedmultiply;
+    recovery.extrudemultiply = extrudemultiply;
+    recovery.fanSpeed = fanSpeed;
+    recovery.activeExtruder = active_extruder;
+    recovery.flags = (relative_mode ? RECOVERY_RELATIVE : 0) | (axis_relative_modes[E_AXIS] ? RECOVERY_RELATIVE_E : 0);
+    recovery_head = block_buffer_head;
+    recovery_pending = true;
+  }
+  // the last block queued with the checkpoint still has to run
+  uint8_t last = (recovery_head - 1) & (BLOCK_BUFFER_SIZE - 1);
+  uint8_t tail = block_buffer_tail;
+  if(((last - tail) & (BLOCK_BUFFER_SIZE - 1)) < ((block_buffer_head - tail) & (BLOCK_BUFFER_SIZE - 1)))
+    return;
+  // the card write holds up the main loop, so only write while the queue has enough moves to run meanwhile
+  if(blocks_queued() && movesplanned() < BLOCK_BUFFER_SIZE / 2)
+    return;
+  recovery_pending = false;
+  card.writeJournal(&recovery);
+}
+
+// Run a command for M807 in the slot M807 came from
+static void recovery_command(char *line)
+{
+  recovery_in_command = true;
+  process_command_line(line);
+  recovery_in_command = false;
+}
+
+// Heat up, home X and Y and continue the print of the journal. Z has to be where the checkpoint
+// left it, it is only lifted while X and Y home. The journal has no bed leveling and G28 resets it,
+// so the rest of the print runs unleveled.
+static void recovery_resume()
+{
+  recovery_t state;
+  char name[MAXPATHNAMELENGTH];
+  char line[MAX_CMD_SIZE];
+  if(!card.readJournal(&state, name))
+  {
+    SERIAL_ECHO_START;
+    SERIAL_ECHOLNPGM("Nothing to resume");
+    return;
+  }
+
+  #if defined(TEMP_BED_PIN) && TEMP_BED_PIN > -1
+  if(state.bedTemp > 0)
+  {
+    sprintf_P(line, PSTR("M190 S%d"), state.bedTemp);
+    recovery_command(line);
+  }
+  #endif
+  for(uint8_t e = 0; e < EXTRUDERS; e++)
+  {
+    if(state.hotendTemp[e] > 0)
+    {
+      sprintf_P(line, PSTR("M109 S%d T%d"), state.hotendTemp[e], (int)e);
+      recovery_command(line);
+    }
+  }
+  if(Stopped)
+    return;
+
+  active_extruder = state.activeExtruder;
+  current_position[Z_AXIS] = state.pos[Z_AXIS];
+  current_position[E_AXIS] = state.pos[E_AXIS];
+  plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+  memcpy(destination, current_position, sizeof(destination));
+  destination[Z_AXIS] += POWER_LOSS_ZLIFT;
+  feedrate = homing_feedrate[Z_AXIS];
+  prepare_move();
+  strcpy_P(line, PSTR("G28 X0 Y0"));
+  recovery_command(line);
+
+  destination[X_AXIS] = state.pos[X_AXIS];
+  destination[Y_AXIS] = state.pos[Y_AXIS];
+  feedrate = homing_feedrate[X_AXIS];
+  prepare_move();
+  destination[Z_AXIS] = state.pos[Z_AXIS];
+  feedrate = homing_feedrate[Z_AXIS];
+  prepare_move();
+
+  feedrate = state.feedrate;
+  feedmultiply = state.feedmultiply;
+  extrudemultiply = state.extrudemultiply;
+  reset_extrusion_factors();
+  fanSpeed = state.fanSpeed;
+  relative_mode = state.flags & RECOVERY_RELATIVE;
+  axis_relative_modes[E_AXIS] = state.flags & RECOVERY_RELATIVE_E;
+
+  card.openFile(name, true);
+  card.setIndex(state.sdpos);
+  card.startFileprint();
+  starttime = millis();
+  #ifdef PRINT_STATISTICS
+  print_job_start(true); // a new job, the one cut off counts as failed
+  #endif
+  // the journal was cleared for the new start, take the first checkpoint right away
+  recovery_sdpos = state.sdpos;
+  recovery_next_ms = millis();
+}
+
+static void recovery_report()
+{
+  recovery_t state;
+  char name[MAXPATHNAMELENGTH];
+  SERIAL_ECHO_START;
+  if(!card.readJournal(&state, name))
+  {
+    SERIAL_ECHOLNPGM("Nothing to resume");
+    return;
+  }
+  SERIAL_ECHOPGM("Resume ");
+  SERIAL_ECHO(name);
+  SERIAL_ECHOPAIR(" at byte ", (unsigned long)state.sdpos);
+  SERIAL_ECHOPAIR(" X:", state.pos[X_AXIS]);
+  SERIAL_ECHOPAIR(" Y:", state.pos[Y_AXIS]);
+  SERIAL_ECHOPAIR(" Z:", state.pos[Z_AXIS]);
+  SERIAL_ECHOPAIR(" E:", state.pos[E_AXIS]);
+  SERIAL_ECHOLN("");
+}
+#endif //POWER_LOSS_RECOVERY
+
+#ifdef SD_TELEMETRY
+static bool telemetry_on = true;
+static unsigned long telemetry_interval = SD_TELEMETRY_INTERVAL;
+static unsigned long telemetry_next_ms = 0;
+
+// Take a record every telemetry_interval and write the block once it is full
+static void telemetry_log()
+{
+  if(!telemetry_on || !card.cardOK)
+    return;
+  if((long)(millis() - telemetry_next_ms) >= 0)
+  {
+    telemetry_next_ms = millis() + telemetry_interval;
+    telemetry_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.ms = millis();
+    for(uint8_t e = 0; e < EXTRUDERS; e++)
+    {
+      rec.temp[e] = degHotend(e) * 10;
+      rec.power[e] = getHeaterPower(e);
+    }
+    rec.temp[3] = degBed() * 10;
+    rec.power[3] = getHeaterPower(-1);
+    for(uint8_t i = 0; i < 3; i++)
+      rec.pos[i] = current_position[i] * 10;
+    rec.feedmultiply = feedmultiply;
+    rec.planned = movesplanned();
+    rec.commands = buflen;
+    rec.fan = fanSpeed;
+    rec.flags = (card.sdprinting ? TELEMETRY_SD_PRINTING : 0) | (Stopped ? TELEMETRY_STOPPED : 0);
+    card.telemetryAdd(&rec);
+  }
+  // the card write holds up the main loop, so only write while the queue has enough moves to run meanwhile
+  if(card.telemetryFull() && !(blocks_queued() && movesplanned() < BLOCK_BUFFER_SIZE / 2))
+    card.telemetryWrite();
+}
+#endif //SD_TELEMETRY
+
+#ifdef LOOP_LATENCY_MONITOR
+// loop() and idle() mark the part of the firmware they enter. The time between two passes of loop() and
+// between two calls of manage_heater() is a window; each window remembers the part that ran longest in it.
+// For the loop window only the parts of loop() itself count, a command waiting in idle() runs on.
+struct latency_window_t
+{
+  unsigned long start;    // micros() the window opened, 0 before the first one
+  unsigned long worst_us; // longest part in the window so far
+  const char *worst;      // and its name, in PROGMEM
+  unsigned long max_us;   // longest window
+  const char *max_in;     // the part that ran longest in it
+};
+
+static const char latency_setup[] PROGMEM = "setup";
+static const char *latency_name = latency_setup; // the part running now, in PROGMEM
+static unsigned long latency_since;              // micros() it started
+static const char *latency_outer = latency_setup; // the part of loop() running now
+static unsigned long latency_outer_since;
+static uint8_t latency_depth;                    // idle() calls running
+static latency_window_t latency_loop, latency_heat;
+static unsigned long latency_stalls;
+
+static void latency_mark(const char *name)
+{
+  unsigned long now = micros();
+  unsigned long ran = now - latency_since;
+  if(ran > latency_heat.worst_us)
+  {
+    latency_heat.worst_us = ran;
+    latency_heat.worst = latency_name;
+  }
+  latency_name = name;
+  latency_since = now;
+  if(latency_depth == 0)
+  {
+    ran = now - latency_outer_since;
+    if(ran > latency_loop.worst_us)
+    {
+      latency_loop.worst_us = ran;
+      latency_loop.worst = latency_outer;
+    }
+    latency_outer = name;
+    latency_outer_since = now;
+  }
+}
+
+// Close the window at the time of the last mark and open the next one, returns its length
+static unsigned long latency_close(latency_window_t &w)
+{
+  unsigned long gap = w.start ? latency_since - w.start : 0;
+  if(gap > w.max_us)
+  {
+    w.max_us = gap;
+    w.max_in = w.worst;
+  }
+  w.start = latency_since;
+  w.worst_us = 0;
+  return gap;
+}
+
+static void latency_loop_start()
+{
+  latency_mark(PSTR("get_command"));
+  latency_close(latency_loop);
+}
+
+void latency_heater()
+{
+  latency_mark(latency_name); // split the running part at this call
+  const char *in = latency_heat.worst;
+  unsigned long gap = latency_close(latency_heat);
+  if(gap > LOOP_STALL_MS * 1000UL)
+  {
+    latency_stalls++;
+    SERIAL_ECHO_START;
+    SERIAL_ECHOPGM("Stall ");
+    SERIAL_ECHO(gap / 1000);
+    SERIAL_ECHOPGM("ms in ");
+    serialprintPGM(in);
+    SERIAL_ECHOLN("");
+  }
+}
+
+static void latency_report_window(const char *what, const latency_window_t &w)
+{
+  SERIAL_ECHO_START;
+  serialprintPGM(what);
+  SERIAL_ECHOPGM(" max us:");
+  SERIAL_ECHO(w.max_us);
+  if(w.max_us)
+  {
+    SERIAL_ECHOPGM(" in ");
+    serialprintPGM(w.max_in);
+  }
+  SERIAL_ECHOLN("");
+}
+
+void latency_report()
+{
+  latency_report_window(PSTR("loop"), latency_loop);
+  latency_report_window(PSTR("manage_heater"), latency_heat);
+  SERIAL_ECHO_START;
+  SERIAL_ECHOPGM("stalls:");
+  SERIAL_ECHOLN(latency_stalls);
+}
+
+void latency_reset()
+{
+  latency_loop.max_us = 0;
+  latency_heat.max_us = 0;
+  latency_stalls = 0;
+}
+#define LATENCY_MARK(name) latency_mark(name)
+#else
+#define LATENCY_MARK(name)
+#endif //LOOP_LATENCY_MONITOR
+
+#ifdef SERIAL_STATS
+// The lines from the host and what went wrong with them, both ports together; MarlinSerial counts the bytes
+static struct
+{
+  unsigned long lines;
+  unsigned int checksum_errors, line_errors, resends;
+} serial_stats;
+static unsigned long serial_stats_start = 0; // millis() of the last M816 S0
+
+#ifndef AT90USB
+static void serial_stats_port(ring_buffer *rx, float seconds)
+{
+  CRITICAL_SECTION_START;
+  unsigned long received = rx->received;
+  unsigned int overflows = rx->overflows;
+  int peak = rx->peak;
+  CRITICAL_SECTION_END;
+  SERIAL_ECHOPGM(" bytes:");
+  SERIAL_ECHO(received);
+  SERIAL_ECHOPGM(" (");
+  SERIAL_ECHO(received / seconds);
+  SERIAL_ECHOPGM("/s) overflows:");
+  SERIAL_ECHO(overflows);
+  SERIAL_ECHOPGM(" peak:");
+  SERIAL_ECHO(peak);
+  SERIAL_ECHOPGM("/");
+  SERIAL_ECHO(RX_BUFFER_SIZE);
+}
+#endif
+
+static void serial_stats_report()
+{
+  float seconds = (millis() - serial_stats_start) / 1000.0;
+  if(seconds < 0.001)
+    seconds = 0.001;
+  SERIAL_ECHO_START;
+  SERIAL_ECHOPGM("Serial lines:");
+  SERIAL_ECHO(serial_stats.lines);
+  SERIAL_ECHOPGM(" (");
+  SERIAL_ECHO(serial_stats.lines / seconds);
+  SERIAL_ECHOPGM("/s) checksum errors:");
+  SERIAL_ECHO(serial_stats.checksum_errors);
+  SERIAL_ECHOPGM(" line errors:");
+  SERIAL_ECHO(serial_stats.line_errors);
+  SERIAL_ECHOPGM(" resends:");
+  SERIAL_ECHO(serial_stats.resends);
+  #ifndef AT90USB
+  serial_stats_port(&rx_buffer, seconds);
+  #ifdef SERIAL_PORT_2
+  SERIAL_ECHOPGM(" port 2");
+  serial_stats_port(&rx_buffer2, seconds);
+  #endif
+  #endif
+  SERIAL_ECHOLN("");
+}
+
+static void serial_stats_reset()
+{
+  memset(&serial_stats, 0, sizeof(serial_stats));
+  #ifndef AT90USB
+  CRITICAL_SECTION_START;
+  rx_buffer.received = rx_buffer.overflows = rx_buffer.peak = 0;
+  #ifdef SERIAL_PORT_2
+  rx_buffer2.received = rx_buffer2.overflows = rx_buffer2.peak = 0;
+  #endif
+  CRITICAL_SECTION_END;
+  #endif
+  serial_stats_start = millis();
+}
+#define SERIAL_STAT(counter) serial_stats.counter++
+#else
+#define SERIAL_STAT(counter)
+#endif //SERIAL_STATS
+
+#ifdef THROUGHPUT_BENCHMARK
+// M818: host lines still to run dry, counting the M818 itself
+static unsigned int bench_lines_left = 0;
+static unsigned int bench_lines;
+static unsigned long bench_start_ms, bench_start_blocks;
+static bool bench_dry_before;
+static float bench_position[NUM_AXIS];
+
+static void bench_start(unsigned int lines)
+{
+  st_synchronize();
+  memcpy(bench_position, current_position, sizeof(bench_position));
+  bench_dry_before = dry_planning;
+  dry_planning = true;
+  bench_lines = lines;
+  bench_lines_left = lines + 1;
+}
+
+// After each command from the host: the clock starts once M818 is done and stops after the last line
+static void bench_line_done()
+{
+  if(!bench_lines_left)
+    return;
+  if(--bench_lines_left == bench_lines)
+  {
+    bench_start_ms = millis();
+    bench_start_blocks = plan_block_count;
+    return;
+  }
+  if(bench_lines_left)
+    return;
+  st_synchronize(); // the blocks still queued are planned already
+  float seconds = (millis() - bench_start_ms) / 1000.0;
+  unsigned long blocks = plan_block_count - bench_start_blocks;
+  dry_planning = bench_dry_before;
+  memcpy(current_position, bench_position, sizeof(current_position));
+  plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+  if(seconds < 0.001)
+    seconds = 0.001;
+  SERIAL_ECHO_START;
+  SERIAL_ECHOPGM("Benchmark lines:");
+  SERIAL_ECHO(bench_lines);
+  SERIAL_ECHOPGM(" blocks:");
+  SERIAL_ECHO(blocks);
+  SERIAL_ECHOPGM(" time:");
+  SERIAL_ECHO(seconds);
+  SERIAL_ECHOPGM("s lines/s:");
+  SERIAL_ECHO(bench_lines / seconds);
+  SERIAL_ECHOPGM(" blocks/s:");
+  SERIAL_ECHOLN(blocks / seconds);
+}
+#endif //THROUGHPUT_BENCHMARK
+
+#ifdef MAIN_LOOP_TASKS
+// The background tasks, highest priority first. idle() runs the ones marked for it, loop() runs all of
+// them. A task with an interval runs at most that often, the others on every pass.
+struct main_task_t
+{
+  const char *name; // in PROGMEM
+  void (*run)();
+  uint16_t interval_ms;
+  bool in_idle;
+};
+struct main_task_stats_t
+{
+  unsigned long last_run;
+  unsigned long runs;
+  unsigned long total_us;
+  unsigned long max_us;
+};
+
+#ifdef STEP_SEGMENTS
+static const char task_segments[] PROGMEM = "st_prep_segments";
+#endif
+static const char task_heater[] PROGMEM = "manage_heater";
+static const char task_inactivity[] PROGMEM = "manage_inactivity";
+static const char task_endstops[] PROGMEM = "checkHitEndstops";
+static const char task_step_rate[] PROGMEM = "checkStepRate";
+static const char task_lcd[] PROGMEM = "lcd_update";
+#ifdef POWER_LOSS_RECOVERY
+static const char task_recovery[] PROGMEM = "recovery_checkpoint";
+#endif
+#ifdef SD_TELEMETRY
+static const char task_telemetry[] PROGMEM = "telemetry_log";
+#endif
+
+static void lcd_update_task() { lcd_update(); } // lcd_update() is inlined away without a display
+
+static const main_task_t main_tasks[] = {
+  #ifdef STEP_SEGMENTS
+  { task_segments, st_prep_segments, 0, true },
+  #endif
+  { task_heater, manage_heater, 0, true },
+  { task_inactivity, manage_inactivity, 0, true },
+  { task_endstops, checkHitEndstops, 0, false },
+  { task_step_rate, checkStepRate, 100, false },
+  { task_lcd, lcd_update_task, 0, true }
+  #ifdef POWER_LOSS_RECOVERY
+  , { task_recovery, recovery_checkpoint, 0, false }
+  #endif
+  #ifdef SD_TELEMETRY
+  , { task_telemetry, telemetry_log, 0, false }
+  #endif
+};
+#define MAIN_TASK_COUNT (sizeof(main_tasks) / sizeof(main_tasks[0]))
+static main_task_stats_t main_task_stats[MAIN_TASK_COUNT];
+
+static void run_main_tasks(bool idle_only)
+{
+  for(uint8_t i = 0; i < MAIN_TASK_COUNT; i++)
+  {
+    const main_task_t &task = main_tasks[i];
+    main_task_stats_t &stats = main_task_stats[i];
+    if(idle_only && !task.in_idle)
+      continue;
+    if(task.interval_ms && millis() - stats.last_run < task.interval_ms)
+      continue;
+    unsigned long start = micros();
+    stats.last_run = millis();
+    LATENCY_MARK(task.name);
+    task.run();
+    unsigned long elapsed = micros() - start;
+    stats.runs++;
+    stats.total_us += elapsed;
+    if(elapsed > stats.max_us)
+      stats.max_us = elapsed;
+  }
+}
+
+void main_tasks_report()
+{
+  for(uint8_t i = 0; i < MAIN_TASK_COUNT; i++)
+  {
+    SERIAL_ECHO_START;
+    serialprintPGM(main_tasks[i].name);
+    SERIAL_ECHOPGM(" runs:");
+    SERIAL_ECHO(main_task_stats[i].runs);
+    SERIAL_ECHOPGM(" avg us:");
+    SERIAL_ECHO(main_task_stats[i].runs ? main_task_stats[i].total_us / main_task_stats[i].runs : 0);
+    SERIAL_ECHOPGM(" max us:");
+    SERIAL_ECHOLN(main_task_stats[i].max_us);
+  }
+}
+
+void main_tasks_reset()
+{
+  for(uint8_t i = 0; i < MAIN_TASK_COUNT; i++)
+  {
+    main_task_stats[i].runs = 0;
+    main_task_stats[i].total_us = 0;
+    main_task_stats[i].max_us = 0;
+  }
+}
+#endif //MAIN_LOOP_TASKS
+
+#ifdef HOST_KEEPALIVE_INTERVAL
+static unsigned long keepalive_ms; // start of the command being run, then of the last busy message
+// what the busy message says the waiting command is doing, back to processing with each command
+#define KEEPALIVE_PROCESSING 0
+#define KEEPALIVE_HEATING 1
+#define KEEPALIVE_PAUSED 2
+static uint8_t keepalive_state = KEEPALIVE_PROCESSING;
+#define KEEPALIVE_STATE(state) keepalive_state = KEEPALIVE_##state
+
+// Tell the host what the waiting command is busy with, every HOST_KEEPALIVE_INTERVAL seconds
+static void host_keepalive()
+{
+  if(millis() - keepalive_ms < HOST_KEEPALIVE_INTERVAL * 1000UL)
+    return;
+  keepalive_ms = millis();
+  SERIAL_ECHO_START;
+  switch(keepalive_state)
+  {
+    case KEEPALIVE_HEATING: SERIAL_ECHOLNPGM("busy: heating"); break;
+    case KEEPALIVE_PAUSED: SERIAL_ECHOLNPGM("busy: paused for user"); break;
+    default: SERIAL_ECHOLNPGM("busy: processing"); break;
+  }
+}
+#else
+#define KEEPALIVE_STATE(state)
+#endif
+
+#ifdef BUFFER_COMMANDS_WHILE_WAITING
+static void get_serial_commands();
+
+// Take in the lines the host sends while a command waits, as loop() does, without running them
+static void idle_get_commands()
+{
+  #ifdef COMMAND_LOOKAHEAD
+  lookahead_refill();
+  #endif
+  if(!COMMAND_ROOM())
+    return;
+  char *saved_strchr_pointer = strchr_pointer; // the command being run may still read its parameters
+  #ifdef SERIAL_PORT_2
+  uint8_t saved_port = serial_port; // and answers on its own port
+  #endif
+  get_serial_commands();
+  strchr_pointer = saved_strchr_pointer;
+  #ifdef SERIAL_PORT_2
+  serial_port_select(saved_port);
+  #endif
+}
+#endif
+
+#ifdef FILAMENTCHANGEENABLE
+// M600 parks with the current feedrate and returns along the same moves: the position, feedrate and
+// extruder position it left are there again when printing resumes
+static float change_lastpos[NUM_AXIS];  // where the print was left
+static float change_target[NUM_AXIS];   // the parked position
+static float change_unload;             // the L retract, fed back by hand before resuming
+static float change_feedrate;
+
+static void filament_change_park()
+{
+  memcpy(change_lastpos, current_position, sizeof(change_lastpos));
+  memcpy(change_target, current_position, sizeof(change_target));
+  change_feedrate = feedrate;
+  //retract by E
+  if(code_seen('E'))
+  {
+    change_target[E_AXIS]+= code_value();
+  }
+  else
+  {
+    #ifdef FILAMENTCHANGE_FIRSTRETRACT
+      change_target[E_AXIS]+= FILAMENTCHANGE_FIRSTRETRACT ;
+    #endif
+  }
+  plan_buffer_line(change_target[X_AXIS], change_target[Y_AXIS], change_target[Z_AXIS], change_target[E_AXIS], change_feedrate/60, active_extruder);
+
+  //lift Z
+  if(code_seen('Z'))
+  {
+    change_target[Z_AXIS]+= code_value();
+  }
+  else
+  {
+    #ifdef FILAMENTCHANGE_ZADD
+      change_target[Z_AXIS]+= FILAMENTCHANGE_ZADD ;
+    #endif
+  }
+  plan_buffer_line(change_target[X_AXIS], change_target[Y_AXIS], change_target[Z_AXIS], change_target[E_AXIS], change_feedrate/60, active_extruder);
+
+  //move xy
+  if(code_seen('X'))
+  {
+    change_target[X_AXIS]+= code_value();
+  }
+  else
+  {
+    #ifdef FILAMENTCHANGE_XPOS
+      change_target[X_AXIS]= FILAMENTCHANGE_XPOS ;
+    #endif
+  }
+  if(code_seen('Y'))
+  {
+    change_target[Y_AXIS]= code_value();
+  }
+  else
+  {
+    #ifdef FILAMENTCHANGE_YPOS
+      change_target[Y_AXIS]= FILAMENTCHANGE_YPOS ;
+    #endif
+  }
+  plan_buffer_line(change_target[X_AXIS], change_target[Y_AXIS], change_target[Z_AXIS], change_target[E_AXIS], change_feedrate/60, active_extruder);
+
+  change_unload = 0;
+  if(code_seen('L'))
+  {
+    change_unload = code_value();
+  }
+  else
+  {
+    #ifdef FILAMENTCHANGE_FINALRETRACT
+      change_unload = FILAMENTCHANGE_FINALRETRACT ;
+    #endif
+  }
+  change_target[E_AXIS]+= change_unload;
+  plan_buffer_line(change_target[X_AXIS], change_target[Y_AXIS], change_target[Z_AXIS], change_target[E_AXIS], change_feedrate/60, active_extruder);
+}
+
+// Parked and the moves done: let go of the filament and ask for the new one
+static void filament_change_parked()
+{
+  //disable extruder steppers so filament can be removed
+  disable_e0();
+  disable_e1();
+  disable_e2();
+  delay(100);
+  LCD_ALERTMESSAGEPGM(MSG_FILAMENTCHANGE);
+}
+
+static void filament_change_beep()
+{
+  #if BEEPER > 0
+    SET_OUTPUT(BEEPER);
+
+    WRITE(BEEPER,HIGH);
+    delay(3);
+    WRITE(BEEPER,LOW);
+    delay(3);
+  #else
+    #if !defined(LCD_FEEDBACK_FREQUENCY_HZ) || !defined(LCD_FEEDBACK_FREQUENCY_DURATION_MS)
+      lcd_buzz(1000/6,100);
+    #else
+      lcd_buzz(LCD_FEEDBACK_FREQUENCY_DURATION_MS,LCD_FEEDBACK_FREQUENCY_HZ);
+    #endif
+  #endif
+}
+
+static void filament_change_resume()
+{
+  //the long retract of L is compensated by manual filament feeding
+  change_target[E_AXIS]-= change_unload;
+  current_position[E_AXIS]=change_target[E_AXIS];
+  plan_set_e_position(current_position[E_AXIS]);
+  plan_buffer_line(change_lastpos[X_AXIS], change_lastpos[Y_AXIS], change_target[Z_AXIS], change_target[E_AXIS], change_feedrate/60, active_extruder); //move xy back
+  plan_buffer_line(change_lastpos[X_AXIS], change_lastpos[Y_AXIS], change_lastpos[Z_AXIS], change_target[E_AXIS], change_feedrate/60, active_extruder); //move z back
+  plan_buffer_line(change_lastpos[X_AXIS], change_lastpos[Y_AXIS], change_lastpos[Z_AXIS], change_lastpos[E_AXIS], change_feedrate/60, active_extruder); //final untretract
+  memcpy(current_position, change_lastpos, sizeof(current_position));
+}
+
+#ifdef FILAMENTCHANGE_NONBLOCKING
+// M600 returns once the park moves are planned, loop() holds the commands after it until the click
+enum { CHANGE_IDLE, CHANGE_PARKING, CHANGE_WAITING };
+static uint8_t change_step = CHANGE_IDLE;
+static unsigned long change_beep_ms;
+
+// Move the filament change on, true while the commands after M600 have to wait
+static bool filament_change_pending()
+{
+  switch(change_step)
+  {
+    case CHANGE_PARKING:
+      if(blocks_queued())
+        return true;
+      filament_change_parked();
+      change_beep_ms = millis();
+      change_step = CHANGE_WAITING;
+      return true;
+    case CHANGE_WAITING:
+      previous_millis_cmd = millis(); // keep X, Y and Z powered, the print continues from where they are
+      KEEPALIVE_STATE(PAUSED);
+      #ifdef HOST_KEEPALIVE_INTERVAL
+      host_keepalive();
+      #endif
+      if(!lcd_clicked())
+      {
+        if(millis() - change_beep_ms > FILAMENTCHANGE_BEEP_INTERVAL)
+        {
+          change_beep_ms = millis();
+          filament_change_beep();
+        }
+        return true;
+      }
+      filament_change_resume();
+      change_step = CHANGE_IDLE;
+      return false;
+    default:
+      return false;
+  }
+}
+#endif //FILAMENTCHANGE_NONBLOCKING
+#endif //FILAMENTCHANGEENABLE
+
+#ifdef STATE_SYNC_WITH_MOVES
+// Apply the held state changes whose moves before them are done, or all when the queue ran dry
+static void sync_events_run()
+{
+  while(sync_count)
+  {
+    sync_event_t *event = &sync_events[sync_head];
+    if(blocks_queued() && (signed char)(event->mark - blocks_retired) > 0)
+      return;
+    if(event->type == SYNC_PIN)
+    {
+      pinMode(event->pin, OUTPUT);
+      digitalWrite(event->pin, event->value);
+      analogWrite(event->pin, event->value);
+    }
+    #ifdef ULTRA_LCD
+    else if(event->type == SYNC_MESSAGE)
+      lcd_setstatus(sync_message);
+    #endif
+    sync_head = (sync_head + 1)%STATE_SYNC_WITH_MOVES;
+    sync_count--;
+  }
+}
+
+// Hold a state change until the moves queued so far are done, waiting without draining them when all slots are taken
+static void sync_event_add(unsigned char type, int pin, unsigned char value)
+{
+  #ifdef SEGMENT_MERGE
+  plan_flush_pending(); // the move held back for merging comes before it
+  #endif
+  #ifdef ULTRA_LCD
+  if(type == SYNC_MESSAGE)
+  {
+    // sync_message holds the new text already, a message still pending is dropped
+    for(uint8_t i = 0; i < sync_count; i++)
+    {
+      if(sync_events[(sync_head + i)%STATE_SYNC_WITH_MOVES].type == SYNC_MESSAGE)
+      {
+        for(uint8_t j = i + 1; j < sync_count; j++)
+        {
+          uint8_t to = (sync_head + j - 1)%STATE_SYNC_WITH_MOVES;
+          sync_events[to] = sync_events[(to + 1)%STATE_SYNC_WITH_MOVES];
+        }
+        sync_count--;
+        break;
+      }
+    }
+  }
+  #endif
+  while(sync_count == STATE_SYNC_WITH_MOVES)
+    idle();
+  sync_event_t *event = &sync_events[(sync_head + sync_count)%STATE_SYNC_WITH_MOVES];
+  event->mark = blocks_added;
+  event->type = type;
+  event->pin = pin;
+  event->value = value;
+  sync_count++;
+  sync_events_run(); // at once when nothing is queued
+}
+#endif //STATE_SYNC_WITH_MOVES
+
+void idle()
+{
+  #ifdef LOOP_LATENCY_MONITOR
+  const char *waiting = latency_name; // the command or task waiting here goes on when idle() returns
+  latency_depth++;
+  #endif
+  #ifdef MAIN_LOOP_TASKS
+  run_main_tasks(true);
+  #else
+  #ifdef STEP_SEGMENTS
+  LATENCY_MARK(PSTR("st_prep_segments"));
+  st_prep_segments();
+  #endif
+  LATENCY_MARK(PSTR("manage_heater"));
+  manage_heater();
+  LATENCY_MARK(PSTR("manage_inactivity"));
+  manage_inactivity();
+  LATENCY_MARK(PSTR("lcd_update"));
+  lcd_update();
+  #endif
+  #ifdef BUFFER_COMMANDS_WHILE_WAITING
+  LATENCY_MARK(PSTR("get_command"));
+  idle_get_commands();
+  #endif
+  #ifdef HOST_KEEPALIVE_INTERVAL
+  host_keepalive();
+  #endif
+  #ifdef LOOP_LATENCY_MONITOR
+  latency_mark(waiting);
+  latency_depth--;
+  #endif
+}
+
+#ifdef SD_LIST_CHUNK
+// Send the ok of M20 once its listing is done, whatever ended it
+static void ls_ok_check()
+{
+  if(!ls_ok_pending || card.lsActive())
+    return;
+  ls_ok_pending = false;
+  #ifdef SERIAL_PORT_2
+  serial_port_select(ls_ok_port);
+  #endif
+  serial_ok();
+}
+#endif
+
+void loop()
+{
+  #ifdef LOOP_LATENCY_MONITOR
+  latency_loop_start();
+  #endif
+  #ifdef COMMAND_LOOKAHEAD
+  lookahead_refill();
+  #endif
+  #ifdef SD_HOST_INTAKE
+  get_command(); // answers the status queries with every slot taken too
+  #else
+  if(COMMAND_ROOM())
+    get_command();
+  #endif
+  #ifdef SDSUPPORT
+  LATENCY_MARK(PSTR("card"));
+  #ifdef FAST_BOOT
+  card.initsdPoll();
+  #endif
+  card.checkautostart(false);
+  #ifdef SD_LIST_CHUNK
+  card.lsContinue();
+  ls_ok_check();
+  #endif
+  #ifdef SD_PRINT_ETA
+  card.updateProgress();
+  #endif
+  #endif
+  #if defined(FILAMENTCHANGEENABLE) && defined(FILAMENTCHANGE_NONBLOCKING)
+  if(filament_change_pending())
+    ;
+  else
+  #endif
+  #ifdef SD_LIST_CHUNK
+  if(ls_ok_pending)
+    ;
+  else
+  #endif
+  #ifdef NONBLOCKING_HEATUP
+  if(buflen && !(heat_wait_pending() && heat_wait_holds_command()))
+  #else
+  if(buflen)
   #endif
-  if(buflen)
   {
+    #ifdef HOST_KEEPALIVE_INTERVAL
+    keepalive_ms = millis();
+    #endif
+    KEEPALIVE_STATE(PROCESSING);
+    LATENCY_MARK(PSTR("process_commands"));
+    #ifdef SERIAL_PORT_2
+    if(!fromsd[bufindr])
+      serial_port_select(cmdbuffer_port[bufindr]);
+    #endif
+    #ifdef SD_EXECUTED_POSITION
+    if(fromsd[bufindr])
+      plan_sdpos = cmdbuffer_sdstart[bufindr];
+    #endif
+    #ifdef PLANNER_STARVATION_STATS
+    plan_source = fromsd[bufindr] ? PLAN_SOURCE_SD : PLAN_SOURCE_SERIAL;
+    #endif
+    #ifdef AUTO_POWER_CONTROL
+    auto_power_settle();
+    #endif
     #ifdef SDSUPPORT
+      #ifdef SD_BACKGROUND_UPLOAD
+      if(card.saving && !fromsd[bufindr]) //the lines of the printed file still run
+      #else
       if(card.saving)
+      #endif
       {
         if(strstr_P(cmdbuffer[bufindr], PSTR("M29")) == NULL)
         {
@@ -550,12 +2526,12 @@ void loop()
           }
           else
           {
-            SERIAL_PROTOCOLLNPGM(MSG_OK);
+            serial_ok(true);
           }
         }
         else
         {
-          card.closefile();
+          card.closeSaveFile();
           SERIAL_PROTOCOLLNPGM(MSG_FILE_SAVED);
         }
       }
@@ -564,22 +2540,651 @@ void loop()
         process_commands();
       }
     #else
-      process_commands();
-    #endif //SDSUPPORT
-    buflen = (buflen-1);
-    bufindr = (bufindr + 1)%BUFSIZE;
+      process_commands();
+    #endif //SDSUPPORT
+    #ifdef HEAT_AND_HOME
+    run_start_sequence();
+    #endif
+    #ifdef THROUGHPUT_BENCHMARK
+    if(!fromsd[bufindr])
+      bench_line_done();
+    #endif
+    #ifdef RESEND_HISTORY_SIZE
+    cmdbuffer_line[bufindr] = -1;
+    #endif
+    #ifdef ACK_ON_RECEIPT
+    cmdbuffer_acked[bufindr] = false;
+    #endif
+    #ifdef POWER_LOSS_RECOVERY
+    if(fromsd[bufindr])
+      recovery_sdpos = cmdbuffer_sdpos[bufindr];
+    #endif
+    buflen = (buflen-1);
+    bufindr = (bufindr + 1)%BUFSIZE;
+    #ifdef COMMAND_RING
+    cmdbuffer[bufindw] = cmdring_head; // the slot may have been the one just run
+    cmdring_tail = cmdbuffer[bufindr];
+    #endif
+  }
+  #ifdef NONBLOCKING_HEATUP
+  else
+    heat_wait_pending();
+  #endif
+  #ifdef FWRETRACT_OVERLAP
+  if(retract_pending && !buflen && movesplanned() <= 1) // no travel came in before the last move started
+    retract_flush();
+  #endif
+  #ifdef MAIN_LOOP_TASKS
+  run_main_tasks(false);
+  #else
+  #ifdef STEP_SEGMENTS
+  LATENCY_MARK(PSTR("st_prep_segments"));
+  st_prep_segments();
+  #endif
+  //check heater every n milliseconds
+  LATENCY_MARK(PSTR("manage_heater"));
+  manage_heater();
+  LATENCY_MARK(PSTR("manage_inactivity"));
+  manage_inactivity();
+  LATENCY_MARK(PSTR("checkHitEndstops"));
+  checkHitEndstops();
+  checkStepRate();
+  LATENCY_MARK(PSTR("lcd_update"));
+  lcd_update();
+  #ifdef POWER_LOSS_RECOVERY
+  LATENCY_MARK(PSTR("recovery_checkpoint"));
+  recovery_checkpoint();
+  #endif
+  #ifdef SD_TELEMETRY
+  LATENCY_MARK(PSTR("telemetry_log"));
+  telemetry_log();
+  #endif
+  #endif
+}
+
+#ifdef BINARY_GCODE
+static void get_binary_byte(uint8_t c)
+{
+  char *frame = SERIAL_LINE;
+  binary_receiving = true;
+  frame[serial_count++] = c;
+  if(serial_count == BINARY_HEADER_SIZE)
+  {
+    uint32_t mask;
+    uint8_t params = 0;
+    memcpy(&mask, frame + 8, sizeof(mask));
+    for(; mask; mask >>= 1)
+      params += mask & 1;
+    if(params > BINARY_MAX_PARAMS)
+    {
+      binary_receiving = false;
+      serial_count = 0;
+      SERIAL_ERROR_START;
+      SERIAL_ERRORPGM("Binary frame too long, Last Line: ");
+      SERIAL_ERRORLN(gcode_LastN);
+      SERIAL_STAT(line_errors);
+      FlushSerialRequestResend();
+      return;
+    }
+    binary_frame_size = BINARY_HEADER_SIZE + 4 * params + 2;
+  }
+  if(serial_count <= BINARY_HEADER_SIZE || serial_count < binary_frame_size)
+    return;
+
+  // complete frame received
+  binary_receiving = false;
+  serial_count = 0;
+  #ifdef SERIAL_LINE_APART
+  memcpy(cmdbuffer[bufindw], frame, binary_frame_size);
+  frame = cmdbuffer[bufindw];
+  #endif
+  #ifdef SERIAL_PORT_2
+  cmdbuffer_port[bufindw] = serial_port;
+  #endif
+
+  uint16_t crc = 0;
+  for(uint8_t i = 1; i < binary_frame_size - 2; i++)
+    crc = _crc_xmodem_update(crc, frame[i]);
+  if(crc != ((uint8_t)frame[binary_frame_size - 2] | ((uint16_t)(uint8_t)frame[binary_frame_size - 1] << 8)))
+  {
+    SERIAL_ERROR_START;
+    SERIAL_ERRORPGM(MSG_ERR_CHECKSUM_MISMATCH);
+    SERIAL_ERRORLN(gcode_LastN);
+    SERIAL_STAT(checksum_errors);
+    FlushSerialRequestResend();
+    return;
+  }
+
+  uint16_t number = (uint8_t)frame[2] | ((uint16_t)(uint8_t)frame[3] << 8);
+  memcpy(&gcode_N, frame + 4, sizeof(gcode_N));
+  if(gcode_N != gcode_LastN+1 && !(frame[1] == 'M' && number == 110)) {
+    #ifdef RESEND_HISTORY_SIZE
+    if(resend_history_skip(gcode_N, crc))
+      return;
+    #endif
+    SERIAL_ERROR_START;
+    SERIAL_ERRORPGM(MSG_ERR_LINE_NO);
+    SERIAL_ERRORLN(gcode_LastN);
+    SERIAL_STAT(line_errors);
+    FlushSerialRequestResend();
+    return;
+  }
+  gcode_LastN = gcode_N;
+  #ifdef RESEND_HISTORY_SIZE
+  resend_history_add(gcode_N, crc);
+  #endif
+  SERIAL_STAT(lines);
+
+  #ifdef SDSUPPORT
+  if(card.saving)
+  {
+    // frames cannot be written to a file, acknowledge and drop it so the host is not stalled
+    SERIAL_ERROR_START;
+    SERIAL_ERRORLNPGM("Binary frames are not stored to SD, send ASCII while writing");
+    serial_ok();
+    return;
+  }
+  #endif //SDSUPPORT
+
+  if(frame[1] == 'G' && number <= 3)
+  {
+    if(Stopped == false) {
+      serial_ok();
+    }
+    else {
+      SERIAL_ERRORLNPGM(MSG_ERR_STOPPED);
+      LCD_MESSAGEPGM(MSG_STOPPED);
+    }
+  }
+  #ifdef TOKENIZED_COMMANDS
+  command_tokens_t *tokens = &cmdtokens[bufindw];
+  uint32_t mask;
+  memcpy(&mask, frame + 8, sizeof(mask));
+  tokens->seen = 0;
+  char *field = frame + BINARY_HEADER_SIZE;
+  for(uint8_t bit = 0; bit < 26; bit++)
+  {
+    if(!(mask & (1UL << bit)))
+      continue;
+    tokens->seen |= 1UL << bit;
+    tokens->offset[bit] = field - frame;
+    memcpy(&tokens->value[bit], field, sizeof(float));
+    field += 4;
+  }
+  uint8_t letter = frame[1] - 'A';
+  if(letter < 26) // the command letter takes precedence, as in code_seen()
+  {
+    tokens->seen |= 1UL << letter;
+    tokens->offset[letter] = 1;
+    tokens->value[letter] = number;
+  }
+  #endif //TOKENIZED_COMMANDS
+  fromsd[bufindw] = false;
+  command_queued(binary_frame_size);
+}
+#endif //BINARY_GCODE
+
+#ifdef SDSUPPORT
+#ifdef SD_FILE_HEADER
+// print time and filament of the selected file on the LCD
+static void sd_header_status()
+{
+  uint8_t found = card.header.found;
+  if(!card.isFileOpen() || !(found & (SD_HEADER_TIME | SD_HEADER_FILAMENT)))
+    return;
+  char msg[24];
+  char *p = msg;
+  *p = 0;
+  if(found & SD_HEADER_TIME)
+  {
+    unsigned long t = card.header.printSeconds;
+    p += sprintf_P(p, PSTR("%ih%02im "), (int)(t/60/60), (int)(t/60%60));
+  }
+  if(found & SD_HEADER_FILAMENT)
+  {
+    unsigned long mm = card.header.filamentMm;
+    sprintf_P(p, PSTR("%i.%im"), (int)(mm/1000), (int)(mm%1000/100));
+  }
+  lcd_setstatus(msg);
+}
+#endif
+
+static void sd_print_finished()
+{
+  SERIAL_PROTOCOLLNPGM(MSG_FILE_PRINTED);
+  stoptime=millis();
+  char time[30];
+  unsigned long t=(stoptime-starttime)/1000;
+  int hours, minutes;
+  minutes=(t/60)%60;
+  hours=t/60/60;
+  sprintf_P(time, PSTR("%i hours %i minutes"),hours, minutes);
+  SERIAL_ECHO_START;
+  SERIAL_ECHOLN(time);
+  lcd_setstatus(time);
+  card.printingHasFinished();
+  #ifdef PRINT_STATISTICS
+  if(!card.sdprinting)
+    print_job_end(true);
+  #endif
+  #ifdef DRY_PLANNING
+    if(dry_planning && !card.sdprinting)
+      plan_time_report(); // the whole file has been planned and retired
+  #endif
+  #ifdef HEATER_DUTY_STATS
+  if(!card.sdprinting)
+    heater_duty_report();
+  #endif
+  #ifdef SD_JOB_QUEUE
+  if(!card.sdprinting && card.queueNext())
+  {
+    starttime=millis();
+    #ifdef HEATER_DUTY_STATS
+    heater_duty_reset();
+    #endif
+    #ifdef PRINT_STATISTICS
+    if(card.sdprinting)
+      print_job_start(true);
+    #endif
+    return; // the next job or the one between jobs
+  }
+  #endif
+  card.checkautostart(true);
+}
+#endif //SDSUPPORT
+
+#if defined(SDSUPPORT) && defined(SD_BINARY_JOB)
+// Moves of a binary job go straight to prepare_move() while the command queue is empty,
+// so they stay in order with the text lines, which are queued as usual.
+static void get_binary_job()
+{
+  while(!card.eof() && COMMAND_SLOT_FREE())
+  {
+    int16_t type = card.peek();
+    if(type == SD_JOB_MOVE)
+    {
+      sd_job_move_t move;
+      // don't wait in plan_buffer_line(), the serial port needs looking after
+      if(buflen || Stopped || movesplanned() >= BLOCK_BUFFER_SIZE - 1)
+        return;
+      #ifdef NONBLOCKING_HEATUP
+      // binary moves skip the command queue, so hold them all until the heaters are ready
+      if(heat_waiting)
+        return;
+      #endif
+      #if defined(FILAMENTCHANGEENABLE) && defined(FILAMENTCHANGE_NONBLOCKING)
+      if(change_step != CHANGE_IDLE)
+        return;
+      #endif
+      #ifdef SD_EXECUTED_POSITION
+      plan_sdpos = card.getIndex();
+      #endif
+      #ifdef PLANNER_STARVATION_STATS
+      plan_source = PLAN_SOURCE_SD;
+      #endif
+      if(card.read(&move, sizeof(move)) != sizeof(move))
+        break; //truncated record
+      for(int8_t i=0; i < NUM_AXIS; i++)
+        destination[i] = move.pos[i] * 0.001;
+      if(move.feedrate)
+        feedrate = move.feedrate;
+      previous_millis_cmd = millis();
+      prepare_move();
+      #ifdef POWER_LOSS_RECOVERY
+      recovery_sdpos = card.getIndex();
+      #endif
+      #ifdef SD_PRINT_ETA
+      card.countMove();
+      #endif
+    }
+    else if(type == SD_JOB_GCODE)
+    {
+      uint8_t header[2];
+      #ifdef SD_EXECUTED_POSITION
+      cmdbuffer_sdstart[bufindw] = card.getIndex();
+      #endif
+      if(card.read(header, sizeof(header)) != sizeof(header) || header[1] >= MAX_CMD_SIZE ||
+         card.read(cmdbuffer[bufindw], header[1]) != header[1])
+        break; //truncated or oversized record
+      cmdbuffer[bufindw][header[1]] = 0;
+      fromsd[bufindw] = true;
+      #ifdef POWER_LOSS_RECOVERY
+      cmdbuffer_sdpos[bufindw] = card.getIndex();
+      #endif
+      #ifdef TOKENIZED_COMMANDS
+      tokenize_command(bufindw);
+      #endif
+      command_queued(header[1] + 1);
+    }
+    else
+      break; //unknown record type
+  }
+  if(card.eof())
+    sd_print_finished();
+  else if(COMMAND_SLOT_FREE())
+  {
+    SERIAL_ERROR_START;
+    SERIAL_ERRORPGM("Bad binary job record at ");
+    SERIAL_ERRORLN(card.getIndex());
+    card.pauseSDPrint();
+  }
+}
+#endif //SD_BINARY_JOB
+
+#ifdef SERIAL_PORT_2
+// Make port the one lines are taken from and output goes to
+static void serial_port_select(uint8_t port)
+{
+  if(port == serial_port)
+    return;
+  serial_ports[serial_port].count = serial_count;
+  serial_ports[serial_port].comment_mode = comment_mode;
+  serial_ports[serial_port].checksum = serial_checksum;
+  serial_ports[serial_port].n_at = serial_n_at;
+  serial_ports[serial_port].star_at = serial_star_at;
+  serial_ports[serial_port].last_n = gcode_LastN;
+  serial_port = port;
+  serial_count = serial_ports[port].count;
+  comment_mode = serial_ports[port].comment_mode;
+  serial_checksum = serial_ports[port].checksum;
+  serial_n_at = serial_ports[port].n_at;
+  serial_star_at = serial_ports[port].star_at;
+  gcode_LastN = serial_ports[port].last_n;
+  MYSERIAL.port = port;
+}
+#endif
+
+#ifdef TOOL_STANDBY
+// Bring a tool on standby back to its temperature
+static void tool_standby_resume(uint8_t e)
+{
+  if(standby_resume[e])
+  {
+    setTargetHotend(standby_resume[e], e);
+    standby_resume[e] = 0;
+  }
+}
+
+// Put the old tool on standby and bring the new one back
+static void tool_standby_switch(uint8_t from, uint8_t to)
+{
+  if(standby_temperature[from] && degTargetHotend(from) > standby_temperature[from])
+  {
+    standby_resume[from] = degTargetHotend(from);
+    setTargetHotend(standby_temperature[from], from);
+  }
+  tool_standby_resume(to);
+}
+
+// A line was taken in: when it is a T<n>, start heating that tool now instead of when the command runs
+static void tool_standby_preview(const char *line)
+{
+  if(*line == 'N')
+  {
+    while(*line && *line != ' ') line++;
+    while(*line == ' ') line++;
+  }
+  if(*line == 'T' && line[1] >= '0' && line[1] < '0' + EXTRUDERS)
+    tool_standby_resume(line[1] - '0');
+}
+#endif
+
+// Queue the host line checked in the slot at bufindw, a move is acknowledged right away
+static void queue_serial_line()
+{
+  bool move = false;
+  if((strchr(cmdbuffer[bufindw], 'G') != NULL)){
+    strchr_pointer = strchr(cmdbuffer[bufindw], 'G');
+    switch((int)parse_long(strchr_pointer + 1)){
+    case 0:
+    case 1:
+    case 2:
+    case 3:
+      move = true;
+      if(Stopped == false) { // If printer is stopped by an error the G[0-3] codes are ignored.
+    #ifdef SDSUPPORT
+        if(card.saving)
+          break;
+    #endif //SDSUPPORT
+        serial_ok();
+      }
+      else {
+        SERIAL_ERRORLNPGM(MSG_ERR_STOPPED);
+        LCD_MESSAGEPGM(MSG_STOPPED);
+      }
+      break;
+    default:
+      break;
+    }
+
+  }
+  #ifdef ACK_ON_RECEIPT
+  cmdbuffer_acked[bufindw] = !move && ack_on_receipt(cmdbuffer[bufindw]);
+  if(cmdbuffer_acked[bufindw])
+    serial_ok();
+  #endif
+  #ifdef TOKENIZED_COMMANDS
+  tokenize_command(bufindw);
+  #endif
+  command_queued(strlen(cmdbuffer[bufindw]) + 1);
+}
+
+#ifdef COMMAND_LOOKAHEAD
+// The host line in the slot at bufindw goes to the lookahead when lines before it wait there, or when
+// it would take the last free slot. True when it was taken there or is held until they moved on.
+static bool lookahead_take_line()
+{
+  if(!lookahead_lines && buflen < BUFSIZE-1)
+    return false;
+  if(SERIAL_ON_FIRST_PORT && !Stopped && ack_on_receipt(cmdbuffer[bufindw]) && lookahead_push(cmdbuffer[bufindw]))
+  {
+    serial_ok();
+    return true;
+  }
+  if(!lookahead_lines)
+    return false; // into the last slot, as without the lookahead
+  lookahead_held = true;
+  return true;
+}
+
+// Move lines from the lookahead into the free slots of the command buffer, then queue a held line
+static void lookahead_refill()
+{
+  #ifndef SERIAL_LINE_APART
+  if(!lookahead_held && serial_count)
+    return; // a line is being received into the slot at bufindw
+  #endif
+  while(lookahead_lines && buflen < BUFSIZE-1)
+  {
+    if(lookahead_held)
+    {
+      // the held line moves back by a slot, behind the one taken out
+      uint8_t next = (bufindw + 1)%BUFSIZE;
+      memcpy(cmdbuffer[next], cmdbuffer[bufindw], MAX_CMD_SIZE);
+      fromsd[next] = fromsd[bufindw];
+      #ifdef SERIAL_PORT_2
+      cmdbuffer_port[next] = cmdbuffer_port[bufindw];
+      #endif
+      #ifdef RESEND_HISTORY_SIZE
+      cmdbuffer_line[next] = cmdbuffer_line[bufindw];
+      #endif
+    }
+    lookahead_pop();
+  }
+  if(lookahead_held && !lookahead_lines)
+  {
+    lookahead_held = false;
+    #ifdef SERIAL_PORT_2
+    serial_port_select(cmdbuffer_port[bufindw]); // for its ok
+    #endif
+    queue_serial_line();
+  }
+}
+#endif //COMMAND_LOOKAHEAD
+
+// M410 and the other aborts: drop the planned moves and carry on from where the steppers stopped, so
+// no homing is needed. E keeps the position the main code is at, the filament of the dropped moves
+// counts as extruded.
+void quickstop_moves()
+{
+  quickStop();
+  float position[3];
+  plan_stepper_position(position);
+  kin_cartesian_position(position, current_position);
+  plan_set_position(position[X_AXIS], position[Y_AXIS], position[Z_AXIS], current_position[E_AXIS]);
+}
+
+// Tell the planner that the nozzle is at current_position
+static void plan_set_current_position()
+{
+  const float *motor = kin_motor_position(current_position);
+  plan_set_position(motor[X_AXIS], motor[Y_AXIS], motor[Z_AXIS], current_position[E_AXIS]);
+}
+
+#ifdef REALTIME_COMMANDS
+// The lines realtime_watch() in MarlinSerial.cpp acts on: they are answered but not queued
+static const char realtime_lines[] PROGMEM = "M112M410S000P000R000";
+
+static bool realtime_line(const char *line)
+{
+  while(*line == ' ')
+    line++;
+  if(*line == 'N') {
+    line++;
+    while((*line >= '0' && *line <= '9') || *line == '-')
+      line++;
+    while(*line == ' ')
+      line++;
+  }
+  for(const char *p = realtime_lines; pgm_read_byte(p); p += 4)
+    if(!strncmp_P(line, p, 4))
+      return !line[4] || line[4] == ' ' || line[4] == '*';
+  return false;
+}
+
+// S000: where the steppers are and whether they run
+static void realtime_report()
+{
+  SERIAL_PROTOCOLPGM("Count X:");
+  SERIAL_PROTOCOL(st_get_position(X_AXIS) / axis_steps_per_unit[X_AXIS]);
+  SERIAL_PROTOCOLPGM(" Y:");
+  SERIAL_PROTOCOL(st_get_position(Y_AXIS) / axis_steps_per_unit[Y_AXIS]);
+  SERIAL_PROTOCOLPGM(" Z:");
+  SERIAL_PROTOCOL(st_get_position(Z_AXIS) / axis_steps_per_unit[Z_AXIS]);
+  SERIAL_PROTOCOLPGM(" E:");
+  SERIAL_PROTOCOL(st_get_position(E_AXIS) / axis_steps_per_unit[E_AXIS]);
+  if(plan_feed_hold)
+    SERIAL_PROTOCOLLNPGM(" State:Hold");
+  else if(blocks_queued())
+    SERIAL_PROTOCOLLNPGM(" State:Busy");
+  else
+    SERIAL_PROTOCOLLNPGM(" State:Idle");
+}
+
+// Do what the receive interrupts found in M410 and S000 lines, from manage_inactivity() so it
+// happens while any command waits
+static void realtime_commands_run()
+{
+  if(!realtime_pending)
+    return;
+  CRITICAL_SECTION_START;
+  uint8_t pending = realtime_pending;
+  realtime_pending = 0;
+  CRITICAL_SECTION_END;
+  if(pending & REALTIME_QUICKSTOP)
+    quickstop_moves();
+  if(pending & REALTIME_REPORT)
+  {
+    #ifdef SERIAL_PORT_2
+    uint8_t saved_port = serial_port;
+    serial_port_select(0);
+    realtime_report();
+    serial_port_select(saved_port);
+    #else
+    realtime_report();
+    #endif
   }
-  //check heater every n milliseconds
-  manage_heater();
-  manage_inactivity();
-  checkHitEndstops();
-  lcd_update();
+  #ifdef SERIAL_PORT_2
+  if(pending & REALTIME_REPORT2)
+  {
+    uint8_t saved_port = serial_port;
+    serial_port_select(1);
+    realtime_report();
+    serial_port_select(saved_port);
+  }
+  #endif
 }
+#endif //REALTIME_COMMANDS
 
-void get_command()
+#ifdef SD_HOST_INTAKE
+static void temperature_report(uint8_t extruder);
+
+// 105 or 27 for M105 or M27 without parameters, which are answered as they are read, else 0
+static int status_query(const char *line)
+{
+  if(card.saving)
+    return 0; // written to the file
+  if(*line == 'N')
+    while(*line && *line != ' ') line++;
+  while(*line == ' ') line++;
+  int code;
+  if(!strncmp_P(line, PSTR("M105"), 4))
+    code = 105, line += 4;
+  else if(!strncmp_P(line, PSTR("M27"), 3))
+    code = 27, line += 3;
+  else
+    return 0;
+  while(*line == ' ') line++;
+  return !*line || *line == '*' ? code : 0;
+}
+
+// Answer a status query without queueing it, true when line was one
+static bool status_query_answered(const char *line)
+{
+  switch(status_query(line))
+  {
+    case 105:
+      temperature_report(active_extruder);
+      return true;
+    case 27:
+      card.getStatus();
+      serial_ok();
+      return true;
+  }
+  return false;
+}
+
+// With every slot taken, whether the next character can still be read: it does not end the host
+// line, or the line it ends is a status query or empty and needs no slot
+static bool host_char_readable()
+{
+  char c = MYSERIAL.peek();
+  #ifdef BINARY_GCODE
+  if(binary_receiving || (serial_count == 0 && !comment_mode && (uint8_t)c == BINARY_GCODE_SYNC && SERIAL_ON_FIRST_PORT))
+    return false;
+  #endif
+  if(c != '\n' && c != '\r' && (c != ':' || comment_mode) && serial_count < MAX_CMD_SIZE - 1)
+    return true;
+  SERIAL_LINE[serial_count] = 0;
+  return !serial_count || (!comment_mode && status_query(SERIAL_LINE));
+}
+#define HOST_CHAR_READABLE() host_char_readable()
+#else
+#define HOST_CHAR_READABLE() false
+#endif //SD_HOST_INTAKE
+
+// Take in the lines the selected serial port has received
+static void get_serial_port_commands()
 {
-  while( MYSERIAL.available() > 0  && buflen < BUFSIZE) {
+  while( MYSERIAL.available() > 0  && (COMMAND_SLOT_FREE() || HOST_CHAR_READABLE()) && !LOOKAHEAD_HELD) {
     serial_char = MYSERIAL.read();
+    #ifdef BINARY_GCODE
+    if(binary_receiving || (serial_count == 0 && !comment_mode && (uint8_t)serial_char == BINARY_GCODE_SYNC && SERIAL_ON_FIRST_PORT))
+    {
+      get_binary_byte((uint8_t)serial_char);
+      continue;
+    }
+    #endif
     if(serial_char == '\n' ||
        serial_char == '\r' ||
        (serial_char == ':' && comment_mode == false) ||
@@ -589,35 +3194,37 @@ void get_command()
         comment_mode = false; //for new command
         return;
       }
-      cmdbuffer[bufindw][serial_count] = 0; //terminate string
+      char *line = SERIAL_LINE; // copied into the slot at bufindw once it is checked
+      line[serial_count] = 0; //terminate string
       if(!comment_mode){
         comment_mode = false; //for new command
-        fromsd[bufindw] = false;
-        if(strchr(cmdbuffer[bufindw], 'N') != NULL)
+        if(serial_n_at >= 0)
         {
-          strchr_pointer = strchr(cmdbuffer[bufindw], 'N');
-          gcode_N = (strtol(&cmdbuffer[bufindw][strchr_pointer - cmdbuffer[bufindw] + 1], NULL, 10));
-          if(gcode_N != gcode_LastN+1 && (strstr_P(cmdbuffer[bufindw], PSTR("M110")) == NULL) ) {
+          gcode_N = parse_long(&line[serial_n_at + 1]);
+          if(gcode_N != gcode_LastN+1 && (strstr_P(line, PSTR("M110")) == NULL) ) {
+            #ifdef RESEND_HISTORY_SIZE
+            if(SERIAL_ON_FIRST_PORT && resend_history_skip(gcode_N, line_hash(line))) {
+              serial_count = 0;
+              return;
+            }
+            #endif
             SERIAL_ERROR_START;
             SERIAL_ERRORPGM(MSG_ERR_LINE_NO);
             SERIAL_ERRORLN(gcode_LastN);
             //Serial.println(gcode_N);
+            SERIAL_STAT(line_errors);
             FlushSerialRequestResend();
             serial_count = 0;
             return;
           }
 
-          if(strchr(cmdbuffer[bufindw], '*') != NULL)
+          if(serial_star_at >= 0)
           {
-            byte checksum = 0;
-            byte count = 0;
-            while(cmdbuffer[bufindw][count] != '*') checksum = checksum^cmdbuffer[bufindw][count++];
-            strchr_pointer = strchr(cmdbuffer[bufindw], '*');
-
-            if( (int)(strtod(&cmdbuffer[bufindw][strchr_pointer - cmdbuffer[bufindw] + 1], NULL)) != checksum) {
+            if( (int)parse_long(&line[serial_star_at + 1]) != serial_checksum) {
               SERIAL_ERROR_START;
               SERIAL_ERRORPGM(MSG_ERR_CHECKSUM_MISMATCH);
               SERIAL_ERRORLN(gcode_LastN);
+              SERIAL_STAT(checksum_errors);
               FlushSerialRequestResend();
               serial_count = 0;
               return;
@@ -629,140 +3236,260 @@ void get_command()
             SERIAL_ERROR_START;
             SERIAL_ERRORPGM(MSG_ERR_NO_CHECKSUM);
             SERIAL_ERRORLN(gcode_LastN);
+            SERIAL_STAT(checksum_errors);
             FlushSerialRequestResend();
             serial_count = 0;
             return;
           }
 
           gcode_LastN = gcode_N;
+          #ifdef RESEND_HISTORY_SIZE
+          if(SERIAL_ON_FIRST_PORT)
+            resend_history_add(gcode_N, line_hash(line));
+          #endif
           //if no errors, continue parsing
         }
         else  // if we don't receive 'N' but still see '*'
         {
-          if((strchr(cmdbuffer[bufindw], '*') != NULL))
+          #ifdef RESEND_HISTORY_SIZE
+          // with a checksum it is the tail of a numbered line cut short, the receive buffer is not flushed;
+          // a line without one is a command of its own, e.g. the host polling M105, and is answered as usual
+          if(resend_pending && SERIAL_ON_FIRST_PORT && serial_star_at >= 0) {
+            serial_count = 0;
+            return;
+          }
+          #endif
+          if(serial_star_at >= 0)
           {
             SERIAL_ERROR_START;
             SERIAL_ERRORPGM(MSG_ERR_NO_LINENUMBER_WITH_CHECKSUM);
             SERIAL_ERRORLN(gcode_LastN);
+            SERIAL_STAT(line_errors);
             serial_count = 0;
             return;
           }
         }
-        if((strchr(cmdbuffer[bufindw], 'G') != NULL)){
-          strchr_pointer = strchr(cmdbuffer[bufindw], 'G');
-          switch((int)((strtod(&cmdbuffer[bufindw][strchr_pointer - cmdbuffer[bufindw] + 1], NULL)))){
-          case 0:
-          case 1:
-          case 2:
-          case 3:
-            if(Stopped == false) { // If printer is stopped by an error the G[0-3] codes are ignored.
-          #ifdef SDSUPPORT
-              if(card.saving)
-                break;
-          #endif //SDSUPPORT
-              SERIAL_PROTOCOLLNPGM(MSG_OK);
-            }
-            else {
-              SERIAL_ERRORLNPGM(MSG_ERR_STOPPED);
-              LCD_MESSAGEPGM(MSG_STOPPED);
-            }
-            break;
-          default:
-            break;
-          }
-
+        SERIAL_STAT(lines);
+        #ifdef REALTIME_COMMANDS
+        if(realtime_line(line)) { // the receive interrupt acted on it already
+          serial_ok();
+          serial_count = 0;
+          return;
         }
-        bufindw = (bufindw + 1)%BUFSIZE;
-        buflen += 1;
+        #endif
+        #ifdef SD_HOST_INTAKE
+        if(status_query_answered(line)) {
+          serial_count = 0;
+          return;
+        }
+        #endif
+        #ifdef SERIAL_LINE_APART
+        memcpy(cmdbuffer[bufindw], line, serial_count + 1);
+        #endif
+        #ifdef SERIAL_PORT_2
+        cmdbuffer_port[bufindw] = serial_port;
+        #endif
+        fromsd[bufindw] = false;
+        #ifdef COMPACT_COMMANDS
+        compact_command(cmdbuffer[bufindw]);
+        #endif
+        #ifdef TOOL_STANDBY
+        tool_standby_preview(cmdbuffer[bufindw]);
+        #endif
+        #ifdef COMMAND_LOOKAHEAD
+        if(!lookahead_take_line())
+        #endif
+        queue_serial_line();
       }
       serial_count = 0; //clear buffer
     }
     else
     {
       if(serial_char == ';') comment_mode = true;
-      if(!comment_mode) cmdbuffer[bufindw][serial_count++] = serial_char;
+      if(!comment_mode) {
+        if(!serial_count) { // a new line
+          serial_checksum = 0;
+          serial_n_at = serial_star_at = -1;
+        }
+        if(serial_star_at < 0) {
+          if(serial_char == '*')
+            serial_star_at = serial_count;
+          else
+            serial_checksum ^= serial_char;
+        }
+        if(serial_char == 'N' && serial_n_at < 0)
+          serial_n_at = serial_count;
+        SERIAL_LINE[serial_count++] = serial_char;
+      }
     }
   }
-  #ifdef SDSUPPORT
+}
+
+static void get_serial_commands()
+{
+  #ifdef SERIAL_PORT_2
+  // the second port first, the first one stays selected for the SD card and the messages that follow
+  uint8_t port = SERIAL_PORTS;
+  do {
+    serial_port_select(--port);
+    get_serial_port_commands();
+  } while(port);
+  #else
+  get_serial_port_commands();
+  #endif
+}
+
+#ifdef SDSUPPORT
+#ifdef SD_HOST_INTAKE
+// The card leaves the last slot to a host line that is coming in
+#define SD_SLOT_FREE() (COMMAND_SLOT_FREE() && (buflen < BUFSIZE-1 || (!serial_count && !MYSERIAL.available())))
+#else
+#define SD_SLOT_FREE() COMMAND_SLOT_FREE()
+#endif
+
+// Take in the lines of the file being printed
+static void get_sd_commands()
+{
+  #ifdef SD_HOST_INTAKE
+  if(!card.sdprinting)
+    return;
+  #else
   if(!card.sdprinting || serial_count!=0){
     return;
   }
+  #endif
+  #ifdef COMMAND_LOOKAHEAD
+  if(lookahead_held)
+    return; // the slot at bufindw is taken by a host line
+  #endif
 
   //'#' stops reading from SD to the buffer prematurely, so procedural macro calls are possible
   // if it occurs, stop_buffering is triggered and the buffer is ran dry.
   // this character _can_ occur in serial com, due to checksums. however, no checksums are used in SD printing
 
+  #ifdef SD_BINARY_JOB
+  if(card.binaryjob){
+    get_binary_job();
+    return;
+  }
+  #endif
+
   static bool stop_buffering=false;
   if(buflen==0) stop_buffering=false;
 
-  while( !card.eof()  && buflen < BUFSIZE && !stop_buffering) {
-    int16_t n=card.get();
-    serial_char = (char)n;
-    if(serial_char == '\n' ||
-       serial_char == '\r' ||
-       (serial_char == '#' && comment_mode == false) ||
-       (serial_char == ':' && comment_mode == false) ||
-       serial_count >= (MAX_CMD_SIZE - 1)||n==-1)
-    {
-      if(card.eof()){
-        SERIAL_PROTOCOLLNPGM(MSG_FILE_PRINTED);
-        stoptime=millis();
-        char time[30];
-        unsigned long t=(stoptime-starttime)/1000;
-        int hours, minutes;
-        minutes=(t/60)%60;
-        hours=t/60/60;
-        sprintf_P(time, PSTR("%i hours %i minutes"),hours, minutes);
-        SERIAL_ECHO_START;
-        SERIAL_ECHOLN(time);
-        lcd_setstatus(time);
-        card.printingHasFinished();
-        card.checkautostart(true);
-
-      }
-      if(serial_char=='#')
-        stop_buffering=true;
-
-      if(!serial_count)
-      {
-        comment_mode = false; //for new command
-        return; //if empty line
-      }
-      cmdbuffer[bufindw][serial_count] = 0; //terminate string
-//      if(!comment_mode){
-        fromsd[bufindw] = true;
-        buflen += 1;
-        bufindw = (bufindw + 1)%BUFSIZE;
-//      }
-      comment_mode = false; //for new command
-      serial_count = 0; //clear buffer
-    }
-    else
-    {
-      if(serial_char == ';') comment_mode = true;
-      if(!comment_mode) cmdbuffer[bufindw][serial_count++] = serial_char;
+  while( !card.eof()  && SD_SLOT_FREE() && !stop_buffering) {
+    #ifdef SD_EXECUTED_POSITION
+    cmdbuffer_sdstart[bufindw] = card.getIndex();
+    #endif
+    char terminator;
+    int count = card.getLine(cmdbuffer[bufindw], MAX_CMD_SIZE, &terminator);
+    if(card.eof()){
+      sd_print_finished();
     }
+    if(terminator=='#')
+      stop_buffering=true;
+
+    if(!count)
+      return; //if empty line
+    fromsd[bufindw] = true;
+    #ifdef POWER_LOSS_RECOVERY
+    cmdbuffer_sdpos[bufindw] = card.getIndex();
+    #endif
+    #ifdef COMPACT_COMMANDS
+    count = compact_command(cmdbuffer[bufindw]);
+    #endif
+    #ifdef TOOL_STANDBY
+    tool_standby_preview(cmdbuffer[bufindw]);
+    #endif
+    #ifdef TOKENIZED_COMMANDS
+    tokenize_command(bufindw);
+    #endif
+    command_queued(count + 1);
   }
+}
+#endif //SDSUPPORT
 
-  #endif //SDSUPPORT
-
+void get_command()
+{
+  #ifdef SD_HOST_INTAKE
+  #ifdef SERIAL_PORT_2
+  serial_port_select(0); // for the card's messages, and the slot it leaves goes to this port
+  #endif
+  get_sd_commands(); // first, it leaves the host a slot
+  get_serial_commands();
+  #else
+  get_serial_commands();
+  #ifdef SDSUPPORT
+  get_sd_commands();
+  #endif
+  #endif
 }
 
 
 float code_value()
 {
-  return (strtod(&cmdbuffer[bufindr][strchr_pointer - cmdbuffer[bufindr] + 1], NULL));
+#ifdef TOKENIZED_COMMANDS
+  return *token_value;
+#else
+  #ifdef BINARY_GCODE
+  if(IS_BINARY_FRAME(bufindr))
+  {
+    if(strchr_pointer == &cmdbuffer[bufindr][1]) // the command letter, number follows as uint16
+      return (uint8_t)strchr_pointer[1] | ((uint16_t)(uint8_t)strchr_pointer[2] << 8);
+    float value;
+    memcpy(&value, strchr_pointer, sizeof(value));
+    return value;
+  }
+  #endif
+  return parse_float(strchr_pointer + 1);
+#endif //TOKENIZED_COMMANDS
 }
 
 long code_value_long()
 {
-  return (strtol(&cmdbuffer[bufindr][strchr_pointer - cmdbuffer[bufindr] + 1], NULL, 10));
+  #ifdef BINARY_GCODE
+  if(IS_BINARY_FRAME(bufindr))
+    return (long)code_value();
+  #endif
+  return parse_long(strchr_pointer + 1);
 }
 
 bool code_seen(char code)
 {
+#ifdef TOKENIZED_COMMANDS
+  uint8_t bit = (uint8_t)(code - 'A');
+  if(bit >= 26 || !(cmdtokens[bufindr].seen & (1UL << bit)))
+    return false;
+  strchr_pointer = cmdbuffer[bufindr] + cmdtokens[bufindr].offset[bit];
+  token_value = &cmdtokens[bufindr].value[bit];
+  return true;
+#else
+  #ifdef BINARY_GCODE
+  if(IS_BINARY_FRAME(bufindr))
+  {
+    char *frame = cmdbuffer[bufindr];
+    if(code == frame[1])
+    {
+      strchr_pointer = frame + 1;
+      return true;
+    }
+    if(code < 'A' || code > 'Z')
+      return false;
+    uint32_t mask;
+    memcpy(&mask, frame + 8, sizeof(mask));
+    uint8_t bit = code - 'A';
+    if(!(mask & (1UL << bit)))
+      return false;
+    uint8_t index = 0;
+    for(uint8_t i = 0; i < bit; i++)
+      if(mask & (1UL << i)) index++;
+    strchr_pointer = frame + BINARY_HEADER_SIZE + 4 * index;
+    return true;
+  }
+  #endif
   strchr_pointer = strchr(cmdbuffer[bufindr], code);
   return (strchr_pointer != NULL);  //Return True if a character was found
+#endif //TOKENIZED_COMMANDS
 }
 
 #define DEFINE_PGM_READ_ANY(type, reader)       \
@@ -783,6 +3510,7 @@ XYZ_CONSTS_FROM_CONFIG(float, base_max_pos,    MAX_POS);
 XYZ_CONSTS_FROM_CONFIG(float, base_home_pos,   HOME_POS);
 XYZ_CONSTS_FROM_CONFIG(float, max_length,      MAX_LENGTH);
 XYZ_CONSTS_FROM_CONFIG(float, home_retract_mm, HOME_RETRACT_MM);
+XYZ_CONSTS_FROM_CONFIG(float, home_bump_divisor, HOME_BUMP_DIVISOR);
 XYZ_CONSTS_FROM_CONFIG(signed char, home_dir,  HOME_DIR);
 
 #ifdef DUAL_X_CARRIAGE
@@ -799,8 +3527,14 @@ XYZ_CONSTS_FROM_CONFIG(signed char, home_dir,  HOME_DIR);
 #define DXC_FULL_CONTROL_MODE 0
 #define DXC_AUTO_PARK_MODE    1
 #define DXC_DUPLICATION_MODE  2
+#define DXC_MIRRORED_MODE     3
 static int dual_x_carriage_mode = DEFAULT_DUAL_X_CARRIAGE_MODE;
 
+// Modes 2 and 3 print with both carriages, the second one following the first
+static bool dual_x_duplicating() {
+  return dual_x_carriage_mode == DXC_DUPLICATION_MODE || dual_x_carriage_mode == DXC_MIRRORED_MODE;
+}
+
 static float x_home_pos(int extruder) {
   if (extruder == 0)
     return base_home_pos(X_AXIS) + add_homeing[X_AXIS];
@@ -820,9 +3554,17 @@ static float inactive_extruder_x_pos = X2_MAX_POS; // used in mode 0 & 1
 static bool active_extruder_parked = false; // used in mode 1 & 2
 static float raised_parked_position[NUM_AXIS]; // used in mode 1
 static unsigned long delayed_move_time = 0; // used in mode 1
-static float duplicate_extruder_x_offset = DEFAULT_DUPLICATION_X_OFFSET; // used in mode 2
-static float duplicate_extruder_temp_offset = 0; // used in mode 2
-bool extruder_duplication_enabled = false; // used in mode 2
+static float duplicate_extruder_x_offset = DEFAULT_DUPLICATION_X_OFFSET; // used in mode 2 & 3
+static float duplicate_extruder_temp_offset = 0; // used in mode 2 & 3
+bool extruder_duplication_enabled = false; // used in mode 2 & 3
+bool extruder_duplication_mirrored = false; // used in mode 3, the second carriage moves the other way
+
+// Where the second carriage follows the first one at x to, in mode 2 & 3
+static float duplicate_extruder_x(float x) {
+  if (dual_x_carriage_mode == DXC_MIRRORED_MODE)
+    return 2 * x_home_pos(0) + duplicate_extruder_x_offset - x; // the offset away at home, closing in as x moves away
+  return x + duplicate_extruder_x_offset;
+}
 #endif //DUAL_X_CARRIAGE
 
 static void axis_is_at_home(int axis) {
@@ -834,10 +3576,16 @@ static void axis_is_at_home(int axis) {
       max_pos[X_AXIS] =          max(extruder_offset[X_AXIS][1], X2_MAX_POS);
       return;
     }
-    else if (dual_x_carriage_mode == DXC_DUPLICATION_MODE && active_extruder == 0) {
+    else if (dual_x_duplicating() && active_extruder == 0) {
       current_position[X_AXIS] = base_home_pos(X_AXIS) + add_homeing[X_AXIS];
       min_pos[X_AXIS] =          base_min_pos(X_AXIS) + add_homeing[X_AXIS];
-      max_pos[X_AXIS] =          min(base_max_pos(X_AXIS) + add_homeing[X_AXIS],
+      if (dual_x_carriage_mode == DXC_MIRRORED_MODE)
+        // the second carriage starts duplicate_extruder_x_offset away and comes closer by twice the
+        // distance the first one moves, they must stay apart by what X2_MIN_POS keeps from home
+        max_pos[X_AXIS] =        min(base_max_pos(X_AXIS) + add_homeing[X_AXIS],
+                                  current_position[X_AXIS] + (duplicate_extruder_x_offset - X2_MIN_POS + current_position[X_AXIS]) / 2);
+      else
+        max_pos[X_AXIS] =        min(base_max_pos(X_AXIS) + add_homeing[X_AXIS],
                                   max(extruder_offset[X_AXIS][1], X2_MAX_POS) - duplicate_extruder_x_offset);
       return;
     }
@@ -850,11 +3598,13 @@ static void axis_is_at_home(int axis) {
 
 #ifdef ENABLE_AUTO_BED_LEVELING
 #ifdef AUTO_BED_LEVELING_GRID
+#ifndef MESH_BED_LEVELING
 static void set_bed_level_equation_lsq(double *plane_equation_coefficients)
 {
     vector_3 planeNormal = vector_3(-plane_equation_coefficients[0], -plane_equation_coefficients[1], 1);
     planeNormal.debug("planeNormal");
     plan_bed_level_matrix = matrix_3x3::create_look_at(planeNormal);
+    plan_bed_level_changed();
     //bedLevel.debug("bedLevel");
 
     //plan_bed_level_matrix.debug("bed level before");
@@ -873,6 +3623,22 @@ static void set_bed_level_equation_lsq(double *plane_equation_coefficients)
     plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
 }
 
+#else // MESH_BED_LEVELING
+// bed_level_mesh holds the probed heights, last_z is the one the probe is still at
+static void set_bed_level_mesh(float last_z)
+{
+    for (int8_t yCount = 0; yCount < AUTO_BED_LEVELING_GRID_POINTS; yCount++)
+      for (int8_t xCount = 0; xCount < AUTO_BED_LEVELING_GRID_POINTS; xCount++)
+        bed_level_mesh[yCount][xCount] -= last_z;
+    bed_level_mesh_active = true;
+
+    // The probe sits at zprobe_zoffset above the mesh height 0, the nozzle above a bed that is
+    // mesh_z_offset() higher
+    current_position[Z_AXIS] = zprobe_zoffset - mesh_z_offset(current_position[X_AXIS], current_position[Y_AXIS]);
+    plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+}
+#endif
+
 #else // not AUTO_BED_LEVELING_GRID
 
 static void set_bed_level_equation_3pts(float z_at_pt_1, float z_at_pt_2, float z_at_pt_3) {
@@ -889,6 +3655,7 @@ static void set_bed_level_equation_3pts(float z_at_pt_1, float z_at_pt_2, float
     planeNormal = vector_3(planeNormal.x, planeNormal.y, abs(planeNormal.z));
 
     plan_bed_level_matrix = matrix_3x3::create_look_at(planeNormal);
+    plan_bed_level_changed();
 
     vector_3 corrected_position = plan_get_position();
     current_position[X_AXIS] = corrected_position.x;
@@ -904,9 +3671,33 @@ static void set_bed_level_equation_3pts(float z_at_pt_1, float z_at_pt_2, float
 
 #endif // AUTO_BED_LEVELING_GRID
 
+#ifndef Z_PROBE_SPEED_FAST
+  #define Z_PROBE_SPEED_FAST homing_feedrate[Z_AXIS]
+#endif
+#ifndef Z_PROBE_SPEED_SLOW
+  #define Z_PROBE_SPEED_SLOW (Z_PROBE_SPEED_FAST/4)
+#endif
+#ifndef Z_PROBE_RETRACT
+  #define Z_PROBE_RETRACT home_retract_mm(Z_AXIS)
+#endif
+
+#if defined(AUTO_BED_LEVELING_GRID) && defined(AUTO_BED_LEVELING_ADAPTIVE)
+// The rows or columns of the probe grid, from first + lo * spacing to first + hi * spacing, that
+// take in from..to. At least two, so a plane can still be fitted.
+static void grid_range(float from, float to, int first, int spacing, int &lo, int &hi)
+{
+    lo = constrain((int)floor((from - first) / spacing), 0, AUTO_BED_LEVELING_GRID_POINTS - 2);
+    hi = constrain((int)ceil((to - first) / spacing), lo + 1, AUTO_BED_LEVELING_GRID_POINTS - 1);
+}
+#endif
+
 static void run_z_probe() {
     plan_bed_level_matrix.set_to_identity();
-    feedrate = homing_feedrate[Z_AXIS];
+    plan_bed_level_changed();
+  #ifdef MESH_BED_LEVELING
+    bed_level_mesh_active = false;
+  #endif
+    feedrate = Z_PROBE_SPEED_FAST;
 
     // move down until you find the bed
     float zPosition = -10;
@@ -918,13 +3709,13 @@ static void run_z_probe() {
     plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], zPosition, current_position[E_AXIS]);
 
     // move up the retract distance
-    zPosition += home_retract_mm(Z_AXIS);
+    zPosition += Z_PROBE_RETRACT;
     plan_buffer_line(current_position[X_AXIS], current_position[Y_AXIS], zPosition, current_position[E_AXIS], feedrate/60, active_extruder);
     st_synchronize();
 
     // move back down slowly to find bed
-    feedrate = homing_feedrate[Z_AXIS]/4;
-    zPosition -= home_retract_mm(Z_AXIS) * 2;
+    feedrate = Z_PROBE_SPEED_SLOW;
+    zPosition -= Z_PROBE_RETRACT * 2;
     plan_buffer_line(current_position[X_AXIS], current_position[Y_AXIS], zPosition, current_position[E_AXIS], feedrate/60, active_extruder);
     st_synchronize();
 
@@ -1024,6 +3815,134 @@ static float probe_pt(float x, float y, float z_before) {
   return measured_z;
 }
 
+#ifdef Z_DUAL_AUTO_ALIGN
+// G34: probe next to both Z screws and raise the low side with its motor alone. A side reads higher
+// when it hangs lower, since the probe reaches the bed there first.
+static void z_dual_align()
+{
+  st_synchronize();
+  plan_bed_level_matrix.set_to_identity();
+  plan_bed_level_changed();
+  vector_3 uncorrected_position = plan_get_position();
+  current_position[X_AXIS] = uncorrected_position.x;
+  current_position[Y_AXIS] = uncorrected_position.y;
+  current_position[Z_AXIS] = uncorrected_position.z;
+  plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+  setup_for_endstop_move();
+  feedrate = homing_feedrate[Z_AXIS];
+
+  // a difference between the probe points grows out to the screws
+  const float screw_scale = (Z_DUAL_ALIGN_SCREW_X2 - Z_DUAL_ALIGN_SCREW_X1)
+                            / (Z_DUAL_ALIGN_X2 - Z_DUAL_ALIGN_X1);
+  float z_before = Z_RAISE_BEFORE_PROBING;
+  for (uint8_t round = 1; round <= Z_DUAL_ALIGN_ITERATIONS; round++) {
+    float z1 = probe_pt(Z_DUAL_ALIGN_X1, Z_DUAL_ALIGN_Y1, z_before);
+    float z2 = probe_pt(Z_DUAL_ALIGN_X2, Z_DUAL_ALIGN_Y2, current_position[Z_AXIS] + Z_RAISE_BETWEEN_PROBINGS);
+    float difference = (z1 - z2) * screw_scale;
+    SERIAL_PROTOCOLPGM("Z2-Z difference: ");
+    SERIAL_PROTOCOLLN(difference);
+    if (fabs(difference) <= Z_DUAL_ALIGN_ACCURACY)
+      break;
+
+    // up by the difference on the low side only, the nozzle ends where the high side was
+    z_dual_steppers = difference > 0 ? Z_DUAL_Z_STEPPER : Z_DUAL_Z2_STEPPER;
+    float z = current_position[Z_AXIS];
+    do_blocking_move_to(current_position[X_AXIS], current_position[Y_AXIS], z + fabs(difference));
+    z_dual_steppers = Z_DUAL_Z_STEPPER | Z_DUAL_Z2_STEPPER;
+    current_position[Z_AXIS] = z;
+    plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+    z_before = current_position[Z_AXIS] + Z_RAISE_BETWEEN_PROBINGS;
+  }
+  clean_up_after_endstop_move();
+  axis_known_position[Z_AXIS] = false; // the gantry moved against the Z endstop
+}
+#endif
+
+#ifdef DELTA_AUTO_CALIBRATION
+// Corrections fitted by G33, added to the current settings
+#define DELTA_CAL_ENDSTOP 0 // endstop_adj X, Y, Z
+#define DELTA_CAL_RADIUS 3
+#define DELTA_CAL_ANGLE 3   // + (Y_AXIS or Z_AXIS) for the tower angles, the X tower stays put
+#define DELTA_CAL_PARAMS 6
+
+// Effector Z of the carriage heights (tower positions in mm) with the corrections k applied, found by
+// intersecting the three rod spheres and taking the lower point
+static float delta_forward_z(const float *carriage, const float *k)
+{
+  static const float tower_angle[3] = { 210, 330, 90 }; // as in recalc_delta_settings()
+  float p[3][3];
+  for (int8_t j = 0; j < 3; j++) {
+    float r = delta_radius + delta_radius_trim[j] + k[DELTA_CAL_RADIUS];
+    float a = radians(tower_angle[j] + delta_tower_angle_trim[j] + (j == X_AXIS ? 0 : k[DELTA_CAL_ANGLE + j]));
+    p[j][X_AXIS] = r * cos(a);
+    p[j][Y_AXIS] = r * sin(a);
+    p[j][Z_AXIS] = carriage[j] + k[DELTA_CAL_ENDSTOP + j];
+  }
+  // unit vectors ex towards tower 2, ey towards tower 3 in their plane, ez = ex x ey pointing up
+  float ex[3], ey[3], ez[3];
+  float d = 0, i = 0, jn = 0;
+  for (int8_t n = 0; n < 3; n++) { ex[n] = p[1][n] - p[0][n]; d += sq(ex[n]); }
+  d = sqrt(d);
+  for (int8_t n = 0; n < 3; n++) { ex[n] /= d; i += ex[n] * (p[2][n] - p[0][n]); }
+  for (int8_t n = 0; n < 3; n++) { ey[n] = p[2][n] - p[0][n] - i * ex[n]; jn += sq(ey[n]); }
+  jn = sqrt(jn);
+  for (int8_t n = 0; n < 3; n++) ey[n] /= jn;
+  ez[X_AXIS] = ex[Y_AXIS] * ey[Z_AXIS] - ex[Z_AXIS] * ey[Y_AXIS];
+  ez[Y_AXIS] = ex[Z_AXIS] * ey[X_AXIS] - ex[X_AXIS] * ey[Z_AXIS];
+  ez[Z_AXIS] = ex[X_AXIS] * ey[Y_AXIS] - ex[Y_AXIS] * ey[X_AXIS];
+
+  float x = (delta_diagonal_rod_2_tower[0] - delta_diagonal_rod_2_tower[1] + sq(d)) / (2 * d);
+  float y = (delta_diagonal_rod_2_tower[0] - delta_diagonal_rod_2_tower[2] + sq(i) + sq(jn)) / (2 * jn) - i * x / jn;
+  float z = sqrt(delta_diagonal_rod_2_tower[0] - sq(x) - sq(y));
+  return p[0][Z_AXIS] + x * ex[Z_AXIS] + y * ey[Z_AXIS] - z * ez[Z_AXIS];
+}
+
+// Like probe_pt(), moving the carriages together so the nozzle goes straight down. The carriage
+// heights where the probe triggered are returned in carriage.
+static void delta_probe_pt(float x, float y, float z_before, float *carriage)
+{
+  feedrate = XY_TRAVEL_SPEED;
+  destination[Z_AXIS] = z_before;
+  prepare_move();
+  destination[X_AXIS] = x - X_PROBE_OFFSET_FROM_EXTRUDER;
+  destination[Y_AXIS] = y - Y_PROBE_OFFSET_FROM_EXTRUDER;
+  prepare_move();
+  st_synchronize();
+
+  engage_z_probe();   // Engage Z Servo endstop if available
+  calculate_delta(current_position);
+  float travel = current_position[Z_AXIS] + 10; // down to Z -10 unless the probe triggers
+  for (int8_t j = 0; j < 3; j++) carriage[j] = delta[j] - travel;
+  for (int8_t stage = 0; stage < 2; stage++) {
+    feedrate = stage ? Z_PROBE_SPEED_SLOW : Z_PROBE_SPEED_FAST;
+    plan_buffer_line(carriage[X_AXIS], carriage[Y_AXIS], carriage[Z_AXIS], current_position[E_AXIS], feedrate/60, active_extruder);
+    st_synchronize();
+    for (int8_t j = 0; j < 3; j++) carriage[j] = st_get_position_mm(j);
+    plan_set_position(carriage[X_AXIS], carriage[Y_AXIS], carriage[Z_AXIS], current_position[E_AXIS]);
+    if (stage) break;
+    // move up the retract distance and back down slowly, to twice that below
+    feedrate = Z_PROBE_SPEED_FAST;
+    plan_buffer_line(carriage[X_AXIS] + Z_PROBE_RETRACT, carriage[Y_AXIS] + Z_PROBE_RETRACT, carriage[Z_AXIS] + Z_PROBE_RETRACT,
+                     current_position[E_AXIS], feedrate/60, active_extruder);
+    st_synchronize();
+    for (int8_t j = 0; j < 3; j++) carriage[j] -= Z_PROBE_RETRACT;
+  }
+  endstops_hit_on_purpose();
+  float no_correction[DELTA_CAL_PARAMS] = { 0, 0, 0, 0, 0, 0 };
+  current_position[Z_AXIS] = destination[Z_AXIS] = delta_forward_z(carriage, no_correction);
+  retract_z_probe();
+
+  SERIAL_PROTOCOLPGM(MSG_BED);
+  SERIAL_PROTOCOLPGM(" x: ");
+  SERIAL_PROTOCOL(x);
+  SERIAL_PROTOCOLPGM(" y: ");
+  SERIAL_PROTOCOL(y);
+  SERIAL_PROTOCOLPGM(" z: ");
+  SERIAL_PROTOCOL(current_position[Z_AXIS]);
+  SERIAL_PROTOCOLPGM("\n");
+}
+#endif // DELTA_AUTO_CALIBRATION
+
 #endif // #ifdef ENABLE_AUTO_BED_LEVELING
 
 static void homeaxis(int axis) {
@@ -1069,11 +3988,7 @@ static void homeaxis(int axis) {
     st_synchronize();
 
     destination[axis] = 2*home_retract_mm(axis) * axis_home_dir;
-#ifdef DELTA
-    feedrate = homing_feedrate[axis]/10;
-#else
-    feedrate = homing_feedrate[axis]/2 ;
-#endif
+    feedrate = homing_feedrate[axis]/home_bump_divisor(axis);
     plan_buffer_line(destination[X_AXIS], destination[Y_AXIS], destination[Z_AXIS], destination[E_AXIS], feedrate/60, active_extruder);
     st_synchronize();
 #ifdef DELTA
@@ -1096,22 +4011,262 @@ static void homeaxis(int axis) {
       if (servo_endstops[axis] > -1) {
         servos[servo_endstops[axis]].write(servo_endstop_angles[axis * 2 + 1]);
       }
-    #endif
-#if defined (ENABLE_AUTO_BED_LEVELING) && (PROBE_SERVO_DEACTIVATION_DELAY > 0)
-    if (axis==Z_AXIS) retract_z_probe();
-#endif
+    #endif
+#if defined (ENABLE_AUTO_BED_LEVELING) && (PROBE_SERVO_DEACTIVATION_DELAY > 0)
+    if (axis==Z_AXIS) retract_z_probe();
+#endif
+
+  }
+}
+#define HOMEAXIS(LETTER) homeaxis(LETTER##_AXIS)
+
+// G28 O: whether an axis G28 homes has lost its position. Disabling its stepper and an endstop hit
+// outside homing clear axis_known_position.
+static bool homing_needed()
+{
+#if defined(DELTA) || defined(SCARA)
+  bool all = true; // they home every axis
+#else
+  bool all = !(code_seen(axis_codes[X_AXIS]) || code_seen(axis_codes[Y_AXIS]) || code_seen(axis_codes[Z_AXIS]));
+#endif
+  for(int8_t i = 0; i < 3; i++)
+    if((all || code_seen(axis_codes[i])) && !axis_known_position[i])
+      return true;
+  return false;
+}
+
+#ifdef HOME_XY_TOGETHER
+#if !(HOMEAXIS_DO(X) && HOMEAXIS_DO(Y))
+  #error "HOME_XY_TOGETHER needs the X and Y endstops in the homing direction"
+#endif
+
+// Move X and Y by distance together, each at no more than its feedrate. An endstop hit stops the move,
+// the axis that is still free then goes on alone. The positions are taken from the steppers after each stop.
+static void home_xy_move(const float distance[2], const float axis_feedrate[2])
+{
+  float target[2] = { current_position[X_AXIS] + distance[X_AXIS], current_position[Y_AXIS] + distance[Y_AXIS] };
+  unsigned char moving = (1<<X_AXIS) | (1<<Y_AXIS);
+  while(moving) {
+    float length = 0;
+    for(int axis = X_AXIS; axis <= Y_AXIS; axis++) {
+      destination[axis] = (moving & (1<<axis)) ? target[axis] : current_position[axis];
+      length += sq(destination[axis] - current_position[axis]);
+    }
+    length = sqrt(length);
+    feedrate = 0;
+    for(int axis = X_AXIS; axis <= Y_AXIS; axis++) {
+      float axis_length = fabs(destination[axis] - current_position[axis]);
+      if(axis_length > 0 && (feedrate == 0 || axis_feedrate[axis] * length / axis_length < feedrate))
+        feedrate = axis_feedrate[axis] * length / axis_length;
+    }
+    if(feedrate == 0) break;
+    endstops_hit_on_purpose();
+    plan_buffer_line(destination[X_AXIS], destination[Y_AXIS], destination[Z_AXIS], destination[E_AXIS], feedrate/60, active_extruder);
+    st_synchronize();
+
+    unsigned char hit = endstops_hit_axes() & moving;
+    current_position[X_AXIS] = (float)st_get_position(X_AXIS) / axis_steps_per_unit[X_AXIS];
+    current_position[Y_AXIS] = (float)st_get_position(Y_AXIS) / axis_steps_per_unit[Y_AXIS];
+    plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+    if(!hit) break; // the move ran to its end
+    moving &= ~hit;
+  }
+  endstops_hit_on_purpose();
+}
+
+// homeaxis() for X and Y at once
+static void home_xy()
+{
+  float distance[2], axis_feedrate[2];
+
+  #ifdef SERVO_ENDSTOPS
+    for(int axis = X_AXIS; axis <= Y_AXIS; axis++)
+      if (servo_endstops[axis] > -1)
+        servos[servo_endstops[axis]].write(servo_endstop_angles[axis * 2]);
+  #endif
+
+  current_position[X_AXIS] = 0;
+  current_position[Y_AXIS] = 0;
+  plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+
+  for(int axis = X_AXIS; axis <= Y_AXIS; axis++) {
+    distance[axis] = 1.5 * max_length(axis) * home_dir(axis);
+    axis_feedrate[axis] = homing_feedrate[axis];
+  }
+  home_xy_move(distance, axis_feedrate);
+
+  for(int axis = X_AXIS; axis <= Y_AXIS; axis++)
+    distance[axis] = -home_retract_mm(axis) * home_dir(axis);
+  home_xy_move(distance, axis_feedrate);
+
+  for(int axis = X_AXIS; axis <= Y_AXIS; axis++) {
+    distance[axis] = 2*home_retract_mm(axis) * home_dir(axis);
+    axis_feedrate[axis] = homing_feedrate[axis]/home_bump_divisor(axis);
+  }
+  home_xy_move(distance, axis_feedrate);
+
+  for(int axis = X_AXIS; axis <= Y_AXIS; axis++) {
+    axis_is_at_home(axis);
+    destination[axis] = current_position[axis];
+    axis_known_position[axis] = true;
+  }
+  feedrate = 0.0;
+
+  #ifdef SERVO_ENDSTOPS
+    for(int axis = X_AXIS; axis <= Y_AXIS; axis++)
+      if (servo_endstops[axis] > -1)
+        servos[servo_endstops[axis]].write(servo_endstop_angles[axis * 2 + 1]);
+  #endif
+}
+#endif //HOME_XY_TOGETHER
+void refresh_cmd_timeout(void)
+{
+  previous_millis_cmd = millis();
+}
+
+#ifdef FWRETRACT
+#if defined(FWRETRACT_OVERLAP) || defined(FWRETRACT_ZLIFT_RAMP)
+  // A G0/G1 that only moves X and Y can carry the pending retraction
+  static bool retract_overlaps_command() {
+    if(!code_seen('G') || ((int)code_value() != 0 && (int)code_value() != 1))
+      return false;
+    return (code_seen('X') || code_seen('Y')) && !code_seen('Z') && !code_seen('E');
+  }
+#endif
+
+#ifdef FWRETRACT_ZLIFT_RAMP
+  // Lift Z on its own, for a command that can't carry the lift
+  static void zlift_flush() {
+    memcpy(destination, current_position, sizeof(destination));
+    current_position[Z_AXIS]-=retract_zlift;
+    plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+    prepare_move();
+    zlift_state = ZLIFT_UP;
+  }
+
+  // Whether the pending lift has to be done before the command: anything but an X/Y travel and the
+  // commands below, which neither move nor wait. T, M600 and the commands a build adds lift first.
+  static bool zlift_flushes_command() {
+    if(code_seen('G')) {
+      if(retract_overlaps_command())
+        return false;
+      switch((int)code_value()) {
+        case 10: case 11: case 20: case 21: case 90: case 91:
+          return false;
+      }
+    }
+    else if(code_seen('M')) {
+      switch((int)code_value()) {
+        case 82: case 83: case 104: case 105: case 106: case 107: case 110: case 114: case 115: case 117:
+        case 140: case 220: case 221:
+          return false;
+      }
+    }
+    return true;
+  }
+
+  // Whether the command after the one running is G11
+  static bool zlift_lower_next() {
+    if(buflen < 2)
+      return false;
+    const char *cmd = cmdbuffer[(bufindr + 1) % BUFSIZE];
+    while(*cmd == 'N' || *cmd == ' ' || (*cmd >= '0' && *cmd <= '9')) // line number
+      cmd++;
+    return cmd[0] == 'G' && strtol(cmd + 1, NULL, 10) == 11;
+  }
+
+  // Travel to destination, lifting Z during its start if the lift is pending and lowering it during
+  // its end if G11 follows. A slope is as long as the travel covers while Z moves retract_zlift at
+  // its top feedrate, or accelerates to it at its acceleration, whichever is longer.
+  static void zlift_travel() {
+    float target[NUM_AXIS];
+    memcpy(target, destination, sizeof(target));
+    float start_x = current_position[X_AXIS], start_y = current_position[Y_AXIS];
+    float dx = target[X_AXIS]-start_x;
+    float dy = target[Y_AXIS]-start_y;
+    float travel = sqrt(dx*dx + dy*dy);
+    bool raise = zlift_state == ZLIFT_PENDING;
+    bool lower = zlift_lower_next();
+    float speed = feedrate/60.0*feedmultiply/100.0;
+    float slope = max(retract_zlift*speed/max_feedrate[Z_AXIS],
+                      retract_zlift*acceleration/max_acceleration_units_per_sq_second[Z_AXIS]);
+    slope = min(slope, raise && lower ? travel/2 : travel);
+    float fraction = travel > 0 ? slope/travel : 0;
+    if(raise) {
+      current_position[Z_AXIS]-=retract_zlift;
+      plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+      destination[X_AXIS]=start_x+dx*fraction;
+      destination[Y_AXIS]=start_y+dy*fraction;
+      prepare_move();
+      zlift_state = ZLIFT_UP;
+    }
+    if(lower) {
+      if(1 - fraction > (raise ? fraction : 0)) {
+        destination[X_AXIS]=start_x+dx*(1 - fraction);
+        destination[Y_AXIS]=start_y+dy*(1 - fraction);
+        prepare_move();
+      }
+      current_position[Z_AXIS]+=retract_zlift;
+      plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+      zlift_state = ZLIFT_DOWN;
+    }
+    memcpy(destination, target, sizeof(destination));
+    prepare_move();
+  }
+#endif //FWRETRACT_ZLIFT_RAMP
+
+#ifdef FWRETRACT_OVERLAP
+  // Do the pending retraction on its own
+  static void retract_flush() {
+    retracted = false;
+    retract(true);
+    retract_pending = false;
+  }
 
+  // Do the pending retraction during the start of the travel to destination, for the length the
+  // retraction takes at retract_feedrate. On a shorter travel the whole travel is slowed down to
+  // keep E within retract_feedrate.
+  static void retract_during_travel() {
+    float target[NUM_AXIS];
+    memcpy(target, destination, sizeof(target));
+    float length = retract_length/volumetric_multiplier[active_extruder];
+    float dx = target[X_AXIS]-current_position[X_AXIS];
+    float dy = target[Y_AXIS]-current_position[Y_AXIS];
+    float travel = sqrt(dx*dx + dy*dy);
+    if(length <= 0 || travel <= 0) {
+      retract_flush();
+      memcpy(destination, target, sizeof(destination));
+      prepare_move();
+      return;
+    }
+    retract_pending = false;
+    current_position[E_AXIS]+=length;
+    plan_set_e_position(current_position[E_AXIS]);
+    float overlap = feedrate*feedmultiply/100.0*length/retract_feedrate; // mm of travel while retracting
+    if(overlap < travel) {
+      destination[X_AXIS]=current_position[X_AXIS]+dx*overlap/travel;
+      destination[Y_AXIS]=current_position[Y_AXIS]+dy*overlap/travel;
+      prepare_move();
+      memcpy(destination, target, sizeof(destination));
+      prepare_move();
+    } else {
+      float oldFeedrate = feedrate;
+      feedrate=min(feedrate, retract_feedrate*travel/length*100.0/feedmultiply);
+      prepare_move();
+      feedrate = oldFeedrate;
+    }
   }
-}
-#define HOMEAXIS(LETTER) homeaxis(LETTER##_AXIS)
-void refresh_cmd_timeout(void)
-{
-  previous_millis_cmd = millis();
-}
+#endif //FWRETRACT_OVERLAP
 
-#ifdef FWRETRACT
   void retract(bool retracting) {
     if(retracting && !retracted) {
+#ifdef FWRETRACT_OVERLAP
+      if(retract_zlift == 0 && !retract_pending) { // the planner slows a move with Z down to Z's acceleration, don't lift while traveling
+        retracted=true;
+        retract_pending=true;
+        return;
+      }
+#endif
       destination[X_AXIS]=current_position[X_AXIS];
       destination[Y_AXIS]=current_position[Y_AXIS];
       destination[Z_AXIS]=current_position[Z_AXIS];
@@ -1122,17 +4277,30 @@ void refresh_cmd_timeout(void)
       feedrate=retract_feedrate;
       retracted=true;
       prepare_move();
+#ifdef FWRETRACT_ZLIFT_RAMP
+      if(retract_zlift > 0)
+        zlift_state = ZLIFT_PENDING; // lifted with the next travel
+#else
       current_position[Z_AXIS]-=retract_zlift;
       plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
       prepare_move();
+#endif
       feedrate = oldFeedrate;
     } else if(!retracting && retracted) {
       destination[X_AXIS]=current_position[X_AXIS];
       destination[Y_AXIS]=current_position[Y_AXIS];
       destination[Z_AXIS]=current_position[Z_AXIS];
       destination[E_AXIS]=current_position[E_AXIS];
+#ifdef FWRETRACT_ZLIFT_RAMP
+      if(zlift_state == ZLIFT_UP) // not lowered with the travel
+#endif
+      {
       current_position[Z_AXIS]+=retract_zlift;
       plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+      }
+#ifdef FWRETRACT_ZLIFT_RAMP
+      zlift_state = ZLIFT_NONE;
+#endif
       //prepare_move();
       current_position[E_AXIS]-=(retract_length+retract_recover_length)/volumetric_multiplier[active_extruder]; 
       plan_set_e_position(current_position[E_AXIS]);
@@ -1145,12 +4313,118 @@ void refresh_cmd_timeout(void)
   } //retract
 #endif //FWRETRACT
 
+// The temperature report of M105 after its "ok", also used for the M155 auto report
+static void print_heaterstates(uint8_t extruder)
+{
+  #ifdef TEMP_REPORT_CACHE
+    SERIAL_PROTOCOL(temp_report(extruder));
+  #else
+  #if defined(TEMP_0_PIN) && TEMP_0_PIN > -1
+    SERIAL_PROTOCOLPGM(" T:");
+    SERIAL_PROTOCOL_F(degHotend(extruder),1);
+    SERIAL_PROTOCOLPGM(" /");
+    SERIAL_PROTOCOL_F(degTargetHotend(extruder),1);
+    #if defined(TEMP_BED_PIN) && TEMP_BED_PIN > -1
+      SERIAL_PROTOCOLPGM(" B:");
+      SERIAL_PROTOCOL_F(degBed(),1);
+      SERIAL_PROTOCOLPGM(" /");
+      SERIAL_PROTOCOL_F(degTargetBed(),1);
+    #endif //TEMP_BED_PIN
+    for (int8_t cur_extruder = 0; cur_extruder < EXTRUDERS; ++cur_extruder) {
+      SERIAL_PROTOCOLPGM(" T");
+      SERIAL_PROTOCOL(cur_extruder);
+      SERIAL_PROTOCOLPGM(":");
+      SERIAL_PROTOCOL_F(degHotend(cur_extruder),1);
+      SERIAL_PROTOCOLPGM(" /");
+      SERIAL_PROTOCOL_F(degTargetHotend(cur_extruder),1);
+    }
+  #endif
+
+    SERIAL_PROTOCOLPGM(" @:");
+  #ifdef EXTRUDER_WATTS
+    SERIAL_PROTOCOL((EXTRUDER_WATTS * getHeaterPower(extruder))/127);
+    SERIAL_PROTOCOLPGM("W");
+  #else
+    SERIAL_PROTOCOL(getHeaterPower(extruder));
+  #endif
+
+    SERIAL_PROTOCOLPGM(" B@:");
+  #ifdef BED_WATTS
+    SERIAL_PROTOCOL((BED_WATTS * getHeaterPower(-1))/127);
+    SERIAL_PROTOCOLPGM("W");
+  #else
+    SERIAL_PROTOCOL(getHeaterPower(-1));
+  #endif
+  #endif // TEMP_REPORT_CACHE
+
+    #ifdef SHOW_TEMP_ADC_VALUES
+      #if defined(TEMP_BED_PIN) && TEMP_BED_PIN > -1
+        SERIAL_PROTOCOLPGM("    ADC B:");
+        SERIAL_PROTOCOL_F(degBed(),1);
+        SERIAL_PROTOCOLPGM("C->");
+        SERIAL_PROTOCOL_F(rawBedTemp()/OVERSAMPLENR,0);
+      #endif
+      for (int8_t cur_extruder = 0; cur_extruder < EXTRUDERS; ++cur_extruder) {
+        SERIAL_PROTOCOLPGM("  T");
+        SERIAL_PROTOCOL(cur_extruder);
+        SERIAL_PROTOCOLPGM(":");
+        SERIAL_PROTOCOL_F(degHotend(cur_extruder),1);
+        SERIAL_PROTOCOLPGM("C->");
+        SERIAL_PROTOCOL_F(rawHotendTemp(cur_extruder)/OVERSAMPLENR,0);
+      }
+    #endif
+}
+
+// M105: ok and the temperatures
+static void temperature_report(uint8_t extruder)
+{
+  #if defined(TEMP_0_PIN) && TEMP_0_PIN > -1
+    SERIAL_PROTOCOLPGM("ok");
+  #else
+    SERIAL_ERROR_START;
+    SERIAL_ERRORLNPGM(MSG_ERR_NO_THERMISTORS);
+  #endif
+    print_heaterstates(extruder);
+    SERIAL_PROTOCOLLN("");
+}
+
+#ifdef AUTO_REPORT_TEMPERATURES
+static uint8_t auto_report_temp_interval = 0; // seconds, 0 is off (M155)
+static unsigned long next_temp_report_ms;
+
+// Called from manage_inactivity(), so reports keep coming while a command blocks
+static void auto_report_temperatures()
+{
+  if(auto_report_temp_interval && (long)(millis() - next_temp_report_ms) >= 0)
+  {
+    next_temp_report_ms = millis() + 1000UL * auto_report_temp_interval;
+    print_heaterstates(active_extruder);
+    SERIAL_PROTOCOLLN("");
+  }
+}
+#endif
+
+// Heating and dwelling are left out of a dry planning run, only the moves count
+#ifdef DRY_PLANNING
+  #define SKIP_WHEN_DRY_PLANNING() if(dry_planning) break
+#else
+  #define SKIP_WHEN_DRY_PLANNING()
+#endif
+
 void process_commands()
 {
   unsigned long codenum; //throw away variable
   char *starpos = NULL;
 #ifdef ENABLE_AUTO_BED_LEVELING
   float x_tmp, y_tmp, z_tmp, real_z;
+#endif
+#ifdef FWRETRACT_OVERLAP
+  if(retract_pending && !retract_overlaps_command())
+    retract_flush();
+#endif
+#ifdef FWRETRACT_ZLIFT_RAMP
+  if(zlift_state == ZLIFT_PENDING && zlift_flushes_command())
+    zlift_flush();
 #endif
   if(code_seen('G'))
   {
@@ -1172,6 +4446,18 @@ void process_commands()
               }
             }
           #endif //FWRETRACT
+          #ifdef FWRETRACT_OVERLAP
+            if(retract_pending) {
+              retract_during_travel();
+              return;
+            }
+          #endif
+          #ifdef FWRETRACT_ZLIFT_RAMP
+            if((zlift_state == ZLIFT_PENDING || zlift_state == ZLIFT_UP) && retract_overlaps_command()) {
+              zlift_travel();
+              return;
+            }
+          #endif
         prepare_move();
         //ClearToSend();
         return;
@@ -1190,20 +4476,54 @@ void process_commands()
         return;
       }
     case 4: // G4 dwell
+      SKIP_WHEN_DRY_PLANNING();
       LCD_MESSAGEPGM(MSG_DWELL);
       codenum = 0;
       if(code_seen('P')) codenum = code_value(); // milliseconds to wait
       if(code_seen('S')) codenum = code_value() * 1000; // seconds to wait
 
+      #ifdef QUEUED_DWELL
+      // G4, G4 P0 and G4 S0 still wait for the moves to finish, slicers use them for that
+      if(codenum > 0) {
+        plan_dwell(codenum);
+        previous_millis_cmd = millis();
+        break;
+      }
+      #endif
       st_synchronize();
       codenum += millis();  // keep track of when we started waiting
       previous_millis_cmd = millis();
       while(millis()  < codenum ){
-        manage_heater();
-        manage_inactivity();
-        lcd_update();
+        idle();
       }
       break;
+      #ifdef BEZIER_CURVE_SUPPORT
+      case 5: // G5 cubic Bezier
+        if(Stopped == false) {
+          get_coordinates();
+          float control[4];
+          control[0] = code_seen('I') ? code_value() : 0.0;
+          control[1] = code_seen('J') ? code_value() : 0.0;
+          control[2] = code_seen('P') ? code_value() : 0.0;
+          control[3] = code_seen('Q') ? code_value() : 0.0;
+          prepare_bezier_move(control);
+        }
+      break;
+      #endif
+      #ifdef LASER_RASTER
+      case 7: // G7 raster move
+        if(Stopped == false) {
+          get_coordinates();
+          unsigned char pixels[MAX_CMD_SIZE / 2];
+          uint8_t count = 0;
+          if(code_seen('D'))
+            count = raster_decode(strchr_pointer + 1, pixels, sizeof(pixels));
+          plan_raster_pixels(pixels, count);
+          prepare_move();
+          plan_raster_pixels(pixels, 0);
+        }
+      break;
+      #endif
       #ifdef FWRETRACT
       case 10: // G10 retract
         retract(true);
@@ -1213,8 +4533,18 @@ void process_commands()
       break;
       #endif //FWRETRACT
     case 28: //G28 Home all Axis one at a time
+      if(code_seen('O') && !homing_needed())
+      {
+        SERIAL_ECHO_START;
+        SERIAL_ECHOLNPGM("Position still known, not homing");
+        break;
+      }
 #ifdef ENABLE_AUTO_BED_LEVELING
       plan_bed_level_matrix.set_to_identity();  //Reset the plane ("erase" all leveling data)
+      plan_bed_level_changed();
+  #ifdef MESH_BED_LEVELING
+      bed_level_mesh_active = false;
+  #endif
 #endif //ENABLE_AUTO_BED_LEVELING
 
 
@@ -1224,6 +4554,9 @@ void process_commands()
       previous_millis_cmd = millis();
 
       enable_endstops(true);
+      #ifdef INPUT_SHAPING
+        st_suspend_shaping(true); // the motors stop where the endstop trips, not an echo later
+      #endif
 
       for(int8_t i=0; i < NUM_AXIS; i++) {
         destination[i] = current_position[i];
@@ -1260,6 +4593,22 @@ void process_commands()
           calculate_delta(current_position);
           plan_set_position(delta[X_AXIS], delta[Y_AXIS], delta[Z_AXIS], current_position[E_AXIS]);
 
+#elif defined(SCARA)
+          // The joints home one after the other in degrees, then the position becomes the nozzle's
+          #if Z_HOME_DIR > 0
+          HOMEAXIS(Z);
+          #endif
+          HOMEAXIS(X);
+          HOMEAXIS(Y);
+          #if Z_HOME_DIR < 0
+          HOMEAXIS(Z);
+          #endif
+          {
+            float angles[3] = { SCARA_SHOULDER_HOME_ANGLE, SCARA_ELBOW_HOME_ANGLE, current_position[Z_AXIS] };
+            plan_set_position(angles[X_AXIS], angles[Y_AXIS], angles[Z_AXIS], current_position[E_AXIS]);
+            calculate_scara_cartesian(angles, current_position);
+          }
+
 #else // NOT DELTA
 
       home_all_axis = !((code_seen(axis_codes[X_AXIS])) || (code_seen(axis_codes[Y_AXIS])) || (code_seen(axis_codes[Z_AXIS])));
@@ -1306,7 +4655,14 @@ void process_commands()
       }
       #endif
 
-      if((home_all_axis) || (code_seen(axis_codes[X_AXIS])))
+      #ifdef HOME_XY_TOGETHER
+      home_xy_together = (home_all_axis) || (code_seen(axis_codes[X_AXIS]) && code_seen(axis_codes[Y_AXIS]));
+      if(home_xy_together) {
+        home_xy();
+      }
+      #endif
+
+      if(!home_xy_together && ((home_all_axis) || (code_seen(axis_codes[X_AXIS]))))
       {
       #ifdef DUAL_X_CARRIAGE
         int tmp_extruder = active_extruder;
@@ -1325,7 +4681,7 @@ void process_commands()
       #endif
       }
 
-      if((home_all_axis) || (code_seen(axis_codes[Y_AXIS]))) {
+      if(!home_xy_together && ((home_all_axis) || (code_seen(axis_codes[Y_AXIS])))) {
         HOMEAXIS(Y);
       }
 
@@ -1411,11 +4767,14 @@ void process_commands()
         }
       #endif
       plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
-#endif // else DELTA
+#endif // else DELTA, SCARA
 
       #ifdef ENDSTOPS_ONLY_FOR_HOMING
         enable_endstops(false);
       #endif
+      #ifdef INPUT_SHAPING
+        st_suspend_shaping(false);
+      #endif
 
       feedrate = saved_feedrate;
       feedmultiply = saved_feedmultiply;
@@ -1444,6 +4803,10 @@ void process_commands()
             //vector_3 corrected_position = plan_get_position_mm();
             //corrected_position.debug("position before G29");
             plan_bed_level_matrix.set_to_identity();
+            plan_bed_level_changed();
+  #ifdef MESH_BED_LEVELING
+            bed_level_mesh_active = false;
+  #endif
             vector_3 uncorrected_position = plan_get_position();
             //uncorrected_position.debug("position durring G29");
             current_position[X_AXIS] = uncorrected_position.x;
@@ -1459,41 +4822,73 @@ void process_commands()
             int xGridSpacing = (RIGHT_PROBE_BED_POSITION - LEFT_PROBE_BED_POSITION) / (AUTO_BED_LEVELING_GRID_POINTS-1);
             int yGridSpacing = (BACK_PROBE_BED_POSITION - FRONT_PROBE_BED_POSITION) / (AUTO_BED_LEVELING_GRID_POINTS-1);
 
+            // the first and last row and column of the grid that are probed
+            int xFirst = 0, xLast = AUTO_BED_LEVELING_GRID_POINTS - 1;
+            int yFirst = 0, yLast = AUTO_BED_LEVELING_GRID_POINTS - 1;
+  #ifdef AUTO_BED_LEVELING_ADAPTIVE
+            {
+              float bounds[4]; // left, right, front, back
+              bool given = false;
+    #ifdef SDSUPPORT
+              given = card.getPrintBounds(bounds);
+    #endif
+              if (!given)
+              {
+                bounds[0] = LEFT_PROBE_BED_POSITION;
+                bounds[1] = RIGHT_PROBE_BED_POSITION;
+                bounds[2] = FRONT_PROBE_BED_POSITION;
+                bounds[3] = BACK_PROBE_BED_POSITION;
+              }
+              if (code_seen('L')) bounds[0] = code_value();
+              if (code_seen('R')) bounds[1] = code_value();
+              if (code_seen('F')) bounds[2] = code_value();
+              if (code_seen('B')) bounds[3] = code_value();
+              grid_range(bounds[0], bounds[1], LEFT_PROBE_BED_POSITION, xGridSpacing, xFirst, xLast);
+              grid_range(bounds[2], bounds[3], FRONT_PROBE_BED_POSITION, yGridSpacing, yFirst, yLast);
+            }
+  #endif
+
 
             // solve the plane equation ax + by + d = z
-            // A is the matrix with rows [x y 1] for all the probed points
-            // B is the vector of the Z positions
+            // in the least squares sense, from the normal equations A'A [a b d] = A'B where
+            // A has the rows [x y 1] for all the probed points and B holds their Z positions.
+            // A'A and A'B are sums that are accumulated as the points are probed, so any grid size
+            // needs the same memory. X and Y are taken from the middle of the grid to keep the sums small.
             // the normal vector to the plane is formed by the coefficients of the plane equation in the standard form, which is Vx*x+Vy*y+Vz*z+d = 0
             // so Vx = -a Vy = -b Vz = 1 (we want the vector facing towards positive Z
-
-            // "A" matrix of the linear system of equations
-            double eqnAMatrix[AUTO_BED_LEVELING_GRID_POINTS*AUTO_BED_LEVELING_GRID_POINTS*3];
-            // "B" vector of Z points
-            double eqnBVector[AUTO_BED_LEVELING_GRID_POINTS*AUTO_BED_LEVELING_GRID_POINTS];
+  #ifndef MESH_BED_LEVELING
+            const float xCenter = (LEFT_PROBE_BED_POSITION + RIGHT_PROBE_BED_POSITION) / 2.0;
+            const float yCenter = (FRONT_PROBE_BED_POSITION + BACK_PROBE_BED_POSITION) / 2.0;
+            float sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0, sum_yy = 0;
+            float sum_z = 0, sum_xz = 0, sum_yz = 0;
+  #endif
 
 
             int probePointCounter = 0;
             bool zig = true;
+  #ifdef MESH_BED_LEVELING
+            float last_z = 0;
+  #endif
 
-            for (int yProbe=FRONT_PROBE_BED_POSITION; yProbe <= BACK_PROBE_BED_POSITION; yProbe += yGridSpacing)
+            for (int yIndex = yFirst; yIndex <= yLast; yIndex++)
             {
-              int xProbe, xInc;
+              int yProbe = FRONT_PROBE_BED_POSITION + yIndex * yGridSpacing;
+              int xIndex, xInc;
               if (zig)
               {
-                xProbe = LEFT_PROBE_BED_POSITION;
-                //xEnd = RIGHT_PROBE_BED_POSITION;
-                xInc = xGridSpacing;
+                xIndex = xFirst;
+                xInc = 1;
                 zig = false;
               } else // zag
               {
-                xProbe = RIGHT_PROBE_BED_POSITION;
-                //xEnd = LEFT_PROBE_BED_POSITION;
-                xInc = -xGridSpacing;
+                xIndex = xLast;
+                xInc = -1;
                 zig = true;
               }
 
-              for (int xCount=0; xCount < AUTO_BED_LEVELING_GRID_POINTS; xCount++)
+              for (int xCount = xFirst; xCount <= xLast; xCount++)
               {
+                int xProbe = LEFT_PROBE_BED_POSITION + xIndex * xGridSpacing;
                 float z_before;
                 if (probePointCounter == 0)
                 {
@@ -1507,19 +4902,52 @@ void process_commands()
 
                 float measured_z = probe_pt(xProbe, yProbe, z_before);
 
-                eqnBVector[probePointCounter] = measured_z;
-
-                eqnAMatrix[probePointCounter + 0*AUTO_BED_LEVELING_GRID_POINTS*AUTO_BED_LEVELING_GRID_POINTS] = xProbe;
-                eqnAMatrix[probePointCounter + 1*AUTO_BED_LEVELING_GRID_POINTS*AUTO_BED_LEVELING_GRID_POINTS] = yProbe;
-                eqnAMatrix[probePointCounter + 2*AUTO_BED_LEVELING_GRID_POINTS*AUTO_BED_LEVELING_GRID_POINTS] = 1;
+  #ifdef MESH_BED_LEVELING
+                bed_level_mesh[yIndex][xIndex] = measured_z;
+                last_z = measured_z;
+  #endif
+  #ifndef MESH_BED_LEVELING
+                float x = xProbe - xCenter, y = yProbe - yCenter;
+                sum_x += x;
+                sum_y += y;
+                sum_xx += x * x;
+                sum_xy += x * y;
+                sum_yy += y * y;
+                sum_z += measured_z;
+                sum_xz += x * measured_z;
+                sum_yz += y * measured_z;
+  #endif
                 probePointCounter++;
-                xProbe += xInc;
+                xIndex += xInc;
               }
             }
             clean_up_after_endstop_move();
 
-            // solve lsq problem
-            double *plane_equation_coefficients = qr_solve(AUTO_BED_LEVELING_GRID_POINTS*AUTO_BED_LEVELING_GRID_POINTS, 3, eqnAMatrix, eqnBVector);
+  #ifdef MESH_BED_LEVELING
+    #ifdef AUTO_BED_LEVELING_ADAPTIVE
+            // the points not probed take the height of the nearest probed one
+            for (int8_t yIndex = 0; yIndex < AUTO_BED_LEVELING_GRID_POINTS; yIndex++)
+              for (int8_t xIndex = 0; xIndex < AUTO_BED_LEVELING_GRID_POINTS; xIndex++)
+                bed_level_mesh[yIndex][xIndex] = bed_level_mesh[constrain(yIndex, yFirst, yLast)][constrain(xIndex, xFirst, xLast)];
+    #endif
+            set_bed_level_mesh(last_z);
+  #else
+            // solve lsq problem by Cramer's rule
+            float n = probePointCounter;
+            float det = sum_xx * (sum_yy * n - sum_y * sum_y)
+                      - sum_xy * (sum_xy * n - sum_y * sum_x)
+                      + sum_x * (sum_xy * sum_y - sum_yy * sum_x);
+            double plane_equation_coefficients[3];
+            plane_equation_coefficients[0] = (sum_xz * (sum_yy * n - sum_y * sum_y)
+                                            - sum_xy * (sum_yz * n - sum_y * sum_z)
+                                            + sum_x * (sum_yz * sum_y - sum_yy * sum_z)) / det;
+            plane_equation_coefficients[1] = (sum_xx * (sum_yz * n - sum_z * sum_y)
+                                            - sum_xz * (sum_xy * n - sum_y * sum_x)
+                                            + sum_x * (sum_xy * sum_z - sum_yz * sum_x)) / det;
+            plane_equation_coefficients[2] = (sum_xx * (sum_yy * sum_z - sum_yz * sum_y)
+                                            - sum_xy * (sum_xy * sum_z - sum_yz * sum_x)
+                                            + sum_xz * (sum_xy * sum_y - sum_yy * sum_x)) / det
+                                           - plane_equation_coefficients[0] * xCenter - plane_equation_coefficients[1] * yCenter;
 
             SERIAL_PROTOCOLPGM("Eqn coefficients: a: ");
             SERIAL_PROTOCOL(plane_equation_coefficients[0]);
@@ -1530,8 +4958,7 @@ void process_commands()
 
 
             set_bed_level_equation_lsq(plane_equation_coefficients);
-
-            free(plane_equation_coefficients);
+  #endif // MESH_BED_LEVELING
 
 #else // AUTO_BED_LEVELING_GRID not defined
 
@@ -1553,6 +4980,7 @@ void process_commands()
 #endif // AUTO_BED_LEVELING_GRID
             st_synchronize();
 
+  #ifndef MESH_BED_LEVELING // the mesh already puts the nozzle, not the probe, at its height
             // The following code correct the Z height difference from z-probe position and hotend tip position.
             // The Z height on homing is measured by Z-Probe, but the probe is quite far from the hotend.
             // When the bed is uneven, this height must be corrected.
@@ -1564,8 +4992,26 @@ void process_commands()
             apply_rotation_xyz(plan_bed_level_matrix, x_tmp, y_tmp, z_tmp);         //Apply the correction sending the probe offset
             current_position[Z_AXIS] = z_tmp - real_z + current_position[Z_AXIS];   //The difference is added to current position and sent to planner.
             plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+  #endif
+  #ifdef BED_LEVEL_EEPROM
+            bed_level_stored_matrix = plan_bed_level_matrix;
+            bed_level_stored = true;
+  #endif
+        }
+        break;
+
+#ifdef Z_DUAL_AUTO_ALIGN
+    case 34: // G34 level the gantry of dual Z motors
+        if (! (axis_known_position[X_AXIS] && axis_known_position[Y_AXIS]) )
+        {
+            LCD_MESSAGEPGM(MSG_POSITION_UNKNOWN);
+            SERIAL_ECHO_START;
+            SERIAL_ECHOLNPGM(MSG_POSITION_UNKNOWN);
+            break;
         }
+        z_dual_align();
         break;
+#endif
 
     case 30: // G30 Single Z Probe
         {
@@ -1592,6 +5038,105 @@ void process_commands()
             retract_z_probe(); // Retract Z Servo endstop if available
         }
         break;
+#ifdef DELTA_AUTO_CALIBRATION
+    case 33: // G33 Delta auto calibration
+        {
+            if (! (axis_known_position[X_AXIS] && axis_known_position[Y_AXIS] && axis_known_position[Z_AXIS]) )
+            {
+                LCD_MESSAGEPGM(MSG_POSITION_UNKNOWN);
+                SERIAL_ECHO_START;
+                SERIAL_ECHOLNPGM(MSG_POSITION_UNKNOWN);
+                break;
+            }
+            st_synchronize();
+            setup_for_endstop_move();
+            for(int8_t i=0; i < NUM_AXIS; i++) destination[i] = current_position[i];
+
+            // the centre first, then around the circle starting in front of the X tower
+            const int points = DELTA_CALIBRATION_POINTS + 1;
+            float carriage[points][3];
+            for (int n = 0; n < points; n++)
+            {
+                float a = radians(210 + 360.0 * (n - 1) / DELTA_CALIBRATION_POINTS);
+                float r = n ? DELTA_CALIBRATION_RADIUS : 0;
+                delta_probe_pt(r * cos(a), r * sin(a),
+                               n ? current_position[Z_AXIS] + Z_RAISE_BETWEEN_PROBINGS : Z_RAISE_BEFORE_PROBING, carriage[n]);
+            }
+            feedrate = XY_TRAVEL_SPEED;
+            destination[Z_AXIS] = current_position[Z_AXIS] + Z_RAISE_BETWEEN_PROBINGS;
+            prepare_move();
+            st_synchronize();
+            clean_up_after_endstop_move();
+
+            // Gauss-Newton least squares: at the trigger point the nozzle should be zprobe_zoffset
+            // above the bed everywhere. The Jacobian is taken by stepping each correction by 0.1.
+            float k[DELTA_CAL_PARAMS] = { 0, 0, 0, 0, 0, 0 };
+            float deviation = 0;
+            for (int8_t iteration = 0; iteration < 3; iteration++)
+            {
+                double eqnAMatrix[points * DELTA_CAL_PARAMS];
+                double eqnBVector[points];
+                deviation = 0;
+                for (int n = 0; n < points; n++)
+                {
+                    float z = delta_forward_z(carriage[n], k);
+                    eqnBVector[n] = zprobe_zoffset - z;
+                    deviation += sq(eqnBVector[n]);
+                    for (int8_t p = 0; p < DELTA_CAL_PARAMS; p++)
+                    {
+                        k[p] += 0.1;
+                        eqnAMatrix[n + p * points] = (delta_forward_z(carriage[n], k) - z) / 0.1;
+                        k[p] -= 0.1;
+                    }
+                }
+                if (iteration == 0)
+                {
+                    SERIAL_PROTOCOLPGM("Deviation before: ");
+                    SERIAL_PROTOCOLLN(sqrt(deviation / points));
+                }
+                double *correction = qr_solve(points, DELTA_CAL_PARAMS, eqnAMatrix, eqnBVector);
+                for (int8_t p = 0; p < DELTA_CAL_PARAMS; p++) k[p] += correction[p];
+                free(correction);
+            }
+            deviation = 0;
+            for (int n = 0; n < points; n++) deviation += sq(zprobe_zoffset - delta_forward_z(carriage[n], k));
+            SERIAL_PROTOCOLPGM("Deviation after: ");
+            SERIAL_PROTOCOLLN(sqrt(deviation / points));
+
+            // Endstop adjustments can only lower a carriage; the common part goes into the home height
+            float highest = -1e9;
+            for (int8_t j = 0; j < 3; j++)
+            {
+                endstop_adj[j] += k[DELTA_CAL_ENDSTOP + j];
+                highest = max(highest, endstop_adj[j]);
+            }
+            for (int8_t j = 0; j < 3; j++) endstop_adj[j] -= highest;
+            add_homeing[Z_AXIS] += highest;
+            delta_radius += k[DELTA_CAL_RADIUS];
+            delta_tower_angle_trim[Y_AXIS] += k[DELTA_CAL_ANGLE + Y_AXIS];
+            delta_tower_angle_trim[Z_AXIS] += k[DELTA_CAL_ANGLE + Z_AXIS];
+            recalc_delta_settings(delta_radius, delta_diagonal_rod);
+
+            SERIAL_PROTOCOLPGM("M666 X");
+            SERIAL_PROTOCOL(endstop_adj[X_AXIS]);
+            SERIAL_PROTOCOLPGM(" Y");
+            SERIAL_PROTOCOL(endstop_adj[Y_AXIS]);
+            SERIAL_PROTOCOLPGM(" Z");
+            SERIAL_PROTOCOLLN(endstop_adj[Z_AXIS]);
+            SERIAL_PROTOCOLPGM("M665 R");
+            SERIAL_PROTOCOL(delta_radius);
+            SERIAL_PROTOCOLPGM(" J");
+            SERIAL_PROTOCOL(delta_tower_angle_trim[Y_AXIS]);
+            SERIAL_PROTOCOLPGM(" K");
+            SERIAL_PROTOCOLLN(delta_tower_angle_trim[Z_AXIS]);
+            SERIAL_PROTOCOLPGM("M206 Z");
+            SERIAL_PROTOCOLLN(add_homeing[Z_AXIS]);
+
+            // the carriages are no longer where the new settings put the nozzle
+            enquecommand_P(PSTR("G28"));
+        }
+        break;
+#endif // DELTA_AUTO_CALIBRATION
 #endif // ENABLE_AUTO_BED_LEVELING
     case 90: // G90
       relative_mode = false;
@@ -1610,7 +5155,7 @@ void process_commands()
            }
            else {
              current_position[i] = code_value()+add_homeing[i];
-             plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+             plan_set_current_position();
            }
         }
       }
@@ -1632,25 +5177,39 @@ void process_commands()
       if(code_seen('S')) codenum = code_value() * 1000; // seconds to wait
 
       st_synchronize();
+      KEEPALIVE_STATE(PAUSED);
       previous_millis_cmd = millis();
       if (codenum > 0){
         codenum += millis();  // keep track of when we started waiting
         while(millis()  < codenum && !lcd_clicked()){
-          manage_heater();
-          manage_inactivity();
-          lcd_update();
+          idle();
         }
       }else{
         while(!lcd_clicked()){
-          manage_heater();
-          manage_inactivity();
-          lcd_update();
+          idle();
         }
       }
       LCD_MESSAGEPGM(MSG_RESUMING);
     }
     break;
 #endif
+    #ifdef LASER_PWM
+    case 3: // M3 - Laser power
+      #ifdef SEGMENT_MERGE
+      plan_flush_pending(); // the held move takes the power it was queued with
+      #endif
+      if(code_seen('S'))
+        laser_power = constrain(code_value(), 0, 255);
+      else
+        laser_power = 255;
+      break;
+    case 5: // M5 - Laser off
+      #ifdef SEGMENT_MERGE
+      plan_flush_pending();
+      #endif
+      laser_power = 0;
+      break;
+    #endif
     case 17:
         LCD_MESSAGEPGM(MSG_NO_MOVE);
         enable_x();
@@ -1663,9 +5222,25 @@ void process_commands()
 
 #ifdef SDSUPPORT
     case 20: // M20 - list SD card
+      #ifdef SD_LIST_CHUNK
+      card.lsStop(); // a listing still going ends before the next begins
+      #endif
       SERIAL_PROTOCOLLNPGM(MSG_BEGIN_FILE_LIST);
       card.ls();
+      #ifdef SD_LIST_CHUNK
+      if(card.lsActive() && !fromsd[bufindr])
+      {
+        // hosts take the ok as the end of the reply, it comes from ls_ok_check()
+        ls_ok_pending = true;
+        #ifdef SERIAL_PORT_2
+        ls_ok_port = cmdbuffer_port[bufindr];
+        #endif
+        previous_millis_cmd = millis();
+        return;
+      }
+      #else
       SERIAL_PROTOCOLLNPGM(MSG_END_FILE_LIST);
+      #endif
       break;
     case 21: // M21 - init SD card
 
@@ -1681,10 +5256,20 @@ void process_commands()
       if(starpos!=NULL)
         *(starpos-1)='\0';
       card.openFile(strchr_pointer + 4,true);
+      #ifdef SD_FILE_HEADER
+      sd_header_status();
+      #endif
+      #ifdef HEATER_DUTY_STATS
+      heater_duty_reset(); // a new job; M24 also resumes a paused one
+      #endif
       break;
     case 24: //M24 - Start SD print
       card.startFileprint();
       starttime=millis();
+      #ifdef PRINT_STATISTICS
+      if(card.sdprinting)
+        print_job_start(true);
+      #endif
       break;
     case 25: //M25 - Pause SD print
       card.pauseSDPrint();
@@ -1704,6 +5289,17 @@ void process_commands()
         strchr_pointer = strchr(npos,' ') + 1;
         *(starpos-1) = '\0';
       }
+      #ifdef SD_WRITE_BEHIND
+      if(strchr_pointer[4] == 'S' && (uint8_t)(strchr_pointer[5] - '0') < 10)
+      {
+        // M28 S<bytes> <filename>: allocate the file for its size in one piece
+        char *name;
+        uint32_t size = strtoul(strchr_pointer + 5, &name, 10);
+        while(*name == ' ') name++;
+        card.openFile(name,false,true,size);
+        break;
+      }
+      #endif
       card.openFile(strchr_pointer+4,false);
       break;
     case 29: //M29 - Stop SD write
@@ -1754,7 +5350,16 @@ void process_commands()
             card.setIndex(code_value_long());
         card.startFileprint();
         if(!call_procedure)
+        {
           starttime=millis(); //procedure calls count as normal print time.
+          #ifdef HEATER_DUTY_STATS
+          heater_duty_reset();
+          #endif
+        }
+        #ifdef PRINT_STATISTICS
+        if(card.sdprinting)
+          print_job_start(true);
+        #endif
       }
     } break;
     case 928: //M928 - Start SD write
@@ -1805,92 +5410,46 @@ void process_commands()
       #endif
         if (pin_number > -1)
         {
+        #ifdef STATE_SYNC_WITH_MOVES
+          sync_event_add(SYNC_PIN, pin_number, pin_status);
+        #else
           pinMode(pin_number, OUTPUT);
           digitalWrite(pin_number, pin_status);
           analogWrite(pin_number, pin_status);
+        #endif
         }
       }
      break;
     case 104: // M104
+      SKIP_WHEN_DRY_PLANNING();
       if(setTargetedHotend(104)){
         break;
       }
+#ifdef TOOL_STANDBY
+      if (code_seen('R')) standby_temperature[tmp_extruder] = code_value();
+      if (code_seen('S')) standby_resume[tmp_extruder] = 0; // a target set for it wins
+#endif
       if (code_seen('S')) setTargetHotend(code_value(), tmp_extruder);
 #ifdef DUAL_X_CARRIAGE
-      if (dual_x_carriage_mode == DXC_DUPLICATION_MODE && tmp_extruder == 0)
+      if (dual_x_duplicating() && tmp_extruder == 0)
         setTargetHotend1(code_value() == 0.0 ? 0.0 : code_value() + duplicate_extruder_temp_offset);
 #endif
       setWatch();
       break;
     case 140: // M140 set bed temp
+      SKIP_WHEN_DRY_PLANNING();
       if (code_seen('S')) setTargetBed(code_value());
       break;
     case 105 : // M105
       if(setTargetedHotend(105)){
         break;
         }
-      #if defined(TEMP_0_PIN) && TEMP_0_PIN > -1
-        SERIAL_PROTOCOLPGM("ok T:");
-        SERIAL_PROTOCOL_F(degHotend(tmp_extruder),1);
-        SERIAL_PROTOCOLPGM(" /");
-        SERIAL_PROTOCOL_F(degTargetHotend(tmp_extruder),1);
-        #if defined(TEMP_BED_PIN) && TEMP_BED_PIN > -1
-          SERIAL_PROTOCOLPGM(" B:");
-          SERIAL_PROTOCOL_F(degBed(),1);
-          SERIAL_PROTOCOLPGM(" /");
-          SERIAL_PROTOCOL_F(degTargetBed(),1);
-        #endif //TEMP_BED_PIN
-        for (int8_t cur_extruder = 0; cur_extruder < EXTRUDERS; ++cur_extruder) {
-          SERIAL_PROTOCOLPGM(" T");
-          SERIAL_PROTOCOL(cur_extruder);
-          SERIAL_PROTOCOLPGM(":");
-          SERIAL_PROTOCOL_F(degHotend(cur_extruder),1);
-          SERIAL_PROTOCOLPGM(" /");
-          SERIAL_PROTOCOL_F(degTargetHotend(cur_extruder),1);
-        }
-      #else
-        SERIAL_ERROR_START;
-        SERIAL_ERRORLNPGM(MSG_ERR_NO_THERMISTORS);
-      #endif
-
-        SERIAL_PROTOCOLPGM(" @:");
-      #ifdef EXTRUDER_WATTS
-        SERIAL_PROTOCOL((EXTRUDER_WATTS * getHeaterPower(tmp_extruder))/127);
-        SERIAL_PROTOCOLPGM("W");
-      #else
-        SERIAL_PROTOCOL(getHeaterPower(tmp_extruder));
-      #endif
-
-        SERIAL_PROTOCOLPGM(" B@:");
-      #ifdef BED_WATTS
-        SERIAL_PROTOCOL((BED_WATTS * getHeaterPower(-1))/127);
-        SERIAL_PROTOCOLPGM("W");
-      #else
-        SERIAL_PROTOCOL(getHeaterPower(-1));
-      #endif
-
-        #ifdef SHOW_TEMP_ADC_VALUES
-          #if defined(TEMP_BED_PIN) && TEMP_BED_PIN > -1
-            SERIAL_PROTOCOLPGM("    ADC B:");
-            SERIAL_PROTOCOL_F(degBed(),1);
-            SERIAL_PROTOCOLPGM("C->");
-            SERIAL_PROTOCOL_F(rawBedTemp()/OVERSAMPLENR,0);
-          #endif
-          for (int8_t cur_extruder = 0; cur_extruder < EXTRUDERS; ++cur_extruder) {
-            SERIAL_PROTOCOLPGM("  T");
-            SERIAL_PROTOCOL(cur_extruder);
-            SERIAL_PROTOCOLPGM(":");
-            SERIAL_PROTOCOL_F(degHotend(cur_extruder),1);
-            SERIAL_PROTOCOLPGM("C->");
-            SERIAL_PROTOCOL_F(rawHotendTemp(cur_extruder)/OVERSAMPLENR,0);
-          }
-        #endif
-
-        SERIAL_PROTOCOLLN("");
+      temperature_report(tmp_extruder);
       return;
       break;
     case 109:
     {// M109 - Wait for extruder heater to reach target.
+      SKIP_WHEN_DRY_PLANNING();
       if(setTargetedHotend(109)){
         break;
       }
@@ -1899,16 +5458,19 @@ void process_commands()
         autotemp_enabled=false;
       #endif
       if (code_seen('S')) {
+      #ifdef TOOL_STANDBY
+        standby_resume[tmp_extruder] = 0;
+      #endif
         setTargetHotend(code_value(), tmp_extruder);
 #ifdef DUAL_X_CARRIAGE
-        if (dual_x_carriage_mode == DXC_DUPLICATION_MODE && tmp_extruder == 0)
+        if (dual_x_duplicating() && tmp_extruder == 0)
           setTargetHotend1(code_value() == 0.0 ? 0.0 : code_value() + duplicate_extruder_temp_offset);
 #endif
         CooldownNoWait = true;
       } else if (code_seen('R')) {
         setTargetHotend(code_value(), tmp_extruder);
 #ifdef DUAL_X_CARRIAGE
-        if (dual_x_carriage_mode == DXC_DUPLICATION_MODE && tmp_extruder == 0)
+        if (dual_x_duplicating() && tmp_extruder == 0)
           setTargetHotend1(code_value() == 0.0 ? 0.0 : code_value() + duplicate_extruder_temp_offset);
 #endif
         CooldownNoWait = false;
@@ -1928,7 +5490,11 @@ void process_commands()
 
       /* See if we are heating up or cooling down */
       target_direction = isHeatingHotend(tmp_extruder); // true if heating, false if cooling
+      KEEPALIVE_STATE(HEATING);
 
+      #ifdef NONBLOCKING_HEATUP
+        heat_wait_start(tmp_extruder);
+      #else
       #ifdef TEMP_RESIDENCY_TIME
         long residencyStart;
         residencyStart = -1;
@@ -1961,9 +5527,7 @@ void process_commands()
             #endif
             codenum = millis();
           }
-          manage_heater();
-          manage_inactivity();
-          lcd_update();
+          idle();
         #ifdef TEMP_RESIDENCY_TIME
             /* start/restart the TEMP_RESIDENCY_TIME timer whenever we reach target temp for the first time
               or when current temp falls outside the hysteresis after target temp was reached */
@@ -1978,9 +5542,11 @@ void process_commands()
         LCD_MESSAGEPGM(MSG_HEATING_COMPLETE);
         starttime=millis();
         previous_millis_cmd = millis();
+      #endif //NONBLOCKING_HEATUP
       }
       break;
     case 190: // M190 - Wait for bed heater to reach target.
+      SKIP_WHEN_DRY_PLANNING();
     #if defined(TEMP_BED_PIN) && TEMP_BED_PIN > -1
         LCD_MESSAGEPGM(MSG_BED_HEATING);
         if (code_seen('S')) {
@@ -1993,7 +5559,11 @@ void process_commands()
         codenum = millis();
 
         target_direction = isHeatingBed(); // true if heating, false if cooling
+        KEEPALIVE_STATE(HEATING);
 
+      #ifdef NONBLOCKING_HEATUP
+        heat_wait_start(HEAT_WAIT_BED);
+      #else
         while ( target_direction ? (isHeatingBed()) : (isCoolingBed()&&(CooldownNoWait==false)) )
         {
           if(( millis() - codenum) > 1000 ) //Print Temp Reading every 1 second while heating up.
@@ -2008,17 +5578,19 @@ void process_commands()
             SERIAL_PROTOCOLLN("");
             codenum = millis();
           }
-          manage_heater();
-          manage_inactivity();
-          lcd_update();
+          idle();
         }
         LCD_MESSAGEPGM(MSG_BED_DONE);
         previous_millis_cmd = millis();
+      #endif //NONBLOCKING_HEATUP
     #endif
         break;
 
     #if defined(FAN_PIN) && FAN_PIN > -1
       case 106: //M106 Fan On
+        #ifdef SEGMENT_MERGE
+        plan_flush_pending(); // the held move takes the fan speed it was queued with
+        #endif
         if (code_seen('S')){
            fanSpeed=constrain(code_value(),0,255);
         }
@@ -2027,6 +5599,9 @@ void process_commands()
         }
         break;
       case 107: //M107 Fan Off
+        #ifdef SEGMENT_MERGE
+        plan_flush_pending();
+        #endif
         fanSpeed = 0;
         break;
     #endif //FAN_PIN
@@ -2080,6 +5655,10 @@ void process_commands()
           LCD_MESSAGEPGM(WELCOME_MSG);
           lcd_update();
         #endif
+        #ifdef AUTO_POWER_CONTROL
+          auto_power_is_on = true;
+          auto_power_used_ms = millis();
+        #endif
         break;
       #endif
 
@@ -2099,6 +5678,9 @@ void process_commands()
         SET_OUTPUT(PS_ON_PIN);
         WRITE(PS_ON_PIN, PS_ON_ASLEEP);
       #endif
+      #ifdef AUTO_POWER_CONTROL
+        auto_power_is_on = false;
+      #endif
       #ifdef ULTIPANEL
         powersupply = false;
         LCD_MESSAGEPGM(MACHINE_NAME" "MSG_OFF".");
@@ -2168,15 +5750,28 @@ void process_commands()
           }
         }
       }
+      reset_extrusion_factors();
       break;
     case 115: // M115
       SERIAL_PROTOCOLPGM(MSG_M115_REPORT);
+      #ifdef BINARY_GCODE
+        SERIAL_PROTOCOLLNPGM("Cap:BINARY_GCODE:1");
+      #endif
       break;
     case 117: // M117 display message
       starpos = (strchr(strchr_pointer + 5,'*'));
       if(starpos!=NULL)
         *(starpos-1)='\0';
+    #if defined(STATE_SYNC_WITH_MOVES) && defined(ULTRA_LCD)
+      strncpy(sync_message, strchr_pointer + 5, LCD_WIDTH);
+      sync_message[LCD_WIDTH] = '\0';
+      sync_event_add(SYNC_MESSAGE, 0, 0);
+    #else
       lcd_setstatus(strchr_pointer + 5);
+    #endif
+      break;
+    case 112: // M112 emergency stop
+      kill();
       break;
     case 114: // M114
       SERIAL_PROTOCOLPGM("X:");
@@ -2231,6 +5826,14 @@ void process_commands()
       #endif
       break;
       //TODO: update for all axis, use for loop
+    #ifdef AUTO_REPORT_TEMPERATURES
+    case 155: // M155 S<seconds> report temperatures every S seconds, S0 stops it
+      if(code_seen('S')) {
+        auto_report_temp_interval = constrain(code_value(), 0, 60);
+        next_temp_report_ms = millis() + 1000UL * auto_report_temp_interval;
+      }
+      break;
+    #endif
     #ifdef BLINKM
     case 150: // M150
       {
@@ -2248,6 +5851,23 @@ void process_commands()
     #endif //BLINKM
     case 200: // M200 D<millimeters> set filament diameter and set E axis units to cubic millimeters (use S0 to set back to millimeters).
       {
+        #ifdef VOLUMETRIC_FLOW_LIMIT
+        if(code_seen('L')) { // L<mm^3/s> T<extruder> set the flow limit of the hotend, L0 for none
+          float limit = max(code_value(), 0.0);
+          tmp_extruder = active_extruder;
+          if(code_seen('T'))
+            tmp_extruder = code_value();
+          if(tmp_extruder >= EXTRUDERS) {
+            SERIAL_ECHO_START;
+            SERIAL_ECHO(MSG_M200_INVALID_EXTRUDER);
+            SERIAL_ECHOLN(tmp_extruder);
+            break;
+          }
+          volumetric_flow_max[tmp_extruder] = limit;
+          reset_extrusion_factors();
+          break;
+        }
+        #endif
         float area = .0;
         float radius = .0;
         if(code_seen('D')) {
@@ -2272,6 +5892,7 @@ void process_commands()
           break;
         }
         volumetric_multiplier[tmp_extruder] = 1 / area;
+        reset_extrusion_factors();
       }
       break;
     case 201: // M201
@@ -2330,6 +5951,12 @@ void process_commands()
 		if(code_seen('S')) {
 			delta_segments_per_second= code_value();
 		}
+		// per tower trims, X tower first: A B C rod length, I J K angle, U V W radius
+		for(int8_t i=0; i < 3; i++) {
+			if(code_seen("ABC"[i])) delta_diagonal_rod_trim[i] = code_value();
+			if(code_seen("IJK"[i])) delta_tower_angle_trim[i] = code_value();
+			if(code_seen("UVW"[i])) delta_radius_trim[i] = code_value();
+		}
 		
 		recalc_delta_settings(delta_radius, delta_diagonal_rod);
 		break;
@@ -2445,6 +6072,7 @@ void process_commands()
         else
         {
           extrudemultiply = tmp_code ;
+          reset_extrusion_factors();
         }
       }
     }
@@ -2491,9 +6119,7 @@ void process_commands()
             }
 
             while(digitalRead(pin_number) != target){
-              manage_heater();
-              manage_inactivity();
-              lcd_update();
+              idle();
             }
           }
         }
@@ -2574,6 +6200,9 @@ void process_commands()
         #ifdef PID_ADD_EXTRUSION_RATE
         if(code_seen('C')) Kc = code_value();
         #endif
+        #ifdef PID_EXTRUSION_FEEDFORWARD
+        if(code_seen('L')) pid_feedforward_ms = code_value();
+        #endif
 
         updatePID();
         SERIAL_PROTOCOL(MSG_OK);
@@ -2588,6 +6217,10 @@ void process_commands()
         //Kc does not have scaling applied above, or in resetting defaults
         SERIAL_PROTOCOL(Kc);
         #endif
+        #ifdef PID_EXTRUSION_FEEDFORWARD
+        SERIAL_PROTOCOL(" l:");
+        SERIAL_PROTOCOL(pid_feedforward_ms);
+        #endif
         SERIAL_PROTOCOLLN("");
       }
       break;
@@ -2596,17 +6229,17 @@ void process_commands()
     case 304: // M304
       {
         if(code_seen('P')) bedKp = code_value();
-        if(code_seen('I')) bedKi = scalePID_i(code_value());
-        if(code_seen('D')) bedKd = scalePID_d(code_value());
+        if(code_seen('I')) bedKi = code_value() * BED_PID_dT;
+        if(code_seen('D')) bedKd = code_value() / BED_PID_dT;
 
         updatePID();
         SERIAL_PROTOCOL(MSG_OK);
         SERIAL_PROTOCOL(" p:");
         SERIAL_PROTOCOL(bedKp);
         SERIAL_PROTOCOL(" i:");
-        SERIAL_PROTOCOL(unscalePID_i(bedKi));
+        SERIAL_PROTOCOL(bedKi / BED_PID_dT);
         SERIAL_PROTOCOL(" d:");
-        SERIAL_PROTOCOL(unscalePID_d(bedKd));
+        SERIAL_PROTOCOL(bedKd * BED_PID_dT);
         SERIAL_PROTOCOLLN("");
       }
       break;
@@ -2673,6 +6306,14 @@ void process_commands()
           temp=70;
       if (code_seen('S')) temp=code_value();
       if (code_seen('C')) c=code_value();
+    #ifdef PID_AUTOTUNE_CONVERGENCE
+      if (code_seen('A')) {
+        float bed_temp = 0;
+        if (code_seen('B')) bed_temp=code_value();
+        PID_autotune_all(temp, bed_temp, c);
+        break;
+      }
+    #endif
       PID_autotune(temp, e, c);
     }
     break;
@@ -2693,6 +6334,53 @@ void process_commands()
         retract_z_probe();    // Retract Z Servo endstop if enabled
     }
     break;
+#endif
+    case 410: // M410 quick stop, from the SD card as the host's are not queued with REALTIME_COMMANDS
+      quickstop_moves();
+      break;
+#ifdef BED_LEVEL_EEPROM
+    case 420: // M420 apply the stored bed leveling
+    {
+        if (!bed_level_stored)
+        {
+          SERIAL_ERROR_START;
+          SERIAL_ERRORLNPGM("No stored bed leveling, run G29");
+          break;
+        }
+        // Like G29, after homing, which measured Z with the probe, and with the same probe offset correction
+        if (! (axis_known_position[X_AXIS] && axis_known_position[Y_AXIS] && axis_known_position[Z_AXIS]) )
+        {
+          LCD_MESSAGEPGM(MSG_POSITION_UNKNOWN);
+          SERIAL_ECHO_START;
+          SERIAL_ECHOLNPGM(MSG_POSITION_UNKNOWN);
+          break;
+        }
+        st_synchronize();
+        float probe_x = current_position[X_AXIS] + X_PROBE_OFFSET_FROM_EXTRUDER;
+        float probe_y = current_position[Y_AXIS] + Y_PROBE_OFFSET_FROM_EXTRUDER;
+  #ifdef MESH_BED_LEVELING
+        // Z was last measured at the probe, so that is where the mesh height is 0
+        bed_level_mesh_active = true;
+        float probe_mesh_z = mesh_z_offset(probe_x, probe_y);
+        for (int8_t yCount = 0; yCount < AUTO_BED_LEVELING_GRID_POINTS; yCount++)
+          for (int8_t xCount = 0; xCount < AUTO_BED_LEVELING_GRID_POINTS; xCount++)
+            bed_level_mesh[yCount][xCount] -= probe_mesh_z;
+        current_position[Z_AXIS] -= mesh_z_offset(current_position[X_AXIS], current_position[Y_AXIS]);
+        plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+  #else
+        plan_bed_level_matrix = bed_level_stored_matrix;
+        plan_bed_level_changed();
+        plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+        float real_z = float(st_get_position(Z_AXIS))/axis_steps_per_unit[Z_AXIS];
+        float z_tmp = current_position[Z_AXIS];
+        apply_rotation_xyz(plan_bed_level_matrix, probe_x, probe_y, z_tmp);
+        current_position[Z_AXIS] = z_tmp - real_z + current_position[Z_AXIS];
+        plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+  #endif
+        SERIAL_ECHO_START;
+        SERIAL_ECHOLNPGM("Bed leveling applied");
+    }
+    break;
 #endif
     case 500: // M500 Store settings in EEPROM
     {
@@ -2724,129 +6412,28 @@ void process_commands()
     #ifdef FILAMENTCHANGEENABLE
     case 600: //Pause for filament change X[pos] Y[pos] Z[relative lift] E[initial retract] L[later retract distance for removal]
     {
-        float target[4];
-        float lastpos[4];
-        target[X_AXIS]=current_position[X_AXIS];
-        target[Y_AXIS]=current_position[Y_AXIS];
-        target[Z_AXIS]=current_position[Z_AXIS];
-        target[E_AXIS]=current_position[E_AXIS];
-        lastpos[X_AXIS]=current_position[X_AXIS];
-        lastpos[Y_AXIS]=current_position[Y_AXIS];
-        lastpos[Z_AXIS]=current_position[Z_AXIS];
-        lastpos[E_AXIS]=current_position[E_AXIS];
-        //retract by E
-        if(code_seen('E'))
-        {
-          target[E_AXIS]+= code_value();
-        }
-        else
-        {
-          #ifdef FILAMENTCHANGE_FIRSTRETRACT
-            target[E_AXIS]+= FILAMENTCHANGE_FIRSTRETRACT ;
-          #endif
-        }
-        plan_buffer_line(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], target[E_AXIS], feedrate/60, active_extruder);
-
-        //lift Z
-        if(code_seen('Z'))
-        {
-          target[Z_AXIS]+= code_value();
-        }
-        else
-        {
-          #ifdef FILAMENTCHANGE_ZADD
-            target[Z_AXIS]+= FILAMENTCHANGE_ZADD ;
-          #endif
-        }
-        plan_buffer_line(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], target[E_AXIS], feedrate/60, active_extruder);
-
-        //move xy
-        if(code_seen('X'))
-        {
-          target[X_AXIS]+= code_value();
-        }
-        else
-        {
-          #ifdef FILAMENTCHANGE_XPOS
-            target[X_AXIS]= FILAMENTCHANGE_XPOS ;
-          #endif
-        }
-        if(code_seen('Y'))
-        {
-          target[Y_AXIS]= code_value();
-        }
-        else
-        {
-          #ifdef FILAMENTCHANGE_YPOS
-            target[Y_AXIS]= FILAMENTCHANGE_YPOS ;
-          #endif
-        }
-
-        plan_buffer_line(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], target[E_AXIS], feedrate/60, active_extruder);
-
-        if(code_seen('L'))
-        {
-          target[E_AXIS]+= code_value();
-        }
-        else
-        {
-          #ifdef FILAMENTCHANGE_FINALRETRACT
-            target[E_AXIS]+= FILAMENTCHANGE_FINALRETRACT ;
-          #endif
-        }
-
-        plan_buffer_line(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], target[E_AXIS], feedrate/60, active_extruder);
-
+        filament_change_park();
+      #ifdef FILAMENTCHANGE_NONBLOCKING
+        change_step = CHANGE_PARKING; // see filament_change_pending()
+      #else
         //finish moves
         st_synchronize();
-        //disable extruder steppers so filament can be removed
-        disable_e0();
-        disable_e1();
-        disable_e2();
-        delay(100);
-        LCD_ALERTMESSAGEPGM(MSG_FILAMENTCHANGE);
+        filament_change_parked();
+        KEEPALIVE_STATE(PAUSED);
         uint8_t cnt=0;
         while(!lcd_clicked()){
           cnt++;
-          manage_heater();
-          manage_inactivity();
-          lcd_update();
+          previous_millis_cmd = millis(); // keep X, Y and Z powered
+          idle();
           if(cnt==0)
           {
-          #if BEEPER > 0
-            SET_OUTPUT(BEEPER);
-
-            WRITE(BEEPER,HIGH);
-            delay(3);
-            WRITE(BEEPER,LOW);
-            delay(3);
-          #else
-			#if !defined(LCD_FEEDBACK_FREQUENCY_HZ) || !defined(LCD_FEEDBACK_FREQUENCY_DURATION_MS)
-              lcd_buzz(1000/6,100);
-			#else
-			  lcd_buzz(LCD_FEEDBACK_FREQUENCY_DURATION_MS,LCD_FEEDBACK_FREQUENCY_HZ);
-			#endif
-          #endif
+            filament_change_beep();
           }
         }
 
         //return to normal
-        if(code_seen('L'))
-        {
-          target[E_AXIS]+= -code_value();
-        }
-        else
-        {
-          #ifdef FILAMENTCHANGE_FINALRETRACT
-            target[E_AXIS]+=(-1)*FILAMENTCHANGE_FINALRETRACT ;
-          #endif
-        }
-        current_position[E_AXIS]=target[E_AXIS]; //the long retract of L is compensated by manual filament feeding
-        plan_set_e_position(current_position[E_AXIS]);
-        plan_buffer_line(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], target[E_AXIS], feedrate/60, active_extruder); //should do nothing
-        plan_buffer_line(lastpos[X_AXIS], lastpos[Y_AXIS], target[Z_AXIS], target[E_AXIS], feedrate/60, active_extruder); //move xy back
-        plan_buffer_line(lastpos[X_AXIS], lastpos[Y_AXIS], lastpos[Z_AXIS], target[E_AXIS], feedrate/60, active_extruder); //move z back
-        plan_buffer_line(lastpos[X_AXIS], lastpos[Y_AXIS], lastpos[Z_AXIS], lastpos[E_AXIS], feedrate/60, active_extruder); //final untretract
+        filament_change_resume();
+      #endif
     }
     break;
     #endif //FILAMENTCHANGEENABLE
@@ -2858,6 +6445,8 @@ void process_commands()
               //                         millimeters x-offset and an optional differential hotend temperature of
               //                         mmm degrees. E.g., with "M605 S2 X100 R2" the second extruder will duplicate
               //                         the first with a spacing of 100mm in the x direction and 2 degrees hotter.
+              //    M605 S3 [Xnnn] [Rmmm]: Mirrored mode. As duplication mode, but the second extruder moves the other
+              //                         way in x and prints a mirror image. Xnnn is the spacing at the X home position.
               //
               //    Note: the X axis should be homed after changing dual x-carriage mode.
     {
@@ -2866,7 +6455,7 @@ void process_commands()
         if (code_seen('S'))
           dual_x_carriage_mode = code_value();
 
-        if (dual_x_carriage_mode == DXC_DUPLICATION_MODE)
+        if (dual_x_duplicating())
         {
           if (code_seen('X'))
             duplicate_extruder_x_offset = max(code_value(),X2_MIN_POS - x_home_pos(0));
@@ -2897,6 +6486,32 @@ void process_commands()
     break;
     #endif //DUAL_X_CARRIAGE
 
+    #ifdef HEAT_AND_HOME
+    case 700: // M700 heat and home in parallel
+    {
+      if(setTargetedHotend(700)){
+        break;
+      }
+      start_extruder = tmp_extruder;
+      start_hotend_temp = start_bed_temp = -1;
+      if(code_seen('S')) {
+        start_hotend_temp = code_value();
+        setTargetHotend(start_hotend_temp, start_extruder);
+        setWatch();
+      }
+      #if defined(TEMP_BED_PIN) && TEMP_BED_PIN > -1
+      if(code_seen('B')) {
+        start_bed_temp = code_value();
+        setTargetBed(start_bed_temp);
+      }
+      #endif
+      start_probe = code_seen('P');
+      // the heaters ramp from here on; loop() homes, probes and then waits for them
+      start_step = START_HOME;
+    }
+    break;
+    #endif //HEAT_AND_HOME
+
     case 907: // M907 Set digital trimpot motor current using axis codes.
     {
       #if defined(DIGIPOTSS_PIN) && DIGIPOTSS_PIN > -1
@@ -2934,6 +6549,9 @@ void process_commands()
     case 350: // M350 Set microstepping mode. Warning: Steps per unit remains unchanged. S code sets stepping mode for all drivers.
     {
       #if defined(X_MS1_PIN) && X_MS1_PIN > -1
+        #ifdef TRAVEL_MICROSTEP_FACTOR
+          st_synchronize(); // not under a travel at the coarse microsteps
+        #endif
         if(code_seen('S')) for(int i=0;i<=4;i++) microstep_mode(i,code_value());
         for(int i=0;i<NUM_AXIS;i++) if(code_seen(axis_codes[i])) microstep_mode(i,(uint8_t)code_value());
         if(code_seen('B')) microstep_mode(4,code_value());
@@ -2944,6 +6562,9 @@ void process_commands()
     case 351: // M351 Toggle MS1 MS2 pins directly, S# determines MS1 or MS2, X# sets the pin high/low.
     {
       #if defined(X_MS1_PIN) && X_MS1_PIN > -1
+      #ifdef TRAVEL_MICROSTEP_FACTOR
+      st_synchronize();
+      #endif
       if(code_seen('S')) switch((int)code_value())
       {
         case 1:
@@ -2959,6 +6580,285 @@ void process_commands()
       #endif
     }
     break;
+    #ifdef STEPPER_ISR_PROFILE
+    case 800: // M800 report stepper interrupt timing, S0 clears it
+      if(code_seen('S') && code_value() == 0)
+        st_isr_profile_reset();
+      else
+        st_isr_profile_report();
+      break;
+    #endif
+    #ifdef PLANNER_PROFILE
+    case 801: // M801 report planner timing, S0 clears it
+      if(code_seen('S') && code_value() == 0)
+        plan_profile_reset();
+      else
+        plan_profile_report();
+      break;
+    #endif
+    #ifdef MAIN_LOOP_TASKS
+    case 803: // M803 report main loop task timing, S0 clears it
+      if(code_seen('S') && code_value() == 0)
+        main_tasks_reset();
+      else
+        main_tasks_report();
+      break;
+    #endif
+    #ifdef MATH_BENCHMARK
+    case 804: // M804 time the hot math functions
+      benchmark_run();
+      break;
+    #endif
+    #ifdef PRINT_TIME_ESTIMATE
+    case 805: // M805 report planned and executed move time, S0 clears it
+      if(code_seen('S') && code_value() == 0)
+        plan_time_reset();
+      else
+        plan_time_report();
+      break;
+    #endif
+    #ifdef DRY_PLANNING
+    case 806: // M806 S1 start dry planning and clear the move time, S0 stop it; reports the move time
+      st_synchronize();
+      if(code_seen('S')) {
+        dry_planning = code_value() != 0;
+        if(dry_planning)
+          plan_time_reset();
+      }
+      SERIAL_ECHO_START;
+      SERIAL_ECHOPGM("Dry planning:");
+      SERIAL_ECHOLN(dry_planning ? "on" : "off");
+      plan_time_report();
+      break;
+    #endif
+    #ifdef THROUGHPUT_BENCHMARK
+    case 818: // M818 S<lines> run the next lines from the host dry and report their rate
+      bench_start(code_seen('S') ? constrain(code_value(), 1, 60000) : 1000);
+      break;
+    #endif
+    #ifdef POWER_LOSS_RECOVERY
+    case 807: // M807 report the power-loss journal, S1 resume the print it describes, S0 discard it
+      if(code_seen('S')) {
+        if(code_value() == 0)
+          card.writeJournal(NULL);
+        else
+          recovery_resume();
+      }
+      else
+        recovery_report();
+      break;
+    #endif
+    #ifdef BOOT_PREHEAT
+    case 808: // M808 S<temp> B<temp> heat up to the current targets at the next reset, P0 cancels
+      {
+        int hotend[EXTRUDERS];
+        for(int8_t e = 0; e < EXTRUDERS; e++)
+          hotend[e] = target_temperature[e];
+        int bed = target_temperature_bed;
+        if(code_seen('S')) hotend[active_extruder] = code_value();
+        if(code_seen('B')) bed = code_value();
+        Config_StoreBootPreheat((code_seen('P') && code_value() == 0) ? NULL : hotend, bed);
+      }
+      break;
+    #endif
+    #ifdef SD_CHECK_CRC
+    case 809: // M809 report SD card CRC errors and the SPI clock divider
+      card.linkStatus();
+      break;
+    #endif
+    #ifdef SD_LATENCY_HISTOGRAM
+    case 817: // M817 SD card access time histograms, S0 clears them
+      if(code_seen('S') && code_value() == 0)
+        card.latencyReset();
+      else
+        card.latencyReport();
+      break;
+    #endif
+    #ifdef SD_BENCHMARK
+    case 819: // M819 [W<KB>] [filename] SD read and write benchmark
+    {
+      starpos = (strchr(strchr_pointer + 4,'*'));
+      if(starpos!=NULL)
+        *(starpos-1)='\0';
+      char *name = strchr_pointer + 4;
+      while(*name == ' ') name++;
+      uint16_t writeKB = 0;
+      if(*name == 'W')
+      {
+        writeKB = strtoul(name + 1, &name, 10);
+        while(*name == ' ') name++;
+      }
+      card.benchmark(name, writeKB);
+    }
+    break;
+    #endif
+    #ifdef PRINT_STATISTICS
+    case 820: // M820 report the print statistics, S1 the host starts a job, S2 completed it, S0 clears them
+      if(code_seen('S'))
+      {
+        uint8_t s = code_value();
+        if(s == 1)
+          print_job_start(false);
+        else if(s == 2)
+          print_job_end(true);
+        else if(s == 0)
+        {
+          print_stats_update(); // the pending time and filament go too
+          memset(&print_stats, 0, sizeof(print_stats));
+          print_job_active = false;
+          print_stats_save();
+        }
+      }
+      else
+        print_stats_report();
+      break;
+    #endif
+    #ifdef AXIS_ENCODERS
+    case 821: // M821 report the axis encoders
+      axis_encoders_report();
+      break;
+    #endif
+    #ifdef EVENT_TRACE
+    case 822: // M822 dump the event trace, S0 clears it, F clears it and freezes it after the stepper next runs dry
+      if(code_seen('S'))
+        trace_clear(false);
+      else if(code_seen('F'))
+        trace_clear(true);
+      else
+        trace_dump();
+      break;
+    #endif
+    #ifdef SD_TELEMETRY
+    case 810: // M810 report the telemetry log, S0 stop it and write what is staged, S1 start it, P<ms> interval
+      if(code_seen('P'))
+        telemetry_interval = constrain(code_value_long(), 100, 3600000L);
+      if(code_seen('S'))
+      {
+        telemetry_on = code_value() != 0;
+        if(!telemetry_on)
+          card.telemetryWrite();
+        telemetry_next_ms = millis();
+      }
+      card.telemetryReport();
+      break;
+    #endif
+    #ifdef LOOP_LATENCY_MONITOR
+    case 811: // M811 report the longest loop and manage_heater gaps, S0 clears them
+      if(code_seen('S') && code_value() == 0)
+        latency_reset();
+      else
+        latency_report();
+      break;
+    #endif
+    #ifdef MEMORY_REPORT
+    case 812: // M812 report the stack high-water mark, the heap and the buffer sizes
+      memory_report();
+      break;
+    #endif
+    #ifdef SD_JOB_QUEUE
+    case 813: // M813 print the SD job queue, S0 stop it after the current job
+      if(code_seen('S') && code_value() == 0)
+        card.queueActive = false;
+      else if(card.queueStart())
+      {
+        starttime=millis();
+        #ifdef HEATER_DUTY_STATS
+        heater_duty_reset();
+        #endif
+        #ifdef PRINT_STATISTICS
+        if(card.sdprinting)
+          print_job_start(true);
+        #endif
+      }
+      break;
+    #endif
+    #ifdef HEATER_DUTY_STATS
+    case 814: // M814 heater duty and energy of this job, S0 starts a new job
+      if(code_seen('S') && code_value() == 0)
+        heater_duty_reset();
+      else
+        heater_duty_report();
+      break;
+    #endif
+    #ifdef PLANNER_STARVATION_STATS
+    case 815: // M815 planner underruns and late moves, S0 clears them
+      if(code_seen('S') && code_value() == 0)
+        plan_starvation_reset();
+      else
+        plan_starvation_report();
+      break;
+    #endif
+    #ifdef SERIAL_STATS
+    case 816: // M816 serial link statistics, S0 clears them
+      if(code_seen('S') && code_value() == 0)
+        serial_stats_reset();
+      else
+        serial_stats_report();
+      break;
+    #endif
+    #ifdef THERMAL_HISTORY
+    case 802: // M802 thermal history: S<ms> sets the interval and clears, B dumps in binary
+      if(code_seen('S'))
+        thermal_history_set_interval(constrain(code_value(), 100, 60000));
+      else if(code_seen('B'))
+        thermal_history_dump();
+      else
+        thermal_history_report();
+      break;
+    #endif
+    #ifdef INPUT_SHAPING
+    case 593: // M593 X Y F<Hz> D<damping ratio> set the input shaping, of both axes without X or Y
+    {
+      // takes effect once the axis has stood still for the echoes to play
+      bool shape_x = code_seen('X'), shape_y = code_seen('Y');
+      if(!shape_x && !shape_y)
+        shape_x = shape_y = true;
+      for(uint8_t axis = X_AXIS; axis <= Y_AXIS; axis++) {
+        if(!(axis == X_AXIS ? shape_x : shape_y))
+          continue;
+        if(code_seen('F'))
+          shaping_frequency[axis] = max(code_value(), 0.0);
+        if(code_seen('D'))
+          shaping_damping[axis] = constrain(code_value(), 0.0, 0.99);
+        if(!st_apply_shaping(axis)) {
+          SERIAL_ERROR_START;
+          SERIAL_ERRORLNPGM("Input shaping frequency too low, shaping off");
+          shaping_frequency[axis] = 0;
+          st_apply_shaping(axis);
+        }
+      }
+      SERIAL_ECHO_START;
+      SERIAL_ECHOPGM("Input shaping X F");
+      SERIAL_ECHO(shaping_frequency[X_AXIS]);
+      SERIAL_ECHOPGM(" D");
+      SERIAL_ECHO(shaping_damping[X_AXIS]);
+      SERIAL_ECHOPGM(" Y F");
+      SERIAL_ECHO(shaping_frequency[Y_AXIS]);
+      SERIAL_ECHOPGM(" D");
+      SERIAL_ECHO(shaping_damping[Y_AXIS]);
+      // a buffer too small for the steps of a period plays their echoes early, shaping them less
+      unsigned int overflows[2];
+      CRITICAL_SECTION_START;
+      overflows[X_AXIS] = shaping_overflows[X_AXIS];
+      overflows[Y_AXIS] = shaping_overflows[Y_AXIS];
+      CRITICAL_SECTION_END;
+      SERIAL_ECHOPGM(" overflows X");
+      SERIAL_ECHO(overflows[X_AXIS]);
+      SERIAL_ECHOPGM(" Y");
+      SERIAL_ECHOLN(overflows[Y_AXIS]);
+    }
+    break;
+    #endif
+    #ifdef LIN_ADVANCE
+    case 900: // M900 K<seconds> set the linear advance factor
+      // takes effect from the next planned move
+      if(code_seen('K'))
+        extruder_advance_k = code_value() > 0 ? code_value() : 0;
+      SERIAL_ECHO_START;
+      SERIAL_ECHOPGM("Advance K:");
+      SERIAL_ECHOLN(extruder_advance_k);
+      break;
+    #endif
     case 999: // M999: Restart after being stopped
       Stopped = false;
       lcd_reset_alert_level();
@@ -2988,6 +6888,9 @@ void process_commands()
       }
       #if EXTRUDERS > 1
       if(tmp_extruder != active_extruder) {
+      #ifdef TOOL_STANDBY
+        tool_standby_switch(active_extruder, tmp_extruder);
+      #endif
         // Save current position to return to after applying extruder offset
         memcpy(destination, current_position, sizeof(destination));
       #ifdef DUAL_X_CARRIAGE
@@ -3001,7 +6904,9 @@ void process_commands()
                 current_position[E_AXIS], max_feedrate[X_AXIS], active_extruder);
           plan_buffer_line(x_home_pos(active_extruder), current_position[Y_AXIS], current_position[Z_AXIS],
                 current_position[E_AXIS], max_feedrate[Z_AXIS], active_extruder);
+        #ifndef PLANNED_TOOLCHANGE
           st_synchronize();
+        #endif
         }
 
         // apply Y & Z extruder offset (x offset is already used in determining home pos)
@@ -3022,13 +6927,13 @@ void process_commands()
           current_position[X_AXIS] = inactive_extruder_x_pos;
           inactive_extruder_x_pos = destination[X_AXIS];
         }
-        else if (dual_x_carriage_mode == DXC_DUPLICATION_MODE)
+        else if (dual_x_duplicating())
         {
           active_extruder_parked = (active_extruder == 0); // this triggers the second extruder to move into the duplication position
           if (active_extruder == 0 || active_extruder_parked)
             current_position[X_AXIS] = inactive_extruder_x_pos;
           else
-            current_position[X_AXIS] = destination[X_AXIS] + duplicate_extruder_x_offset;
+            current_position[X_AXIS] = duplicate_extruder_x(destination[X_AXIS]);
           inactive_extruder_x_pos = destination[X_AXIS];
           extruder_duplication_enabled = false;
         }
@@ -3051,7 +6956,14 @@ void process_commands()
         // Set the new active extruder and position
         active_extruder = tmp_extruder;
       #endif //else DUAL_X_CARRIAGE
-        plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+      #ifdef PLANNED_TOOLCHANGE
+      {
+        const float *motor = kin_motor_position(current_position);
+        plan_shift_position(motor[X_AXIS], motor[Y_AXIS], motor[Z_AXIS], current_position[E_AXIS]);
+      }
+      #else
+        plan_set_current_position();
+      #endif
         // Move to the old position if 'F' was in the parameters
         if(make_move && Stopped == false) {
            prepare_move();
@@ -3072,31 +6984,62 @@ void process_commands()
     SERIAL_ECHOLNPGM("\"");
   }
 
+  #ifdef ACK_ON_RECEIPT
+  if(cmdbuffer_acked[bufindr])
+  {
+    previous_millis_cmd = millis(); // as ClearToSend(), its ok went out when it came in
+    return;
+  }
+  #endif
   ClearToSend();
 }
 
 void FlushSerialRequestResend()
 {
+  SERIAL_STAT(resends);
   //char cmdbuffer[bufindr][100]="Resend:";
+  #ifdef RESEND_HISTORY_SIZE
+  if(SERIAL_ON_FIRST_PORT)
+    resend_pending = true; // the lines already on their way are dropped as they come, see resend_history_skip()
+  else
+  #endif
   MYSERIAL.flush();
   SERIAL_PROTOCOLPGM(MSG_RESEND);
   SERIAL_PROTOCOLLN(gcode_LastN + 1);
-  ClearToSend();
+  previous_millis_cmd = millis();
+  serial_ok(); // the bad line never took a slot
 }
 
 void ClearToSend()
 {
   previous_millis_cmd = millis();
+  #ifdef HEAT_AND_HOME
+  if(start_in_step)
+    return;
+  #endif
+  #ifdef POWER_LOSS_RECOVERY
+  if(recovery_in_command)
+    return;
+  #endif
   #ifdef SDSUPPORT
   if(fromsd[bufindr])
     return;
   #endif //SDSUPPORT
-  SERIAL_PROTOCOLLNPGM(MSG_OK);
+  serial_ok(true);
 }
 
 void get_coordinates()
 {
   bool seen[4]={false,false,false,false};
+  #ifdef STEP_SPACE_POSITION
+  // Relative E only: keep the position under 1 mm, so that adding the next extrusion to it rounds
+  // off next to nothing. Taking the whole mm off is exact.
+  if((axis_relative_modes[E_AXIS] || relative_mode) && fabs(current_position[E_AXIS]) >= 1) {
+    float offset = (long)current_position[E_AXIS];
+    current_position[E_AXIS] -= offset;
+    plan_shift_e_origin(offset);
+  }
+  #endif
   for(int8_t i=0; i < NUM_AXIS; i++) {
     if(code_seen(axis_codes[i]))
     {
@@ -3154,26 +7097,47 @@ void clamp_to_software_endstops(float target[3])
 #ifdef DELTA
 void recalc_delta_settings(float radius, float diagonal_rod)
 {
-	 delta_tower1_x= -SIN_60*radius; // front left tower
-	 delta_tower1_y= -COS_60*radius;	   
-	 delta_tower2_x=  SIN_60*radius; // front right tower
-	 delta_tower2_y= -COS_60*radius;	   
-	 delta_tower3_x= 0.0;                  // back middle tower
-	 delta_tower3_y= radius;
+	 // front left, front right and back middle tower at 210, 330 and 90 degrees
+	 delta_tower1_x= (radius + delta_radius_trim[X_AXIS]) * cos(radians(210 + delta_tower_angle_trim[X_AXIS]));
+	 delta_tower1_y= (radius + delta_radius_trim[X_AXIS]) * sin(radians(210 + delta_tower_angle_trim[X_AXIS]));
+	 delta_tower2_x= (radius + delta_radius_trim[Y_AXIS]) * cos(radians(330 + delta_tower_angle_trim[Y_AXIS]));
+	 delta_tower2_y= (radius + delta_radius_trim[Y_AXIS]) * sin(radians(330 + delta_tower_angle_trim[Y_AXIS]));
+	 delta_tower3_x= (radius + delta_radius_trim[Z_AXIS]) * cos(radians(90 + delta_tower_angle_trim[Z_AXIS]));
+	 delta_tower3_y= (radius + delta_radius_trim[Z_AXIS]) * sin(radians(90 + delta_tower_angle_trim[Z_AXIS]));
 	 delta_diagonal_rod_2= sq(diagonal_rod);
+	 for(int8_t i=0; i < 3; i++)
+	   delta_diagonal_rod_2_tower[i] = sq(diagonal_rod + delta_diagonal_rod_trim[i]);
+}
+
+#ifdef DELTA_FAST_SQRT
+// sqrt(x) as x/sqrt(x), with the inverse square root from the usual bit level estimate refined by two
+// Newton steps, which leaves a relative error of about 5e-6
+static FORCE_INLINE float delta_sqrt(float x)
+{
+  union { float f; int32_t i; } estimate;
+  estimate.f = x;
+  estimate.i = 0x5f3759df - (estimate.i >> 1);
+  float half_x = 0.5 * x;
+  float y = estimate.f;
+  y *= 1.5 - half_x * y * y;
+  y *= 1.5 - half_x * y * y;
+  return x * y;
 }
+#else
+  #define delta_sqrt(x) sqrt(x)
+#endif
 
 void calculate_delta(float cartesian[3])
 {
-  delta[X_AXIS] = sqrt(delta_diagonal_rod_2
+  delta[X_AXIS] = delta_sqrt(delta_diagonal_rod_2_tower[X_AXIS]
                        - sq(delta_tower1_x-cartesian[X_AXIS])
                        - sq(delta_tower1_y-cartesian[Y_AXIS])
                        ) + cartesian[Z_AXIS];
-  delta[Y_AXIS] = sqrt(delta_diagonal_rod_2
+  delta[Y_AXIS] = delta_sqrt(delta_diagonal_rod_2_tower[Y_AXIS]
                        - sq(delta_tower2_x-cartesian[X_AXIS])
                        - sq(delta_tower2_y-cartesian[Y_AXIS])
                        ) + cartesian[Z_AXIS];
-  delta[Z_AXIS] = sqrt(delta_diagonal_rod_2
+  delta[Z_AXIS] = delta_sqrt(delta_diagonal_rod_2_tower[Z_AXIS]
                        - sq(delta_tower3_x-cartesian[X_AXIS])
                        - sq(delta_tower3_y-cartesian[Y_AXIS])
                        ) + cartesian[Z_AXIS];
@@ -3187,6 +7151,94 @@ void calculate_delta(float cartesian[3])
   SERIAL_ECHOPGM(" z="); SERIAL_ECHOLN(delta[Z_AXIS]);
   */
 }
+
+// The other way round: the effector position for the carriage heights, where the three rod spheres
+// around the carriages meet below them
+void calculate_delta_cartesian(const float carriage[3], float cartesian[3])
+{
+  float p[3][3] = { { delta_tower1_x, delta_tower1_y, carriage[X_AXIS] },
+                    { delta_tower2_x, delta_tower2_y, carriage[Y_AXIS] },
+                    { delta_tower3_x, delta_tower3_y, carriage[Z_AXIS] } };
+  // unit vectors ex towards tower 2, ey towards tower 3 in their plane, ez = ex x ey pointing up
+  float ex[3], ey[3], ez[3];
+  float d = 0, i = 0, j = 0;
+  for (int8_t n = 0; n < 3; n++) { ex[n] = p[1][n] - p[0][n]; d += sq(ex[n]); }
+  d = sqrt(d);
+  for (int8_t n = 0; n < 3; n++) { ex[n] /= d; i += ex[n] * (p[2][n] - p[0][n]); }
+  for (int8_t n = 0; n < 3; n++) { ey[n] = p[2][n] - p[0][n] - i * ex[n]; j += sq(ey[n]); }
+  j = sqrt(j);
+  for (int8_t n = 0; n < 3; n++) ey[n] /= j;
+  ez[X_AXIS] = ex[Y_AXIS] * ey[Z_AXIS] - ex[Z_AXIS] * ey[Y_AXIS];
+  ez[Y_AXIS] = ex[Z_AXIS] * ey[X_AXIS] - ex[X_AXIS] * ey[Z_AXIS];
+  ez[Z_AXIS] = ex[X_AXIS] * ey[Y_AXIS] - ex[Y_AXIS] * ey[X_AXIS];
+
+  float x = (delta_diagonal_rod_2_tower[X_AXIS] - delta_diagonal_rod_2_tower[Y_AXIS] + sq(d)) / (2 * d);
+  float y = (delta_diagonal_rod_2_tower[X_AXIS] - delta_diagonal_rod_2_tower[Z_AXIS] + sq(i) + sq(j)) / (2 * j) - i * x / j;
+  float z = sqrt(delta_diagonal_rod_2_tower[X_AXIS] - sq(x) - sq(y));
+  for (int8_t n = 0; n < 3; n++)
+    cartesian[n] = p[0][n] + x * ex[n] + y * ey[n] - z * ez[n];
+}
+#endif
+
+#ifdef SCARA
+float scara_angles[3] = {0.0, 0.0, 0.0};
+
+// atan(i/64) for i = 0..64
+static const float scara_atan_table[65] PROGMEM = {
+  0.00000000, 0.01562373, 0.03123983, 0.04684071, 0.06241881, 0.07796663, 0.09347678, 0.10894196,
+  0.12435499, 0.13970887, 0.15499674, 0.17021193, 0.18534795, 0.20039855, 0.21535770, 0.23021959,
+  0.24497866, 0.25962963, 0.27416745, 0.28858736, 0.30288487, 0.31705575, 0.33109608, 0.34500218,
+  0.35877067, 0.37239845, 0.38588267, 0.39922077, 0.41241044, 0.42544964, 0.43833656, 0.45106966,
+  0.46364761, 0.47606933, 0.48833395, 0.50044081, 0.51238946, 0.52417963, 0.53581124, 0.54728438,
+  0.55859932, 0.56975645, 0.58075635, 0.59159971, 0.60228735, 0.61282020, 0.62319933, 0.63342588,
+  0.64350111, 0.65342634, 0.66320299, 0.67283255, 0.68231655, 0.69165662, 0.70085441, 0.70991162,
+  0.71883000, 0.72761133, 0.73625743, 0.74477013, 0.75315128, 0.76140277, 0.76952648, 0.77752431,
+  0.78539816
+};
+
+// atan2(y, x) in radians, interpolated in the table after folding the angle into 0..45 degrees.
+// The error stays below 2e-5 rad, against several times the time of this for atan2() of the library.
+static float scara_atan2(float y, float x)
+{
+  float ax = fabs(x), ay = fabs(y);
+  if (ax == 0 && ay == 0) return 0;
+  bool steep = ay > ax;
+  float t = (steep ? ax / ay : ay / ax) * 64;
+  uint8_t i = t;
+  if (i > 63) i = 63;
+  float a0 = pgm_read_float(&scara_atan_table[i]);
+  float a = a0 + (pgm_read_float(&scara_atan_table[i + 1]) - a0) * (t - i);
+  if (steep) a = M_PI / 2 - a;
+  if (x < 0) a = M_PI - a;
+  return y < 0 ? -a : a;
+}
+
+// Joint angles in degrees for a nozzle position. The elbow bends to positive angles, a point out of
+// reach gets the stretched arm pointing at it. The shoulder angle is kept within -180..180, so the arm
+// must not have to cross the -X direction from the shoulder.
+void calculate_scara(float cartesian[3])
+{
+  float x = cartesian[X_AXIS] - SCARA_OFFSET_X;
+  float y = cartesian[Y_AXIS] - SCARA_OFFSET_Y;
+  float c = (sq(x) + sq(y) - sq(SCARA_LINKAGE_1) - sq(SCARA_LINKAGE_2)) / (2 * SCARA_LINKAGE_1 * SCARA_LINKAGE_2);
+  c = constrain(c, -1, 1);
+  float s = sqrt(1 - sq(c));
+  float shoulder = scara_atan2(y, x) - scara_atan2(SCARA_LINKAGE_2 * s, SCARA_LINKAGE_1 + SCARA_LINKAGE_2 * c);
+  if (shoulder < -M_PI) shoulder += 2 * M_PI;
+  scara_angles[X_AXIS] = degrees(shoulder);
+  scara_angles[Y_AXIS] = degrees(scara_atan2(s, c));
+  scara_angles[Z_AXIS] = cartesian[Z_AXIS];
+}
+
+// The nozzle position for the joint angles, only needed outside of the moves
+void calculate_scara_cartesian(const float angles[3], float cartesian[3])
+{
+  float shoulder = radians(angles[X_AXIS]), forearm = shoulder + radians(angles[Y_AXIS]);
+  float z = angles[Z_AXIS];
+  cartesian[X_AXIS] = SCARA_OFFSET_X + SCARA_LINKAGE_1 * cos(shoulder) + SCARA_LINKAGE_2 * cos(forearm);
+  cartesian[Y_AXIS] = SCARA_OFFSET_Y + SCARA_LINKAGE_1 * sin(shoulder) + SCARA_LINKAGE_2 * sin(forearm);
+  cartesian[Z_AXIS] = z;
+}
 #endif
 
 void prepare_move()
@@ -3194,7 +7246,7 @@ void prepare_move()
   clamp_to_software_endstops(destination);
 
   previous_millis_cmd = millis();
-#ifdef DELTA
+#ifdef KINEMATICS_SEGMENTED
   float difference[NUM_AXIS];
   for (int8_t i=0; i < NUM_AXIS; i++) {
     difference[i] = destination[i] - current_position[i];
@@ -3205,34 +7257,106 @@ void prepare_move()
   if (cartesian_mm < 0.000001) { cartesian_mm = abs(difference[E_AXIS]); }
   if (cartesian_mm < 0.000001) { return; }
   float seconds = 6000 * cartesian_mm / feedrate / feedmultiply;
-  int steps = max(1, int(delta_segments_per_second * seconds));
+#ifdef DELTA_SEGMENT_MM
+  int steps = max(1, int(min(ceil(cartesian_mm / DELTA_SEGMENT_MM), KINEMATICS_SEGMENTS_PER_SECOND * seconds)));
+#else
+  int steps = max(1, int(KINEMATICS_SEGMENTS_PER_SECOND * seconds));
+#endif
   // SERIAL_ECHOPGM("mm="); SERIAL_ECHO(cartesian_mm);
   // SERIAL_ECHOPGM(" seconds="); SERIAL_ECHO(seconds);
   // SERIAL_ECHOPGM(" steps="); SERIAL_ECHOLN(steps);
+#ifdef DELTA_SEGMENT_BATCH
+  float segment[DELTA_SEGMENT_BATCH][NUM_AXIS]; // tower positions and E of the segments of one batch
+  #ifdef DELTA_SEGMENT_INTERPOLATION_MM
+    // Odd segments get the average of the tower positions around them, the error of which
+    // shrinks with the square of the segment length.
+    bool interpolate = steps > 1 && cartesian_mm < DELTA_SEGMENT_INTERPOLATION_MM * steps;
+    bool interpolation_pending = false;
+    float last_delta[3];
+    if (interpolate) {
+      memcpy(last_delta, kin_motor_position(current_position), sizeof(last_delta));
+    }
+  #endif
+  int s = 1;
+  while (s <= steps) {
+    uint8_t count = 0;
+    for (; count < DELTA_SEGMENT_BATCH && s <= steps; count++, s++) {
+      float fraction = float(s) / float(steps);
+      for(int8_t i=0; i < NUM_AXIS; i++) {
+        destination[i] = current_position[i] + difference[i] * fraction;
+      }
+      segment[count][E_AXIS] = destination[E_AXIS];
+      #ifdef DELTA_SEGMENT_INTERPOLATION_MM
+        // only skip a segment when the exact one after it is in the same batch
+        if (interpolate && (s & 1) && s < steps && count + 1 < DELTA_SEGMENT_BATCH) {
+          interpolation_pending = true;
+          continue;
+        }
+      #endif
+      const float *motor = kin_motor_position(destination);
+      for(int8_t i=0; i < 3; i++) {
+        segment[count][i] = motor[i];
+      }
+      #ifdef DELTA_SEGMENT_INTERPOLATION_MM
+        if (interpolate) {
+          if (interpolation_pending) {
+            for(int8_t i=0; i < 3; i++) {
+              segment[count - 1][i] = (last_delta[i] + motor[i]) * 0.5;
+            }
+            interpolation_pending = false;
+          }
+          memcpy(last_delta, motor, sizeof(last_delta));
+        }
+      #endif
+    }
+    plan_defer_recalculation(true);
+    FEED_MULTIPLY_BEGIN();
+    for (uint8_t n = 0; n < count; n++) {
+      plan_buffer_line(segment[n][X_AXIS], segment[n][Y_AXIS], segment[n][Z_AXIS],
+                       segment[n][E_AXIS], feedrate*feedmultiply/60/100.0,
+                       active_extruder);
+    }
+    FEED_MULTIPLY_END();
+    plan_defer_recalculation(false);
+  }
+#else
+  #ifdef SCARA
+  float last_motor[3];
+  memcpy(last_motor, kin_motor_position(current_position), sizeof(last_motor));
+  #endif
   for (int s = 1; s <= steps; s++) {
     float fraction = float(s) / float(steps);
     for(int8_t i=0; i < NUM_AXIS; i++) {
       destination[i] = current_position[i] + difference[i] * fraction;
     }
-    calculate_delta(destination);
-    plan_buffer_line(delta[X_AXIS], delta[Y_AXIS], delta[Z_AXIS],
-                     destination[E_AXIS], feedrate*feedmultiply/60/100.0,
+    const float *motor = kin_motor_position(destination);
+    float feed_rate = feedrate*feedmultiply/60/100.0;
+    #ifdef SCARA
+    feed_rate = kin_motor_feedrate(last_motor, motor, cartesian_mm / steps, feed_rate);
+    memcpy(last_motor, motor, sizeof(last_motor));
+    #endif
+    FEED_MULTIPLY_BEGIN();
+    plan_buffer_line(motor[X_AXIS], motor[Y_AXIS], motor[Z_AXIS],
+                     destination[E_AXIS], feed_rate,
                      active_extruder);
+    FEED_MULTIPLY_END();
   }
-#else
+#endif //DELTA_SEGMENT_BATCH
+#else // !KINEMATICS_SEGMENTED
 
 #ifdef DUAL_X_CARRIAGE
   if (active_extruder_parked)
   {
-    if (dual_x_carriage_mode == DXC_DUPLICATION_MODE && active_extruder == 0)
+    if (dual_x_duplicating() && active_extruder == 0)
     {
       // move duplicate extruder into correct duplication position.
       plan_set_position(inactive_extruder_x_pos, current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
-      plan_buffer_line(current_position[X_AXIS] + duplicate_extruder_x_offset, current_position[Y_AXIS], current_position[Z_AXIS],
+      plan_buffer_line(duplicate_extruder_x(current_position[X_AXIS]), current_position[Y_AXIS], current_position[Z_AXIS],
           current_position[E_AXIS], max_feedrate[X_AXIS], 1);
       plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
       st_synchronize();
       extruder_duplication_enabled = true;
+      extruder_duplication_mirrored = (dual_x_carriage_mode == DXC_MIRRORED_MODE);
       active_extruder_parked = false;
     }
     else if (dual_x_carriage_mode == DXC_AUTO_PARK_MODE) // handle unparking of head
@@ -3267,7 +7391,9 @@ void prepare_move()
       plan_buffer_line(destination[X_AXIS], destination[Y_AXIS], destination[Z_AXIS], destination[E_AXIS], feedrate/60, active_extruder);
   }
   else {
+    FEED_MULTIPLY_BEGIN();
     plan_buffer_line(destination[X_AXIS], destination[Y_AXIS], destination[Z_AXIS], destination[E_AXIS], feedrate*feedmultiply/60/100.0, active_extruder);
+    FEED_MULTIPLY_END();
   }
 #endif //else DELTA
   for(int8_t i=0; i < NUM_AXIS; i++) {
@@ -3279,7 +7405,9 @@ void prepare_arc_move(char isclockwise) {
   float r = hypot(offset[X_AXIS], offset[Y_AXIS]); // Compute arc radius for mc_arc
 
   // Trace the arc
+  FEED_MULTIPLY_BEGIN();
   mc_arc(current_position, destination, offset, X_AXIS, Y_AXIS, Z_AXIS, feedrate*feedmultiply/60/100.0, r, isclockwise, active_extruder);
+  FEED_MULTIPLY_END();
 
   // As far as the parser is concerned, the position is now == target. In reality the
   // motion control system might still be processing the action and the real tool position
@@ -3290,6 +7418,19 @@ void prepare_arc_move(char isclockwise) {
   previous_millis_cmd = millis();
 }
 
+#ifdef BEZIER_CURVE_SUPPORT
+void prepare_bezier_move(const float *control) {
+  FEED_MULTIPLY_BEGIN();
+  mc_bezier(current_position, destination, control, feedrate*feedmultiply/60/100.0, active_extruder);
+  FEED_MULTIPLY_END();
+
+  for(int8_t i=0; i < NUM_AXIS; i++) {
+    current_position[i] = destination[i];
+  }
+  previous_millis_cmd = millis();
+}
+#endif
+
 #if defined(CONTROLLERFAN_PIN) && CONTROLLERFAN_PIN > -1
 
 #if defined(FAN_PIN)
@@ -3372,20 +7513,65 @@ void handle_status_leds(void) {
 
 void manage_inactivity()
 {
+  #ifdef REALTIME_COMMANDS
+  realtime_commands_run();
+  #endif
+  #ifdef STATE_SYNC_WITH_MOVES
+  sync_events_run();
+  #endif
+  #ifdef SEGMENT_MERGE
+  plan_check_pending();
+  #endif
+  #ifdef PLANNER_STARVATION_STATS
+  // the queue running dry is an underrun only while there are commands to run or an SD print goes on
+  plan_lines_waiting = buflen > 0
+  #ifdef SDSUPPORT
+    || card.sdprinting
+  #endif
+    ;
+  #endif
+  #ifdef PLANNER_PRIMING
+  plan_check_priming();
+  #endif
+  #ifdef AUTO_REPORT_TEMPERATURES
+  auto_report_temperatures();
+  #endif
+  #ifdef EEPROM_BACKGROUND_STORE
+  Config_StoreStep();
+  #endif
+  #ifdef PRINT_STATISTICS
+  print_stats_check();
+  #endif
+  #ifdef AXIS_ENCODERS
+  axis_encoders_check();
+  #endif
+  #ifdef AUTO_POWER_CONTROL
+  auto_power_check();
+  #endif
+  #ifdef REALTIME_FEEDRATE_OVERRIDE
+  if(feedmultiply != override_multiply) // M220 or the display changed it
+  {
+    override_multiply = feedmultiply;
+    plan_feedrate_override(feedmultiply);
+  }
+  #endif
   if( (millis() - previous_millis_cmd) >  max_inactive_time )
     if(max_inactive_time)
       kill();
   if(stepper_inactive_time)  {
-    if( (millis() - previous_millis_cmd) >  stepper_inactive_time )
+    // The steppers idle from the end of the last move, so a command that moves for longer than
+    // the timeout, like a slow G28, doesn't lose its position between two of its moves
+    if(blocks_queued())
+      previous_millis_move = millis();
+    else if( (millis() - previous_millis_cmd) >  stepper_inactive_time &&
+             (millis() - previous_millis_move) > stepper_inactive_time )
     {
-      if(blocks_queued() == false) {
-        disable_x();
-        disable_y();
-        disable_z();
-        disable_e0();
-        disable_e1();
-        disable_e2();
-      }
+      disable_x();
+      disable_y();
+      disable_z();
+      disable_e0();
+      disable_e1();
+      disable_e2();
     }
   }
   
@@ -3444,6 +7630,9 @@ void kill()
 {
   cli(); // Stop interrupts
   disable_heater();
+#ifdef LASER_PWM
+  digitalWrite(LASER_PIN, LOW);
+#endif
 
   disable_x();
   disable_y();
@@ -3568,6 +7757,11 @@ bool setTargetedHotend(int code){
         case 221:
           SERIAL_ECHO(MSG_M221_INVALID_EXTRUDER);
           break;
+        #ifdef HEAT_AND_HOME
+        case 700:
+          SERIAL_ECHOPGM("M700 Invalid extruder ");
+          break;
+        #endif
       }
       SERIAL_ECHOLN(tmp_extruder);
       return true;
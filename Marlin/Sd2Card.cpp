@@ -21,6 +21,8 @@
 
 #ifdef SDSUPPORT
 #include "Sd2Card.h"
+#include "spi_bus.h"
+#include "event_trace.h"
 //------------------------------------------------------------------------------
 #ifndef SOFTWARE_SPI
 // functions for hardware SPI
@@ -150,8 +152,88 @@ static void spiSend(uint8_t data) {
 }
 #endif  // SOFTWARE_SPI
 //------------------------------------------------------------------------------
+#ifdef SD_LATENCY_HISTOGRAM
+uint16_t sdLatency[SD_LATENCY_KINDS][SD_LATENCY_BUCKETS];
+uint32_t sdLatencyMax[SD_LATENCY_KINDS];
+
+void sdLatencyAdd(uint8_t kind, uint32_t startMicros) {
+  uint32_t t = micros() - startMicros;
+  if (t > sdLatencyMax[kind]) sdLatencyMax[kind] = t;
+  uint8_t bucket = 0;
+  for (t >>= 7; t && bucket < SD_LATENCY_BUCKETS - 1; t >>= 1) bucket++;
+  if (sdLatency[kind][bucket] != 0XFFFF) sdLatency[kind][bucket]++;
+}
+#endif  // SD_LATENCY_HISTOGRAM
+//------------------------------------------------------------------------------
+/** SPI send count bytes of buf and zeros for the rest of the block */
+static void spiSendPadded(uint8_t token, const uint8_t* buf, uint16_t count) {
+  spiSend(token);
+  for (uint16_t i = 0; i < 512; i++) {
+    spiSend(i < count ? buf[i] : 0);
+  }
+}
+//------------------------------------------------------------------------------
+#ifdef SD_CHECK_CRC
+/** CRC7 of a command, shifted left with the end bit set as it is sent */
+static uint8_t crc7(const uint8_t* data, uint8_t n) {
+  uint8_t crc = 0;
+  for (uint8_t i = 0; i < n; i++) {
+    uint8_t d = data[i];
+    for (uint8_t j = 0; j < 8; j++) {
+      crc <<= 1;
+      if ((d ^ crc) & 0X80) crc ^= 0X09;
+      d <<= 1;
+    }
+  }
+  return (crc << 1) | 1;
+}
+//------------------------------------------------------------------------------
+/** add a byte to the CRC16 (CCITT) of a data block */
+static inline uint16_t crc16Add(uint16_t crc, uint8_t b) {
+  crc = (uint8_t)(crc >> 8) | (crc << 8);
+  crc ^= b;
+  crc ^= (uint8_t)(crc & 0XFF) >> 4;
+  crc ^= crc << 12;
+  crc ^= (crc & 0XFF) << 5;
+  return crc;
+}
+//------------------------------------------------------------------------------
+/** CRC16 of n bytes of buf, continuing from crc */
+static uint16_t crc16(uint16_t crc, const uint8_t* buf, uint16_t n) {
+  for (uint16_t i = 0; i < n; i++) crc = crc16Add(crc, buf[i]);
+  return crc;
+}
+//------------------------------------------------------------------------------
+/**
+ * Receive the CRC that ends a data block and compare it with the one computed.
+ * After SD_CRC_SLOWDOWN bad blocks in a row the SPI clock is halved, down to
+ * the slowest rate, until the card is initialized again.
+ */
+bool Sd2Card::checkCrc(uint16_t crc) {
+  crc ^= (uint16_t)spiRec() << 8;
+  crc ^= spiRec();
+  if (!crc) {
+    crcRun_ = 0;
+    return true;
+  }
+  error(SD_CARD_ERROR_READ_CRC);
+  if (crcErrors_ < 0XFFFF) crcErrors_++;
+#ifndef SOFTWARE_SPI
+  if (++crcRun_ >= SD_CRC_SLOWDOWN && spiRate_ < 6) {
+    spiRate_++;
+    crcRun_ = 0;
+  }
+#endif  // SOFTWARE_SPI
+  return false;
+}
+#endif  // SD_CHECK_CRC
+//------------------------------------------------------------------------------
 // send command and return error code.  Return zero for OK
 uint8_t Sd2Card::cardCommand(uint8_t cmd, uint32_t arg) {
+  // any other command ends an open multiple block read or write
+  if (readActive_ && cmd != CMD12) readStop();
+  if (writeActive_) writeStop();
+
   // select card
   chipSelectLow();
 
@@ -165,9 +247,16 @@ uint8_t Sd2Card::cardCommand(uint8_t cmd, uint32_t arg) {
   for (int8_t s = 24; s >= 0; s -= 8) spiSend(arg >> s);
 
   // send CRC
+#ifdef SD_CHECK_CRC
+  // the card checks it once CMD59 has turned CRCs on
+  uint8_t msg[5] = {(uint8_t)(cmd | 0x40), (uint8_t)(arg >> 24), (uint8_t)(arg >> 16),
+                    (uint8_t)(arg >> 8), (uint8_t)arg};
+  uint8_t crc = crc7(msg, 5);
+#else  // SD_CHECK_CRC
   uint8_t crc = 0XFF;
   if (cmd == CMD0) crc = 0X95;  // correct crc for CMD0 with arg 0
   if (cmd == CMD8) crc = 0X87;  // correct crc for CMD8 with arg 0X1AA
+#endif  // SD_CHECK_CRC
   spiSend(crc);
 
   // skip stuff byte for stop read
@@ -206,9 +295,15 @@ uint32_t Sd2Card::cardSize() {
 //------------------------------------------------------------------------------
 void Sd2Card::chipSelectHigh() {
   digitalWrite(chipSelectPin_, HIGH);
+#ifdef SPI_BUS_ARBITER
+  spi_bus_release();
+#endif  // SPI_BUS_ARBITER
 }
 //------------------------------------------------------------------------------
 void Sd2Card::chipSelectLow() {
+#ifdef SPI_BUS_ARBITER
+  spi_bus_acquire();
+#endif  // SPI_BUS_ARBITER
 #ifndef SOFTWARE_SPI
   spiInit(spiRate_);
 #endif  // SOFTWARE_SPI
@@ -284,11 +379,31 @@ bool Sd2Card::eraseSingleBlockEnable() {
  * can be determined by calling errorCode() and errorData().
  */
 bool Sd2Card::init(uint8_t sckRateID, uint8_t chipSelectPin) {
+  int8_t done;
+  initStart(sckRateID, chipSelectPin);
+  while (!(done = initStep())) {}
+  return done > 0;
+}
+//------------------------------------------------------------------------------
+/**
+ * Start initializing an SD flash memory card without waiting for it.
+ * Call initStep() until it returns nonzero to finish.
+ *
+ * \param[in] sckRateID SPI clock rate selector. See setSckRate().
+ * \param[in] chipSelectPin SD chip select pin number.
+ */
+void Sd2Card::initStart(uint8_t sckRateID, uint8_t chipSelectPin) {
   errorCode_ = type_ = 0;
+  readActive_ = writeActive_ = false;
   chipSelectPin_ = chipSelectPin;
+  sckRateID_ = sckRateID;
   // 16-bit init start time allows over a minute
-  uint16_t t0 = (uint16_t)millis();
-  uint32_t arg;
+  initT0_ = (uint16_t)millis();
+  initCmd0_ = true;
+#ifdef SD_CHECK_CRC
+  crcErrors_ = 0;
+  crcRun_ = 0;
+#endif  // SD_CHECK_CRC
 
   // set pin modes
   pinMode(chipSelectPin_, OUTPUT);
@@ -311,35 +426,56 @@ bool Sd2Card::init(uint8_t sckRateID, uint8_t chipSelectPin) {
 
   // must supply min of 74 clock cycles with CS high.
   for (uint8_t i = 0; i < 10; i++) spiSend(0XFF);
-
-  // command to go idle in SPI mode
-  while ((status_ = cardCommand(CMD0, 0)) != R1_IDLE_STATE) {
-    if (((uint16_t)millis() - t0) > SD_INIT_TIMEOUT) {
-      error(SD_CARD_ERROR_CMD0);
-      goto fail;
+}
+//------------------------------------------------------------------------------
+/**
+ * Send the next command of an init begun with initStart(). The card is
+ * deselected between calls, so the SPI bus is free for other devices.
+ *
+ * \return Zero while the card is still starting up, 1 when it is ready
+ * and -1 for failure, see errorCode() and errorData().
+ */
+int8_t Sd2Card::initStep() {
+  if (initCmd0_) {
+    // command to go idle in SPI mode
+    if ((status_ = cardCommand(CMD0, 0)) != R1_IDLE_STATE) {
+      if (((uint16_t)millis() - initT0_) > SD_INIT_TIMEOUT) {
+        error(SD_CARD_ERROR_CMD0);
+        goto fail;
+      }
+      chipSelectHigh();
+      return 0;
     }
-  }
-  // check SD version
-  if ((cardCommand(CMD8, 0x1AA) & R1_ILLEGAL_COMMAND)) {
-    type(SD_CARD_TYPE_SD1);
-  } else {
-    // only need last byte of r7 response
-    for (uint8_t i = 0; i < 4; i++) status_ = spiRec();
-    if (status_ != 0XAA) {
-      error(SD_CARD_ERROR_CMD8);
+#ifdef SD_CHECK_CRC
+    // from here on every command and data block carries a valid CRC
+    if (cardCommand(CMD59, 1) != R1_IDLE_STATE) {
+      error(SD_CARD_ERROR_CMD59);
       goto fail;
     }
-    type(SD_CARD_TYPE_SD2);
+#endif  // SD_CHECK_CRC
+    // check SD version
+    if ((cardCommand(CMD8, 0x1AA) & R1_ILLEGAL_COMMAND)) {
+      type(SD_CARD_TYPE_SD1);
+    } else {
+      // only need last byte of r7 response
+      for (uint8_t i = 0; i < 4; i++) status_ = spiRec();
+      if (status_ != 0XAA) {
+        error(SD_CARD_ERROR_CMD8);
+        goto fail;
+      }
+      type(SD_CARD_TYPE_SD2);
+    }
+    initCmd0_ = false;
   }
   // initialize card and send host supports SDHC if SD2
-  arg = type() == SD_CARD_TYPE_SD2 ? 0X40000000 : 0;
-
-  while ((status_ = cardAcmd(ACMD41, arg)) != R1_READY_STATE) {
+  if ((status_ = cardAcmd(ACMD41, type() == SD_CARD_TYPE_SD2 ? 0X40000000 : 0)) != R1_READY_STATE) {
     // check for timeout
-    if (((uint16_t)millis() - t0) > SD_INIT_TIMEOUT) {
+    if (((uint16_t)millis() - initT0_) > SD_INIT_TIMEOUT) {
       error(SD_CARD_ERROR_ACMD41);
       goto fail;
     }
+    chipSelectHigh();
+    return 0;
   }
   // if SD2 read OCR register to check for SDHC card
   if (type() == SD_CARD_TYPE_SD2) {
@@ -354,14 +490,14 @@ bool Sd2Card::init(uint8_t sckRateID, uint8_t chipSelectPin) {
   chipSelectHigh();
 
 #ifndef SOFTWARE_SPI
-  return setSckRate(sckRateID);
+  return setSckRate(sckRateID_) ? 1 : -1;
 #else  // SOFTWARE_SPI
-  return true;
+  return 1;
 #endif  // SOFTWARE_SPI
 
  fail:
   chipSelectHigh();
-  return false;
+  return -1;
 }
 //------------------------------------------------------------------------------
 /**
@@ -369,17 +505,33 @@ bool Sd2Card::init(uint8_t sckRateID, uint8_t chipSelectPin) {
  *
  * \param[in] blockNumber Logical block to be read.
  * \param[out] dst Pointer to the location that will receive the data.
+ * \param[in] count Bytes of the block to store in dst, the rest is
+ * received and dropped.
  * \return The value one, true, is returned for success and
  * the value zero, false, is returned for failure.
  */
-bool Sd2Card::readBlock(uint32_t blockNumber, uint8_t* dst) {
+bool Sd2Card::readBlock(uint32_t blockNumber, uint8_t* dst, uint16_t count) {
+  SD_LATENCY_TIME(SD_LATENCY_READ_BLOCK);
+  TRACE_SPAN(TRACE_SD_READ);
   // use address if not SDHC card
   if (type()!= SD_CARD_TYPE_SDHC) blockNumber <<= 9;
+#ifdef SD_CHECK_CRC
+  // a corrupted block is read again, maybe at the slower clock checkCrc() set
+  for (uint8_t retry = 0; ; retry++) {
+    if (cardCommand(CMD17, blockNumber)) {
+      error(SD_CARD_ERROR_CMD17);
+      goto fail;
+    }
+    if (readData(dst, count, 512 - count)) return true;
+    if (errorCode_ != SD_CARD_ERROR_READ_CRC || retry == SD_CRC_RETRIES) return false;
+  }
+#else  // SD_CHECK_CRC
   if (cardCommand(CMD17, blockNumber)) {
     error(SD_CARD_ERROR_CMD17);
     goto fail;
   }
-  return readData(dst, 512);
+  return readData(dst, count, 512 - count);
+#endif  // SD_CHECK_CRC
 
  fail:
   chipSelectHigh();
@@ -394,11 +546,57 @@ bool Sd2Card::readBlock(uint32_t blockNumber, uint8_t* dst) {
  * the value zero, false, is returned for failure.
  */
 bool Sd2Card::readData(uint8_t *dst) {
+  SD_LATENCY_TIME(SD_LATENCY_READ_DATA);
   chipSelectLow();
   return readData(dst, 512);
 }
 //------------------------------------------------------------------------------
-bool Sd2Card::readData(uint8_t* dst, uint16_t count) {
+/** Receive part of one data block in a multiple block read sequence
+ *
+ * Does not wait for the card: if the start token has not arrived yet
+ * nothing is transferred.  The card stays selected until the block is
+ * complete.
+ *
+ * \param[out] dst Pointer to the 512 byte location for the block.
+ * \param[in,out] offset Number of bytes of the block received so far.
+ * \param[in] count Maximum number of bytes to receive in this call.
+ *
+ * \return 1 when the block is complete, 0 if more calls are needed
+ * and -1 if an error occurred.
+ */
+int8_t Sd2Card::readDataPart(uint8_t* dst, uint16_t* offset, uint16_t count) {
+  chipSelectLow();
+  if (*offset == 0) {
+    if ((status_ = spiRec()) == 0XFF) {
+      chipSelectHigh();
+      return 0;
+    }
+    if (status_ != DATA_START_BLOCK) {
+      error(SD_CARD_ERROR_READ);
+      goto fail;
+    }
+  }
+  if (count > 512 - *offset) count = 512 - *offset;
+  spiRead(dst + *offset, count);
+  *offset += count;
+  if (*offset < 512) return 0;
+
+#ifdef SD_CHECK_CRC
+  if (!checkCrc(crc16(0, dst, 512))) goto fail;
+#else  // SD_CHECK_CRC
+  // discard CRC
+  spiRec();
+  spiRec();
+#endif  // SD_CHECK_CRC
+  chipSelectHigh();
+  return 1;
+
+ fail:
+  chipSelectHigh();
+  return -1;
+}
+//------------------------------------------------------------------------------
+bool Sd2Card::readData(uint8_t* dst, uint16_t count, uint16_t skip) {
   // wait for start block token
   uint16_t t0 = millis();
   while ((status_ = spiRec()) == 0XFF) {
@@ -413,10 +611,19 @@ bool Sd2Card::readData(uint8_t* dst, uint16_t count) {
   }
   // transfer data
   spiRead(dst, count);
+#ifdef SD_CHECK_CRC
+  {
+    uint16_t crc = crc16(0, dst, count);
+    while (skip--) crc = crc16Add(crc, spiRec());
+    if (!checkCrc(crc)) goto fail;
+  }
+#else  // SD_CHECK_CRC
+  while (skip--) spiRec();
 
   // discard CRC
   spiRec();
   spiRec();
+#endif  // SD_CHECK_CRC
   chipSelectHigh();
   return true;
 
@@ -455,6 +662,7 @@ bool Sd2Card::readStart(uint32_t blockNumber) {
     error(SD_CARD_ERROR_CMD18);
     goto fail;
   }
+  readActive_ = true;
   chipSelectHigh();
   return true;
 
@@ -469,6 +677,7 @@ bool Sd2Card::readStart(uint32_t blockNumber) {
  * the value zero, false, is returned for failure.
  */
 bool Sd2Card::readStop() {
+  readActive_ = false;
   chipSelectLow();
   if (cardCommand(CMD12, 0)) {
     error(SD_CARD_ERROR_CMD12);
@@ -505,6 +714,7 @@ bool Sd2Card::setSckRate(uint8_t sckRateID) {
 //------------------------------------------------------------------------------
 // wait for card to go not busy
 bool Sd2Card::waitNotBusy(uint16_t timeoutMillis) {
+  SD_LATENCY_TIME(SD_LATENCY_BUSY);
   uint16_t t0 = millis();
   while (spiRec() != 0XFF) {
     if (((uint16_t)millis() - t0) >= timeoutMillis) goto fail;
@@ -520,17 +730,20 @@ bool Sd2Card::waitNotBusy(uint16_t timeoutMillis) {
  *
  * \param[in] blockNumber Logical block to be written.
  * \param[in] src Pointer to the location of the data to be written.
+ * \param[in] count Bytes of src to write, the rest of the block is
+ * filled with zeros. A small record needs no 512 byte buffer.
  * \return The value one, true, is returned for success and
  * the value zero, false, is returned for failure.
  */
-bool Sd2Card::writeBlock(uint32_t blockNumber, const uint8_t* src) {
+bool Sd2Card::writeBlock(uint32_t blockNumber, const uint8_t* src,
+                         uint16_t count) {
   // use address if not SDHC card
   if (type() != SD_CARD_TYPE_SDHC) blockNumber <<= 9;
   if (cardCommand(CMD24, blockNumber)) {
     error(SD_CARD_ERROR_CMD24);
     goto fail;
   }
-  if (!writeData(DATA_START_BLOCK, src)) goto fail;
+  if (!writeData(DATA_START_BLOCK, src, count)) goto fail;
 
   // wait for flash programming to complete
   if (!waitNotBusy(SD_WRITE_TIMEOUT)) {
@@ -570,11 +783,24 @@ bool Sd2Card::writeData(const uint8_t* src) {
 }
 //------------------------------------------------------------------------------
 // send one block of data for write block or write multiple blocks
-bool Sd2Card::writeData(uint8_t token, const uint8_t* src) {
-  spiSendBlock(token, src);
+bool Sd2Card::writeData(uint8_t token, const uint8_t* src, uint16_t count) {
+#ifdef SD_CHECK_CRC
+  uint16_t crc = crc16(0, src, count);
+  for (uint16_t i = count; i < 512; i++) crc = crc16Add(crc, 0);
+#endif  // SD_CHECK_CRC
+  if (count < 512) {
+    spiSendPadded(token, src, count);
+  } else {
+    spiSendBlock(token, src);
+  }
 
+#ifdef SD_CHECK_CRC
+  spiSend(crc >> 8);
+  spiSend(crc);
+#else  // SD_CHECK_CRC
   spiSend(0xff);  // dummy crc
   spiSend(0xff);  // dummy crc
+#endif  // SD_CHECK_CRC
 
   status_ = spiRec();
   if ((status_ & DATA_RES_MASK) != DATA_RES_ACCEPTED) {
@@ -611,6 +837,7 @@ bool Sd2Card::writeStart(uint32_t blockNumber, uint32_t eraseCount) {
     error(SD_CARD_ERROR_CMD25);
     goto fail;
   }
+  writeActive_ = true;
   chipSelectHigh();
   return true;
 
@@ -625,6 +852,7 @@ bool Sd2Card::writeStart(uint32_t blockNumber, uint32_t eraseCount) {
  * the value zero, false, is returned for failure.
  */
 bool Sd2Card::writeStop() {
+  writeActive_ = false;
   chipSelectLow();
   if (!waitNotBusy(SD_WRITE_TIMEOUT)) goto fail;
   spiSend(STOP_TRAN_TOKEN);
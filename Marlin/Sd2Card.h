@@ -103,6 +103,10 @@ uint8_t const SD_CARD_ERROR_WRITE_TIMEOUT = 0X17;
 uint8_t const SD_CARD_ERROR_SCK_RATE = 0X18;
 /** init() not called */
 uint8_t const SD_CARD_ERROR_INIT_NOT_CALLED = 0X19;
+/** card did not accept CMD59 (CRC on) */
+uint8_t const SD_CARD_ERROR_CMD59 = 0X1A;
+/** CRC of a data block read does not match */
+uint8_t const SD_CARD_ERROR_READ_CRC = 0X1B;
 //------------------------------------------------------------------------------
 // card types
 /** Standard capacity V1 SD card */
@@ -147,6 +151,34 @@ uint8_t const SPI_MISO_PIN = SOFT_SPI_MISO_PIN;
 uint8_t const SPI_SCK_PIN = SOFT_SPI_SCK_PIN;
 #endif  // SOFTWARE_SPI
 //------------------------------------------------------------------------------
+#ifdef SD_LATENCY_HISTOGRAM
+// Log-scale histograms of how long card accesses take. The kinds nest: a
+// readBlock() includes the waitNotBusy() of its command, a cache miss the
+// readBlock() and the write back.
+#define SD_LATENCY_READ_BLOCK 0  // readBlock(): command and one block
+#define SD_LATENCY_READ_DATA  1  // readData(): one block of a multiple block read
+#define SD_LATENCY_BUSY       2  // waitNotBusy()
+#define SD_LATENCY_CACHE_MISS 3  // SdVolume cache miss: FAT, directory, part block
+#define SD_LATENCY_KINDS      4
+// Bucket 0 is under 128us, bucket n from 64<<n us, the last one has no end
+#define SD_LATENCY_BUCKETS    14
+extern uint16_t sdLatency[SD_LATENCY_KINDS][SD_LATENCY_BUCKETS];
+extern uint32_t sdLatencyMax[SD_LATENCY_KINDS];  // us
+void sdLatencyAdd(uint8_t kind, uint32_t startMicros);
+// Times the rest of the enclosing block into the histogram of kind
+class SdLatencyTimer {
+ public:
+  explicit SdLatencyTimer(uint8_t kind) : kind_(kind), t0_(micros()) {}
+  ~SdLatencyTimer() {sdLatencyAdd(kind_, t0_);}
+ private:
+  uint8_t kind_;
+  uint32_t t0_;
+};
+#define SD_LATENCY_TIME(kind) SdLatencyTimer sdLatencyTimer(kind)
+#else  // SD_LATENCY_HISTOGRAM
+#define SD_LATENCY_TIME(kind)
+#endif  // SD_LATENCY_HISTOGRAM
+//------------------------------------------------------------------------------
 /**
  * \class Sd2Card
  * \brief Raw access to SD and SDHC flash memory cards.
@@ -154,7 +186,7 @@ uint8_t const SPI_SCK_PIN = SOFT_SPI_SCK_PIN;
 class Sd2Card {
  public:
   /** Construct an instance of Sd2Card. */
-  Sd2Card() : errorCode_(SD_CARD_ERROR_INIT_NOT_CALLED), type_(0) {}
+  Sd2Card() : errorCode_(SD_CARD_ERROR_INIT_NOT_CALLED), readActive_(false), type_(0), writeActive_(false) {}
   uint32_t cardSize();
   bool erase(uint32_t firstBlock, uint32_t lastBlock);
   bool eraseSingleBlockEnable();
@@ -169,6 +201,14 @@ class Sd2Card {
   int errorCode() const {return errorCode_;}
   /** \return error data for last error. */
   int errorData() const {return status_;}
+#ifdef SD_CHECK_CRC
+  /** \return data blocks read with a wrong CRC since init */
+  uint16_t crcErrors() const {return crcErrors_;}
+  /** \return SPI clock rate selector in use, see setSckRate() */
+  uint8_t sckRate() const {return spiRate_;}
+  /** \return SPI clock rate selector the card was initialized for */
+  uint8_t initSckRate() const {return sckRateID_;}
+#endif  // SD_CHECK_CRC
   /**
    * Initialize an SD flash memory card with default clock rate and chip
    * select pin.  See sd2Card::init(uint8_t sckRateID, uint8_t chipSelectPin).
@@ -177,7 +217,10 @@ class Sd2Card {
    */
   bool init(uint8_t sckRateID = SPI_FULL_SPEED,
     uint8_t chipSelectPin = SD_CHIP_SELECT_PIN);
-  bool readBlock(uint32_t block, uint8_t* dst);
+  void initStart(uint8_t sckRateID = SPI_FULL_SPEED,
+    uint8_t chipSelectPin = SD_CHIP_SELECT_PIN);
+  int8_t initStep();
+  bool readBlock(uint32_t block, uint8_t* dst, uint16_t count = 512);
   /**
    * Read a card's CID register. The CID contains card identification
    * information such as Manufacturer ID, Product name, Product serial
@@ -202,6 +245,9 @@ class Sd2Card {
     return readRegister(CMD9, csd);
   }
   bool readData(uint8_t *dst);
+  int8_t readDataPart(uint8_t* dst, uint16_t* offset, uint16_t count);
+  /** \return true while a multiple block read sequence is open. */
+  bool readActive() const {return readActive_;}
   bool readStart(uint32_t blockNumber);
   bool readStop();
   bool setSckRate(uint8_t sckRateID);
@@ -209,31 +255,46 @@ class Sd2Card {
    * \return 0 - SD V1, 1 - SD V2, or 3 - SDHC.
    */
   int type() const {return type_;}
-  bool writeBlock(uint32_t blockNumber, const uint8_t* src);
+  bool writeBlock(uint32_t blockNumber, const uint8_t* src,
+                  uint16_t count = 512);
   bool writeData(const uint8_t* src);
+  /** \return true while a multiple block write sequence is open. */
+  bool writeActive() const {return writeActive_;}
   bool writeStart(uint32_t blockNumber, uint32_t eraseCount);
   bool writeStop();
  private:
   //----------------------------------------------------------------------------
   uint8_t chipSelectPin_;
+#ifdef SD_CHECK_CRC
+  uint16_t crcErrors_;
+  uint8_t crcRun_;     // blocks with a wrong CRC in a row
+#endif  // SD_CHECK_CRC
   uint8_t errorCode_;
+  bool initCmd0_;      // initStep() still waits for the card to go idle
+  uint16_t initT0_;    // millis() when initStart() was called
+  bool readActive_;
   uint8_t spiRate_;
+  uint8_t sckRateID_;  // SPI rate initStep() switches to at the end
   uint8_t status_;
   uint8_t type_;
+  bool writeActive_;
   // private functions
   uint8_t cardAcmd(uint8_t cmd, uint32_t arg) {
     cardCommand(CMD55, 0);
     return cardCommand(cmd, arg);
   }
   uint8_t cardCommand(uint8_t cmd, uint32_t arg);
+#ifdef SD_CHECK_CRC
+  bool checkCrc(uint16_t crc);
+#endif  // SD_CHECK_CRC
 
-  bool readData(uint8_t* dst, uint16_t count);
+  bool readData(uint8_t* dst, uint16_t count, uint16_t skip = 0);
   bool readRegister(uint8_t cmd, void* buf);
   void chipSelectHigh();
   void chipSelectLow();
   void type(uint8_t value) {type_ = value;}
   bool waitNotBusy(uint16_t timeoutMillis);
-  bool writeData(uint8_t token, const uint8_t* src);
+  bool writeData(uint8_t token, const uint8_t* src, uint16_t count = 512);
 };
 #endif  // Sd2Card_h
 
@@ -28,6 +28,48 @@ SdBaseFile* SdBaseFile::cwd_ = 0;
 // callback function for date/time
 void (*SdBaseFile::dateTime_)(uint16_t* date, uint16_t* time) = 0;
 //------------------------------------------------------------------------------
+#ifdef SD_STREAMING_READ
+// bytes of the next block received per byte chunk consumed from the current one
+uint8_t const STREAM_CHUNK = 32;
+// limit on the clusters looked up in the FAT before a multiple block read
+uint8_t const STREAM_MAX_RUN = 64;
+
+// Only one file is streamed at a time, so the buffers are shared.
+static SdBaseFile* streamFile_ = 0;
+static uint8_t streamBuf_[2][512];
+static uint8_t streamFront_;          // buffer being consumed
+static uint16_t streamPos_;           // next byte in the front buffer
+static uint16_t streamFill_;          // bytes received into the back buffer
+static uint16_t streamSkip_;          // bytes to skip in the first block
+static bool streamBackReady_;         // back buffer holds a complete block
+static uint32_t streamFrontCluster_;  // cluster of the front buffer block
+static uint32_t streamBackCluster_;   // cluster of the back buffer block
+static uint32_t streamBlock_;         // block the card sends next
+static uint32_t streamCluster_;       // cluster of streamBlock_
+static uint32_t streamRunEnd_;        // last block of the open multiple block read
+static uint32_t streamNextCluster_;   // cluster following the open read
+static uint32_t streamPosition_;      // file position the stream is at
+#ifdef SD_CHECK_CRC
+static uint8_t streamRetries_;        // times the back buffer block was corrupted
+#endif  // SD_CHECK_CRC
+#endif  // SD_STREAMING_READ
+// cluster of the block returned by readPeek()
+static uint32_t peekCluster_;
+#ifdef SD_WRITE_BEHIND
+// Clusters reserved ahead of writeBlockRun(), for one file at a time
+static SdBaseFile* writeFile_ = 0;
+static uint32_t writeRunEnd_;        // last reserved cluster
+static uint32_t writeNextBlock_;     // block the open multiple block write expects
+#endif  // SD_WRITE_BEHIND
+#ifdef SD_CLUSTER_RUN_CACHE
+// Contiguous cluster runs of one file, so reading it needs no FAT lookups.
+static SdBaseFile* runFile_ = 0;
+static uint32_t runStart_[SD_CLUSTER_RUN_CACHE];   // first cluster of each run
+static uint32_t runLength_[SD_CLUSTER_RUN_CACHE];  // clusters in each run
+static uint8_t runCount_;                          // runs in use
+static uint8_t runHint_;                           // run of the last lookup
+#endif  // SD_CLUSTER_RUN_CACHE
+//------------------------------------------------------------------------------
 // add a cluster to a file
 bool SdBaseFile::addCluster() {
   if (!vol_->allocContiguous(1, &curCluster_)) goto fail;
@@ -91,6 +133,12 @@ dir_t* SdBaseFile::cacheDirEntry(uint8_t action) {
  * Reasons for failure include no file is open or an I/O error.
  */
 bool SdBaseFile::close() {
+#ifdef SD_STREAMING_READ
+  if (streamFile_ == this) streamStop();
+#endif  // SD_STREAMING_READ
+#ifdef SD_CLUSTER_RUN_CACHE
+  if (runFile_ == this) runFile_ = 0;
+#endif  // SD_CLUSTER_RUN_CACHE
   bool rtn = sync();
   type_ = FAT_FILE_TYPE_CLOSED;
   return rtn;
@@ -166,7 +214,13 @@ bool SdBaseFile::createContiguous(SdBaseFile* dirFile,
   // insure sync() will update dir entry
   flags_ |= F_FILE_DIR_DIRTY;
 
-  return sync();
+  if (!sync()) goto fail;
+#ifdef SD_WRITE_BEHIND
+  // the clusters are chained, writeBlockRun() writes them as one run
+  writeFile_ = this;
+  writeRunEnd_ = firstCluster_ + count - 1;
+#endif  // SD_WRITE_BEHIND
+  return true;
 
  fail:
   return false;
@@ -294,7 +348,7 @@ bool SdBaseFile::getFilename(char* name) {
   return true;
 }
 //------------------------------------------------------------------------------
-void SdBaseFile::getpos(fpos_t* pos) {
+void SdBaseFile::getpos(filepos_t* pos) {
   pos->position = curPosition_;
   pos->cluster = curCluster_;
 }
@@ -920,12 +974,45 @@ bool SdBaseFile::openRoot(SdVolume* vol) {
   return false;
 }
 //------------------------------------------------------------------------------
+/** Open a subdirectory from its first cluster, without its directory entry.
+ *
+ * \param[in] vol The FAT volume containing the subdirectory.
+ * \param[in] cluster The first cluster of the subdirectory.
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ * The directory is opened read only.
+ */
+bool SdBaseFile::openSubDir(SdVolume* vol, uint32_t cluster) {
+  // error if file is already open or cluster is the fixed root
+  if (isOpen() || cluster == 0) goto fail;
+
+  vol_ = vol;
+  firstCluster_ = cluster;
+  if (!vol->chainSize(firstCluster_, &fileSize_)) goto fail;
+  type_ = FAT_FILE_TYPE_SUBDIR;
+  // read only
+  flags_ = O_READ;
+
+  // set to start of file
+  curCluster_ = 0;
+  curPosition_ = 0;
+
+  // the entry is not known
+  dirBlock_ = 0;
+  dirIndex_ = 0;
+  return true;
+
+ fail:
+  return false;
+}
+//------------------------------------------------------------------------------
 /** Return the next available byte without consuming it.
  *
  * \return The byte if no error and not at eof else -1;
  */
 int SdBaseFile::peek() {
-  fpos_t pos;
+  filepos_t pos;
   getpos(&pos);
   int c = read();
   if (c >= 0) setpos(&pos);
@@ -1069,7 +1156,7 @@ int16_t SdBaseFile::read(void* buf, uint16_t nbyte) {
           curCluster_ = firstCluster_;
         } else {
           // get next cluster from FAT
-          if (!vol_->fatGet(curCluster_, &curCluster_)) goto fail;
+          if (!fatNext(curCluster_, &curCluster_)) goto fail;
         }
       }
       block = vol_->clusterStartBlock(curCluster_) + blockOfCluster;
@@ -1097,10 +1184,290 @@ int16_t SdBaseFile::read(void* buf, uint16_t nbyte) {
  fail:
   return -1;
 }
+#ifdef SD_CLUSTER_RUN_CACHE
+//------------------------------------------------------------------------------
+/** Record the cluster chain of a file as a list of contiguous runs.
+ *
+ * Only one file is cached at a time and the cache is dropped when the
+ * file is closed.  A file with more fragments than SD_CLUSTER_RUN_CACHE
+ * falls back to the FAT after the last cached run.
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+bool SdBaseFile::cacheClusterRuns() {
+  uint32_t cluster = firstCluster_;
+  uint32_t next;
+
+  runFile_ = 0;
+  if (!isFile() || cluster == 0) goto fail;
+  runStart_[0] = cluster;
+  runLength_[0] = 1;
+  runCount_ = 1;
+  while (1) {
+    if (!vol_->fatGet(cluster, &next)) goto fail;
+    if (vol_->isEOC(next)) break;
+    if (next == cluster + 1) {
+      runLength_[runCount_ - 1]++;
+    } else {
+      if (runCount_ == SD_CLUSTER_RUN_CACHE) break;
+      runStart_[runCount_] = next;
+      runLength_[runCount_++] = 1;
+    }
+    cluster = next;
+  }
+  runHint_ = 0;
+  runFile_ = this;
+  return true;
+
+ fail:
+  return false;
+}
+#endif  // SD_CLUSTER_RUN_CACHE
+//------------------------------------------------------------------------------
+// next cluster in the chain, from the run cache if possible
+bool SdBaseFile::fatNext(uint32_t cluster, uint32_t* next) {
+#ifdef SD_CLUSTER_RUN_CACHE
+  if (runFile_ == this) {
+    uint8_t i = runHint_;
+    for (uint8_t n = 0; n < runCount_; n++) {
+      uint32_t offset = cluster - runStart_[i];
+      if (offset < runLength_[i]) {
+        runHint_ = i;
+        if (offset + 1 < runLength_[i]) {
+          *next = cluster + 1;
+          return true;
+        }
+        if (i + 1 < runCount_) {
+          runHint_ = i + 1;
+          *next = runStart_[i + 1];
+          return true;
+        }
+        break;
+      }
+      if (++i == runCount_) i = 0;
+    }
+  }
+#endif  // SD_CLUSTER_RUN_CACHE
+  return vol_->fatGet(cluster, next);
+}
+//------------------------------------------------------------------------------
+/** Access the data at the current position without copying it.
+ *
+ * The data stays valid until the next access to the file or the card.
+ * Use readSkip() to advance over the bytes that were used.
+ *
+ * \param[out] avail Number of bytes available, up to the end of the
+ * block or the end of the file.
+ *
+ * \return Pointer to the byte at the current position.  Zero is returned
+ * at end of file or if an error occurs.
+ */
+uint8_t* SdBaseFile::readPeek(uint16_t* avail) {
+  uint16_t offset = curPosition_ & 0X1FF;  // offset in block
+
+  // error if not open or write only
+  if (!isOpen() || !(flags_ & O_READ)) goto fail;
+  if (curPosition_ >= fileSize_) goto fail;
+
+  *avail = 512 - offset;
+  if (*avail > fileSize_ - curPosition_) *avail = fileSize_ - curPosition_;
+
+#ifdef SD_STREAMING_READ
+  if (isFile()) {
+    if (streamFile_ != this || streamPosition_ != curPosition_) {
+      if (!streamStart()) goto fail;
+    }
+    if (streamPos_ >= 512) {
+      // current block used up, switch to the next one
+      if (!streamPump(true)) goto fail;
+      streamFront_ ^= 1;
+      streamPos_ = streamSkip_;
+      streamSkip_ = 0;
+      streamFill_ = 0;
+      streamBackReady_ = false;
+      streamFrontCluster_ = streamBackCluster_;
+    }
+    return streamBuf_[streamFront_] + streamPos_;
+  }
+#endif  // SD_STREAMING_READ
+
+  uint32_t block;  // raw device block number
+  if (type_ == FAT_FILE_TYPE_ROOT_FIXED) {
+    block = vol_->rootDirStart() + (curPosition_ >> 9);
+  } else {
+    uint8_t blockOfCluster = vol_->blockOfCluster(curPosition_);
+    peekCluster_ = curCluster_;
+    if (offset == 0 && blockOfCluster == 0) {
+      // start of new cluster
+      if (curPosition_ == 0) {
+        peekCluster_ = firstCluster_;
+      } else {
+        if (!fatNext(curCluster_, &peekCluster_)) goto fail;
+      }
+    }
+    block = vol_->clusterStartBlock(peekCluster_) + blockOfCluster;
+  }
+  if (!vol_->cacheRawBlock(block, SdVolume::CACHE_FOR_READ)) goto fail;
+  return vol_->cache()->data + offset;
+
+ fail:
+  return 0;
+}
+//------------------------------------------------------------------------------
+/** Advance the current position over data returned by readPeek().
+ *
+ * \param[in] n Number of bytes used, at most the count readPeek() returned.
+ */
+void SdBaseFile::readSkip(uint16_t n) {
+  if (n == 0) return;
+#ifdef SD_STREAMING_READ
+  if (streamFile_ == this && streamPosition_ == curPosition_) {
+    uint16_t pos = streamPos_;
+    curCluster_ = streamFrontCluster_;
+    streamPos_ += n;
+    streamPosition_ = curPosition_ += n;
+    // receive a little of the next block per chunk consumed
+    if ((pos ^ streamPos_) & ~(STREAM_CHUNK - 1)) {
+      if (!streamPump(false)) streamStop();
+    }
+    return;
+  }
+#endif  // SD_STREAMING_READ
+  if (type_ != FAT_FILE_TYPE_ROOT_FIXED) curCluster_ = peekCluster_;
+  curPosition_ += n;
+}
+#ifdef SD_STREAMING_READ
+//------------------------------------------------------------------------------
+/** Read the next byte from a file through a multiple block read.
+ *
+ * While the current block is consumed the next one is received into a
+ * second buffer a few bytes at a time, so only the first block after a
+ * seek waits for the card.  Seeking, read() or any other access to the
+ * card simply restarts the stream at the current position.
+ *
+ * \return For success streamRead returns the next byte in the file as
+ * an int.  If an error occurs or end of file is reached -1 is returned.
+ */
+int16_t SdBaseFile::streamRead() {
+  uint16_t n;
+  uint8_t* src = readPeek(&n);
+  if (!src) return -1;
+  uint8_t b = *src;
+  readSkip(1);
+  return b;
+}
+//------------------------------------------------------------------------------
+// receive more of the next block, wait for all of it if wait is true
+bool SdBaseFile::streamPump(bool wait) {
+  Sd2Card* card = vol_->sdCard();
+  uint16_t t0 = millis();
+  int8_t r;
+
+  if (streamBackReady_) return true;
+  if (!card->readActive()) {
+    // past the end of the cluster chain there is nothing to receive
+    if (vol_->isEOC(streamCluster_)) return !wait;
+    // previous read is done or was ended by another card access
+    streamFill_ = 0;
+    if (!streamRunStart()) return false;
+  }
+  while ((r = card->readDataPart(streamBuf_[streamFront_ ^ 1], &streamFill_,
+                                 wait ? 512 : STREAM_CHUNK)) == 0) {
+    if (!wait) return true;
+    if (((uint16_t)millis() - t0) > SD_READ_TIMEOUT) {
+      card->error(SD_CARD_ERROR_READ_TIMEOUT);
+      return false;
+    }
+  }
+  if (r < 0) {
+#ifdef SD_CHECK_CRC
+    // end the multiple block read, the next call starts it again at the same block
+    if (card->errorCode() == SD_CARD_ERROR_READ_CRC && streamRetries_ < SD_CRC_RETRIES) {
+      streamRetries_++;
+      card->readStop();
+      return wait ? streamPump(true) : true;
+    }
+#endif  // SD_CHECK_CRC
+    return false;
+  }
+#ifdef SD_CHECK_CRC
+  streamRetries_ = 0;
+#endif  // SD_CHECK_CRC
+
+  streamBackReady_ = true;
+  streamBackCluster_ = streamCluster_;
+  if (streamBlock_ == streamRunEnd_) {
+    if (!card->readStop()) return false;
+    streamCluster_ = streamNextCluster_;
+    streamBlock_ = vol_->clusterStartBlock(streamCluster_);
+  } else {
+    streamBlock_++;
+    // clusters are contiguous up to streamRunEnd_
+    if (((streamBlock_ - vol_->dataStartBlock_)
+      & (vol_->blocksPerCluster_ - 1)) == 0) {
+      streamCluster_++;
+    }
+  }
+  return true;
+}
+//------------------------------------------------------------------------------
+// open a multiple block read at streamBlock_ covering contiguous clusters
+bool SdBaseFile::streamRunStart() {
+  uint32_t cluster = streamCluster_;
+  uint32_t next;
+  for (uint8_t n = 1; ; n++) {
+    if (!fatNext(cluster, &next)) return false;
+    if (next != cluster + 1 || n == STREAM_MAX_RUN) break;
+    cluster = next;
+  }
+  streamRunEnd_ = vol_->clusterStartBlock(cluster) + vol_->blocksPerCluster_ - 1;
+  streamNextCluster_ = next;
+  return vol_->sdCard()->readStart(streamBlock_);
+}
+//------------------------------------------------------------------------------
+// set up the stream at the current position, nothing is read yet
+bool SdBaseFile::streamStart() {
+  uint32_t cluster = curCluster_;
+  streamStop();
+
+  // same cluster lookup as read()
+  if (curPosition_ == 0) {
+    cluster = firstCluster_;
+  } else if ((curPosition_ & 0X1FF) == 0
+    && vol_->blockOfCluster(curPosition_) == 0) {
+    if (!fatNext(curCluster_, &cluster)) return false;
+  }
+  streamFile_ = this;
+  streamCluster_ = cluster;
+  streamBlock_ = vol_->blockNumber(cluster, curPosition_);
+  streamSkip_ = curPosition_ & 0X1FF;
+  streamPos_ = 512;
+  streamFill_ = 0;
+  streamBackReady_ = false;
+  streamPosition_ = curPosition_;
+#ifdef SD_CHECK_CRC
+  streamRetries_ = 0;
+#endif  // SD_CHECK_CRC
+  return true;
+}
+//------------------------------------------------------------------------------
+// end the multiple block read of the streamed file, if any
+void SdBaseFile::streamStop() {
+  if (streamFile_) {
+    Sd2Card* card = streamFile_->vol_->sdCard();
+    if (card->readActive()) card->readStop();
+    streamFile_ = 0;
+  }
+}
+#endif  // SD_STREAMING_READ
 //------------------------------------------------------------------------------
 /** Read the next directory entry from a directory file.
  *
  * \param[out] dir The dir_t struct that will receive the data.
+ * \param[out] longFilename Receives the long name of the entry, if any, or NULL to skip it.
+ * \param[in] lfnParts Only the first this many 13 character parts of the long name are
+ * assembled, with fewer than MAX_VFAT_ENTRIES it is not terminated if it is longer.
  *
  * \return For success readDir() returns the number of bytes read.
  * A value of zero will be returned if end of file is reached.
@@ -1108,7 +1475,7 @@ int16_t SdBaseFile::read(void* buf, uint16_t nbyte) {
  * readDir() called before a directory has been opened, this is not
  * a directory file or an I/O error occurred.
  */
-int8_t SdBaseFile::readDir(dir_t* dir, char* longFilename) {
+int8_t SdBaseFile::readDir(dir_t* dir, char* longFilename, uint8_t lfnParts) {
   int16_t n;
   // if not a directory file or miss-positioned return an error
   if (!isDir() || (0X1F & curPosition_)) return -1;
@@ -1132,7 +1499,7 @@ int8_t SdBaseFile::readDir(dir_t* dir, char* longFilename) {
     {
     	vfat_t *VFAT = (vfat_t*)dir;
 		//Sanity check the VFAT entry. The first cluster is always set to zero. And th esequence number should be higher then 0
-    	if (VFAT->firstClusterLow == 0 && (VFAT->sequenceNumber & 0x1F) > 0 && (VFAT->sequenceNumber & 0x1F) <= MAX_VFAT_ENTRIES)
+    	if (VFAT->firstClusterLow == 0 && (VFAT->sequenceNumber & 0x1F) > 0 && (VFAT->sequenceNumber & 0x1F) <= lfnParts)
     	{
 			//TODO: Store the filename checksum to verify if a none-long filename aware system modified the file table.
     		n = ((VFAT->sequenceNumber & 0x1F) - 1) * 13;
@@ -1481,7 +1848,7 @@ bool SdBaseFile::seekSet(uint32_t pos) {
     nNew -= nCur;
   }
   while (nNew--) {
-    if (!vol_->fatGet(curCluster_, &curCluster_)) goto fail;
+    if (!fatNext(curCluster_, &curCluster_)) goto fail;
   }
   curPosition_ = pos;
 
@@ -1492,7 +1859,7 @@ bool SdBaseFile::seekSet(uint32_t pos) {
   return false;
 }
 //------------------------------------------------------------------------------
-void SdBaseFile::setpos(fpos_t* pos) {
+void SdBaseFile::setpos(filepos_t* pos) {
   curPosition_ = pos->position;
   curCluster_ = pos->cluster;
 }
@@ -1509,6 +1876,15 @@ bool SdBaseFile::sync() {
   // only allow open files and directories
   if (!isOpen()) goto fail;
 
+#ifdef SD_WRITE_BEHIND
+  if (writeFile_ == this) {
+    // end the block run and give back the clusters it did not use
+    writeFile_ = 0;
+    if (vol_->sdCard()->writeActive() && !vol_->sdCard()->writeStop()) goto fail;
+    if (!truncate(fileSize_)) goto fail;
+  }
+#endif  // SD_WRITE_BEHIND
+
   if (flags_ & F_FILE_DIR_DIRTY) {
     dir_t* d = cacheDirEntry(SdVolume::CACHE_FOR_WRITE);
     // check for deleted by another open file object
@@ -1815,6 +2191,89 @@ int16_t SdBaseFile::write(const void* buf, uint16_t nbyte) {
   writeError = true;
   return -1;
 }
+#ifdef SD_WRITE_BEHIND
+//------------------------------------------------------------------------------
+/** Write one 512 byte block at the current position, which must be on a
+ * block boundary.
+ *
+ * Clusters are reserved SD_WRITE_BEHIND at a time and written with one
+ * pre-erased multiple block write, so the FAT is only touched once per
+ * run and no block is read back.  sync() frees the clusters that were
+ * not used.
+ *
+ * \param[in] src Pointer to the 512 bytes to be written.
+ *
+ * \return The value one, true, is returned for success and
+ * the value zero, false, is returned for failure.
+ */
+bool SdBaseFile::writeBlockRun(const uint8_t* src) {
+  Sd2Card* card = vol_->sdCard();
+  uint8_t blockOfCluster = vol_->blockOfCluster(curPosition_);
+  uint32_t block;
+
+  // error if not a normal file, read-only or not on a block boundary
+  if (!isFile() || !(flags_ & O_WRITE) || (curPosition_ & 0X1FF)) goto fail;
+
+  if (blockOfCluster == 0) {
+    // start of new cluster
+    if (curCluster_ == 0 && firstCluster_ != 0) {
+      curCluster_ = firstCluster_;
+    } else if (writeFile_ == this && curCluster_ != 0
+      && curCluster_ < writeRunEnd_) {
+      // reserved clusters are contiguous and already chained
+      curCluster_++;
+    } else {
+      uint32_t next = 0;
+      if (curCluster_ != 0 && !vol_->fatGet(curCluster_, &next)) goto fail;
+      if (curCluster_ != 0 && !vol_->isEOC(next)) {
+        curCluster_ = next;
+      } else {
+        // reserve a run, or a single cluster if the card is too fragmented
+        uint32_t count = SD_WRITE_BEHIND;
+        if (!vol_->allocContiguous(count, &curCluster_)) {
+          count = 1;
+          if (!vol_->allocContiguous(count, &curCluster_)) goto fail;
+        }
+        if (firstCluster_ == 0) {
+          firstCluster_ = curCluster_;
+          flags_ |= F_FILE_DIR_DIRTY;
+        }
+        writeFile_ = this;
+        writeRunEnd_ = curCluster_ + count - 1;
+      }
+    }
+  }
+  block = vol_->clusterStartBlock(curCluster_) + blockOfCluster;
+
+  if (!card->writeActive() || block != writeNextBlock_) {
+    uint32_t eraseCount = 1;
+    if (writeFile_ == this && curCluster_ <= writeRunEnd_) {
+      // pre-erase the rest of the reserved run
+      eraseCount = vol_->clusterStartBlock(writeRunEnd_)
+                   + vol_->blocksPerCluster_ - block;
+    }
+    if (!card->writeStart(block, eraseCount)) goto fail;
+  }
+  if (vol_->cacheBlockNumber() == block) {
+    // invalidate cache if block is in cache
+    vol_->cacheSetBlockNumber(0XFFFFFFFF, false);
+  }
+  if (!card->writeData(src)) goto fail;
+  writeNextBlock_ = block + 1;
+
+  curPosition_ += 512;
+  if (curPosition_ > fileSize_) {
+    // update fileSize and insure sync will update dir entry
+    fileSize_ = curPosition_;
+    flags_ |= F_FILE_DIR_DIRTY;
+  }
+  return true;
+
+ fail:
+  writeError = true;
+  return false;
+}
+#endif  // SD_WRITE_BEHIND
 //------------------------------------------------------------------------------
 // suppress cpplint warnings with NOLINT comment
 #if ALLOW_DEPRECATED_FUNCTIONS && !defined(DOXYGEN)
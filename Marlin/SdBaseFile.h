@@ -31,16 +31,16 @@
 #include "SdVolume.h"
 //------------------------------------------------------------------------------
 /**
- * \struct fpos_t
+ * \struct filepos_t
  * \brief internal type for istream
  * do not use in user apps
  */
-struct fpos_t {
+struct filepos_t {
   /** stream position */
   uint32_t position;
   /** cluster for position */
   uint32_t cluster;
-  fpos_t() : position(0), cluster(0) {}
+  filepos_t() : position(0), cluster(0) {}
 };
 
 // use the gnu style oflag in open()
@@ -196,11 +196,11 @@ class SdBaseFile {
   /** get position for streams
    * \param[out] pos struct to receive position
    */
-  void getpos(fpos_t* pos);
+  void getpos(filepos_t* pos);
   /** set position for streams
    * \param[out] pos struct with value for new position
    */
-  void setpos(fpos_t* pos);
+  void setpos(filepos_t* pos);
   //----------------------------------------------------------------------------
   bool close();
   bool contiguousRange(uint32_t* bgnBlock, uint32_t* endBlock);
@@ -277,13 +277,22 @@ class SdBaseFile {
   bool open(const char* path, uint8_t oflag = O_READ);
   bool openNext(SdBaseFile* dirFile, uint8_t oflag);
   bool openRoot(SdVolume* vol);
+  bool openSubDir(SdVolume* vol, uint32_t cluster);
   int peek();
   static void printFatDate(uint16_t fatDate);
   static void printFatTime( uint16_t fatTime);
   bool printName();
   int16_t read();
+#ifdef SD_STREAMING_READ
+  int16_t streamRead();
+#endif
   int16_t read(void* buf, uint16_t nbyte);
-  int8_t readDir(dir_t* dir, char* longFilename);
+  uint8_t* readPeek(uint16_t* avail);
+#ifdef SD_CLUSTER_RUN_CACHE
+  bool cacheClusterRuns();
+#endif
+  void readSkip(uint16_t n);
+  int8_t readDir(dir_t* dir, char* longFilename, uint8_t lfnParts = MAX_VFAT_ENTRIES);
   static bool remove(SdBaseFile* dirFile, const char* path);
   bool remove();
   /** Set the file's current position to zero. */
@@ -320,6 +329,9 @@ class SdBaseFile {
   /** \return SdVolume that contains this file. */
   SdVolume* volume() const {return vol_;}
   int16_t write(const void* buf, uint16_t nbyte);
+#ifdef SD_WRITE_BEHIND
+  bool writeBlockRun(const uint8_t* src);
+#endif
 //------------------------------------------------------------------------------
  private:
   // allow SdFat to set cwd_
@@ -358,6 +370,13 @@ class SdBaseFile {
   bool open(SdBaseFile* dirFile, const uint8_t dname[11], uint8_t oflag);
   bool openCachedEntry(uint8_t cacheIndex, uint8_t oflags);
   dir_t* readDirCache();
+  bool fatNext(uint32_t cluster, uint32_t* next);
+#ifdef SD_STREAMING_READ
+  static void streamStop();
+  bool streamStart();
+  bool streamPump(bool wait);
+  bool streamRunStart();
+#endif
 //------------------------------------------------------------------------------
 // to be deleted
   static void printDirName( const dir_t& dir,
@@ -455,7 +474,7 @@ class SdBaseFile {
    * \param[out] dir The dir_t struct that will receive the data.
    * \return bytes read for success zero for eof or -1 for failure.
    */
-  int8_t readDir(dir_t& dir, char* longFilename) {return readDir(&dir, longFilename);}  // NOLINT
+  int8_t readDir(dir_t& dir, char* longFilename, uint8_t lfnParts = MAX_VFAT_ENTRIES) {return readDir(&dir, longFilename, lfnParts);}  // NOLINT
   /** \deprecated Use:
    * static uint8_t remove(SdBaseFile* dirFile, const char* path);
    * \param[in] dirFile The directory that contains the file.
@@ -126,6 +126,7 @@ bool SdVolume::cacheFlush() {
 //------------------------------------------------------------------------------
 bool SdVolume::cacheRawBlock(uint32_t blockNumber, bool dirty) {
   if (cacheBlockNumber_ != blockNumber) {
+    SD_LATENCY_TIME(SD_LATENCY_CACHE_MISS);
     if (!cacheFlush()) goto fail;
     if (!sdCard_->readBlock(blockNumber, cacheBuffer_.data)) goto fail;
     cacheBlockNumber_ = blockNumber;
@@ -209,7 +209,21 @@ static void initISR(timer16_Sequence_t timer)
 static void finISR(timer16_Sequence_t timer)
 {
     //disable use of the given timer
-#if defined WIRING   // Wiring
+#if defined(SERVO_HARDWARE_PWM) && !defined(WIRING)
+  // no servo left on it, so the interrupt has nothing to pulse
+#if defined(_useTimer1)
+  if(timer == _timer1) TIMSK1 &= ~_BV(OCIE1A);
+#endif
+#if defined(_useTimer3)
+  if(timer == _timer3) TIMSK3 &= ~_BV(OCIE3A);
+#endif
+#if defined(_useTimer4)
+  if(timer == _timer4) TIMSK4 &= ~_BV(OCIE4A);
+#endif
+#if defined(_useTimer5)
+  if(timer == _timer5) TIMSK5 &= ~_BV(OCIE5A);
+#endif
+#elif defined WIRING   // Wiring
   if(timer == _timer1) {
     #if defined(__AVR_ATmega1281__)||defined(__AVR_ATmega2561__)
     TIMSK1 &=  ~_BV(OCIE1A) ;  // disable timer 1 output compare interrupt
@@ -242,6 +256,60 @@ static boolean isTimerActive(timer16_Sequence_t timer)
 }
 
 
+#ifdef SERVO_HARDWARE_PWM
+// An output compare pin of a 16 bit timer the interrupt driver does not use: the timer runs in
+// fast PWM mode with ICRn as TOP at the refresh interval and makes the pulses without an interrupt
+typedef struct {
+  uint8_t pin;
+  volatile uint8_t *tccrA;
+  volatile uint8_t *tccrB;
+  volatile uint16_t *icr;
+  volatile uint16_t *ocr;  // pulse width of the pin
+  uint8_t com;             // COMnx1, connects the pin to the compare unit
+} servo_pwm_t;
+
+#if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+static const servo_pwm_t servo_pwm[] = {
+  { 5, &TCCR3A, &TCCR3B, &ICR3, &OCR3A, _BV(COM3A1) },
+  { 2, &TCCR3A, &TCCR3B, &ICR3, &OCR3B, _BV(COM3B1) },
+  { 3, &TCCR3A, &TCCR3B, &ICR3, &OCR3C, _BV(COM3C1) },
+  { 6, &TCCR4A, &TCCR4B, &ICR4, &OCR4A, _BV(COM4A1) },
+  { 7, &TCCR4A, &TCCR4B, &ICR4, &OCR4B, _BV(COM4B1) },
+  { 8, &TCCR4A, &TCCR4B, &ICR4, &OCR4C, _BV(COM4C1) }
+};
+#define SERVO_PWM_COUNT (sizeof(servo_pwm) / sizeof(servo_pwm[0]))
+#else
+static const servo_pwm_t *servo_pwm = NULL;
+#define SERVO_PWM_COUNT 0
+#endif
+
+// 1 + the entry of servo_pwm[] for pin, 0 if the pin has to be pulsed by the interrupt
+static uint8_t pwmForPin(int pin)
+{
+  for(uint8_t i = 0; i < SERVO_PWM_COUNT; i++)
+    if(servo_pwm[i].pin == pin)
+      return i + 1;
+  return 0;
+}
+
+// Start pulsing the pin of compare unit p, ticks wide. The bits of the WGM, CS and COM fields are
+// at the same places in the registers of all 16 bit timers.
+static void startPwm(const servo_pwm_t &p, unsigned int ticks)
+{
+  uint8_t oldSREG = SREG;
+  cli();
+  if(*p.icr != usToTicks(REFRESH_INTERVAL) || (*p.tccrB & (_BV(WGM33) | _BV(WGM32) | _BV(CS32) | _BV(CS31) | _BV(CS30))) != (_BV(WGM33) | _BV(WGM32) | _BV(CS31))) {
+    // mode 14, fast PWM up to ICRn, with a prescaler of 8
+    *p.tccrA = (*p.tccrA & ~_BV(WGM30)) | _BV(WGM31);
+    *p.tccrB = _BV(WGM33) | _BV(WGM32) | _BV(CS31);
+    *p.icr = usToTicks(REFRESH_INTERVAL);
+  }
+  *p.ocr = ticks;
+  *p.tccrA |= p.com;
+  SREG = oldSREG;
+}
+#endif  // SERVO_HARDWARE_PWM
+
 /****************** end of static functions ******************************/
 
 Servo::Servo()
@@ -252,6 +320,9 @@ Servo::Servo()
   }
   else
     this->servoIndex = INVALID_SERVO ;  // too many servos
+#ifdef SERVO_HARDWARE_PWM
+  this->pwm = 0;
+#endif
 }
 
 uint8_t Servo::attach(int pin)
@@ -270,6 +341,14 @@ uint8_t Servo::attach(int pin, int min, int max)
     // todo min/max check: abs(min - MIN_PULSE_WIDTH) /4 < 128
     this->min  = (MIN_PULSE_WIDTH - min)/4; //resolution of min/max is 4 uS
     this->max  = (MAX_PULSE_WIDTH - max)/4;
+#ifdef SERVO_HARDWARE_PWM
+    this->pwm = pwmForPin(pin);
+    if(this->pwm) {
+      // the interrupt leaves the pin alone, its digitalWrite() would disconnect the compare unit
+      startPwm(servo_pwm[this->pwm - 1], servos[this->servoIndex].ticks + usToTicks(TRIM_DURATION));
+      return this->servoIndex;
+    }
+#endif
     // initialize the timer if it has not already been initialized
     timer16_Sequence_t timer = SERVO_INDEX_TO_TIMER(servoIndex);
     if(isTimerActive(timer) == false)
@@ -281,6 +360,14 @@ uint8_t Servo::attach(int pin, int min, int max)
 
 void Servo::detach()
 {
+#ifdef SERVO_HARDWARE_PWM
+  if(this->pwm) {
+    // no more pulses, the pin is held low
+    *servo_pwm[this->pwm - 1].tccrA &= ~servo_pwm[this->pwm - 1].com;
+    digitalWrite(servos[this->servoIndex].Pin.nbr, LOW);
+    return;
+  }
+#endif
   servos[this->servoIndex].Pin.isActive = false;
   timer16_Sequence_t timer = SERVO_INDEX_TO_TIMER(servoIndex);
   if(isTimerActive(timer) == false) {
@@ -316,6 +403,10 @@ void Servo::writeMicroseconds(int value)
     uint8_t oldSREG = SREG;
     cli();
     servos[channel].ticks = value;
+#ifdef SERVO_HARDWARE_PWM
+    if(this->pwm)
+      *servo_pwm[this->pwm - 1].ocr = value + usToTicks(TRIM_DURATION);
+#endif
     SREG = oldSREG;
   }
 }
@@ -338,6 +429,10 @@ int Servo::readMicroseconds()
 
 bool Servo::attached()
 {
+#ifdef SERVO_HARDWARE_PWM
+  if(this->pwm)
+    return (*servo_pwm[this->pwm - 1].tccrA & servo_pwm[this->pwm - 1].com) != 0;
+#endif
   return servos[this->servoIndex].Pin.isActive ;
 }
 
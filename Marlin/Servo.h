@@ -128,6 +128,9 @@ public:
 #endif
 private:
    uint8_t servoIndex;               // index into the channel data for this servo
+#ifdef SERVO_HARDWARE_PWM
+   uint8_t pwm;                      // 1 + the output compare unit pulsing the pin, 0 for the interrupt
+#endif
    int8_t min;                       // minimum is this value times 4 added to MIN_PULSE_WIDTH
    int8_t max;                       // maximum is this value times 4 added to MAX_PULSE_WIDTH
 };
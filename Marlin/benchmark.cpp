@@ -0,0 +1,178 @@
+#include "Marlin.h"
+
+#ifdef MATH_BENCHMARK
+#include "planner.h"
+#include "stepper.h"
+#include "temperature.h"
+#include "motion_control.h"
+#include "benchmark.h"
+
+#ifdef __AVR__
+  // Timer1, the stepper timer, counts F_CPU/8. It is left running to 0xFFFF while the benchmark runs.
+  typedef unsigned short bench_time_t;
+  #define BENCH_NOW() TCNT1
+  #define BENCH_UNITS(ticks) ((ticks) * 8)
+  #define BENCH_UNIT_NAME " cycles"
+#else
+  // host build, see sim/sim_bench.cpp
+  #include <time.h>
+  typedef unsigned long bench_time_t;
+  static bench_time_t bench_now()
+  {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+  }
+  #define BENCH_NOW() bench_now()
+  #define BENCH_UNITS(ticks) (ticks)
+  #define BENCH_UNIT_NAME " ns"
+#endif
+
+//===========================================================================
+//=============================private variables  ============================
+//===========================================================================
+
+struct bench_result_t
+{
+  unsigned long total, min, max;
+  unsigned int count;
+};
+
+static bench_result_t bench_result;
+static bench_time_t bench_overhead = 0; // reading the clock twice
+static volatile float bench_sink;         // keeps the results of the timed calls alive
+
+// Time one run of the statement with interrupts off. plan_buffer_line() enables the stepper
+// interrupt, it is disabled again before interrupts are, so the planned moves never start.
+#define BENCH_TIME(statement) do { \
+    CRITICAL_SECTION_START; \
+    bench_time_t bench_start = BENCH_NOW(); \
+    statement; \
+    bench_time_t bench_ticks = (bench_time_t)(BENCH_NOW() - bench_start); \
+    DISABLE_STEPPER_DRIVER_INTERRUPT(); \
+    CRITICAL_SECTION_END; \
+    bench_add(bench_ticks); \
+  } while(0)
+
+//===========================================================================
+//=============================functions         ============================
+//===========================================================================
+
+static void bench_add(bench_time_t ticks)
+{
+  ticks = ticks > bench_overhead ? ticks - bench_overhead : 0;
+  bench_result.total += ticks;
+  if (ticks < bench_result.min) bench_result.min = ticks;
+  if (ticks > bench_result.max) bench_result.max = ticks;
+  bench_result.count++;
+}
+
+static void bench_begin()
+{
+  bench_result.total = bench_result.max = bench_result.count = 0;
+  bench_result.min = 0xFFFFFFFF;
+}
+
+static void bench_report(const char *name)
+{
+  SERIAL_ECHO_START;
+  serialprintPGM(name);
+  SERIAL_ECHOPAIR(" calls:", (unsigned long)bench_result.count);
+  SERIAL_ECHOPAIR(" min:", (unsigned long)BENCH_UNITS(bench_result.min));
+  SERIAL_ECHOPAIR(" avg:", (unsigned long)BENCH_UNITS(bench_result.total / bench_result.count));
+  SERIAL_ECHOPAIR(" max:", (unsigned long)BENCH_UNITS(bench_result.max));
+  SERIAL_ECHOLNPGM(BENCH_UNIT_NAME);
+}
+
+// Drop what the timed call planned and put the planner back where the printer is
+static void bench_discard_moves()
+{
+#ifdef SEGMENT_MERGE
+  plan_discard_pending();
+#endif
+  while(blocks_queued())
+    plan_discard_current_block();
+  plan_set_position(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS]);
+}
+
+void benchmark_run()
+{
+  st_synchronize();
+  DISABLE_STEPPER_DRIVER_INTERRUPT();
+#ifdef __AVR__
+  unsigned short old_OCR1A = OCR1A;
+  OCR1A = 0xFFFF;
+#endif
+
+  bench_overhead = 0;
+  bench_begin();
+  for (uint8_t i = 0; i < 64; i++)
+    BENCH_TIME();
+  bench_overhead = bench_result.min;
+
+  bench_begin();
+  for (unsigned int i = 0; i < 256; i++) {
+    unsigned short step_rate = 100 + i * 156; // up to 40kHz, through the slow, fast, double and quad step ranges
+    BENCH_TIME(bench_sink = bench_calc_timer(step_rate));
+  }
+  bench_report(PSTR("calc_timer()"));
+
+  bench_begin();
+  for (unsigned int i = 0; i < 256; i++) {
+    int raw = i * 4 * OVERSAMPLENR;
+    BENCH_TIME(bench_sink = bench_analog2temp(raw, 0));
+  }
+  bench_report(PSTR("analog2temp()"));
+
+#ifdef DELTA
+  bench_begin();
+  for (uint8_t i = 0; i < 64; i++) {
+    float cartesian[3];
+    cartesian[X_AXIS] = 50 * cos(i * (M_PI / 32));
+    cartesian[Y_AXIS] = 50 * sin(i * (M_PI / 32));
+    cartesian[Z_AXIS] = 10;
+    BENCH_TIME(calculate_delta(cartesian));
+  }
+  bench_report(PSTR("calculate_delta()"));
+#endif
+
+  // the M804 being processed: its own M field
+  bench_begin();
+  for (uint8_t i = 0; i < 64; i++) {
+    code_seen('M');
+    BENCH_TIME(bench_sink = code_value());
+  }
+  bench_report(PSTR("code_value()"));
+
+  bench_begin();
+  for (uint8_t i = 0; i < 32; i++) {
+    float target[NUM_AXIS];
+    memcpy(target, current_position, sizeof(target));
+    target[X_AXIS] += (i & 1) ? 10 : -10;
+    target[Y_AXIS] += (i & 2) ? 5 : -5;
+    BENCH_TIME(plan_buffer_line(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], target[E_AXIS], 100, active_extruder));
+    bench_discard_moves();
+  }
+  bench_report(PSTR("plan_buffer_line()"));
+
+  // a 0.5mm arc of radius 2mm, few enough segments to never fill the block buffer
+  bench_begin();
+  for (uint8_t i = 0; i < 32; i++) {
+    float position[NUM_AXIS], target[NUM_AXIS], offset[2] = { -2, 0 };
+    memcpy(position, current_position, sizeof(position));
+    memcpy(target, current_position, sizeof(target));
+    target[X_AXIS] += 2 * cos(0.25) - 2;
+    target[Y_AXIS] += 2 * sin(0.25);
+    BENCH_TIME(mc_arc(position, target, offset, X_AXIS, Y_AXIS, Z_AXIS, 100, 2, 0, active_extruder));
+    bench_discard_moves();
+  }
+  bench_report(PSTR("mc_arc()"));
+
+#ifdef __AVR__
+  OCR1A = old_OCR1A;
+  TCNT1 = 0;
+#endif
+  ENABLE_STEPPER_DRIVER_INTERRUPT();
+}
+
+#endif //MATH_BENCHMARK
@@ -0,0 +1,12 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include "Marlin.h"
+
+#ifdef MATH_BENCHMARK
+  // time calc_timer(), analog2temp(), calculate_delta(), code_value(), plan_buffer_line() and mc_arc()
+  // call by call and print min/avg/max of each. The printer must be idle, the planned moves are dropped.
+  void benchmark_run();
+#endif
+
+#endif
@@ -14,16 +14,53 @@ CardReader::CardReader()
    filesize = 0;
    sdpos = 0;
    sdprinting = false;
+   #ifdef SD_BINARY_JOB
+   binaryjob = false;
+   #endif
    cardOK = false;
+   #ifdef FAST_BOOT
+   initPending = false;
+   #endif
+   #ifdef SD_LIST_CHUNK
+   lsJobActive = false;
+   #endif
    saving = false;
    logging = false;
    autostart_atmillis=0;
    workDirDepth = 0;
    file_subcall_ctr=0;
+   #ifdef POWER_LOSS_RECOVERY
+   journalBlock = 0;
+   #endif
+   #ifdef SD_JOB_QUEUE
+   queueActive = false;
+   queueState = QUEUE_IDLE;
+   #endif
+   #ifdef SD_TELEMETRY
+   telemetryBlock = 0;
+   telemetryTried = false;
+   telemetryFill = 0;
+   telemetryDropped = 0;
+   #endif
    memset(workDirParents, 0, sizeof(workDirParents));
+   invalidateDirIndex();
+   invalidateSubcalls();
+   #ifdef SD_SUBCALL_CACHE
+   subcallNext = 0;
+   #endif
+   invalidateHeaders();
+   #ifdef SD_FILE_HEADER
+   headerNext = 0;
+   header.found = 0;
+   #endif
 
    autostart_stilltocheck=true; //the SD start is delayed, because otherwise the serial cannot answer fast enough to make contact with the host software.
    lastnr=0;
+  #ifdef SD_PRINT_ETA
+   progressPercent=0;
+   etaMoveCount=0;
+   resetProgress();
+  #endif
   //power to SD reader
   #if SDPOWER > -1
     SET_OUTPUT(SDPOWER); 
@@ -49,86 +86,145 @@ char *createFilename(char *buffer,const dir_t &p) //buffer>12characters
   return buffer;
 }
 
+#ifdef SD_DIR_INDEX
+//same checksum the long name entries of a file carry
+static uint8_t shortNameChecksum(const uint8_t *name)
+{
+  uint8_t sum=0;
+  for (uint8_t i = 0; i < 11; i++)
+    sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+  return sum;
+}
+#endif
+
+
+//append a subdirectory to the path prefix of M20, false if it would not fit
+static bool lsPathPush(char *path, const char *name)
+{
+  if(strlen(path) + strlen(name) + 3 > MAXPATHNAMELENGTH)
+    return false;
+  if(path[0]==0) //avoid leading / if already in prepend
+    strcat(path,"/");
+  strcat(path,name);
+  strcat(path,"/");
+  return true;
+}
+
+//walk dir, and its subdirectories for LS_SerialPrint
+void CardReader::lsDive(const char *prepend,SdFile &dir)
+{
+  ls_walk_t walk;
+  lsWalkStart(walk,prepend);
+  lsWalk(walk,dir,0);
+}
+
+void CardReader::lsWalkStart(ls_walk_t &w, const char *prepend)
+{
+  w.depth=0;
+  strncpy(w.path,prepend,sizeof(w.path)-1);
+  w.path[sizeof(w.path)-1]=0;
+  w.paused=false;
+}
 
-void  CardReader::lsDive(const char *prepend,SdFile parent)
+//walk on without recursion: the directories above the current one are only remembered by cluster
+//and position and reopened when it is done. Pauses after printing entries files (0 for no limit),
+//false until the walk is done
+bool CardReader::lsWalk(ls_walk_t &w, SdFile &dir, uint8_t entries)
 {
+  SdFile *cur=w.depth ? &w.sub : &dir;
   dir_t p;
- uint8_t cnt=0;
- 
-  while (parent.readDir(p, longFilename) > 0)
+  uint8_t cnt=0;
+  uint8_t printed=0;
+  if(w.paused) //others may have read dir since
   {
-    if( DIR_IS_SUBDIR(&p) && lsAction!=LS_Count && lsAction!=LS_GetFilename) // hence LS_SerialPrint
-    {
+    cur->seekSet(w.pos);
+    w.paused=false;
+  }
 
-      char path[13*2];
-      char lfilename[13];
-      createFilename(lfilename,p);
-      
-      path[0]=0;
-      if(strlen(prepend)==0) //avoid leading / if already in prepend
-      {
-       strcat(path,"/");
-      }
-      strcat(path,prepend);
-      strcat(path,lfilename);
-      strcat(path,"/");
-      
-      //Serial.print(path);
-      
-      SdFile dir;
-      if(!dir.open(parent,lfilename, O_READ))
+  for(;;)
+  {
+    uint32_t pos=cur->curPosition();
+    //counting only needs the first character of a long name, to leave out hidden files
+    if(cur->readDir(p, longFilename, lsAction==LS_Count ? 1 : MAX_VFAT_ENTRIES) <= 0)
+    {
+      //end of this directory, carry on in its parent after the entry of it
+      if(w.depth==0)
+        return true;
+      w.depth--;
+      w.path[w.stack[w.depth].pathLen]=0;
+      w.sub.close();
+      if(w.depth==0)
       {
-        if(lsAction==LS_SerialPrint)
-        {
-          SERIAL_ECHO_START;
-          SERIAL_ECHOLN(MSG_SD_CANT_OPEN_SUBDIR);
-          SERIAL_ECHOLN(lfilename);
-        }
+        cur=&dir;
+        dir.seekSet(w.stack[0].pos);
       }
-      lsDive(path,dir);
-      //close done automatically by destructor of SdFile
-
-      
+      else if(w.sub.openSubDir(&volume,w.stack[w.depth].cluster))
+        w.sub.seekSet(w.stack[w.depth].pos); //on failure the next readDir() ends this directory as well
+      continue;
     }
-    else
+    if(DIR_IS_SUBDIR(&p) && lsAction==LS_SerialPrint)
     {
-      if (p.name[0] == DIR_NAME_FREE) break;
-      if (p.name[0] == DIR_NAME_DELETED || p.name[0] == '.'|| p.name[0] == '_') continue;
-      if (longFilename[0] != '\0' &&
-          (longFilename[0] == '.' || longFilename[0] == '_')) continue;
-      if ( p.name[0] == '.')
+      createFilename(filename,p);
+      uint8_t pathLen=strlen(w.path);
+      if(w.depth>=MAX_DIR_DEPTH || !lsPathPush(w.path,filename))
       {
-        if ( p.name[1] != '.')
+        SERIAL_ECHO_START;
+        SERIAL_ECHOLN(MSG_SD_CANT_OPEN_SUBDIR);
+        SERIAL_ECHOLN(filename);
         continue;
       }
-      
-      if (!DIR_IS_FILE_OR_SUBDIR(&p)) continue;
-      filenameIsDir=DIR_IS_SUBDIR(&p);
-      
-      
-      if(!filenameIsDir)
+      w.stack[w.depth].cluster=cur->firstCluster();
+      w.stack[w.depth].pos=cur->curPosition();
+      w.stack[w.depth].pathLen=pathLen;
+      w.depth++;
+      w.sub.close();
+      cur=&w.sub;
+      if(!w.sub.openSubDir(&volume,((uint32_t)p.firstClusterHigh << 16) | p.firstClusterLow))
       {
-        if(p.name[8]!='G') continue;
-        if(p.name[9]=='~') continue;
+        //the next readDir() fails and returns to the parent
+        SERIAL_ECHO_START;
+        SERIAL_ECHOLN(MSG_SD_CANT_OPEN_SUBDIR);
+        SERIAL_ECHOLN(filename);
       }
-      //if(cnt++!=nr) continue;
-      createFilename(filename,p);
-      if(lsAction==LS_SerialPrint)
+      continue;
+    }
+
+    if (p.name[0] == '_') continue;
+    if (longFilename[0] == '.' || longFilename[0] == '_') continue;
+    filenameIsDir=DIR_IS_SUBDIR(&p);
+    if(!filenameIsDir)
+    {
+      if(p.name[8]!='G') continue;
+      if(p.name[9]=='~') continue;
+    }
+    createFilename(filename,p);
+    if(lsAction==LS_SerialPrint)
+    {
+      SERIAL_PROTOCOL(w.path);
+      SERIAL_PROTOCOLLN(filename);
+      if(++printed==entries)
       {
-        SERIAL_PROTOCOL(prepend);
-        SERIAL_PROTOCOLLN(filename);
+        w.pos=cur->curPosition();
+        w.paused=true;
+        return false;
       }
-      else if(lsAction==LS_Count)
-      {
-        nrFiles++;
-      } 
-      else if(lsAction==LS_GetFilename)
+    }
+    else if(lsAction==LS_Count)
+    {
+      #ifdef SD_DIR_INDEX
+      if(nrFiles < SD_DIR_INDEX)
       {
-        if(cnt==nrFiles)
-          return;
-        cnt++;
-        
+        dirIndexPos[nrFiles] = pos >> 5;
+        dirIndexHash[nrFiles] = shortNameChecksum(p.name);
       }
+      #endif
+      nrFiles++;
+    }
+    else if(lsAction==LS_GetFilename)
+    {
+      if(cnt==nrFiles)
+        return true;
+      cnt++;
     }
   }
 }
@@ -140,20 +236,252 @@ void CardReader::ls()
   nrFiles=0;
 
   root.rewind();
+#ifdef SDCARD_SORT
+  lsSorted(root);
+  invalidateDirIndex(); //it no longer describes the working directory
+#elif defined(SD_LIST_CHUNK)
+  lsWalkStart(lsJob,"");
+  lsJobActive=true;
+  lsContinue();
+#else
   lsDive("",root);
+#endif
 }
 
+#ifdef SD_LIST_CHUNK
+void CardReader::lsContinue()
+{
+  if(!lsJobActive)
+    return;
+  lsAction=LS_SerialPrint;
+  if(lsWalk(lsJob,root,SD_LIST_CHUNK))
+    lsStop();
+}
+
+//end the listing of M20 where it is, the host gets the end of the list in any case
+void CardReader::lsStop()
+{
+  if(!lsJobActive)
+    return;
+  lsJobActive=false;
+  lsJob.sub.close();
+  SERIAL_PROTOCOLLNPGM(MSG_END_FILE_LIST);
+}
+#endif
+
+#ifdef SD_DIR_INDEX
+//count the files of dir and remember where the first SD_DIR_INDEX of them are
+void CardReader::indexDir(SdFile &dir)
+{
+  lsAction=LS_Count;
+  nrFiles=0;
+  dir.rewind();
+  lsDive("",dir);
+  dirIndexFiles = nrFiles;
+  dirIndexCount = min(nrFiles, SD_DIR_INDEX);
+  #ifdef SDCARD_SORT
+  sortDirIndex(dir);
+  #endif
+}
+
+//read the directory entry of the indexed file nr, long name included
+bool CardReader::readIndexEntry(SdFile &dir, uint8_t nr, dir_t &p)
+{
+  return dir.seekSet((uint32_t)dirIndexPos[nr] << 5) &&
+         dir.readDir(p, longFilename) > 0 &&
+         shortNameChecksum(p.name) == dirIndexHash[nr];
+}
+#endif
+
+#ifdef SDCARD_SORT
+//the name shown for an entry just read by readIndexEntry()
+static const char *sortName(char *filename, const char *longFilename, const dir_t &p)
+{
+  if(longFilename[0] != '\0')
+    return longFilename;
+  return createFilename(filename, p);
+}
+
+//binary insertion sort of the index, only the entry being inserted is kept in RAM
+void CardReader::sortDirIndex(SdFile &dir)
+{
+  dir_t p;
+  for(int16_t i = 1; i < dirIndexCount; i++)
+  {
+    if(!readIndexEntry(dir, i, p))
+    {
+      invalidateDirIndex();
+      return;
+    }
+    #ifdef SDCARD_SORT_NEWEST_FIRST
+    uint32_t key = ((uint32_t)p.lastWriteDate << 16) | p.lastWriteTime;
+    #else
+    char key[LONG_FILENAME_LENGTH];
+    strncpy(key, sortName(filename, longFilename, p), LONG_FILENAME_LENGTH - 1);
+    key[LONG_FILENAME_LENGTH - 1] = '\0';
+    #endif
+    int16_t lo = 0, hi = i;
+    while(lo < hi)
+    {
+      int16_t mid = (lo + hi) / 2;
+      if(!readIndexEntry(dir, mid, p))
+      {
+        invalidateDirIndex();
+        return;
+      }
+      #ifdef SDCARD_SORT_NEWEST_FIRST
+      bool before = key > (((uint32_t)p.lastWriteDate << 16) | p.lastWriteTime);
+      #else
+      bool before = strcasecmp(key, sortName(filename, longFilename, p)) < 0;
+      #endif
+      if(before)
+        hi = mid;
+      else
+        lo = mid + 1;
+    }
+    uint16_t pos = dirIndexPos[i];
+    uint8_t hash = dirIndexHash[i];
+    memmove(&dirIndexPos[lo + 1], &dirIndexPos[lo], (i - lo) * sizeof(dirIndexPos[0]));
+    memmove(&dirIndexHash[lo + 1], &dirIndexHash[lo], (i - lo) * sizeof(dirIndexHash[0]));
+    dirIndexPos[lo] = pos;
+    dirIndexHash[lo] = hash;
+  }
+}
+
+//sorted version of lsDive() for M20, walking the subdirectories the same way
+void CardReader::lsSorted(SdFile &dir)
+{
+  ls_level_t stack[MAX_DIR_DEPTH];
+  uint8_t depth=0;
+  char path[MAXPATHNAMELENGTH];
+  path[0]=0;
+  SdFile sub; //the subdirectory being listed
+  SdFile *cur=&dir;
+  int16_t i=0;
+  indexDir(dir);
+  for(;;)
+  {
+    if(i==0 && (dirIndexCount < 0 || dirIndexFiles > (uint16_t)dirIndexCount)) //too many files to sort
+    {
+      lsAction=LS_SerialPrint;
+      cur->rewind();
+      lsDive(path,*cur);
+      i=0x7fff;
+    }
+    dir_t p;
+    if(i < dirIndexCount && readIndexEntry(*cur, i, p))
+    {
+      i++;
+      createFilename(filename,p);
+      if(!DIR_IS_SUBDIR(&p))
+      {
+        SERIAL_PROTOCOL(path);
+        SERIAL_PROTOCOLLN(filename);
+        continue;
+      }
+      uint8_t pathLen=strlen(path);
+      if(depth>=MAX_DIR_DEPTH || !lsPathPush(path,filename))
+      {
+        SERIAL_ECHO_START;
+        SERIAL_ECHOLN(MSG_SD_CANT_OPEN_SUBDIR);
+        SERIAL_ECHOLN(filename);
+        continue;
+      }
+      stack[depth].cluster=cur->firstCluster();
+      stack[depth].pos=i;
+      stack[depth].pathLen=pathLen;
+      depth++;
+      sub.close();
+      cur=&sub;
+      if(!sub.openSubDir(&volume,((uint32_t)p.firstClusterHigh << 16) | p.firstClusterLow))
+      {
+        //indexed as empty, so it returns to the parent right away
+        SERIAL_ECHO_START;
+        SERIAL_ECHOLN(MSG_SD_CANT_OPEN_SUBDIR);
+        SERIAL_ECHOLN(filename);
+      }
+      i=0;
+      indexDir(sub);
+      continue;
+    }
+    //end of this directory, carry on in its parent after the entry of it
+    if(depth==0)
+      return;
+    depth--;
+    path[stack[depth].pathLen]=0;
+    sub.close();
+    if(depth==0)
+      cur=&dir;
+    else
+      sub.openSubDir(&volume,stack[depth].cluster); //on failure it is indexed as empty
+    indexDir(*cur); //the subdirectory took over the index
+    i=stack[depth].pos;
+  }
+}
+#endif
+
+
+#ifdef SDSLOW
+  #define SD_SPI_SPEED SPI_HALF_SPEED
+#else
+  #define SD_SPI_SPEED SPI_FULL_SPEED
+#endif
 
 void CardReader::initsd()
+{
+  initsdBegin();
+  initsdEnd(card.init(SD_SPI_SPEED,SDSS));
+}
+
+#ifdef FAST_BOOT
+// Start initsd() without waiting for the card, initsdPoll() finishes it from the main loop
+void CardReader::initsdStart()
+{
+  initsdBegin();
+  card.initStart(SD_SPI_SPEED,SDSS);
+  initPending = true;
+}
+
+void CardReader::initsdPoll()
+{
+  if(!initPending)
+    return;
+  int8_t done = card.initStep();
+  if(done)
+  {
+    initPending = false;
+    initsdEnd(done > 0);
+  }
+}
+#endif //FAST_BOOT
+
+void CardReader::initsdBegin()
 {
   cardOK = false;
+  #ifdef SD_LIST_CHUNK
+  lsStop();
+  #endif
+  #ifdef FAST_BOOT
+  initPending = false;
+  #endif
+  invalidateDirIndex();
+  invalidateSubcalls(); //another card may be in
+  invalidateHeaders();
+  #ifdef POWER_LOSS_RECOVERY
+  journalBlock = 0; //another card may be in
+  #endif
+  #ifdef SD_TELEMETRY
+  telemetryBlock = 0;
+  telemetryTried = false;
+  #endif
   if(root.isOpen())
     root.close();
-#ifdef SDSLOW
-  if (!card.init(SPI_HALF_SPEED,SDSS))
-#else
-  if (!card.init(SPI_FULL_SPEED,SDSS))
-#endif
+}
+
+// Mount the volume once card.init() is done, cardInit tells whether it succeeded
+void CardReader::initsdEnd(bool cardInit)
+{
+  if (!cardInit)
   {
     //if (!card.init(SPI_HALF_SPEED,SDSS))
     SERIAL_ECHO_START;
@@ -193,6 +521,7 @@ void CardReader::setroot()
     SERIAL_ECHOLNPGM(MSG_SD_WORKDIR_FAIL);
   }*/
   workDir=root;
+  invalidateDirIndex();
   
   curDir=&workDir;
 }
@@ -200,6 +529,14 @@ void CardReader::release()
 {
   sdprinting = false;
   cardOK = false;
+  #ifdef FAST_BOOT
+  initPending = false;
+  #endif
+  #ifdef SD_LIST_CHUNK
+  lsStop();
+  #endif
+  invalidateSubcalls();
+  invalidateHeaders();
 }
 
 void CardReader::startFileprint()
@@ -207,6 +544,13 @@ void CardReader::startFileprint()
   if(cardOK)
   {
     sdprinting = true;
+    #ifdef POWER_LOSS_RECOVERY
+    if(!journalBlock) //a newly opened file, not a resumed pause
+      openJournal();
+    #endif
+    #ifdef SD_PRINT_ETA
+    resetProgress(); //the time spent paused doesn't count
+    #endif
   }
 }
 
@@ -241,10 +585,57 @@ void CardReader::getAbsFilename(char *t)
     t[0]=0;
 }
 
-void CardReader::openFile(char* name,bool read, bool replace_current/*=true*/)
+#ifdef SD_SUBCALL_CACHE
+//a relative path is looked up in the working directory, so that is part of the hash
+uint16_t CardReader::subcallPathHash(const char *name)
+{
+  uint16_t hash = name[0]=='/' ? 0 : (uint16_t)workDir.firstCluster();
+  while(*name)
+    hash = (hash << 5) + hash + toupper(*name++);
+  return hash ? hash : 1; //0 marks an unused entry
+}
+
+//open a subroutine file called before without walking the directories for it
+bool CardReader::openCachedSubcall(char *name)
+{
+  uint16_t hash = subcallPathHash(name);
+  const char *slash = strrchr(name, '/');
+  const char *fname = slash ? slash + 1 : name;
+  char cachedname[13];
+  for(uint8_t i = 0; i < SD_SUBCALL_CACHE; i++)
+  {
+    if(subcallHash[i] != hash)
+      continue;
+    subcallFile[i].getFilename(cachedname);
+    if(strcasecmp(cachedname, fname) != 0)
+      continue;
+    file = subcallFile[i];
+    return true;
+  }
+  return false;
+}
+
+//remember the subroutine file just opened, while it is still at position 0
+void CardReader::cacheSubcall(char *name)
+{
+  subcallHash[subcallNext] = subcallPathHash(name);
+  subcallFile[subcallNext] = file;
+  subcallNext = (subcallNext + 1) % SD_SUBCALL_CACHE;
+}
+#endif
+
+void CardReader::openFile(char* name,bool read, bool replace_current/*=true*/, uint32_t size/*=0*/)
 {
   if(!cardOK)
     return;
+  bool subcall=false;
+  #ifdef SD_BACKGROUND_UPLOAD
+  if(!read)
+  {
+    //goes to saveFile, the printed file stays open
+  }
+  else
+  #endif
   if(file.isOpen())  //replacing current file by new file, or subfile call
   {
     if(!replace_current)
@@ -263,14 +654,20 @@ void CardReader::openFile(char* name,bool read, bool replace_current/*=true*/)
      SERIAL_ECHO(name);
      SERIAL_ECHOPGM("\" parent:\"");
      
-     //store current filename and position
-     getAbsFilename(filenames[file_subcall_ctr]);
+     //keep the current file open and remember the position
+     char parentname[13];
+     file.getFilename(parentname);
      
-     SERIAL_ECHO(filenames[file_subcall_ctr]);
+     SERIAL_ECHO(parentname);
      SERIAL_ECHOPGM("\" pos");
      SERIAL_ECHOLN(sdpos);
      filespos[file_subcall_ctr]=sdpos;
+     filesParent[file_subcall_ctr]=file;
+     #ifdef SD_BINARY_JOB
+     filesBinary[file_subcall_ctr]=binaryjob;
+     #endif
      file_subcall_ctr++;
+     subcall=true;
     }
     else
     {
@@ -287,23 +684,41 @@ void CardReader::openFile(char* name,bool read, bool replace_current/*=true*/)
     SERIAL_ECHOPGM("Now fresh file: ");
     SERIAL_ECHOLN(name);
   }
+  #ifdef SD_BACKGROUND_UPLOAD
+  if(read)
+  #endif
   sdprinting = false;
+  #ifdef SD_JOB_QUEUE
+  if(read && replace_current)
+    queueState = QUEUE_IDLE; //queuePrint() sets it again for its own files
+  #endif
   
  
   SdFile myDir;
   curDir=&root;
   char *fname=name;
+  #ifdef SD_SUBCALL_CACHE
+  bool cached = subcall && read && openCachedSubcall(name);
+  #else
+  const bool cached = false;
+  #endif
   
   char *dirname_start,*dirname_end;
-  if(name[0]=='/')
+  if(cached)
+  {
+    char *slash=strrchr(name,'/');
+    if(slash)
+      fname=slash+1;
+  }
+  else if(name[0]=='/')
   {
     dirname_start=strchr(name,'/')+1;
-    while(dirname_start>0)
+    while(dirname_start!=NULL)
     {
       dirname_end=strchr(dirname_start,'/');
       //SERIAL_ECHO("start:");SERIAL_ECHOLN((int)(dirname_start-name));
       //SERIAL_ECHO("end  :");SERIAL_ECHOLN((int)(dirname_end-name));
-      if(dirname_end>0 && dirname_end>dirname_start)
+      if(dirname_end!=NULL && dirname_end>dirname_start)
       {
         char subdirname[13];
         strncpy(subdirname, dirname_start, dirname_end-dirname_start);
@@ -340,14 +755,39 @@ void CardReader::openFile(char* name,bool read, bool replace_current/*=true*/)
   }
   if(read)
   {
-    if (file.open(curDir, fname, O_READ)) 
+    if (cached || file.open(curDir, fname, O_READ)) 
     {
+      #ifdef SD_SUBCALL_CACHE
+      if(subcall && !cached)
+        cacheSubcall(name);
+      #endif
       filesize = file.fileSize();
+      #ifdef POWER_LOSS_RECOVERY
+      journalBlock = 0; //the journal is started again for this file
+      #endif
+      #ifdef SD_PRINT_ETA
+      progressPercent = 0;
+      etaMoveCount = 0;
+      resetProgress();
+      #endif
+      #ifdef SD_CLUSTER_RUN_CACHE
+      file.cacheClusterRuns();
+      #endif
+      #ifdef SD_FILE_HEADER
+      if(!subcall)
+        readHeader();
+      #endif
+      #ifdef SD_BINARY_JOB
+      openBinaryJob();
+      #endif
       SERIAL_PROTOCOLPGM(MSG_SD_FILE_OPENED);
       SERIAL_PROTOCOL(fname);
       SERIAL_PROTOCOLPGM(MSG_SD_SIZE);
       SERIAL_PROTOCOLLN(filesize);
       sdpos = 0;
+      #ifdef SD_EXECUTED_POSITION
+      plan_sdpos = 0;
+      #endif
       
       SERIAL_PROTOCOLLNPGM(MSG_SD_FILE_SELECTED);
       lcd_setstatus(fname);
@@ -361,7 +801,35 @@ void CardReader::openFile(char* name,bool read, bool replace_current/*=true*/)
   }
   else 
   { //write
-    if (!file.open(curDir, fname, O_CREAT | O_APPEND | O_WRITE | O_TRUNC))
+    invalidateDirIndex();
+    invalidateSubcalls(); //the file may be one of them
+    invalidateHeaders();
+    #ifdef SD_BACKGROUND_UPLOAD
+    if(file.isOpen() && file.firstCluster())
+    {
+      //truncating the printed file would pull it away under the print
+      SdFile existing;
+      bool printed = existing.open(curDir, fname, O_READ) && existing.firstCluster() == file.firstCluster();
+      existing.close();
+      if(printed)
+      {
+        SERIAL_PROTOCOLPGM(MSG_SD_OPEN_FILE_FAIL);
+        SERIAL_PROTOCOL(fname);
+        SERIAL_PROTOCOLLNPGM(".");
+        return;
+      }
+    }
+    #endif
+    bool opened = false;
+    #ifdef SD_WRITE_BEHIND
+    if(size)
+    {
+      //all clusters in one piece, which writeBlockRun() fills with one pre-erased multiple block write
+      SdBaseFile::remove(curDir, fname);
+      opened = writeFile().createContiguous(curDir, fname, size);
+    }
+    #endif
+    if (!opened && !writeFile().open(curDir, fname, O_CREAT | O_APPEND | O_WRITE | O_TRUNC))
     {
       SERIAL_PROTOCOLPGM(MSG_SD_OPEN_FILE_FAIL);
       SERIAL_PROTOCOL(fname);
@@ -370,6 +838,9 @@ void CardReader::openFile(char* name,bool read, bool replace_current/*=true*/)
     else
     {
       saving = true;
+      #ifdef SD_WRITE_BEHIND
+      writeFill = 0;
+      #endif
       SERIAL_PROTOCOLPGM(MSG_SD_WRITE_TO_FILE);
       SERIAL_PROTOCOLLN(name);
       lcd_setstatus(fname);
@@ -384,7 +855,9 @@ void CardReader::removeFile(char* name)
     return;
   file.close();
   sdprinting = false;
-  
+  invalidateDirIndex();
+  invalidateSubcalls();
+  invalidateHeaders();
   
   SdFile myDir;
   curDir=&root;
@@ -394,12 +867,12 @@ void CardReader::removeFile(char* name)
   if(name[0]=='/')
   {
     dirname_start=strchr(name,'/')+1;
-    while(dirname_start>0)
+    while(dirname_start!=NULL)
     {
       dirname_end=strchr(dirname_start,'/');
       //SERIAL_ECHO("start:");SERIAL_ECHOLN((int)(dirname_start-name));
       //SERIAL_ECHO("end  :");SERIAL_ECHOLN((int)(dirname_end-name));
-      if(dirname_end>0 && dirname_end>dirname_start)
+      if(dirname_end!=NULL && dirname_end>dirname_start)
       {
         char subdirname[13];
         strncpy(subdirname, dirname_start, dirname_end-dirname_start);
@@ -449,35 +922,756 @@ void CardReader::removeFile(char* name)
   
 }
 
+//a character that ends the command part of a line
+static inline bool isLineStop(char c)
+{
+  return c == '\n' || c == '\r' || c == '#' || c == ':' || c == ';';
+}
+
+// Copy the next line of the file into buf without its comment, straight from the
+// block buffer, with one memcpy per block the line is in. terminator gets the character
+// that ended the line ('\n', '\r', '#' or ':'), or 0 at the end of the file or when buf is full.
+uint8_t CardReader::getLine(char *buf, uint8_t size, char *terminator)
+{
+  uint8_t count = 0;
+  bool comment = false;
+  *terminator = 0;
+  while(*terminator == 0 && count < size - 1)
+  {
+    uint16_t avail;
+    const char *src = (const char *)file.readPeek(&avail);
+    if(src == NULL)
+      break; //end of file or read error
+    uint16_t i = 0;
+    while(i < avail)
+    {
+      if(comment)
+      {
+        //skip to the end of the line
+        while(i < avail && src[i] != '\n' && src[i] != '\r')
+          i++;
+        if(i == avail)
+          break;
+      }
+      else
+      {
+        //find where the line stops in this block and copy that part in one go
+        uint16_t start = i, room = size - 1 - count;
+        while(i < avail && i - start < room && !isLineStop(src[i]))
+          i++;
+        memcpy(buf + count, src + start, i - start);
+        count += i - start;
+        if(i == avail || !isLineStop(src[i]))
+          break; //the line goes on in the next block, or buf is full
+        if(src[i] == ';')
+        {
+          comment = true;
+          i++;
+          continue;
+        }
+      }
+      *terminator = src[i++];
+      break;
+    }
+    file.readSkip(i);
+  }
+  sdpos = file.curPosition();
+  buf[count] = 0;
+  #ifdef SD_PRINT_ETA
+  if(buf[0] == 'G' && (buf[1] == '0' || buf[1] == '1') && (buf[2] < '0' || buf[2] > '9'))
+    countMove();
+  #endif
+  return count;
+}
+
+// Copy up to nbyte bytes of the file into buf, returns the number copied.
+int16_t CardReader::read(void *buf, uint16_t nbyte)
+{
+  uint8_t *dst = (uint8_t *)buf;
+  uint16_t done = 0;
+  while(done < nbyte)
+  {
+    uint16_t avail;
+    const uint8_t *src = file.readPeek(&avail);
+    if(src == NULL)
+      break;
+    if(avail > nbyte - done)
+      avail = nbyte - done;
+    memcpy(dst + done, src, avail);
+    file.readSkip(avail);
+    done += avail;
+  }
+  sdpos = file.curPosition();
+  return done;
+}
+
+// The next byte of the file without consuming it, -1 at the end of the file.
+int16_t CardReader::peek()
+{
+  uint16_t avail;
+  const uint8_t *src = file.readPeek(&avail);
+  return src == NULL ? -1 : *src;
+}
+
+#ifdef SD_BINARY_JOB
+// Check the just opened file for the binary job header and skip it.
+void CardReader::openBinaryJob()
+{
+  uint8_t header[6];
+  binaryjob = false;
+  if(read(header, sizeof(header)) == sizeof(header) && memcmp_P(header, PSTR("MBJ1"), 4) == 0)
+  {
+    binaryjob = true;
+    setIndex(header[4] | ((uint16_t)header[5] << 8));
+    SERIAL_PROTOCOLLNPGM("Binary job");
+  }
+  else
+    setIndex(0);
+}
+#endif
+
+#ifdef SD_FILE_HEADER
+// header of the opened file, from the cache if it is there
+void CardReader::readHeader()
+{
+  uint32_t cluster = file.firstCluster();
+  for(uint8_t i = 0; i < SD_FILE_HEADER; i++)
+    if(cluster && headerCache[i].cluster == cluster && headerCache[i].size == filesize)
+    {
+      header = headerCache[i];
+      return;
+    }
+  scanHeader();
+  header.cluster = cluster;
+  header.size = filesize;
+  if(!cluster)
+    return; //empty, nothing to keep
+  headerCache[headerNext] = header;
+  headerNext = (headerNext + 1) % SD_FILE_HEADER;
+}
+
+// The comment lines ";<key>:<value>" in the first SD_FILE_HEADER_BYTES of the file, the keys are
+// the SD_HEADER_ bits in order
+void CardReader::scanHeader()
+{
+  static const char keys[] PROGMEM = "MINX\0MAXX\0MINY\0MAXY\0TIME\0Filament used\0";
+  char line[32];
+  uint8_t len = 0;
+  header.found = 0;
+  setIndex(0);
+  for(uint16_t n = 0; n < SD_FILE_HEADER_BYTES; n++)
+  {
+    int16_t c = get();
+    if(c < 0)
+      break;
+    if(c != '\n' && c != '\r')
+    {
+      if(len < sizeof(line) - 1)
+        line[len++] = c;
+      continue;
+    }
+    line[len] = 0;
+    char *value = line[0] == ';' ? strchr(line, ':') : NULL;
+    len = 0;
+    if(value == NULL)
+      continue;
+    *value++ = 0;
+    const char *key = keys;
+    for(uint8_t k = 0; pgm_read_byte(key); k++, key += strlen_P(key) + 1)
+    {
+      if(strcmp_P(line + 1, key) != 0)
+        continue;
+      double v = strtod(value, NULL);
+      if(k < 4)
+        header.bounds[k] = v;
+      else if(k == 4)
+        header.printSeconds = v;
+      else
+        header.filamentMm = v * 1000;
+      header.found |= 1 << k;
+    }
+  }
+  setIndex(0);
+}
+
+bool CardReader::getPrintBounds(float *bounds)
+{
+  if(!isFileOpen() || (header.found & SD_HEADER_BOUNDS) != SD_HEADER_BOUNDS)
+    return false;
+  memcpy(bounds, header.bounds, sizeof(header.bounds));
+  return true;
+}
+#endif
+
+#ifdef SD_JOB_QUEUE
+// M813: go through the queue, at once if nothing is printing or else after the print
+bool CardReader::queueStart()
+{
+  queueActive = cardOK;
+  if(!cardOK || sdprinting)
+    return false;
+  return queueStartNext();
+}
+
+// A print ended, mark its job done and start what comes after it. True if something prints.
+bool CardReader::queueNext()
+{
+  uint8_t finished = queueState;
+  queueState = QUEUE_IDLE;
+  if(finished == QUEUE_JOB)
+  {
+    queueMarkDone();
+    #ifdef SD_JOB_QUEUE_BETWEEN
+    char name[MAXPATHNAMELENGTH];
+    strcpy_P(name, PSTR(SD_JOB_QUEUE_BETWEEN));
+    SdFile between;
+    bool found = between.open(root, name, O_READ);
+    between.close();
+    if(found && queuePrint(name))
+    {
+      queueState = QUEUE_BETWEEN;
+      return true;
+    }
+    #endif
+  }
+  if(!queueActive)
+    return false;
+  return queueStartNext();
+}
+
+// Open a file named in the queue, relative to the root directory, and print it
+bool CardReader::queuePrint(char *name)
+{
+  char path[MAXPATHNAMELENGTH + 1];
+  path[0] = '/';
+  strncpy(path + (name[0] != '/'), name, MAXPATHNAMELENGTH);
+  path[MAXPATHNAMELENGTH] = 0;
+  openFile(path, true);
+  if(!isFileOpen())
+    return false;
+  startFileprint();
+  return true;
+}
+
+// Start the first job of SD_JOB_QUEUE_FILE that is not marked done. The queue stops when there
+// is none or it can't be printed.
+bool CardReader::queueStartNext()
+{
+  SdFile queue;
+  char line[MAXPATHNAMELENGTH];
+  queueActive = false;
+  if(!queue.open(root, SD_JOB_QUEUE_FILE, O_READ))
+  {
+    SERIAL_ERROR_START;
+    SERIAL_ERRORLNPGM("Can't open " SD_JOB_QUEUE_FILE);
+    return false;
+  }
+  for(;;)
+  {
+    uint32_t pos = queue.curPosition();
+    int16_t n = queue.fgets(line, sizeof(line));
+    if(n <= 0)
+      break;
+    if(n == sizeof(line) - 1 && line[n - 1] != '\n')
+    {
+      SERIAL_ERROR_START;
+      SERIAL_ERRORLNPGM("Path too long in " SD_JOB_QUEUE_FILE);
+      queue.close();
+      return false;
+    }
+    char *job = line;
+    while(*job == ' ' || *job == '\t')
+      job++;
+    char *end = line + n;
+    while(end > job && (uint8_t)end[-1] <= ' ')
+      *--end = 0;
+    if(!*job || *job == ';')
+      continue; //done or a comment
+    queue.close();
+    if(!queuePrint(job))
+    {
+      SERIAL_ERROR_START;
+      SERIAL_ERRORLNPGM("Job queue stopped");
+      return false;
+    }
+    queueJobPos = pos + (job - line);
+    queueState = QUEUE_JOB;
+    queueActive = true;
+    return true;
+  }
+  queue.close();
+  SERIAL_ECHO_START;
+  SERIAL_ECHOLNPGM("Job queue done");
+  return false;
+}
+
+// Overwrite the first character of the line of the finished job with ';' so it is not printed again
+void CardReader::queueMarkDone()
+{
+  SdFile queue;
+  bool done = queue.open(root, SD_JOB_QUEUE_FILE, O_RDWR) && queue.seekSet(queueJobPos) && queue.write(";", 1) == 1;
+  if(!queue.close() || !done)
+  {
+    queueActive = false; //it would be printed again
+    SERIAL_ERROR_START;
+    SERIAL_ERRORLNPGM("Can't mark the job done in " SD_JOB_QUEUE_FILE);
+  }
+}
+#endif
+
+#ifdef POWER_LOSS_RECOVERY
+// Find POWER_LOSS_FILE in the root directory, creating it as two contiguous blocks the first time
+static bool findJournal(SdFile &root, uint32_t *block)
+{
+  SdFile journal;
+  uint32_t endBlock;
+  if(!journal.open(root, POWER_LOSS_FILE, O_READ) && !journal.createContiguous(&root, POWER_LOSS_FILE, 1024))
+    return false;
+  bool found = journal.fileSize() >= 1024 && journal.contiguousRange(block, &endBlock);
+  journal.close();
+  return found;
+}
+
+// Called as a print starts: store the path of the file and clear the old checkpoint. The
+// checkpoints only overwrite the first block in place, so they never allocate a cluster.
+bool CardReader::openJournal()
+{
+  char name[MAXPATHNAMELENGTH];
+  journalBlock = 0;
+  if(!findJournal(root, &journalBlock))
+  {
+    journalBlock = 0;
+    SERIAL_ERROR_START;
+    SERIAL_ERRORLNPGM("Can't open " POWER_LOSS_FILE);
+    return false;
+  }
+  getAbsFilename(name);
+  return card.writeBlock(journalBlock + 1, (const uint8_t *)name, strlen(name) + 1) && writeJournal(NULL);
+}
+
+// Overwrite the checkpoint, a NULL state leaves nothing to resume
+bool CardReader::writeJournal(const recovery_t *state)
+{
+  if(!journalBlock && (!cardOK || !findJournal(root, &journalBlock)))
+  {
+    journalBlock = 0;
+    return false;
+  }
+  return card.writeBlock(journalBlock, (const uint8_t *)state, state ? sizeof(*state) : 0);
+}
+
+// The last checkpoint and the path of its file, false if there is none
+bool CardReader::readJournal(recovery_t *state, char *name)
+{
+  uint32_t block;
+  if(!cardOK || !findJournal(root, &block))
+    return false;
+  if(!card.readBlock(block, (uint8_t *)state, sizeof(*state)) || state->magic != RECOVERY_MAGIC)
+    return false;
+  if(!card.readBlock(block + 1, (uint8_t *)name, MAXPATHNAMELENGTH))
+    return false;
+  name[MAXPATHNAMELENGTH - 1] = 0;
+  return true;
+}
+#endif
+
+#ifdef SD_TELEMETRY
+// seq of the first record in block b of the log if it is the record that belongs there, else 0
+uint32_t CardReader::telemetryBlockSeq(uint32_t b)
+{
+  uint32_t seq;
+  if(!card.readBlock(telemetryBlock + b, (uint8_t *)&seq, sizeof(seq)))
+    return 0;
+  if(seq == 0 || (seq - 1) % TELEMETRY_PER_BLOCK != 0 || ((seq - 1) / TELEMETRY_PER_BLOCK) % SD_TELEMETRY_BLOCKS != b)
+    return 0;
+  return seq;
+}
+
+// Find SD_TELEMETRY_FILE in the root directory, creating it in one contiguous piece the first time, and
+// continue after its newest record. The blocks from 0 on carry on from block 0 up to the newest, after
+// that there are older records or none, so the newest block is found with a binary search.
+bool CardReader::openTelemetry()
+{
+  SdFile log;
+  uint32_t endBlock;
+  telemetryTried = true;
+  if(!log.open(root, SD_TELEMETRY_FILE, O_READ) && !log.createContiguous(&root, SD_TELEMETRY_FILE, SD_TELEMETRY_BLOCKS * 512UL))
+    return false;
+  bool found = log.fileSize() >= SD_TELEMETRY_BLOCKS * 512UL && log.contiguousRange(&telemetryBlock, &endBlock);
+  log.close();
+  if(!found)
+  {
+    telemetryBlock = 0;
+    return false;
+  }
+  uint32_t first = telemetryBlockSeq(0);
+  telemetrySeq = 1;
+  if(first)
+  {
+    uint32_t lo = 1, hi = SD_TELEMETRY_BLOCKS;
+    while(lo < hi)
+    {
+      uint32_t mid = (lo + hi) / 2;
+      if(telemetryBlockSeq(mid) == first + mid * TELEMETRY_PER_BLOCK)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    telemetrySeq = first + lo * TELEMETRY_PER_BLOCK;
+  }
+  memset(telemetryBuf, 0, sizeof(telemetryBuf));
+  telemetryFill = 0;
+  telemetryWriteNext = 0;
+  return true;
+}
+
+// Stage a record for the log, false if there is no log or the block buffer is still full
+bool CardReader::telemetryAdd(telemetry_t *rec)
+{
+  if(!telemetryBlock)
+  {
+    if(telemetryTried || !cardOK)
+      return false;
+    if(!openTelemetry())
+    {
+      SERIAL_ERROR_START;
+      SERIAL_ERRORLNPGM("Can't open " SD_TELEMETRY_FILE);
+      return false;
+    }
+  }
+  if(telemetryFull())
+  {
+    if(telemetryDropped < 0xFFFF)
+      telemetryDropped++;
+    return false;
+  }
+  rec->seq = telemetrySeq + telemetryFill;
+  telemetryBuf[telemetryFill++] = *rec;
+  return true;
+}
+
+// Write the staged block, as the next block of a multiple block write when it follows the last one. A block
+// that is not full yet is written with its unused slots zero and written again once it is. Only the block
+// being written is pre-erased: the rest of the ring still holds the older records, and a pre-erase may
+// wipe blocks the write never gets to.
+bool CardReader::telemetryWrite()
+{
+  if(!telemetryBlock || !telemetryFill)
+    return false;
+  uint32_t b = ((telemetrySeq - 1) / TELEMETRY_PER_BLOCK) % SD_TELEMETRY_BLOCKS;
+  if(!card.writeActive() || telemetryWriteNext != telemetryBlock + b)
+  {
+    if(!card.writeStart(telemetryBlock + b, 1))
+      return false;
+  }
+  if(!card.writeData((const uint8_t *)telemetryBuf))
+    return false;
+  telemetryWriteNext = telemetryBlock + b + 1;
+  if(telemetryFull())
+  {
+    telemetrySeq += TELEMETRY_PER_BLOCK;
+    memset(telemetryBuf, 0, sizeof(telemetryBuf));
+    telemetryFill = 0;
+  }
+  return true;
+}
+
+void CardReader::telemetryReport()
+{
+  SERIAL_PROTOCOLPGM("Telemetry records:");
+  SERIAL_PROTOCOL(telemetryBlock ? telemetrySeq - 1 + telemetryFill : 0);
+  SERIAL_PROTOCOLPGM(" staged:");
+  SERIAL_PROTOCOL((int)telemetryFill);
+  SERIAL_PROTOCOLPGM(" dropped:");
+  SERIAL_PROTOCOLLN(telemetryDropped);
+}
+#endif
+
+#ifdef SD_PRINT_ETA
+// start a new window, since the last samples no longer tell how fast the print goes
+void CardReader::resetProgress()
+{
+  etaIndex = 0;
+  etaCount = 0;
+  etaSeconds = -1;
+  bytesPerSecond = 0;
+  movesPerSecond = 0;
+  etaNextSample = millis();
+}
+
+// Take a sample every SD_ETA_SAMPLE_MS, so the rates and the remaining time are
+// only divided out once per sample rather than on every display refresh.
+void CardReader::updateProgress()
+{
+  unsigned long now = millis();
+  if(!sdprinting || (long)(now - etaNextSample) < 0)
+    return;
+  etaNextSample = now + SD_ETA_SAMPLE_MS;
+
+  uint8_t oldest = etaCount < SD_ETA_SAMPLES ? 0 : (etaIndex + 1) % SD_ETA_SAMPLES;
+  bool first = etaCount == 0;
+  etaBytes[etaIndex] = sdpos;
+  etaMoves[etaIndex] = etaMoveCount;
+  etaTimes[etaIndex] = now;
+  etaIndex = (etaIndex + 1) % SD_ETA_SAMPLES;
+  if(etaCount < SD_ETA_SAMPLES)
+    etaCount++;
+
+  progressPercent = filesize ? sdpos / ((filesize + 99) / 100) : 0;
+  if(first)
+    return;
+  unsigned long window = now - etaTimes[oldest];
+  bytesPerSecond = (sdpos - etaBytes[oldest]) * 1000UL / window;
+  movesPerSecond = (etaMoveCount - etaMoves[oldest]) * 1000UL / window;
+  etaSeconds = bytesPerSecond ? (int32_t)((filesize - sdpos) / bytesPerSecond) : -1;
+}
+#endif
+
 void CardReader::getStatus()
 {
   if(cardOK){
     SERIAL_PROTOCOLPGM(MSG_SD_PRINTING_BYTE);
+    #ifdef SD_EXECUTED_POSITION
+    SERIAL_PROTOCOL(isFileOpen() ? plan_executed_sdpos() : sdpos); //where the stepper is, not the reading
+    #else
     SERIAL_PROTOCOL(sdpos);
+    #endif
     SERIAL_PROTOCOLPGM("/");
     SERIAL_PROTOCOLLN(filesize);
+    #ifdef SD_FILE_HEADER
+    if(isFileOpen() && (header.found & (SD_HEADER_TIME | SD_HEADER_FILAMENT)))
+    {
+      SERIAL_PROTOCOLPGM("Estimated:");
+      SERIAL_PROTOCOL(header.printSeconds);
+      SERIAL_PROTOCOLPGM(" filament mm:");
+      SERIAL_PROTOCOLLN(header.filamentMm);
+    }
+    #endif
+    #ifdef SD_PRINT_ETA
+    if(etaSeconds >= 0)
+    {
+      SERIAL_PROTOCOLPGM("ETA:");
+      SERIAL_PROTOCOL(etaSeconds);
+      SERIAL_PROTOCOLPGM(" bytes/s:");
+      SERIAL_PROTOCOL(bytesPerSecond);
+      SERIAL_PROTOCOLPGM(" moves/s:");
+      SERIAL_PROTOCOLLN(movesPerSecond);
+    }
+    #endif
   }
   else{
     SERIAL_PROTOCOLLNPGM(MSG_SD_NOT_PRINTING);
   }
 }
+
+#ifdef SD_CHECK_CRC
+//corrupted blocks since the card was initialized and the SPI clock divider they left
+void CardReader::linkStatus()
+{
+  if(!cardOK)
+  {
+    SERIAL_ECHO_START;
+    SERIAL_ECHOLNPGM(MSG_SD_INIT_FAIL);
+    return;
+  }
+  SERIAL_PROTOCOLPGM("SD CRC errors:");
+  SERIAL_PROTOCOL(card.crcErrors());
+  SERIAL_PROTOCOLPGM(" SCK divider:");
+  SERIAL_PROTOCOL(2 << card.sckRate());
+  SERIAL_PROTOCOLPGM(" started at:");
+  SERIAL_PROTOCOLLN(2 << card.initSckRate());
+}
+#endif
+
+#ifdef SD_LATENCY_HISTOGRAM
+// One line per kind: the longest time, then "<us:count" for the buckets that are not empty
+void CardReader::latencyReport()
+{
+  static const char read_block[] PROGMEM = "read block";
+  static const char read_data[] PROGMEM = "stream block";
+  static const char busy[] PROGMEM = "busy wait";
+  static const char cache_miss[] PROGMEM = "cache miss";
+  static const char *const names[SD_LATENCY_KINDS] PROGMEM = { read_block, read_data, busy, cache_miss };
+  for(uint8_t kind = 0; kind < SD_LATENCY_KINDS; kind++)
+  {
+    SERIAL_PROTOCOLPGM("SD ");
+    serialprintPGM((const char *)pgm_read_ptr(&names[kind]));
+    SERIAL_PROTOCOLPGM(" max us:");
+    SERIAL_PROTOCOL(sdLatencyMax[kind]);
+    for(uint8_t b = 0; b < SD_LATENCY_BUCKETS; b++)
+    {
+      if(!sdLatency[kind][b])
+        continue;
+      if(b == SD_LATENCY_BUCKETS - 1)
+      {
+        SERIAL_PROTOCOLPGM(" >=");
+        SERIAL_PROTOCOL(64UL << b);
+      }
+      else
+      {
+        SERIAL_PROTOCOLPGM(" <");
+        SERIAL_PROTOCOL(128UL << b);
+      }
+      SERIAL_PROTOCOLPGM(":");
+      SERIAL_PROTOCOL(sdLatency[kind][b]);
+    }
+    SERIAL_PROTOCOLLN("");
+  }
+}
+
+void CardReader::latencyReset()
+{
+  memset(sdLatency, 0, sizeof(sdLatency));
+  memset(sdLatencyMax, 0, sizeof(sdLatencyMax));
+}
+#endif
+
+#ifdef SD_BENCHMARK
+static void benchmarkResult(const char *what, uint32_t bytes, unsigned long ms, unsigned long worst_us)
+{
+  if(!ms)
+    ms = 1;
+  SERIAL_PROTOCOLPGM("SD ");
+  serialprintPGM(what);
+  SERIAL_PROTOCOL(bytes);
+  SERIAL_PROTOCOLPGM(" bytes in ");
+  SERIAL_PROTOCOL(ms);
+  SERIAL_PROTOCOLPGM("ms ");
+  SERIAL_PROTOCOL((float)bytes / ms);
+  SERIAL_PROTOCOLPGM("KB/s worst call us:");
+  SERIAL_PROTOCOL(worst_us);
+}
+
+// Read name to the end with getLine() like a print, then write writeKB to a scratch file in
+// the root directory with the write() calls M28 uses and remove it. Either part may be left out.
+void CardReader::benchmark(char *name, uint16_t writeKB)
+{
+  if(!cardOK)
+  {
+    SERIAL_ECHO_START;
+    SERIAL_ECHOLNPGM(MSG_SD_INIT_FAIL);
+    return;
+  }
+  if(sdprinting || saving)
+  {
+    SERIAL_ERROR_START;
+    SERIAL_ERRORLNPGM("SD busy, not benchmarked");
+    return;
+  }
+  char line[MAX_CMD_SIZE];
+  unsigned long start, worst = 0;
+  if(*name)
+  {
+    // opened here rather than with openFile(), a benchmark doesn't select the file or tell the host about it
+    file.close();
+    if(!file.open(&workDir, name, O_READ))
+    {
+      SERIAL_PROTOCOLPGM(MSG_SD_OPEN_FILE_FAIL);
+      SERIAL_PROTOCOL(name);
+      SERIAL_PROTOCOLLNPGM(".");
+      return;
+    }
+    filesize = file.fileSize();
+    sdpos = 0;
+    #ifdef SD_CLUSTER_RUN_CACHE
+    file.cacheClusterRuns();
+    #endif
+    uint32_t lines = 0;
+    char terminator;
+    start = millis();
+    while(!eof())
+    {
+      unsigned long t = micros();
+      uint8_t n = getLine(line, sizeof(line), &terminator);
+      t = micros() - t;
+      if(t > worst)
+        worst = t;
+      if(n)
+        lines++;
+      else if(terminator == 0 && !eof())
+        break; //read error
+      manage_heater();
+    }
+    unsigned long ms = millis() - start;
+    benchmarkResult(PSTR("read "), sdpos, ms, worst);
+    SERIAL_PROTOCOLPGM(" lines/s:");
+    SERIAL_PROTOCOLLN(lines * 1000.0 / (ms ? ms : 1));
+    file.close();
+  }
+  if(writeKB)
+  {
+    SdFile scratch;
+    invalidateDirIndex();
+    if(!scratch.open(&root, "bench.tmp", O_CREAT | O_WRITE | O_TRUNC))
+    {
+      SERIAL_PROTOCOLPGM(MSG_SD_OPEN_FILE_FAIL);
+      SERIAL_PROTOCOLLNPGM("bench.tmp.");
+      return;
+    }
+    memset(line, 'G', sizeof(line));
+    uint32_t bytes = (uint32_t)writeKB * 1024, written = 0;
+    worst = 0;
+    start = millis();
+    while(written < bytes)
+    {
+      uint16_t n = min((uint32_t)sizeof(line), bytes - written);
+      unsigned long t = micros();
+      if(scratch.write(line, n) != n)
+        break;
+      t = micros() - t;
+      if(t > worst)
+        worst = t;
+      written += n;
+      manage_heater();
+    }
+    scratch.sync();
+    benchmarkResult(PSTR("write "), written, millis() - start, worst);
+    SERIAL_PROTOCOLLN("");
+    scratch.remove();
+  }
+}
+#endif
+
 void CardReader::write_command(char *buf)
 {
   char* begin = buf;
   char* npos = 0;
-  char* end = buf + strlen(buf) - 1;
+  char* end = buf + strlen(buf);
 
-  file.writeError = false;
+  SdFile &out = writeFile();
+  out.writeError = false;
   if((npos = strchr(buf, 'N')) != NULL)
   {
     begin = strchr(npos, ' ') + 1;
-    end = strchr(npos, '*') - 1;
+    end = strchr(npos, '*');
+  }
+  // the line break is written after the line, not into buf: the next queued command may follow right after it
+  static const char newline[] = "\r\n";
+#ifdef SD_WRITE_BEHIND
+  // only whole blocks go to the card
+  for(uint8_t part = 0; part < 2; part++)
+  {
+    const char *from = part ? newline : begin;
+    uint16_t len = part ? 2 : end - begin;
+    while(len)
+    {
+      uint16_t n = min(len, sizeof(writeBuf) - writeFill);
+      memcpy(writeBuf + writeFill, from, n);
+      from += n;
+      len -= n;
+      writeFill += n;
+      if(writeFill == sizeof(writeBuf))
+      {
+        out.writeBlockRun(writeBuf);
+        writeFill = 0;
+      }
+    }
   }
-  end[1] = '\r';
-  end[2] = '\n';
-  end[3] = '\0';
-  file.write(begin);
-  if (file.writeError)
+#else
+  out.write(begin, end - begin);
+  out.write(newline, 2);
+#endif
+  if (out.writeError)
   {
     SERIAL_ERROR_START;
     SERIAL_ERRORLNPGM(MSG_SD_ERR_WRITE_TO_FILE);
@@ -491,12 +1685,20 @@ void CardReader::checkautostart(bool force)
   {
     if(!autostart_stilltocheck)
       return;
+    #ifdef FAST_BOOT
+    if(initPending) // wait for the card started from setup()
+      return;
+    #endif
     if(autostart_atmillis<millis())
       return;
   }
   autostart_stilltocheck=false;
   if(!cardOK)
   {
+    #ifdef FAST_BOOT
+    if(!force) // the card did not come up from setup(), don't stall the loop on it again
+      return;
+    #endif
     initsd();
     if(!cardOK) //fail
       return;
@@ -535,12 +1737,35 @@ void CardReader::checkautostart(bool force)
     lastnr++;
 }
 
-void CardReader::closefile(bool store_location)
+void CardReader::closeSaveFile()
 {
-  file.sync();
-  file.close();
+  #ifdef SD_WRITE_BEHIND
+  if(saving && writeFill)
+  {
+    writeFile().write(writeBuf, writeFill);
+    writeFill = 0;
+  }
+  //a file allocated for its announced size may have come out shorter
+  if(saving && writeFile().curPosition() < writeFile().fileSize())
+    writeFile().truncate(writeFile().curPosition());
+  #endif
+  writeFile().sync();
+  writeFile().close();
   saving = false; 
   logging = false;
+}
+
+void CardReader::closefile(bool store_location)
+{
+  #ifdef SD_BACKGROUND_UPLOAD
+  file.close(); //an upload goes on until M29
+  #else
+  closeSaveFile();
+  #endif
+  #ifdef SD_JOB_QUEUE
+  queueActive = false; //a stopped print stops the queue
+  queueState = QUEUE_IDLE;
+  #endif
   
   if(store_location)
   {
@@ -552,25 +1777,86 @@ void CardReader::closefile(bool store_location)
   
 }
 
+#ifdef SD_NAME_CACHE
+//take the name of file nr from the cache and make it the most recently used
+bool CardReader::cachedFilename(uint8_t nr)
+{
+  for(uint8_t i = 0; i < nameCacheUsed; i++)
+  {
+    if(nameCache[i].nr != nr)
+      continue;
+    sd_name_t e = nameCache[i];
+    memmove(&nameCache[1], &nameCache[0], i * sizeof(sd_name_t));
+    nameCache[0] = e;
+    filenameIsDir = e.isDir;
+    strcpy(filename, e.filename);
+    strcpy(longFilename, e.longFilename);
+    return true;
+  }
+  return false;
+}
+
+//remember the name just read for file nr, in place of the least recently used one
+void CardReader::cacheFilename(uint8_t nr)
+{
+  if(nameCacheUsed < SD_NAME_CACHE)
+    nameCacheUsed++;
+  memmove(&nameCache[1], &nameCache[0], (nameCacheUsed - 1) * sizeof(sd_name_t));
+  nameCache[0].nr = nr;
+  nameCache[0].isDir = filenameIsDir;
+  strcpy(nameCache[0].filename, filename);
+  strncpy(nameCache[0].longFilename, longFilename, LONG_FILENAME_LENGTH - 1);
+  nameCache[0].longFilename[LONG_FILENAME_LENGTH - 1] = '\0';
+}
+#endif
+
 void CardReader::getfilename(const uint8_t nr)
 {
   curDir=&workDir;
+#ifdef SD_NAME_CACHE
+  if(cachedFilename(nr))
+    return;
+#endif
+#ifdef SD_DIR_INDEX
+  if(nr < dirIndexCount)
+  {
+    dir_t p;
+    if(readIndexEntry(*curDir, nr, p))
+    {
+      filenameIsDir=DIR_IS_SUBDIR(&p);
+      createFilename(filename,p);
+      #ifdef SD_NAME_CACHE
+      cacheFilename(nr);
+      #endif
+      return;
+    }
+    invalidateDirIndex(); //the directory changed, scan it the slow way
+  }
+#endif
   lsAction=LS_GetFilename;
   nrFiles=nr;
   curDir->rewind();
   lsDive("",*curDir);
-  
+#ifdef SD_NAME_CACHE
+  cacheFilename(nr);
+#endif
 }
 
 uint16_t CardReader::getnrfilenames()
 {
   curDir=&workDir;
+#ifdef SD_DIR_INDEX
+  if(dirIndexCount < 0)
+    indexDir(*curDir);
+  return dirIndexFiles;
+#else
   lsAction=LS_Count;
   nrFiles=0;
   curDir->rewind();
   lsDive("",*curDir);
   //SERIAL_ECHOLN(nrFiles);
   return nrFiles;
+#endif
 }
 
 void CardReader::chdir(const char * relpath)
@@ -595,6 +1881,7 @@ void CardReader::chdir(const char * relpath)
       workDirParents[0]=*parent;
     }
     workDir=newfile;
+    invalidateDirIndex();
   }
 }
 
@@ -607,6 +1894,7 @@ void CardReader::updir()
     int d;
     for (int d = 0; d < workDirDepth; d++)
       workDirParents[d] = workDirParents[d+1];
+    invalidateDirIndex();
   }
 }
 
@@ -618,7 +1906,17 @@ void CardReader::printingHasFinished()
     {
       file.close();
       file_subcall_ctr--;
-      openFile(filenames[file_subcall_ctr],true,true);
+      file=filesParent[file_subcall_ctr]; //still open, no need to look it up again
+      filesize = file.fileSize();
+      #ifdef POWER_LOSS_RECOVERY
+      journalBlock = 0; //the journal is started again for this file
+      #endif
+      #ifdef SD_CLUSTER_RUN_CACHE
+      file.cacheClusterRuns();
+      #endif
+      #ifdef SD_BINARY_JOB
+      binaryjob = filesBinary[file_subcall_ctr];
+      #endif
       setIndex(filespos[file_subcall_ctr]);
       startFileprint();
     }
@@ -627,6 +1925,9 @@ void CardReader::printingHasFinished()
       quickStop();
       file.close();
       sdprinting = false;
+      #ifdef POWER_LOSS_RECOVERY
+      writeJournal(NULL); //nothing left to resume
+      #endif
       if(SD_FINISHED_STEPPERRELEASE)
       {
           //finishAndDisableSteppers();
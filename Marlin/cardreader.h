@@ -5,27 +5,135 @@
 
 #define MAX_DIR_DEPTH 10
 
+#ifdef SD_BINARY_JOB
+// Binary job file: a header of "MBJ1" and its uint16 size, followed by records.
+// All values are little endian.
+#define SD_JOB_MOVE 1  //absolute move to pos[] in µm, feedrate in mm/min (0 keeps the current one)
+#define SD_JOB_GCODE 2 //uint8 length and that many characters of a G-code line, without comment
+typedef struct {
+  uint8_t type;
+  int32_t pos[NUM_AXIS];
+  uint16_t feedrate;
+} __attribute__((packed)) sd_job_move_t;
+#endif
+
+#ifdef POWER_LOSS_RECOVERY
+// Block 0 of POWER_LOSS_FILE, block 1 holds the absolute path of the printed file
+#define RECOVERY_MAGIC 0x31524C50UL //"PLR1"
+#define RECOVERY_RELATIVE 1   //G91
+#define RECOVERY_RELATIVE_E 2 //M83
+typedef struct {
+  uint32_t magic; //RECOVERY_MAGIC, 0 while there is nothing to resume
+  uint32_t sdpos; //file position after the last command the stepper has run the moves of
+  float pos[NUM_AXIS]; //current_position after that command
+  float feedrate; //mm/min
+  int16_t hotendTemp[EXTRUDERS];
+  int16_t bedTemp;
+  int16_t feedmultiply;
+  int16_t extrudemultiply;
+  uint8_t fanSpeed;
+  uint8_t activeExtruder;
+  uint8_t flags; //RECOVERY_RELATIVE, RECOVERY_RELATIVE_E
+} __attribute__((packed)) recovery_t;
+#endif
+
+#ifdef SD_TELEMETRY
+// A record of SD_TELEMETRY_FILE, TELEMETRY_PER_BLOCK to a block. seq counts the records from 1 since
+// the file was created and fixes where a record is: block ((seq - 1) / TELEMETRY_PER_BLOCK) % SD_TELEMETRY_BLOCKS.
+// A slot with seq 0 is unused. All values are little endian.
+#define TELEMETRY_PER_BLOCK 16
+#define TELEMETRY_SD_PRINTING 1
+#define TELEMETRY_STOPPED 2
+typedef struct {
+  uint32_t seq;
+  uint32_t ms;          //millis() when the record was taken
+  int16_t temp[4];      //hotends and then the bed in 1/10 degree C, 0 for hotends that are not there
+  uint8_t power[4];     //heater PWM 0-127 in the same order
+  int16_t pos[3];       //planned X Y Z in 1/10 mm
+  int16_t feedmultiply; //percent
+  uint8_t planned;      //moves in the planner queue
+  uint8_t commands;     //commands in the command buffer
+  uint8_t fan;          //fanSpeed
+  uint8_t flags;        //TELEMETRY_SD_PRINTING, TELEMETRY_STOPPED
+} __attribute__((packed)) telemetry_t;
+#endif
+
+#if defined(SDCARD_SORT_ALPHA) || defined(SDCARD_SORT_NEWEST_FIRST)
+  #define SDCARD_SORT
+  #ifndef SD_DIR_INDEX
+    #error "SDCARD_SORT_ALPHA and SDCARD_SORT_NEWEST_FIRST need SD_DIR_INDEX"
+  #endif
+#endif
+
 #include "SdFile.h"
+#ifdef SD_NAME_CACHE
+// A name the LCD SD menu showed, by its number in the working directory
+typedef struct {
+  uint8_t nr;
+  bool isDir;
+  char filename[13];
+  char longFilename[LONG_FILENAME_LENGTH];
+} sd_name_t;
+#endif
+#ifdef SD_FILE_HEADER
+// Values from the comments at the start of a file
+#define SD_HEADER_BOUNDS 0x0f   //a bit for each of bounds[]
+#define SD_HEADER_TIME 0x10
+#define SD_HEADER_FILAMENT 0x20
+typedef struct {
+  uint32_t cluster; //first cluster and size of the file, cluster 0 for an unused cache entry
+  uint32_t size;
+  uint32_t printSeconds; //;TIME:
+  uint32_t filamentMm; //;Filament used: in m
+  float bounds[4]; //;MINX: ;MAXX: ;MINY: ;MAXY:
+  uint8_t found; //SD_HEADER_ bits of the values that were given
+} sd_header_t;
+#endif
+#ifdef SD_EXECUTED_POSITION
+#include "planner.h"
+#endif
 enum LsAction {LS_SerialPrint,LS_Count,LS_GetFilename};
+
+// Where the walk of lsDive() left a directory above the one it is in
+typedef struct {
+  uint32_t cluster; //first cluster of the directory, it is reopened from that
+  uint32_t pos;     //lsWalk(): position after the entry of the subdirectory, lsSorted(): index of the next entry
+  uint8_t pathLen;  //length of the path prefix in the directory
+} ls_level_t;
 class CardReader
 {
 public:
   CardReader();
   
   void initsd();
+  #ifdef FAST_BOOT
+  void initsdStart();
+  void initsdPoll();
+  #endif
   void write_command(char *buf);
   //files auto[0-9].g on the sd card are performed in a row
   //this is to delay autostart and hence the initialisaiton of the sd card to some seconds after the normal init, so the device is available quick after a reset
 
   void checkautostart(bool x); 
-  void openFile(char* name,bool read,bool replace_current=true);
+  void openFile(char* name,bool read,bool replace_current=true,uint32_t size=0); //size allocates a file to write in one piece
   void openLogFile(char* name);
   void removeFile(char* name);
   void closefile(bool store_location=false);
+  void closeSaveFile();
   void release();
   void startFileprint();
   void pauseSDPrint();
   void getStatus();
+  #ifdef SD_CHECK_CRC
+  void linkStatus();
+  #endif
+  #ifdef SD_LATENCY_HISTOGRAM
+  void latencyReport();
+  void latencyReset();
+  #endif
+  #ifdef SD_BENCHMARK
+  void benchmark(char *name, uint16_t writeKB);
+  #endif
   void printingHasFinished();
 
   void getfilename(const uint8_t nr);
@@ -35,6 +143,11 @@ public:
   
 
   void ls();
+#ifdef SD_LIST_CHUNK
+  void lsContinue(); //list the next SD_LIST_CHUNK files of M20
+  void lsStop();
+  FORCE_INLINE bool lsActive() { return lsJobActive; };
+#endif
   void chdir(const char * relpath);
   void updir();
   void setroot();
@@ -42,42 +155,215 @@ public:
 
   FORCE_INLINE bool isFileOpen() { return file.isOpen(); }
   FORCE_INLINE bool eof() { return sdpos>=filesize ;};
+#ifdef SD_STREAMING_READ
+  FORCE_INLINE int16_t get() {  sdpos = file.curPosition();return file.streamRead();};
+#else
   FORCE_INLINE int16_t get() {  sdpos = file.curPosition();return (int16_t)file.read();};
-  FORCE_INLINE void setIndex(long index) {sdpos = index;file.seekSet(index);};
+#endif
+  uint8_t getLine(char *buf, uint8_t size, char *terminator);
+  int16_t read(void *buf, uint16_t nbyte);
+  int16_t peek();
+  #ifdef SD_BINARY_JOB
+  void openBinaryJob();
+  #endif
+  #ifdef SD_FILE_HEADER
+  bool getPrintBounds(float *bounds); // min X, max X, min Y, max Y of the open file, false if not given
+  #endif
+  #ifdef SD_TELEMETRY
+  bool telemetryAdd(telemetry_t *rec);
+  bool telemetryWrite();
+  FORCE_INLINE bool telemetryFull() { return telemetryFill == TELEMETRY_PER_BLOCK; };
+  void telemetryReport();
+  #endif
+  #ifdef SD_JOB_QUEUE
+  bool queueStart();
+  bool queueNext();
+  #endif
+  #ifdef POWER_LOSS_RECOVERY
+  bool openJournal();
+  bool writeJournal(const recovery_t *state);
+  bool readJournal(recovery_t *state, char *name);
+  #endif
+  FORCE_INLINE uint32_t getIndex() { return sdpos; };
+  FORCE_INLINE void setIndex(long index) {
+    sdpos = index;
+    file.seekSet(index);
+    #ifdef SD_EXECUTED_POSITION
+    plan_sdpos = index; //until a command from there runs
+    #endif
+    #ifdef SD_PRINT_ETA
+    resetProgress();
+    #endif
+  };
+#ifdef SD_PRINT_ETA
+  void updateProgress();
+  void resetProgress();
+  FORCE_INLINE void countMove() { etaMoveCount++; };
+  FORCE_INLINE uint8_t percentDone(){if(!isFileOpen()) return 0; return progressPercent;};
+#else
   FORCE_INLINE uint8_t percentDone(){if(!isFileOpen()) return 0; if(filesize) return sdpos/((filesize+99)/100); else return 0;};
+#endif
   FORCE_INLINE char* getWorkDirName(){workDir.getFilename(filename);return filename;};
 
 public:
   bool saving;
   bool logging;
   bool sdprinting ;  
+  #ifdef SD_BINARY_JOB
+  bool binaryjob; //the open file is a binary job
+  #endif
   bool cardOK ;
+  #ifdef SD_JOB_QUEUE
+  bool queueActive; //the next job of SD_JOB_QUEUE_FILE follows the current print
+  #endif
   char filename[13];
   char longFilename[LONG_FILENAME_LENGTH];
   bool filenameIsDir;
   int lastnr; //last number of the autostart;
+  #ifdef SD_FILE_HEADER
+  sd_header_t header; //of the open file, found is 0 if none is
+  #endif
+  #ifdef SD_PRINT_ETA
+  int32_t etaSeconds; //remaining print time, -1 while unknown
+  uint16_t bytesPerSecond;
+  uint16_t movesPerSecond;
+  #endif
 private:
+  void initsdBegin();
+  void initsdEnd(bool cardInit);
+  #ifdef FAST_BOOT
+  bool initPending; // initsdStart() waits for the card
+  #endif
   SdFile root,*curDir,workDir,workDirParents[MAX_DIR_DEPTH];
   uint16_t workDirDepth;
   Sd2Card card;
   SdVolume volume;
   SdFile file;
+  #ifdef SD_BACKGROUND_UPLOAD
+  SdFile saveFile; //M28/M928 write here while file is printed
+  FORCE_INLINE SdFile &writeFile() { return saveFile; }
+  #else
+  FORCE_INLINE SdFile &writeFile() { return file; }
+  #endif
   #define SD_PROCEDURE_DEPTH 1
   #define MAXPATHNAMELENGTH (13*MAX_DIR_DEPTH+MAX_DIR_DEPTH+1)
   uint8_t file_subcall_ctr;
   uint32_t filespos[SD_PROCEDURE_DEPTH];
-  char filenames[SD_PROCEDURE_DEPTH][MAXPATHNAMELENGTH];
+  SdFile filesParent[SD_PROCEDURE_DEPTH]; //still open, so returning to it needs no path lookup
+  #ifdef SD_BINARY_JOB
+  bool filesBinary[SD_PROCEDURE_DEPTH];
+  #endif
   uint32_t filesize;
   //int16_t n;
   unsigned long autostart_atmillis;
   uint32_t sdpos ;
+  #ifdef SD_PRINT_ETA
+  uint8_t progressPercent;
+  uint32_t etaMoveCount; //moves read from the file
+  uint32_t etaBytes[SD_ETA_SAMPLES]; //file position at each sample
+  uint32_t etaMoves[SD_ETA_SAMPLES]; //etaMoveCount at each sample
+  unsigned long etaTimes[SD_ETA_SAMPLES]; //millis() at each sample
+  uint8_t etaIndex, etaCount;
+  unsigned long etaNextSample;
+  #endif
+  #ifdef POWER_LOSS_RECOVERY
+  uint32_t journalBlock; //first block of POWER_LOSS_FILE, 0 until it has been opened
+  #endif
+  #ifdef SD_TELEMETRY
+  uint32_t telemetryBlock; //first block of SD_TELEMETRY_FILE, 0 until it has been opened
+  bool telemetryTried; //opening failed, not tried again before the card is
+  uint32_t telemetrySeq; //seq of the first record in telemetryBuf
+  uint32_t telemetryWriteNext; //block the open multiple block write continues with
+  telemetry_t telemetryBuf[TELEMETRY_PER_BLOCK]; //the block being filled, unused slots zero
+  uint8_t telemetryFill;
+  uint16_t telemetryDropped; //records lost because the card was not written in time
+  bool openTelemetry();
+  uint32_t telemetryBlockSeq(uint32_t b);
+  #endif
+  #ifdef SD_JOB_QUEUE
+  #define QUEUE_IDLE 0
+  #define QUEUE_JOB 1     //printing the job at queueJobPos
+  #define QUEUE_BETWEEN 2 //printing SD_JOB_QUEUE_BETWEEN
+  uint8_t queueState;
+  uint32_t queueJobPos; //of the line of the job in SD_JOB_QUEUE_FILE
+  bool queuePrint(char *name);
+  bool queueStartNext();
+  void queueMarkDone();
+  #endif
+  #ifdef SD_WRITE_BEHIND
+  uint8_t writeBuf[512]; //next block of the file being written
+  uint16_t writeFill;
+  #endif
 
   bool autostart_stilltocheck; //the sd start is delayed, because otherwise the serial cannot answer fast enought to make contact with the hostsoftware.
   
-  LsAction lsAction; //stored for recursion.
+  LsAction lsAction; //what lsDive() does with the entries
   int16_t nrFiles; //counter for the files in the current directory and recycled as position counter for getting the nrFiles'th name in the directory.
   char* diveDirName;
-  void lsDive(const char *prepend,SdFile parent);
+  void lsDive(const char *prepend,SdFile &dir);
+  //the state of a walk through a directory and its subdirectories
+  struct ls_walk_t {
+    ls_level_t stack[MAX_DIR_DEPTH]; //the directories above the current one
+    uint8_t depth;
+    char path[MAXPATHNAMELENGTH];
+    SdFile sub; //the subdirectory being walked
+    uint32_t pos; //in the current directory when the walk paused
+    bool paused;
+  };
+  void lsWalkStart(ls_walk_t &w, const char *prepend);
+  bool lsWalk(ls_walk_t &w, SdFile &dir, uint8_t entries);
+#ifdef SD_LIST_CHUNK
+  ls_walk_t lsJob; //of M20
+  bool lsJobActive;
+#endif
+#ifdef SD_SUBCALL_CACHE
+  uint16_t subcallHash[SD_SUBCALL_CACHE]; //of the path and the directory it is relative to, 0 when unused
+  SdFile subcallFile[SD_SUBCALL_CACHE]; //opened subroutine files, at position 0
+  uint8_t subcallNext; //entry replaced next
+  uint16_t subcallPathHash(const char *name);
+  bool openCachedSubcall(char *name);
+  void cacheSubcall(char *name);
+  FORCE_INLINE void invalidateSubcalls() { memset(subcallHash, 0, sizeof(subcallHash)); };
+#else
+  FORCE_INLINE void invalidateSubcalls() {};
+#endif
+#ifdef SD_DIR_INDEX
+  int16_t dirIndexCount; //entries in the index, -1 once it has to be rebuilt
+  uint16_t dirIndexFiles; //files in the directory the index was built for
+  uint16_t dirIndexPos[SD_DIR_INDEX]; //first directory entry of each file, including its long name
+  uint8_t dirIndexHash[SD_DIR_INDEX]; //checksum of the short name, to detect a changed directory
+  void indexDir(SdFile &dir);
+  bool readIndexEntry(SdFile &dir, uint8_t nr, dir_t &p);
+  #ifdef SDCARD_SORT
+  void sortDirIndex(SdFile &dir);
+  void lsSorted(SdFile &dir);
+  #endif
+#endif
+#ifdef SD_FILE_HEADER
+  sd_header_t headerCache[SD_FILE_HEADER];
+  uint8_t headerNext; //entry replaced next
+  void readHeader();
+  void scanHeader();
+  FORCE_INLINE void invalidateHeaders() { memset(headerCache, 0, sizeof(headerCache)); };
+#else
+  FORCE_INLINE void invalidateHeaders() {};
+#endif
+#ifdef SD_NAME_CACHE
+  sd_name_t nameCache[SD_NAME_CACHE]; //most recently used first
+  uint8_t nameCacheUsed;
+  bool cachedFilename(uint8_t nr);
+  void cacheFilename(uint8_t nr);
+#endif
+  //the working directory changed or its listing may have
+  FORCE_INLINE void invalidateDirIndex()
+  {
+    #ifdef SD_DIR_INDEX
+    dirIndexCount = -1;
+    #endif
+    #ifdef SD_NAME_CACHE
+    nameCacheUsed = 0;
+    #endif
+  };
 };
 extern CardReader card;
 #define IS_SD_PRINTING (card.sdprinting)
@@ -1,9 +1,13 @@
 #include "Configuration.h"
 
 #ifdef DIGIPOT_I2C
+#ifdef TWI_QUEUE
+#include "twi_queue.h"
+#else
 #include "Stream.h"
 #include "utility/twi.h"
 #include "Wire.h"
+#endif
 
 // Settings for the I2C based DIGIPOT (MCP4451) on Azteeg X3 Pro
 #define DIGIPOT_I2C_FACTOR 106.7
@@ -15,14 +19,45 @@ static byte current_to_wiper( float current ){
 
 static void i2c_send(byte addr, byte a, byte b)
 {
+#ifdef TWI_QUEUE
+    const uint8_t data[2] = { a, b };
+    twi_queue_write(addr, data, 2);
+#else
 	Wire.beginTransmission(addr);
     Wire.write(a);
     Wire.write(b);
     Wire.endTransmission();
+#endif
 }
 
+#ifdef IDLE_CURRENT_PERCENT
+static float run_current[DIGIPOT_I2C_NUM_CHANNELS]; // as last set, idle channels get IDLE_CURRENT_PERCENT of it
+static uint8_t idle_channels;
+
+static void digipot_i2c_write_current( int channel, float current );
+
+void digipot_i2c_set_current( int channel, float current )
+{
+    run_current[channel] = current;
+    if(idle_channels & (1<<channel))
+        current = current * IDLE_CURRENT_PERCENT / 100;
+    digipot_i2c_write_current(channel, current);
+}
+
+void digipot_i2c_set_idle( uint8_t channels )
+{
+    uint8_t changed = channels ^ idle_channels;
+    idle_channels = channels;
+    for(int i=0;i<DIGIPOT_I2C_NUM_CHANNELS;i++)
+        if(changed & (1<<i))
+            digipot_i2c_set_current(i, run_current[i]);
+}
+
+static void digipot_i2c_write_current( int channel, float current )
+#else
 // This is for the MCP4451 I2C based digipot
 void digipot_i2c_set_current( int channel, float current )
+#endif
 {
     current = min( (float) max( current, 0.0f ), DIGIPOT_I2C_MAX_CURRENT);
     // these addresses are specific to Azteeg X3 Pro, can be set to others,
@@ -45,7 +80,11 @@ void digipot_i2c_set_current( int channel, float current )
 void digipot_i2c_init()
 {
     const float digipot_motor_current[] = DIGIPOT_I2C_MOTOR_CURRENTS;
+#ifdef TWI_QUEUE
+    twi_queue_init();
+#else
     Wire.begin();
+#endif
     // setup initial currents as defined in Configuration_adv.h
     for(int i=0;i<=sizeof(digipot_motor_current)/sizeof(float);i++) {
         digipot_i2c_set_current(i, digipot_motor_current[i]);
@@ -168,6 +168,42 @@ static void lcd_printPGM(const char* str)
 }
 
 
+#ifdef DOGLCD_STATUS_DIRTY_CHECK
+// Whether the values shown by lcd_implementation_status_screen() changed since the last call,
+// judged by a hash of them as they are displayed. The status message forces its own redraw.
+static bool lcd_implementation_status_changed()
+{
+ static uint16_t last_hash = 0;
+ uint16_t hash = 0;
+ #define STATUS_HASH(v) hash = hash * 31 + (uint16_t)(v)
+ for (uint8_t e = 0; e < EXTRUDERS; e++)
+   {
+	STATUS_HASH(int(degTargetHotend(e) + 0.5));
+	STATUS_HASH(int(degHotend(e) + 0.5));
+	STATUS_HASH(isHeatingHotend(e));
+   }
+ STATUS_HASH(int(degTargetBed() + 0.5));
+ STATUS_HASH(int(degBed() + 0.5));
+ STATUS_HASH(isHeatingBed());
+ STATUS_HASH(fanSpeed);
+ STATUS_HASH(lround(current_position[X_AXIS] * 10));
+ STATUS_HASH(lround(current_position[Y_AXIS] * 10));
+ STATUS_HASH(lround(current_position[Z_AXIS] * 10));
+ STATUS_HASH(feedmultiply);
+ #ifdef SDSUPPORT
+ STATUS_HASH(IS_SD_PRINTING ? (71 * card.percentDone()) / 100 : 0xff);
+  #ifdef SD_PRINT_ETA
+ STATUS_HASH(card.etaSeconds / 60);
+  #endif
+ STATUS_HASH(starttime != 0 ? millis()/60000 - starttime/60000 : 0xffff);
+ #endif
+ #undef STATUS_HASH
+ bool changed = hash != last_hash;
+ last_hash = hash;
+ return changed;
+}
+#endif
+
 static void lcd_implementation_status_screen()
 {
 
@@ -176,7 +212,7 @@ static void lcd_implementation_status_screen()
  u8g.setColorIndex(1);	// black on white
  
  // Symbols menu graphics, animated fan
- if ((blink % 2) &&  fanSpeed )	u8g.drawBitmapP(9,1,STATUS_SCREENBYTEWIDTH,STATUS_SCREENHEIGHT,status_screen0_bmp);
+ if ((blink % 2) &&  STATUS_FAN )	u8g.drawBitmapP(9,1,STATUS_SCREENBYTEWIDTH,STATUS_SCREENHEIGHT,status_screen0_bmp);
 	else u8g.drawBitmapP(9,1,STATUS_SCREENBYTEWIDTH,STATUS_SCREENHEIGHT,status_screen1_bmp);
  
  #ifdef SDSUPPORT
@@ -191,19 +227,33 @@ static void lcd_implementation_status_screen()
  // SD Card Progress bar and clock
  u8g.setFont(FONT_STATUSMENU);
  
- if (IS_SD_PRINTING)
+ if (STATUS_SD_PRINTING)
    {
 	// Progress bar
-	u8g.drawBox(55,50, (unsigned int)( (71 * card.percentDone())/100) ,2);
+	u8g.drawBox(55,50, (unsigned int)( (71 * STATUS_SD_PERCENT)/100) ,2);
    }
     else {
 			// do nothing
 		 }
  
  u8g.setPrintPos(80,47);
- if(starttime != 0)
+ #if defined(SDSUPPORT) && defined(SD_PRINT_ETA)
+ if(STATUS_SD_PRINTING && STATUS_ETA_MINUTES >= 0)
+    {
+        //remaining time instead of the time printed so far
+        uint16_t time = STATUS_ETA_MINUTES;
+
+		u8g.print('-');
+		u8g.print(itostr2(time/60));
+		u8g.print(':');
+		u8g.print(itostr2(time%60));
+    }
+ else
+ #endif
+   {
+ uint16_t time = STATUS_PRINT_MINUTES;
+ if(time != 0xFFFF)
     {
-        uint16_t time = millis()/60000 - starttime/60000;
 
 		u8g.print(itostr2(time/60));
 		u8g.print(':');
@@ -211,17 +261,18 @@ static void lcd_implementation_status_screen()
     }else{
 			lcd_printPGM(PSTR("--:--"));
 		 }
+   }
  #endif
  
  // Extruder 1
  u8g.setFont(FONT_STATUSMENU);
  u8g.setPrintPos(6,6);
- u8g.print(itostr3(int(degTargetHotend(0) + 0.5)));
+ u8g.print(itostr3(STATUS_HOTEND_TARGET(0)));
  lcd_printPGM(PSTR(LCD_STR_DEGREE " "));
  u8g.setPrintPos(6,27);
- u8g.print(itostr3(int(degHotend(0) + 0.5)));
+ u8g.print(itostr3(STATUS_HOTEND(0)));
  lcd_printPGM(PSTR(LCD_STR_DEGREE " "));
- if (!isHeatingHotend(0)) u8g.drawBox(13,17,2,2);
+ if (!STATUS_HOTEND_HEATING(0)) u8g.drawBox(13,17,2,2);
 	else
 		{
 		 u8g.setColorIndex(0);	// white on black
@@ -233,12 +284,12 @@ static void lcd_implementation_status_screen()
  u8g.setFont(FONT_STATUSMENU);
  #if EXTRUDERS > 1
  u8g.setPrintPos(31,6);
- u8g.print(itostr3(int(degTargetHotend(1) + 0.5)));
+ u8g.print(itostr3(STATUS_HOTEND_TARGET(1)));
  lcd_printPGM(PSTR(LCD_STR_DEGREE " "));
  u8g.setPrintPos(31,27);
- u8g.print(itostr3(int(degHotend(1) + 0.5)));
+ u8g.print(itostr3(STATUS_HOTEND(1)));
  lcd_printPGM(PSTR(LCD_STR_DEGREE " "));
- if (!isHeatingHotend(1)) u8g.drawBox(38,17,2,2);
+ if (!STATUS_HOTEND_HEATING(1)) u8g.drawBox(38,17,2,2);
 	else
 		{
 		 u8g.setColorIndex(0);	// white on black
@@ -254,12 +305,12 @@ static void lcd_implementation_status_screen()
  u8g.setFont(FONT_STATUSMENU);
  # if EXTRUDERS > 2
  u8g.setPrintPos(55,6);
- u8g.print(itostr3(int(degTargetHotend(2) + 0.5)));
+ u8g.print(itostr3(STATUS_HOTEND_TARGET(2)));
  lcd_printPGM(PSTR(LCD_STR_DEGREE " "));
  u8g.setPrintPos(55,27);
- u8g.print(itostr3(int(degHotend(2) + 0.5)));
+ u8g.print(itostr3(STATUS_HOTEND(2)));
  lcd_printPGM(PSTR(LCD_STR_DEGREE " "));
- if (!isHeatingHotend(2)) u8g.drawBox(62,17,2,2);
+ if (!STATUS_HOTEND_HEATING(2)) u8g.drawBox(62,17,2,2);
 	else
 		{
 		 u8g.setColorIndex(0);	// white on black
@@ -274,12 +325,12 @@ static void lcd_implementation_status_screen()
  // Heatbed
  u8g.setFont(FONT_STATUSMENU);
  u8g.setPrintPos(81,6);
- u8g.print(itostr3(int(degTargetBed() + 0.5)));
+ u8g.print(itostr3(STATUS_BED_TARGET));
  lcd_printPGM(PSTR(LCD_STR_DEGREE " "));
  u8g.setPrintPos(81,27);
- u8g.print(itostr3(int(degBed() + 0.5)));
+ u8g.print(itostr3(STATUS_BED));
  lcd_printPGM(PSTR(LCD_STR_DEGREE " "));
- if (!isHeatingBed()) u8g.drawBox(88,18,2,2);
+ if (!STATUS_BED_HEATING) u8g.drawBox(88,18,2,2);
 	else
 		{
 		 u8g.setColorIndex(0);	// white on black
@@ -291,7 +342,7 @@ static void lcd_implementation_status_screen()
  u8g.setFont(FONT_STATUSMENU);
  u8g.setPrintPos(104,27);
  #if defined(FAN_PIN) && FAN_PIN > -1
- u8g.print(itostr3(int((fanSpeed*100)/256 + 1)));
+ u8g.print(itostr3(int((STATUS_FAN*100)/256 + 1)));
  u8g.print("%");
  #else
  u8g.print("---");
@@ -307,19 +358,19 @@ static void lcd_implementation_status_screen()
  u8g.drawPixel(8,33);
  u8g.drawPixel(8,35);
  u8g.setPrintPos(10,37);
- u8g.print(ftostr31ns(current_position[X_AXIS]));
+ u8g.print(ftostr31ns(STATUS_POSITION(X_AXIS)));
  u8g.setPrintPos(43,37);
  lcd_printPGM(PSTR("Y"));
  u8g.drawPixel(49,33);
  u8g.drawPixel(49,35);
  u8g.setPrintPos(51,37);
- u8g.print(ftostr31ns(current_position[Y_AXIS]));
+ u8g.print(ftostr31ns(STATUS_POSITION(Y_AXIS)));
  u8g.setPrintPos(83,37);
  u8g.print("Z");
  u8g.drawPixel(89,33);
  u8g.drawPixel(89,35);
  u8g.setPrintPos(91,37);
- u8g.print(ftostr31(current_position[Z_AXIS]));
+ u8g.print(ftostr31(STATUS_POSITION(Z_AXIS)));
  u8g.setColorIndex(1);	// black on white
  
  // Feedrate
@@ -328,7 +379,7 @@ static void lcd_implementation_status_screen()
  u8g.print(LCD_STR_FEEDRATE[0]);
  u8g.setFont(FONT_STATUSMENU);
  u8g.setPrintPos(12,48);
- u8g.print(itostr3(feedmultiply));
+ u8g.print(itostr3(STATUS_FEEDMULTIPLY));
  u8g.print('%');
 
  // Status line
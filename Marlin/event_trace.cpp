@@ -0,0 +1,95 @@
+#include "Marlin.h"
+
+#ifdef EVENT_TRACE
+#include "event_trace.h"
+
+#if EVENT_TRACE_SIZE < 8 || EVENT_TRACE_SIZE > 255
+  #error "EVENT_TRACE_SIZE must be 8 to 255"
+#endif
+
+//===========================================================================
+//=============================private variables  ============================
+//===========================================================================
+
+// 7 bytes on AVR; this is also the record layout of the M822 dump
+typedef struct {
+  unsigned long us;
+  uint8_t event;
+  uint16_t arg;
+} trace_record_t;
+
+#define TRACE_RUNNING  0 // records all the time
+#define TRACE_ARMED    1 // stops some records after the next TRACE_STEPPER_IDLE
+#define TRACE_STOPPING 2 // trace_left records to go
+#define TRACE_STOPPED  3
+
+static trace_record_t trace_ring[EVENT_TRACE_SIZE];
+static uint8_t trace_head = 0;   // next record to write
+static uint8_t trace_count = 0;
+static uint8_t trace_state = TRACE_RUNNING;
+static uint8_t trace_left;
+
+//===========================================================================
+//=============================functions         ============================
+//===========================================================================
+
+// A record is a few stores, so the interrupts are only held off for as long as those take. The time is
+// read with them held off too, so an interrupt recording in between can't leave the ring out of order.
+void trace_event(uint8_t event, uint16_t arg)
+{
+  CRITICAL_SECTION_START;
+  if(trace_state != TRACE_STOPPED)
+  {
+    trace_record_t *r = &trace_ring[trace_head];
+    r->us = micros();
+    r->event = event;
+    r->arg = arg;
+    trace_head = trace_head + 1 == EVENT_TRACE_SIZE ? 0 : trace_head + 1;
+    if(trace_count < EVENT_TRACE_SIZE)
+      trace_count++;
+    if(trace_state == TRACE_ARMED && event == TRACE_STEPPER_IDLE)
+    {
+      trace_state = TRACE_STOPPING;
+      trace_left = EVENT_TRACE_SIZE / 4;
+    }
+    else if(trace_state == TRACE_STOPPING && --trace_left == 0)
+      trace_state = TRACE_STOPPED;
+  }
+  CRITICAL_SECTION_END;
+}
+
+void trace_dump()
+{
+  // nothing is recorded while the ring goes out, the records of the dump itself would overwrite it
+  uint8_t state;
+  {
+    CRITICAL_SECTION_START;
+    state = trace_state;
+    trace_state = TRACE_STOPPED;
+    CRITICAL_SECTION_END;
+  }
+  SERIAL_PROTOCOLPGM("event_trace:");
+  SERIAL_PROTOCOL((int)trace_count);
+  SERIAL_PROTOCOLPGM(",");
+  SERIAL_PROTOCOL((int)sizeof(trace_record_t));
+  SERIAL_PROTOCOLPGM(",");
+  SERIAL_PROTOCOLLN((int)(state == TRACE_STOPPED));
+  uint8_t i = trace_count < EVENT_TRACE_SIZE ? 0 : trace_head;
+  for(uint8_t n = 0; n < trace_count; n++) {
+    const uint8_t *p = (const uint8_t *)&trace_ring[i];
+    for(uint8_t b = 0; b < sizeof(trace_record_t); b++)
+      MYSERIAL.write(p[b]);
+    i = i + 1 == EVENT_TRACE_SIZE ? 0 : i + 1;
+  }
+  SERIAL_PROTOCOLLN("");
+  trace_state = state; // a single byte, the interrupts see it whole
+}
+
+void trace_clear(bool freeze)
+{
+  CRITICAL_SECTION_START;
+  trace_head = trace_count = 0;
+  trace_state = freeze ? TRACE_ARMED : TRACE_RUNNING;
+  CRITICAL_SECTION_END;
+}
+#endif //EVENT_TRACE
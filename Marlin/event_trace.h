@@ -0,0 +1,47 @@
+#ifndef EVENT_TRACE_H
+#define EVENT_TRACE_H
+
+#include "Marlin.h"
+
+#ifdef EVENT_TRACE
+  // The events and what their arg is
+  #define TRACE_PLAN_LINE    1 // plan_buffer_line() queued a block: moves planned
+  #define TRACE_PLAN_RECALC  2 // planner_recalculate() is done: us it took
+  #define TRACE_BLOCK_START  3 // the stepper took the next block: moves planned
+  #define TRACE_BLOCK_DONE   4 // plan_discard_current_block(): moves planned
+  #define TRACE_STEPPER_IDLE 5 // the stepper found no block to run: blocks queued but being replanned
+  #define TRACE_SD_READ      6 // Sd2Card::readBlock() is done: us it took
+  #define TRACE_HOST_LINE    7 // get_command() queued a line from the host: commands queued
+  #define TRACE_SD_LINE      8 // get_command() queued a line from SD: commands queued
+  #define TRACE_LCD_UPDATE   9 // lcd_update() drew the screen or a slice of it: us it took
+
+  // Put a record in the ring, from the main loop or an interrupt
+  void trace_event(uint8_t event, uint16_t arg);
+  // Text header "event_trace:<records>,<bytes per record>,<1 when it froze>", then the records
+  // (micros() as unsigned long, event as uint8_t, arg as uint16_t, little endian), oldest first,
+  // then a newline
+  void trace_dump();
+  // Empty the ring and record again; with freeze the ring stops EVENT_TRACE_SIZE/4 records after
+  // the next TRACE_STEPPER_IDLE, keeping what led up to the stepper running dry and what came after
+  void trace_clear(bool freeze);
+
+  // Records event at the end of the scope with the us it took as arg
+  class TraceSpan {
+   public:
+    explicit TraceSpan(uint8_t event) : event_(event), t0_(micros()) {}
+    ~TraceSpan() {
+      unsigned long us = micros() - t0_;
+      trace_event(event_, us > 0xFFFF ? 0xFFFF : us);
+    }
+   private:
+    uint8_t event_;
+    unsigned long t0_;
+  };
+  #define TRACE_EVENT(event, arg) trace_event(event, arg)
+  #define TRACE_SPAN(event) TraceSpan traceSpan(event)
+#else
+  #define TRACE_EVENT(event, arg)
+  #define TRACE_SPAN(event)
+#endif
+
+#endif
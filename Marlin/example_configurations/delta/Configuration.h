@@ -103,6 +103,24 @@
 // and processor overload (too many expensive sqrt calls).
 #define DELTA_SEGMENTS_PER_SECOND 200
 
+// Cut moves into segments of at most this length (mm) instead, with DELTA_SEGMENTS_PER_SECOND
+// (M665 S) only as the upper bound of the segment rate on fast moves. Slow moves then get no more
+// segments than their length needs. M801 with PLANNER_PROFILE shows what rate the planner manages.
+//#define DELTA_SEGMENT_MM 1.0
+
+// Compute the tower positions of this many segments at once and queue them with a single
+// planner recalculation instead of one per segment.
+#define DELTA_SEGMENT_BATCH 4
+
+// For segments shorter than this (mm) only every other segment gets exact tower positions,
+// the ones in between are interpolated. Saves up to half of the sqrt calls on short moves.
+//#define DELTA_SEGMENT_INTERPOLATION_MM 1.0
+
+// Compute the tower positions with a square root made of multiplies only (two Newton steps on an
+// approximate inverse square root), accurate to about 1 um at these rod lengths but much faster
+// than sqrt() on AVR.
+//#define DELTA_FAST_SQRT
+
 // NOTE NB all values for DELTA_* values MOUST be floating point, so always have a decimal point in them
 
 // Center-to-center distance of the holes in the diagonal push rods.
@@ -372,6 +390,15 @@ const bool Z_MAX_ENDSTOP_INVERTING = true; // set to true to invert the logic of
   #define Z_RAISE_BEFORE_PROBING 15    //How much the extruder will be raised before traveling to the first probing point.
   #define Z_RAISE_BETWEEN_PROBINGS 5  //How much the extruder will be raised when traveling from between next probing points
 
+  // G33 probes the bed centre and DELTA_CALIBRATION_POINTS points on a circle of DELTA_CALIBRATION_RADIUS
+  // (probe position, mm) and fits the endstop adjustments, delta_radius and the Y and Z tower angles
+  // to a flat bed. The result is applied like M665/M666 and the printer homed again; M500 keeps it.
+  //#define DELTA_AUTO_CALIBRATION
+  #ifdef DELTA_AUTO_CALIBRATION
+    #define DELTA_CALIBRATION_RADIUS 70.0
+    #define DELTA_CALIBRATION_POINTS 6
+  #endif
+
 
   //If defined, the Probe servo will be turned on only during movement and then turned off to avoid jerk
   //The value is the delay to turn the servo off after powered on - depends on the servo speed; 300ms is good value, but you can try lower it.
@@ -216,6 +216,10 @@
 #define X_HOME_RETRACT_MM 5 
 #define Y_HOME_RETRACT_MM 5 
 #define Z_HOME_RETRACT_MM 5 // deltas need the same for all three axis
+//and the slow bump runs at the homing feedrate divided by this:
+#define X_HOME_BUMP_DIVISOR 10
+#define Y_HOME_BUMP_DIVISOR 10
+#define Z_HOME_BUMP_DIVISOR 10
 
 //#define QUICK_HOME  //if this is defined, if both x and y are to be homed, a diagonal move will be performed initially.
 
@@ -310,10 +314,7 @@
   #define BABYSTEP_XY  //not only z, but also XY in the menu. more clutter, more functions
   #define BABYSTEP_INVERT_Z false  //true for inverse movements in Z
   #define BABYSTEP_Z_MULTIPLICATOR 2 //faster z movements
-  
-  #ifdef COREXY
-    #error BABYSTEPPING not implemented for COREXY yet.
-  #endif
+  #define BABYSTEP_RATE 1000 //babysteps per second and axis, taken by the stepper interrupt between the steps of the moves
 
   #ifdef DELTA
     #ifdef BABYSTEP_XY
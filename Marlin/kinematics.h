@@ -0,0 +1,127 @@
+#ifndef KINEMATICS_H
+#define KINEMATICS_H
+
+#include "Marlin.h"
+
+// The kinematics of the machine, picked at compile time. The motion code calls these functions instead
+// of testing DELTA or COREXY itself, and each machine gets its own inline version, so the planner and
+// the stepper interrupt are compiled for the machine with nothing left to decide at run time. Another
+// kinematics is added by giving it a branch in each function here.
+//
+// KINEMATICS_SEGMENTED:  a straight move is not straight for the motors, prepare_move() cuts it into
+//                        segments and plans the motor position of each
+// KINEMATICS_COUPLED_XY: the X and Y motors (A and B) both move for a move along X or Y alone
+
+#if defined(DELTA)
+  #define KINEMATICS_SEGMENTED
+  #define KINEMATICS_SEGMENTS_PER_SECOND delta_segments_per_second
+#elif defined(SCARA)
+  #define KINEMATICS_SEGMENTED
+  #define KINEMATICS_SEGMENTS_PER_SECOND SCARA_SEGMENTS_PER_SECOND
+#elif defined(COREXY)
+  #define KINEMATICS_COUPLED_XY
+#endif
+
+// Motor position of a cartesian XYZ position. Returns the result, which is the tower positions in
+// delta[] on a delta, the joint angles in scara_angles[] on a SCARA and the position itself everywhere
+// else.
+FORCE_INLINE const float *kin_motor_position(float *cartesian)
+{
+#if defined(DELTA)
+  calculate_delta(cartesian);
+  return delta;
+#elif defined(SCARA)
+  calculate_scara(cartesian);
+  return scara_angles;
+#else
+  return cartesian;
+#endif
+}
+
+// Cartesian XYZ position of a motor position
+FORCE_INLINE void kin_cartesian_position(const float *motor, float *cartesian)
+{
+#if defined(DELTA)
+  calculate_delta_cartesian(motor, cartesian);
+#elif defined(SCARA)
+  calculate_scara_cartesian(motor, cartesian);
+#else
+  memcpy(cartesian, motor, 3 * sizeof(float));
+#endif
+}
+
+// Feed rate to plan a segment with that goes from motor position from to motor position to and is mm long
+// at feed_rate mm/s. The planner measures the length of a move in motor units, which on a SCARA are joint
+// degrees: the feed rate is scaled by the joint distance over the cartesian length, so the segment takes
+// as long as the cartesian move. Elsewhere the motor units are mm and the feed rate is kept.
+FORCE_INLINE float kin_motor_feedrate(const float *from, const float *to, float mm, float feed_rate)
+{
+#if defined(SCARA)
+  float motor_distance = sqrt(sq(to[X_AXIS] - from[X_AXIS]) + sq(to[Y_AXIS] - from[Y_AXIS]) + sq(to[Z_AXIS] - from[Z_AXIS]));
+  if (mm > 0.000001 && motor_distance > 0.000001) // otherwise the planner takes the E distance
+    return feed_rate * motor_distance / mm;
+#endif
+  return feed_rate;
+}
+
+// Steps of the X and Y motors for a move of dx and dy steps along the axes.
+// COREXY: A = X + Y and B = X - Y, see http://www.corexy.com/theory.html
+FORCE_INLINE void kin_xy_motor_steps(long dx, long dy, long &a, long &b)
+{
+#ifdef KINEMATICS_COUPLED_XY
+  a = dx + dy;
+  b = dx - dy;
+#else
+  a = dx;
+  b = dy;
+#endif
+}
+
+// Steps along the X and Y axes of the step counts of the X and Y motors
+FORCE_INLINE void kin_xy_axis_steps(float a, float b, float &x, float &y)
+{
+#ifdef KINEMATICS_COUPLED_XY
+  x = (a + b) / 2;
+  y = (a - b) / 2;
+#else
+  x = a;
+  y = b;
+#endif
+}
+
+// Whether a block moves towards the X or Y min endstop, from the direction bits of its motors
+FORCE_INLINE bool kin_toward_x_min(uint8_t direction_bits)
+{
+#ifdef KINEMATICS_COUPLED_XY
+  return (direction_bits & (1<<X_AXIS)) && (direction_bits & (1<<Y_AXIS)); // -X occurs for -A and -B
+#else
+  return direction_bits & (1<<X_AXIS);
+#endif
+}
+
+FORCE_INLINE bool kin_toward_y_min(uint8_t direction_bits)
+{
+#ifdef KINEMATICS_COUPLED_XY
+  return (direction_bits & (1<<X_AXIS)) && !(direction_bits & (1<<Y_AXIS)); // -Y occurs for -A and +B
+#else
+  return direction_bits & (1<<Y_AXIS);
+#endif
+}
+
+// Motor steps of one babystep of -1, 0 or +1 per axis
+FORCE_INLINE void kin_babystep_motors(const signed char *axis, signed char *motor)
+{
+#if defined(DELTA)
+  motor[X_AXIS] = motor[Y_AXIS] = motor[Z_AXIS] = axis[Z_AXIS]; // all towers move the effector in Z
+#elif defined(KINEMATICS_COUPLED_XY)
+  motor[X_AXIS] = axis[X_AXIS] + axis[Y_AXIS];
+  motor[Y_AXIS] = axis[X_AXIS] - axis[Y_AXIS];
+  motor[Z_AXIS] = axis[Z_AXIS];
+#else
+  motor[X_AXIS] = axis[X_AXIS];
+  motor[Y_AXIS] = axis[Y_AXIS];
+  motor[Z_AXIS] = axis[Z_AXIS];
+#endif
+}
+
+#endif
@@ -22,9 +22,36 @@
 #include "Marlin.h"
 #include "stepper.h"
 #include "planner.h"
+#include "kinematics.h"
+
+#ifdef SCARA
+// The point the curve got to and its joint angles, for the feed rate of the next segment
+static float mc_last_point[3], mc_last_motor[3];
+
+static void mc_plan_start(float *position)
+{
+  memcpy(mc_last_point, position, sizeof(mc_last_point));
+  memcpy(mc_last_motor, kin_motor_position(position), sizeof(mc_last_motor));
+}
+#endif
+
+// Queue the move to a point of a curve. A delta gets the tower positions of the point, the curve
+// is cut finely enough already that prepare_move() does not have to cut its pieces again.
+static void mc_plan_point(float *point, float feed_rate, uint8_t extruder)
+{
+  const float *motor = kin_motor_position(point);
+#ifdef SCARA
+  float mm = sqrt(sq(point[X_AXIS] - mc_last_point[X_AXIS]) + sq(point[Y_AXIS] - mc_last_point[Y_AXIS])
+                  + sq(point[Z_AXIS] - mc_last_point[Z_AXIS]));
+  feed_rate = kin_motor_feedrate(mc_last_motor, motor, mm, feed_rate);
+  memcpy(mc_last_point, point, sizeof(mc_last_point));
+  memcpy(mc_last_motor, motor, sizeof(mc_last_motor));
+#endif
+  plan_buffer_line(motor[X_AXIS], motor[Y_AXIS], motor[Z_AXIS], point[E_AXIS], feed_rate, extruder);
+}
 
 // The arc is approximated by generating a huge number of tiny, linear segments. The length of each 
-// segment is configured in settings.mm_per_arc_segment.  
+// segment is configured in settings.mm_per_arc_segment, or follows from ARC_CHORD_TOLERANCE.
 void mc_arc(float *position, float *target, float *offset, uint8_t axis_0, uint8_t axis_1, 
   uint8_t axis_linear, float feed_rate, float radius, uint8_t isclockwise, uint8_t extruder)
 {      
@@ -46,7 +73,28 @@ void mc_arc(float *position, float *target, float *offset, uint8_t axis_0, uint8
   
   float millimeters_of_travel = hypot(angular_travel*radius, fabs(linear_travel));
   if (millimeters_of_travel < 0.001) { return; }
+#ifdef SCARA
+  mc_plan_start(position);
+#endif
+#ifdef ARC_CHORD_TOLERANCE
+  // Chord of the arc whose sagitta is the tolerance: 2*sqrt(2*r*e - e^2)
+  float mm_per_segment = radius > ARC_CHORD_TOLERANCE
+    ? 2*sqrt((2*radius - ARC_CHORD_TOLERANCE)*ARC_CHORD_TOLERANCE) : MIN_MM_PER_ARC_SEGMENT;
+  float mm_per_second_segment = feed_rate / ARC_SEGMENTS_PER_SECOND;
+  if (mm_per_segment < mm_per_second_segment) mm_per_segment = mm_per_second_segment;
+  mm_per_segment = constrain(mm_per_segment, MIN_MM_PER_ARC_SEGMENT, MAX_MM_PER_ARC_SEGMENT);
+  uint16_t segments = floor(millimeters_of_travel/mm_per_segment);
+#else
   uint16_t segments = floor(millimeters_of_travel/MM_PER_ARC_SEGMENT);
+#endif
+#ifdef KINEMATICS_SEGMENTED
+  // At least as many segments as prepare_move() cuts a line of the same length and time into
+  float delta_segments = KINEMATICS_SEGMENTS_PER_SECOND * millimeters_of_travel / feed_rate;
+  #ifdef DELTA_SEGMENT_MM
+  delta_segments = min(delta_segments, ceil(millimeters_of_travel / DELTA_SEGMENT_MM));
+  #endif
+  if(delta_segments > segments) segments = min(delta_segments, 65535.0);
+#endif
   if(segments == 0) segments = 1;
   
   /*  
@@ -126,12 +174,70 @@ void mc_arc(float *position, float *target, float *offset, uint8_t axis_0, uint8
     arc_target[E_AXIS] += extruder_per_segment;
 
     clamp_to_software_endstops(arc_target);
-    plan_buffer_line(arc_target[X_AXIS], arc_target[Y_AXIS], arc_target[Z_AXIS], arc_target[E_AXIS], feed_rate, extruder);
+    mc_plan_point(arc_target, feed_rate, extruder);
     
   }
   // Ensure last segment arrives at target location.
-  plan_buffer_line(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], target[E_AXIS], feed_rate, extruder);
+  mc_plan_point(target, feed_rate, extruder);
 
   //   plan_set_acceleration_manager_enabled(acceleration_manager_was_enabled);
 }
 
+#ifdef BEZIER_CURVE_SUPPORT
+// Point at parameter t of the cubic Bezier with control values p0..p3
+static float bezier_eval(float p0, float p1, float p2, float p3, float t)
+{
+  float mt = 1.0 - t;
+  return mt*mt*(mt*p0 + 3.0*t*p1) + t*t*(3.0*mt*p2 + t*p3);
+}
+
+// The curve is followed with a parameter step that halves while the middle of the next segment would
+// lie more than BEZIER_TOLERANCE off the curve and doubles again while it lies well within, so
+// straight stretches get few long segments and tight bends many short ones.
+void mc_bezier(float *position, float *target, const float *control, float feed_rate, uint8_t extruder)
+{
+  float p1_x = position[X_AXIS] + control[0];
+  float p1_y = position[Y_AXIS] + control[1];
+  float p2_x = target[X_AXIS] + control[2];
+  float p2_y = target[Y_AXIS] + control[3];
+  float bez_target[4];
+  bez_target[X_AXIS] = position[X_AXIS];
+  bez_target[Y_AXIS] = position[Y_AXIS];
+  float t = 0.0;
+  float step = BEZIER_MAX_STEP;
+#ifdef SCARA
+  mc_plan_start(position);
+#endif
+
+  while (t < 1.0) {
+    float new_t, new_x, new_y;
+    for (;;) {
+      new_t = t + step;
+      if (new_t > 1.0) new_t = 1.0;
+      new_x = bezier_eval(position[X_AXIS], p1_x, p2_x, target[X_AXIS], new_t);
+      new_y = bezier_eval(position[Y_AXIS], p1_y, p2_y, target[Y_AXIS], new_t);
+      float mid_t = 0.5*(t + new_t);
+      float error = fabs(bezier_eval(position[X_AXIS], p1_x, p2_x, target[X_AXIS], mid_t) - 0.5*(bez_target[X_AXIS] + new_x))
+                  + fabs(bezier_eval(position[Y_AXIS], p1_y, p2_y, target[Y_AXIS], mid_t) - 0.5*(bez_target[Y_AXIS] + new_y));
+      if (error > BEZIER_TOLERANCE && step > BEZIER_MIN_STEP) {
+        step *= 0.5;
+        continue;
+      }
+      if (error < BEZIER_TOLERANCE*0.25 && step < BEZIER_MAX_STEP)
+        step *= 2.0; // for the next segment
+      break;
+    }
+    t = new_t;
+    if (t >= 1.0) break;
+
+    bez_target[X_AXIS] = new_x;
+    bez_target[Y_AXIS] = new_y;
+    bez_target[Z_AXIS] = position[Z_AXIS] + (target[Z_AXIS] - position[Z_AXIS])*t;
+    bez_target[E_AXIS] = position[E_AXIS] + (target[E_AXIS] - position[E_AXIS])*t;
+    clamp_to_software_endstops(bez_target);
+    mc_plan_point(bez_target, feed_rate, extruder);
+  }
+  // Ensure last segment arrives at target location.
+  mc_plan_point(target, feed_rate, extruder);
+}
+#endif //BEZIER_CURVE_SUPPORT
@@ -28,5 +28,12 @@
 // for vector transformation direction.
 void mc_arc(float *position, float *target, float *offset, unsigned char axis_0, unsigned char axis_1,
   unsigned char axis_linear, float feed_rate, float radius, unsigned char isclockwise, uint8_t extruder);
+
+#ifdef BEZIER_CURVE_SUPPORT
+// Execute a cubic Bezier curve in the XY plane from position to target. control == I J offset of the
+// first control point from position, P Q offset of the second control point from target. Z and E are
+// interpolated along the curve parameter.
+void mc_bezier(float *position, float *target, const float *control, float feed_rate, uint8_t extruder);
+#endif
   
 #endif
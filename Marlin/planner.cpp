@@ -53,6 +53,7 @@
 
 #include "Marlin.h"
 #include "planner.h"
+#include "kinematics.h"
 #include "stepper.h"
 #include "temperature.h"
 #include "ultralcd.h"
@@ -73,6 +74,9 @@ float max_xy_jerk; //speed than can be stopped at once, if i understand correctl
 float max_z_jerk;
 float max_e_jerk;
 float mintravelfeedrate;
+#ifdef LIN_ADVANCE
+float extruder_advance_k = LIN_ADVANCE_K;
+#endif
 unsigned long axis_steps_per_sqr_second[NUM_AXIS];
 
 #ifdef ENABLE_AUTO_BED_LEVELING
@@ -82,12 +86,97 @@ matrix_3x3 plan_bed_level_matrix = {
 	0.0, 1.0, 0.0,
 	0.0, 0.0, 1.0,
 };
+
+#ifdef BED_LEVEL_EEPROM
+matrix_3x3 bed_level_stored_matrix;
+bool bed_level_stored = false;
+#endif
+
+#ifdef BED_LEVEL_SHEAR_MAX_TILT
+// Bottom row of plan_bed_level_matrix while it is applied as a shear, see plan_bed_level_changed()
+static bool bed_level_shear = true;
+static float bed_level_shear_x = 0.0, bed_level_shear_y = 0.0, bed_level_shear_z = 1.0;
+#endif
+
+void plan_bed_level_changed()
+{
+#ifdef BED_LEVEL_SHEAR_MAX_TILT
+  bed_level_shear_x = plan_bed_level_matrix.matrix[3*0+2];
+  bed_level_shear_y = plan_bed_level_matrix.matrix[3*1+2];
+  bed_level_shear_z = plan_bed_level_matrix.matrix[3*2+2];
+  bed_level_shear = fabs(bed_level_shear_x) < BED_LEVEL_SHEAR_MAX_TILT && fabs(bed_level_shear_y) < BED_LEVEL_SHEAR_MAX_TILT;
+#endif
+}
+
+// Level x, y, z with plan_bed_level_matrix
+static void plan_apply_bed_level(float &x, float &y, float &z)
+{
+#ifdef BED_LEVEL_SHEAR_MAX_TILT
+  if (bed_level_shear) {
+    z = x * bed_level_shear_x + y * bed_level_shear_y + z * bed_level_shear_z;
+    return;
+  }
+#endif
+  apply_rotation_xyz(plan_bed_level_matrix, x, y, z);
+}
+
+#ifdef MESH_BED_LEVELING
+float bed_level_mesh[AUTO_BED_LEVELING_GRID_POINTS][AUTO_BED_LEVELING_GRID_POINTS];
+bool bed_level_mesh_active = false;
+static float mesh_last[NUM_AXIS]; // Target of the last planned move, before leveling
+#endif
 #endif // #ifdef ENABLE_AUTO_BED_LEVELING
 
 // The current position of the tool in absolute steps
 long position[4];   //rescaled from extern when axis_steps_per_unit are changed by gcode
+#ifdef STEP_SPACE_POSITION
+// position[] in the coordinates the planner is given (after leveling) and what it was rounded by:
+// position[i] + position_residual[i] steps is position_mm[i]
+static float position_mm[NUM_AXIS];
+static float position_residual[NUM_AXIS];
+
+// Target in steps of a move to mm, and the residual it leaves
+static void step_space_target(const float *mm, long *target, float *residual)
+{
+  for(int8_t i=0; i < NUM_AXIS; i++) {
+    float steps = (mm[i] - position_mm[i]) * axis_steps_per_unit[i] + position_residual[i];
+    long whole = lround(steps);
+    target[i] = position[i] + whole;
+    residual[i] = steps - whole;
+  }
+}
+
+// After planning: the axes that got to their target, which a move too short to plan leaves out
+static void step_space_reached(const float *mm, const long *target, const float *residual)
+{
+  for(int8_t i=0; i < NUM_AXIS; i++)
+    if(position[i] == target[i]) {
+      position_mm[i] = mm[i];
+      position_residual[i] = residual[i];
+    }
+}
+
+// Set the position to mm
+static void step_space_set(int8_t axis, float mm)
+{
+  float steps = mm * axis_steps_per_unit[axis];
+  position[axis] = lround(steps);
+  position_mm[axis] = mm;
+  position_residual[axis] = steps - position[axis];
+}
+#endif
+#ifdef JUNCTION_DEVIATION
+static float previous_unit_vec[3]; // Direction of previous path line segment
+static bool previous_xyz_move;     // The previous path line segment moved X, Y or Z
+#else
 static float previous_speed[4]; // Speed of previous path line segment
+#endif
 static float previous_nominal_speed; // Nominal speed of previous path line segment
+#ifdef DELTA_SEGMENT_BATCH
+static bool recalculation_deferred = false;
+static bool recalculation_pending = false;
+static unsigned char recalculation_first; // the first block queued while recalculation_pending
+#endif
 
 #ifdef AUTOTEMP
 float autotemp_max=250;
@@ -102,6 +191,52 @@ bool autotemp_enabled=false;
 block_t block_buffer[BLOCK_BUFFER_SIZE];            // A ring buffer for motion instfructions
 volatile unsigned char block_buffer_head;           // Index of the next block to be pushed
 volatile unsigned char block_buffer_tail;           // Index of the block to process now
+volatile unsigned char block_buffer_hold = BLOCK_HOLD_NONE; // The stepper stops before this block
+#ifdef PLANNER_PRIMING
+volatile bool block_buffer_priming = false;
+static unsigned long priming_start; // millis() when the stepper ran dry
+#endif
+#ifdef REALTIME_COMMANDS
+volatile bool plan_feed_hold = false;
+#endif
+#ifdef REALTIME_FEEDRATE_OVERRIDE
+int plan_feed_multiply = 0;
+#endif
+#ifdef SD_EXECUTED_POSITION
+uint32_t plan_sdpos = 0;
+#endif
+#ifdef PLANNER_STARVATION_STATS
+uint8_t plan_source = PLAN_SOURCE_SERIAL;
+volatile bool plan_starved = false;
+volatile bool plan_lines_waiting = false;
+static unsigned int plan_underruns[2];  // per plan_source
+static unsigned int plan_late_moves[2];
+#endif
+unsigned char axis_blocks_added[NUM_AXIS];
+volatile unsigned char axis_blocks_retired[NUM_AXIS];
+#ifdef STATE_SYNC_WITH_MOVES
+unsigned char blocks_added;
+volatile unsigned char blocks_retired;
+#endif
+#ifdef THROUGHPUT_BENCHMARK
+unsigned long plan_block_count = 0;
+#endif
+#ifdef PRINT_STATISTICS
+long plan_filament_steps = 0;
+#endif
+#ifdef AUTOTEMP
+// The queued block with the highest e_speed. It stays the highest until it is retired; only then,
+// or when its slot is reused, the queue is searched again.
+static float high_e_speed = 0.0;
+static unsigned char high_e_block = BLOCK_HOLD_NONE;
+#endif
+#ifdef PLANNER_INCREMENTAL_RECALC
+// Entry speeds from the tail up to and including this block can no longer change. New blocks only
+// ever raise junction speeds (the plan always ends with a stop), so once a junction is at its maximum,
+// or is limited by accelerating from an optimal junction, it is final and does not need to be revisited.
+static unsigned char block_buffer_planned;
+static unsigned char trapezoid_start_index; // block_buffer_planned before the current recalculation
+#endif
 
 //===========================================================================
 //=============================private variables ============================
@@ -109,6 +244,13 @@ volatile unsigned char block_buffer_tail;           // Index of the block to pro
 #ifdef PREVENT_DANGEROUS_EXTRUDE
 float extrude_min_temp=EXTRUDE_MINTEMP;
 #endif
+// volumetric_multiplier * extrudemultiply / 100 of each extruder, see reset_extrusion_factors()
+static float extrusion_factor[EXTRUDERS];
+static float extrusion_mm_per_step[EXTRUDERS]; // extrusion_factor / axis_steps_per_unit[E_AXIS]
+#ifdef VOLUMETRIC_FLOW_LIMIT
+float volumetric_flow_max[EXTRUDERS];
+static float flow_max_e_speed[EXTRUDERS]; // mm/s of filament volumetric_flow_max comes to, 0 for no limit
+#endif
 #ifdef XY_FREQUENCY_LIMIT
 #define MAX_FREQ_TIME (1000000.0/XY_FREQUENCY_LIMIT)
 // Used for the frequency limit
@@ -116,6 +258,32 @@ static unsigned char old_direction_bits = 0;               // Old direction bits
 static long x_segment_time[3]={MAX_FREQ_TIME + 1,0,0};     // Segment times (in us). Used for speed calculations
 static long y_segment_time[3]={MAX_FREQ_TIME + 1,0,0};
 #endif
+#ifdef PRINT_TIME_ESTIMATE
+static unsigned long long planned_move_us = 0; // duration of every block planned, as last recalculated
+volatile unsigned long long executed_move_us = 0;
+#endif
+#ifdef SLOWDOWN
+static unsigned long last_arrival;      // micros() when the previous move was planned
+static unsigned long arrival_time = 0;  // Averaged time between planned moves (in us)
+#endif
+
+#ifdef PLANNER_PROFILE
+// Microseconds spent in plan_buffer_line() and in each pass of planner_recalculate()
+typedef struct {
+  unsigned long total;
+  unsigned long max;
+} planner_timing_t;
+static planner_timing_t timing_buffer_line, timing_reverse_pass, timing_forward_pass, timing_trapezoids;
+static unsigned long profiled_lines = 0;
+static unsigned long queue_depth_histogram[BLOCK_BUFFER_SIZE]; // movesplanned() each time a line is added
+
+static void planner_timing_add(planner_timing_t *timing, unsigned long start)
+{
+  unsigned long elapsed = micros() - start;
+  timing->total += elapsed;
+  if (elapsed > timing->max) timing->max = elapsed;
+}
+#endif
 
 // Returns the index of the next block in the ring buffer
 // NOTE: Removed modulo (%) operator, which uses an expensive divide and multiplication.
@@ -137,6 +305,19 @@ static int8_t prev_block_index(int8_t block_index) {
   return(block_index);
 }
 
+// Keep the stepper from starting the block at block_index, and so the ones after it, until
+// planner_recalculate() is done. Returns false if the stepper had already started the block, which
+// then must not be changed, nor the entry speed of the block after it. The hold is in place before
+// busy is read, and the stepper interrupt runs all at once, so the answer cannot go stale.
+static bool plan_hold_block(uint8_t block_index) {
+  unsigned char tail = block_buffer_tail;
+  if (block_buffer_hold == BLOCK_HOLD_NONE ||
+      ((block_index - tail) & (BLOCK_BUFFER_SIZE - 1)) < ((block_buffer_hold - tail) & (BLOCK_BUFFER_SIZE - 1)))
+    block_buffer_hold = block_index;
+  MEMORY_BARRIER();
+  return !block_buffer[block_index].busy;
+}
+
 //===========================================================================
 //=============================functions         ============================
 //===========================================================================
@@ -170,9 +351,56 @@ FORCE_INLINE float intersection_distance(float initial_rate, float final_rate, f
   }
 }
 
+#ifdef TRAPEZOID_INTEGER_MATH
+// Rounds n/d up, d must be positive
+FORCE_INLINE int32_t ceil_div(int32_t n, int32_t d)
+{
+  if (n >= 0) return (n + d - 1) / d;
+  return -((-n) / d);
+}
+#endif
+
 // Calculates trapezoid parameters so that the entry- and exit-speed is compensated by the provided factors.
 
+#ifdef S_CURVE_ACCELERATION
+// The stepper turns the time into a ramp in 1/2^15 parts as ((t << shift) * inverse) >> 24 with one
+// 24x24 bit multiply, which needs the scaled duration within 2^16..2^17 ticks.
+static unsigned long s_curve_scale(float ticks, signed char *shift)
+{
+  *shift = 0;
+  if(ticks < 1) ticks = 1;
+  while(ticks < 65536.0) { ticks *= 2; (*shift)++; }
+  while(ticks >= 131072.0) { ticks *= 0.5; (*shift)--; }
+  return 549755813888.0 / ticks; // 2^39
+}
+#endif
+
+#ifdef PRINT_TIME_ESTIMATE
+// How long the stepper takes for the trapezoid. Each ramp has constant acceleration, so it steps at
+// the mean of its end rates (an S-curve ramp too, it is symmetric).
+static unsigned long trapezoid_duration_us(block_t *block, unsigned long initial_rate, unsigned long final_rate,
+  long acceleration, int32_t accelerate_steps, int32_t plateau_steps)
+{
+  float peak_rate = block->nominal_rate;
+  if(plateau_steps == 0 && acceleration > 0) {
+    float peak = sqrt((float)initial_rate * initial_rate + 2.0 * acceleration * accelerate_steps);
+    if(peak < peak_rate) peak_rate = peak;
+  }
+  if(peak_rate < initial_rate) peak_rate = initial_rate;
+  if(peak_rate < final_rate) peak_rate = final_rate;
+  int32_t decelerate_steps = block->step_event_count - accelerate_steps - plateau_steps;
+  float seconds = 2.0 * accelerate_steps / (initial_rate + peak_rate) +
+    (float)plateau_steps / block->nominal_rate +
+    2.0 * decelerate_steps / (peak_rate + final_rate);
+  return seconds * 1000000.0;
+}
+#endif
+
 void calculate_trapezoid_for_block(block_t *block, float entry_factor, float exit_factor) {
+#ifdef QUEUED_DWELL
+  if(BLOCK_IS_DWELL(block)) // its entry speed of 0 stops the block before, it runs at the nominal rate
+    entry_factor = exit_factor = 1.0;
+#endif
   unsigned long initial_rate = ceil(block->nominal_rate*entry_factor); // (step/min)
   unsigned long final_rate = ceil(block->nominal_rate*exit_factor); // (step/min)
 
@@ -185,22 +413,53 @@ void calculate_trapezoid_for_block(block_t *block, float entry_factor, float exi
   }
 
   long acceleration = block->acceleration_st;
-  int32_t accelerate_steps =
-    ceil(estimate_acceleration_distance(initial_rate, block->nominal_rate, acceleration));
-  int32_t decelerate_steps =
-    floor(estimate_acceleration_distance(block->nominal_rate, final_rate, -acceleration));
-
-  // Calculate the size of Plateau of Nominal Rate.
-  int32_t plateau_steps = block->step_event_count-accelerate_steps-decelerate_steps;
-
-  // Is the Plateau of Nominal Rate smaller than nothing? That means no cruising, and we will
-  // have to use intersection_distance() to calculate when to abort acceleration and start braking
-  // in order to reach the final_rate exactly at the end of this block.
-  if (plateau_steps < 0) {
-    accelerate_steps = ceil(intersection_distance(initial_rate, final_rate, acceleration, block->step_event_count));
-    accelerate_steps = max(accelerate_steps,0); // Check limits due to numerical round-off
-    accelerate_steps = min((uint32_t)accelerate_steps,block->step_event_count);//(We can cast here to unsigned, because the above line ensures that we are above zero)
-    plateau_steps = 0;
+  int32_t accelerate_steps;
+  int32_t plateau_steps;
+
+#ifdef TRAPEZOID_INTEGER_MATH
+  // The rates are whole steps/s, so the distances can be computed exactly with integer squares and one
+  // division per distance instead of float divides. Rates above 46340 would overflow the squares.
+  if (block->nominal_rate <= 46340 && acceleration > 0 && acceleration < 0x10000000) {
+    int32_t nominal_sq = (int32_t)block->nominal_rate * (int32_t)block->nominal_rate;
+    int32_t initial_sq = (int32_t)initial_rate * (int32_t)initial_rate;
+    int32_t final_sq = (int32_t)final_rate * (int32_t)final_rate;
+    int32_t acceleration_x2 = acceleration << 1;
+
+    accelerate_steps = ceil_div(nominal_sq - initial_sq, acceleration_x2);
+    int32_t decelerate_steps = (nominal_sq - final_sq) / acceleration_x2;
+    if (nominal_sq < final_sq) decelerate_steps = -ceil_div(final_sq - nominal_sq, acceleration_x2); // floor of a negative value
+    plateau_steps = block->step_event_count-accelerate_steps-decelerate_steps;
+
+    if (plateau_steps < 0) {
+      // intersection_distance() = step_event_count/2 + (final^2 - initial^2)/(4*acceleration), split so the
+      // step count never gets multiplied by the acceleration.
+      accelerate_steps = (block->step_event_count >> 1) +
+        ceil_div((block->step_event_count & 1) * acceleration_x2 + final_sq - initial_sq, acceleration_x2 << 1);
+      accelerate_steps = max(accelerate_steps,0);
+      accelerate_steps = min((uint32_t)accelerate_steps,block->step_event_count);
+      plateau_steps = 0;
+    }
+  }
+  else
+#endif //TRAPEZOID_INTEGER_MATH
+  {
+    accelerate_steps =
+      ceil(estimate_acceleration_distance(initial_rate, block->nominal_rate, acceleration));
+    int32_t decelerate_steps =
+      floor(estimate_acceleration_distance(block->nominal_rate, final_rate, -acceleration));
+
+    // Calculate the size of Plateau of Nominal Rate.
+    plateau_steps = block->step_event_count-accelerate_steps-decelerate_steps;
+
+    // Is the Plateau of Nominal Rate smaller than nothing? That means no cruising, and we will
+    // have to use intersection_distance() to calculate when to abort acceleration and start braking
+    // in order to reach the final_rate exactly at the end of this block.
+    if (plateau_steps < 0) {
+      accelerate_steps = ceil(intersection_distance(initial_rate, final_rate, acceleration, block->step_event_count));
+      accelerate_steps = max(accelerate_steps,0); // Check limits due to numerical round-off
+      accelerate_steps = min((uint32_t)accelerate_steps,block->step_event_count);//(We can cast here to unsigned, because the above line ensures that we are above zero)
+      plateau_steps = 0;
+    }
   }
 
 #ifdef ADVANCE
@@ -208,9 +467,28 @@ void calculate_trapezoid_for_block(block_t *block, float entry_factor, float exi
   volatile long final_advance = block->advance*exit_factor*exit_factor;
 #endif // ADVANCE
 
+#ifdef S_CURVE_ACCELERATION
+  // Without a plateau the peak is where acceleration stops
+  unsigned long cruise_rate = block->nominal_rate;
+  if(plateau_steps == 0 && acceleration > 0) {
+    float peak = sqrt((float)initial_rate * initial_rate + 2.0 * acceleration * accelerate_steps);
+    if(peak < cruise_rate) cruise_rate = peak;
+  }
+  if(cruise_rate < initial_rate) cruise_rate = initial_rate;
+  if(cruise_rate < final_rate) cruise_rate = final_rate;
+  unsigned long accel_inverse = 0, decel_inverse = 0;
+  signed char accel_shift = 0, decel_shift = 0;
+  if(acceleration > 0) {
+    if(cruise_rate > initial_rate)
+      accel_inverse = s_curve_scale((cruise_rate - initial_rate) * (F_CPU / 8.0) / acceleration, &accel_shift);
+    if(cruise_rate > final_rate)
+      decel_inverse = s_curve_scale((cruise_rate - final_rate) * (F_CPU / 8.0) / acceleration, &decel_shift);
+  }
+#endif // S_CURVE_ACCELERATION
+
   // block->accelerate_until = accelerate_steps;
   // block->decelerate_after = accelerate_steps+plateau_steps;
-  CRITICAL_SECTION_START;  // Fill variables used by the stepper in a critical section
+  // The caller holds the block (or has not queued it yet), so busy cannot change under us
   if(block->busy == false) { // Don't update variables if block is busy.
     block->accelerate_until = accelerate_steps;
     block->decelerate_after = accelerate_steps+plateau_steps;
@@ -220,8 +498,21 @@ void calculate_trapezoid_for_block(block_t *block, float entry_factor, float exi
     block->initial_advance = initial_advance;
     block->final_advance = final_advance;
 #endif //ADVANCE
+#ifdef PRINT_TIME_ESTIMATE
+    unsigned long duration_us = trapezoid_duration_us(block, initial_rate, final_rate, acceleration, accelerate_steps, plateau_steps);
+    planned_move_us -= block->duration_us;
+    planned_move_us += duration_us;
+    block->duration_us = duration_us;
+#endif
+#ifdef S_CURVE_ACCELERATION
+    block->cruise_rate = cruise_rate;
+    block->accel_inverse = accel_inverse;
+    block->decel_inverse = decel_inverse;
+    block->accel_shift = accel_shift;
+    block->decel_shift = decel_shift;
+#endif //S_CURVE_ACCELERATION
+    MEMORY_BARRIER(); // the trapezoid is complete before the caller clears recalculate_flag
   }
-  CRITICAL_SECTION_END;
 }                    
 
 // Calculates the maximum allowable speed at this point when you must be able to reach target_velocity using the 
@@ -250,6 +541,8 @@ void planner_reverse_pass_kernel(block_t *previous, block_t *current, block_t *n
     // If not, block in state of acceleration or deceleration. Reset entry speed to maximum and
     // check for maximum allowable speed reductions to ensure maximum possible planned speed.
     if (current->entry_speed != current->max_entry_speed) {
+      // The stepper's exit speed of previous must still be open to change
+      if (!plan_hold_block(previous - block_buffer)) return;
 
       // If nominal length true, max junction speed is guaranteed to be reached. Only compute
       // for max allowable speed if block is decelerating and nominal length is false.
@@ -271,12 +564,16 @@ void planner_reverse_pass_kernel(block_t *previous, block_t *current, block_t *n
 void planner_reverse_pass() {
   uint8_t block_index = block_buffer_head;
   
-  //Make a local copy of block_buffer_tail, because the interrupt can alter it
-  CRITICAL_SECTION_START;
+  //Make a local copy of block_buffer_tail, because the interrupt can alter it (a byte read is atomic)
   unsigned char tail = block_buffer_tail;
-  CRITICAL_SECTION_END
   
   if(((block_buffer_head-tail + BLOCK_BUFFER_SIZE) & (BLOCK_BUFFER_SIZE - 1)) > 3) {
+#ifdef PLANNER_INCREMENTAL_RECALC
+    // The blocks up to block_buffer_planned are final, the stepper may have consumed them already
+    if(((block_buffer_planned - tail) & (BLOCK_BUFFER_SIZE - 1)) > ((block_buffer_head - tail) & (BLOCK_BUFFER_SIZE - 1)))
+      block_buffer_planned = tail;
+    tail = block_buffer_planned;
+#endif
     block_index = (block_buffer_head - 3) & (BLOCK_BUFFER_SIZE - 1);
     block_t *block[3] = { 
       NULL, NULL, NULL         };
@@ -285,15 +582,22 @@ void planner_reverse_pass() {
       block[2]= block[1];
       block[1]= block[0];
       block[0] = &block_buffer[block_index];
+#ifdef PLANNER_INCREMENTAL_RECALC
+      // A block already at its maximum entry speed is left alone by the kernel, so the blocks
+      // before it see the same speeds as the last time they were planned.
+      if(block[1] != NULL && block[2] != NULL && block[1]->entry_speed == block[1]->max_entry_speed)
+        break;
+#endif
       planner_reverse_pass_kernel(block[0], block[1], block[2]);
     }
   }
 }
 
 // The kernel called by planner_recalculate() when scanning the plan from first to last entry.
-void planner_forward_pass_kernel(block_t *previous, block_t *current, block_t *next) {
+// Returns true if the entry speed of current is limited by the acceleration over previous.
+bool planner_forward_pass_kernel(block_t *previous, block_t *current, block_t *next) {
   if(!previous) { 
-    return; 
+    return false; 
   }
 
   // If the previous block is an acceleration block, but it is not long enough to complete the
@@ -302,22 +606,33 @@ void planner_forward_pass_kernel(block_t *previous, block_t *current, block_t *n
   // If nominal length is true, max junction speed is guaranteed to be reached. No need to recheck.
   if (!previous->nominal_length_flag) {
     if (previous->entry_speed < current->entry_speed) {
-      double entry_speed = min( current->entry_speed,
-      max_allowable_speed(-previous->acceleration,previous->entry_speed,previous->millimeters) );
+      double allowable_speed = max_allowable_speed(-previous->acceleration,previous->entry_speed,previous->millimeters);
+      double entry_speed = min( current->entry_speed, allowable_speed );
 
       // Check for junction speed change
       if (current->entry_speed != entry_speed) {
+        // previous is running with this junction speed as its exit, the junction is final
+        if (!plan_hold_block(previous - block_buffer)) return true;
         current->entry_speed = entry_speed;
         current->recalculate_flag = true;
       }
+      return (allowable_speed <= entry_speed);
     }
   }
+  return false;
 }
 
 // planner_recalculate() needs to go over the current plan twice. Once in reverse and once forward. This 
 // implements the forward pass.
 void planner_forward_pass() {
+#ifdef PLANNER_INCREMENTAL_RECALC
+  // Start at the last final block: its entry speed is fixed, later junctions depend on it.
+  uint8_t block_index = block_buffer_planned;
+  bool optimal = true; // all junctions so far are final
+  uint8_t current_index = block_index;
+#else
   uint8_t block_index = block_buffer_tail;
+#endif
   block_t *block[3] = { 
     NULL, NULL, NULL   };
 
@@ -325,7 +640,18 @@ void planner_forward_pass() {
     block[0] = block[1];
     block[1] = block[2];
     block[2] = &block_buffer[block_index];
+#ifdef PLANNER_INCREMENTAL_RECALC
+    bool limited = planner_forward_pass_kernel(block[0],block[1],block[2]);
+    if(block[0] != NULL) { // junction at the entry of block[1], the block at current_index
+      if(block[1]->entry_speed == block[1]->max_entry_speed || (optimal && limited))
+        block_buffer_planned = current_index;
+      else
+        optimal = false;
+    }
+    current_index = block_index;
+#else
     planner_forward_pass_kernel(block[0],block[1],block[2]);
+#endif
     block_index = next_block_index(block_index);
   }
   planner_forward_pass_kernel(block[1], block[2], NULL);
@@ -335,7 +661,13 @@ void planner_forward_pass() {
 // entry_factor for each junction. Must be called by planner_recalculate() after 
 // updating the blocks.
 void planner_recalculate_trapezoids() {
+#ifdef PLANNER_INCREMENTAL_RECALC
+  // Only blocks after the final ones may have been flagged, start at the last final block
+  // because its exit speed is the entry of the next one.
+  int8_t block_index = trapezoid_start_index;
+#else
   int8_t block_index = block_buffer_tail;
+#endif
   block_t *current;
   block_t *next = NULL;
 
@@ -346,19 +678,26 @@ void planner_recalculate_trapezoids() {
       // Recalculate if current block entry or exit junction speed has changed.
       if (current->recalculate_flag || next->recalculate_flag) {
         // NOTE: Entry and exit factors always > 0 by all previous logic operations.
-        calculate_trapezoid_for_block(current, current->entry_speed/current->nominal_speed,
-        next->entry_speed/current->nominal_speed);
+        if (plan_hold_block(current - block_buffer))
+          calculate_trapezoid_for_block(current, current->entry_speed/current->nominal_speed,
+          next->entry_speed/current->nominal_speed);
         current->recalculate_flag = false; // Reset current only to ensure next trapezoid is computed
       }
+      // current is final now, let the stepper have it
+      if (block_buffer_hold == (uint8_t)(current - block_buffer))
+        block_buffer_hold = next - block_buffer;
     }
     block_index = next_block_index( block_index );
   }
   // Last/newest block in buffer. Exit speed is set with MINIMUM_PLANNER_SPEED. Always recalculated.
   if(next != NULL) {
-    calculate_trapezoid_for_block(next, next->entry_speed/next->nominal_speed,
-    MINIMUM_PLANNER_SPEED/next->nominal_speed);
+    if (plan_hold_block(next - block_buffer))
+      calculate_trapezoid_for_block(next, next->entry_speed/next->nominal_speed,
+      MINIMUM_PLANNER_SPEED/next->nominal_speed);
     next->recalculate_flag = false;
   }
+  MEMORY_BARRIER();
+  block_buffer_hold = BLOCK_HOLD_NONE;
 }
 
 // Recalculates the motion plan according to the following algorithm:
@@ -379,20 +718,92 @@ void planner_recalculate_trapezoids() {
 //   3. Recalculate trapezoids for all blocks.
 
 void planner_recalculate() {   
+  TRACE_SPAN(TRACE_PLAN_RECALC);
+#ifdef PLANNER_INCREMENTAL_RECALC
+  unsigned char tail = block_buffer_tail;
+  if(((block_buffer_planned - tail) & (BLOCK_BUFFER_SIZE - 1)) > ((block_buffer_head - tail) & (BLOCK_BUFFER_SIZE - 1)))
+    block_buffer_planned = tail;
+  trapezoid_start_index = block_buffer_planned;
+#endif
+#ifdef PLANNER_PROFILE
+  unsigned long start = micros();
   planner_reverse_pass();
+  planner_timing_add(&timing_reverse_pass, start);
+  start = micros();
   planner_forward_pass();
+  planner_timing_add(&timing_forward_pass, start);
+  start = micros();
   planner_recalculate_trapezoids();
+  planner_timing_add(&timing_trapezoids, start);
+#else
+  planner_reverse_pass();
+  planner_forward_pass();
+  planner_recalculate_trapezoids();
+#endif
 }
 
+#ifdef DELTA_SEGMENT_BATCH
+// Don't let the stepper reach blocks that were never planned together: replan when it runs the block
+// before the first of them or already took that one, or when the buffer is full
+static void plan_check_deferred(int next_buffer_head)
+{
+  if(!recalculation_pending)
+    return;
+  unsigned char tail = block_buffer_tail;
+  unsigned char ahead = (recalculation_first - tail) & (BLOCK_BUFFER_SIZE - 1);
+  if(ahead <= 1 || ahead >= ((block_buffer_head - tail) & (BLOCK_BUFFER_SIZE - 1)) || tail == next_buffer_head) {
+    planner_recalculate();
+    recalculation_pending = false;
+  }
+}
+
+// Called with the new block queued
+static void plan_recalculate_or_defer()
+{
+  if(!recalculation_deferred)
+    planner_recalculate();
+  else if(!recalculation_pending) {
+    recalculation_pending = true;
+    recalculation_first = prev_block_index(block_buffer_head);
+  }
+}
+#endif
+
 void plan_init() {
   block_buffer_head = 0;
   block_buffer_tail = 0;
+  block_buffer_hold = BLOCK_HOLD_NONE;
+#ifdef PLANNER_INCREMENTAL_RECALC
+  block_buffer_planned = 0;
+#endif
+#ifdef PLANNER_PRIMING
+  block_buffer_priming = false;
+#endif
+  memset(axis_blocks_added, 0, sizeof(axis_blocks_added));
+  memset((void *)axis_blocks_retired, 0, sizeof(axis_blocks_retired));
+#ifdef STATE_SYNC_WITH_MOVES
+  blocks_added = 0;
+  blocks_retired = 0;
+#endif
+#ifdef AUTOTEMP
+  high_e_block = BLOCK_HOLD_NONE;
+#endif
   memset(position, 0, sizeof(position)); // clear position
+#ifndef JUNCTION_DEVIATION
   previous_speed[0] = 0.0;
   previous_speed[1] = 0.0;
   previous_speed[2] = 0.0;
   previous_speed[3] = 0.0;
+#endif
   previous_nominal_speed = 0.0;
+#ifdef SEGMENT_MERGE
+  plan_discard_pending();
+#endif
+#ifdef VOLUMETRIC_FLOW_LIMIT
+  for(int8_t e=0; e < EXTRUDERS; e++)
+    volumetric_flow_max[e] = VOLUMETRIC_FLOW_MAX;
+#endif
+  reset_extrusion_factors();
 }
 
 
@@ -409,24 +820,21 @@ void getHighESpeed()
     return; //do nothing
   }
 
-  float high=0.0;
-  uint8_t block_index = block_buffer_tail;
-
-  while(block_index != block_buffer_head) {
-    if((block_buffer[block_index].steps_x != 0) ||
-      (block_buffer[block_index].steps_y != 0) ||
-      (block_buffer[block_index].steps_z != 0)) {
-      float se=(float(block_buffer[block_index].steps_e)/float(block_buffer[block_index].step_event_count))*block_buffer[block_index].nominal_speed;
-      //se; mm/sec;
-      if(se>high)
-      {
-        high=se;
+  uint8_t tail = block_buffer_tail;
+  uint8_t queued = (block_buffer_head - tail) & (BLOCK_BUFFER_SIZE - 1);
+  if(high_e_block == BLOCK_HOLD_NONE || ((high_e_block - tail) & (BLOCK_BUFFER_SIZE - 1)) >= queued) {
+    // the fastest block has been retired
+    high_e_speed = 0.0;
+    high_e_block = BLOCK_HOLD_NONE;
+    for(uint8_t block_index = tail; block_index != block_buffer_head; block_index = next_block_index(block_index)) {
+      if(high_e_block == BLOCK_HOLD_NONE || block_buffer[block_index].e_speed > high_e_speed) {
+        high_e_speed = block_buffer[block_index].e_speed;
+        high_e_block = block_index;
       }
     }
-    block_index = (block_index+1) & (BLOCK_BUFFER_SIZE - 1);
   }
 
-  float g=autotemp_min+high*autotemp_factor;
+  float g=autotemp_min+high_e_speed*autotemp_factor;
   float t=g;
   if(t<autotemp_min)
     t=autotemp_min;
@@ -441,6 +849,21 @@ void getHighESpeed()
 }
 #endif
 
+#ifdef Z_LATE_ENABLE
+// Enable Z when one of the next Z_LATE_ENABLE_BLOCKS blocks moves it
+static void z_late_enable()
+{
+  uint8_t block_index = block_buffer_tail;
+  for(uint8_t n = 0; n < Z_LATE_ENABLE_BLOCKS && block_index != block_buffer_head; n++) {
+    if(block_buffer[block_index].steps_z != 0) {
+      enable_z();
+      return;
+    }
+    block_index = next_block_index(block_index);
+  }
+}
+#endif
+
 void check_axes_activity()
 {
   unsigned char x_active = 0;
@@ -456,31 +879,42 @@ void check_axes_activity()
 
   if(block_buffer_tail != block_buffer_head)
   {
-    uint8_t block_index = block_buffer_tail;
-    tail_fan_speed = block_buffer[block_index].fan_speed;
+    block = &block_buffer[block_buffer_tail];
+    tail_fan_speed = block->fan_speed;
     #ifdef BARICUDA
-    tail_valve_pressure = block_buffer[block_index].valve_pressure;
-    tail_e_to_p_pressure = block_buffer[block_index].e_to_p_pressure;
+    tail_valve_pressure = block->valve_pressure;
+    tail_e_to_p_pressure = block->e_to_p_pressure;
     #endif
-    while(block_index != block_buffer_head)
-    {
-      block = &block_buffer[block_index];
-      if(block->steps_x != 0) x_active++;
-      if(block->steps_y != 0) y_active++;
-      if(block->steps_z != 0) z_active++;
-      if(block->steps_e != 0) e_active++;
-      block_index = (block_index+1) & (BLOCK_BUFFER_SIZE - 1);
-    }
   }
+  x_active = axis_blocks_added[X_AXIS] - axis_blocks_retired[X_AXIS];
+  y_active = axis_blocks_added[Y_AXIS] - axis_blocks_retired[Y_AXIS];
+  z_active = axis_blocks_added[Z_AXIS] - axis_blocks_retired[Z_AXIS];
+  e_active = axis_blocks_added[E_AXIS] - axis_blocks_retired[E_AXIS];
   if((DISABLE_X) && (x_active == 0)) disable_x();
   if((DISABLE_Y) && (y_active == 0)) disable_y();
   if((DISABLE_Z) && (z_active == 0)) disable_z();
+#ifdef Z_LATE_ENABLE
+  if(z_active != 0)
+    z_late_enable();
+#endif
   if((DISABLE_E) && (e_active == 0))
   {
     disable_e0();
     disable_e1();
     disable_e2(); 
   }
+#ifdef IDLE_CURRENT_PERCENT
+  static unsigned long axis_active_millis[NUM_AXIS]; // when each axis last had queued blocks
+  uint8_t idle_axes = 0;
+  unsigned char active[NUM_AXIS] = { x_active, y_active, z_active, e_active };
+  for(int8_t i = 0; i < NUM_AXIS; i++) {
+    if(active[i])
+      axis_active_millis[i] = millis();
+    else if(millis() - axis_active_millis[i] > IDLE_CURRENT_DELAY * 1000UL)
+      idle_axes |= 1<<i;
+  }
+  motor_current_idle(idle_axes);
+#endif
 #if defined(FAN_PIN) && FAN_PIN > -1
   #ifdef FAN_KICKSTART_TIME
     static unsigned long fan_kick_end;
@@ -496,11 +930,16 @@ void check_axes_activity()
       fan_kick_end = 0;
     }
   #endif//FAN_KICKSTART_TIME
+  #ifdef FAN_SYNC_WITH_MOVES
+  if(block_buffer_tail == block_buffer_head) // otherwise the stepper interrupt sets it as each move starts
+  #endif
+  {
   #ifdef FAN_SOFT_PWM
   fanSpeedSoftPwm = tail_fan_speed;
   #else
   analogWrite(FAN_PIN,tail_fan_speed);
   #endif//!FAN_SOFT_PWM
+  }
 #endif//FAN_PIN > -1
 #ifdef AUTOTEMP
   getHighESpeed();
@@ -518,45 +957,245 @@ void check_axes_activity()
 }
 
 
-float junction_deviation = 0.1;
+#ifdef TEMP_FEEDRATE_LIMIT
+// Speed factor for printing with the given extruder, below 1 while its hotend is too cold
+static float temp_feedrate_factor(uint8_t extruder)
+{
+  float target = degTargetHotend(extruder);
+  float deficit = target - degHotend(extruder) - TEMP_FEEDRATE_LIMIT_BAND;
+  if(target <= 0 || deficit <= 0)
+    return 1.0;
+  return max(1.0 - deficit * TEMP_FEEDRATE_LIMIT_GAIN, TEMP_FEEDRATE_LIMIT_MIN);
+}
+#endif
+
 // Add a new linear movement to the buffer. steps_x, _y and _z is the absolute position in 
 // mm. Microseconds specify how many microseconds the move should take to perform. To aid acceleration
 // calculation the caller must also provide the physical length of the line in millimeters.
-#ifdef ENABLE_AUTO_BED_LEVELING
+#ifdef MESH_BED_LEVELING
+float mesh_z_offset(float x, float y)
+{
+  if (!bed_level_mesh_active) return 0.0;
+  float fx = (x - LEFT_PROBE_BED_POSITION) / (float)MESH_X_DIST;
+  float fy = (y - FRONT_PROBE_BED_POSITION) / (float)MESH_Y_DIST;
+  int8_t ix = constrain((int)floor(fx), 0, AUTO_BED_LEVELING_GRID_POINTS - 2);
+  int8_t iy = constrain((int)floor(fy), 0, AUTO_BED_LEVELING_GRID_POINTS - 2);
+  float tx = constrain(fx - ix, 0.0, 1.0);
+  float ty = constrain(fy - iy, 0.0, 1.0);
+  float z_front = bed_level_mesh[iy][ix] + (bed_level_mesh[iy][ix+1] - bed_level_mesh[iy][ix]) * tx;
+  float z_back = bed_level_mesh[iy+1][ix] + (bed_level_mesh[iy+1][ix+1] - bed_level_mesh[iy+1][ix]) * tx;
+  return z_front + (z_back - z_front) * ty;
+}
+
+// Fraction along the move from 'from' to 'to' where it next crosses one of the grid lines at
+// first + k*dist, 1 if it does not. Lines closer than 5 um ahead are skipped, a split ends on one.
+static float mesh_next_line(float from, float to, float first, float dist)
+{
+  float cells = (from - first) / dist;
+  int k;
+  if (to > from) {
+    k = floor(cells) + 1;
+    if (first + k*dist - from < 0.005) k++;
+    if (k < 0) k = 0;
+    if (k > AUTO_BED_LEVELING_GRID_POINTS - 1) return 1.0;
+  }
+  else if (to < from) {
+    k = ceil(cells) - 1;
+    if (from - (first + k*dist) < 0.005) k--;
+    if (k > AUTO_BED_LEVELING_GRID_POINTS - 1) k = AUTO_BED_LEVELING_GRID_POINTS - 1;
+    if (k < 0) return 1.0;
+  }
+  else return 1.0;
+  float t = (first + k*dist - from) / (to - from);
+  return t < 1.0 ? t : 1.0;
+}
+
+// Splitting calls the planner entry again for each piece, which then crosses no grid line
+#ifdef SEGMENT_MERGE
+  #define MESH_PLAN_LINE plan_queue_line
+#else
+  #define MESH_PLAN_LINE plan_buffer_line
+#endif
+#endif // MESH_BED_LEVELING
+
+#ifdef TRAVEL_MICROSTEP_FACTOR
+static bool travel_piece = false;  // the block is part of a split travel and kept however short
+static bool travel_coarse = false; // the block is the part at the coarse travel microsteps
+
+// Whether the move to target is a travel to run at the coarse microsteps. If so, start and end get the
+// points the coarse part runs between. An axis that moves in it starts and ends on a step of the coarse
+// mode; one that moves too little for that stays where it is and moves in the last part.
+static bool travel_microsteps_split(const long *target, float feed_rate, long *start, long *end)
+{
+  if(target[Z_AXIS] != position[Z_AXIS] || target[E_AXIS] != position[E_AXIS] || !st_travel_microsteps_usable())
+    return false;
+  float delta_mm[2], speed = feed_rate;
+  for(int8_t i=X_AXIS; i <= Y_AXIS; i++)
+    delta_mm[i] = (target[i] - position[i]) / axis_steps_per_unit[i];
+  float millimeters = sqrt(square(delta_mm[X_AXIS]) + square(delta_mm[Y_AXIS]));
+  if(millimeters < TRAVEL_MICROSTEP_MIN_LENGTH) return false;
+  for(int8_t i=X_AXIS; i <= Y_AXIS; i++)
+    if(fabs(delta_mm[i]) * speed > max_feedrate[i] * millimeters)
+      speed = max_feedrate[i] * millimeters / fabs(delta_mm[i]);
+  long most_steps = max(labs(target[X_AXIS] - position[X_AXIS]), labs(target[Y_AXIS] - position[Y_AXIS]));
+  if(most_steps * speed < TRAVEL_MICROSTEP_MIN_RATE * millimeters) return false;
+
+  const long mask = TRAVEL_MICROSTEP_FACTOR - 1;
+  bool coarse_steps = false;
+  for(int8_t i=X_AXIS; i <= Y_AXIS; i++) {
+    long steps = target[i] - position[i];
+    uint8_t phase = st_microstep_phase(i); // the driver is on a coarse step where (steps + phase) & mask is 0
+    // Both ends are rounded towards the other one
+    long from = steps > 0 ? position[i] + (-(position[i] + phase) & mask) : position[i] - ((position[i] + phase) & mask);
+    long to = steps > 0 ? target[i] - ((target[i] + phase) & mask) : target[i] + (-(target[i] + phase) & mask);
+    if(steps == 0 || (steps > 0 ? to <= from : to >= from))
+      from = to = position[i];
+    else
+      coarse_steps = true;
+    start[i] = from;
+    end[i] = to;
+  }
+  start[Z_AXIS] = end[Z_AXIS] = target[Z_AXIS];
+  start[E_AXIS] = end[E_AXIS] = target[E_AXIS];
+  return coarse_steps;
+}
+#endif
+
+static bool plan_block_steps(long *target, float feed_rate, uint8_t extruder);
+
+#ifdef PLANNER_STARVATION_STATS
+// "Underrun <underruns>/<late moves>" on the LCD status line, both sources together
+static void plan_starvation_status()
+{
+#ifdef ULTRA_LCD
+  char status[LCD_WIDTH + 1];
+  snprintf_P(status, sizeof(status), PSTR("Underrun %u/%u"),
+    plan_underruns[PLAN_SOURCE_SERIAL] + plan_underruns[PLAN_SOURCE_SD],
+    plan_late_moves[PLAN_SOURCE_SERIAL] + plan_late_moves[PLAN_SOURCE_SD]);
+  lcd_setstatus(status);
+#endif
+}
+
+void plan_starvation_report()
+{
+  SERIAL_ECHO_START;
+  SERIAL_ECHOPGM("Underruns serial:");
+  SERIAL_ECHO(plan_underruns[PLAN_SOURCE_SERIAL]);
+  SERIAL_ECHOPGM(" SD:");
+  SERIAL_ECHO(plan_underruns[PLAN_SOURCE_SD]);
+  SERIAL_ECHOPGM(" late moves serial:");
+  SERIAL_ECHO(plan_late_moves[PLAN_SOURCE_SERIAL]);
+  SERIAL_ECHOPGM(" SD:");
+  SERIAL_ECHOLN(plan_late_moves[PLAN_SOURCE_SD]);
+}
+
+void plan_starvation_reset()
+{
+  for (uint8_t i = 0; i < 2; i++)
+    plan_underruns[i] = plan_late_moves[i] = 0;
+  plan_starved = false;
+}
+#endif //PLANNER_STARVATION_STATS
+
+#ifdef LASER_RASTER
+unsigned char raster_buffer[LASER_RASTER_BUFFER];
+volatile unsigned char raster_tail = 0;
+static unsigned char raster_head = 0;   // where the pixels of the next G7 move start
+static unsigned char raster_staged = 0; // pixels waiting at raster_head for the next block
+
+void plan_raster_pixels(const unsigned char *pixels, uint8_t count)
+{
+  if(count > LASER_RASTER_BUFFER)
+    count = LASER_RASTER_BUFFER;
+  while((unsigned char)(raster_head - raster_tail) + count > LASER_RASTER_BUFFER)
+    idle();
+  for(uint8_t i = 0; i < count; i++)
+    raster_buffer[(unsigned char)(raster_head + i) & (LASER_RASTER_BUFFER - 1)] = pixels[i];
+  raster_staged = count;
+}
+#endif //LASER_RASTER
+
+#ifdef SEGMENT_MERGE
+// The merging front end below is plan_buffer_line()
+static void plan_queue_line(float x, float y, float z, float e, float feed_rate, uint8_t extruder)
+#elif defined(ENABLE_AUTO_BED_LEVELING)
 void plan_buffer_line(float x, float y, float z, const float &e, float feed_rate, const uint8_t &extruder)
 #else
 void plan_buffer_line(const float &x, const float &y, const float &z, const float &e, float feed_rate, const uint8_t &extruder)
 #endif  //ENABLE_AUTO_BED_LEVELING
 {
+#ifdef MESH_BED_LEVELING
+  if (bed_level_mesh_active) {
+    float target_mm[NUM_AXIS] = { x, y, z, e };
+    for (;;) {
+      float t = min(mesh_next_line(mesh_last[X_AXIS], x, LEFT_PROBE_BED_POSITION, MESH_X_DIST),
+                    mesh_next_line(mesh_last[Y_AXIS], y, FRONT_PROBE_BED_POSITION, MESH_Y_DIST));
+      if (t >= 1.0) break;
+      float split[NUM_AXIS];
+      for (int8_t i=0; i < NUM_AXIS; i++)
+        split[i] = mesh_last[i] + (target_mm[i] - mesh_last[i]) * t;
+      MESH_PLAN_LINE(split[X_AXIS], split[Y_AXIS], split[Z_AXIS], split[E_AXIS], feed_rate, extruder);
+    }
+  }
+  mesh_last[X_AXIS] = x;
+  mesh_last[Y_AXIS] = y;
+  mesh_last[Z_AXIS] = z;
+  mesh_last[E_AXIS] = e;
+#endif
+
   // Calculate the buffer head after we push this byte
   int next_buffer_head = next_block_index(block_buffer_head);
 
+#ifdef DELTA_SEGMENT_BATCH
+  plan_check_deferred(next_buffer_head);
+#endif
+
   // If the buffer is full: good! That means we are well ahead of the robot. 
   // Rest here until there is room in the buffer.
-  while(block_buffer_tail == next_buffer_head)
+  while(block_buffer_tail == next_buffer_head
+  #ifdef REALTIME_COMMANDS
+        || plan_feed_hold // and during a feed hold
+  #endif
+       )
   {
-    manage_heater(); 
-    manage_inactivity(); 
-    lcd_update();
+    idle();
   }
 
+#ifdef PLANNER_PROFILE
+  unsigned long profile_start = micros(); // waiting for a free block is not counted
+  queue_depth_histogram[movesplanned()]++;
+#endif
+
 #ifdef ENABLE_AUTO_BED_LEVELING
-  apply_rotation_xyz(plan_bed_level_matrix, x, y, z);
+  #ifdef MESH_BED_LEVELING
+  z += mesh_z_offset(x, y);
+  #endif
+  plan_apply_bed_level(x, y, z);
 #endif // ENABLE_AUTO_BED_LEVELING
 
   // The target position of the tool in absolute steps
   // Calculate target position in absolute steps
   //this should be done after the wait, because otherwise a M92 code within the gcode disrupts this calculation somehow
   long target[4];
+#ifdef STEP_SPACE_POSITION
+  float target_mm[NUM_AXIS] = { x, y, z, e };
+  float target_residual[NUM_AXIS];
+  step_space_target(target_mm, target, target_residual);
+#else
   target[X_AXIS] = lround(x*axis_steps_per_unit[X_AXIS]);
   target[Y_AXIS] = lround(y*axis_steps_per_unit[Y_AXIS]);
   target[Z_AXIS] = lround(z*axis_steps_per_unit[Z_AXIS]);     
   target[E_AXIS] = lround(e*axis_steps_per_unit[E_AXIS]);
+#endif
 
   #ifdef PREVENT_DANGEROUS_EXTRUDE
   if(target[E_AXIS]!=position[E_AXIS])
   {
-    if(degHotend(active_extruder)<extrude_min_temp)
+    if(degHotend(active_extruder)<extrude_min_temp
+    #ifdef DRY_PLANNING
+      && !dry_planning
+    #endif
+    )
     {
       position[E_AXIS]=target[E_AXIS]; //behave as if the move really took place, but ignore E part
       SERIAL_ECHO_START;
@@ -574,34 +1213,73 @@ void plan_buffer_line(const float &x, const float &y, const float &z, const floa
   }
   #endif
 
+  bool planned;
+#ifdef TRAVEL_MICROSTEP_FACTOR
+  long travel_start[NUM_AXIS], travel_end[NUM_AXIS];
+  if(travel_microsteps_split(target, feed_rate, travel_start, travel_end)) {
+    while(movesplanned() > BLOCK_BUFFER_SIZE - 4) // room for all three parts
+      idle();
+    travel_piece = true;
+    plan_block_steps(travel_start, feed_rate, extruder);
+    travel_coarse = true;
+    plan_block_steps(travel_end, feed_rate, extruder);
+    travel_coarse = false;
+    plan_block_steps(target, feed_rate, extruder);
+    travel_piece = false;
+    planned = true;
+  }
+  else
+#endif
+  planned = plan_block_steps(target, feed_rate, extruder);
+#ifdef STEP_SPACE_POSITION
+  step_space_reached(target_mm, target, target_residual); // the cold extrusion check may have moved E
+#endif
+  if(!planned)
+    return;
+
+#ifdef PLANNER_PROFILE
+  planner_timing_add(&timing_buffer_line, profile_start);
+  profiled_lines++;
+#endif
+}
+
+// Plan the block from position to target, in steps, and make target the position. False if it was
+// too short to plan.
+static bool plan_block_steps(long *target, float feed_rate, uint8_t extruder)
+{
   // Prepare to set up new block
   block_t *block = &block_buffer[block_buffer_head];
 
   // Mark block as not busy (Not executed by the stepper interrupt)
   block->busy = false;
-
-  // Number of steps for each axis
-#ifndef COREXY
-// default non-h-bot planning
-block->steps_x = labs(target[X_AXIS]-position[X_AXIS]);
-block->steps_y = labs(target[Y_AXIS]-position[Y_AXIS]);
-#else
-// corexy planning
-// these equations follow the form of the dA and dB equations on http://www.corexy.com/theory.html
-block->steps_x = labs((target[X_AXIS]-position[X_AXIS]) + (target[Y_AXIS]-position[Y_AXIS]));
-block->steps_y = labs((target[X_AXIS]-position[X_AXIS]) - (target[Y_AXIS]-position[Y_AXIS]));
+#ifdef PRINT_TIME_ESTIMATE
+  block->duration_us = 0; // not in planned_move_us yet
 #endif
+
+  // Number of steps for each axis, steps_x and steps_y are those of the X and Y motors
+  long motor_dx, motor_dy;
+  kin_xy_motor_steps(target[X_AXIS]-position[X_AXIS], target[Y_AXIS]-position[Y_AXIS], motor_dx, motor_dy);
+  block->steps_x = labs(motor_dx);
+  block->steps_y = labs(motor_dy);
   block->steps_z = labs(target[Z_AXIS]-position[Z_AXIS]);
-  block->steps_e = labs(target[E_AXIS]-position[E_AXIS]);
-  block->steps_e *= volumetric_multiplier[active_extruder];
-  block->steps_e *= extrudemultiply;
-  block->steps_e /= 100;
+  block->steps_e = lround(labs(target[E_AXIS]-position[E_AXIS]) * extrusion_factor[active_extruder]);
+#ifdef TRAVEL_MICROSTEP_FACTOR
+  block->travel_microsteps = travel_coarse;
+  if(travel_coarse) { // the ends are on coarse steps
+    block->steps_x /= TRAVEL_MICROSTEP_FACTOR;
+    block->steps_y /= TRAVEL_MICROSTEP_FACTOR;
+  }
+#endif
   block->step_event_count = max(block->steps_x, max(block->steps_y, max(block->steps_z, block->steps_e)));
 
   // Bail if this is a zero-length block
-  if (block->step_event_count <= dropsegments)
+  if (block->step_event_count <= dropsegments
+#ifdef TRAVEL_MICROSTEP_FACTOR
+      && (block->step_event_count == 0 || !travel_piece) // the coarse part must start where it was split
+#endif
+     )
   { 
-    return; 
+    return false; 
   }
 
   block->fan_speed = fanSpeed;
@@ -609,28 +1287,36 @@ block->steps_y = labs((target[X_AXIS]-position[X_AXIS]) - (target[Y_AXIS]-positi
   block->valve_pressure = ValvePressure;
   block->e_to_p_pressure = EtoPPressure;
   #endif
+  #ifdef LASER_PWM
+  block->laser_power = laser_power;
+  #endif
+  #ifdef LASER_RASTER
+  block->raster_pixels = raster_staged;
+  block->raster_start = raster_head;
+  if(raster_staged) {
+    block->raster_pixel_events = (block->step_event_count << 8) / raster_staged;
+    raster_head += raster_staged;
+    raster_staged = 0;
+  }
+  #endif
+  #ifdef SD_EXECUTED_POSITION
+  block->sdpos = plan_sdpos;
+  #endif
+  #ifdef REALTIME_FEEDRATE_OVERRIDE
+  block->feed_multiply = plan_feed_multiply;
+  block->override_scale = OVERRIDE_SCALE_ONE;
+  #endif
 
   // Compute direction bits for this block 
   block->direction_bits = 0;
-#ifndef COREXY
-  if (target[X_AXIS] < position[X_AXIS])
+  if (motor_dx < 0)
   {
     block->direction_bits |= (1<<X_AXIS); 
   }
-  if (target[Y_AXIS] < position[Y_AXIS])
+  if (motor_dy < 0)
   {
     block->direction_bits |= (1<<Y_AXIS); 
   }
-#else
-  if ((target[X_AXIS]-position[X_AXIS]) + (target[Y_AXIS]-position[Y_AXIS]) < 0)
-  {
-    block->direction_bits |= (1<<X_AXIS); 
-  }
-  if ((target[X_AXIS]-position[X_AXIS]) - (target[Y_AXIS]-position[Y_AXIS]) < 0)
-  {
-    block->direction_bits |= (1<<Y_AXIS); 
-  }
-#endif
   if (target[Z_AXIS] < position[Z_AXIS])
   {
     block->direction_bits |= (1<<Z_AXIS); 
@@ -643,7 +1329,7 @@ block->steps_y = labs((target[X_AXIS]-position[X_AXIS]) - (target[Y_AXIS]-positi
   block->active_extruder = extruder;
 
   //enable active axes
-  #ifdef COREXY
+  #ifdef KINEMATICS_COUPLED_XY
   if((block->steps_x != 0) || (block->steps_y != 0))
   {
     enable_x();
@@ -655,6 +1341,9 @@ block->steps_y = labs((target[X_AXIS]-position[X_AXIS]) - (target[Y_AXIS]-positi
   #endif
 #ifndef Z_LATE_ENABLE
   if(block->steps_z != 0) enable_z();
+#else
+  if(block->steps_z != 0 && ((block_buffer_head - block_buffer_tail) & (BLOCK_BUFFER_SIZE - 1)) < Z_LATE_ENABLE_BLOCKS)
+    enable_z(); // close to the stepper already
 #endif
 
   // Enable all
@@ -675,22 +1364,27 @@ block->steps_y = labs((target[X_AXIS]-position[X_AXIS]) - (target[Y_AXIS]-positi
   } 
 
   float delta_mm[4];
-  #ifndef COREXY
-    delta_mm[X_AXIS] = (target[X_AXIS]-position[X_AXIS])/axis_steps_per_unit[X_AXIS];
-    delta_mm[Y_AXIS] = (target[Y_AXIS]-position[Y_AXIS])/axis_steps_per_unit[Y_AXIS];
-  #else
-    delta_mm[X_AXIS] = ((target[X_AXIS]-position[X_AXIS]) + (target[Y_AXIS]-position[Y_AXIS]))/axis_steps_per_unit[X_AXIS];
-    delta_mm[Y_AXIS] = ((target[X_AXIS]-position[X_AXIS]) - (target[Y_AXIS]-position[Y_AXIS]))/axis_steps_per_unit[Y_AXIS];
-  #endif
+  delta_mm[X_AXIS] = motor_dx/axis_steps_per_unit[X_AXIS];
+  delta_mm[Y_AXIS] = motor_dy/axis_steps_per_unit[Y_AXIS];
   delta_mm[Z_AXIS] = (target[Z_AXIS]-position[Z_AXIS])/axis_steps_per_unit[Z_AXIS];
-  delta_mm[E_AXIS] = ((target[E_AXIS]-position[E_AXIS])/axis_steps_per_unit[E_AXIS])*volumetric_multiplier[active_extruder]*extrudemultiply/100.0;
-  if ( block->steps_x <=dropsegments && block->steps_y <=dropsegments && block->steps_z <=dropsegments )
+  delta_mm[E_AXIS] = (target[E_AXIS]-position[E_AXIS])*extrusion_mm_per_step[active_extruder];
+#ifdef JUNCTION_DEVIATION
+  bool xyz_move = false;
+#endif
+  if ( block->steps_x <=dropsegments && block->steps_y <=dropsegments && block->steps_z <=dropsegments
+#ifdef TRAVEL_MICROSTEP_FACTOR
+       && !travel_piece
+#endif
+     )
   {
     block->millimeters = fabs(delta_mm[E_AXIS]);
   } 
   else
   {
     block->millimeters = sqrt(square(delta_mm[X_AXIS]) + square(delta_mm[Y_AXIS]) + square(delta_mm[Z_AXIS]));
+#ifdef JUNCTION_DEVIATION
+    xyz_move = true;
+#endif
   }
   float inverse_millimeters = 1.0/block->millimeters;  // Inverse millimeters to remove multiple divides 
 
@@ -708,22 +1402,41 @@ block->steps_y = labs((target[X_AXIS]-position[X_AXIS]) - (target[Y_AXIS]-positi
 #ifdef SLOWDOWN
   //  segment time im micro seconds
   unsigned long segment_time = lround(1000000.0/inverse_second);
-  if ((moves_queued > 1) && (moves_queued < (BLOCK_BUFFER_SIZE * 0.5)))
-  {
-    if (segment_time < minsegmenttime)
-    { // buffer is draining, add extra time.  The amount of time added increases if the buffer is still emptied more.
-      inverse_second=1000000.0/(segment_time+lround(2*(minsegmenttime-segment_time)/moves_queued));
-      #ifdef XY_FREQUENCY_LIMIT
-         segment_time = lround(1000000.0/inverse_second);
-      #endif
-    }
+  // Time between moves arriving here, averaged over the last few. Gaps while the buffer was empty are
+  // idle time rather than the rate moves can be delivered at, so they are left out.
+  unsigned long arrival_now = micros();
+  if (moves_queued > 1)
+    arrival_time = (3 * arrival_time + min(arrival_now - last_arrival, (unsigned long)minsegmenttime)) >> 2;
+  last_arrival = arrival_now;
+  if ((moves_queued > 1) && (moves_queued < (BLOCK_BUFFER_SIZE * 0.5)) && (segment_time < arrival_time))
+  { // The buffer drains faster than it is refilled and is getting low: stretch the move towards the
+    // arrival time, the more the emptier the buffer. No slowdown while moves keep pace with the stepper.
+    unsigned long half = BLOCK_BUFFER_SIZE / 2;
+    inverse_second=1000000.0/(segment_time+(arrival_time-segment_time)*(half-moves_queued)/(half-1));
+    #ifdef XY_FREQUENCY_LIMIT
+       segment_time = lround(1000000.0/inverse_second);
+    #endif
   }
 #endif
   //  END OF SLOW DOWN SECTION    
 
+#ifdef TEMP_FEEDRATE_LIMIT
+  // Printing moves give the hotend time to catch up when it lags its target
+  if(block->steps_e != 0 && (block->steps_x != 0 || block->steps_y != 0) && !(block->direction_bits & (1<<E_AXIS))
+  #ifdef DRY_PLANNING
+     && !dry_planning // the heaters are not waited for
+  #endif
+    )
+    inverse_second *= temp_feedrate_factor(extruder);
+#endif
+
 
   block->nominal_speed = block->millimeters * inverse_second; // (mm/sec) Always > 0
   block->nominal_rate = ceil(block->step_event_count * inverse_second); // (step/sec) Always > 0
+  #ifdef LASER_POWER_FOLLOWS_SPEED
+  // rounded up, so the nominal rate gives the full power
+  block->laser_scale = (((unsigned long)block->laser_power << 16) + block->nominal_rate - 1) / block->nominal_rate;
+  #endif
 
   // Calculate and limit speed in mm/sec for each axis
   float current_speed[4];
@@ -734,6 +1447,11 @@ block->steps_y = labs((target[X_AXIS]-position[X_AXIS]) - (target[Y_AXIS]-positi
     if(fabs(current_speed[i]) > max_feedrate[i])
       speed_factor = min(speed_factor, max_feedrate[i] / fabs(current_speed[i]));
   }
+#ifdef VOLUMETRIC_FLOW_LIMIT
+  // No faster than the hotend melts the filament; retracts are not melted
+  if(flow_max_e_speed[extruder] > 0 && current_speed[E_AXIS] > flow_max_e_speed[extruder])
+    speed_factor = min(speed_factor, flow_max_e_speed[extruder] / current_speed[E_AXIS]);
+#endif
 
   // Max segement time in us.
 #ifdef XY_FREQUENCY_LIMIT
@@ -782,34 +1500,50 @@ block->steps_y = labs((target[X_AXIS]-position[X_AXIS]) - (target[Y_AXIS]-positi
   }
 
   // Compute and limit the acceleration rate for the trapezoid generator.  
-  float steps_per_mm = block->step_event_count/block->millimeters;
+  float steps_per_mm = block->step_event_count*inverse_millimeters;
+  float inverse_step_event_count = 1.0/block->step_event_count;
   if(block->steps_x == 0 && block->steps_y == 0 && block->steps_z == 0)
   {
     block->acceleration_st = ceil(retract_acceleration * steps_per_mm); // convert to: acceleration steps/sec^2
   }
   else
   {
+    unsigned long max_x_steps_per_sqr_second = axis_steps_per_sqr_second[X_AXIS];
+    unsigned long max_y_steps_per_sqr_second = axis_steps_per_sqr_second[Y_AXIS];
+#ifdef TRAVEL_MICROSTEP_FACTOR
+    if(travel_coarse) {
+      max_x_steps_per_sqr_second /= TRAVEL_MICROSTEP_FACTOR;
+      max_y_steps_per_sqr_second /= TRAVEL_MICROSTEP_FACTOR;
+    }
+#endif
     block->acceleration_st = ceil(acceleration * steps_per_mm); // convert to: acceleration steps/sec^2
     // Limit acceleration per axis
-    if(((float)block->acceleration_st * (float)block->steps_x / (float)block->step_event_count) > axis_steps_per_sqr_second[X_AXIS])
-      block->acceleration_st = axis_steps_per_sqr_second[X_AXIS];
-    if(((float)block->acceleration_st * (float)block->steps_y / (float)block->step_event_count) > axis_steps_per_sqr_second[Y_AXIS])
-      block->acceleration_st = axis_steps_per_sqr_second[Y_AXIS];
-    if(((float)block->acceleration_st * (float)block->steps_e / (float)block->step_event_count) > axis_steps_per_sqr_second[E_AXIS])
+    if(((float)block->acceleration_st * (float)block->steps_x * inverse_step_event_count) > max_x_steps_per_sqr_second)
+      block->acceleration_st = max_x_steps_per_sqr_second;
+    if(((float)block->acceleration_st * (float)block->steps_y * inverse_step_event_count) > max_y_steps_per_sqr_second)
+      block->acceleration_st = max_y_steps_per_sqr_second;
+    if(((float)block->acceleration_st * (float)block->steps_e * inverse_step_event_count) > axis_steps_per_sqr_second[E_AXIS])
       block->acceleration_st = axis_steps_per_sqr_second[E_AXIS];
-    if(((float)block->acceleration_st * (float)block->steps_z / (float)block->step_event_count ) > axis_steps_per_sqr_second[Z_AXIS])
+    if(((float)block->acceleration_st * (float)block->steps_z * inverse_step_event_count) > axis_steps_per_sqr_second[Z_AXIS])
       block->acceleration_st = axis_steps_per_sqr_second[Z_AXIS];
   }
-  block->acceleration = block->acceleration_st / steps_per_mm;
+  block->acceleration = block->acceleration_st * block->millimeters * inverse_step_event_count;
   block->acceleration_rate = (long)((float)block->acceleration_st * (16777216.0 / (F_CPU / 8.0)));
+#ifdef REALTIME_FEEDRATE_OVERRIDE
+  // Changing the time scale by acceleration_st / nominal_rate per second changes the nominal speed
+  // by the acceleration
+  float override_ramp = (float)block->acceleration_st * (16777216.0 / (F_CPU / 8.0)) / block->nominal_rate;
+  block->override_ramp = override_ramp < 1 ? 1 : (override_ramp > 65535 ? 65535 : override_ramp);
+#endif
 
-#if 0  // Use old jerk for now
-  // Compute path unit vector
-  double unit_vec[3];
-
-  unit_vec[X_AXIS] = delta_mm[X_AXIS]*inverse_millimeters;
-  unit_vec[Y_AXIS] = delta_mm[Y_AXIS]*inverse_millimeters;
-  unit_vec[Z_AXIS] = delta_mm[Z_AXIS]*inverse_millimeters;
+#ifdef JUNCTION_DEVIATION
+  // Path unit vector, previous_unit_vec is the one of the block before
+  float unit_vec[3];
+  if (xyz_move) {
+    unit_vec[X_AXIS] = delta_mm[X_AXIS]*inverse_millimeters;
+    unit_vec[Y_AXIS] = delta_mm[Y_AXIS]*inverse_millimeters;
+    unit_vec[Z_AXIS] = delta_mm[Z_AXIS]*inverse_millimeters;
+  }
 
   // Compute maximum allowable entry speed at junction by centripetal acceleration approximation.
   // Let a circle be tangent to both previous and current path line segments, where the junction
@@ -820,13 +1554,15 @@ block->steps_y = labs((target[X_AXIS]-position[X_AXIS]) - (target[Y_AXIS]-positi
   // path width or max_jerk in the previous grbl version. This approach does not actually deviate
   // from path, but used as a robust way to compute cornering speeds, as it takes into account the
   // nonlinearities of both the junction angle and junction velocity.
-  double vmax_junction = MINIMUM_PLANNER_SPEED; // Set default max junction speed
+  float vmax_junction = MINIMUM_PLANNER_SPEED; // Set default max junction speed
+  float safe_speed = min(vmax_junction, block->nominal_speed);
 
   // Skip first block or when previous_nominal_speed is used as a flag for homing and offset cycles.
-  if ((block_buffer_head != block_buffer_tail) && (previous_nominal_speed > 0.0)) {
+  // Moves of E alone have no direction to corner with, they start and end at the default speed.
+  if ((block_buffer_head != block_buffer_tail) && (previous_nominal_speed > 0.0) && xyz_move && previous_xyz_move) {
     // Compute cosine of angle between previous and current path. (prev_unit_vec is negative)
     // NOTE: Max junction velocity is computed without sin() or acos() by trig half angle identity.
-    double cos_theta = - previous_unit_vec[X_AXIS] * unit_vec[X_AXIS]
+    float cos_theta = - previous_unit_vec[X_AXIS] * unit_vec[X_AXIS]
       - previous_unit_vec[Y_AXIS] * unit_vec[Y_AXIS]
       - previous_unit_vec[Z_AXIS] * unit_vec[Z_AXIS] ;
 
@@ -836,13 +1572,13 @@ block->steps_y = labs((target[X_AXIS]-position[X_AXIS]) - (target[Y_AXIS]-positi
       // Skip and avoid divide by zero for straight junctions at 180 degrees. Limit to min() of nominal speeds.
       if (cos_theta > -0.95) {
         // Compute maximum junction velocity based on maximum acceleration and junction deviation
-        double sin_theta_d2 = sqrt(0.5*(1.0-cos_theta)); // Trig half angle identity. Always positive.
+        float sin_theta_d2 = sqrt(0.5*(1.0-cos_theta)); // Trig half angle identity. Always positive.
         vmax_junction = min(vmax_junction,
-        sqrt(block->acceleration * junction_deviation * sin_theta_d2/(1.0-sin_theta_d2)) );
+        sqrt(block->acceleration * JUNCTION_DEVIATION_MM * sin_theta_d2/(1.0-sin_theta_d2)) );
       }
     }
   }
-#endif
+#else
   // Start with a safe speed
   float vmax_junction = max_xy_jerk/2; 
   float vmax_junction_factor = 1.0; 
@@ -854,23 +1590,40 @@ block->steps_y = labs((target[X_AXIS]-position[X_AXIS]) - (target[Y_AXIS]-positi
   float safe_speed = vmax_junction;
 
   if ((moves_queued > 1) && (previous_nominal_speed > 0.0001)) {
-    float jerk = sqrt(pow((current_speed[X_AXIS]-previous_speed[X_AXIS]), 2)+pow((current_speed[Y_AXIS]-previous_speed[Y_AXIS]), 2));
+    float jerk = sqrt(square(current_speed[X_AXIS]-previous_speed[X_AXIS])+square(current_speed[Y_AXIS]-previous_speed[Y_AXIS]));
+    float jerk_z = fabs(current_speed[Z_AXIS] - previous_speed[Z_AXIS]);
+    float jerk_e = fabs(current_speed[E_AXIS] - previous_speed[E_AXIS]);
     //    if((fabs(previous_speed[X_AXIS]) > 0.0001) || (fabs(previous_speed[Y_AXIS]) > 0.0001)) {
     vmax_junction = block->nominal_speed;
     //    }
     if (jerk > max_xy_jerk) {
       vmax_junction_factor = (max_xy_jerk/jerk);
     } 
-    if(fabs(current_speed[Z_AXIS] - previous_speed[Z_AXIS]) > max_z_jerk) {
-      vmax_junction_factor= min(vmax_junction_factor, (max_z_jerk/fabs(current_speed[Z_AXIS] - previous_speed[Z_AXIS])));
+    if(jerk_z > max_z_jerk) {
+      vmax_junction_factor= min(vmax_junction_factor, (max_z_jerk/jerk_z));
     } 
-    if(fabs(current_speed[E_AXIS] - previous_speed[E_AXIS]) > max_e_jerk) {
-      vmax_junction_factor = min(vmax_junction_factor, (max_e_jerk/fabs(current_speed[E_AXIS] - previous_speed[E_AXIS])));
+    if(jerk_e > max_e_jerk) {
+      vmax_junction_factor = min(vmax_junction_factor, (max_e_jerk/jerk_e));
     } 
     vmax_junction = min(previous_nominal_speed, vmax_junction * vmax_junction_factor); // Limit speed to max previous speed
   }
+#endif
   block->max_entry_speed = vmax_junction;
 
+#ifdef PLANNER_STARVATION_STATS
+  if (plan_starved) {
+    plan_starved = false; // the queue is empty: the stepper stood still waiting for this move
+    plan_underruns[plan_source]++;
+    plan_starvation_status();
+  }
+  else if (block_buffer_head != block_buffer_tail && vmax_junction > safe_speed &&
+           block_buffer[prev_block_index(block_buffer_head)].busy) {
+    // the move before is already running with a stop at its end, the corner could have been faster
+    plan_late_moves[plan_source]++;
+    plan_starvation_status();
+  }
+#endif
+
   // Initialize block entry speed. Compute based on deceleration to user-defined MINIMUM_PLANNER_SPEED.
   double v_allowable = max_allowable_speed(-block->acceleration,MINIMUM_PLANNER_SPEED,block->millimeters);
   block->entry_speed = min(vmax_junction, v_allowable);
@@ -892,7 +1645,12 @@ block->steps_y = labs((target[X_AXIS]-position[X_AXIS]) - (target[Y_AXIS]-positi
   block->recalculate_flag = true; // Always calculate trapezoid for new block
 
   // Update previous path unit_vector and nominal speed
+#ifdef JUNCTION_DEVIATION
+  memcpy(previous_unit_vec, unit_vec, sizeof(previous_unit_vec)); // previous_unit_vec[] = unit_vec[]
+  previous_xyz_move = xyz_move;
+#else
   memcpy(previous_speed, current_speed, sizeof(previous_speed)); // previous_speed[] = current_speed[]
+#endif
   previous_nominal_speed = block->nominal_speed;
 
 
@@ -923,67 +1681,524 @@ block->steps_y = labs((target[X_AXIS]-position[X_AXIS]) - (target[Y_AXIS]-positi
    */
 #endif // ADVANCE
 
+#ifdef LIN_ADVANCE
+  // Only printing moves get the pressure lead; retractions, travel and E-only moves
+  // bring it back to zero on their first speed update.
+  if(block->steps_e == 0 || (block->steps_x == 0 && block->steps_y == 0)
+     || (block->direction_bits & (1<<E_AXIS)) || extruder_advance_k <= 0) {
+    block->advance_k24 = 0;
+  }
+  else {
+    float k24 = extruder_advance_k * block->steps_e / block->step_event_count * 16777216.0;
+    block->advance_k24 = k24 < 16777215.0 ? (unsigned long)k24 : 16777215UL;
+  }
+#endif // LIN_ADVANCE
+
   calculate_trapezoid_for_block(block, block->entry_speed/block->nominal_speed,
   safe_speed/block->nominal_speed);
 
-  // Move buffer head
-  block_buffer_head = next_buffer_head;
+  if(block->steps_x != 0) axis_blocks_added[X_AXIS]++;
+  if(block->steps_y != 0) axis_blocks_added[Y_AXIS]++;
+  if(block->steps_z != 0) axis_blocks_added[Z_AXIS]++;
+  if(block->steps_e != 0) axis_blocks_added[E_AXIS]++;
+#ifdef STATE_SYNC_WITH_MOVES
+  blocks_added++;
+#endif
+#ifdef THROUGHPUT_BENCHMARK
+  plan_block_count++;
+#endif
+#ifdef PRINT_STATISTICS
+  if(block->direction_bits & (1<<E_AXIS))
+    plan_filament_steps -= block->steps_e;
+  else
+    plan_filament_steps += block->steps_e;
+#endif
+#ifdef AUTOTEMP
+  block->e_speed = (block->steps_x != 0 || block->steps_y != 0 || block->steps_z != 0)
+    ? (float)block->steps_e / (float)block->step_event_count * block->nominal_speed : 0.0;
+  if(high_e_block == block_buffer_head)
+    high_e_block = BLOCK_HOLD_NONE; // the slot's old block has been retired
+  else if(high_e_block != BLOCK_HOLD_NONE && block->e_speed > high_e_speed) {
+    high_e_speed = block->e_speed;
+    high_e_block = block_buffer_head;
+  }
+#endif
+
+#ifdef IDLE_CURRENT_PERCENT
+  // The moves queued ahead give the drivers time to get back to full current, with none it is waited for
+  if(motor_current_wake((block->steps_x ? 1<<X_AXIS : 0) | (block->steps_y ? 1<<Y_AXIS : 0) |
+                        (block->steps_z ? 1<<Z_AXIS : 0) | (block->steps_e ? 1<<E_AXIS : 0)) && !blocks_queued())
+    delay(IDLE_CURRENT_LEAD_MS);
+#endif
+
+#ifdef PLANNER_PRIMING
+  // The stepper is idle: let more moves queue up behind this one before it starts
+  if(block_buffer_head == block_buffer_tail) {
+    priming_start = millis();
+    block_buffer_priming = true;
+  }
+#endif
+
+  // Move buffer head, after the block is complete
+  MEMORY_BARRIER();
+  block_buffer_head = next_block_index(block_buffer_head);
+  TRACE_EVENT(TRACE_PLAN_LINE, movesplanned());
 
   // Update position
-  memcpy(position, target, sizeof(target)); // position[] = target[]
+  memcpy(position, target, sizeof(position)); // position[] = target[]
 
+#ifdef DELTA_SEGMENT_BATCH
+  plan_recalculate_or_defer();
+#else
   planner_recalculate();
+#endif
+
+#ifdef PLANNER_PRIMING
+  if(block_buffer_priming && movesplanned() >= PLANNER_PRIMING_BLOCKS)
+    block_buffer_priming = false;
+#endif
 
   st_wake_up();
+  return true;
 }
 
-#ifdef ENABLE_AUTO_BED_LEVELING
-vector_3 plan_get_position() {
-	vector_3 position = vector_3(st_get_position_mm(X_AXIS), st_get_position_mm(Y_AXIS), st_get_position_mm(Z_AXIS));
+#ifdef QUEUED_DWELL
+void plan_dwell(unsigned long ms)
+{
+  if(ms == 0)
+    return;
+#ifdef SEGMENT_MERGE
+  plan_flush_pending();
+#endif
+  int next_buffer_head = next_block_index(block_buffer_head);
+#ifdef DELTA_SEGMENT_BATCH
+  plan_check_deferred(next_buffer_head);
+#endif
+  while(block_buffer_tail == next_buffer_head
+  #ifdef REALTIME_COMMANDS
+        || plan_feed_hold
+  #endif
+       )
+  {
+    idle();
+  }
 
-	//position.debug("in plan_get position");
-	//plan_bed_level_matrix.debug("in plan_get bed_level");
-	matrix_3x3 inverse = matrix_3x3::transpose(plan_bed_level_matrix);
-	//inverse.debug("in plan_get inverse");
-	position.apply_rotation(inverse);
-	//position.debug("after rotation");
+  block_t *block = &block_buffer[block_buffer_head];
+  block->busy = false;
+#ifdef PRINT_TIME_ESTIMATE
+  block->duration_us = 0;
+#endif
+  block->steps_x = block->steps_y = block->steps_z = block->steps_e = 0;
+  block->step_event_count = ms;
+  block->direction_bits = block_buffer[prev_block_index(block_buffer_head)].direction_bits; // the pins stay
+  block->active_extruder = active_extruder;
+  block->fan_speed = fanSpeed;
+  #ifdef BARICUDA
+  block->valve_pressure = ValvePressure;
+  block->e_to_p_pressure = EtoPPressure;
+  #endif
+  #ifdef LASER_PWM
+  block->laser_power = 0;
+  #endif
+  #ifdef LASER_RASTER
+  block->raster_pixels = 0;
+  block->raster_start = raster_head;
+  #endif
+  #ifdef SD_EXECUTED_POSITION
+  block->sdpos = plan_sdpos;
+  #endif
+  #ifdef REALTIME_FEEDRATE_OVERRIDE
+  block->feed_multiply = 0; // not sped up or slowed down
+  block->override_scale = OVERRIDE_SCALE_ONE;
+  block->override_ramp = 1;
+  #endif
+  #ifdef TRAVEL_MICROSTEP_FACTOR
+  block->travel_microsteps = false;
+  #endif
+  #ifdef ADVANCE
+  block->advance_rate = 0;
+  block->advance = 0;
+  #endif
+  #ifdef LIN_ADVANCE
+  block->advance_k24 = 0;
+  #endif
+  #ifdef AUTOTEMP
+  block->e_speed = 0;
+  #endif
 
-	return position;
+  // A step event per millisecond. nominal_speed is only there to be divided by, the entry speed of 0
+  // makes the move before stop and the nominal length flag keeps the move after from being limited.
+  block->nominal_rate = 1000;
+  block->acceleration_st = 1000;
+  block->acceleration_rate = 0;
+  block->nominal_speed = 1.0;
+  block->millimeters = 0;
+  block->acceleration = 0;
+  block->entry_speed = block->max_entry_speed = 0;
+  block->nominal_length_flag = true;
+  block->recalculate_flag = true;
+  calculate_trapezoid_for_block(block, 1.0, 1.0);
+
+  // the move after starts as from a stop
+#ifdef JUNCTION_DEVIATION
+  previous_xyz_move = false;
+#else
+  memset(previous_speed, 0, sizeof(previous_speed));
+#endif
+  previous_nominal_speed = 0;
+#ifdef STATE_SYNC_WITH_MOVES
+  blocks_added++;
+#endif
+
+  MEMORY_BARRIER();
+  block_buffer_head = next_buffer_head;
+  TRACE_EVENT(TRACE_PLAN_LINE, movesplanned());
+#ifdef DELTA_SEGMENT_BATCH
+  plan_recalculate_or_defer();
+#else
+  planner_recalculate();
+#endif
+  st_wake_up();
 }
-#endif // ENABLE_AUTO_BED_LEVELING
+#endif
 
-#ifdef ENABLE_AUTO_BED_LEVELING
-void plan_set_position(float x, float y, float z, const float &e)
+#ifdef PLANNER_PRIMING
+void plan_check_priming()
 {
-  apply_rotation_xyz(plan_bed_level_matrix, x, y, z);
+  if(block_buffer_priming && millis() - priming_start >= PLANNER_PRIMING_MS)
+    block_buffer_priming = false;
+}
+
+void plan_end_priming()
+{
+  block_buffer_priming = false;
+}
+#endif
+
+#ifdef SEGMENT_MERGE
+// The held move runs from merge_start to merge_last, in the coordinates plan_buffer_line() gets
+static bool merge_pending = false;
+static float merge_start[NUM_AXIS];
+static float merge_last[NUM_AXIS]; // end of the last move given to plan_buffer_line()
+static float merge_feed_rate;
+static uint8_t merge_extruder;
+#ifdef REALTIME_FEEDRATE_OVERRIDE
+static int merge_feed_multiply;
+#endif
+#ifdef SD_EXECUTED_POSITION
+static uint32_t merge_sdpos; // of the command of the first segment
+#endif
+static uint8_t merge_count;
+
+// Whether the move from merge_last to target continues the held move
+static bool segment_continues(const float *target)
+{
+  float held[3], added[3], merged[3];
+  for(int8_t i=0; i < 3; i++) {
+    held[i] = merge_last[i] - merge_start[i];
+    added[i] = target[i] - merge_last[i];
+    merged[i] = target[i] - merge_start[i];
+  }
+  float held_mm = sqrt(square(held[X_AXIS]) + square(held[Y_AXIS]) + square(held[Z_AXIS]));
+  float added_mm = sqrt(square(added[X_AXIS]) + square(added[Y_AXIS]) + square(added[Z_AXIS]));
+  if(held_mm == 0.0 || added_mm == 0.0) return false; // E only moves stay apart
+  if(held[X_AXIS]*added[X_AXIS] + held[Y_AXIS]*added[Y_AXIS] + held[Z_AXIS]*added[Z_AXIS] <= 0.0) return false;
+
+  // Same kind of move (travel, printing or retracting) with about the same extrusion per mm
+  float held_e = merge_last[E_AXIS] - merge_start[E_AXIS];
+  float added_e = target[E_AXIS] - merge_last[E_AXIS];
+  if((held_e > 0.0) != (added_e > 0.0) || (held_e < 0.0) != (added_e < 0.0)) return false;
+  if(held_e != 0.0) {
+    float held_ratio = held_e / held_mm;
+    if(fabs(added_e / added_mm - held_ratio) > fabs(held_ratio) * SEGMENT_MERGE_E_RATIO) return false;
+  }
+
+  // Distance of the corner at merge_last from the merged line: |held x merged| / |merged|
+  float cross_x = held[Y_AXIS]*merged[Z_AXIS] - held[Z_AXIS]*merged[Y_AXIS];
+  float cross_y = held[Z_AXIS]*merged[X_AXIS] - held[X_AXIS]*merged[Z_AXIS];
+  float cross_z = held[X_AXIS]*merged[Y_AXIS] - held[Y_AXIS]*merged[X_AXIS];
+  float merged_sq = square(merged[X_AXIS]) + square(merged[Y_AXIS]) + square(merged[Z_AXIS]);
+  return square(cross_x) + square(cross_y) + square(cross_z) <= square(SEGMENT_MERGE_DEVIATION) * merged_sq;
+}
+
+#ifdef ENABLE_AUTO_BED_LEVELING
+void plan_buffer_line(float x, float y, float z, const float &e, float feed_rate, const uint8_t &extruder)
 #else
-void plan_set_position(const float &x, const float &y, const float &z, const float &e)
+void plan_buffer_line(const float &x, const float &y, const float &z, const float &e, float feed_rate, const uint8_t &extruder)
+#endif  //ENABLE_AUTO_BED_LEVELING
+{
+  float target[NUM_AXIS] = { x, y, z, e };
+  if(merge_pending && merge_count < SEGMENT_MERGE_MAX && extruder == merge_extruder
+     && feed_rate == merge_feed_rate
+#ifdef REALTIME_FEEDRATE_OVERRIDE
+     && plan_feed_multiply == merge_feed_multiply
+#endif
+     && segment_continues(target)) {
+    merge_count++;
+  }
+  else {
+    plan_flush_pending();
+    memcpy(merge_start, merge_last, sizeof(merge_start));
+    merge_feed_rate = feed_rate;
+#ifdef REALTIME_FEEDRATE_OVERRIDE
+    merge_feed_multiply = plan_feed_multiply;
+#endif
+#ifdef SD_EXECUTED_POSITION
+    merge_sdpos = plan_sdpos;
+#endif
+    merge_extruder = extruder;
+    merge_count = 1;
+    merge_pending = true;
+  }
+  memcpy(merge_last, target, sizeof(merge_last));
+  if(merge_count >= SEGMENT_MERGE_MAX)
+    plan_flush_pending();
+  else
+    plan_check_pending();
+}
+
+void plan_flush_pending()
+{
+  if(!merge_pending) return;
+  merge_pending = false; // first, plan_queue_line() may wait in manage_inactivity()
+#ifdef REALTIME_FEEDRATE_OVERRIDE
+  int feed_multiply = plan_feed_multiply;
+  plan_feed_multiply = merge_feed_multiply;
+#endif
+#ifdef SD_EXECUTED_POSITION
+  uint32_t sdpos = plan_sdpos;
+  plan_sdpos = merge_sdpos;
+#endif
+  plan_queue_line(merge_last[X_AXIS], merge_last[Y_AXIS], merge_last[Z_AXIS], merge_last[E_AXIS],
+                  merge_feed_rate, merge_extruder);
+#ifdef REALTIME_FEEDRATE_OVERRIDE
+  plan_feed_multiply = feed_multiply;
+#endif
+#ifdef SD_EXECUTED_POSITION
+  plan_sdpos = sdpos;
+#endif
+}
+
+void plan_check_pending()
+{
+  if(merge_pending && movesplanned() < SEGMENT_MERGE_MIN_QUEUED)
+    plan_flush_pending();
+}
+
+void plan_discard_pending()
+{
+  merge_pending = false;
+}
+#endif //SEGMENT_MERGE
+
+void plan_stepper_position(float *xyz)
 {
+  float x, y;
+  kin_xy_axis_steps(st_get_position(X_AXIS), st_get_position(Y_AXIS), x, y); // the stepper counts motor steps
+#ifdef ENABLE_AUTO_BED_LEVELING
+	vector_3 position = vector_3(x / axis_steps_per_unit[X_AXIS], y / axis_steps_per_unit[Y_AXIS], st_get_position_mm(Z_AXIS));
+
+#ifdef BED_LEVEL_SHEAR_MAX_TILT
+	if (bed_level_shear) {
+		position.z = (position.z - position.x * bed_level_shear_x - position.y * bed_level_shear_y) / bed_level_shear_z;
+	} else
+#endif
+	{
+		//position.debug("in plan_get position");
+		//plan_bed_level_matrix.debug("in plan_get bed_level");
+		matrix_3x3 inverse = matrix_3x3::transpose(plan_bed_level_matrix);
+		//inverse.debug("in plan_get inverse");
+		position.apply_rotation(inverse);
+		//position.debug("after rotation");
+	}
+#ifdef MESH_BED_LEVELING
+	position.z -= mesh_z_offset(position.x, position.y);
+#endif
+  xyz[X_AXIS] = position.x;
+  xyz[Y_AXIS] = position.y;
+  xyz[Z_AXIS] = position.z;
+#else
+  xyz[X_AXIS] = x / axis_steps_per_unit[X_AXIS];
+  xyz[Y_AXIS] = y / axis_steps_per_unit[Y_AXIS];
+  xyz[Z_AXIS] = float(st_get_position(Z_AXIS)) / axis_steps_per_unit[Z_AXIS];
 #endif // ENABLE_AUTO_BED_LEVELING
+}
+
+#ifdef ENABLE_AUTO_BED_LEVELING
+vector_3 plan_get_position() {
+  float position[3];
+  plan_stepper_position(position);
+  return vector_3(position[X_AXIS], position[Y_AXIS], position[Z_AXIS]);
+}
+#endif // ENABLE_AUTO_BED_LEVELING
+
+// Make the planner position in steps the given one, as the stepper will be at it once the queue is done
+static void plan_position_steps(float x, float y, float z, const float &e)
+{
+#ifdef SEGMENT_MERGE
+  plan_flush_pending();
+  merge_last[X_AXIS] = x;
+  merge_last[Y_AXIS] = y;
+  merge_last[Z_AXIS] = z;
+  merge_last[E_AXIS] = e;
+#endif
+#ifdef MESH_BED_LEVELING
+  mesh_last[X_AXIS] = x;
+  mesh_last[Y_AXIS] = y;
+  mesh_last[Z_AXIS] = z;
+  mesh_last[E_AXIS] = e;
+  z += mesh_z_offset(x, y);
+#endif
+#ifdef ENABLE_AUTO_BED_LEVELING
+  plan_apply_bed_level(x, y, z);
+#endif
 
+#ifdef STEP_SPACE_POSITION
+  step_space_set(X_AXIS, x);
+  step_space_set(Y_AXIS, y);
+  step_space_set(Z_AXIS, z);
+  step_space_set(E_AXIS, e);
+#else
   position[X_AXIS] = lround(x*axis_steps_per_unit[X_AXIS]);
   position[Y_AXIS] = lround(y*axis_steps_per_unit[Y_AXIS]);
   position[Z_AXIS] = lround(z*axis_steps_per_unit[Z_AXIS]);     
   position[E_AXIS] = lround(e*axis_steps_per_unit[E_AXIS]);  
-  st_set_position(position[X_AXIS], position[Y_AXIS], position[Z_AXIS], position[E_AXIS]);
+#endif
+}
+
+#ifdef ENABLE_AUTO_BED_LEVELING
+void plan_set_position(float x, float y, float z, const float &e)
+{
+#else
+void plan_set_position(const float &x, const float &y, const float &z, const float &e)
+{
+#endif // ENABLE_AUTO_BED_LEVELING
+  plan_position_steps(x, y, z, e);
+  long a, b;
+  kin_xy_motor_steps(position[X_AXIS], position[Y_AXIS], a, b);
+  st_set_position(a, b, position[Z_AXIS], position[E_AXIS]);
   previous_nominal_speed = 0.0; // Resets planner junction speeds. Assumes start from rest.
+#ifndef JUNCTION_DEVIATION
   previous_speed[0] = 0.0;
   previous_speed[1] = 0.0;
   previous_speed[2] = 0.0;
   previous_speed[3] = 0.0;
+#endif
+}
+
+#ifdef PLANNED_TOOLCHANGE
+void plan_shift_position(const float &x, const float &y, const float &z, const float &e)
+{
+  long before[NUM_AXIS];
+  memcpy(before, position, sizeof(before));
+  plan_position_steps(x, y, z, e);
+  long shift_a, shift_b;
+  kin_xy_motor_steps(position[X_AXIS] - before[X_AXIS], position[Y_AXIS] - before[Y_AXIS], shift_a, shift_b);
+  st_shift_position(shift_a, shift_b, position[Z_AXIS] - before[Z_AXIS], position[E_AXIS] - before[E_AXIS]);
+}
+#endif
+
+#ifdef DELTA_SEGMENT_BATCH
+void plan_defer_recalculation(bool defer)
+{
+  recalculation_deferred = defer;
+  if(!defer && recalculation_pending) {
+    planner_recalculate();
+    recalculation_pending = false;
+  }
 }
+#endif
 
 void plan_set_e_position(const float &e)
 {
+#ifdef SEGMENT_MERGE
+  plan_flush_pending();
+  merge_last[E_AXIS] = e;
+#endif
+#ifdef MESH_BED_LEVELING
+  mesh_last[E_AXIS] = e;
+#endif
+#ifdef STEP_SPACE_POSITION
+  step_space_set(E_AXIS, e);
+#else
   position[E_AXIS] = lround(e*axis_steps_per_unit[E_AXIS]);  
+#endif
   st_set_e_position(position[E_AXIS]);
 }
 
+#ifdef STEP_SPACE_POSITION
+void plan_shift_e_origin(float offset)
+{
+  position_mm[E_AXIS] -= offset;
+#ifdef SEGMENT_MERGE
+  merge_start[E_AXIS] -= offset;
+  merge_last[E_AXIS] -= offset;
+#endif
+#ifdef MESH_BED_LEVELING
+  mesh_last[E_AXIS] -= offset;
+#endif
+}
+#endif
+
 uint8_t movesplanned()
 {
   return (block_buffer_head-block_buffer_tail + BLOCK_BUFFER_SIZE) & (BLOCK_BUFFER_SIZE - 1);
 }
 
+#ifdef REALTIME_FEEDRATE_OVERRIDE
+void plan_feedrate_override(int multiply)
+{
+  // blocks the stepper finishes meanwhile are not planned again before this returns
+  for(uint8_t block_index = block_buffer_tail; block_index != block_buffer_head; block_index = next_block_index(block_index)) {
+    block_t *block = &block_buffer[block_index];
+    if(block->feed_multiply == 0)
+      continue;
+    unsigned long scale = OVERRIDE_SCALE_ONE;
+    if(multiply < block->feed_multiply)
+      scale = (float)multiply / block->feed_multiply * OVERRIDE_SCALE_ONE;
+    CRITICAL_SECTION_START;
+    block->override_scale = scale;
+    CRITICAL_SECTION_END;
+  }
+}
+#endif
+
+#ifdef SD_EXECUTED_POSITION
+uint32_t plan_executed_sdpos()
+{
+  // blocks are only ever retired by the stepper interrupt
+  CRITICAL_SECTION_START;
+  uint32_t sdpos = blocks_queued() ? block_buffer[block_buffer_tail].sdpos : plan_sdpos;
+  CRITICAL_SECTION_END;
+  return sdpos;
+}
+#endif
+
+#ifdef PID_EXTRUSION_FEEDFORWARD
+float plan_extrusion_rate(uint8_t extruder, unsigned int window_ms)
+{
+  float window = window_ms * 0.001;
+  float left = window;
+  float e_steps = 0;
+  int8_t block_index = block_buffer_tail;
+  while(block_index != block_buffer_head && left > 0) {
+    block_t *block = &block_buffer[block_index];
+    float duration = (float)block->step_event_count / block->nominal_rate;
+    if(block->active_extruder == extruder && block->steps_e > 0
+      && (block->steps_x || block->steps_y || block->steps_z)
+      && !(block->direction_bits & (1<<E_AXIS)))
+    {
+      // Only the part of the last block that falls inside the window counts
+      e_steps += duration > left ? block->steps_e * left / duration : block->steps_e;
+    }
+    left -= duration;
+    block_index = next_block_index(block_index);
+  }
+  if(window <= 0) return 0;
+  return e_steps / axis_steps_per_unit[E_AXIS] / window;
+}
+#endif
+
 #ifdef PREVENT_DANGEROUS_EXTRUDE
 void set_extrude_min_temp(float temp)
 {
@@ -991,6 +2206,74 @@ void set_extrude_min_temp(float temp)
 }
 #endif
 
+#ifdef PRINT_TIME_ESTIMATE
+void plan_time_report()
+{
+  CRITICAL_SECTION_START;
+  unsigned long long executed = executed_move_us;
+  CRITICAL_SECTION_END;
+  SERIAL_ECHO_START;
+  SERIAL_ECHOPGM("Move time s planned:");
+  SERIAL_ECHO(planned_move_us / 1000000.0);
+  SERIAL_ECHOPGM(" executed:");
+  SERIAL_ECHO(executed / 1000000.0);
+  SERIAL_ECHOPGM(" queued:");
+  SERIAL_ECHOLN((planned_move_us - executed) / 1000000.0);
+}
+
+void plan_time_reset()
+{
+  CRITICAL_SECTION_START;
+  planned_move_us -= executed_move_us;
+  executed_move_us = 0;
+  CRITICAL_SECTION_END;
+}
+#endif //PRINT_TIME_ESTIMATE
+
+#ifdef PLANNER_PROFILE
+static void planner_timing_report(const char *name_P, const planner_timing_t *timing)
+{
+  serialprintPGM(name_P);
+  SERIAL_ECHOPGM(" avg:");
+  SERIAL_ECHO(profiled_lines ? timing->total / profiled_lines : 0);
+  SERIAL_ECHOPGM(" max:");
+  SERIAL_ECHOLN(timing->max);
+}
+
+void plan_profile_report()
+{
+  SERIAL_ECHO_START;
+  SERIAL_ECHOPGM("Planner lines:");
+  SERIAL_ECHOLN(profiled_lines);
+  SERIAL_ECHO_START;
+  planner_timing_report(PSTR("plan_buffer_line us"), &timing_buffer_line);
+  SERIAL_ECHO_START;
+  planner_timing_report(PSTR("reverse pass us"), &timing_reverse_pass);
+  SERIAL_ECHO_START;
+  planner_timing_report(PSTR("forward pass us"), &timing_forward_pass);
+  SERIAL_ECHO_START;
+  planner_timing_report(PSTR("trapezoids us"), &timing_trapezoids);
+  SERIAL_ECHO_START;
+  SERIAL_ECHOPGM("Queue depth:");
+  for(int8_t i=0; i < BLOCK_BUFFER_SIZE; i++)
+  {
+    SERIAL_ECHOPGM(" ");
+    SERIAL_ECHO(queue_depth_histogram[i]);
+  }
+  SERIAL_ECHOLN("");
+}
+
+void plan_profile_reset()
+{
+  memset(&timing_buffer_line, 0, sizeof(timing_buffer_line));
+  memset(&timing_reverse_pass, 0, sizeof(timing_reverse_pass));
+  memset(&timing_forward_pass, 0, sizeof(timing_forward_pass));
+  memset(&timing_trapezoids, 0, sizeof(timing_trapezoids));
+  memset(queue_depth_histogram, 0, sizeof(queue_depth_histogram));
+  profiled_lines = 0;
+}
+#endif //PLANNER_PROFILE
+
 // Calculate the steps/s^2 acceleration rates, based on the mm/s^s
 void reset_acceleration_rates()
 {
@@ -999,3 +2282,18 @@ void reset_acceleration_rates()
         axis_steps_per_sqr_second[i] = max_acceleration_units_per_sq_second[i] * axis_steps_per_unit[i];
         }
 }
+
+void reset_extrusion_factors()
+{
+  for(int8_t e=0; e < EXTRUDERS; e++)
+  {
+    extrusion_factor[e] = volumetric_multiplier[e] * extrudemultiply / 100.0;
+    extrusion_mm_per_step[e] = extrusion_factor[e] / axis_steps_per_unit[E_AXIS];
+#ifdef VOLUMETRIC_FLOW_LIMIT
+    // volumetric_multiplier is 1 / filament area after M200 D, and 1 without it
+    float area = volumetric_multiplier[e] != 1.0 ? 1.0 / volumetric_multiplier[e]
+                                                 : M_PI * square(VOLUMETRIC_FLOW_FILAMENT_DIA * 0.5);
+    flow_max_e_speed[e] = volumetric_flow_max[e] / area;
+#endif
+  }
+}
@@ -25,6 +25,7 @@
 #define planner_h
 
 #include "Marlin.h"
+#include "event_trace.h"
 
 #ifdef ENABLE_AUTO_BED_LEVELING
 #include "vector_3.h"
@@ -47,6 +48,31 @@ typedef struct {
     volatile long final_advance;
     float advance;
   #endif
+  #ifdef S_CURVE_ACCELERATION
+    unsigned long cruise_rate;                // Rate at the end of acceleration and start of deceleration
+    unsigned long accel_inverse, decel_inverse; // 2^39 / scaled ramp durations in timer ticks, 0 for a linear ramp
+    signed char accel_shift, decel_shift;     // Scaling of the ramp durations to 2^16..2^17 ticks
+  #endif
+  #ifdef LIN_ADVANCE
+    unsigned long advance_k24;              // Extra E steps per step event/s, in 1/2^24 steps
+  #endif
+  #ifdef PRINT_TIME_ESTIMATE
+    unsigned long duration_us;              // Time the trapezoid takes to step
+  #endif
+  #ifdef AUTOTEMP
+    float e_speed;                          // Extrusion speed in mm/s, 0 for moves without X, Y or Z
+  #endif
+  #ifdef SD_EXECUTED_POSITION
+    uint32_t sdpos;                         // File position of the SD command that planned the block
+  #endif
+  #ifdef TRAVEL_MICROSTEP_FACTOR
+    bool travel_microsteps;                 // steps_x and steps_y are TRAVEL_MICROSTEP_FACTOR times coarser
+  #endif
+  #ifdef REALTIME_FEEDRATE_OVERRIDE
+    unsigned long override_scale;           // Time scale the stepper slows this block to, OVERRIDE_SCALE_ONE for none
+    unsigned short override_ramp;           // Largest change of the time scale per timer tick
+    unsigned short feed_multiply;           // feedmultiply the nominal speed was planned with, 0 if it does not apply
+  #endif
 
   // Fields used by the motion planner to manage acceleration
 //  float speed_x, speed_y, speed_z, speed_e;        // Nominal mm/sec for each axis
@@ -55,25 +81,72 @@ typedef struct {
   float max_entry_speed;                             // Maximum allowable junction entry speed in mm/sec
   float millimeters;                                 // The total travel of this block in mm
   float acceleration;                                // acceleration mm/sec^2
+  #ifdef COMPACT_BLOCKS
+  // Only the planner uses these; busy, which the stepper writes, must stay in a byte of its own
+  unsigned char recalculate_flag : 1;                // Planner flag to recalculate trapezoids on entry junction
+  unsigned char nominal_length_flag : 1;             // Planner flag for nominal speed always reached
+  #else
   unsigned char recalculate_flag;                    // Planner flag to recalculate trapezoids on entry junction
   unsigned char nominal_length_flag;                 // Planner flag for nominal speed always reached
+  #endif
 
   // Settings for the trapezoid generator
   unsigned long nominal_rate;                        // The nominal step rate for this block in step_events/sec 
   unsigned long initial_rate;                        // The jerk-adjusted step rate at start of block  
   unsigned long final_rate;                          // The minimal rate at exit
   unsigned long acceleration_st;                     // acceleration steps/sec^2
+  #ifdef COMPACT_BLOCKS
+  unsigned char fan_speed;                           // fanSpeed is 0..255
+  #ifdef BARICUDA
+  unsigned char valve_pressure;
+  unsigned char e_to_p_pressure;
+  #endif
+  #else
   unsigned long fan_speed;
   #ifdef BARICUDA
   unsigned long valve_pressure;
   unsigned long e_to_p_pressure;
   #endif
+  #endif
+  #ifdef LASER_PWM
+  unsigned char laser_power;                         // laser_power is 0..255
+  #ifdef LASER_POWER_FOLLOWS_SPEED
+  unsigned long laser_scale;                         // laser_power per step_events/sec, in 1/65536
+  #endif
+  #ifdef LASER_RASTER
+  unsigned char raster_pixels;                       // pixels along a G7 move, 0 for a move at one power
+  unsigned char raster_start;                        // index of its first pixel in raster_buffer
+  unsigned long raster_pixel_events;                 // step events per pixel, in 1/256
+  #endif
+  #endif
   volatile char busy;
 } block_t;
 
 #ifdef ENABLE_AUTO_BED_LEVELING
 // this holds the required transform to compensate for bed level
 extern matrix_3x3 plan_bed_level_matrix;
+
+// Call after changing plan_bed_level_matrix
+void plan_bed_level_changed();
+
+#ifdef BED_LEVEL_EEPROM
+// The plane found by the last G29 (identity with MESH_BED_LEVELING, whose mesh is kept in bed_level_mesh),
+// valid while bed_level_stored is set. M420 applies it again.
+extern matrix_3x3 bed_level_stored_matrix;
+extern bool bed_level_stored;
+#endif
+
+#ifdef MESH_BED_LEVELING
+#define MESH_X_DIST ((RIGHT_PROBE_BED_POSITION - LEFT_PROBE_BED_POSITION) / (AUTO_BED_LEVELING_GRID_POINTS-1))
+#define MESH_Y_DIST ((BACK_PROBE_BED_POSITION - FRONT_PROBE_BED_POSITION) / (AUTO_BED_LEVELING_GRID_POINTS-1))
+// Bed height at the G29 probe points, [y][x] from the front left, relative to the last point probed.
+// Only applied to moves while bed_level_mesh_active is set.
+extern float bed_level_mesh[AUTO_BED_LEVELING_GRID_POINTS][AUTO_BED_LEVELING_GRID_POINTS];
+extern bool bed_level_mesh_active;
+
+// Bed height at x, y interpolated from the mesh, 0 while it is not active
+float mesh_z_offset(float x, float y);
+#endif
 #endif // #ifdef ENABLE_AUTO_BED_LEVELING
 
 // Initialize the motion plan subsystem      
@@ -91,6 +164,10 @@ vector_3 plan_get_position();
 void plan_buffer_line(const float &x, const float &y, const float &z, const float &e, float feed_rate, const uint8_t &extruder);
 #endif // ENABLE_AUTO_BED_LEVELING
 
+// Where the steppers are in the coordinates plan_buffer_line() takes (the carriage heights on a DELTA):
+// the COREXY motor steps and the bed leveling are taken out of the stepper counts
+void plan_stepper_position(float *xyz);
+
 // Set position. Used for G92 instructions.
 #ifdef ENABLE_AUTO_BED_LEVELING
 void plan_set_position(float x, float y, float z, const float &e);
@@ -100,11 +177,102 @@ void plan_set_position(const float &x, const float &y, const float &z, const flo
 
 void plan_set_e_position(const float &e);
 
+#ifdef STEP_SPACE_POSITION
+// The E coordinates given to the planner become offset mm smaller, the planned steps stay
+void plan_shift_e_origin(float offset);
+#endif
+
+#ifdef PLANNED_TOOLCHANGE
+// Like plan_set_position() for the position a tool change gives the same place, but without waiting for
+// the queue: the stepper counts are shifted by the same steps and the next move joins the last one.
+void plan_shift_position(const float &x, const float &y, const float &z, const float &e);
+#endif
+
+#ifdef SEGMENT_MERGE
+// Queue the move plan_buffer_line() is holding back for merging. Done before anything that waits for
+// or changes the planned position; plan_check_pending() does it when the stepper is about to run dry.
+void plan_flush_pending();
+void plan_check_pending();
+// Forget the held move, after quickStop()
+void plan_discard_pending();
+#endif
+
+#ifdef QUEUED_DWELL
+// Queue a pause of ms milliseconds after the planned moves. The dwell block has no steps and a step
+// event per millisecond, its neighbours stop at it.
+void plan_dwell(unsigned long ms);
+#define BLOCK_IS_DWELL(block) (((block)->steps_x | (block)->steps_y | (block)->steps_z | (block)->steps_e) == 0)
+#endif
+
+#ifdef PLANNER_STARVATION_STATS
+// Source of the command being processed, the underruns and late moves are counted for it
+#define PLAN_SOURCE_SERIAL 0
+#define PLAN_SOURCE_SD 1
+extern uint8_t plan_source;
+void plan_starvation_report();
+void plan_starvation_reset();
+#endif
+
+#ifdef PLANNER_PRIMING
+// Let the stepper start the queued moves: plan_check_priming() once PLANNER_PRIMING_MS have passed,
+// plan_end_priming() right away, before waiting for the moves
+void plan_check_priming();
+void plan_end_priming();
+#endif
+
+#ifdef DELTA_SEGMENT_BATCH
+// While deferred, plan_buffer_line() queues blocks without replanning the buffer.
+// Ending the deferral replans once for all the blocks added meanwhile.
+void plan_defer_recalculation(bool defer);
+#endif
+
 
 
 void check_axes_activity();
 uint8_t movesplanned(); //return the nr of buffered moves
 
+#ifdef PID_EXTRUSION_FEEDFORWARD
+// Average filament feed (mm/s) of the given extruder over the next window_ms of planned moves.
+// Retractions and moves without X/Y/Z travel are left out, as they don't melt new plastic.
+float plan_extrusion_rate(uint8_t extruder, unsigned int window_ms);
+#endif
+
+#ifdef PRINT_TIME_ESTIMATE
+extern volatile unsigned long long executed_move_us; // duration of the blocks the stepper has finished
+#endif
+
+#ifdef LIN_ADVANCE
+extern float extruder_advance_k; // s of filament feed the extruder runs ahead by (M900 K)
+#endif
+
+#ifdef SD_EXECUTED_POSITION
+// File position of the SD command being processed, the blocks planned now get it
+extern uint32_t plan_sdpos;
+// File position of the command the stepper runs the moves of, plan_sdpos while the queue is empty
+uint32_t plan_executed_sdpos();
+#endif
+
+#ifdef LASER_RASTER
+// Pixel powers of the queued G7 moves, indexed modulo LASER_RASTER_BUFFER. raster_tail is the first one
+// still needed and moves on as the blocks are discarded.
+extern unsigned char raster_buffer[LASER_RASTER_BUFFER];
+extern volatile unsigned char raster_tail;
+// Give the next planned block these pixels, waiting for room in the ring. count 0 drops pixels that no
+// block took, as of a move too short to plan.
+void plan_raster_pixels(const unsigned char *pixels, uint8_t count);
+#endif
+
+#ifdef REALTIME_FEEDRATE_OVERRIDE
+// The stepper runs a block slowed down in time by override_scale / 2^24: every speed is scaled by it,
+// the accelerations by its square, so the slowed block stays within the limits it was planned for.
+#define OVERRIDE_SCALE_ONE (1UL << 24)
+// feedmultiply the moves planned now include, 0 while planning moves it does not apply to
+extern int plan_feed_multiply;
+// Slow the queued blocks down to a new feedmultiply, or let them back up to the speed they were planned
+// with. A feedmultiply above that takes effect with the blocks planned after the change.
+void plan_feedrate_override(int multiply);
+#endif
+
 extern unsigned long minsegmenttime;
 extern float max_feedrate[4]; // set the max speeds
 extern float axis_steps_per_unit[4];
@@ -131,25 +299,109 @@ extern unsigned long axis_steps_per_sqr_second[NUM_AXIS];
 extern block_t block_buffer[BLOCK_BUFFER_SIZE];            // A ring buffer for motion instfructions
 extern volatile unsigned char block_buffer_head;           // Index of the next block to be pushed
 extern volatile unsigned char block_buffer_tail; 
+// The block ring has one producer, plan_buffer_line() in the main loop, and one consumer, the stepper
+// interrupt. Only the planner moves block_buffer_head and only the stepper moves block_buffer_tail and
+// sets busy. While planner_recalculate() is rewriting the plan it sets block_buffer_hold, and the
+// stepper does not start that block (or, as it goes in order, any after it), so no block is ever
+// changed after the stepper has started it and neither side needs cli().
+extern volatile unsigned char block_buffer_hold;
+#define BLOCK_HOLD_NONE 0xff
+#ifdef PLANNER_PRIMING
+// Set while the stepper waits for the queue to fill after it ran dry
+extern volatile bool block_buffer_priming;
+#endif
+#ifdef PLANNER_STARVATION_STATS
+// Set when the stepper retires the last queued block, cleared by st_synchronize(), which waits for that
+extern volatile bool plan_starved;
+extern volatile bool plan_lines_waiting; // kept by manage_inactivity(), plan_starved is only set while true
+#endif
+#ifdef REALTIME_COMMANDS
+// Set by a P000 line, cleared by R000: no block is added, the planned ones run out and stop
+extern volatile bool plan_feed_hold;
+#endif
+
+// Queued blocks that move each axis: added by the planner minus retired by the stepper, each counter
+// written by one side only like the ring indexes.
+extern unsigned char axis_blocks_added[NUM_AXIS];
+extern volatile unsigned char axis_blocks_retired[NUM_AXIS];
+#ifdef STATE_SYNC_WITH_MOVES
+extern unsigned char blocks_added;
+extern volatile unsigned char blocks_retired;
+#endif
+#ifdef THROUGHPUT_BENCHMARK
+extern unsigned long plan_block_count; // blocks ever planned, for the rate M818 reports
+#endif
+#ifdef PRINT_STATISTICS
+extern long plan_filament_steps; // E steps planned less the retracted ones, until the print statistics take them
+#endif
+
 // Called when the current block is no longer needed. Discards the block and makes the memory
 // availible for new blocks.    
 FORCE_INLINE void plan_discard_current_block()  
 {
   if (block_buffer_head != block_buffer_tail) {
+    block_t *block = &block_buffer[block_buffer_tail];
+    if (block->steps_x != 0) axis_blocks_retired[X_AXIS]++;
+    if (block->steps_y != 0) axis_blocks_retired[Y_AXIS]++;
+    if (block->steps_z != 0) axis_blocks_retired[Z_AXIS]++;
+    if (block->steps_e != 0) axis_blocks_retired[E_AXIS]++;
+    #ifdef STATE_SYNC_WITH_MOVES
+      blocks_retired++;
+    #endif
+    #ifdef PRINT_TIME_ESTIMATE
+      executed_move_us += block->duration_us;
+    #endif
+    #ifdef LASER_RASTER
+      if (block->raster_pixels)
+        raster_tail = block->raster_start + block->raster_pixels;
+    #endif
+    MEMORY_BARRIER(); // done with the block before handing it back
     block_buffer_tail = (block_buffer_tail + 1) & (BLOCK_BUFFER_SIZE - 1);  
+    TRACE_EVENT(TRACE_BLOCK_DONE, movesplanned());
+    #ifdef PLANNER_STARVATION_STATS
+      if (block_buffer_tail == block_buffer_head && plan_lines_waiting)
+        plan_starved = true;
+    #endif
   }
 }
 
-// Gets the current block. Returns NULL if buffer empty
+// Gets the current block. Returns NULL if buffer empty or the block is being replanned
 FORCE_INLINE block_t *plan_get_current_block() 
 {
-  if (block_buffer_head == block_buffer_tail) { 
+  if (block_buffer_head == block_buffer_tail || block_buffer_tail == block_buffer_hold) { 
     return(NULL); 
   }
+  #ifdef PLANNER_PRIMING
+  if (block_buffer_priming)
+    return(NULL);
+  #endif
   block_t *block = &block_buffer[block_buffer_tail];
   block->busy = true;
+  MEMORY_BARRIER();
+  return(block);
+}
+
+#ifdef STEP_SEGMENTS
+// Gets the block at block_index for the segment preparation, which starts the blocks ahead of the
+// stepper. Returns NULL if it is not queued yet, or it or a block before it is being replanned.
+FORCE_INLINE block_t *plan_get_block(unsigned char block_index)
+{
+  unsigned char tail = block_buffer_tail;
+  unsigned char hold = block_buffer_hold;
+  if (block_index == block_buffer_head || (hold != BLOCK_HOLD_NONE &&
+      ((hold - tail) & (BLOCK_BUFFER_SIZE - 1)) <= ((block_index - tail) & (BLOCK_BUFFER_SIZE - 1)))) {
+    return(NULL);
+  }
+  #ifdef PLANNER_PRIMING
+  if (block_buffer_priming)
+    return(NULL);
+  #endif
+  block_t *block = &block_buffer[block_index];
+  block->busy = true;
+  MEMORY_BARRIER();
   return(block);
 }
+#endif
 
 // Gets the current block. Returns NULL if buffer empty
 FORCE_INLINE bool blocks_queued() 
@@ -166,4 +418,20 @@ void set_extrude_min_temp(float temp);
 #endif
 
 void reset_acceleration_rates();
+// Recompute the E scaling of planned moves after M200, M221 or M92 E changed one of its inputs
+void reset_extrusion_factors();
+
+#ifdef VOLUMETRIC_FLOW_LIMIT
+extern float volumetric_flow_max[EXTRUDERS]; // mm^3/s each hotend melts at most, 0 for no limit; reset_extrusion_factors() after a change
+#endif
+
+#ifdef PLANNER_PROFILE
+void plan_profile_report(); // print time spent planning and the queue depth histogram
+void plan_profile_reset();
+#endif
+
+#ifdef PRINT_TIME_ESTIMATE
+void plan_time_report(); // print the move time planned, executed and still queued
+void plan_time_reset();  // start counting again from the moves in the queue
+#endif
 #endif
@@ -1,6 +1,6 @@
 #include "qr_solve.h"
 
-#ifdef AUTO_BED_LEVELING_GRID
+#if defined(AUTO_BED_LEVELING_GRID) || defined(DELTA_AUTO_CALIBRATION)
 
 #include <stdlib.h>
 #include <math.h>
@@ -1,6 +1,6 @@
 #include "Configuration.h"
 
-#ifdef AUTO_BED_LEVELING_GRID
+#if defined(AUTO_BED_LEVELING_GRID) || defined(DELTA_AUTO_CALIBRATION)
 
 void daxpy ( int n, double da, double dx[], int incx, double dy[], int incy );
 double ddot ( int n, double dx[], int incx, double dy[], int incy );
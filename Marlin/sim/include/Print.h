@@ -0,0 +1,16 @@
+// Host stand-in for the Arduino Print class, SdFile derives from it
+#ifndef SIM_PRINT_H
+#define SIM_PRINT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+class Print
+{
+public:
+  virtual size_t write(uint8_t c) = 0;
+  size_t write(const char *s) { size_t n = 0; while (*s) n += write((uint8_t)*s++); return n; }
+  size_t write(const uint8_t *buf, size_t size) { size_t n = 0; while (size--) n += write(*buf++); return n; }
+};
+
+#endif
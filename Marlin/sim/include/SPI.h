@@ -0,0 +1,12 @@
+// Host stand-in for the Arduino SPI library
+#ifndef SIM_SPI_H
+#define SIM_SPI_H
+
+struct SPIClass
+{
+  static void begin() {}
+  static uint8_t transfer(uint8_t) { return 0; }
+};
+extern SPIClass SPI;
+
+#endif
@@ -0,0 +1,12 @@
+// Host stand-in for the Arduino String class, only what MarlinSerial.h needs
+#ifndef SIM_WSTRING_H
+#define SIM_WSTRING_H
+
+class String
+{
+public:
+  unsigned int length() const { return 0; }
+  char operator[](unsigned int) const { return 0; }
+};
+
+#endif
@@ -0,0 +1,12 @@
+// Host stand-in for <avr/eeprom.h>
+#ifndef SIM_AVR_EEPROM_H
+#define SIM_AVR_EEPROM_H
+
+#include <stdint.h>
+
+extern uint8_t sim_eeprom[4096];
+static inline uint8_t eeprom_read_byte(const uint8_t *p) { return sim_eeprom[(uintptr_t)p & 4095]; }
+static inline void eeprom_write_byte(uint8_t *p, uint8_t v) { sim_eeprom[(uintptr_t)p & 4095] = v; }
+#define eeprom_is_ready() 1
+
+#endif
@@ -0,0 +1,12 @@
+// Host stand-in for <avr/interrupt.h>: an ISR is an ordinary function the simulation calls
+#ifndef SIM_AVR_INTERRUPT_H
+#define SIM_AVR_INTERRUPT_H
+
+#include <avr/io.h>
+
+#define ISR(vector, ...) extern "C" void vector(void)
+#define SIGNAL(vector) ISR(vector)
+#define cli()
+#define sei()
+
+#endif
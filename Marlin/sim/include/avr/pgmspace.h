@@ -0,0 +1,33 @@
+// Host stand-in for <avr/pgmspace.h>: program memory is ordinary memory
+#ifndef SIM_AVR_PGMSPACE_H
+#define SIM_AVR_PGMSPACE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define PGM_P const char *
+typedef char prog_char;
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+#define pgm_read_word_near(p) pgm_read_word(p)
+#define pgm_read_byte_near(p) pgm_read_byte(p)
+#define pgm_read_dword(p) (*(const uint32_t *)(p))
+#define pgm_read_float(p) (*(const float *)(p))
+#define pgm_read_float_near(p) pgm_read_float(p)
+#define pgm_read_dword_near(p) pgm_read_dword(p)
+#define pgm_read_ptr(p) (*(void * const *)(p))
+#define strcpy_P strcpy
+#define strncpy_P strncpy
+#define strcmp_P strcmp
+#define strncmp_P strncmp
+#define strlen_P strlen
+#define strstr_P strstr
+#define strchr_P strchr
+#define memcpy_P memcpy
+#define sprintf_P sprintf
+#define snprintf_P snprintf
+
+#endif
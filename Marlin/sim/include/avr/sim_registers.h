@@ -0,0 +1,16 @@
+// The AVR I/O registers the firmware touches, as plain variables. Included twice: by avr/io.h
+// to declare them and by sim_hw.cpp to define them.
+#define SIM_PORT(p) SIM_REG8(DDR##p) SIM_REG8(PORT##p) SIM_REG8(PIN##p)
+SIM_PORT(A) SIM_PORT(B) SIM_PORT(C) SIM_PORT(D) SIM_PORT(E) SIM_PORT(F)
+SIM_PORT(G) SIM_PORT(H) SIM_PORT(J) SIM_PORT(K) SIM_PORT(L)
+#undef SIM_PORT
+
+SIM_REG8(TCCR0A) SIM_REG8(TCCR0B) SIM_REG8(TIMSK0) SIM_REG8(TIFR0) SIM_REG8(OCR0A) SIM_REG8(OCR0B) SIM_REG8(TCNT0)
+SIM_REG8(TCCR1A) SIM_REG8(TCCR1B) SIM_REG8(TCCR1C) SIM_REG8(TIMSK1) SIM_REG8(TIFR1)
+SIM_REG16(OCR1A) SIM_REG16(OCR1B) SIM_REG16(OCR1C) SIM_REG16(TCNT1) SIM_REG16(ICR1)
+SIM_REG8(TCCR2A) SIM_REG8(TCCR2B) SIM_REG8(TIMSK2) SIM_REG8(OCR2A) SIM_REG8(OCR2B) SIM_REG8(TCNT2)
+SIM_REG8(ADCSRA) SIM_REG8(ADCSRB) SIM_REG8(ADMUX) SIM_REG8(DIDR0) SIM_REG8(DIDR2) SIM_REG16(ADC)
+SIM_REG8(SPCR) SIM_REG8(PRR0)
+SIM_REG8(UCSR0B) SIM_REG8(UCSR0C) SIM_REG8(UBRR0H) SIM_REG8(UBRR0L)
+SIM_REG8(UCSR1B) SIM_REG8(UCSR1C) SIM_REG8(UBRR1H) SIM_REG8(UBRR1L)
+SIM_REG8(SREG) SIM_REG8(MCUSR) SIM_REG16(SP)
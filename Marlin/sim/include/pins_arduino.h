@@ -0,0 +1,7 @@
+// Host stand-in for the Arduino variant pin tables
+#ifndef SIM_PINS_ARDUINO_H
+#define SIM_PINS_ARDUINO_H
+
+#define analogInputToDigitalPin(p) ((p) + 54) // the Mega layout, A0 is 54
+
+#endif
@@ -0,0 +1,8 @@
+// Host stand-in for <util/delay.h>
+#ifndef SIM_UTIL_DELAY_H
+#define SIM_UTIL_DELAY_H
+
+#define _delay_ms(ms)
+#define _delay_us(us)
+
+#endif
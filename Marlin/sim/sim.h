@@ -0,0 +1,31 @@
+#ifndef SIM_H
+#define SIM_H
+
+extern unsigned long long sim_ticks; // simulated time in timer 1 ticks
+void sim_run_isr();                  // run the stepper interrupt once and advance the clock to the next one
+
+// Used by the host builds of the whole firmware (sim_hw.cpp)
+extern void (*sim_millis_hook)();          // called by every millis(), sim_replay.cpp runs the interrupts from it
+extern void (*sim_serial_hook)(uint8_t c); // gets the bytes the firmware sends, instead of stderr
+void sim_serial_receive(uint8_t c);        // hand a byte to the receive interrupt
+extern uint8_t sim_serial_port;            // the UART the byte given to sim_serial_hook went out on, 0 or 1
+void sim_serial2_receive(uint8_t c);       // the same for UART 1 as SERIAL_PORT_2
+extern uint8_t (*sim_spi_hook)(uint8_t c); // gets each byte sent on the SPI bus and returns the one received
+extern void (*sim_pin_hook)(uint8_t pin, uint8_t value); // sees every digitalWrite()
+
+// The SD card on the SPI bus, backed by a disk image (sim_sdcard.cpp)
+struct sim_sd_stats_t
+{
+  unsigned long commands;
+  unsigned long single_reads;   // CMD17
+  unsigned long multi_reads;    // CMD18
+  unsigned long blocks_read;    // by either
+  unsigned long single_writes;  // CMD24
+  unsigned long multi_writes;   // CMD25
+  unsigned long blocks_written; // by either
+  unsigned long long bytes;     // SPI transfers with the card selected
+};
+extern sim_sd_stats_t sim_sd_stats;
+bool sim_sd_insert(const char *image);
+
+#endif
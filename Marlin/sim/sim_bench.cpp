@@ -0,0 +1,16 @@
+// Runs M804 (MATH_BENCHMARK) on the host build of the whole firmware:
+//
+//   marlin_bench
+//
+// setup() runs as on the printer, then M804 is queued and loop() processes it. The report goes to
+// stderr like all serial output of the host builds. The figures are nanoseconds on the host CPU, for
+// comparing one version of a function against another, not against the cycle counts of the printer.
+#include "Marlin.h"
+
+int main()
+{
+  setup();
+  enquecommand_P(PSTR("M804"));
+  loop();
+  return 0;
+}
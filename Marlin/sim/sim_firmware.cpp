@@ -0,0 +1,30 @@
+// The few parts of Marlin_main.cpp and temperature.cpp that planner.cpp and stepper.cpp use,
+// so marlin_sim links without the rest of the firmware
+#include "Marlin.h"
+#include "temperature.h"
+#include "sim.h"
+
+bool axis_known_position[3] = { false, false, false };
+uint8_t active_extruder = 0;
+int extrudemultiply = 100;
+float volumetric_multiplier[EXTRUDERS] = { 1.0 };
+int fanSpeed = 0;
+int target_temperature[EXTRUDERS] = { 0 };
+float current_temperature[EXTRUDERS] = { 0 };
+#ifdef DUAL_X_CARRIAGE
+bool extruder_duplication_enabled = false;
+bool extruder_duplication_mirrored = false;
+#endif
+
+void serial_echopair_P(const char *s_P, float v) { serialprintPGM(s_P); SERIAL_ECHO(v); }
+void serial_echopair_P(const char *s_P, double v) { serialprintPGM(s_P); SERIAL_ECHO(v); }
+void serial_echopair_P(const char *s_P, unsigned long v) { serialprintPGM(s_P); SERIAL_ECHO(v); }
+
+void manage_heater() {}
+void manage_inactivity() {}
+
+// Every wait of the firmware (a full block buffer, st_synchronize()) lets one stepper interrupt happen
+void idle()
+{
+  sim_run_isr();
+}
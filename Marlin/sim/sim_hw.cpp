@@ -0,0 +1,85 @@
+// The hardware side of the host builds: registers, clock and the Arduino functions
+#include "Marlin.h"
+#include "sim.h"
+#include <SPI.h>
+
+#define SIM_REG8(name) volatile uint8_t name;
+#define SIM_REG16(name) volatile uint16_t name;
+#include <avr/sim_registers.h>
+#undef SIM_REG8
+#undef SIM_REG16
+
+sim_ucsra_t UCSR0A, UCSR1A;
+sim_udr_t UDR0, UDR1;
+void (*sim_serial_hook)(uint8_t c) = NULL;
+uint8_t sim_serial_port = 0;
+sim_udr_t &sim_udr_t::operator=(uint8_t c)
+{
+  sim_serial_port = this == &UDR1;
+  if (sim_serial_hook)
+    sim_serial_hook(c);
+  else
+    fputc(c, stderr);
+  return *this;
+}
+
+extern "C" void M_USARTx_RX_vect(void);
+void sim_serial_receive(uint8_t c)
+{
+  UDR0.rx = c;
+  M_USARTx_RX_vect();
+}
+
+#if defined(SERIAL_PORT_2) && SERIAL_PORT_2 == 1
+extern "C" void M2_USARTx_RX_vect(void);
+void sim_serial2_receive(uint8_t c)
+{
+  UDR1.rx = c;
+  M2_USARTx_RX_vect();
+}
+#endif
+
+uint8_t (*sim_spi_hook)(uint8_t c) = NULL;
+sim_spsr_t SPSR;
+sim_spdr_t SPDR;
+sim_spdr_t &sim_spdr_t::operator=(uint8_t c)
+{
+  value = sim_spi_hook ? sim_spi_hook(c) : c;
+  return *this;
+}
+
+uint8_t sim_eeprom[4096];
+SPIClass SPI;
+
+// Timer 1 runs at F_CPU / 8
+unsigned long long sim_ticks = 0;
+
+unsigned long micros() { return (unsigned long)(sim_ticks * 8000000ULL / F_CPU); }
+void (*sim_millis_hook)() = NULL;
+unsigned long millis()
+{
+  if (sim_millis_hook)
+    sim_millis_hook();
+  return (unsigned long)(sim_ticks * 8000ULL / F_CPU);
+}
+void delay(unsigned long ms) { sim_ticks += (unsigned long long)ms * F_CPU / 8000; }
+void delayMicroseconds(unsigned int us) { sim_ticks += (unsigned long long)us * F_CPU / 8000000; }
+void pinMode(uint8_t, uint8_t) {}
+void (*sim_pin_hook)(uint8_t pin, uint8_t value) = NULL;
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+  if (sim_pin_hook)
+    sim_pin_hook(pin, value);
+}
+int digitalRead(uint8_t) { return 0; }
+void analogWrite(uint8_t, int) {}
+void attachInterrupt(uint8_t, void (*)(void), int) {}
+int analogRead(uint8_t) { return 0; }
+
+// Read by freeMemory() and the MEMORY_REPORT stack painting in Marlin_main.cpp. SP reads 0, below
+// these, so there is nothing to paint.
+extern "C" {
+  unsigned int __bss_end;
+  unsigned int __heap_start;
+  void *__brkval;
+}
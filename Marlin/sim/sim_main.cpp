@@ -0,0 +1,180 @@
+// Replays the moves of a G-code file through planner.cpp and stepper.cpp on the host and writes
+// the time of every stepper interrupt that stepped, with the step positions after it:
+//
+//   marlin_sim print.gcode > steps.csv
+//
+// Handled are G0/G1 (X Y Z E F), G4, G28 (position taken as 0), G90/G91, M82/M83 and G92.
+// Everything else is skipped. The main loop is taken to be infinitely fast, so the planner
+// buffer is always as full as it can be; the figures are what the planner and the stepper
+// interrupt make of the moves, not what a slow serial link would leave of them.
+#include <ctype.h>
+#include "Marlin.h"
+#include "planner.h"
+#include "stepper.h"
+#include "sim.h"
+
+extern "C" void TIMER1_COMPA_vect(void);
+
+static const char axis_letters[NUM_AXIS] = { 'X', 'Y', 'Z', 'E' };
+static long last_steps[NUM_AXIS];
+static unsigned long long last_step_tick[NUM_AXIS];
+static unsigned long long min_step_interval[NUM_AXIS];
+static unsigned long step_isrs = 0;
+
+void sim_run_isr()
+{
+  if (TIMSK1 & (1 << OCIE1A))
+    TIMER1_COMPA_vect();
+  bool stepped = false;
+  for (uint8_t i = 0; i < NUM_AXIS; i++)
+  {
+    long steps = st_get_position(i);
+    if (steps == last_steps[i])
+      continue;
+    if (last_step_tick[i] && sim_ticks - last_step_tick[i] < min_step_interval[i])
+      min_step_interval[i] = sim_ticks - last_step_tick[i];
+    last_step_tick[i] = sim_ticks;
+    last_steps[i] = steps;
+    stepped = true;
+  }
+  if (stepped)
+  {
+    step_isrs++;
+    printf("%.1f,%ld,%ld,%ld,%ld\n", sim_ticks * 8000000.0 / F_CPU, last_steps[0], last_steps[1], last_steps[2], last_steps[3]);
+  }
+  // CTC mode: the next interrupt comes OCR1A + 1 ticks later
+  sim_ticks += (TIMSK1 & (1 << OCIE1A)) ? OCR1A + 1 : 2000;
+}
+
+static void set_defaults()
+{
+  float steps[] = DEFAULT_AXIS_STEPS_PER_UNIT;
+  float feedrate[] = DEFAULT_MAX_FEEDRATE;
+  long accel[] = DEFAULT_MAX_ACCELERATION;
+  for (uint8_t i = 0; i < NUM_AXIS; i++)
+  {
+    axis_steps_per_unit[i] = steps[i];
+    max_feedrate[i] = feedrate[i];
+    max_acceleration_units_per_sq_second[i] = accel[i];
+  }
+  reset_acceleration_rates();
+  acceleration = DEFAULT_ACCELERATION;
+  retract_acceleration = DEFAULT_RETRACT_ACCELERATION;
+  minimumfeedrate = DEFAULT_MINIMUMFEEDRATE;
+  minsegmenttime = DEFAULT_MINSEGMENTTIME;
+  mintravelfeedrate = DEFAULT_MINTRAVELFEEDRATE;
+  max_xy_jerk = DEFAULT_XYJERK;
+  max_z_jerk = DEFAULT_ZJERK;
+  max_e_jerk = DEFAULT_EJERK;
+#ifdef PREVENT_DANGEROUS_EXTRUDE
+  set_extrude_min_temp(0); // there is no hotend to wait for
+#endif
+}
+
+// The number after letter in line, or false when the line has no such word
+static bool code_value(const char *line, char letter, float &value)
+{
+  for (const char *p = line; *p; p++)
+  {
+    if (*p == ';' || *p == '(')
+      break;
+    if (toupper(*p) == letter)
+    {
+      char *end;
+      value = strtod(p + 1, &end);
+      return end != p + 1;
+    }
+  }
+  return false;
+}
+
+int main(int argc, char **argv)
+{
+  FILE *in = argc > 1 ? fopen(argv[1], "r") : stdin;
+  if (!in)
+  {
+    fprintf(stderr, "cannot open %s\n", argv[1]);
+    return 1;
+  }
+
+  set_defaults();
+  plan_init();
+  st_init();
+  enable_endstops(false);
+  for (uint8_t i = 0; i < NUM_AXIS; i++)
+    min_step_interval[i] = ~0ULL;
+
+  float position[NUM_AXIS] = { 0, 0, 0, 0 };
+  float feedrate = 1500; // mm/min
+  bool relative = false, relative_e = false;
+  unsigned long moves = 0;
+  char line[256];
+  printf("time_us,x,y,z,e\n");
+  while (fgets(line, sizeof(line), in))
+  {
+    float value;
+    if (!code_value(line, 'G', value))
+    {
+      if (code_value(line, 'M', value))
+      {
+        if (value == 82) relative_e = false;
+        if (value == 83) relative_e = true;
+      }
+      continue;
+    }
+    int g = (int)value;
+    if (g == 0 || g == 1)
+    {
+      float target[NUM_AXIS];
+      for (uint8_t i = 0; i < NUM_AXIS; i++)
+      {
+        target[i] = position[i];
+        if (code_value(line, axis_letters[i], value))
+          target[i] = ((i == E_AXIS ? relative_e : relative) ? position[i] : 0) + value;
+      }
+      if (code_value(line, 'F', value) && value > 0)
+        feedrate = value;
+      plan_buffer_line(target[X_AXIS], target[Y_AXIS], target[Z_AXIS], target[E_AXIS], feedrate / 60, 0);
+      memcpy(position, target, sizeof(position));
+      moves++;
+    }
+    else if (g == 4)
+    {
+      st_synchronize();
+      unsigned long long until = sim_ticks;
+      if (code_value(line, 'P', value)) until += (unsigned long long)(value * F_CPU / 8000);
+      if (code_value(line, 'S', value)) until += (unsigned long long)(value * F_CPU / 8);
+      while (sim_ticks < until)
+        sim_run_isr();
+    }
+    else if (g == 28 || g == 92)
+    {
+      st_synchronize();
+      for (uint8_t i = 0; i < NUM_AXIS; i++)
+      {
+        if (g == 28 && i != E_AXIS)
+          position[i] = 0;
+        else if (g == 92 && code_value(line, axis_letters[i], value))
+          position[i] = value;
+      }
+      plan_set_position(position[X_AXIS], position[Y_AXIS], position[Z_AXIS], position[E_AXIS]);
+    }
+    else if (g == 90)
+      relative = relative_e = false;
+    else if (g == 91)
+      relative = relative_e = true;
+  }
+  st_synchronize();
+
+  fprintf(stderr, "moves: %lu\n", moves);
+  fprintf(stderr, "time: %.3f s\n", sim_ticks * 8.0 / F_CPU);
+  fprintf(stderr, "stepping interrupts: %lu\n", step_isrs);
+  for (uint8_t i = 0; i < NUM_AXIS; i++)
+  {
+    fprintf(stderr, "%c steps: %ld", axis_letters[i], last_steps[i]);
+    if (min_step_interval[i] != ~0ULL)
+      fprintf(stderr, ", shortest step interval %.1f us", min_step_interval[i] * 8000000.0 / F_CPU);
+    fprintf(stderr, "\n");
+  }
+  return 0;
+}
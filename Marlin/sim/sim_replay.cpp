@@ -0,0 +1,187 @@
+// Sends a G-code file through the serial port of the host build of the whole firmware, one line per
+// "ok" like a printing host, and logs every block the stepper interrupt finishes:
+//
+//   marlin_replay print.gcode > blocks.csv
+//
+// Rates are in step events per second, steps carry the direction of the move. The log of two builds
+// can be diffed to see whether a change altered the motion, the summary on stderr gives the print time.
+//
+// The stepper interrupt runs whenever the firmware reads millis(), so each read stands for the time
+// to the next interrupt, or a millisecond while there is nothing to step. The temperature interrupt
+// does not run, so M104/M109/M140/M190 are skipped and cold extrusion is allowed. The endstops read
+// as open, so G28 runs its whole search move.
+#include "Marlin.h"
+#include "planner.h"
+#include "stepper.h"
+#include "sim.h"
+
+extern "C" void TIMER1_COMPA_vect(void);
+
+#define REPLAY_TIMEOUT_S 3600 // give up when a line gets no "ok" in this much simulated time
+
+// Drive an input pin to the level that reads as an open endstop
+#define _ENDSTOP_OPEN(IO, inverting) do { \
+    if (inverting) DIO ## IO ## _RPORT |= MASK(DIO ## IO ## _PIN); \
+    else DIO ## IO ## _RPORT &= ~MASK(DIO ## IO ## _PIN); \
+  } while(0)
+#define ENDSTOP_OPEN(IO, inverting) _ENDSTOP_OPEN(IO, inverting)
+
+static unsigned long oks = 0;
+static char out_line[8];
+static uint8_t out_length = 0;
+
+static unsigned char tracked_tail = 0;
+static bool tracked_started = false;
+static unsigned long long block_start;
+static unsigned long blocks = 0;
+
+static double ticks_to_us(unsigned long long ticks) { return ticks * 8000000.0 / F_CPU; }
+
+// Count the lines starting with "ok", pass everything on to stderr
+static void replay_serial(uint8_t c)
+{
+  fputc(c, stderr);
+  if (c == '\n') {
+    if (out_length >= 2 && out_line[0] == 'o' && out_line[1] == 'k')
+      oks++;
+    out_length = 0;
+  }
+  else if (out_length < sizeof(out_line))
+    out_line[out_length++] = c;
+}
+
+static long signed_steps(long steps, unsigned char direction_bits, uint8_t axis)
+{
+  return (direction_bits & (1 << axis)) ? -steps : steps;
+}
+
+static void log_block(const block_t *block)
+{
+  printf("%lu,%.1f,%.1f,%ld,%ld,%ld,%ld,%.3f,%lu,%lu,%lu,%lu,%ld,%ld\n", blocks,
+    ticks_to_us(block_start), ticks_to_us(sim_ticks),
+    signed_steps(block->steps_x, block->direction_bits, X_AXIS), signed_steps(block->steps_y, block->direction_bits, Y_AXIS),
+    signed_steps(block->steps_z, block->direction_bits, Z_AXIS), signed_steps(block->steps_e, block->direction_bits, E_AXIS),
+    block->millimeters, block->step_event_count, block->initial_rate, block->nominal_rate, block->final_rate,
+    block->accelerate_until, block->decelerate_after);
+  blocks++;
+}
+
+// Run the stepper interrupt that is due and move the clock on to the next one
+static void replay_run_isr()
+{
+  if (TIMSK1 & (1 << OCIE1A)) {
+    TIMER1_COMPA_vect();
+    // a finished block stays untouched until the main code plans the next one
+    while (tracked_tail != block_buffer_tail) {
+      if (!tracked_started) // started and ended in this interrupt, as when an endstop is already hit
+        block_start = sim_ticks;
+      log_block(&block_buffer[tracked_tail]);
+      tracked_tail = (tracked_tail + 1) & (BLOCK_BUFFER_SIZE - 1);
+      tracked_started = false;
+    }
+    if (!tracked_started && block_buffer_tail != block_buffer_head && block_buffer[block_buffer_tail].busy) {
+      tracked_started = true;
+      block_start = sim_ticks;
+    }
+    sim_ticks += OCR1A + 1; // CTC mode
+  }
+  else
+    sim_ticks += F_CPU / 8000;
+}
+
+// The heater commands would wait for temperatures that never come
+static bool skipped_command(const char *line)
+{
+  while (*line == ' ')
+    line++;
+  if (*line == 'N') { // line number
+    while (*line && *line != ' ')
+      line++;
+    while (*line == ' ')
+      line++;
+  }
+  if (*line != 'M' && *line != 'm')
+    return false;
+  int code = atoi(line + 1);
+  return code == 104 || code == 109 || code == 140 || code == 190;
+}
+
+static void open_endstops()
+{
+  #if defined(X_MIN_PIN) && X_MIN_PIN > -1
+    ENDSTOP_OPEN(X_MIN_PIN, X_MIN_ENDSTOP_INVERTING);
+  #endif
+  #if defined(Y_MIN_PIN) && Y_MIN_PIN > -1
+    ENDSTOP_OPEN(Y_MIN_PIN, Y_MIN_ENDSTOP_INVERTING);
+  #endif
+  #if defined(Z_MIN_PIN) && Z_MIN_PIN > -1
+    ENDSTOP_OPEN(Z_MIN_PIN, Z_MIN_ENDSTOP_INVERTING);
+  #endif
+  #if defined(X_MAX_PIN) && X_MAX_PIN > -1
+    ENDSTOP_OPEN(X_MAX_PIN, X_MAX_ENDSTOP_INVERTING);
+  #endif
+  #if defined(Y_MAX_PIN) && Y_MAX_PIN > -1
+    ENDSTOP_OPEN(Y_MAX_PIN, Y_MAX_ENDSTOP_INVERTING);
+  #endif
+  #if defined(Z_MAX_PIN) && Z_MAX_PIN > -1
+    ENDSTOP_OPEN(Z_MAX_PIN, Z_MAX_ENDSTOP_INVERTING);
+  #endif
+}
+
+static bool send_line(const char *line)
+{
+  unsigned long waiting_for = oks + 1;
+  for (const char *p = line; *p; p++)
+    sim_serial_receive(*p);
+  sim_serial_receive('\n');
+  unsigned long long deadline = sim_ticks + (unsigned long long)REPLAY_TIMEOUT_S * F_CPU / 8;
+  while (oks < waiting_for) {
+    loop();
+    if (sim_ticks > deadline) {
+      fprintf(stderr, "no ok for: %s\n", line);
+      return false;
+    }
+  }
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  FILE *in = argc > 1 ? fopen(argv[1], "r") : stdin;
+  if (!in) {
+    fprintf(stderr, "cannot open %s\n", argv[1]);
+    return 1;
+  }
+
+  sim_serial_hook = replay_serial;
+  open_endstops();
+  setup();
+  sim_millis_hook = replay_run_isr;
+  printf("block,start_us,end_us,x,y,z,e,mm,step_events,initial_rate,nominal_rate,final_rate,accelerate_until,decelerate_after\n");
+
+  unsigned long lines = 0, skipped = 0;
+  char line[MAX_CMD_SIZE + 2];
+  bool ok = send_line("M302"); // allow cold extrusion
+  while (ok && fgets(line, sizeof(line), in)) {
+    char *end = strpbrk(line, ";\r\n");
+    if (end)
+      *end = 0;
+    if (!line[strspn(line, " \t")])
+      continue;
+    if (skipped_command(line)) {
+      skipped++;
+      continue;
+    }
+    ok = send_line(line);
+    lines++;
+  }
+  if (ok)
+    ok = send_line("M400");
+
+  fprintf(stderr, "lines: %lu, skipped: %lu\n", lines, skipped);
+  fprintf(stderr, "blocks: %lu\n", blocks);
+  fprintf(stderr, "time: %.3f s\n", sim_ticks * 8.0 / F_CPU);
+  fprintf(stderr, "steps: X%ld Y%ld Z%ld E%ld\n", st_get_position(X_AXIS), st_get_position(Y_AXIS),
+    st_get_position(Z_AXIS), st_get_position(E_AXIS));
+  return ok ? 0 : 1;
+}
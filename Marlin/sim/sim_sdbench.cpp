@@ -0,0 +1,148 @@
+// Runs the SD card code of the host build of the whole firmware against a FAT16 or FAT32 disk image:
+//
+//   marlin_sdbench card.img print.gcode [write KB]
+//
+// The card (sim_sdcard.cpp) answers Sd2Card.cpp on the SPI bus from the image. The commands go in
+// through the serial port as from a host, each waits for its "ok" (M29 for "Done saving"):
+//
+//   mount   M21, card init, volume and root directory
+//   list    M20
+//   upload  M28 bench.gco, the lines of print.gcode, M29 (lower case: a G or N in the name reads as a code)
+//   read    M819 bench.gco, reads the file to its end with the line reading code of a print
+//   write   M819 W<KB>, 256 KB unless given
+//
+// For each phase it prints the card commands, the single and multiple block reads and writes with the
+// blocks they moved, the SdVolume cache misses and the bus and card time in ms (see sim_sdcard.cpp).
+// The firmware's own output, with the M819 figures, goes to stderr. The image is only read, the blocks
+// written are kept in memory. An image with some files on it can be made with
+//
+//   truncate -s 64M card.img && mkfs.fat -F 32 card.img && mcopy -i card.img *.gcode ::
+//
+// or copied from a card with dd. SDSUPPORT and SD_BENCHMARK are set by the make target,
+// SD_LATENCY_HISTOGRAM counts the cache misses.
+#include "Marlin.h"
+#include "cardreader.h"
+#include "sim.h"
+
+#define SDBENCH_MAX_LOOPS 10000000UL // give up when a line gets no reply in this many loop() calls
+
+static const char *reply = "ok";
+static bool replied;
+static char out_line[16];
+static uint8_t out_length = 0;
+
+// Look for the reply at the start of the lines, pass everything on to stderr
+static void sdbench_serial(uint8_t c)
+{
+  fputc(c, stderr);
+  if (c == '\n') {
+    out_line[out_length] = 0;
+    if (!strncmp(out_line, reply, strlen(reply)))
+      replied = true;
+    out_length = 0;
+  }
+  else if (out_length < sizeof(out_line) - 1)
+    out_line[out_length++] = c;
+}
+
+static bool send_line(const char *line, const char *awaited = "ok")
+{
+  reply = awaited;
+  replied = false;
+  for (const char *p = line; *p; p++)
+    sim_serial_receive(*p);
+  sim_serial_receive('\n');
+  for (unsigned long loops = 0; !replied; loops++) {
+    if (loops == SDBENCH_MAX_LOOPS) {
+      fprintf(stderr, "no %s for: %s\n", awaited, line);
+      return false;
+    }
+    loop();
+  }
+  return true;
+}
+
+static unsigned long long phase_ticks;
+
+static void phase_start()
+{
+  memset(&sim_sd_stats, 0, sizeof(sim_sd_stats));
+  memset(sdLatency, 0, sizeof(sdLatency));
+  phase_ticks = sim_ticks;
+}
+
+static void phase_end(const char *name)
+{
+  unsigned long misses = 0;
+  for (uint8_t b = 0; b < SD_LATENCY_BUCKETS; b++)
+    misses += sdLatency[SD_LATENCY_CACHE_MISS][b];
+  printf("%-8s %8lu %8lu %8lu %8lu %8lu %8lu %8lu %8lu %10.1f\n", name, sim_sd_stats.commands,
+    sim_sd_stats.single_reads, sim_sd_stats.multi_reads, sim_sd_stats.blocks_read,
+    sim_sd_stats.single_writes, sim_sd_stats.multi_writes, sim_sd_stats.blocks_written, misses,
+    (sim_ticks - phase_ticks) * 8000.0 / F_CPU);
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 3) {
+    fprintf(stderr, "usage: marlin_sdbench card.img print.gcode [write KB]\n");
+    return 1;
+  }
+  if (!sim_sd_insert(argv[1])) {
+    fprintf(stderr, "cannot read the image %s\n", argv[1]);
+    return 1;
+  }
+  FILE *in = fopen(argv[2], "r");
+  if (!in) {
+    fprintf(stderr, "cannot open %s\n", argv[2]);
+    return 1;
+  }
+  unsigned long write_kb = argc > 3 ? strtoul(argv[3], NULL, 10) : 256;
+
+  sim_serial_hook = sdbench_serial;
+  setup();
+  printf("phase    commands   single    multi   blocks  single    multi   blocks   misses         ms\n");
+  printf("                     reads    reads     read  writes   writes  written\n");
+
+  phase_start();
+  bool ok = send_line("M21") && card.cardOK;
+  phase_end("mount");
+
+  if (ok) {
+    phase_start();
+    ok = send_line("M20");
+    phase_end("list");
+  }
+
+  if (ok) {
+    phase_start();
+    ok = send_line("M28 bench.gco");
+    char line[MAX_CMD_SIZE + 2];
+    while (ok && fgets(line, sizeof(line), in)) {
+      char *end = strpbrk(line, ";\r\n");
+      if (end)
+        *end = 0;
+      if (!line[strspn(line, " \t")])
+        continue;
+      ok = send_line(line);
+    }
+    if (ok)
+      ok = send_line("M29", "Done saving");
+    phase_end("upload");
+  }
+
+  if (ok) {
+    phase_start();
+    ok = send_line("M819 bench.gco");
+    phase_end("read");
+  }
+
+  if (ok && write_kb) {
+    char line[16];
+    sprintf(line, "M819 W%lu", write_kb);
+    phase_start();
+    ok = send_line(line);
+    phase_end("write");
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,340 @@
+// An SD card on the SPI bus of the host build, backed by a disk image. Sd2Card.cpp talks to it byte by
+// byte as to a card in SPI mode: an SDHC card (block addressing) that answers CMD0/8/9/10/12/13/17/18/
+// 24/25/32/33/38/55/58/59, ACMD23/41, with data tokens, CRCs and busy signalling as the card sends them.
+// It listens while SDSS is low.
+//
+// Blocks written are kept in memory, the image file is only read, so every run starts from the same
+// card. Each byte on the bus advances the simulated clock by its time at the SPI rate in SPCR/SPSR, and
+// the card takes SIM_SD_READ_US from a read command or block to its data and SIM_SD_WRITE_US to program
+// a block, so millis() measures bus and card time, not the host's CPU time.
+#include "Marlin.h"
+#include "sim.h"
+#include <stdio.h>
+#include <map>
+#include <util/crc16.h>
+
+#define SIM_SD_READ_US 250
+#define SIM_SD_WRITE_US 600
+
+sim_sd_stats_t sim_sd_stats;
+
+// SdFatUtil::FreeRam() declares its own __bss_end and __brkval inside the namespace
+namespace SdFatUtil {
+  int __bss_end;
+  int *__brkval;
+}
+
+struct sim_block_t { uint8_t data[512]; };
+
+static FILE *image;
+static uint32_t image_blocks;
+static std::map<uint32_t, sim_block_t> written;
+
+static bool selected = false;
+static bool card_idle = true, app_command = false;
+static uint8_t command[6], command_length = 0;
+static uint32_t erase_start, erase_end;
+
+// Sent before anything else: responses and their register bytes
+static uint8_t response[8];
+static uint8_t response_head = 0, response_length = 0;
+
+// A data packet being sent: access time, start token, data, CRC. With read_multi the next block follows.
+static uint8_t packet[512];
+static uint16_t packet_length = 0;
+static long packet_pos;  // below 0 while the card is still getting the data, 0 the token
+static uint16_t packet_crc;
+static bool read_multi = false;
+static uint32_t read_block;
+
+// A data packet being received
+#define WRITE_NONE 0
+#define WRITE_TOKEN 1      // CMD24 given, waiting for its start token
+#define WRITE_MULTI 2      // CMD25 given, waiting for the next block's token or the stop token
+#define WRITE_DATA 3
+static uint8_t write_state = WRITE_NONE;
+static bool write_multi;
+static uint32_t write_block;
+static uint16_t write_pos;
+static sim_block_t write_buffer;
+
+static unsigned long busy_bytes = 0; // bytes the card holds MISO low for
+
+// SPI clock divider of the rate Sd2Card.cpp set, a byte takes as many timer 1 ticks (F_CPU / 8)
+static unsigned int spi_divider()
+{
+  static const unsigned int dividers[4] = { 4, 16, 64, 128 };
+  return dividers[SPCR & 3] >> (SPSR.value & 1);
+}
+
+static unsigned long bytes_for_us(unsigned long us)
+{
+  unsigned long bytes = (unsigned long)((unsigned long long)us * (F_CPU / 8) / 1000000 / spi_divider());
+  return bytes ? bytes : 1;
+}
+
+static void read_image_block(uint32_t block, uint8_t *dst)
+{
+  std::map<uint32_t, sim_block_t>::const_iterator it = written.find(block);
+  if (it != written.end())
+    memcpy(dst, it->second.data, 512);
+  else if (fseek(image, (long)block * 512, SEEK_SET) || fread(dst, 1, 512, image) != 512)
+    memset(dst, 0, 512);
+}
+
+static void respond(uint8_t c)
+{
+  if (response_length < sizeof(response))
+    response[response_length++] = c;
+}
+
+static void send_packet(uint16_t length, bool access_time)
+{
+  packet_length = length;
+  packet_crc = 0;
+  for (uint16_t i = 0; i < length; i++)
+    packet_crc = _crc_xmodem_update(packet_crc, packet[i]);
+  packet_pos = access_time ? -(long)bytes_for_us(SIM_SD_READ_US) : -1;
+}
+
+static void send_block(uint32_t block)
+{
+  read_image_block(block, packet);
+  send_packet(512, true);
+  sim_sd_stats.blocks_read++;
+}
+
+static void run_command()
+{
+  uint8_t cmd = command[0] & 0x3F;
+  uint32_t arg = ((uint32_t)command[1] << 24) | ((uint32_t)command[2] << 16) | ((uint32_t)command[3] << 8) | command[4];
+  bool app = app_command;
+  app_command = false;
+  sim_sd_stats.commands++;
+  respond(0xFF); // a byte before the response
+  uint8_t r1 = card_idle ? 0x01 : 0x00;
+  if (app) {
+    if (cmd == 41)
+      card_idle = false, r1 = 0x00;
+    else if (cmd != 23)
+      r1 |= 0x04; // illegal command
+    respond(r1);
+    return;
+  }
+  switch (cmd) {
+    case 0:
+      card_idle = true;
+      read_multi = false;
+      packet_length = 0;
+      write_state = WRITE_NONE;
+      respond(0x01);
+      break;
+    case 8:
+      respond(r1);
+      respond(0x00);
+      respond(0x00);
+      respond(0x01);
+      respond(arg & 0xFF);
+      break;
+    case 9: // CSD version 2, the size in 512 KB units
+    {
+      respond(r1);
+      uint32_t c_size = image_blocks / 1024 - 1;
+      static const uint8_t csd[16] = { 0x40, 0x0E, 0x00, 0x32, 0x5B, 0x59, 0x00, 0, 0, 0, 0x7F, 0x80, 0x0A, 0x40, 0x00, 0x01 };
+      memcpy(packet, csd, 16);
+      packet[7] = (c_size >> 16) & 0x3F;
+      packet[8] = c_size >> 8;
+      packet[9] = c_size;
+      send_packet(16, false);
+      break;
+    }
+    case 10:
+    {
+      respond(r1);
+      static const uint8_t cid[16] = { 0x03, 'S', 'D', 'S', 'I', 'M', 'C', 'D', 0x10, 0, 0, 0, 1, 0x01, 0x4A, 0x01 };
+      memcpy(packet, cid, 16);
+      send_packet(16, false);
+      break;
+    }
+    case 12:
+      read_multi = false;
+      packet_length = 0;
+      respond(r1);
+      break;
+    case 13:
+      respond(r1);
+      respond(0x00);
+      break;
+    case 17:
+    case 18:
+      if (arg >= image_blocks) {
+        respond(r1 | 0x20); // address error
+        break;
+      }
+      respond(r1);
+      read_multi = cmd == 18;
+      read_block = arg;
+      send_block(read_block);
+      if (read_multi)
+        sim_sd_stats.multi_reads++;
+      else
+        sim_sd_stats.single_reads++;
+      break;
+    case 24:
+    case 25:
+      if (arg >= image_blocks) {
+        respond(r1 | 0x20);
+        break;
+      }
+      respond(r1);
+      write_multi = cmd == 25;
+      write_state = write_multi ? WRITE_MULTI : WRITE_TOKEN;
+      write_block = arg;
+      if (write_multi)
+        sim_sd_stats.multi_writes++;
+      else
+        sim_sd_stats.single_writes++;
+      break;
+    case 32:
+      erase_start = arg;
+      respond(r1);
+      break;
+    case 33:
+      erase_end = arg;
+      respond(r1);
+      break;
+    case 38:
+    {
+      respond(r1);
+      sim_block_t zero;
+      memset(zero.data, 0, 512);
+      for (uint32_t block = erase_start; block <= erase_end && block < image_blocks; block++)
+        written[block] = zero;
+      busy_bytes = bytes_for_us(SIM_SD_WRITE_US);
+      break;
+    }
+    case 55:
+      app_command = true;
+      respond(r1);
+      break;
+    case 58:
+      respond(r1);
+      respond(0xC0); // powered up, SDHC
+      respond(0xFF);
+      respond(0x80);
+      respond(0x00);
+      break;
+    case 59:
+      respond(r1);
+      break;
+    default:
+      respond(r1 | 0x04);
+      break;
+  }
+}
+
+// The byte the card sends while c comes in
+static uint8_t card_byte()
+{
+  if (response_head < response_length) {
+    uint8_t c = response[response_head++];
+    if (response_head == response_length)
+      response_head = response_length = 0;
+    return c;
+  }
+  if (packet_length) {
+    uint8_t c;
+    if (packet_pos < 0)
+      c = 0xFF;
+    else if (packet_pos == 0)
+      c = 0xFE;
+    else if (packet_pos <= packet_length)
+      c = packet[packet_pos - 1];
+    else if (packet_pos == packet_length + 1)
+      c = packet_crc >> 8;
+    else
+      c = packet_crc;
+    if (++packet_pos > packet_length + 2) {
+      if (read_multi && read_block + 1 < image_blocks)
+        send_block(++read_block);
+      else
+        packet_length = 0;
+    }
+    return c;
+  }
+  if (busy_bytes) {
+    busy_bytes--;
+    return 0x00;
+  }
+  return 0xFF;
+}
+
+static void host_byte(uint8_t c)
+{
+  switch (write_state) {
+    case WRITE_TOKEN:
+    case WRITE_MULTI:
+      if (c == (write_state == WRITE_TOKEN ? 0xFE : 0xFC)) {
+        write_state = WRITE_DATA;
+        write_pos = 0;
+      }
+      else if (write_state == WRITE_MULTI && c == 0xFD) { // stop token
+        write_state = WRITE_NONE;
+        busy_bytes = 1;
+      }
+      return;
+    case WRITE_DATA:
+      if (write_pos < 512)
+        write_buffer.data[write_pos] = c;
+      if (++write_pos < 514)
+        return;
+      written[write_block++] = write_buffer;
+      sim_sd_stats.blocks_written++;
+      respond(0x05); // accepted
+      busy_bytes = bytes_for_us(SIM_SD_WRITE_US);
+      write_state = write_multi && write_block < image_blocks ? WRITE_MULTI : WRITE_NONE;
+      return;
+  }
+  if (command_length || (c & 0xC0) == 0x40) {
+    command[command_length++] = c;
+    if (command_length == sizeof(command)) {
+      command_length = 0;
+      run_command();
+    }
+  }
+}
+
+static uint8_t sd_spi(uint8_t c)
+{
+  sim_ticks += spi_divider();
+  if (!selected)
+    return 0xFF;
+  sim_sd_stats.bytes++;
+  uint8_t out = card_byte();
+  host_byte(c);
+  return out;
+}
+
+static void sd_pin(uint8_t pin, uint8_t value)
+{
+  if (pin == SDSS)
+    selected = !value;
+}
+
+// Put the card with image in, false when the file can't be read
+bool sim_sd_insert(const char *image_name)
+{
+  image = fopen(image_name, "rb");
+  if (!image)
+    return false;
+  fseek(image, 0, SEEK_END);
+  image_blocks = ftell(image) / 512;
+  if (image_blocks < 1024) {
+    fclose(image);
+    image = NULL;
+    return false;
+  }
+  sim_spi_hook = sd_spi;
+  sim_pin_hook = sd_pin;
+  return true;
+}
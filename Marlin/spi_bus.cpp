@@ -0,0 +1,95 @@
+#include "Marlin.h"
+
+#ifdef SPI_BUS_ARBITER
+#include "spi_bus.h"
+
+#ifndef HEATER_0_USES_MAX6675
+  #error "SPI_BUS_ARBITER is for sharing the bus with a MAX6675 (TEMP_SENSOR_0 -2)"
+#endif
+
+//===========================================================================
+//=============================private variables  ============================
+//===========================================================================
+
+static volatile bool spi_bus_held = false;      // by the SD card or the digipot
+static volatile bool max6675_queued = false;    // waiting for the bus
+static volatile uint8_t max6675_bytes = 0;      // still to come of the read on the bus
+static unsigned int max6675_reading;            // being read
+static volatile unsigned int max6675_word = 4;  // bit 2 set: thermocouple open
+
+//===========================================================================
+//=============================functions         ============================
+//===========================================================================
+
+// The bus must be free, interrupts off
+static void max6675_start()
+{
+  #ifdef PRR
+    PRR &= ~(1<<PRSPI);
+  #elif defined PRR0
+    PRR0 &= ~(1<<PRSPI);
+  #endif
+  SPCR = (1<<SPIE) | (1<<MSTR) | (1<<SPE) | (1<<SPR0);
+  max6675_queued = false;
+  max6675_bytes = 2;
+  WRITE(MAX6675_SS, 0);
+  // ensure 100ns delay - a bit extra is fine
+  asm("nop");//50ns on 20Mhz, 62.5ns on 16Mhz
+  asm("nop");//50ns on 20Mhz, 62.5ns on 16Mhz
+  SPDR = 0;
+}
+
+void spi_bus_acquire()
+{
+  for(;;) {
+    CRITICAL_SECTION_START;
+    if (max6675_bytes == 0) {
+      spi_bus_held = true;
+      CRITICAL_SECTION_END;
+      return;
+    }
+    CRITICAL_SECTION_END;
+  }
+}
+
+void spi_bus_release()
+{
+  CRITICAL_SECTION_START;
+  spi_bus_held = false;
+  if (max6675_queued)
+    max6675_start();
+  CRITICAL_SECTION_END;
+}
+
+void spi_bus_read_max6675()
+{
+  CRITICAL_SECTION_START;
+  if (spi_bus_held)
+    max6675_queued = true;
+  else if (max6675_bytes == 0)
+    max6675_start();
+  CRITICAL_SECTION_END;
+}
+
+unsigned int spi_bus_max6675_word()
+{
+  CRITICAL_SECTION_START;
+  unsigned int word = max6675_word;
+  CRITICAL_SECTION_END;
+  return word;
+}
+
+// MSB first. SPCR is left as the MAX6675 needs it, the SD card sets its own at chip select.
+ISR(SPI_STC_vect)
+{
+  max6675_reading = (max6675_reading << 8) | SPDR;
+  if (--max6675_bytes) {
+    SPDR = 0;
+    return;
+  }
+  WRITE(MAX6675_SS, 1);
+  SPCR &= ~(1<<SPIE);
+  max6675_word = max6675_reading;
+}
+
+#endif //SPI_BUS_ARBITER
@@ -0,0 +1,19 @@
+#ifndef SPI_BUS_H
+#define SPI_BUS_H
+
+#include "Marlin.h"
+
+#ifdef SPI_BUS_ARBITER
+  // hold the hardware SPI bus, as the SD card does from chip select low to high. Main code only,
+  // waits for a MAX6675 read that is on the bus to finish (two bytes, about 16us)
+  void spi_bus_acquire();
+  // let go of the bus and start the MAX6675 read that waited for it
+  void spi_bus_release();
+  // queue reading the MAX6675, also from an interrupt. The read runs from the SPI interrupt as soon
+  // as the bus is free, a read that is already queued or running is not queued again.
+  void spi_bus_read_max6675();
+  // the last word read from the MAX6675, reads as an open thermocouple until the first read is done
+  unsigned int spi_bus_max6675_word();
+#endif
+
+#endif
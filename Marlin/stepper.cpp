@@ -24,11 +24,13 @@
 #include "Marlin.h"
 #include "stepper.h"
 #include "planner.h"
+#include "kinematics.h"
 #include "temperature.h"
 #include "ultralcd.h"
 #include "language.h"
 #include "cardreader.h"
 #include "speed_lookuptable.h"
+#include "spi_bus.h"
 #if defined(DIGIPOTSS_PIN) && DIGIPOTSS_PIN > -1
 #include <SPI.h>
 #endif
@@ -47,11 +49,23 @@ block_t *current_block;  // A pointer to the block currently being traced
 
 // Variables used by The Stepper Driver Interrupt
 static unsigned char out_bits;        // The next stepping-bits to be output
-static long counter_x,       // Counter variables for the bresenham line tracer
-            counter_y,
-            counter_z,
-            counter_e;
 volatile static unsigned long step_events_completed; // The number of step events executed in the current block
+#ifdef STEP_SMOOTHING
+  static unsigned char step_smoothing;   // log2 of the interrupts per step event in the current block
+  static unsigned char smoothing_mask;   // (1 << step_smoothing) - 1
+  static unsigned char smoothing_ticks;  // interrupts done in the current step event
+  static long step_event_ticks;          // step_event_count << step_smoothing, the Bresenham denominator
+  #define STEP_EVENT_TICKS step_event_ticks
+  #define STEP_TICK_TIMER(rate) calc_timer((rate) << step_smoothing)
+#else
+  #define STEP_EVENT_TICKS current_block->step_event_count
+  #define STEP_TICK_TIMER(rate) calc_timer(rate)
+#endif
+#ifdef LIN_ADVANCE
+  static int e_steps_pending;                // E steps still to send: Bresenham steps and lead changes
+  static unsigned short lin_advance_steps;   // lead in E steps currently applied
+  static bool lin_advance_rev = false;       // the E direction pin is set for retraction
+#endif
 #ifdef ADVANCE
   static long advance_rate, advance, final_advance = 0;
   static long old_advance = 0;
@@ -63,6 +77,9 @@ static unsigned short acc_step_rate; // needed for deccelaration start point
 static char step_loops;
 static unsigned short OCR1A_nominal;
 static unsigned short step_loops_nominal;
+#ifdef REALTIME_FEEDRATE_OVERRIDE
+static unsigned long override_k = OVERRIDE_SCALE_ONE; // time scale stepped at, carried from block to block
+#endif
 
 volatile long endstops_trigsteps[3]={0,0,0};
 volatile long endstops_stepsTotal,endstops_stepsDone;
@@ -85,15 +102,181 @@ static bool old_z_max_endstop=false;
 
 static bool check_endstops = true;
 
+#ifdef ENDSTOP_INTERRUPTS
+  static volatile bool endstops_changed = true; // set by the pin interrupts, the endstops are read when set
+  static unsigned char endstops_polled = 0;     // endstops without an interrupt, read on every step
+  #define ENDSTOP_SEEN(hit) endstops_seen |= (hit)
+#else
+  #define ENDSTOP_SEEN(hit)
+#endif
+
+#ifdef STEPPER_ISR_PROFILE
+  // Timer1 ticks (0.5us at 16MHz) spent in the stepper interrupt
+  static unsigned short isr_ticks_min = 0xFFFF, isr_ticks_max = 0;
+  static unsigned long isr_ticks_total = 0, isr_count = 0;
+  static unsigned long isr_double_steps = 0, isr_quad_steps = 0; // interrupts that ran with step_loops 2 / 4
+  static unsigned long isr_missed = 0; // interrupts that ended after their next deadline
+#endif
+
+#ifdef DRY_PLANNING
+volatile bool dry_planning = false;
+#endif
+
+#ifdef EVENT_TRACE
+  static bool trace_stepper_idle = true; // TRACE_STEPPER_IDLE is recorded, until the next block starts
+#endif
+
+#ifdef LASER_PWM
+  static unsigned char laser_output_power = 0; // as last written to LASER_PIN
+#endif
+#ifdef LASER_RASTER
+  static unsigned char laser_power_set = 0;     // the power before the pixel is applied
+  static unsigned char laser_pixel = 255;       // pixel under the beam, 255 outside of G7 moves
+  static unsigned char raster_pixel;            // its index in the current block
+  static unsigned long raster_next_event;       // step events where the next pixel starts, in 1/256
+#endif
+
 volatile long count_position[NUM_AXIS] = { 0, 0, 0, 0};
 volatile signed char count_direction[NUM_AXIS] = { 1, 1, 1, 1};
 
+#ifdef TRAVEL_MICROSTEP_FACTOR
+  #if !defined(X_MS1_PIN) || X_MS1_PIN < 0 || !defined(Y_MS1_PIN) || Y_MS1_PIN < 0
+    #error "TRAVEL_MICROSTEP_FACTOR needs the MS pins of the X and Y drivers"
+  #endif
+  static volatile uint8_t microstep_phase[2] = { 0, 0 }; // see st_microstep_phase()
+  static uint8_t travel_fine_modes[2];      // X and Y modes as set by M350, for all but coarse travel blocks
+  static bool travel_microsteps = false;    // the X and Y drivers are at the coarse travel modes
+#endif
+
 //===========================================================================
 //=============================functions         ============================
 //===========================================================================
 
 #define CHECK_ENDSTOPS  if(check_endstops)
 
+#ifdef STEPPER_PORT_WRITES
+// Step slots: X, X2, Y, Y2, Z, Z2, E0, E1, E2. The port address of a missing slot is 0.
+#define STEP_SLOT_X  (1<<0)
+#define STEP_SLOT_X2 (1<<1)
+#define STEP_SLOT_Y  (1<<2)
+#define STEP_SLOT_Y2 (1<<3)
+#define STEP_SLOT_Z  (1<<4)
+#define STEP_SLOT_Z2 (1<<5)
+#define STEP_SLOT_E0 (1<<6)
+#define STEP_SLOT_E1 (1<<7)
+#define STEP_SLOT_E2 (1<<8)
+
+#define _STEP_ADDR(IO) (&(DIO ## IO ## _WPORT))
+#define STEP_ADDR(IO) _STEP_ADDR(IO)
+#define _STEP_BIT(IO) MASK(DIO ## IO ## _PIN)
+#define STEP_BIT(IO) _STEP_BIT(IO)
+#define STEP_NONE_ADDR ((volatile uint8_t *)0)
+
+#define STEP_ADDR_0 STEP_ADDR(X_STEP_PIN)
+#define STEP_BIT_0 STEP_BIT(X_STEP_PIN)
+#define STEP_INV_0 INVERT_X_STEP_PIN
+#ifdef DUAL_X_CARRIAGE
+  #define STEP_ADDR_1 STEP_ADDR(X2_STEP_PIN)
+  #define STEP_BIT_1 STEP_BIT(X2_STEP_PIN)
+#else
+  #define STEP_ADDR_1 STEP_NONE_ADDR
+  #define STEP_BIT_1 0
+#endif
+#define STEP_INV_1 INVERT_X_STEP_PIN
+#define STEP_ADDR_2 STEP_ADDR(Y_STEP_PIN)
+#define STEP_BIT_2 STEP_BIT(Y_STEP_PIN)
+#define STEP_INV_2 INVERT_Y_STEP_PIN
+#ifdef Y_DUAL_STEPPER_DRIVERS
+  #define STEP_ADDR_3 STEP_ADDR(Y2_STEP_PIN)
+  #define STEP_BIT_3 STEP_BIT(Y2_STEP_PIN)
+#else
+  #define STEP_ADDR_3 STEP_NONE_ADDR
+  #define STEP_BIT_3 0
+#endif
+#define STEP_INV_3 INVERT_Y_STEP_PIN
+#define STEP_ADDR_4 STEP_ADDR(Z_STEP_PIN)
+#define STEP_BIT_4 STEP_BIT(Z_STEP_PIN)
+#define STEP_INV_4 INVERT_Z_STEP_PIN
+#ifdef Z_DUAL_STEPPER_DRIVERS
+  #define STEP_ADDR_5 STEP_ADDR(Z2_STEP_PIN)
+  #define STEP_BIT_5 STEP_BIT(Z2_STEP_PIN)
+#else
+  #define STEP_ADDR_5 STEP_NONE_ADDR
+  #define STEP_BIT_5 0
+#endif
+#define STEP_INV_5 INVERT_Z_STEP_PIN
+#if !defined(ADVANCE) && !defined(LIN_ADVANCE) // those send the E steps themselves
+  #define STEP_ADDR_6 STEP_ADDR(E0_STEP_PIN)
+  #define STEP_BIT_6 STEP_BIT(E0_STEP_PIN)
+#else
+  #define STEP_ADDR_6 STEP_NONE_ADDR
+  #define STEP_BIT_6 0
+#endif
+#if !defined(ADVANCE) && !defined(LIN_ADVANCE) && EXTRUDERS > 1
+  #define STEP_ADDR_7 STEP_ADDR(E1_STEP_PIN)
+  #define STEP_BIT_7 STEP_BIT(E1_STEP_PIN)
+#else
+  #define STEP_ADDR_7 STEP_NONE_ADDR
+  #define STEP_BIT_7 0
+#endif
+#if !defined(ADVANCE) && !defined(LIN_ADVANCE) && EXTRUDERS > 2
+  #define STEP_ADDR_8 STEP_ADDR(E2_STEP_PIN)
+  #define STEP_BIT_8 STEP_BIT(E2_STEP_PIN)
+#else
+  #define STEP_ADDR_8 STEP_NONE_ADDR
+  #define STEP_BIT_8 0
+#endif
+#define STEP_INV_6 INVERT_E_STEP_PIN
+#define STEP_INV_7 INVERT_E_STEP_PIN
+#define STEP_INV_8 INVERT_E_STEP_PIN
+
+// The address comparisons are constant, so only the slot tests are left at run time
+#define STEP_SAME(a, n) (STEP_ADDR_##a == STEP_ADDR_##n)
+#define STEP_SLOT_BIT(a, n, slots) (STEP_SAME(a, n) && ((slots) & (1<<a)) ? STEP_BIT_##a : 0)
+#define STEP_MASK(n, slots) (STEP_SLOT_BIT(0, n, slots) | STEP_SLOT_BIT(1, n, slots) | \
+    STEP_SLOT_BIT(2, n, slots) | STEP_SLOT_BIT(3, n, slots) | STEP_SLOT_BIT(4, n, slots) | \
+    STEP_SLOT_BIT(5, n, slots) | STEP_SLOT_BIT(6, n, slots) | STEP_SLOT_BIT(7, n, slots) | \
+    STEP_SLOT_BIT(8, n, slots))
+// Port bits of the slots on port n whose step pulse is a high level
+#define STEP_ACTIVE_BIT(a, n) (STEP_SAME(a, n) && !STEP_INV_##a ? STEP_BIT_##a : 0)
+#define STEP_ACTIVE(n) (STEP_ACTIVE_BIT(0, n) | STEP_ACTIVE_BIT(1, n) | STEP_ACTIVE_BIT(2, n) | \
+    STEP_ACTIVE_BIT(3, n) | STEP_ACTIVE_BIT(4, n) | STEP_ACTIVE_BIT(5, n) | \
+    STEP_ACTIVE_BIT(6, n) | STEP_ACTIVE_BIT(7, n) | STEP_ACTIVE_BIT(8, n))
+// Only the lowest slot on each port writes it, covering every slot on that port
+#define STEP_FIRST_0 1
+#define STEP_FIRST_1 (!STEP_SAME(0, 1))
+#define STEP_FIRST_2 (!STEP_SAME(0, 2) && !STEP_SAME(1, 2))
+#define STEP_FIRST_3 (!STEP_SAME(0, 3) && !STEP_SAME(1, 3) && !STEP_SAME(2, 3))
+#define STEP_FIRST_4 (!STEP_SAME(0, 4) && !STEP_SAME(1, 4) && !STEP_SAME(2, 4) && !STEP_SAME(3, 4))
+#define STEP_FIRST_5 (!STEP_SAME(0, 5) && !STEP_SAME(1, 5) && \
+    !STEP_SAME(2, 5) && !STEP_SAME(3, 5) && !STEP_SAME(4, 5))
+#define STEP_FIRST_6 (!STEP_SAME(0, 6) && !STEP_SAME(1, 6) && !STEP_SAME(2, 6) && \
+    !STEP_SAME(3, 6) && !STEP_SAME(4, 6) && !STEP_SAME(5, 6))
+#define STEP_FIRST_7 (!STEP_SAME(0, 7) && !STEP_SAME(1, 7) && !STEP_SAME(2, 7) && \
+    !STEP_SAME(3, 7) && !STEP_SAME(4, 7) && !STEP_SAME(5, 7) && !STEP_SAME(6, 7))
+#define STEP_FIRST_8 (!STEP_SAME(0, 8) && !STEP_SAME(1, 8) && !STEP_SAME(2, 8) && !STEP_SAME(3, 8) && \
+    !STEP_SAME(4, 8) && !STEP_SAME(5, 8) && !STEP_SAME(6, 8) && !STEP_SAME(7, 8))
+#define STEP_WRITE_PORT(n, slots, pulse) do { \
+    if(STEP_ADDR_##n && STEP_FIRST_##n) { \
+      uint8_t mask = STEP_MASK(n, slots); \
+      if(mask) *STEP_ADDR_##n = (*STEP_ADDR_##n & ~mask) | (((pulse) ? STEP_ACTIVE(n) : ~STEP_ACTIVE(n)) & mask); \
+    } \
+  } while(0)
+#define STEP_WRITE_PORTS(slots, pulse) do { \
+    STEP_WRITE_PORT(0, slots, pulse); STEP_WRITE_PORT(1, slots, pulse); STEP_WRITE_PORT(2, slots, pulse); \
+    STEP_WRITE_PORT(3, slots, pulse); STEP_WRITE_PORT(4, slots, pulse); STEP_WRITE_PORT(5, slots, pulse); \
+    STEP_WRITE_PORT(6, slots, pulse); STEP_WRITE_PORT(7, slots, pulse); STEP_WRITE_PORT(8, slots, pulse); \
+  } while(0)
+
+// Slots that step for an X, Z or E step of the current block, set by set_block_directions()
+static unsigned int x_step_slots = STEP_SLOT_X;
+#ifdef Z_DUAL_AUTO_ALIGN
+static unsigned int z_step_slots = STEP_SLOT_Z | STEP_SLOT_Z2;
+#endif
+static unsigned int e_step_slots = STEP_SLOT_E0;
+#endif //STEPPER_PORT_WRITES
+
+#ifdef __AVR__
 // intRes = intIn1 * intIn2 >> 16
 // uses:
 // r26 to store 0
@@ -163,11 +346,11 @@ asm volatile ( \
 : \
 "r26" , "r27" \
 )
-
-// Some useful constants
-
-#define ENABLE_STEPPER_DRIVER_INTERRUPT()  TIMSK1 |= (1<<OCIE1A)
-#define DISABLE_STEPPER_DRIVER_INTERRUPT() TIMSK1 &= ~(1<<OCIE1A)
+#else
+// Plain C versions for the host simulation (sim/)
+#define MultiU16X8toH16(intRes, charIn1, intIn2) intRes = ((uint32_t)(charIn1) * (intIn2)) >> 8
+#define MultiU24X24toH16(intRes, longIn1, longIn2) intRes = ((uint64_t)(longIn1) * (longIn2)) >> 24
+#endif
 
 
 void checkHitEndstops()
@@ -176,14 +359,17 @@ void checkHitEndstops()
    SERIAL_ECHO_START;
    SERIAL_ECHOPGM(MSG_ENDSTOPS_HIT);
    if(endstop_x_hit) {
+     axis_known_position[X_AXIS] = false; // the move stopped short
      SERIAL_ECHOPAIR(" X:",(float)endstops_trigsteps[X_AXIS]/axis_steps_per_unit[X_AXIS]);
      LCD_MESSAGEPGM(MSG_ENDSTOPS_HIT "X");
    }
    if(endstop_y_hit) {
+     axis_known_position[Y_AXIS] = false; // the move stopped short
      SERIAL_ECHOPAIR(" Y:",(float)endstops_trigsteps[Y_AXIS]/axis_steps_per_unit[Y_AXIS]);
      LCD_MESSAGEPGM(MSG_ENDSTOPS_HIT "Y");
    }
    if(endstop_z_hit) {
+     axis_known_position[Z_AXIS] = false; // the move stopped short
      SERIAL_ECHOPAIR(" Z:",(float)endstops_trigsteps[Z_AXIS]/axis_steps_per_unit[Z_AXIS]);
      LCD_MESSAGEPGM(MSG_ENDSTOPS_HIT "Z");
    }
@@ -196,7 +382,7 @@ void checkHitEndstops()
    {
      card.sdprinting = false;
      card.closefile();
-     quickStop();
+     quickstop_moves();
      setTargetHotend0(0);
      setTargetHotend1(0);
      setTargetHotend2(0);
@@ -205,6 +391,27 @@ void checkHitEndstops()
  }
 }
 
+// Set by calc_timer() instead of printing from the interrupt, reported by checkStepRate()
+static volatile unsigned short step_rate_too_high = 0;
+
+void checkStepRate()
+{
+  if(step_rate_too_high) {
+    CRITICAL_SECTION_START;
+    unsigned short step_rate = step_rate_too_high;
+    step_rate_too_high = 0;
+    CRITICAL_SECTION_END;
+    SERIAL_ECHO_START;
+    SERIAL_ECHOPGM(MSG_STEPPER_TOO_HIGH);
+    SERIAL_ECHOLN(step_rate);
+  }
+}
+
+unsigned char endstops_hit_axes()
+{
+  return (endstop_x_hit ? (1<<X_AXIS) : 0) | (endstop_y_hit ? (1<<Y_AXIS) : 0) | (endstop_z_hit ? (1<<Z_AXIS) : 0);
+}
+
 void endstops_hit_on_purpose()
 {
   endstop_x_hit=false;
@@ -215,6 +422,9 @@ void endstops_hit_on_purpose()
 void enable_endstops(bool check)
 {
   check_endstops = check;
+  #ifdef ENDSTOP_INTERRUPTS
+    endstops_changed = true;
+  #endif
 }
 
 //         __________________________
@@ -244,44 +454,245 @@ void step_wait(){
 }
 
 
-FORCE_INLINE unsigned short calc_timer(unsigned short step_rate) {
+#ifdef SPEED_TABLE_RAM
+// Fast table entries 8..255 (calc_timer() only uses those): timer and slope in 1/16 ticks
+static uint16_t speed_table_fast_ram[256 - 8][2];
+
+static void speed_table_init()
+{
+  const float timer_freq = F_CPU / 8.0 * 16;
+  float a = timer_freq / (8 * 256 + (F_CPU/500000));
+  for(int i = 8; i < 256; i++) {
+    // the last slope is repeated, as create_speed_lookuptable.py does
+    float next = i < 255 ? timer_freq / ((i + 1) * 256 + (F_CPU/500000)) : a - speed_table_fast_ram[i - 9][1];
+    speed_table_fast_ram[i - 8][0] = (uint16_t)(a + 0.5);
+    speed_table_fast_ram[i - 8][1] = (uint16_t)(a - next + 0.5);
+    a = next;
+  }
+}
+#endif
+
+// Timer ticks per interrupt at step_rate, with the steps each interrupt takes in loops
+FORCE_INLINE unsigned short calc_timer_interval(unsigned short step_rate, char *loops) {
   unsigned short timer;
   if(step_rate > MAX_STEP_FREQUENCY) step_rate = MAX_STEP_FREQUENCY;
 
   if(step_rate > 20000) { // If steprate > 20kHz >> step 4 times
     step_rate = (step_rate >> 2)&0x3fff;
-    step_loops = 4;
+    *loops = 4;
   }
   else if(step_rate > 10000) { // If steprate > 10kHz >> step 2 times
     step_rate = (step_rate >> 1)&0x7fff;
-    step_loops = 2;
+    *loops = 2;
   }
   else {
-    step_loops = 1;
+    *loops = 1;
   }
 
   if(step_rate < (F_CPU/500000)) step_rate = (F_CPU/500000);
   step_rate -= (F_CPU/500000); // Correct for minimal speed
   if(step_rate >= (8*256)){ // higher step rate
-    unsigned short table_address = (unsigned short)&speed_lookuptable_fast[(unsigned char)(step_rate>>8)][0];
+  #ifdef SPEED_TABLE_RAM
+    uint16_t *entry = speed_table_fast_ram[(unsigned char)(step_rate>>8) - 8];
     unsigned char tmp_step_rate = (step_rate & 0x00ff);
-    unsigned short gain = (unsigned short)pgm_read_word_near(table_address+2);
+    MultiU16X8toH16(timer, tmp_step_rate, entry[1]);
+    timer = (entry[0] - timer + 8) >> 4;
+  #else
+    const uint16_t *table_entry = speed_lookuptable_fast[(unsigned char)(step_rate>>8)];
+    unsigned char tmp_step_rate = (step_rate & 0x00ff);
+    unsigned short gain = (unsigned short)pgm_read_word_near(table_entry+1);
     MultiU16X8toH16(timer, tmp_step_rate, gain);
-    timer = (unsigned short)pgm_read_word_near(table_address) - timer;
+    timer = (unsigned short)pgm_read_word_near(table_entry) - timer;
+  #endif
   }
   else { // lower step rates
-    unsigned short table_address = (unsigned short)&speed_lookuptable_slow[0][0];
-    table_address += ((step_rate)>>1) & 0xfffc;
-    timer = (unsigned short)pgm_read_word_near(table_address);
-    timer -= (((unsigned short)pgm_read_word_near(table_address+2) * (unsigned char)(step_rate & 0x0007))>>3);
+    const uint16_t *table_entry = speed_lookuptable_slow[step_rate>>3];
+    timer = (unsigned short)pgm_read_word_near(table_entry);
+    timer -= (((unsigned short)pgm_read_word_near(table_entry+1) * (unsigned char)(step_rate & 0x0007))>>3);
   }
-  if(timer < 100) { timer = 100; MYSERIAL.print(MSG_STEPPER_TOO_HIGH); MYSERIAL.println(step_rate); }//(20kHz this should never happen)
+  if(timer < 100) { timer = 100; step_rate_too_high = step_rate; }//(20kHz this should never happen)
   return timer;
 }
 
+// The same for the interrupt, which steps step_loops times per interrupt
+FORCE_INLINE unsigned short calc_timer(unsigned short step_rate) {
+  return calc_timer_interval(step_rate, &step_loops);
+}
+
+#ifdef MATH_BENCHMARK
+unsigned short bench_calc_timer(unsigned short step_rate)
+{
+  return calc_timer(step_rate);
+}
+#endif
+
 // Initializes the trapezoid generator from the current block. Called whenever a new
 // block begins.
+#ifdef STEP_SMOOTHING
+// Pick the most interrupts per step event that keep the nominal rate within STEP_SMOOTHING_RATE
+// and the Bresenham counters within a long
+FORCE_INLINE void set_step_smoothing() {
+  step_smoothing = 0;
+  while(step_smoothing < STEP_SMOOTHING_MAX
+        && (current_block->nominal_rate << (step_smoothing + 1)) <= STEP_SMOOTHING_RATE
+        && current_block->step_event_count < (0x20000000UL >> step_smoothing))
+    step_smoothing++;
+  smoothing_mask = (1 << step_smoothing) - 1;
+  smoothing_ticks = 0;
+  step_event_ticks = current_block->step_event_count << step_smoothing;
+}
+#endif
+
+#ifdef S_CURVE_ACCELERATION
+// Part of span that a ramp has covered after t timer ticks, following the Bezier curve
+// 10u^3 - 15u^4 + 6u^5 of the ramp fraction u. All in 1/2^15 parts.
+FORCE_INLINE unsigned short s_curve_delta(unsigned long t, signed char shift, unsigned long inverse, unsigned short span) {
+  for(; shift > 0; shift--) t <<= 1;
+  for(; shift < 0; shift++) t >>= 1;
+  if(t > 0x1FFFF) return span;
+  unsigned short u;
+  MultiU24X24toH16(u, t, inverse);
+  if(u >= 32768) return span;
+  unsigned long u2 = ((unsigned long)u * u) >> 15;
+  unsigned long u3 = (u2 * u) >> 15;
+  unsigned long poly = 40960 + ((u2 * 6) >> 3) - (((unsigned long)u * 15) >> 3); // 10 - 15u + 6u^2 in 1/4096
+  unsigned long bezier = (u3 * poly) >> 12;
+  return ((unsigned long)span * bezier) >> 15;
+}
+#endif
+
+#ifdef LIN_ADVANCE
+// Bring the lead of the extruder to what the block asks for at this step rate. The difference is
+// queued with the Bresenham E steps and sent by lin_advance_step().
+FORCE_INLINE void lin_advance_update(unsigned long step_rate) {
+  unsigned short lead;
+  MultiU24X24toH16(lead, step_rate, current_block->advance_k24);
+  e_steps_pending += (int)(lead - lin_advance_steps);
+  lin_advance_steps = lead;
+}
+
+// Send at most one queued E step per step event. The previous pulse is ended first, so the pulse
+// lasts until the next call.
+FORCE_INLINE void lin_advance_step() {
+  WRITE_E_STEP(INVERT_E_STEP_PIN);
+  if (e_steps_pending == 0)
+    return;
+  bool rev = e_steps_pending < 0;
+  if (rev != lin_advance_rev) {
+    lin_advance_rev = rev;
+    if (rev)
+      REV_E_DIR();
+    else
+      NORM_E_DIR();
+    delayMicroseconds(1); // direction setup time of the drivers
+  }
+  e_steps_pending += rev ? 1 : -1;
+  WRITE_E_STEP(!INVERT_E_STEP_PIN);
+}
+
+// At the end of the last queued block the lead goes back to nothing. True while E steps are still
+// queued then: the block is held until they are out, with the stepper idle nothing would send them.
+FORCE_INLINE bool lin_advance_drain() {
+  if (((block_buffer_head - block_buffer_tail) & (BLOCK_BUFFER_SIZE - 1)) > 1)
+    return false; // the next block takes the lead over
+  e_steps_pending -= lin_advance_steps;
+  lin_advance_steps = 0;
+  return e_steps_pending != 0;
+}
+#endif
+
+#ifdef LASER_PWM
+// analogWrite() is slow for the stepper interrupt, so only call it when the power changes
+FORCE_INLINE void laser_output(unsigned char power) {
+  #ifdef LASER_RASTER
+    laser_power_set = power;
+    power = ((unsigned short)power * (laser_pixel + 1)) >> 8;
+  #endif
+  if (power != laser_output_power) {
+    laser_output_power = power;
+    analogWrite(LASER_PIN, power);
+  }
+}
+
+#ifdef LASER_POWER_FOLLOWS_SPEED
+// The rate never exceeds nominal_rate, so the product stays below 2^24 + nominal_rate
+FORCE_INLINE void laser_output_rate(unsigned short rate) {
+  unsigned short power = ((unsigned long)rate * current_block->laser_scale) >> 16;
+  laser_output(power < current_block->laser_power ? power : current_block->laser_power);
+}
+#endif
+
+#ifdef LASER_RASTER
+// Set the first pixel of a block that was just loaded, before its power is written
+FORCE_INLINE void raster_block_start() {
+  if (current_block->raster_pixels) {
+    raster_pixel = 0;
+    raster_next_event = current_block->raster_pixel_events;
+    laser_pixel = raster_buffer[current_block->raster_start & (LASER_RASTER_BUFFER - 1)];
+  }
+  else
+    laser_pixel = 255;
+}
+
+// Move on to the pixel the step events done so far have reached
+FORCE_INLINE void raster_update() {
+  unsigned long events = (unsigned long)step_events_completed << 8;
+  if (events < raster_next_event)
+    return;
+  do {
+    raster_pixel++;
+    raster_next_event += current_block->raster_pixel_events;
+  } while (events >= raster_next_event);
+  if (raster_pixel < current_block->raster_pixels) {
+    laser_pixel = raster_buffer[(unsigned char)(current_block->raster_start + raster_pixel) & (LASER_RASTER_BUFFER - 1)];
+    laser_output(laser_power_set);
+  }
+}
+#endif
+#endif
+
+#ifdef REALTIME_FEEDRATE_OVERRIDE
+#define OVERRIDE_ACTIVE() (override_k != OVERRIDE_SCALE_ONE || current_block->override_scale != OVERRIDE_SCALE_ONE)
+
+// The rate stepped at for a rate of the trapezoid
+FORCE_INLINE unsigned short override_rate(unsigned short rate) {
+  if (override_k == OVERRIDE_SCALE_ONE)
+    return rate;
+  unsigned short scaled;
+  MultiU24X24toH16(scaled, rate, override_k);
+  return scaled;
+}
+
+// The time along the trapezoid that timer ticks of stepping stand for
+FORCE_INLINE unsigned short override_time(unsigned short timer) {
+  if (override_k == OVERRIDE_SCALE_ONE)
+    return timer;
+  unsigned short scaled;
+  MultiU24X24toH16(scaled, timer, override_k);
+  return scaled;
+}
+
+// Move the time scale towards the one of the block, at most as fast as its acceleration allows.
+// It only moves against the trapezoid, down while it speeds up and up while it slows down, or
+// either way while cruising, so the two changes together never exceed the acceleration.
+FORCE_INLINE void override_ramp(unsigned short timer, bool may_rise, bool may_fall) {
+  unsigned long target = current_block->override_scale;
+  if (override_k == target)
+    return;
+  unsigned long step = (unsigned long)timer * current_block->override_ramp;
+  if (override_k < target) {
+    if (may_rise)
+      override_k = target - override_k > step ? override_k + step : target;
+  }
+  else if (may_fall)
+    override_k = override_k - target > step ? override_k - step : target;
+}
+#endif
+
 FORCE_INLINE void trapezoid_generator_reset() {
+  #ifdef LIN_ADVANCE
+    lin_advance_update(current_block->initial_rate);
+  #endif
   #ifdef ADVANCE
     advance = current_block->initial_advance;
     final_advance = current_block->final_advance;
@@ -291,12 +702,17 @@ FORCE_INLINE void trapezoid_generator_reset() {
   #endif
   deceleration_time = 0;
   // step_rate to timer interval
-  OCR1A_nominal = calc_timer(current_block->nominal_rate);
+  OCR1A_nominal = STEP_TICK_TIMER(current_block->nominal_rate);
   // make a note of the number of step loops required at nominal speed
   step_loops_nominal = step_loops;
   acc_step_rate = current_block->initial_rate;
-  acceleration_time = calc_timer(acc_step_rate);
+  #ifdef REALTIME_FEEDRATE_OVERRIDE
+  OCR1A = STEP_TICK_TIMER(override_rate(acc_step_rate));
+  acceleration_time = override_time(OCR1A);
+  #else
+  acceleration_time = STEP_TICK_TIMER(acc_step_rate);
   OCR1A = acceleration_time;
+  #endif
 
 //    SERIAL_ECHO_START;
 //    SERIAL_ECHOPGM("advance :");
@@ -310,25 +726,1008 @@ FORCE_INLINE void trapezoid_generator_reset() {
 
 }
 
+#ifdef STEP_SEGMENTS
+// A piece of a block that the stepper interrupt steps at one rate
+typedef struct {
+  unsigned short timer;  // OCR1A for each interrupt of the segment
+  unsigned short events; // step events in the segment
+  unsigned char loops;   // step events per interrupt, the last interrupt may do fewer
+  bool last;             // the last segment of its block
+} step_segment_t;
+
+#define SEGMENT_TICKS ((unsigned long)STEP_SEGMENT_US * (F_CPU / 80000UL) / 100)
+#define SEGMENT_INDEX(i) ((i) & (STEP_SEGMENT_BUFFER - 1))
+#define PREP_ABORT_NONE 0xff
+
+// The segment ring has one producer, st_prep_segments() in the main loop, and one consumer, the
+// stepper interrupt, like the block ring. The interrupt prepares a segment itself only while
+// prep_busy is clear, so the preparation state below is never used by both at once.
+static step_segment_t segment_buffer[STEP_SEGMENT_BUFFER];
+static volatile unsigned char segment_head = 0, segment_tail = 0;
+static volatile bool prep_busy = false;
+// Index of the block an endstop ended early; its segments are dropped, the rest is not prepared
+static volatile unsigned char prep_abort = PREP_ABORT_NONE;
+static step_segment_t *segment = NULL; // the segment being stepped
+static unsigned short segment_events;  // step events left in it
+#ifdef STEPPER_ISR_PROFILE
+  static unsigned long segment_underruns = 0; // segments the interrupt had to prepare itself
+#endif
+
+static block_t *prep_block = NULL;    // the block being sliced
+static unsigned char prep_index = 0;  // its index, or the one of the next block to slice
+static unsigned long prep_events;     // step events of it already in segments
+static unsigned long prep_accel_time, prep_decel_time; // timer ticks into the acceleration and the deceleration
+static unsigned short prep_cruise_rate; // rate the acceleration reached, the deceleration starts from there
+
+// Step rate t timer ticks into the acceleration
+static unsigned short prep_accel_rate(unsigned long t) {
+  unsigned short rate;
+  #ifdef S_CURVE_ACCELERATION
+  if (prep_block->accel_inverse) {
+    rate = prep_block->initial_rate + s_curve_delta(t, prep_block->accel_shift,
+      prep_block->accel_inverse, prep_block->cruise_rate - prep_block->initial_rate);
+  }
+  else
+  #endif
+  {
+    MultiU24X24toH16(rate, t, prep_block->acceleration_rate);
+    rate += prep_block->initial_rate;
+  }
+  if (rate > prep_block->nominal_rate)
+    rate = prep_block->nominal_rate;
+  return rate;
+}
+
+// Step rate t timer ticks into the deceleration
+static unsigned short prep_decel_rate(unsigned long t) {
+  unsigned short rate;
+  #ifdef S_CURVE_ACCELERATION
+  if (prep_block->decel_inverse) {
+    rate = prep_block->cruise_rate - s_curve_delta(t, prep_block->decel_shift,
+      prep_block->decel_inverse, prep_block->cruise_rate - prep_block->final_rate);
+  }
+  else
+  #endif
+  {
+    unsigned short drop;
+    MultiU24X24toH16(drop, t, prep_block->acceleration_rate);
+    rate = drop > prep_cruise_rate ? prep_block->final_rate : prep_cruise_rate - drop;
+  }
+  if (rate < prep_block->final_rate)
+    rate = prep_block->final_rate;
+  return rate;
+}
+
+// Fill seg with the step events at rate that fit in a segment, at most left of them, and return the
+// timer ticks they take. A rate too slow for two steps in a segment gets a segment per interrupt.
+static unsigned long prep_slice(step_segment_t *seg, unsigned short rate, unsigned long left) {
+  char loops;
+  seg->timer = calc_timer_interval(rate, &loops);
+  seg->loops = loops;
+  unsigned long interrupts = SEGMENT_TICKS / seg->timer;
+  if (interrupts == 0)
+    interrupts = 1;
+  if (interrupts * loops > left) {
+    interrupts = (left + loops - 1) / loops;
+    seg->events = left;
+  }
+  else
+    seg->events = interrupts * loops;
+  return interrupts * seg->timer;
+}
+
+// Slice the next segment off the block being prepared, starting on the next block if there is none.
+// Returns false if there is nothing to slice. The segment gets the rate of the trapezoid half way
+// through it.
+static bool prep_segment() {
+  if (prep_block == NULL) {
+    prep_block = plan_get_block(prep_index);
+    if (prep_block == NULL)
+      return false;
+    prep_events = 0;
+    prep_accel_time = 0;
+    prep_decel_time = 0;
+    prep_cruise_rate = prep_block->initial_rate;
+  }
+  step_segment_t *seg = &segment_buffer[segment_head];
+  if (prep_abort == prep_index) {
+    // an empty last segment, for the interrupt to drop the block
+    seg->timer = 200;
+    seg->loops = 1;
+    seg->events = 0;
+    prep_events = prep_block->step_event_count;
+    prep_abort = PREP_ABORT_NONE;
+  }
+  else if (prep_events < (unsigned long)prep_block->accelerate_until) {
+    char loops;
+    unsigned short timer = calc_timer_interval(prep_accel_rate(prep_accel_time), &loops);
+    unsigned short rate = prep_accel_rate(prep_accel_time + (timer > SEGMENT_TICKS ? timer : SEGMENT_TICKS) / 2);
+    prep_accel_time += prep_slice(seg, rate, prep_block->accelerate_until - prep_events);
+    prep_cruise_rate = prep_accel_rate(prep_accel_time);
+  }
+  else if (prep_events < (unsigned long)prep_block->decelerate_after) {
+    // one segment for the whole cruise, as long as the count fits
+    unsigned long left = prep_block->decelerate_after - prep_events;
+    char loops;
+    seg->timer = calc_timer_interval(prep_block->nominal_rate, &loops);
+    seg->loops = loops;
+    seg->events = left > 0xFFFF ? 0xFFFF : left;
+  }
+  else {
+    char loops;
+    unsigned short timer = calc_timer_interval(prep_decel_rate(prep_decel_time), &loops);
+    unsigned short rate = prep_decel_rate(prep_decel_time + (timer > SEGMENT_TICKS ? timer : SEGMENT_TICKS) / 2);
+    prep_decel_time += prep_slice(seg, rate, prep_block->step_event_count - prep_events);
+  }
+  prep_events += seg->events;
+  seg->last = prep_events >= prep_block->step_event_count;
+  if (seg->last) {
+    prep_block = NULL;
+    prep_index = (prep_index + 1) & (BLOCK_BUFFER_SIZE - 1);
+  }
+  MEMORY_BARRIER(); // the segment is written before the interrupt can see it
+  segment_head = SEGMENT_INDEX(segment_head + 1);
+  return true;
+}
+
+void st_prep_segments() {
+  if (prep_busy)
+    return;
+  prep_busy = true;
+  while (SEGMENT_INDEX(segment_head + 1) != segment_tail && prep_segment())
+    ;
+  prep_busy = false;
+}
+
+// The segment to step next, prepared here if the main loop has not got to it. NULL if there is none.
+FORCE_INLINE step_segment_t *segment_get() {
+  if (segment_head == segment_tail && !prep_busy) {
+    #ifdef STEPPER_ISR_PROFILE
+    if (prep_segment())
+      segment_underruns++;
+    #else
+    prep_segment();
+    #endif
+  }
+  return segment_head != segment_tail ? &segment_buffer[segment_tail] : NULL;
+}
+
+// Done with the segment being stepped; after the last one of the block the block is done too
+FORCE_INLINE void segment_done() {
+  bool last = segment->last;
+  segment = NULL;
+  segment_tail = SEGMENT_INDEX(segment_tail + 1);
+  if (last) {
+    prep_abort = PREP_ABORT_NONE;
+    current_block = NULL;
+    plan_discard_current_block();
+  }
+}
+#endif //STEP_SEGMENTS
+
 // "The Stepper Driver Interrupt" - This timer interrupt is the workhorse.
 // It pops blocks from the block_buffer and executes them by pulsing the stepper pins appropriately.
-ISR(TIMER1_COMPA_vect)
+// Endstops the current block has to watch, worked out once per block by set_block_directions()
+#define ENDSTOP_X_MIN 0
+#define ENDSTOP_X_MAX 1
+#define ENDSTOP_Y_MIN 2
+#define ENDSTOP_Y_MAX 3
+#define ENDSTOP_Z_MIN 4
+#define ENDSTOP_Z_MAX 5
+static unsigned char endstop_mask;
+#ifdef DUAL_X_CARRIAGE
+unsigned char dual_x_steppers = DXC_X_STEPPER | DXC_E0_STEPPER;
+#endif
+#ifdef Z_DUAL_AUTO_ALIGN
+unsigned char z_dual_steppers = Z_DUAL_Z_STEPPER | Z_DUAL_Z2_STEPPER;
+#endif
+
+// Set the direction pins and the endstops to check for a block that was just loaded.
+// This used to be redone on every stepper interrupt. (X_AXIS=A_AXIS and Y_AXIS=B_AXIS for COREXY)
+FORCE_INLINE void set_block_directions()
+{
+  out_bits = current_block->direction_bits;
+  endstop_mask = 0;
+  #ifdef ENDSTOP_INTERRUPTS
+    endstops_changed = true; // the pins that were not checked may have changed unseen
+  #endif
+
+  #ifdef DUAL_X_CARRIAGE
+    if (extruder_duplication_enabled)
+      dual_x_steppers = DXC_X_STEPPER | DXC_X2_STEPPER | DXC_E0_STEPPER | DXC_E1_STEPPER
+                        | (extruder_duplication_mirrored ? DXC_X2_MIRRORED : 0);
+    else if (current_block->active_extruder != 0)
+      dual_x_steppers = DXC_X2_STEPPER | DXC_E1_STEPPER;
+    else
+      dual_x_steppers = DXC_X_STEPPER | DXC_E0_STEPPER;
+  #endif
+  // With INPUT_SHAPING the X and Y direction pins are set for each step of the motors
+  if((out_bits & (1<<X_AXIS))!=0){
+    #ifdef DUAL_X_CARRIAGE
+      if (dual_x_steppers & DXC_X_STEPPER)
+        WRITE(X_DIR_PIN, INVERT_X_DIR);
+      if (dual_x_steppers & DXC_X2_STEPPER) // mirrored, the second carriage goes the other way
+        WRITE(X2_DIR_PIN, (dual_x_steppers & DXC_X2_MIRRORED) ? !INVERT_X_DIR : INVERT_X_DIR);
+    #elif !defined(INPUT_SHAPING)
+      WRITE(X_DIR_PIN, INVERT_X_DIR);
+    #endif        
+    count_direction[X_AXIS]=-1;
+  }
+  else{
+    #ifdef DUAL_X_CARRIAGE
+      if (dual_x_steppers & DXC_X_STEPPER)
+        WRITE(X_DIR_PIN, !INVERT_X_DIR);
+      if (dual_x_steppers & DXC_X2_STEPPER)
+        WRITE(X2_DIR_PIN, (dual_x_steppers & DXC_X2_MIRRORED) ? INVERT_X_DIR : !INVERT_X_DIR);
+    #elif !defined(INPUT_SHAPING)
+      WRITE(X_DIR_PIN, !INVERT_X_DIR);
+    #endif        
+    count_direction[X_AXIS]=1;
+  }
+  if((out_bits & (1<<Y_AXIS))!=0){
+    #ifndef INPUT_SHAPING
+    WRITE(Y_DIR_PIN, INVERT_Y_DIR);
+    #ifdef Y_DUAL_STEPPER_DRIVERS
+      WRITE(Y2_DIR_PIN, !(INVERT_Y_DIR == INVERT_Y2_VS_Y_DIR));
+    #endif
+    #endif
+    count_direction[Y_AXIS]=-1;
+  }
+  else{
+    #ifndef INPUT_SHAPING
+    WRITE(Y_DIR_PIN, !INVERT_Y_DIR);
+    #ifdef Y_DUAL_STEPPER_DRIVERS
+      WRITE(Y2_DIR_PIN, (INVERT_Y_DIR == INVERT_Y2_VS_Y_DIR));
+    #endif
+    #endif
+    count_direction[Y_AXIS]=1;
+  }
+  if ((out_bits & (1<<Z_AXIS)) != 0) {   // -direction
+    WRITE(Z_DIR_PIN,INVERT_Z_DIR);
+    #ifdef Z_DUAL_STEPPER_DRIVERS
+      WRITE(Z2_DIR_PIN,INVERT_Z_DIR);
+    #endif
+    count_direction[Z_AXIS]=-1;
+  }
+  else { // +direction
+    WRITE(Z_DIR_PIN,!INVERT_Z_DIR);
+    #ifdef Z_DUAL_STEPPER_DRIVERS
+      WRITE(Z2_DIR_PIN,!INVERT_Z_DIR);
+    #endif
+    count_direction[Z_AXIS]=1;
+  }
+  #ifndef ADVANCE
+    if ((out_bits & (1<<E_AXIS)) != 0) {  // -direction
+      REV_E_DIR();
+      count_direction[E_AXIS]=-1;
+    }
+    else { // +direction
+      NORM_E_DIR();
+      count_direction[E_AXIS]=1;
+    }
+    #ifdef LIN_ADVANCE
+      lin_advance_rev = count_direction[E_AXIS] < 0; // the pin of this block's extruder is set now
+    #endif
+  #endif //!ADVANCE
+
+  #ifdef TRAVEL_MICROSTEP_FACTOR
+    if (current_block->travel_microsteps != travel_microsteps) {
+      travel_microsteps = current_block->travel_microsteps;
+      microstep_mode(X_AXIS, travel_fine_modes[X_AXIS]);
+      microstep_mode(Y_AXIS, travel_fine_modes[Y_AXIS]);
+    }
+    if (travel_microsteps) { // count_position stays in normal microsteps
+      count_direction[X_AXIS] *= TRAVEL_MICROSTEP_FACTOR;
+      count_direction[Y_AXIS] *= TRAVEL_MICROSTEP_FACTOR;
+    }
+  #endif
+
+  #ifdef STEPPER_PORT_WRITES
+    #ifdef DUAL_X_CARRIAGE
+      x_step_slots = ((dual_x_steppers & DXC_X_STEPPER) ? STEP_SLOT_X : 0)
+                     | ((dual_x_steppers & DXC_X2_STEPPER) ? STEP_SLOT_X2 : 0);
+    #endif
+    #ifdef Z_DUAL_AUTO_ALIGN
+      z_step_slots = ((z_dual_steppers & Z_DUAL_Z_STEPPER) ? STEP_SLOT_Z : 0)
+                     | ((z_dual_steppers & Z_DUAL_Z2_STEPPER) ? STEP_SLOT_Z2 : 0);
+    #endif
+    e_step_slots = STEP_SLOT_E0 << current_block->active_extruder;
+    #if defined(DUAL_X_CARRIAGE) && EXTRUDERS == 2
+      if (extruder_duplication_enabled) e_step_slots = STEP_SLOT_E0 | STEP_SLOT_E1;
+    #endif
+  #endif
+
+  // An endstop is only checked for an axis that moves, on the side it moves towards
+  if (current_block->steps_x > 0) {
+    if (kin_toward_x_min(out_bits)) {
+      #ifdef DUAL_X_CARRIAGE
+      // with 2 x-carriages, endstops are only checked in the homing direction for the active extruder
+      if ((current_block->active_extruder == 0 && X_HOME_DIR == -1) 
+          || (current_block->active_extruder != 0 && X2_HOME_DIR == -1))
+      #endif          
+        endstop_mask |= (1<<ENDSTOP_X_MIN);
+    }
+    else { // +direction
+      #ifdef DUAL_X_CARRIAGE
+      if ((current_block->active_extruder == 0 && X_HOME_DIR == 1) 
+          || (current_block->active_extruder != 0 && X2_HOME_DIR == 1))
+      #endif          
+        endstop_mask |= (1<<ENDSTOP_X_MAX);
+    }
+  }
+  if (current_block->steps_y > 0) {
+    if (kin_toward_y_min(out_bits)) {
+      endstop_mask |= (1<<ENDSTOP_Y_MIN);
+    }
+    else { // +direction
+      endstop_mask |= (1<<ENDSTOP_Y_MAX);
+    }
+  }
+  if (current_block->steps_z > 0) {
+    if ((out_bits & (1<<Z_AXIS)) != 0)   // -direction
+      endstop_mask |= (1<<ENDSTOP_Z_MIN);
+    else // +direction
+      endstop_mask |= (1<<ENDSTOP_Z_MAX);
+  }
+}
+
+#ifdef DRY_PLANNING
+// Retire the next block at once, moving the position as if it had been stepped
+FORCE_INLINE void dry_planning_isr()
+{
+  block_t *block = plan_get_current_block();
+  if (block != NULL) {
+    unsigned char bits = block->direction_bits;
+    long steps_x = block->steps_x, steps_y = block->steps_y;
+    #ifdef TRAVEL_MICROSTEP_FACTOR
+      if (block->travel_microsteps) {
+        steps_x *= TRAVEL_MICROSTEP_FACTOR;
+        steps_y *= TRAVEL_MICROSTEP_FACTOR;
+      }
+    #endif
+    count_position[X_AXIS] += (bits & (1<<X_AXIS)) ? -steps_x : steps_x;
+    count_position[Y_AXIS] += (bits & (1<<Y_AXIS)) ? -steps_y : steps_y;
+    count_position[Z_AXIS] += (bits & (1<<Z_AXIS)) ? -block->steps_z : block->steps_z;
+    count_position[E_AXIS] += (bits & (1<<E_AXIS)) ? -block->steps_e : block->steps_e;
+    plan_discard_current_block();
+  }
+  OCR1A = 200;
+}
+#endif
+
+// The body is kept in stepper_isr() so STEPPER_ISR_PROFILE can time it.
+#ifdef BABYSTEPPING
+volatile int babystepsTodo[3]={0,0,0};
+static unsigned short babystep_ticks = 0; // timer ticks since the last babysteps
+
+#define BABYSTEP_TICKS (F_CPU / 8 / BABYSTEP_RATE)
+
+// One step on each of the X, Y and Z motors whose direction is not 0 (1 forward, -1 back). It is
+// a step the planner does not know of, so count_position stays. The direction pins are put back
+// for the current block, which steps right after in the same interrupt.
+static void babystep_motors(const signed char x, const signed char y, const signed char z)
 {
+  uint8_t old_x_dir = READ(X_DIR_PIN), old_y_dir = READ(Y_DIR_PIN), old_z_dir = READ(Z_DIR_PIN);
+  #ifdef DUAL_X_CARRIAGE
+    uint8_t old_x2_dir = READ(X2_DIR_PIN);
+  #endif
+  #ifdef Y_DUAL_STEPPER_DRIVERS
+    uint8_t old_y2_dir = READ(Y2_DIR_PIN);
+  #endif
+  #ifdef Z_DUAL_STEPPER_DRIVERS
+    uint8_t old_z2_dir = READ(Z2_DIR_PIN);
+  #endif
+
+  if (x) {
+    enable_x();
+    #ifdef DUAL_X_CARRIAGE
+      if (dual_x_steppers & DXC_X_STEPPER)
+        WRITE(X_DIR_PIN, INVERT_X_DIR ^ (x > 0));
+      if (dual_x_steppers & DXC_X2_STEPPER)
+        WRITE(X2_DIR_PIN, INVERT_X_DIR ^ (x > 0) ^ ((dual_x_steppers & DXC_X2_MIRRORED) != 0));
+    #else
+      WRITE(X_DIR_PIN, INVERT_X_DIR ^ (x > 0));
+    #endif
+  }
+  if (y) {
+    enable_y();
+    WRITE(Y_DIR_PIN, INVERT_Y_DIR ^ (y > 0));
+    #ifdef Y_DUAL_STEPPER_DRIVERS
+      WRITE(Y2_DIR_PIN, (INVERT_Y_DIR == INVERT_Y2_VS_Y_DIR) ^ (y < 0));
+    #endif
+  }
+  if (z) {
+    enable_z();
+    WRITE(Z_DIR_PIN, INVERT_Z_DIR ^ (z > 0));
+    #ifdef Z_DUAL_STEPPER_DRIVERS
+      WRITE(Z2_DIR_PIN, INVERT_Z_DIR ^ (z > 0));
+    #endif
+  }
+  delayMicroseconds(1); // direction setup time of the drivers
+  #ifdef TRAVEL_MICROSTEP_FACTOR
+    microstep_phase[X_AXIS] += travel_microsteps ? x * TRAVEL_MICROSTEP_FACTOR : x;
+    microstep_phase[Y_AXIS] += travel_microsteps ? y * TRAVEL_MICROSTEP_FACTOR : y;
+  #endif
+
+  if (x) {
+    #ifdef DUAL_X_CARRIAGE
+      if (dual_x_steppers & DXC_X_STEPPER)
+        WRITE(X_STEP_PIN, !INVERT_X_STEP_PIN);
+      if (dual_x_steppers & DXC_X2_STEPPER)
+        WRITE(X2_STEP_PIN, !INVERT_X_STEP_PIN);
+    #else
+      WRITE(X_STEP_PIN, !INVERT_X_STEP_PIN);
+    #endif
+  }
+  if (y) {
+    WRITE(Y_STEP_PIN, !INVERT_Y_STEP_PIN);
+    #ifdef Y_DUAL_STEPPER_DRIVERS
+      WRITE(Y2_STEP_PIN, !INVERT_Y_STEP_PIN);
+    #endif
+  }
+  if (z) {
+    WRITE(Z_STEP_PIN, !INVERT_Z_STEP_PIN);
+    #ifdef Z_DUAL_STEPPER_DRIVERS
+      WRITE(Z2_STEP_PIN, !INVERT_Z_STEP_PIN);
+    #endif
+  }
+  delayMicroseconds(1); // step pulse width
+  WRITE(X_STEP_PIN, INVERT_X_STEP_PIN);
+  #ifdef DUAL_X_CARRIAGE
+    WRITE(X2_STEP_PIN, INVERT_X_STEP_PIN);
+  #endif
+  WRITE(Y_STEP_PIN, INVERT_Y_STEP_PIN);
+  #ifdef Y_DUAL_STEPPER_DRIVERS
+    WRITE(Y2_STEP_PIN, INVERT_Y_STEP_PIN);
+  #endif
+  WRITE(Z_STEP_PIN, INVERT_Z_STEP_PIN);
+  #ifdef Z_DUAL_STEPPER_DRIVERS
+    WRITE(Z2_STEP_PIN, INVERT_Z_STEP_PIN);
+  #endif
+
+  WRITE(X_DIR_PIN, old_x_dir);
+  #ifdef DUAL_X_CARRIAGE
+    WRITE(X2_DIR_PIN, old_x2_dir);
+  #endif
+  WRITE(Y_DIR_PIN, old_y_dir);
+  #ifdef Y_DUAL_STEPPER_DRIVERS
+    WRITE(Y2_DIR_PIN, old_y2_dir);
+  #endif
+  WRITE(Z_DIR_PIN, old_z_dir);
+  #ifdef Z_DUAL_STEPPER_DRIVERS
+    WRITE(Z2_DIR_PIN, old_z2_dir);
+  #endif
+  delayMicroseconds(1); // direction setup time again, for the step of the block that follows
+}
+
+// Take one pending babystep per axis once BABYSTEP_TICKS have passed since the last ones. elapsed
+// is the interval of the timer tick that just ended. This runs inside the stepper interrupt, so
+// the babysteps fall between two steps of the current block and never race its pin writes.
+FORCE_INLINE void babystep_isr(unsigned short elapsed)
+{
+  if (babystep_ticks < BABYSTEP_TICKS) {
+    babystep_ticks += elapsed < BABYSTEP_TICKS ? elapsed : BABYSTEP_TICKS;
+    return;
+  }
+  signed char todo[3];
+  bool any = false;
+  for (uint8_t axis = 0; axis < 3; axis++) {
+    int curTodo = babystepsTodo[axis]; // get rid of volatile for performance
+    todo[axis] = curTodo > 0 ? 1 : curTodo < 0 ? -1 : 0;
+    #ifdef KINEMATICS_COUPLED_XY
+      if (axis == Y_AXIS && todo[X_AXIS]) todo[Y_AXIS] = 0; // X and Y turn the same motors, take turns
+    #endif
+    if (todo[axis]) {
+      babystepsTodo[axis] = curTodo - todo[axis];
+      any = true;
+    }
+  }
+  if (!any) return; // stay due, so the next babystep goes out on the next tick
+  babystep_ticks = 0;
+
+  #ifdef BABYSTEP_INVERT_Z
+    if (BABYSTEP_INVERT_Z) todo[Z_AXIS] = -todo[Z_AXIS];
+  #endif
+  signed char motor[3];
+  kin_babystep_motors(todo, motor);
+  babystep_motors(motor[X_AXIS], motor[Y_AXIS], motor[Z_AXIS]);
+}
+#endif //BABYSTEPPING
+
+#ifdef INPUT_SHAPING
+// Input shaping of the X and Y motors (A and B with COREXY). The Bresenham tracer only counts the steps
+// of each interrupt in shaping_steps[]. shaping_isr() owes the motor weight[0] 256ths of each of them
+// at once and queues them, and owes it weight[i] more once delay[i-1] has passed. The motor steps
+// whenever it is owed half a step or more, so in the end it makes exactly the planned steps.
+#ifdef INPUT_SHAPING_ZVD
+  #define SHAPING_ECHOES 2
+#else
+  #define SHAPING_ECHOES 1
+#endif
+#define SHAPING_TICK_SHIFT 2 // the echo clock counts 4 timer ticks, so delays of up to 131 ms fit 16 bits
+#define SHAPING_UNITS_PER_S (F_CPU / (8UL << SHAPING_TICK_SHIFT))
+#define SHAPING_MIN_TICKS 100 // soonest interrupt for an echo, after the one that is running
+#define SHAPING_NEXT(i) (((i) + 1) & (INPUT_SHAPING_BUFFER - 1))
+
+struct shaping_params_t {
+  int weight[SHAPING_ECHOES + 1];       // 256ths of a step, adding up to 256
+  unsigned short delay[SHAPING_ECHOES]; // echo clock units, 0 without shaping
+};
+struct shaping_axis_t {
+  shaping_params_t params;              // in use
+  shaping_params_t staged;              // taken over at a step while nothing is queued
+  bool staged_new;
+  int owed;                             // 256ths of a step the motor has still to make
+  bool backward;                        // the direction pin
+  unsigned short stamp[INPUT_SHAPING_BUFFER]; // echo clock of each queued interrupt
+  signed char steps[INPUT_SHAPING_BUFFER];    // and its steps
+  uint8_t head;
+  uint8_t tail[SHAPING_ECHOES];         // next entry of each echo, the last one is the oldest
+};
+static shaping_axis_t shaping[2];
+static signed char shaping_steps[2];    // steps of the interrupt that is running
+static unsigned short shaping_now;      // echo clock
+static uint8_t shaping_now_rest;        // timer ticks not on the echo clock yet
+static long shaping_event_ticks;                      // until stepper_isr() is due, below 0 when late
+static unsigned short shaping_event_interval = 0x4000; // the interval stepper_isr() asked for
+float shaping_frequency[2] = { INPUT_SHAPING_FREQ_X, INPUT_SHAPING_FREQ_Y };
+float shaping_damping[2] = { INPUT_SHAPING_ZETA_X, INPUT_SHAPING_ZETA_Y };
+static bool shaping_suspended = false;
+unsigned int shaping_overflows[2] = { 0, 0 };
+
+template <uint8_t axis> FORCE_INLINE void shaping_pulse(bool backward)
+{
+  shaping_axis_t &s = shaping[axis];
+  if (backward != s.backward) {
+    s.backward = backward;
+    if (axis == X_AXIS) {
+      WRITE(X_DIR_PIN, backward ? INVERT_X_DIR : !INVERT_X_DIR);
+    }
+    else {
+      WRITE(Y_DIR_PIN, backward ? INVERT_Y_DIR : !INVERT_Y_DIR);
+      #ifdef Y_DUAL_STEPPER_DRIVERS
+        WRITE(Y2_DIR_PIN, backward ? !(INVERT_Y_DIR == INVERT_Y2_VS_Y_DIR) : (INVERT_Y_DIR == INVERT_Y2_VS_Y_DIR));
+      #endif
+    }
+    delayMicroseconds(1); // direction setup time of the drivers
+  }
+  // the bookkeeping doubles as the step pulse width
+  if (axis == X_AXIS) {
+    WRITE(X_STEP_PIN, !INVERT_X_STEP_PIN);
+    s.owed += backward ? 256 : -256;
+    WRITE(X_STEP_PIN, INVERT_X_STEP_PIN);
+  }
+  else {
+    WRITE(Y_STEP_PIN, !INVERT_Y_STEP_PIN);
+    #ifdef Y_DUAL_STEPPER_DRIVERS
+      WRITE(Y2_STEP_PIN, !INVERT_Y_STEP_PIN);
+    #endif
+    s.owed += backward ? 256 : -256;
+    WRITE(Y_STEP_PIN, INVERT_Y_STEP_PIN);
+    #ifdef Y_DUAL_STEPPER_DRIVERS
+      WRITE(Y2_STEP_PIN, INVERT_Y_STEP_PIN);
+    #endif
+  }
+}
+
+template <uint8_t axis> FORCE_INLINE void shaping_owe(int weighted)
+{
+  shaping_axis_t &s = shaping[axis];
+  s.owed += weighted;
+  // usually one pulse; pulses that follow each other get the low time the trace loop has between them
+  bool pulsed = false;
+  while (s.owed >= 128) {
+    if (pulsed) delayMicroseconds(1);
+    shaping_pulse<axis>(false);
+    pulsed = true;
+  }
+  while (s.owed < -128) {
+    if (pulsed) delayMicroseconds(1);
+    shaping_pulse<axis>(true);
+    pulsed = true;
+  }
+}
+
+template <uint8_t axis> FORCE_INLINE void shaping_echo(uint8_t echo)
+{
+  shaping_axis_t &s = shaping[axis];
+  uint8_t i = s.tail[echo];
+  s.tail[echo] = SHAPING_NEXT(i);
+  shaping_owe<axis>(s.steps[i] * s.params.weight[echo + 1]);
+}
+
+// Queue the steps of this interrupt and play the echoes that are due. Returns the echo clock units
+// until the next echo, 0xFFFF for none.
+template <uint8_t axis> FORCE_INLINE unsigned short shaping_run()
+{
+  shaping_axis_t &s = shaping[axis];
+  signed char steps = shaping_steps[axis];
+  if (steps) {
+    shaping_steps[axis] = 0;
+    uint8_t oldest = s.tail[SHAPING_ECHOES - 1];
+    if (s.staged_new && s.head == oldest) {
+      s.params = s.staged;
+      s.staged_new = false;
+    }
+    if (s.params.delay[0]) {
+      uint8_t next = SHAPING_NEXT(s.head);
+      if (next == oldest) { // full: play the oldest interrupt early
+        if (shaping_overflows[axis] < 0xFFFF) shaping_overflows[axis]++;
+        for (uint8_t echo = 0; echo < SHAPING_ECHOES; echo++)
+          if (s.tail[echo] == oldest) shaping_echo<axis>(echo);
+      }
+      s.stamp[s.head] = shaping_now;
+      s.steps[s.head] = steps;
+      s.head = next;
+    }
+    shaping_owe<axis>(steps * s.params.weight[0]);
+  }
+  unsigned short wait = 0xFFFF;
+  for (uint8_t echo = 0; echo < SHAPING_ECHOES; echo++) {
+    while (s.tail[echo] != s.head) {
+      unsigned short age = shaping_now - s.stamp[s.tail[echo]];
+      if (age < s.params.delay[echo]) {
+        if (s.params.delay[echo] - age < wait) wait = s.params.delay[echo] - age;
+        break;
+      }
+      shaping_echo<axis>(echo);
+    }
+  }
+  return wait;
+}
+
+// Stage the shaper of the frequency and damping set for the axis, off while suspended.
+// Returns false for a frequency too low for the delays to fit the echo clock.
+bool st_apply_shaping(uint8_t axis)
+{
+  shaping_params_t params;
+  memset(&params, 0, sizeof(params));
+  params.weight[0] = 256;
+  float frequency = shaping_frequency[axis], zeta = shaping_damping[axis];
+  if (frequency > 0 && !shaping_suspended) {
+    float root = sqrt(1 - zeta * zeta);
+    float k = exp(-zeta * M_PI / root);
+    float delay = SHAPING_UNITS_PER_S * 0.5 / (frequency * root); // half the damped period
+    if (delay * SHAPING_ECHOES > 0xFFFF)
+      return false;
+    #ifdef INPUT_SHAPING_ZVD
+      // impulses 1 : 2k : k^2 at 0, half and one damped period
+      float scale = 256 / ((1 + k) * (1 + k));
+      params.weight[1] = 2 * k * scale + 0.5;
+      params.weight[2] = k * k * scale + 0.5;
+      params.delay[1] = 2 * delay + 0.5;
+    #else
+      // impulses 1 : k at 0 and half the damped period
+      params.weight[1] = 256 * k / (1 + k) + 0.5;
+    #endif
+    for (uint8_t echo = 1; echo <= SHAPING_ECHOES; echo++)
+      params.weight[0] -= params.weight[echo];
+    params.delay[0] = delay + 0.5;
+  }
+  CRITICAL_SECTION_START;
+  shaping[axis].staged = params;
+  shaping[axis].staged_new = true;
+  CRITICAL_SECTION_END;
+  return true;
+}
+
+void st_suspend_shaping(bool suspend)
+{
+  st_synchronize();
+  shaping_suspended = suspend;
+  st_apply_shaping(X_AXIS);
+  st_apply_shaping(Y_AXIS);
+  // the motors catch up with the planned steps once the last echoes have played
+  for (uint8_t axis = X_AXIS; axis <= Y_AXIS; axis++) {
+    bool queued;
+    do {
+      CRITICAL_SECTION_START;
+      queued = shaping[axis].head != shaping[axis].tail[SHAPING_ECHOES - 1];
+      CRITICAL_SECTION_END;
+    } while (queued);
+  }
+}
+#endif //INPUT_SHAPING
+
+// The Bresenham tracer of the current block. With BRESENHAM_16BIT, blocks with few enough step
+// events use 16 bit counters, which halves the adds, compares and subtracts of every axis and step.
+template <typename counter_t> struct bresenham_t {
+  counter_t x, y, z, e;                         // the error terms
+  counter_t steps_x, steps_y, steps_z, steps_e; // the steps of the block
+  counter_t ticks;                              // STEP_EVENT_TICKS
+  counter_t count;                              // the step events of the block
+};
+static bresenham_t<long> tracer_long;
+#ifdef BRESENHAM_16BIT
+static bresenham_t<int16_t> tracer_short;
+static bool short_block; // the current block uses tracer_short
+#endif
+
+template <typename counter_t> FORCE_INLINE void bresenham_load(bresenham_t<counter_t> &b) {
+  b.steps_x = current_block->steps_x;
+  b.steps_y = current_block->steps_y;
+  b.steps_z = current_block->steps_z;
+  b.steps_e = current_block->steps_e;
+  b.ticks = STEP_EVENT_TICKS;
+  b.count = current_block->step_event_count;
+  b.x = -(b.ticks >> 1);
+  b.y = b.x;
+  b.z = b.x;
+  b.e = b.x;
+}
+
+// The axes a variant of the step loop traces. The masks are compile time constants, so the code of
+// the axes a variant leaves out drops out of it, and an axis that moves alone in its block steps on
+// every step event without touching its error term.
+#define TRACE_ALL ((1<<X_AXIS)|(1<<Y_AXIS)|(1<<Z_AXIS)|(1<<E_AXIS))
+#define TRACE_XY  ((1<<X_AXIS)|(1<<Y_AXIS))
+#define TRACE_Z   (1<<Z_AXIS)
+#define TRACE_E   (1<<E_AXIS)
+#ifdef STEP_SMOOTHING
+  #define TRACE_ALONE(axis) false // smoothed blocks run several step events per step
+#else
+  #define TRACE_ALONE(axis) (axes == (1<<(axis)))
+#endif
+// Add the steps of the block to the error term of an axis, true when the axis steps
+#define TRACE_ADD(axis, err, steps) ((axes & (1<<(axis))) && (TRACE_ALONE(axis) || (err += (steps)) > 0))
+// Whether the axis steps, after TRACE_ADD
+#define TRACE_STEPS(axis, err) ((axes & (1<<(axis))) && (TRACE_ALONE(axis) || (err) > 0))
+// Take a step from the error term of an axis
+#define TRACE_TAKE(axis, err) do{ if (!TRACE_ALONE(axis)) err -= b.ticks; }while(0)
+
+#ifdef AXIS_STEP_LOOPS
+static uint8_t trace_axes; // the variant of the step loop for the current block
+
+// E only (retracts), Z only (layer changes) and travel without E get a loop of their own
+FORCE_INLINE uint8_t trace_axes_of(block_t *block) {
+  uint8_t moving = (block->steps_x ? (1<<X_AXIS) : 0) | (block->steps_y ? (1<<Y_AXIS) : 0)
+                 | (block->steps_z ? (1<<Z_AXIS) : 0) | (block->steps_e ? (1<<E_AXIS) : 0);
+  if (moving == TRACE_E || moving == TRACE_Z) return moving;
+  if (!(moving & (TRACE_Z | TRACE_E))) return TRACE_XY;
+  return TRACE_ALL;
+}
+#endif
+
+// Take the step events of one interrupt, step_loops of them, fewer at the end of the block
+template <typename counter_t, uint8_t axes> FORCE_INLINE void trace_steps(bresenham_t<counter_t> &b) {
+  counter_t done = step_events_completed;
+  for(int8_t i=0; i < step_loops; i++) { // Take multiple steps per interrupt (For high speed moves)
+    #ifndef AT90USB
+    MSerial.checkRx(); // Check for serial chars.
+    #endif
+
+    #ifdef ADVANCE
+    if (TRACE_ADD(E_AXIS, b.e, b.steps_e)) {
+      TRACE_TAKE(E_AXIS, b.e);
+      if ((out_bits & (1<<E_AXIS)) != 0) { // - direction
+        e_steps[current_block->active_extruder]--;
+      }
+      else {
+        e_steps[current_block->active_extruder]++;
+      }
+    }
+    #endif //ADVANCE
+
+    #ifdef LIN_ADVANCE
+    if (TRACE_ADD(E_AXIS, b.e, b.steps_e)) {
+      TRACE_TAKE(E_AXIS, b.e);
+      count_position[E_AXIS]+=count_direction[E_AXIS];
+      e_steps_pending += count_direction[E_AXIS];
+    }
+    #endif //LIN_ADVANCE
+
+  #ifdef STEPPER_PORT_WRITES
+    unsigned int step_slots = 0;
+    if (TRACE_ADD(X_AXIS, b.x, b.steps_x)) step_slots |= x_step_slots;
+    if (TRACE_ADD(Y_AXIS, b.y, b.steps_y)) step_slots |= STEP_SLOT_Y | STEP_SLOT_Y2;
+    #ifdef Z_DUAL_AUTO_ALIGN
+      if (TRACE_ADD(Z_AXIS, b.z, b.steps_z)) step_slots |= z_step_slots;
+    #else
+      if (TRACE_ADD(Z_AXIS, b.z, b.steps_z)) step_slots |= STEP_SLOT_Z | STEP_SLOT_Z2;
+    #endif
+    #if !defined(ADVANCE) && !defined(LIN_ADVANCE)
+      if (TRACE_ADD(E_AXIS, b.e, b.steps_e)) step_slots |= e_step_slots;
+    #endif
+
+    if (step_slots) {
+      STEP_WRITE_PORTS(step_slots, true);
+      // the bookkeeping doubles as the step pulse width, as with the WRITE() calls
+      if (TRACE_STEPS(X_AXIS, b.x)) {
+        TRACE_TAKE(X_AXIS, b.x);
+        count_position[X_AXIS]+=count_direction[X_AXIS];
+      }
+      if (TRACE_STEPS(Y_AXIS, b.y)) {
+        TRACE_TAKE(Y_AXIS, b.y);
+        count_position[Y_AXIS]+=count_direction[Y_AXIS];
+      }
+      if (TRACE_STEPS(Z_AXIS, b.z)) {
+        TRACE_TAKE(Z_AXIS, b.z);
+        count_position[Z_AXIS]+=count_direction[Z_AXIS];
+      }
+      #if !defined(ADVANCE) && !defined(LIN_ADVANCE)
+        if (TRACE_STEPS(E_AXIS, b.e)) {
+          TRACE_TAKE(E_AXIS, b.e);
+          count_position[E_AXIS]+=count_direction[E_AXIS];
+        }
+      #endif
+      STEP_WRITE_PORTS(step_slots, false);
+    }
+  #else
+      if (TRACE_ADD(X_AXIS, b.x, b.steps_x)) {
+      #ifdef DUAL_X_CARRIAGE
+        if (dual_x_steppers & DXC_X_STEPPER)
+          WRITE(X_STEP_PIN, !INVERT_X_STEP_PIN);
+        if (dual_x_steppers & DXC_X2_STEPPER)
+          WRITE(X2_STEP_PIN, !INVERT_X_STEP_PIN);
+      #elif !defined(INPUT_SHAPING)
+        WRITE(X_STEP_PIN, !INVERT_X_STEP_PIN);
+      #endif        
+        TRACE_TAKE(X_AXIS, b.x);
+        count_position[X_AXIS]+=count_direction[X_AXIS];
+      #ifdef DUAL_X_CARRIAGE
+        if (dual_x_steppers & DXC_X_STEPPER)
+          WRITE(X_STEP_PIN, INVERT_X_STEP_PIN);
+        if (dual_x_steppers & DXC_X2_STEPPER)
+          WRITE(X2_STEP_PIN, INVERT_X_STEP_PIN);
+      #elif defined(INPUT_SHAPING)
+        shaping_steps[X_AXIS] += count_direction[X_AXIS]; // shaping_isr() steps the motor
+      #else
+        WRITE(X_STEP_PIN, INVERT_X_STEP_PIN);
+      #endif
+      }
+
+      if (TRACE_ADD(Y_AXIS, b.y, b.steps_y)) {
+      #ifdef INPUT_SHAPING
+        TRACE_TAKE(Y_AXIS, b.y);
+        count_position[Y_AXIS]+=count_direction[Y_AXIS];
+        shaping_steps[Y_AXIS] += count_direction[Y_AXIS]; // shaping_isr() steps the motor
+      #else
+        WRITE(Y_STEP_PIN, !INVERT_Y_STEP_PIN);
+		  
+		  #ifdef Y_DUAL_STEPPER_DRIVERS
+			WRITE(Y2_STEP_PIN, !INVERT_Y_STEP_PIN);
+		  #endif
+		  
+        TRACE_TAKE(Y_AXIS, b.y);
+        count_position[Y_AXIS]+=count_direction[Y_AXIS];
+        WRITE(Y_STEP_PIN, INVERT_Y_STEP_PIN);
+		  
+		  #ifdef Y_DUAL_STEPPER_DRIVERS
+			WRITE(Y2_STEP_PIN, INVERT_Y_STEP_PIN);
+		  #endif
+      #endif
+      }
+
+    if (TRACE_ADD(Z_AXIS, b.z, b.steps_z)) {
+      #ifdef Z_DUAL_AUTO_ALIGN
+        if (z_dual_steppers & Z_DUAL_Z_STEPPER) WRITE(Z_STEP_PIN, !INVERT_Z_STEP_PIN);
+        if (z_dual_steppers & Z_DUAL_Z2_STEPPER) WRITE(Z2_STEP_PIN, !INVERT_Z_STEP_PIN);
+      #else
+      WRITE(Z_STEP_PIN, !INVERT_Z_STEP_PIN);
+      
+      #ifdef Z_DUAL_STEPPER_DRIVERS
+        WRITE(Z2_STEP_PIN, !INVERT_Z_STEP_PIN);
+      #endif
+      #endif
+
+      TRACE_TAKE(Z_AXIS, b.z);
+      count_position[Z_AXIS]+=count_direction[Z_AXIS];
+      WRITE(Z_STEP_PIN, INVERT_Z_STEP_PIN);
+      
+      #ifdef Z_DUAL_STEPPER_DRIVERS
+        WRITE(Z2_STEP_PIN, INVERT_Z_STEP_PIN);
+      #endif
+    }
+
+    #if !defined(ADVANCE) && !defined(LIN_ADVANCE)
+      if (TRACE_ADD(E_AXIS, b.e, b.steps_e)) {
+        WRITE_E_STEP(!INVERT_E_STEP_PIN);
+        TRACE_TAKE(E_AXIS, b.e);
+        count_position[E_AXIS]+=count_direction[E_AXIS];
+        WRITE_E_STEP(INVERT_E_STEP_PIN);
+      }
+    #endif
+  #endif //STEPPER_PORT_WRITES
+    #ifdef LIN_ADVANCE
+      lin_advance_step();
+    #endif
+    #ifdef STEP_SMOOTHING
+      if(((++smoothing_ticks) & smoothing_mask) == 0) done += 1;
+    #else
+      done += 1;
+    #endif
+    #ifdef STEP_SEGMENTS
+      if(--segment_events == 0) break;
+    #endif
+    if(done >= b.count) break;
+  }
+  step_events_completed = done;
+}
+
+template <typename counter_t> FORCE_INLINE void trace_block(bresenham_t<counter_t> &b) {
+  #ifdef AXIS_STEP_LOOPS
+    switch (trace_axes) {
+      case TRACE_E: trace_steps<counter_t, TRACE_E>(b); break;
+      case TRACE_Z: trace_steps<counter_t, TRACE_Z>(b); break;
+      case TRACE_XY: trace_steps<counter_t, TRACE_XY>(b); break;
+      default: trace_steps<counter_t, TRACE_ALL>(b);
+    }
+  #else
+    trace_steps<counter_t, TRACE_ALL>(b);
+  #endif
+}
+
+FORCE_INLINE void stepper_isr()
+{
+  #ifdef DRY_PLANNING
+    if (dry_planning) {
+      #ifdef LASER_PWM
+        laser_output(0);
+      #endif
+      dry_planning_isr();
+      return;
+    }
+  #endif
+
+  #ifdef BABYSTEPPING
+    babystep_isr(OCR1A); // OCR1A still holds the interval that just ended
+  #endif
+
   // If there is no current block, attempt to pop one from the buffer
   if (current_block == NULL) {
     // Anything in the buffer?
-    current_block = plan_get_current_block();
+    #ifdef STEP_SEGMENTS
+      // the first segment of a block is ready: the block is the oldest one
+      segment = segment_get();
+      if (segment != NULL) {
+        current_block = &block_buffer[block_buffer_tail];
+        segment_events = segment->events;
+      }
+    #else
+      current_block = plan_get_current_block();
+    #endif
     if (current_block != NULL) {
       current_block->busy = true;
-      trapezoid_generator_reset();
-      counter_x = -(current_block->step_event_count >> 1);
-      counter_y = counter_x;
-      counter_z = counter_x;
-      counter_e = counter_x;
+      #ifdef EVENT_TRACE
+        trace_stepper_idle = false;
+        TRACE_EVENT(TRACE_BLOCK_START, movesplanned());
+      #endif
+      set_block_directions();
+      #ifdef STEP_SMOOTHING
+        set_step_smoothing();
+      #endif
+      #ifndef STEP_SEGMENTS
+        trapezoid_generator_reset();
+      #endif
+      #if defined(FAN_SYNC_WITH_MOVES) && defined(FAN_PIN) && FAN_PIN > -1
+        #ifdef FAN_SOFT_PWM
+          fanSpeedSoftPwm = current_block->fan_speed;
+        #else
+          analogWrite(FAN_PIN, current_block->fan_speed);
+        #endif
+      #endif
+      #ifdef LASER_RASTER
+        raster_block_start();
+      #endif
+      #ifdef LASER_POWER_FOLLOWS_SPEED
+        laser_output_rate(current_block->initial_rate);
+      #elif defined(LASER_PWM)
+        laser_output(current_block->laser_power);
+      #endif
+      #ifdef BRESENHAM_16BIT
+        short_block = STEP_EVENT_TICKS <= 0x7FFF;
+        if (short_block)
+          bresenham_load(tracer_short);
+        else
+      #endif
+          bresenham_load(tracer_long);
+      #ifdef AXIS_STEP_LOOPS
+        trace_axes = trace_axes_of(current_block);
+      #endif
       step_events_completed = 0;
 
       #ifdef Z_LATE_ENABLE
-        if(current_block->steps_z > 0) {
+        if(current_block->steps_z > 0 && READ(Z_ENABLE_PIN) != (bool)Z_ENABLE_ON) { // not enabled ahead
           enable_z();
           OCR1A = 2000; //1ms wait
           return;
@@ -340,320 +1739,200 @@ ISR(TIMER1_COMPA_vect)
 //      #endif
     }
     else {
-        OCR1A=2000; // 1kHz.
+        OCR1A = blocks_queued() ? 200 : 2000; // 10kHz while the next block is being replanned, 1kHz when idle
+        #ifdef EVENT_TRACE
+          if (!trace_stepper_idle) { // once, not on every pass
+            trace_stepper_idle = true;
+            TRACE_EVENT(TRACE_STEPPER_IDLE, movesplanned());
+          }
+        #endif
+        #ifdef LASER_PWM
+          laser_output(0); // no burning while standing still
+        #endif
     }
   }
 
   if (current_block != NULL) {
-    // Set directions TO DO This should be done once during init of trapezoid. Endstops -> interrupt
-    out_bits = current_block->direction_bits;
-
-
-    // Set the direction bits (X_AXIS=A_AXIS and Y_AXIS=B_AXIS for COREXY)
-    if((out_bits & (1<<X_AXIS))!=0){
-      #ifdef DUAL_X_CARRIAGE
-        if (extruder_duplication_enabled){
-          WRITE(X_DIR_PIN, INVERT_X_DIR);
-          WRITE(X2_DIR_PIN, INVERT_X_DIR);
-        }
-        else{
-          if (current_block->active_extruder != 0)
-            WRITE(X2_DIR_PIN, INVERT_X_DIR);
-          else
-            WRITE(X_DIR_PIN, INVERT_X_DIR);
-        }
-      #else
-        WRITE(X_DIR_PIN, INVERT_X_DIR);
-      #endif        
-      count_direction[X_AXIS]=-1;
-    }
-    else{
-      #ifdef DUAL_X_CARRIAGE
-        if (extruder_duplication_enabled){
-          WRITE(X_DIR_PIN, !INVERT_X_DIR);
-          WRITE(X2_DIR_PIN, !INVERT_X_DIR);
+    #ifdef LIN_ADVANCE
+      if (step_events_completed >= current_block->step_event_count) { // held by lin_advance_drain()
+        bool drained = e_steps_pending == 0;
+        lin_advance_step(); // ends the last pulse too
+        if (drained) {
+          current_block = NULL;
+          plan_discard_current_block();
         }
-        else{
-          if (current_block->active_extruder != 0)
-            WRITE(X2_DIR_PIN, !INVERT_X_DIR);
-          else
-            WRITE(X_DIR_PIN, !INVERT_X_DIR);
-        }
-      #else
-        WRITE(X_DIR_PIN, !INVERT_X_DIR);
-      #endif        
-      count_direction[X_AXIS]=1;
-    }
-    if((out_bits & (1<<Y_AXIS))!=0){
-      WRITE(Y_DIR_PIN, INVERT_Y_DIR);
-	  
-	  #ifdef Y_DUAL_STEPPER_DRIVERS
-	    WRITE(Y2_DIR_PIN, !(INVERT_Y_DIR == INVERT_Y2_VS_Y_DIR));
-	  #endif
-	  
-      count_direction[Y_AXIS]=-1;
-    }
-    else{
-      WRITE(Y_DIR_PIN, !INVERT_Y_DIR);
-	  
-	  #ifdef Y_DUAL_STEPPER_DRIVERS
-	    WRITE(Y2_DIR_PIN, (INVERT_Y_DIR == INVERT_Y2_VS_Y_DIR));
-	  #endif
-	  
-      count_direction[Y_AXIS]=1;
-    }
-
-    // Set direction en check limit switches
-    #ifndef COREXY
-    if ((out_bits & (1<<X_AXIS)) != 0) {   // stepping along -X axis
-    #else
-    if ((((out_bits & (1<<X_AXIS)) != 0)&&(out_bits & (1<<Y_AXIS)) != 0)) {   //-X occurs for -A and -B
+        return;
+      }
     #endif
-      CHECK_ENDSTOPS
-      {
-        #ifdef DUAL_X_CARRIAGE
-        // with 2 x-carriages, endstops are only checked in the homing direction for the active extruder
-        if ((current_block->active_extruder == 0 && X_HOME_DIR == -1) 
-            || (current_block->active_extruder != 0 && X2_HOME_DIR == -1))
-        #endif          
-        {
-          #if defined(X_MIN_PIN) && X_MIN_PIN > -1
-            bool x_min_endstop=(READ(X_MIN_PIN) != X_MIN_ENDSTOP_INVERTING);
-            if(x_min_endstop && old_x_min_endstop && (current_block->steps_x > 0)) {
-              endstops_trigsteps[X_AXIS] = count_position[X_AXIS];
-              endstop_x_hit=true;
-              step_events_completed = current_block->step_event_count;
-            }
-            old_x_min_endstop = x_min_endstop;
-          #endif
+    #ifdef STEP_SEGMENTS
+      if (segment == NULL) {
+        segment = segment_get();
+        if (segment == NULL) {
+          OCR1A = 200; // the next segment is being prepared
+          return;
         }
+        segment_events = segment->events;
       }
-    }
-    else { // +direction
-      CHECK_ENDSTOPS
-      {
-        #ifdef DUAL_X_CARRIAGE
-        // with 2 x-carriages, endstops are only checked in the homing direction for the active extruder
-        if ((current_block->active_extruder == 0 && X_HOME_DIR == 1) 
-            || (current_block->active_extruder != 0 && X2_HOME_DIR == 1))
-        #endif          
-        {
-          #if defined(X_MAX_PIN) && X_MAX_PIN > -1
-            bool x_max_endstop=(READ(X_MAX_PIN) != X_MAX_ENDSTOP_INVERTING);
-            if(x_max_endstop && old_x_max_endstop && (current_block->steps_x > 0)){
-              endstops_trigsteps[X_AXIS] = count_position[X_AXIS];
-              endstop_x_hit=true;
-              step_events_completed = current_block->step_event_count;
-            }
-            old_x_max_endstop = x_max_endstop;
-          #endif
-        }
+      if (step_events_completed >= current_block->step_event_count) {
+        // an endstop ended the block: drop its remaining segments, the empty last one comes soon
+        if (!segment->last)
+          prep_abort = block_buffer_tail;
+        segment_done();
+        OCR1A = 200;
+        return;
       }
-    }
-
-    #ifndef COREXY
-    if ((out_bits & (1<<Y_AXIS)) != 0) {   // -direction
-    #else
-    if ((((out_bits & (1<<X_AXIS)) != 0)&&(out_bits & (1<<Y_AXIS)) == 0)) {   // -Y occurs for -A and +B
+      step_loops = segment->loops;
     #endif
-      CHECK_ENDSTOPS
-      {
-        #if defined(Y_MIN_PIN) && Y_MIN_PIN > -1
+    // Check limit switches. The directions were set when the block was loaded.
+    unsigned char endstops_check = endstop_mask;
+    #ifdef ENDSTOP_INTERRUPTS
+      bool endstops_seen = false;
+      if (endstops_changed)
+        endstops_changed = false; // before the reads, a change during them sets it again
+      else
+        endstops_check &= endstops_polled;
+    #endif
+    if (endstops_check) CHECK_ENDSTOPS
+    {
+      #if defined(X_MIN_PIN) && X_MIN_PIN > -1
+        if (endstops_check & (1<<ENDSTOP_X_MIN)) {
+          bool x_min_endstop=(READ(X_MIN_PIN) != X_MIN_ENDSTOP_INVERTING);
+          ENDSTOP_SEEN(x_min_endstop);
+          if(x_min_endstop && old_x_min_endstop) {
+            endstops_trigsteps[X_AXIS] = count_position[X_AXIS];
+            endstop_x_hit=true;
+            step_events_completed = current_block->step_event_count;
+          }
+          old_x_min_endstop = x_min_endstop;
+        }
+      #endif
+      #if defined(X_MAX_PIN) && X_MAX_PIN > -1
+        if (endstops_check & (1<<ENDSTOP_X_MAX)) {
+          bool x_max_endstop=(READ(X_MAX_PIN) != X_MAX_ENDSTOP_INVERTING);
+          ENDSTOP_SEEN(x_max_endstop);
+          if(x_max_endstop && old_x_max_endstop) {
+            endstops_trigsteps[X_AXIS] = count_position[X_AXIS];
+            endstop_x_hit=true;
+            step_events_completed = current_block->step_event_count;
+          }
+          old_x_max_endstop = x_max_endstop;
+        }
+      #endif
+      #if defined(Y_MIN_PIN) && Y_MIN_PIN > -1
+        if (endstops_check & (1<<ENDSTOP_Y_MIN)) {
           bool y_min_endstop=(READ(Y_MIN_PIN) != Y_MIN_ENDSTOP_INVERTING);
-          if(y_min_endstop && old_y_min_endstop && (current_block->steps_y > 0)) {
+          ENDSTOP_SEEN(y_min_endstop);
+          if(y_min_endstop && old_y_min_endstop) {
             endstops_trigsteps[Y_AXIS] = count_position[Y_AXIS];
             endstop_y_hit=true;
             step_events_completed = current_block->step_event_count;
           }
           old_y_min_endstop = y_min_endstop;
-        #endif
-      }
-    }
-    else { // +direction
-      CHECK_ENDSTOPS
-      {
-        #if defined(Y_MAX_PIN) && Y_MAX_PIN > -1
+        }
+      #endif
+      #if defined(Y_MAX_PIN) && Y_MAX_PIN > -1
+        if (endstops_check & (1<<ENDSTOP_Y_MAX)) {
           bool y_max_endstop=(READ(Y_MAX_PIN) != Y_MAX_ENDSTOP_INVERTING);
-          if(y_max_endstop && old_y_max_endstop && (current_block->steps_y > 0)){
+          ENDSTOP_SEEN(y_max_endstop);
+          if(y_max_endstop && old_y_max_endstop) {
             endstops_trigsteps[Y_AXIS] = count_position[Y_AXIS];
             endstop_y_hit=true;
             step_events_completed = current_block->step_event_count;
           }
           old_y_max_endstop = y_max_endstop;
-        #endif
-      }
-    }
-
-    if ((out_bits & (1<<Z_AXIS)) != 0) {   // -direction
-      WRITE(Z_DIR_PIN,INVERT_Z_DIR);
-      
-      #ifdef Z_DUAL_STEPPER_DRIVERS
-        WRITE(Z2_DIR_PIN,INVERT_Z_DIR);
+        }
       #endif
-
-      count_direction[Z_AXIS]=-1;
-      CHECK_ENDSTOPS
-      {
-        #if defined(Z_MIN_PIN) && Z_MIN_PIN > -1
+      #if defined(Z_MIN_PIN) && Z_MIN_PIN > -1
+        if (endstops_check & (1<<ENDSTOP_Z_MIN)) {
           bool z_min_endstop=(READ(Z_MIN_PIN) != Z_MIN_ENDSTOP_INVERTING);
-          if(z_min_endstop && old_z_min_endstop && (current_block->steps_z > 0)) {
+          ENDSTOP_SEEN(z_min_endstop);
+          if(z_min_endstop && old_z_min_endstop) {
             endstops_trigsteps[Z_AXIS] = count_position[Z_AXIS];
             endstop_z_hit=true;
             step_events_completed = current_block->step_event_count;
           }
           old_z_min_endstop = z_min_endstop;
-        #endif
-      }
-    }
-    else { // +direction
-      WRITE(Z_DIR_PIN,!INVERT_Z_DIR);
-
-      #ifdef Z_DUAL_STEPPER_DRIVERS
-        WRITE(Z2_DIR_PIN,!INVERT_Z_DIR);
+        }
       #endif
-
-      count_direction[Z_AXIS]=1;
-      CHECK_ENDSTOPS
-      {
-        #if defined(Z_MAX_PIN) && Z_MAX_PIN > -1
+      #if defined(Z_MAX_PIN) && Z_MAX_PIN > -1
+        if (endstops_check & (1<<ENDSTOP_Z_MAX)) {
           bool z_max_endstop=(READ(Z_MAX_PIN) != Z_MAX_ENDSTOP_INVERTING);
-          if(z_max_endstop && old_z_max_endstop && (current_block->steps_z > 0)) {
+          ENDSTOP_SEEN(z_max_endstop);
+          if(z_max_endstop && old_z_max_endstop) {
             endstops_trigsteps[Z_AXIS] = count_position[Z_AXIS];
             endstop_z_hit=true;
             step_events_completed = current_block->step_event_count;
           }
           old_z_max_endstop = z_max_endstop;
-        #endif
-      }
-    }
-
-    #ifndef ADVANCE
-      if ((out_bits & (1<<E_AXIS)) != 0) {  // -direction
-        REV_E_DIR();
-        count_direction[E_AXIS]=-1;
-      }
-      else { // +direction
-        NORM_E_DIR();
-        count_direction[E_AXIS]=1;
-      }
-    #endif //!ADVANCE
-
-
-
-    for(int8_t i=0; i < step_loops; i++) { // Take multiple steps per interrupt (For high speed moves)
-      #ifndef AT90USB
-      MSerial.checkRx(); // Check for serial chars.
-      #endif
-
-      #ifdef ADVANCE
-      counter_e += current_block->steps_e;
-      if (counter_e > 0) {
-        counter_e -= current_block->step_event_count;
-        if ((out_bits & (1<<E_AXIS)) != 0) { // - direction
-          e_steps[current_block->active_extruder]--;
-        }
-        else {
-          e_steps[current_block->active_extruder]++;
-        }
-      }
-      #endif //ADVANCE
-
-        counter_x += current_block->steps_x;
-        if (counter_x > 0) {
-        #ifdef DUAL_X_CARRIAGE
-          if (extruder_duplication_enabled){
-            WRITE(X_STEP_PIN, !INVERT_X_STEP_PIN);
-            WRITE(X2_STEP_PIN, !INVERT_X_STEP_PIN);
-          }
-          else {
-            if (current_block->active_extruder != 0)
-              WRITE(X2_STEP_PIN, !INVERT_X_STEP_PIN);
-            else
-              WRITE(X_STEP_PIN, !INVERT_X_STEP_PIN);
-          }
-        #else
-          WRITE(X_STEP_PIN, !INVERT_X_STEP_PIN);
-        #endif        
-          counter_x -= current_block->step_event_count;
-          count_position[X_AXIS]+=count_direction[X_AXIS];   
-        #ifdef DUAL_X_CARRIAGE
-          if (extruder_duplication_enabled){
-            WRITE(X_STEP_PIN, INVERT_X_STEP_PIN);
-            WRITE(X2_STEP_PIN, INVERT_X_STEP_PIN);
-          }
-          else {
-            if (current_block->active_extruder != 0)
-              WRITE(X2_STEP_PIN, INVERT_X_STEP_PIN);
-            else
-              WRITE(X_STEP_PIN, INVERT_X_STEP_PIN);
-          }
-        #else
-          WRITE(X_STEP_PIN, INVERT_X_STEP_PIN);
-        #endif
         }
-
-        counter_y += current_block->steps_y;
-        if (counter_y > 0) {
-          WRITE(Y_STEP_PIN, !INVERT_Y_STEP_PIN);
-		  
-		  #ifdef Y_DUAL_STEPPER_DRIVERS
-			WRITE(Y2_STEP_PIN, !INVERT_Y_STEP_PIN);
-		  #endif
-		  
-          counter_y -= current_block->step_event_count;
-          count_position[Y_AXIS]+=count_direction[Y_AXIS];
-          WRITE(Y_STEP_PIN, INVERT_Y_STEP_PIN);
-		  
-		  #ifdef Y_DUAL_STEPPER_DRIVERS
-			WRITE(Y2_STEP_PIN, INVERT_Y_STEP_PIN);
-		  #endif
-        }
-
-      counter_z += current_block->steps_z;
-      if (counter_z > 0) {
-        WRITE(Z_STEP_PIN, !INVERT_Z_STEP_PIN);
-        
-        #ifdef Z_DUAL_STEPPER_DRIVERS
-          WRITE(Z2_STEP_PIN, !INVERT_Z_STEP_PIN);
-        #endif
-
-        counter_z -= current_block->step_event_count;
-        count_position[Z_AXIS]+=count_direction[Z_AXIS];
-        WRITE(Z_STEP_PIN, INVERT_Z_STEP_PIN);
-        
-        #ifdef Z_DUAL_STEPPER_DRIVERS
-          WRITE(Z2_STEP_PIN, INVERT_Z_STEP_PIN);
-        #endif
-      }
-
-      #ifndef ADVANCE
-        counter_e += current_block->steps_e;
-        if (counter_e > 0) {
-          WRITE_E_STEP(!INVERT_E_STEP_PIN);
-          counter_e -= current_block->step_event_count;
-          count_position[E_AXIS]+=count_direction[E_AXIS];
-          WRITE_E_STEP(INVERT_E_STEP_PIN);
-        }
-      #endif //!ADVANCE
-      step_events_completed += 1;
-      if(step_events_completed >= current_block->step_event_count) break;
+      #endif
+      #ifdef ENDSTOP_INTERRUPTS
+        // a pin that reads as hit is read again on the next step, to be believed or as long as it stays hit
+        if (endstops_seen)
+          endstops_changed = true;
+      #endif
     }
+
+
+
+    #ifdef BRESENHAM_16BIT
+      if (short_block)
+        trace_block(tracer_short);
+      else
+    #endif
+        trace_block(tracer_long);
+    #ifdef LASER_RASTER
+      if (current_block->raster_pixels)
+        raster_update();
+    #endif
+    #ifdef STEP_SEGMENTS
+    OCR1A = segment->timer;
+    if (segment_events == 0)
+      segment_done();
+    // when an endstop ended the block, the next interrupt drops the rest of it
+    #else
     // Calculare new timer value
     unsigned short timer;
     unsigned short step_rate;
     if (step_events_completed <= (unsigned long int)current_block->accelerate_until) {
 
-      MultiU24X24toH16(acc_step_rate, acceleration_time, current_block->acceleration_rate);
-      acc_step_rate += current_block->initial_rate;
+      #ifdef S_CURVE_ACCELERATION
+      if (current_block->accel_inverse) {
+        acc_step_rate = current_block->initial_rate + s_curve_delta(acceleration_time, current_block->accel_shift,
+          current_block->accel_inverse, current_block->cruise_rate - current_block->initial_rate);
+      }
+      else
+      #endif
+      {
+        MultiU24X24toH16(acc_step_rate, acceleration_time, current_block->acceleration_rate);
+        acc_step_rate += current_block->initial_rate;
+      }
 
       // upper limit
       if(acc_step_rate > current_block->nominal_rate)
         acc_step_rate = current_block->nominal_rate;
 
+      #ifdef REALTIME_FEEDRATE_OVERRIDE
+        step_rate = override_rate(acc_step_rate);
+      #else
+        step_rate = acc_step_rate;
+      #endif
+
       // step_rate to timer interval
-      timer = calc_timer(acc_step_rate);
+      timer = STEP_TICK_TIMER(step_rate);
       OCR1A = timer;
-      acceleration_time += timer;
+      #ifdef REALTIME_FEEDRATE_OVERRIDE
+        acceleration_time += override_time(timer);
+        override_ramp(timer, false, true);
+      #else
+        acceleration_time += timer;
+      #endif
+      #ifdef LIN_ADVANCE
+        lin_advance_update(step_rate);
+      #endif
+      #ifdef LASER_POWER_FOLLOWS_SPEED
+        laser_output_rate(step_rate);
+      #endif
       #ifdef ADVANCE
         for(int8_t i=0; i < step_loops; i++) {
           advance += advance_rate;
@@ -666,23 +1945,46 @@ ISR(TIMER1_COMPA_vect)
       #endif
     }
     else if (step_events_completed > (unsigned long int)current_block->decelerate_after) {
-      MultiU24X24toH16(step_rate, deceleration_time, current_block->acceleration_rate);
-
-      if(step_rate > acc_step_rate) { // Check step_rate stays positive
-        step_rate = current_block->final_rate;
+      #ifdef S_CURVE_ACCELERATION
+      if (current_block->decel_inverse) {
+        step_rate = current_block->cruise_rate - s_curve_delta(deceleration_time, current_block->decel_shift,
+          current_block->decel_inverse, current_block->cruise_rate - current_block->final_rate);
       }
-      else {
-        step_rate = acc_step_rate - step_rate; // Decelerate from aceleration end point.
+      else
+      #endif
+      {
+        MultiU24X24toH16(step_rate, deceleration_time, current_block->acceleration_rate);
+
+        if(step_rate > acc_step_rate) { // Check step_rate stays positive
+          step_rate = current_block->final_rate;
+        }
+        else {
+          step_rate = acc_step_rate - step_rate; // Decelerate from aceleration end point.
+        }
       }
 
       // lower limit
       if(step_rate < current_block->final_rate)
         step_rate = current_block->final_rate;
+      #ifdef REALTIME_FEEDRATE_OVERRIDE
+        step_rate = override_rate(step_rate);
+      #endif
 
       // step_rate to timer interval
-      timer = calc_timer(step_rate);
+      timer = STEP_TICK_TIMER(step_rate);
       OCR1A = timer;
-      deceleration_time += timer;
+      #ifdef REALTIME_FEEDRATE_OVERRIDE
+        deceleration_time += override_time(timer);
+        override_ramp(timer, true, false);
+      #else
+        deceleration_time += timer;
+      #endif
+      #ifdef LIN_ADVANCE
+        lin_advance_update(step_rate);
+      #endif
+      #ifdef LASER_POWER_FOLLOWS_SPEED
+        laser_output_rate(step_rate);
+      #endif
       #ifdef ADVANCE
         for(int8_t i=0; i < step_loops; i++) {
           advance -= advance_rate;
@@ -693,19 +1995,156 @@ ISR(TIMER1_COMPA_vect)
         old_advance = advance >>8;
       #endif //ADVANCE
     }
+    #ifdef REALTIME_FEEDRATE_OVERRIDE
+    else if (OVERRIDE_ACTIVE()) {
+      step_rate = override_rate(current_block->nominal_rate);
+      timer = STEP_TICK_TIMER(step_rate);
+      OCR1A = timer;
+      override_ramp(timer, true, true);
+      #ifdef LIN_ADVANCE
+        lin_advance_update(step_rate);
+      #endif
+      #ifdef LASER_POWER_FOLLOWS_SPEED
+        laser_output_rate(step_rate);
+      #endif
+    }
+    #endif
     else {
       OCR1A = OCR1A_nominal;
       // ensure we're running at the correct step rate, even if we just came off an acceleration
       step_loops = step_loops_nominal;
+      #ifdef LIN_ADVANCE
+        lin_advance_update(current_block->nominal_rate);
+      #endif
+      #ifdef LASER_POWER_FOLLOWS_SPEED
+        laser_output(current_block->laser_power);
+      #endif
     }
 
     // If current block is finished, reset pointer
     if (step_events_completed >= current_block->step_event_count) {
+      #ifdef LIN_ADVANCE
+        if (lin_advance_drain())
+          return;
+      #endif
       current_block = NULL;
       plan_discard_current_block();
     }
+    #endif //STEP_SEGMENTS
+  }
+}
+
+#ifdef INPUT_SHAPING
+// Runs stepper_isr() when it is due and the echoes in between
+FORCE_INLINE void shaping_isr()
+{
+  unsigned short elapsed = OCR1A + 1; // the interval that just ended, the timer counts OCR1A + 1 ticks
+  shaping_now += elapsed >> SHAPING_TICK_SHIFT;
+  shaping_now_rest += elapsed & ((1 << SHAPING_TICK_SHIFT) - 1);
+  if (shaping_now_rest >> SHAPING_TICK_SHIFT) {
+    shaping_now++;
+    shaping_now_rest -= 1 << SHAPING_TICK_SHIFT;
+  }
+  shaping_event_ticks -= elapsed;
+  if (shaping_event_ticks < SHAPING_MIN_TICKS) { // due, or too close to wake up for an echo first
+    OCR1A = shaping_event_interval; // babystep_isr() reads the whole interval
+    stepper_isr();
+    shaping_event_interval = OCR1A;
+    shaping_event_ticks += OCR1A + 1L; // an early or late step event makes the next interval shorter or longer
   }
+
+  unsigned short wait = shaping_run<X_AXIS>(), wait_y = shaping_run<Y_AXIS>();
+  if (wait_y < wait) wait = wait_y;
+  unsigned short timer = shaping_event_ticks > 0xFFFF ? 0xFFFF : shaping_event_ticks;
+  if (wait < (timer >> SHAPING_TICK_SHIFT))
+    timer = (wait << SHAPING_TICK_SHIFT) - shaping_now_rest;
+  OCR1A = (timer < SHAPING_MIN_TICKS ? SHAPING_MIN_TICKS : timer) - 1;
+}
+#endif
+
+ISR(TIMER1_COMPA_vect)
+{
+  #ifdef STEPPER_ISR_PROFILE
+    unsigned short start = TCNT1;
+  #endif
+
+  #ifdef INPUT_SHAPING
+    shaping_isr();
+  #else
+    stepper_isr();
+  #endif
+
+  #ifdef STEPPER_ISR_PROFILE
+    unsigned short end = TCNT1;
+    // The counter restarted during the interrupt (the compare flag is set again) or is already
+    // beyond the new compare value: the next step is late.
+    if ((TIFR1 & (1<<OCF1A)) || end < start || end >= OCR1A) {
+      isr_missed++;
+    }
+    else {
+      unsigned short ticks = end - start;
+      if (ticks < isr_ticks_min) isr_ticks_min = ticks;
+      if (ticks > isr_ticks_max) isr_ticks_max = ticks;
+      isr_ticks_total += ticks;
+      isr_count++;
+    }
+    if (step_loops == 2) isr_double_steps++;
+    else if (step_loops == 4) isr_quad_steps++;
+  #endif
+}
+
+#ifdef STEPPER_ISR_PROFILE
+void st_isr_profile_report()
+{
+  CRITICAL_SECTION_START;
+  unsigned short ticks_min = isr_ticks_min, ticks_max = isr_ticks_max;
+  unsigned long ticks_total = isr_ticks_total, count = isr_count;
+  unsigned long double_steps = isr_double_steps, quad_steps = isr_quad_steps, missed = isr_missed;
+  #ifdef STEP_SEGMENTS
+  unsigned long underruns = segment_underruns;
+  #endif
+  CRITICAL_SECTION_END;
+
+  const float us_per_tick = 8000000.0 / F_CPU;
+  SERIAL_ECHO_START;
+  SERIAL_ECHOPGM("Stepper ISR us min:");
+  SERIAL_ECHO(count ? ticks_min * us_per_tick : 0);
+  SERIAL_ECHOPGM(" avg:");
+  SERIAL_ECHO(count ? ticks_total * us_per_tick / count : 0);
+  SERIAL_ECHOPGM(" max:");
+  SERIAL_ECHO(ticks_max * us_per_tick);
+  SERIAL_ECHOPGM(" count:");
+  SERIAL_ECHO(count);
+  SERIAL_ECHOPGM(" double:");
+  SERIAL_ECHO(double_steps);
+  SERIAL_ECHOPGM(" quad:");
+  SERIAL_ECHO(quad_steps);
+  SERIAL_ECHOPGM(" missed:");
+  #ifdef STEP_SEGMENTS
+  SERIAL_ECHO(missed);
+  SERIAL_ECHOPGM(" segments prepared in the ISR:");
+  SERIAL_ECHOLN(underruns);
+  #else
+  SERIAL_ECHOLN(missed);
+  #endif
+}
+
+void st_isr_profile_reset()
+{
+  CRITICAL_SECTION_START;
+  isr_ticks_min = 0xFFFF;
+  isr_ticks_max = 0;
+  isr_ticks_total = 0;
+  isr_count = 0;
+  isr_double_steps = 0;
+  isr_quad_steps = 0;
+  isr_missed = 0;
+  #ifdef STEP_SEGMENTS
+  segment_underruns = 0;
+  #endif
+  CRITICAL_SECTION_END;
 }
+#endif //STEPPER_ISR_PROFILE
 
 #ifdef ADVANCE
   unsigned char old_OCR0A;
@@ -764,9 +2203,211 @@ ISR(TIMER1_COMPA_vect)
   }
 #endif // ADVANCE
 
+#ifdef AXIS_ENCODERS
+static volatile long encoder_count[3];
+static uint8_t encoder_state[3]; //the last readings of pins A and B, in bits 1 and 0
+static uint8_t encoder_axes; //a bit for each axis whose encoder is counted
+static bool encoder_checked[3]; //encoder_offset[] is set, the axis has been homed since
+static float encoder_offset[3]; //steps less the encoder position in steps when it was set
+static float encoder_error[3]; //mm, at the last check
+static bool encoder_resync; //count_position was set, the offsets are taken again
+static const float encoder_steps_per_count[3] = AXIS_ENCODER_STEPS_PER_COUNT;
+
+#define AXIS_ENCODER_READ(axis, a_pin, b_pin) do { \
+    uint8_t s = (READ(a_pin) ? 2 : 0) | (READ(b_pin) ? 1 : 0); \
+    encoder_count[axis] += encoder_step[(encoder_state[axis] << 2) | s]; \
+    encoder_state[axis] = s; \
+  } while(0)
+
+static void axis_encoders_read()
+{
+  //count change by the old state in bits 3 and 2 and the new one in bits 1 and 0, 0 for an impossible one
+  static const int8_t encoder_step[16] = {0, 1, -1, 0, -1, 0, 0, 1, 1, 0, 0, -1, 0, -1, 1, 0};
+  #if X_ENCODER_A_PIN > -1
+    AXIS_ENCODER_READ(X_AXIS, X_ENCODER_A_PIN, X_ENCODER_B_PIN);
+  #endif
+  #if Y_ENCODER_A_PIN > -1
+    AXIS_ENCODER_READ(Y_AXIS, Y_ENCODER_A_PIN, Y_ENCODER_B_PIN);
+  #endif
+  #if Z_ENCODER_A_PIN > -1
+    AXIS_ENCODER_READ(Z_AXIS, Z_ENCODER_A_PIN, Z_ENCODER_B_PIN);
+  #endif
+}
+
+// Enable the pin change interrupt of an encoder pin, false if it has none
+static bool axis_encoder_interrupt(uint8_t pin)
+{
+  #ifdef digitalPinToPCICR
+    if (digitalPinToPCICR(pin) != NULL) {
+      *digitalPinToPCMSK(pin) |= _BV(digitalPinToPCMSKbit(pin));
+      *digitalPinToPCICR(pin) |= _BV(digitalPinToPCICRbit(pin));
+      return true;
+    }
+  #endif
+  return false;
+}
+
+static void axis_encoder_init(uint8_t axis, uint8_t a_pin, uint8_t b_pin)
+{
+  pinMode(a_pin, INPUT);
+  pinMode(b_pin, INPUT);
+  if (axis_encoder_interrupt(a_pin) && axis_encoder_interrupt(b_pin))
+    encoder_axes |= (1<<axis);
+  else {
+    SERIAL_ERROR_START;
+    SERIAL_ERRORPGM("No pin change interrupt for the encoder of ");
+    SERIAL_ERRORLN(axis_codes[axis]);
+  }
+}
+
+void axis_encoders_check()
+{
+  bool resync = encoder_resync;
+  encoder_resync = false;
+  for (uint8_t i = 0; i < 3; i++) {
+    if (!(encoder_axes & (1<<i)) || !axis_known_position[i]) {
+      encoder_checked[i] = false;
+      continue;
+    }
+    CRITICAL_SECTION_START;
+    long steps = count_position[i];
+    long count = encoder_count[i];
+    CRITICAL_SECTION_END;
+    float difference = steps - count * encoder_steps_per_count[i];
+    if (!encoder_checked[i] || resync) { // homed or set since the last check
+      encoder_offset[i] = difference;
+      encoder_checked[i] = true;
+      continue;
+    }
+    encoder_error[i] = (difference - encoder_offset[i]) / axis_steps_per_unit[i];
+    if (fabs(encoder_error[i]) > AXIS_ENCODER_MAX_ERROR) {
+      axis_known_position[i] = false; // G28 O homes it again
+      encoder_checked[i] = false;
+      SERIAL_ERROR_START;
+      SERIAL_ERRORPGM("Skipped steps ");
+      SERIAL_ERROR(axis_codes[i]);
+      SERIAL_ERRORPGM(":");
+      SERIAL_ERRORLN(encoder_error[i]);
+      LCD_ALERTMESSAGEPGM("Skipped steps");
+      #if defined(AXIS_ENCODER_PAUSE) && defined(SDSUPPORT)
+        if (card.sdprinting)
+          card.pauseSDPrint();
+      #endif
+    }
+  }
+}
+
+// M821: the count of each encoder and its difference from the steps in mm, while the axis is homed
+void axis_encoders_report()
+{
+  for (uint8_t i = 0; i < 3; i++) {
+    if (!(encoder_axes & (1<<i)))
+      continue;
+    SERIAL_PROTOCOL(axis_codes[i]);
+    SERIAL_PROTOCOLPGM(":");
+    SERIAL_PROTOCOL(encoder_count[i]);
+    if (encoder_checked[i]) {
+      SERIAL_PROTOCOLPGM(" error:");
+      SERIAL_PROTOCOL(encoder_error[i]);
+    }
+    SERIAL_PROTOCOLPGM(" ");
+  }
+  SERIAL_PROTOCOLLNPGM("");
+}
+
+#ifndef ENDSTOP_INTERRUPTS // otherwise endstop_pin_changed() reads them
+static void axis_encoder_pin_changed()
+{
+  axis_encoders_read();
+  #if defined(ULTIPANEL) && defined(ENCODER_INTERRUPTS)
+  lcd_encoder_pin_changed(); // the LCD encoder pins share the vectors
+  #endif
+}
+
+#ifdef PCINT0_vect
+ISR(PCINT0_vect) { axis_encoder_pin_changed(); }
+#endif
+#ifdef PCINT1_vect
+ISR(PCINT1_vect) { axis_encoder_pin_changed(); }
+#endif
+#ifdef PCINT2_vect
+ISR(PCINT2_vect) { axis_encoder_pin_changed(); }
+#endif
+#ifdef PCINT3_vect
+ISR(PCINT3_vect) { axis_encoder_pin_changed(); }
+#endif
+#endif
+#endif // AXIS_ENCODERS
+
+#ifdef ENDSTOP_INTERRUPTS
+static void endstop_pin_changed()
+{
+  endstops_changed = true;
+  #ifdef AXIS_ENCODERS
+  axis_encoders_read(); // they share the vectors
+  #endif
+  #if defined(ULTIPANEL) && defined(ENCODER_INTERRUPTS)
+  lcd_encoder_pin_changed(); // the encoder pins share the vectors
+  #endif
+}
+
+#ifdef PCINT0_vect
+ISR(PCINT0_vect) { endstop_pin_changed(); }
+#endif
+#ifdef PCINT1_vect
+ISR(PCINT1_vect) { endstop_pin_changed(); }
+#endif
+#ifdef PCINT2_vect
+ISR(PCINT2_vect) { endstop_pin_changed(); }
+#endif
+#ifdef PCINT3_vect
+ISR(PCINT3_vect) { endstop_pin_changed(); }
+#endif
+
+// attachInterrupt() number of the external interrupt on a pin, -1 if it has none
+static int8_t endstop_external_interrupt(uint8_t pin)
+{
+  #if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+    switch(pin) {
+      case 2: return 0;
+      case 3: return 1;
+      case 21: return 2;
+      case 20: return 3;
+      case 19: return 4;
+      case 18: return 5;
+    }
+  #endif
+  return -1;
+}
+
+// Prefer the pin change interrupt, many endstops can share one
+static void endstop_interrupt_init(uint8_t pin, uint8_t endstop)
+{
+  #ifdef digitalPinToPCICR
+    if (digitalPinToPCICR(pin) != NULL) {
+      *digitalPinToPCMSK(pin) |= _BV(digitalPinToPCMSKbit(pin));
+      *digitalPinToPCICR(pin) |= _BV(digitalPinToPCICRbit(pin));
+      return;
+    }
+  #endif
+  int8_t external = endstop_external_interrupt(pin);
+  if (external >= 0)
+    attachInterrupt(external, endstop_pin_changed, CHANGE);
+  else
+    endstops_polled |= (1<<endstop);
+}
+#endif
+
 void st_init()
 {
+  #ifdef SPEED_TABLE_RAM
+  speed_table_init();
+  #endif
   digipot_init(); //Initialize Digipot Motor Current
+  #ifdef LASER_PWM
+    pinMode(LASER_PIN, OUTPUT);
+    digitalWrite(LASER_PIN, LOW);
+  #endif
   microstep_init(); //Initialize Microstepping Pins
 
   //Initialize Dir Pins
@@ -885,6 +2526,39 @@ void st_init()
     #endif
   #endif
 
+  #ifdef ENDSTOP_INTERRUPTS
+    #if defined(X_MIN_PIN) && X_MIN_PIN > -1
+      endstop_interrupt_init(X_MIN_PIN, ENDSTOP_X_MIN);
+    #endif
+    #if defined(X_MAX_PIN) && X_MAX_PIN > -1
+      endstop_interrupt_init(X_MAX_PIN, ENDSTOP_X_MAX);
+    #endif
+    #if defined(Y_MIN_PIN) && Y_MIN_PIN > -1
+      endstop_interrupt_init(Y_MIN_PIN, ENDSTOP_Y_MIN);
+    #endif
+    #if defined(Y_MAX_PIN) && Y_MAX_PIN > -1
+      endstop_interrupt_init(Y_MAX_PIN, ENDSTOP_Y_MAX);
+    #endif
+    #if defined(Z_MIN_PIN) && Z_MIN_PIN > -1
+      endstop_interrupt_init(Z_MIN_PIN, ENDSTOP_Z_MIN);
+    #endif
+    #if defined(Z_MAX_PIN) && Z_MAX_PIN > -1
+      endstop_interrupt_init(Z_MAX_PIN, ENDSTOP_Z_MAX);
+    #endif
+  #endif
+
+  #ifdef AXIS_ENCODERS
+    #if X_ENCODER_A_PIN > -1
+      axis_encoder_init(X_AXIS, X_ENCODER_A_PIN, X_ENCODER_B_PIN);
+    #endif
+    #if Y_ENCODER_A_PIN > -1
+      axis_encoder_init(Y_AXIS, Y_ENCODER_A_PIN, Y_ENCODER_B_PIN);
+    #endif
+    #if Z_ENCODER_A_PIN > -1
+      axis_encoder_init(Z_AXIS, Z_ENCODER_A_PIN, Z_ENCODER_B_PIN);
+    #endif
+  #endif
+
 
   //Initialize Step Pins
   #if defined(X_STEP_PIN) && (X_STEP_PIN > -1)
@@ -948,6 +2622,17 @@ void st_init()
   // create_speed_lookuptable.py
   TCCR1B = (TCCR1B & ~(0x07<<CS10)) | (2<<CS10);
 
+  #ifdef INPUT_SHAPING
+    // the motors start out going forward
+    WRITE(X_DIR_PIN, !INVERT_X_DIR);
+    WRITE(Y_DIR_PIN, !INVERT_Y_DIR);
+    #ifdef Y_DUAL_STEPPER_DRIVERS
+      WRITE(Y2_DIR_PIN, (INVERT_Y_DIR == INVERT_Y2_VS_Y_DIR));
+    #endif
+    st_apply_shaping(X_AXIS);
+    st_apply_shaping(Y_AXIS);
+  #endif
+
   OCR1A = 0x4000;
   TCNT1 = 0;
   ENABLE_STEPPER_DRIVER_INTERRUPT();
@@ -971,21 +2656,36 @@ void st_init()
 // Block until all buffered steps are executed
 void st_synchronize()
 {
+#ifdef SEGMENT_MERGE
+    plan_flush_pending();
+#endif
+#ifdef PLANNER_PRIMING
+    plan_end_priming();
+#endif
     while( blocks_queued()) {
-    manage_heater();
-    manage_inactivity();
-    lcd_update();
+    idle();
   }
+#ifdef PLANNER_STARVATION_STATS
+    plan_starved = false; // waited for on purpose
+#endif
 }
 
 void st_set_position(const long &x, const long &y, const long &z, const long &e)
 {
   CRITICAL_SECTION_START;
+  #ifdef TRAVEL_MICROSTEP_FACTOR
+    // The drivers stay at their microstep
+    microstep_phase[X_AXIS] += count_position[X_AXIS] - x;
+    microstep_phase[Y_AXIS] += count_position[Y_AXIS] - y;
+  #endif
   count_position[X_AXIS] = x;
   count_position[Y_AXIS] = y;
   count_position[Z_AXIS] = z;
   count_position[E_AXIS] = e;
   CRITICAL_SECTION_END;
+  #ifdef AXIS_ENCODERS
+  encoder_resync = true;
+  #endif
 }
 
 void st_set_e_position(const long &e)
@@ -995,6 +2695,25 @@ void st_set_e_position(const long &e)
   CRITICAL_SECTION_END;
 }
 
+#ifdef PLANNED_TOOLCHANGE
+void st_shift_position(const long &x, const long &y, const long &z, const long &e)
+{
+  CRITICAL_SECTION_START;
+  #ifdef TRAVEL_MICROSTEP_FACTOR
+    microstep_phase[X_AXIS] -= x;
+    microstep_phase[Y_AXIS] -= y;
+  #endif
+  count_position[X_AXIS] += x;
+  count_position[Y_AXIS] += y;
+  count_position[Z_AXIS] += z;
+  count_position[E_AXIS] += e;
+  CRITICAL_SECTION_END;
+  #ifdef AXIS_ENCODERS
+  encoder_resync = true;
+  #endif
+}
+#endif
+
 long st_get_position(uint8_t axis)
 {
   long count_pos;
@@ -1026,166 +2745,39 @@ void finishAndDisableSteppers()
 void quickStop()
 {
   DISABLE_STEPPER_DRIVER_INTERRUPT();
+#ifdef SEGMENT_MERGE
+  plan_discard_pending();
+#endif
   while(blocks_queued())
     plan_discard_current_block();
   current_block = NULL;
+  #ifdef STEP_SEGMENTS
+    segment = NULL;
+    segment_head = segment_tail = 0;
+    prep_block = NULL;
+    prep_index = block_buffer_tail;
+    prep_abort = PREP_ABORT_NONE;
+  #endif
+  #ifdef LIN_ADVANCE
+    e_steps_pending = 0;
+    lin_advance_steps = 0;
+  #endif
   ENABLE_STEPPER_DRIVER_INTERRUPT();
 }
 
-#ifdef BABYSTEPPING
-
-
-void babystep(const uint8_t axis,const bool direction)
-{
-  //MUST ONLY BE CALLED BY A ISR, it depends on that no other ISR interrupts this
-    //store initial pin states
-  switch(axis)
-  {
-  case X_AXIS:
-  {
-    enable_x();   
-    uint8_t old_x_dir_pin= READ(X_DIR_PIN);  //if dualzstepper, both point to same direction.
-   
-    //setup new step
-    WRITE(X_DIR_PIN,(INVERT_X_DIR)^direction);
-    #ifdef DUAL_X_CARRIAGE
-      WRITE(X2_DIR_PIN,(INVERT_X_DIR)^direction);
-    #endif
-    
-    //perform step 
-    WRITE(X_STEP_PIN, !INVERT_X_STEP_PIN); 
-    #ifdef DUAL_X_CARRIAGE
-      WRITE(X2_STEP_PIN, !INVERT_X_STEP_PIN);
-    #endif
-    {
-    float x=1./float(axis+1)/float(axis+2); //wait a tiny bit
-    }
-    WRITE(X_STEP_PIN, INVERT_X_STEP_PIN);
-    #ifdef DUAL_X_CARRIAGE
-      WRITE(X2_STEP_PIN, INVERT_X_STEP_PIN);
-    #endif
-
-    //get old pin state back.
-    WRITE(X_DIR_PIN,old_x_dir_pin);
-    #ifdef DUAL_X_CARRIAGE
-      WRITE(X2_DIR_PIN,old_x_dir_pin);
-    #endif
-
-  }
-  break;
-  case Y_AXIS:
-  {
-    enable_y();   
-    uint8_t old_y_dir_pin= READ(Y_DIR_PIN);  //if dualzstepper, both point to same direction.
-   
-    //setup new step
-    WRITE(Y_DIR_PIN,(INVERT_Y_DIR)^direction);
-    #ifdef DUAL_Y_CARRIAGE
-      WRITE(Y2_DIR_PIN,(INVERT_Y_DIR)^direction);
-    #endif
-    
-    //perform step 
-    WRITE(Y_STEP_PIN, !INVERT_Y_STEP_PIN); 
-    #ifdef DUAL_Y_CARRIAGE
-      WRITE(Y2_STEP_PIN, !INVERT_Y_STEP_PIN);
-    #endif
-    {
-    float x=1./float(axis+1)/float(axis+2); //wait a tiny bit
-    }
-    WRITE(Y_STEP_PIN, INVERT_Y_STEP_PIN);
-    #ifdef DUAL_Y_CARRIAGE
-      WRITE(Y2_STEP_PIN, INVERT_Y_STEP_PIN);
-    #endif
-
-    //get old pin state back.
-    WRITE(Y_DIR_PIN,old_y_dir_pin);
-    #ifdef DUAL_Y_CARRIAGE
-      WRITE(Y2_DIR_PIN,old_y_dir_pin);
-    #endif
-
-  }
-  break;
- 
-#ifndef DELTA
-  case Z_AXIS:
-  {
-    enable_z();
-    uint8_t old_z_dir_pin= READ(Z_DIR_PIN);  //if dualzstepper, both point to same direction.
-    //setup new step
-    WRITE(Z_DIR_PIN,(INVERT_Z_DIR)^direction^BABYSTEP_INVERT_Z);
-    #ifdef Z_DUAL_STEPPER_DRIVERS
-      WRITE(Z2_DIR_PIN,(INVERT_Z_DIR)^direction^BABYSTEP_INVERT_Z);
-    #endif
-    //perform step 
-    WRITE(Z_STEP_PIN, !INVERT_Z_STEP_PIN); 
-    #ifdef Z_DUAL_STEPPER_DRIVERS
-      WRITE(Z2_STEP_PIN, !INVERT_Z_STEP_PIN);
-    #endif
-    //wait a tiny bit
-    {
-    float x=1./float(axis+1); //absolutely useless
-    }
-    WRITE(Z_STEP_PIN, INVERT_Z_STEP_PIN);
-    #ifdef Z_DUAL_STEPPER_DRIVERS
-      WRITE(Z2_STEP_PIN, INVERT_Z_STEP_PIN);
-    #endif
-
-    //get old pin state back.
-    WRITE(Z_DIR_PIN,old_z_dir_pin);
-    #ifdef Z_DUAL_STEPPER_DRIVERS
-      WRITE(Z2_DIR_PIN,old_z_dir_pin);
-    #endif
-
-  }
-  break;
-#else //DELTA
-  case Z_AXIS:
-  {
-    enable_x();
-    enable_y();
-    enable_z();
-    uint8_t old_x_dir_pin= READ(X_DIR_PIN);  
-    uint8_t old_y_dir_pin= READ(Y_DIR_PIN);  
-    uint8_t old_z_dir_pin= READ(Z_DIR_PIN);  
-    //setup new step
-    WRITE(X_DIR_PIN,(INVERT_X_DIR)^direction^BABYSTEP_INVERT_Z);
-    WRITE(Y_DIR_PIN,(INVERT_Y_DIR)^direction^BABYSTEP_INVERT_Z);
-    WRITE(Z_DIR_PIN,(INVERT_Z_DIR)^direction^BABYSTEP_INVERT_Z);
-    
-    //perform step 
-    WRITE(X_STEP_PIN, !INVERT_X_STEP_PIN); 
-    WRITE(Y_STEP_PIN, !INVERT_Y_STEP_PIN); 
-    WRITE(Z_STEP_PIN, !INVERT_Z_STEP_PIN); 
-    
-    //wait a tiny bit
-    {
-    float x=1./float(axis+1); //absolutely useless
-    }
-    WRITE(X_STEP_PIN, INVERT_X_STEP_PIN); 
-    WRITE(Y_STEP_PIN, INVERT_Y_STEP_PIN); 
-    WRITE(Z_STEP_PIN, INVERT_Z_STEP_PIN);
-
-    //get old pin state back.
-    WRITE(X_DIR_PIN,old_x_dir_pin);
-    WRITE(Y_DIR_PIN,old_y_dir_pin);
-    WRITE(Z_DIR_PIN,old_z_dir_pin);
-
-  }
-  break;
-#endif
- 
-  default:    break;
-  }
-}
-#endif //BABYSTEPPING
-
 void digitalPotWrite(int address, int value) // From Arduino DigitalPotControl example
 {
   #if defined(DIGIPOTSS_PIN) && DIGIPOTSS_PIN > -1
+    #ifdef SPI_BUS_ARBITER
+      spi_bus_acquire();
+    #endif
     digitalWrite(DIGIPOTSS_PIN,LOW); // take the SS pin low to select the chip
     SPI.transfer(address); //  send in the address and value via SPI:
     SPI.transfer(value);
     digitalWrite(DIGIPOTSS_PIN,HIGH); // take the SS pin high to de-select the chip:
+    #ifdef SPI_BUS_ARBITER
+      spi_bus_release();
+    #endif
     //delay(10);
   #endif
 }
@@ -1213,7 +2805,56 @@ void digipot_init() //Initialize Digipot Motor Current
   #endif
 }
 
+#ifdef IDLE_CURRENT_PERCENT
+static int motor_current_run[5];      // set by digipot_init() and M907, idle drivers get IDLE_CURRENT_PERCENT of it
+static uint8_t motor_current_drivers; // the drivers at the idle current, a bit each
+static uint8_t motor_current_axes;    // the axes at the idle current
+
+static void digipot_current_write(uint8_t driver, int current);
+
+void digipot_current(uint8_t driver, int current)
+{
+  motor_current_run[driver] = current;
+  if (motor_current_drivers & (1<<driver))
+    current = (long)current * IDLE_CURRENT_PERCENT / 100;
+  digipot_current_write(driver, current);
+}
+
+void motor_current_idle(uint8_t idle_axes)
+{
+  if (idle_axes == motor_current_axes)
+    return;
+  motor_current_axes = idle_axes;
+  #ifdef DIGIPOT_I2C
+    // channels 0-3 are the axes, 4-7 the further extruders
+    digipot_i2c_set_idle((idle_axes & 0x0f) | ((idle_axes & (1<<E_AXIS)) ? 0xf0 : 0));
+  #endif
+  #ifdef MOTOR_CURRENT_PWM_XY_PIN
+    // X and Y share a driver current, it idles when both do
+    uint8_t drivers = ((idle_axes & ((1<<X_AXIS)|(1<<Y_AXIS))) == ((1<<X_AXIS)|(1<<Y_AXIS)) ? 1 : 0)
+                    | ((idle_axes & (1<<Z_AXIS)) ? 2 : 0) | ((idle_axes & (1<<E_AXIS)) ? 4 : 0);
+  #else
+    uint8_t drivers = (idle_axes & 0x0f) | ((idle_axes & (1<<E_AXIS)) ? 0x10 : 0); // driver 4 is the second extruder
+  #endif
+  uint8_t changed = drivers ^ motor_current_drivers;
+  motor_current_drivers = drivers;
+  for (uint8_t i = 0; i < 5; i++)
+    if (changed & (1<<i))
+      digipot_current(i, motor_current_run[i]);
+}
+
+bool motor_current_wake(uint8_t axes)
+{
+  if (!(motor_current_axes & axes))
+    return false;
+  motor_current_idle(motor_current_axes & ~axes);
+  return true;
+}
+
+static void digipot_current_write(uint8_t driver, int current)
+#else
 void digipot_current(uint8_t driver, int current)
+#endif
 {
   #if defined(DIGIPOTSS_PIN) && DIGIPOTSS_PIN > -1
     const uint8_t digipot_ch[] = DIGIPOT_CHANNELS;
@@ -1261,6 +2902,12 @@ void microstep_ms(uint8_t driver, int8_t ms1, int8_t ms2)
 
 void microstep_mode(uint8_t driver, uint8_t stepping_mode)
 {
+  #ifdef TRAVEL_MICROSTEP_FACTOR
+  if(driver <= Y_AXIS) {
+    travel_fine_modes[driver] = stepping_mode;
+    if(travel_microsteps && stepping_mode >= TRAVEL_MICROSTEP_FACTOR) stepping_mode /= TRAVEL_MICROSTEP_FACTOR;
+  }
+  #endif
   switch(stepping_mode)
   {
     case 1: microstep_ms(driver,MICROSTEP1); break;
@@ -1271,6 +2918,18 @@ void microstep_mode(uint8_t driver, uint8_t stepping_mode)
   }
 }
 
+#ifdef TRAVEL_MICROSTEP_FACTOR
+bool st_travel_microsteps_usable()
+{
+  return travel_fine_modes[X_AXIS] >= TRAVEL_MICROSTEP_FACTOR && travel_fine_modes[Y_AXIS] >= TRAVEL_MICROSTEP_FACTOR;
+}
+
+uint8_t st_microstep_phase(uint8_t axis)
+{
+  return microstep_phase[axis];
+}
+#endif
+
 void microstep_readings()
 {
       SERIAL_PROTOCOLPGM("MS1,MS2 Pins\n");
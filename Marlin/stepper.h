@@ -23,6 +23,28 @@
 
 #include "planner.h"
 
+#define ENABLE_STEPPER_DRIVER_INTERRUPT()  TIMSK1 |= (1<<OCIE1A)
+#define DISABLE_STEPPER_DRIVER_INTERRUPT() TIMSK1 &= ~(1<<OCIE1A)
+
+#ifdef DUAL_X_CARRIAGE
+  extern bool extruder_duplication_enabled;
+  extern bool extruder_duplication_mirrored;
+  // The steppers the current block drives, set when it is loaded
+  #define DXC_X_STEPPER  1
+  #define DXC_X2_STEPPER 2
+  #define DXC_E0_STEPPER 4
+  #define DXC_E1_STEPPER 8
+  #define DXC_X2_MIRRORED 16
+  extern unsigned char dual_x_steppers;
+#endif
+
+#ifdef Z_DUAL_AUTO_ALIGN
+  // The Z motors that step, both except while G34 turns one alone. Change it only with the queue empty.
+  #define Z_DUAL_Z_STEPPER  1
+  #define Z_DUAL_Z2_STEPPER 2
+  extern unsigned char z_dual_steppers;
+#endif
+
 #if EXTRUDERS > 2
   #define WRITE_E_STEP(v) { if(current_block->active_extruder == 2) { WRITE(E2_STEP_PIN, v); } else { if(current_block->active_extruder == 1) { WRITE(E1_STEP_PIN, v); } else { WRITE(E0_STEP_PIN, v); }}}
   #define NORM_E_DIR() { if(current_block->active_extruder == 2) { WRITE(E2_DIR_PIN, !INVERT_E2_DIR); } else { if(current_block->active_extruder == 1) { WRITE(E1_DIR_PIN, !INVERT_E1_DIR); } else { WRITE(E0_DIR_PIN, !INVERT_E0_DIR); }}}
@@ -33,10 +55,9 @@
     #define NORM_E_DIR() { if(current_block->active_extruder == 1) { WRITE(E1_DIR_PIN, !INVERT_E1_DIR); } else { WRITE(E0_DIR_PIN, !INVERT_E0_DIR); }}
     #define REV_E_DIR() { if(current_block->active_extruder == 1) { WRITE(E1_DIR_PIN, INVERT_E1_DIR); } else { WRITE(E0_DIR_PIN, INVERT_E0_DIR); }}
   #else
-    extern bool extruder_duplication_enabled;
-    #define WRITE_E_STEP(v) { if(extruder_duplication_enabled) { WRITE(E0_STEP_PIN, v); WRITE(E1_STEP_PIN, v); } else if(current_block->active_extruder == 1) { WRITE(E1_STEP_PIN, v); } else { WRITE(E0_STEP_PIN, v); }}
-    #define NORM_E_DIR() { if(extruder_duplication_enabled) { WRITE(E0_DIR_PIN, !INVERT_E0_DIR); WRITE(E1_DIR_PIN, !INVERT_E1_DIR); } else if(current_block->active_extruder == 1) { WRITE(E1_DIR_PIN, !INVERT_E1_DIR); } else { WRITE(E0_DIR_PIN, !INVERT_E0_DIR); }}
-    #define REV_E_DIR() { if(extruder_duplication_enabled) { WRITE(E0_DIR_PIN, INVERT_E0_DIR); WRITE(E1_DIR_PIN, INVERT_E1_DIR); } else if(current_block->active_extruder == 1) { WRITE(E1_DIR_PIN, INVERT_E1_DIR); } else { WRITE(E0_DIR_PIN, INVERT_E0_DIR); }}
+    #define WRITE_E_STEP(v) { if(dual_x_steppers & DXC_E0_STEPPER) WRITE(E0_STEP_PIN, v); if(dual_x_steppers & DXC_E1_STEPPER) WRITE(E1_STEP_PIN, v); }
+    #define NORM_E_DIR() { if(dual_x_steppers & DXC_E0_STEPPER) WRITE(E0_DIR_PIN, !INVERT_E0_DIR); if(dual_x_steppers & DXC_E1_STEPPER) WRITE(E1_DIR_PIN, !INVERT_E1_DIR); }
+    #define REV_E_DIR() { if(dual_x_steppers & DXC_E0_STEPPER) WRITE(E0_DIR_PIN, INVERT_E0_DIR); if(dual_x_steppers & DXC_E1_STEPPER) WRITE(E1_DIR_PIN, INVERT_E1_DIR); }
   #endif  
 #else
   #define WRITE_E_STEP(v) WRITE(E0_STEP_PIN, v)
@@ -57,6 +78,9 @@ void st_synchronize();
 // Set current position in steps
 void st_set_position(const long &x, const long &y, const long &z, const long &e);
 void st_set_e_position(const long &e);
+#ifdef PLANNED_TOOLCHANGE
+void st_shift_position(const long &x, const long &y, const long &z, const long &e); // add to the current position
+#endif
 
 // Get current position in steps
 long st_get_position(uint8_t axis);
@@ -72,28 +96,72 @@ void st_wake_up();
 
   
 void checkHitEndstops(); //call from somewhere to create an serial error message with the locations the endstops where hit, in case they were triggered
+void checkStepRate(); //report a step rate calc_timer() had to clamp; the interrupt only flags it
 void endstops_hit_on_purpose(); //avoid creation of the message, i.e. after homing and before a routine call of checkHitEndstops();
+unsigned char endstops_hit_axes(); //the axes (1<<X_AXIS..) whose endstop stopped a move since the flags were last cleared
 
 void enable_endstops(bool check); // Enable/disable endstop checking
 
 void checkStepperErrors(); //Print errors detected by the stepper
 
+#ifdef AXIS_ENCODERS
+void axis_encoders_check(); //report an axis whose encoder left its steps, call from the main loop
+void axis_encoders_report();
+#endif
+
 void finishAndDisableSteppers();
 
 extern block_t *current_block;  // A pointer to the block currently being traced
 
+#ifdef DRY_PLANNING
+extern volatile bool dry_planning; // M806: the stepper interrupt retires blocks without stepping
+#endif
+
 void quickStop();
 
+#ifdef STEP_SEGMENTS
+void st_prep_segments(); // slice the queued blocks into segments for the stepper interrupt, from the main loop
+#endif
+
 void digitalPotWrite(int address, int value);
 void microstep_ms(uint8_t driver, int8_t ms1, int8_t ms2);
 void microstep_mode(uint8_t driver, uint8_t stepping);
 void digipot_init();
 void digipot_current(uint8_t driver, int current);
+#ifdef IDLE_CURRENT_PERCENT
+// Give the axes (a bit each, X_AXIS..E_AXIS) in idle_axes the idle current and the others the full one
+void motor_current_idle(uint8_t idle_axes);
+// Full current for the axes of a block about to be queued, true when some of them were idle
+bool motor_current_wake(uint8_t axes);
+#endif
 void microstep_init();
 void microstep_readings();
+#ifdef TRAVEL_MICROSTEP_FACTOR
+// Whether the X and Y modes allow the coarse travel microsteps
+bool st_travel_microsteps_usable();
+// Microstep of the X or Y driver less the steps of count_position, which are in normal microsteps
+uint8_t st_microstep_phase(uint8_t axis);
+#endif
 
 #ifdef BABYSTEPPING
-  void babystep(const uint8_t axis,const bool direction); // perform a short step with a single stepper motor, outside of any convention
+  extern volatile int babystepsTodo[3]; // steps the stepper interrupt adds to X, Y and Z, outside of the planned moves
+#endif
+
+#ifdef INPUT_SHAPING
+  extern float shaping_frequency[2]; // Hz of the ringing of X and Y, 0 for no shaping
+  extern float shaping_damping[2];   // damping ratio of the ringing
+  extern unsigned int shaping_overflows[2]; // steps whose echoes came early, INPUT_SHAPING_BUFFER being full
+  bool st_apply_shaping(uint8_t axis); // use the above from the next time the axis stands still, false if too low
+  void st_suspend_shaping(bool suspend); // waits for the moves, for homing against an endstop
+#endif
+
+#ifdef STEPPER_ISR_PROFILE
+  void st_isr_profile_report(); // print stepper interrupt duration and overrun statistics
+  void st_isr_profile_reset();
+#endif
+
+#ifdef MATH_BENCHMARK
+  unsigned short bench_calc_timer(unsigned short step_rate); // calc_timer() for benchmark_run()
 #endif
      
 
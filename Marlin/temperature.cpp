@@ -33,6 +33,7 @@
 #include "ultralcd.h"
 #include "temperature.h"
 #include "watchdog.h"
+#include "spi_bus.h"
 
 //===========================================================================
 //=============================public variables============================
@@ -43,9 +44,11 @@ int current_temperature_raw[EXTRUDERS] = { 0 };
 float current_temperature[EXTRUDERS] = { 0.0 };
 int current_temperature_bed_raw = 0;
 float current_temperature_bed = 0.0;
-#ifdef TEMP_SENSOR_1_AS_REDUNDANT
-  int redundant_temperature_raw = 0;
-  float redundant_temperature = 0.0;
+#ifdef REDUNDANT_SENSORS
+  #define REDUNDANT_BED EXTRUDERS
+  static int redundant_raw[EXTRUDERS + 1]; // of the second sensor of each hotend, then the bed
+  #define _RAW_TEMP_VALUE(n) raw_temp_ ## n ## _value
+  #define RAW_TEMP_VALUE(n) _RAW_TEMP_VALUE(n)  // the sum the interrupt makes for a sensor input
 #endif
 #ifdef PIDTEMP
   float Kp=DEFAULT_Kp;
@@ -53,13 +56,16 @@ float current_temperature_bed = 0.0;
   float Kd=(DEFAULT_Kd/PID_dT);
   #ifdef PID_ADD_EXTRUSION_RATE
     float Kc=DEFAULT_Kc;
+    #ifdef PID_EXTRUSION_FEEDFORWARD
+      unsigned int pid_feedforward_ms = PID_FEEDFORWARD_MS;
+    #endif
   #endif
 #endif //PIDTEMP
 
 #ifdef PIDTEMPBED
   float bedKp=DEFAULT_bedKp;
-  float bedKi=(DEFAULT_bedKi*PID_dT);
-  float bedKd=(DEFAULT_bedKd/PID_dT);
+  float bedKi=(DEFAULT_bedKi*BED_PID_dT);
+  float bedKd=(DEFAULT_bedKd/BED_PID_dT);
 #endif //PIDTEMPBED
   
 #ifdef FAN_SOFT_PWM
@@ -68,29 +74,47 @@ float current_temperature_bed = 0.0;
 
 unsigned char soft_pwm_bed;
   
-#ifdef BABYSTEPPING
-  volatile int babystepsTodo[3]={0,0,0};
-#endif
-  
 //===========================================================================
 //=============================private variables============================
 //===========================================================================
 static volatile bool temp_meas_ready = false;
 
 #ifdef PIDTEMP
+  #ifdef PID_FIXED_POINT
+    // Q24.8: 1/256 degree or PWM step
+    typedef long pidval_t;
+    #define PID_FP_SHIFT 8
+    #define PID_FP_ONE (1L << PID_FP_SHIFT)
+    #define PID_FP_TO_FLOAT(x) ((x) / (float)PID_FP_ONE)
+    // K1 in 1/4096 steps; keeping dTerm within 4x PID_MAX lets K1 * dTerm fit in 32 bits
+    #define PID_FP_K1 ((long)(K1 * 4096.0 + 0.5))
+    #define PID_FP_DTERM_MAX ((long)(PID_MAX) * 4 * PID_FP_ONE)
+    static long Kp_fp, Ki_fp, Kd_fp;    // Kp, Kd*K2 in 1/256, Ki in 1/65536 steps
+    static long Kp_fp_lim, Kd_fp_lim;   // largest operands whose product with Kp/Kd fits in 32 bits
+  #else
+    typedef float pidval_t;
+    #define PID_FP_TO_FLOAT(x) (x)
+  #endif
   //static cannot be external:
-  static float temp_iState[EXTRUDERS] = { 0 };
-  static float temp_dState[EXTRUDERS] = { 0 };
-  static float pTerm[EXTRUDERS];
-  static float iTerm[EXTRUDERS];
-  static float dTerm[EXTRUDERS];
+  static pidval_t temp_iState[EXTRUDERS] = { 0 };
+  static pidval_t temp_dState[EXTRUDERS] = { 0 };
+  static pidval_t pTerm[EXTRUDERS];
+  static pidval_t iTerm[EXTRUDERS];
+  static pidval_t dTerm[EXTRUDERS];
   //int output;
-  static float pid_error[EXTRUDERS];
-  static float temp_iState_min[EXTRUDERS];
-  static float temp_iState_max[EXTRUDERS];
+  static pidval_t pid_error[EXTRUDERS];
+  static pidval_t temp_iState_min[EXTRUDERS];
+  static pidval_t temp_iState_max[EXTRUDERS];
   // static float pid_input[EXTRUDERS];
   // static float pid_output[EXTRUDERS];
   static bool pid_reset[EXTRUDERS];
+  #ifdef PID_BOOST_HEATUP
+  static float boost_last_temp[EXTRUDERS];
+  static unsigned long boost_last_ms[EXTRUDERS];
+  static float boost_rate[EXTRUDERS];     // degree/s, smoothed
+  static bool boosting[EXTRUDERS];        // heating up at full power
+  static float boost_hold[EXTRUDERS];     // PID output per degree above 25C that holds the temperature
+  #endif
 #endif //PIDTEMP
 #ifdef PIDTEMPBED
   //static cannot be external:
@@ -103,9 +127,13 @@ static volatile bool temp_meas_ready = false;
   static float pid_error_bed;
   static float temp_iState_min_bed;
   static float temp_iState_max_bed;
-#else //PIDTEMPBED
-	static unsigned long  previous_millis_bed_heater;
 #endif //PIDTEMPBED
+#if !defined(PIDTEMPBED) || defined(BED_PID_INTERVAL)
+	static unsigned long  previous_millis_bed_heater;
+#endif
+#ifdef BED_SLOW_PWM
+  static unsigned long bed_pwm_cycle_start;
+#endif
   static unsigned char soft_pwm[EXTRUDERS];
 
 #ifdef FAN_SOFT_PWM
@@ -137,18 +165,119 @@ static int maxttemp[EXTRUDERS] = ARRAY_BY_EXTRUDERS( 16383, 16383, 16383 );
 static int bed_maxttemp_raw = HEATER_BED_RAW_HI_TEMP;
 #endif
 
-#ifdef TEMP_SENSOR_1_AS_REDUNDANT
-  static void *heater_ttbl_map[2] = {(void *)HEATER_0_TEMPTABLE, (void *)HEATER_1_TEMPTABLE };
-  static uint8_t heater_ttbllen_map[2] = { HEATER_0_TEMPTABLE_LEN, HEATER_1_TEMPTABLE_LEN };
-#else
-  static void *heater_ttbl_map[EXTRUDERS] = ARRAY_BY_EXTRUDERS( (void *)HEATER_0_TEMPTABLE, (void *)HEATER_1_TEMPTABLE, (void *)HEATER_2_TEMPTABLE );
-  static uint8_t heater_ttbllen_map[EXTRUDERS] = ARRAY_BY_EXTRUDERS( HEATER_0_TEMPTABLE_LEN, HEATER_1_TEMPTABLE_LEN, HEATER_2_TEMPTABLE_LEN );
-#endif
+static void *heater_ttbl_map[EXTRUDERS] = ARRAY_BY_EXTRUDERS( (void *)HEATER_0_TEMPTABLE, (void *)HEATER_1_TEMPTABLE, (void *)HEATER_2_TEMPTABLE );
+static uint8_t heater_ttbllen_map[EXTRUDERS] = ARRAY_BY_EXTRUDERS( HEATER_0_TEMPTABLE_LEN, HEATER_1_TEMPTABLE_LEN, HEATER_2_TEMPTABLE_LEN );
 
 static float analog2temp(int raw, uint8_t e);
 static float analog2tempBed(int raw);
+#ifdef REDUNDANT_SENSORS
+static bool redundant_sensor_off(uint8_t heater);
+static void redundant_sensor_error();
+#endif
 static void updateTemperaturesFromRawValues();
 
+#ifdef THERMAL_RUNAWAY_PROTECTION
+enum { RUNAWAY_INACTIVE, RUNAWAY_HEATING, RUNAWAY_STABLE };
+typedef struct {
+  unsigned char state;
+  int target;           // target the state belongs to
+  int watch_temp;       // heating: temperature at the start of the watch period
+  unsigned long timer;  // heating: start of the watch period, stable: last time inside the band
+} runaway_state_t;
+static runaway_state_t runaway_state[EXTRUDERS + 1]; // hotends, then the bed
+#define RUNAWAY_BED EXTRUDERS
+
+static void thermal_runaway_error(uint8_t heater);
+
+// Whole degrees and millis() only, so this costs next to nothing per heater and cycle
+static void thermal_runaway_check(uint8_t heater, int temp, int target, unsigned long period_ms, int hysteresis)
+{
+  runaway_state_t *r = &runaway_state[heater];
+  if(target != r->target) {
+    r->target = target;
+    r->state = target > 0 ? RUNAWAY_HEATING : RUNAWAY_INACTIVE;
+    r->watch_temp = temp;
+    r->timer = millis();
+  }
+  switch(r->state) {
+    case RUNAWAY_HEATING:
+      if(temp >= target - hysteresis) {
+        r->state = RUNAWAY_STABLE;
+        r->timer = millis();
+      }
+      else if(millis() - r->timer > period_ms) {
+        if(temp < r->watch_temp + THERMAL_RUNAWAY_INCREASE)
+          thermal_runaway_error(heater);
+        r->watch_temp = temp;
+        r->timer = millis();
+      }
+      break;
+    case RUNAWAY_STABLE:
+      if(temp >= target - hysteresis)
+        r->timer = millis();
+      else if(millis() - r->timer > period_ms)
+        thermal_runaway_error(heater);
+      break;
+  }
+}
+#endif //THERMAL_RUNAWAY_PROTECTION
+
+#ifdef THERMAL_HISTORY
+// One heater in one sample, 5 bytes; this is also the record layout of the M802 B dump
+typedef struct {
+  int temp;           // 1/10 degree
+  int target;         // degree
+  unsigned char pwm;  // soft_pwm, 0-127
+} thermal_sample_t;
+
+#define THERMAL_HEATERS (EXTRUDERS + 1) // hotends, then the bed
+static thermal_sample_t thermal_history[THERMAL_HISTORY_SIZE][THERMAL_HEATERS];
+static uint8_t thermal_history_head = 0;   // next sample to write
+static uint8_t thermal_history_count = 0;
+static unsigned int thermal_history_ms = THERMAL_HISTORY_MS;
+static unsigned long thermal_history_last = 0;
+
+static void thermal_history_record()
+{
+  if(millis() - thermal_history_last < thermal_history_ms)
+    return;
+  thermal_history_last = millis();
+  thermal_sample_t *sample = thermal_history[thermal_history_head];
+  for(uint8_t e = 0; e < EXTRUDERS; e++) {
+    sample[e].temp = current_temperature[e] * 10;
+    sample[e].target = target_temperature[e];
+    sample[e].pwm = soft_pwm[e];
+  }
+  sample[EXTRUDERS].temp = current_temperature_bed * 10;
+  sample[EXTRUDERS].target = target_temperature_bed;
+  sample[EXTRUDERS].pwm = soft_pwm_bed;
+  thermal_history_head = (thermal_history_head + 1) % THERMAL_HISTORY_SIZE;
+  if(thermal_history_count < THERMAL_HISTORY_SIZE)
+    thermal_history_count++;
+}
+#endif //THERMAL_HISTORY
+
+#ifdef HEATER_DUTY_STATS
+// Summed soft_pwm of every heater once per soft PWM period, and the periods spent at the power limit;
+// hotends, then the bed. Only the ISR writes them, the rest reads or clears them with interrupts off.
+#define DUTY_HEATERS (EXTRUDERS + 1)
+static unsigned long duty_sum[DUTY_HEATERS];
+static unsigned long duty_full[DUTY_HEATERS];
+static unsigned long duty_periods = 0;
+static unsigned long duty_start_ms = 0;
+
+FORCE_INLINE void heater_duty_count()
+{
+  for(uint8_t e = 0; e < EXTRUDERS; e++) {
+    duty_sum[e] += soft_pwm[e];
+    if(soft_pwm[e] >= (PID_MAX >> 1)) duty_full[e]++;
+  }
+  duty_sum[EXTRUDERS] += soft_pwm_bed;
+  if(soft_pwm_bed >= (MAX_BED_POWER >> 1)) duty_full[EXTRUDERS]++;
+  duty_periods++;
+}
+#endif //HEATER_DUTY_STATS
+
 #ifdef WATCH_TEMP_PERIOD
 int watch_start_temp[EXTRUDERS] = ARRAY_BY_EXTRUDERS(0,0,0);
 unsigned long watchmillis[EXTRUDERS] = ARRAY_BY_EXTRUDERS(0,0,0);
@@ -162,162 +291,301 @@ unsigned long watchmillis[EXTRUDERS] = ARRAY_BY_EXTRUDERS(0,0,0);
 //=============================   functions      ============================
 //===========================================================================
 
-void PID_autotune(float temp, int extruder, int ncycles)
+#ifdef BED_SLOW_PWM
+// Time proportioning of the bed: on for (soft_pwm_bed + 1) / 128 of each period, like the soft PWM
+static void bed_slow_pwm()
 {
-  float input = 0.0;
-  int cycles=0;
-  bool heating = true;
-
-  unsigned long temp_millis = millis();
-  unsigned long t1=temp_millis;
-  unsigned long t2=temp_millis;
-  long t_high = 0;
-  long t_low = 0;
-
+  unsigned long ms = millis() - bed_pwm_cycle_start;
+  if(ms >= BED_SLOW_PWM_PERIOD) {
+    bed_pwm_cycle_start = millis();
+    ms = 0;
+  }
+  if(soft_pwm_bed > 0 && ms < (soft_pwm_bed + 1UL) * BED_SLOW_PWM_PERIOD / 128)
+    WRITE(HEATER_BED_PIN,1);
+  else
+    WRITE(HEATER_BED_PIN,0);
+}
+#endif //BED_SLOW_PWM
+
+// Relay autotune state of one heater, extruder -1 is the bed
+#define AUTOTUNE_SAMPLES 3 // Ku/Tu of the last cycles kept for the result and its spread
+typedef struct {
+  int extruder;
+  float temp;
+  bool heating;
+  bool done;
+  unsigned long t1, t2;
+  long t_high, t_low;
   long bias, d;
-  float Ku, Tu;
-  float Kp, Ki, Kd;
-  float max = 0, min = 10000;
+  float max, min;
+  int cycles;
+  float Ku[AUTOTUNE_SAMPLES], Tu[AUTOTUNE_SAMPLES];
+  uint8_t samples; // Ku/Tu measured so far
+} autotune_t;
 
-  if ((extruder > EXTRUDERS)
-  #if (TEMP_BED_PIN <= -1)
-       ||(extruder < 0)
-  #endif
-       ){
-          SERIAL_ECHOLN("PID Autotune failed. Bad extruder number.");
-          return;
-        }
-	
-  SERIAL_ECHOLN("PID Autotune start");
-  
-  disable_heater(); // switch off all heaters.
+static void autotune_output(autotune_t *a, long power)
+{
+  if (a->extruder<0)
+    soft_pwm_bed = power;
+  else
+    soft_pwm[a->extruder] = power;
+}
 
-  if (extruder<0)
-  {
-     soft_pwm_bed = (MAX_BED_POWER)/2;
-     bias = d = (MAX_BED_POWER)/2;
-   }
-   else
-   {
-     soft_pwm[extruder] = (PID_MAX)/2;
-     bias = d = (PID_MAX)/2;
+static void autotune_name(autotune_t *a)
+{
+  if (a->extruder<0)
+    SERIAL_PROTOCOLPGM(" B");
+  else {
+    SERIAL_PROTOCOLPGM(" T");
+    SERIAL_PROTOCOL(a->extruder);
   }
+}
 
+// Spread of the last Ku or Tu measurements, (max - min) / mean in percent; their mean goes to *mean
+static float autotune_spread(const float *values, uint8_t count, float *mean)
+{
+  float lo = values[0], hi = values[0], sum = 0;
+  for(uint8_t i = 0; i < count; i++) {
+    lo = min(lo, values[i]);
+    hi = max(hi, values[i]);
+    sum += values[i];
+  }
+  *mean = sum / count;
+  return *mean > 0 ? (hi - lo) * 100.0 / *mean : 100.0;
+}
 
+static void autotune_start(autotune_t *a, int extruder, float temp)
+{
+  a->extruder = extruder;
+  a->temp = temp;
+  a->heating = true;
+  a->done = false;
+  a->t1 = a->t2 = millis();
+  a->t_high = a->t_low = 0;
+  a->bias = a->d = (extruder<0?(MAX_BED_POWER):(PID_MAX))/2;
+  a->max = 0;
+  a->min = 10000;
+  a->cycles = 0;
+  a->samples = 0;
+  autotune_output(a, a->bias);
+}
 
+// Report Ku and Tu as the mean of the last cycles with their spread, and the gains from them
+static void autotune_result(autotune_t *a)
+{
+  if (a->samples == 0) {
+    autotune_name(a);
+    SERIAL_PROTOCOLLNPGM(" no oscillation measured");
+    return;
+  }
+  uint8_t count = min(a->samples, AUTOTUNE_SAMPLES);
+  float Ku, Tu;
+  float Ku_spread = autotune_spread(a->Ku, count, &Ku);
+  float Tu_spread = autotune_spread(a->Tu, count, &Tu);
+  autotune_name(a);
+  SERIAL_PROTOCOLPGM(" Ku: "); SERIAL_PROTOCOL(Ku);
+  SERIAL_PROTOCOLPGM(" Tu: "); SERIAL_PROTOCOL(Tu);
+  SERIAL_PROTOCOLPGM(" spread Ku: "); SERIAL_PROTOCOL(Ku_spread);
+  SERIAL_PROTOCOLPGM("% Tu: "); SERIAL_PROTOCOL(Tu_spread);
+  SERIAL_PROTOCOLPGM("% over "); SERIAL_PROTOCOL((int)count);
+  SERIAL_PROTOCOLPGM(" of "); SERIAL_PROTOCOL(a->cycles);
+  SERIAL_PROTOCOLLNPGM(" cycles");
+  float Kp = 0.6*Ku;
+  SERIAL_PROTOCOLLNPGM(" Classic PID ");
+  SERIAL_PROTOCOLPGM(" Kp: "); SERIAL_PROTOCOLLN(Kp);
+  SERIAL_PROTOCOLPGM(" Ki: "); SERIAL_PROTOCOLLN(2*Kp/Tu);
+  SERIAL_PROTOCOLPGM(" Kd: "); SERIAL_PROTOCOLLN(Kp*Tu/8);
+}
 
- for(;;) {
+// Take a new reading of the heater: switch the relay at the target and adjust bias and swing after each cycle
+static void autotune_update(autotune_t *a, float input, int ncycles)
+{
+  long power_max = (a->extruder<0?(MAX_BED_POWER):(PID_MAX));
+  a->max=max(a->max,input);
+  a->min=min(a->min,input);
+  if(a->heating == true && input > a->temp) {
+    if(millis() - a->t2 > 5000) {
+      a->heating=false;
+      autotune_output(a, (a->bias - a->d) >> 1);
+      a->t1=millis();
+      a->t_high=a->t1 - a->t2;
+      a->max=a->temp;
+    }
+  }
+  if(a->heating == false && input < a->temp) {
+    if(millis() - a->t1 > 5000) {
+      a->heating=true;
+      a->t2=millis();
+      a->t_low=a->t2 - a->t1;
+      if(a->cycles > 0) {
+        a->bias += (a->d*(a->t_high - a->t_low))/(a->t_low + a->t_high);
+        a->bias = constrain(a->bias, 20 ,power_max-20);
+        if(a->bias > power_max/2) a->d = power_max - 1 - a->bias;
+        else a->d = a->bias;
+
+        autotune_name(a);
+        SERIAL_PROTOCOLPGM(" bias: "); SERIAL_PROTOCOL(a->bias);
+        SERIAL_PROTOCOLPGM(" d: "); SERIAL_PROTOCOL(a->d);
+        SERIAL_PROTOCOLPGM(" min: "); SERIAL_PROTOCOL(a->min);
+        SERIAL_PROTOCOLPGM(" max: "); SERIAL_PROTOCOL(a->max);
+        if(a->cycles > 2) {
+          uint8_t i = a->samples % AUTOTUNE_SAMPLES;
+          a->Ku[i] = (4.0*a->d)/(3.14159*(a->max-a->min)/2.0);
+          a->Tu[i] = ((float)(a->t_low + a->t_high)/1000.0);
+          a->samples++;
+          SERIAL_PROTOCOLPGM(" Ku: "); SERIAL_PROTOCOL(a->Ku[i]);
+          SERIAL_PROTOCOLPGM(" Tu: "); SERIAL_PROTOCOL(a->Tu[i]);
+        }
+        SERIAL_PROTOCOLLNPGM("");
+      }
+      autotune_output(a, (a->bias + a->d) >> 1);
+      a->cycles++;
+      a->min=a->temp;
+      #ifdef PID_AUTOTUNE_CONVERGENCE
+      if(a->samples >= 2) {
+        // the last two cycles agree: the oscillation has settled
+        uint8_t last = (a->samples - 1) % AUTOTUNE_SAMPLES, before = (a->samples - 2) % AUTOTUNE_SAMPLES;
+        float pair[2], mean;
+        pair[0] = a->Ku[last]; pair[1] = a->Ku[before];
+        bool settled = autotune_spread(pair, 2, &mean) <= PID_AUTOTUNE_CONVERGENCE;
+        pair[0] = a->Tu[last]; pair[1] = a->Tu[before];
+        if(settled && autotune_spread(pair, 2, &mean) <= PID_AUTOTUNE_CONVERGENCE)
+          a->done = true;
+      }
+      #endif
+      if(a->cycles > ncycles)
+        a->done = true;
+      if(a->done) {
+        autotune_output(a, 0);
+        autotune_result(a);
+      }
+    }
+  }
+}
 
+// Relay autotune of count heaters at once, each until it settled or ran ncycles cycles
+static void autotune_run(autotune_t *tunes, uint8_t count, int ncycles)
+{
+  unsigned long temp_millis = millis();
+  for(;;) {
+    bool done = true;
     if(temp_meas_ready == true) { // temp sample ready
       updateTemperaturesFromRawValues();
-
-      input = (extruder<0)?current_temperature_bed:current_temperature[extruder];
-
-      max=max(max,input);
-      min=min(min,input);
-      if(heating == true && input > temp) {
-        if(millis() - t2 > 5000) { 
-          heating=false;
-          if (extruder<0)
-            soft_pwm_bed = (bias - d) >> 1;
-          else
-            soft_pwm[extruder] = (bias - d) >> 1;
-          t1=millis();
-          t_high=t1 - t2;
-          max=temp;
+      for(uint8_t i = 0; i < count; i++) {
+        autotune_t *a = &tunes[i];
+        if(a->done)
+          continue;
+        float input = (a->extruder<0)?current_temperature_bed:current_temperature[a->extruder];
+        if(input > (a->temp + 20)) {
+          disable_heater();
+          autotune_name(a);
+          SERIAL_PROTOCOLLNPGM(" PID Autotune failed! Temperature too high");
+          return;
         }
-      }
-      if(heating == false && input < temp) {
-        if(millis() - t1 > 5000) {
-          heating=true;
-          t2=millis();
-          t_low=t2 - t1;
-          if(cycles > 0) {
-            bias += (d*(t_high - t_low))/(t_low + t_high);
-            bias = constrain(bias, 20 ,(extruder<0?(MAX_BED_POWER):(PID_MAX))-20);
-            if(bias > (extruder<0?(MAX_BED_POWER):(PID_MAX))/2) d = (extruder<0?(MAX_BED_POWER):(PID_MAX)) - 1 - bias;
-            else d = bias;
-
-            SERIAL_PROTOCOLPGM(" bias: "); SERIAL_PROTOCOL(bias);
-            SERIAL_PROTOCOLPGM(" d: "); SERIAL_PROTOCOL(d);
-            SERIAL_PROTOCOLPGM(" min: "); SERIAL_PROTOCOL(min);
-            SERIAL_PROTOCOLPGM(" max: "); SERIAL_PROTOCOLLN(max);
-            if(cycles > 2) {
-              Ku = (4.0*d)/(3.14159*(max-min)/2.0);
-              Tu = ((float)(t_low + t_high)/1000.0);
-              SERIAL_PROTOCOLPGM(" Ku: "); SERIAL_PROTOCOL(Ku);
-              SERIAL_PROTOCOLPGM(" Tu: "); SERIAL_PROTOCOLLN(Tu);
-              Kp = 0.6*Ku;
-              Ki = 2*Kp/Tu;
-              Kd = Kp*Tu/8;
-              SERIAL_PROTOCOLLNPGM(" Classic PID ");
-              SERIAL_PROTOCOLPGM(" Kp: "); SERIAL_PROTOCOLLN(Kp);
-              SERIAL_PROTOCOLPGM(" Ki: "); SERIAL_PROTOCOLLN(Ki);
-              SERIAL_PROTOCOLPGM(" Kd: "); SERIAL_PROTOCOLLN(Kd);
-              /*
-              Kp = 0.33*Ku;
-              Ki = Kp/Tu;
-              Kd = Kp*Tu/3;
-              SERIAL_PROTOCOLLNPGM(" Some overshoot ")
-              SERIAL_PROTOCOLPGM(" Kp: "); SERIAL_PROTOCOLLN(Kp);
-              SERIAL_PROTOCOLPGM(" Ki: "); SERIAL_PROTOCOLLN(Ki);
-              SERIAL_PROTOCOLPGM(" Kd: "); SERIAL_PROTOCOLLN(Kd);
-              Kp = 0.2*Ku;
-              Ki = 2*Kp/Tu;
-              Kd = Kp*Tu/3;
-              SERIAL_PROTOCOLLNPGM(" No overshoot ")
-              SERIAL_PROTOCOLPGM(" Kp: "); SERIAL_PROTOCOLLN(Kp);
-              SERIAL_PROTOCOLPGM(" Ki: "); SERIAL_PROTOCOLLN(Ki);
-              SERIAL_PROTOCOLPGM(" Kd: "); SERIAL_PROTOCOLLN(Kd);
-              */
-            }
-          }
-          if (extruder<0)
-            soft_pwm_bed = (bias + d) >> 1;
-          else
-            soft_pwm[extruder] = (bias + d) >> 1;
-          cycles++;
-          min=temp;
+        if(((millis() - a->t1) + (millis() - a->t2)) > (10L*60L*1000L*2L)) {
+          disable_heater();
+          autotune_name(a);
+          SERIAL_PROTOCOLLNPGM(" PID Autotune failed! timeout");
+          return;
         }
-      } 
+        autotune_update(a, input, ncycles);
+      }
     }
-    if(input > (temp + 20)) {
-      SERIAL_PROTOCOLLNPGM("PID Autotune failed! Temperature too high");
+    #ifdef BED_SLOW_PWM
+    bed_slow_pwm();
+    #endif
+    for(uint8_t i = 0; i < count; i++)
+      done = done && tunes[i].done;
+    if(done) {
+      SERIAL_PROTOCOLLNPGM("PID Autotune finished! Put the last Kp, Ki and Kd constants from above into Configuration.h");
       return;
     }
     if(millis() - temp_millis > 2000) {
-      int p;
-      if (extruder<0){
-        p=soft_pwm_bed;       
-        SERIAL_PROTOCOLPGM("ok B:");
-      }else{
-        p=soft_pwm[extruder];       
-        SERIAL_PROTOCOLPGM("ok T:");
+      SERIAL_PROTOCOLPGM("ok");
+      for(uint8_t i = 0; i < count; i++) {
+        autotune_t *a = &tunes[i];
+        if (a->extruder<0){
+          SERIAL_PROTOCOLPGM(" B:");
+          SERIAL_PROTOCOL(current_temperature_bed);
+          SERIAL_PROTOCOLPGM(" @:");
+          SERIAL_PROTOCOL((int)soft_pwm_bed);
+        }else{
+          SERIAL_PROTOCOLPGM(" T");
+          if(count > 1)
+            SERIAL_PROTOCOL(a->extruder);
+          SERIAL_PROTOCOLPGM(":");
+          SERIAL_PROTOCOL(current_temperature[a->extruder]);
+          SERIAL_PROTOCOLPGM(" @");
+          if(count > 1)
+            SERIAL_PROTOCOL(a->extruder);
+          SERIAL_PROTOCOLPGM(":");
+          SERIAL_PROTOCOL((int)soft_pwm[a->extruder]);
+        }
       }
-			
-      SERIAL_PROTOCOL(input);   
-      SERIAL_PROTOCOLPGM(" @:");
-      SERIAL_PROTOCOLLN(p);       
-
+      SERIAL_PROTOCOLLNPGM("");
       temp_millis = millis();
     }
-    if(((millis() - t1) + (millis() - t2)) > (10L*60L*1000L*2L)) {
-      SERIAL_PROTOCOLLNPGM("PID Autotune failed! timeout");
-      return;
-    }
-    if(cycles > ncycles) {
-      SERIAL_PROTOCOLLNPGM("PID Autotune finished! Put the last Kp, Ki and Kd constants from above into Configuration.h");
-      return;
-    }
     lcd_update();
   }
 }
 
+void PID_autotune(float temp, int extruder, int ncycles)
+{
+  autotune_t tune;
+
+  if ((extruder >= EXTRUDERS)
+  #if (TEMP_BED_PIN <= -1)
+       ||(extruder < 0)
+  #endif
+       ){
+          SERIAL_ECHOLN("PID Autotune failed. Bad extruder number.");
+          return;
+        }
+
+  SERIAL_ECHOLN("PID Autotune start");
+
+  disable_heater(); // switch off all heaters.
+  autotune_start(&tune, extruder, temp);
+  autotune_run(&tune, 1, ncycles);
+}
+
+#ifdef PID_AUTOTUNE_CONVERGENCE
+void PID_autotune_all(float temp, float bed_temp, int ncycles)
+{
+  autotune_t tunes[EXTRUDERS + 1];
+  uint8_t count = 0;
+
+  SERIAL_ECHOLN("PID Autotune start");
+
+  disable_heater(); // switch off all heaters.
+  for(int e = 0; e < EXTRUDERS; e++)
+    autotune_start(&tunes[count++], e, temp);
+  #if TEMP_BED_PIN > -1
+  if(bed_temp > 0)
+    autotune_start(&tunes[count++], -1, bed_temp);
+  #endif
+  autotune_run(tunes, count, ncycles);
+}
+#endif
+
 void updatePID()
 {
 #ifdef PIDTEMP
+  #ifdef PID_FIXED_POINT
+    Kp_fp = Kp * PID_FP_ONE;
+    Ki_fp = Ki * 65536.0;
+    Kd_fp = Kd * (1.0-K1) * PID_FP_ONE;
+    Kp_fp_lim = Kp_fp > 0 ? 0x7FFFFFFFL / Kp_fp : 0x7FFFFFFFL;
+    Kd_fp_lim = Kd_fp > 0 ? 0x7FFFFFFFL / Kd_fp : 0x7FFFFFFFL;
+    // Ki * iState never exceeds PID_INTEGRAL_DRIVE_MAX, so with iState taken in 1/64 degree
+    // the iTerm product stays below PID_INTEGRAL_DRIVE_MAX * 2^22
+    float iState_max = Ki > 0 ? PID_INTEGRAL_DRIVE_MAX / Ki * PID_FP_ONE : 0x40000000L;
+    if (iState_max > 0x40000000L) iState_max = 0x40000000L;
+  #else
+    float iState_max = PID_INTEGRAL_DRIVE_MAX / Ki;
+  #endif
   for(int e = 0; e < EXTRUDERS; e++) { 
-     temp_iState_max[e] = PID_INTEGRAL_DRIVE_MAX / Ki;  
+     temp_iState_max[e] = iState_max;
   }
 #endif
 #ifdef PIDTEMPBED
@@ -325,12 +593,243 @@ void updatePID()
 #endif
 }
   
+#ifdef THERMAL_HISTORY
+void thermal_history_report()
+{
+  SERIAL_ECHO_START;
+  SERIAL_ECHOPGM("Thermal history samples:");
+  SERIAL_ECHO((int)thermal_history_count);
+  SERIAL_ECHOPGM(" every ms:");
+  SERIAL_ECHOLN(thermal_history_ms);
+  if(thermal_history_count == 0)
+    return;
+  for(uint8_t h = 0; h < THERMAL_HEATERS; h++) {
+    int temp_min = 32767, temp_max = -32768;
+    unsigned char pwm_min = 255, pwm_max = 0;
+    long temp_sum = 0, pwm_sum = 0;
+    for(uint8_t i = 0; i < thermal_history_count; i++) {
+      thermal_sample_t *s = &thermal_history[i][h];
+      if(s->temp < temp_min) temp_min = s->temp;
+      if(s->temp > temp_max) temp_max = s->temp;
+      if(s->pwm < pwm_min) pwm_min = s->pwm;
+      if(s->pwm > pwm_max) pwm_max = s->pwm;
+      temp_sum += s->temp;
+      pwm_sum += s->pwm;
+    }
+    SERIAL_ECHO_START;
+    if(h == EXTRUDERS)
+      SERIAL_ECHOPGM("B");
+    else {
+      SERIAL_ECHOPGM("T");
+      SERIAL_ECHO((int)h);
+    }
+    SERIAL_ECHOPGM(" temp min:");
+    SERIAL_ECHO(temp_min / 10.0);
+    SERIAL_ECHOPGM(" max:");
+    SERIAL_ECHO(temp_max / 10.0);
+    SERIAL_ECHOPGM(" mean:");
+    SERIAL_ECHO(temp_sum / 10.0 / thermal_history_count);
+    SERIAL_ECHOPGM(" pwm min:");
+    SERIAL_ECHO((int)pwm_min);
+    SERIAL_ECHOPGM(" max:");
+    SERIAL_ECHO((int)pwm_max);
+    SERIAL_ECHOPGM(" mean:");
+    SERIAL_ECHOLN((float)pwm_sum / thermal_history_count);
+  }
+}
+
+// Text header "thermal_history:<samples>,<heaters>,<interval ms>", then samples*heaters records
+// of thermal_sample_t (little endian), oldest first, then a newline
+void thermal_history_dump()
+{
+  SERIAL_PROTOCOLPGM("thermal_history:");
+  SERIAL_PROTOCOL((int)thermal_history_count);
+  SERIAL_PROTOCOLPGM(",");
+  SERIAL_PROTOCOL((int)THERMAL_HEATERS);
+  SERIAL_PROTOCOLPGM(",");
+  SERIAL_PROTOCOLLN(thermal_history_ms);
+  uint8_t i = (thermal_history_head + THERMAL_HISTORY_SIZE - thermal_history_count) % THERMAL_HISTORY_SIZE;
+  for(uint8_t n = 0; n < thermal_history_count; n++) {
+    const uint8_t *p = (const uint8_t *)thermal_history[i];
+    for(uint8_t b = 0; b < sizeof(thermal_history[0]); b++)
+      MYSERIAL.write(p[b]);
+    i = (i + 1) % THERMAL_HISTORY_SIZE;
+  }
+  SERIAL_PROTOCOLLN("");
+}
+
+void thermal_history_set_interval(unsigned int ms)
+{
+  thermal_history_ms = ms;
+  thermal_history_head = thermal_history_count = 0;
+  thermal_history_last = millis() - ms; // sample at the next manage_heater()
+}
+#endif //THERMAL_HISTORY
+
+#ifdef HEATER_DUTY_STATS
+void heater_duty_reset()
+{
+  CRITICAL_SECTION_START;
+  for(uint8_t h = 0; h < DUTY_HEATERS; h++)
+    duty_sum[h] = duty_full[h] = 0;
+  duty_periods = 0;
+  CRITICAL_SECTION_END;
+  duty_start_ms = millis();
+}
+
+// Mean power in percent, time at the power limit in percent and, with the wattage set, the energy
+static void heater_duty_print(unsigned long sum, unsigned long full, unsigned long periods, float hours, float watts)
+{
+  float duty = periods ? (float)sum / (127.0 * periods) : 0;
+  SERIAL_ECHO(duty * 100);
+  SERIAL_ECHOPGM("% full:");
+  SERIAL_ECHO(periods ? 100.0 * full / periods : 0);
+  SERIAL_ECHOPGM("%");
+  if(watts > 0) {
+    SERIAL_ECHOPGM(" ");
+    SERIAL_ECHO(watts * duty * hours);
+    SERIAL_ECHOPGM("Wh");
+  }
+}
+
+void heater_duty_report()
+{
+  unsigned long sum[DUTY_HEATERS], full[DUTY_HEATERS], periods;
+  CRITICAL_SECTION_START;
+  for(uint8_t h = 0; h < DUTY_HEATERS; h++) {
+    sum[h] = duty_sum[h];
+    full[h] = duty_full[h];
+  }
+  periods = duty_periods;
+  CRITICAL_SECTION_END;
+  unsigned long seconds = (millis() - duty_start_ms) / 1000;
+  float hours = seconds / 3600.0;
+
+  SERIAL_ECHO_START;
+  SERIAL_ECHOPGM("Heater duty");
+  for(uint8_t e = 0; e < EXTRUDERS; e++) {
+    SERIAL_ECHOPGM(" T");
+    SERIAL_ECHO((int)e);
+    SERIAL_ECHOPGM(":");
+    #ifdef EXTRUDER_WATTS
+      heater_duty_print(sum[e], full[e], periods, hours, EXTRUDER_WATTS);
+    #else
+      heater_duty_print(sum[e], full[e], periods, hours, 0);
+    #endif
+  }
+  #if defined(HEATER_BED_PIN) && HEATER_BED_PIN > -1
+    SERIAL_ECHOPGM(" B:");
+    #ifdef BED_WATTS
+      heater_duty_print(sum[EXTRUDERS], full[EXTRUDERS], periods, hours, BED_WATTS);
+    #else
+      heater_duty_print(sum[EXTRUDERS], full[EXTRUDERS], periods, hours, 0);
+    #endif
+  #endif
+  SERIAL_ECHOPGM(" time:");
+  SERIAL_ECHO(seconds);
+  SERIAL_ECHOLNPGM("s");
+}
+#endif //HEATER_DUTY_STATS
+
 int getHeaterPower(int heater) {
 	if (heater<0)
 		return soft_pwm_bed;
   return soft_pwm[heater];
 }
 
+#ifdef TEMP_REPORT_CACHE
+#define TEMP_REPORT_SIZE (18 * (EXTRUDERS + 2) + 24)
+static char temp_report_line[TEMP_REPORT_SIZE];
+static bool temp_report_stale = true; // set by each temperature reading
+static uint8_t temp_report_extruder;
+static int temp_report_targets[EXTRUDERS + 1]; // the targets in the line, the bed last
+
+// Append n, or n tenths with one decimal
+static char *temp_report_number(char *p, long n, bool tenths)
+{
+  char digits[10];
+  uint8_t i = 0;
+  if(n < 0) {
+    *p++ = '-';
+    n = -n;
+  }
+  do {
+    digits[i++] = '0' + n % 10;
+    n /= 10;
+  } while(n || (tenths && i < 2));
+  while(i) {
+    *p++ = digits[--i];
+    if(tenths && i == 1)
+      *p++ = '.';
+  }
+  return p;
+}
+
+static char *temp_report_text(char *p, const char *pstr)
+{
+  strcpy_P(p, pstr);
+  return p + strlen(p);
+}
+
+// ":<current> /<target>", as SERIAL_PROTOCOL_F(x,1) would print them
+static char *temp_report_heater(char *p, float current, int target)
+{
+  *p++ = ':';
+  p = temp_report_number(p, lround(current * 10), true);
+  p = temp_report_text(p, PSTR(" /"));
+  return temp_report_number(p, target * 10L, true);
+}
+
+const char *temp_report(uint8_t extruder)
+{
+  bool stale = temp_report_stale || extruder != temp_report_extruder;
+  for(uint8_t e = 0; e < EXTRUDERS; e++)
+    if(target_temperature[e] != temp_report_targets[e])
+      stale = true;
+  if(target_temperature_bed != temp_report_targets[EXTRUDERS])
+    stale = true;
+  if(!stale)
+    return temp_report_line;
+
+  char *p = temp_report_line;
+  #if defined(TEMP_0_PIN) && TEMP_0_PIN > -1
+    p = temp_report_text(p, PSTR(" T"));
+    p = temp_report_heater(p, current_temperature[extruder], target_temperature[extruder]);
+    #if defined(TEMP_BED_PIN) && TEMP_BED_PIN > -1
+      p = temp_report_text(p, PSTR(" B"));
+      p = temp_report_heater(p, current_temperature_bed, target_temperature_bed);
+    #endif
+    for(uint8_t e = 0; e < EXTRUDERS; e++) {
+      p = temp_report_text(p, PSTR(" T"));
+      *p++ = '0' + e;
+      p = temp_report_heater(p, current_temperature[e], target_temperature[e]);
+    }
+  #endif
+  p = temp_report_text(p, PSTR(" @:"));
+  #ifdef EXTRUDER_WATTS
+    p = temp_report_number(p, (EXTRUDER_WATTS * getHeaterPower(extruder))/127, false);
+    *p++ = 'W';
+  #else
+    p = temp_report_number(p, getHeaterPower(extruder), false);
+  #endif
+  p = temp_report_text(p, PSTR(" B@:"));
+  #ifdef BED_WATTS
+    p = temp_report_number(p, (BED_WATTS * getHeaterPower(-1))/127, false);
+    *p++ = 'W';
+  #else
+    p = temp_report_number(p, getHeaterPower(-1), false);
+  #endif
+  *p = 0;
+
+  for(uint8_t e = 0; e < EXTRUDERS; e++)
+    temp_report_targets[e] = target_temperature[e];
+  temp_report_targets[EXTRUDERS] = target_temperature_bed;
+  temp_report_extruder = extruder;
+  temp_report_stale = false;
+  return temp_report_line;
+}
+#endif
+
 #if (defined(EXTRUDER_0_AUTO_FAN_PIN) && EXTRUDER_0_AUTO_FAN_PIN > -1) || \
     (defined(EXTRUDER_1_AUTO_FAN_PIN) && EXTRUDER_1_AUTO_FAN_PIN > -1) || \
     (defined(EXTRUDER_2_AUTO_FAN_PIN) && EXTRUDER_2_AUTO_FAN_PIN > -1)
@@ -403,15 +902,68 @@ void checkExtruderAutoFans()
 
 #endif // any extruder auto fan pins set
 
+#ifdef PID_BOOST_HEATUP
+// Whether hotend e heats at full power: from when it is more than PID_FUNCTIONAL_RANGE below its
+// target until the rise it makes in PID_BOOST_LAG at its present rate would take it there
+static bool pid_boost_bang(uint8_t e, float temp)
+{
+  unsigned long ms = millis();
+  float dt = (ms - boost_last_ms[e]) * 0.001;
+  if(dt > 0)
+    boost_rate[e] += ((temp - boost_last_temp[e]) / dt - boost_rate[e]) * 0.25;
+  boost_last_ms[e] = ms;
+  boost_last_temp[e] = temp;
+
+  float error = target_temperature[e] - temp;
+  if(error > PID_FUNCTIONAL_RANGE)
+    boosting[e] = true;
+  if(boosting[e] && target_temperature[e] && error > boost_rate[e] * PID_BOOST_LAG)
+    return true;
+  boosting[e] = false;
+  return false;
+}
+
+// The integral the PID of hotend e starts with after heating up: the output that holds the target
+static pidval_t pid_boost_preload(uint8_t e)
+{
+  if(Ki <= 0)
+    return 0;
+  float out = constrain(boost_hold[e] * (target_temperature[e] - 25), 0, PID_MAX);
+  #ifdef PID_FIXED_POINT
+  pidval_t i = out / Ki * PID_FP_ONE;
+  #else
+  pidval_t i = out / Ki;
+  #endif
+  return constrain(i, temp_iState_min[e], temp_iState_max[e]);
+}
+
+// While hotend e holds its target, the integral is the output that does it
+static void pid_boost_learn(uint8_t e, float temp, float iterm)
+{
+  if(target_temperature[e] < 50 || fabs(target_temperature[e] - temp) > 1)
+    return;
+  boost_hold[e] += (iterm / (target_temperature[e] - 25) - boost_hold[e]) * (1.0 / 64);
+}
+#define PID_BOOST_PRELOAD(e) pid_boost_preload(e)
+#else
+#define PID_BOOST_PRELOAD(e) 0
+#endif
+
 void manage_heater()
 {
   float pid_input;
   float pid_output;
 
+  #ifdef LOOP_LATENCY_MONITOR
+  latency_heater();
+  #endif
   if(temp_meas_ready != true)   //better readability
     return; 
 
   updateTemperaturesFromRawValues();
+  #ifdef THERMAL_HISTORY
+  thermal_history_record();
+  #endif
 
   for(int e = 0; e < EXTRUDERS; e++) 
   {
@@ -420,8 +972,54 @@ void manage_heater()
     pid_input = current_temperature[e];
 
     #ifndef PID_OPENLOOP
+      #ifdef PID_FIXED_POINT
+        long pid_input_fp = pid_input * PID_FP_ONE;
+        pid_error[e] = ((long)target_temperature[e] << PID_FP_SHIFT) - pid_input_fp;
+        #ifdef PID_BOOST_HEATUP
+        if(pid_boost_bang(e, pid_input)) {
+        #else
+        if(pid_error[e] > PID_FUNCTIONAL_RANGE * PID_FP_ONE) {
+        #endif
+          pid_output = BANG_MAX;
+          pid_reset[e] = true;
+        }
+        else if(pid_error[e] < -PID_FUNCTIONAL_RANGE * PID_FP_ONE || target_temperature[e] == 0) {
+          pid_output = 0;
+          pid_reset[e] = true;
+        }
+        else {
+          if(pid_reset[e] == true) {
+            temp_iState[e] = PID_BOOST_PRELOAD(e);
+            pid_reset[e] = false;
+          }
+          // Operands are clamped so the 32 bit products cannot wrap; a clamped term
+          // is far outside 0..PID_MAX and saturates the output just as the float one would
+          pTerm[e] = (Kp_fp * constrain(pid_error[e], -Kp_fp_lim, Kp_fp_lim)) >> PID_FP_SHIFT;
+          temp_iState[e] += pid_error[e];
+          temp_iState[e] = constrain(temp_iState[e], temp_iState_min[e], temp_iState_max[e]);
+          iTerm[e] = (Ki_fp * (temp_iState[e] >> 2)) >> 14;
+          #ifdef PID_BOOST_HEATUP
+          pid_boost_learn(e, pid_input, PID_FP_TO_FLOAT(iTerm[e]));
+          #endif
+
+          //K1 defined in Configuration.h in the PID settings
+          long dInput = constrain(pid_input_fp - temp_dState[e], -Kd_fp_lim, Kd_fp_lim);
+          dTerm[e] = ((Kd_fp * dInput) >> PID_FP_SHIFT) + ((PID_FP_K1 * dTerm[e]) >> 12);
+          dTerm[e] = constrain(dTerm[e], -PID_FP_DTERM_MAX, PID_FP_DTERM_MAX);
+          long pid_out_fp = pTerm[e] + iTerm[e] - dTerm[e];
+          #ifdef PID_EXTRUSION_FEEDFORWARD
+            pid_out_fp += (long)(Kc * plan_extrusion_rate(e, pid_feedforward_ms) * PID_FP_ONE);
+          #endif
+          pid_output = constrain(pid_out_fp, 0, (long)(PID_MAX) << PID_FP_SHIFT) >> PID_FP_SHIFT;
+        }
+        temp_dState[e] = pid_input_fp;
+      #else
         pid_error[e] = target_temperature[e] - pid_input;
+        #ifdef PID_BOOST_HEATUP
+        if(pid_boost_bang(e, pid_input)) {
+        #else
         if(pid_error[e] > PID_FUNCTIONAL_RANGE) {
+        #endif
           pid_output = BANG_MAX;
           pid_reset[e] = true;
         }
@@ -431,20 +1029,28 @@ void manage_heater()
         }
         else {
           if(pid_reset[e] == true) {
-            temp_iState[e] = 0.0;
+            temp_iState[e] = PID_BOOST_PRELOAD(e);
             pid_reset[e] = false;
           }
           pTerm[e] = Kp * pid_error[e];
           temp_iState[e] += pid_error[e];
           temp_iState[e] = constrain(temp_iState[e], temp_iState_min[e], temp_iState_max[e]);
           iTerm[e] = Ki * temp_iState[e];
+          #ifdef PID_BOOST_HEATUP
+          pid_boost_learn(e, pid_input, iTerm[e]);
+          #endif
 
           //K1 defined in Configuration.h in the PID settings
           #define K2 (1.0-K1)
           dTerm[e] = (Kd * (pid_input - temp_dState[e]))*K2 + (K1 * dTerm[e]);
-          pid_output = constrain(pTerm[e] + iTerm[e] - dTerm[e], 0, PID_MAX);
+          pid_output = pTerm[e] + iTerm[e] - dTerm[e];
+          #ifdef PID_EXTRUSION_FEEDFORWARD
+            pid_output += Kc * plan_extrusion_rate(e, pid_feedforward_ms);
+          #endif
+          pid_output = constrain(pid_output, 0, PID_MAX);
         }
         temp_dState[e] = pid_input;
+      #endif //PID_FIXED_POINT
     #else 
           pid_output = constrain(target_temperature[e], 0, PID_MAX);
     #endif //PID_OPENLOOP
@@ -457,11 +1063,11 @@ void manage_heater()
     SERIAL_ECHO(" Output ");
     SERIAL_ECHO(pid_output);
     SERIAL_ECHO(" pTerm ");
-    SERIAL_ECHO(pTerm[e]);
+    SERIAL_ECHO(PID_FP_TO_FLOAT(pTerm[e]));
     SERIAL_ECHO(" iTerm ");
-    SERIAL_ECHO(iTerm[e]);
+    SERIAL_ECHO(PID_FP_TO_FLOAT(iTerm[e]));
     SERIAL_ECHO(" dTerm ");
-    SERIAL_ECHOLN(dTerm[e]);  
+    SERIAL_ECHOLN(PID_FP_TO_FLOAT(dTerm[e]));  
     #endif //PID_DEBUG
   #else /* PID off */
     pid_output = 0;
@@ -493,21 +1099,33 @@ void manage_heater()
         }
     }
     #endif
-    #ifdef TEMP_SENSOR_1_AS_REDUNDANT
-      if(fabs(current_temperature[0] - redundant_temperature) > MAX_REDUNDANT_TEMP_SENSOR_DIFF) {
-        disable_heater();
-        if(IsStopped() == false) {
-          SERIAL_ERROR_START;
-          SERIAL_ERRORLNPGM("Extruder switched off. Temperature difference between temp sensors is too high !");
-          LCD_ALERTMESSAGEPGM("Err: REDUNDANT TEMP ERROR");
-        }
-        #ifndef BOGUS_TEMPERATURE_FAILSAFE_OVERRIDE
-          Stop();
+    #ifdef THERMAL_RUNAWAY_PROTECTION
+      thermal_runaway_check(e, (int)current_temperature[e], target_temperature[e],
+                            THERMAL_RUNAWAY_PERIOD * 1000UL, THERMAL_RUNAWAY_HYSTERESIS);
+    #endif
+    #if defined(REDUNDANT_SENSOR_0) || defined(REDUNDANT_SENSOR_1)
+      if(
+        #ifndef REDUNDANT_SENSOR_0
+          e != 0 &&
         #endif
-      }
+        #ifndef REDUNDANT_SENSOR_1
+          e != 1 &&
+        #endif
+          redundant_sensor_off(e))
+        redundant_sensor_error();
     #endif
   } // End extruder for loop
 
+  #ifdef REDUNDANT_SENSOR_BED
+    if(redundant_sensor_off(REDUNDANT_BED))
+      redundant_sensor_error();
+  #endif
+
+  #if defined(THERMAL_RUNAWAY_PROTECTION) && (TEMP_SENSOR_BED != 0)
+    thermal_runaway_check(RUNAWAY_BED, (int)current_temperature_bed, target_temperature_bed,
+                          THERMAL_RUNAWAY_BED_PERIOD * 1000UL, THERMAL_RUNAWAY_BED_HYSTERESIS);
+  #endif
+
   #if (defined(EXTRUDER_0_AUTO_FAN_PIN) && EXTRUDER_0_AUTO_FAN_PIN > -1) || \
       (defined(EXTRUDER_1_AUTO_FAN_PIN) && EXTRUDER_1_AUTO_FAN_PIN > -1) || \
       (defined(EXTRUDER_2_AUTO_FAN_PIN) && EXTRUDER_2_AUTO_FAN_PIN > -1)
@@ -518,10 +1136,18 @@ void manage_heater()
   }  
   #endif       
   
+  #ifdef BED_SLOW_PWM
+  bed_slow_pwm();
+  #endif
+
   #ifndef PIDTEMPBED
   if(millis() - previous_millis_bed_heater < BED_CHECK_INTERVAL)
     return;
   previous_millis_bed_heater = millis();
+  #elif defined(BED_PID_INTERVAL)
+  if(millis() - previous_millis_bed_heater < BED_PID_INTERVAL)
+    return;
+  previous_millis_bed_heater = millis();
   #endif
 
   #if TEMP_SENSOR_BED != 0
@@ -596,14 +1222,48 @@ void manage_heater()
 }
 
 #define PGM_RD_W(x)   (short)pgm_read_word(&x)
+
+// Interpolate raw in a PROGMEM table sorted by raw value. The binary search finds the same
+// entry the old linear scan did: the first one above raw, interpolating from the one before it.
+// Raw values past the end of the table give the last temperature.
+static float temptable_lookup(const short (*tt)[2], uint8_t len, int raw)
+{
+  uint8_t lo = 1, hi = len;
+  while (lo < hi)
+  {
+    uint8_t mid = (lo + hi) >> 1;
+    if (PGM_RD_W(tt[mid][0]) > raw)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  if (lo == len)
+    return PGM_RD_W(tt[len-1][1]);
+
+  short raw0 = PGM_RD_W(tt[lo-1][0]), temp0 = PGM_RD_W(tt[lo-1][1]);
+  return temp0 + (raw - raw0) *
+    (float)(PGM_RD_W(tt[lo][1]) - temp0) /
+    (float)(PGM_RD_W(tt[lo][0]) - raw0);
+}
+
+#ifdef CUSTOM_TEMPTABLE_LEN
+// The custom table has a temperature in 1/16 C every THERMISTOR_CUSTOM_ADC_STEP ADC counts, so raw
+// gives the entry to interpolate from without a search
+static float temptable_custom_lookup(int raw)
+{
+  const unsigned int step = THERMISTOR_CUSTOM_ADC_STEP * OVERSAMPLENR;
+  uint8_t i = (unsigned int)raw / step;
+  if (i >= CUSTOM_TEMPTABLE_LEN - 1)
+    return PGM_RD_W(temptable_1000[CUSTOM_TEMPTABLE_LEN - 1]) / 16.0;
+  short temp0 = PGM_RD_W(temptable_1000[i]);
+  return (temp0 + ((unsigned int)raw - i * step) * (float)(PGM_RD_W(temptable_1000[i + 1]) - temp0) / step) / 16.0;
+}
+#endif
+
 // Derived from RepRap FiveD extruder::getTemperature()
 // For hot end temperature measurement.
 static float analog2temp(int raw, uint8_t e) {
-#ifdef TEMP_SENSOR_1_AS_REDUNDANT
-  if(e > EXTRUDERS)
-#else
   if(e >= EXTRUDERS)
-#endif
   {
       SERIAL_ERROR_START;
       SERIAL_ERROR((int)e);
@@ -617,55 +1277,31 @@ static float analog2temp(int raw, uint8_t e) {
     }
   #endif
 
+  #ifdef CUSTOM_TEMPTABLE_LEN
+    if(heater_ttbl_map[e] == (void *)temptable_1000)
+      return temptable_custom_lookup(raw);
+  #endif
   if(heater_ttbl_map[e] != NULL)
   {
-    float celsius = 0;
-    uint8_t i;
-    short (*tt)[][2] = (short (*)[][2])(heater_ttbl_map[e]);
-
-    for (i=1; i<heater_ttbllen_map[e]; i++)
-    {
-      if (PGM_RD_W((*tt)[i][0]) > raw)
-      {
-        celsius = PGM_RD_W((*tt)[i-1][1]) + 
-          (raw - PGM_RD_W((*tt)[i-1][0])) * 
-          (float)(PGM_RD_W((*tt)[i][1]) - PGM_RD_W((*tt)[i-1][1])) /
-          (float)(PGM_RD_W((*tt)[i][0]) - PGM_RD_W((*tt)[i-1][0]));
-        break;
-      }
-    }
-
-    // Overflow: Set to last value in the table
-    if (i == heater_ttbllen_map[e]) celsius = PGM_RD_W((*tt)[i-1][1]);
-
-    return celsius;
+    return temptable_lookup((const short (*)[2])heater_ttbl_map[e], heater_ttbllen_map[e], raw);
   }
   return ((raw * ((5.0 * 100.0) / 1024.0) / OVERSAMPLENR) * TEMP_SENSOR_AD595_GAIN) + TEMP_SENSOR_AD595_OFFSET;
 }
 
+#ifdef MATH_BENCHMARK
+float bench_analog2temp(int raw, uint8_t e)
+{
+  return analog2temp(raw, e);
+}
+#endif
+
 // Derived from RepRap FiveD extruder::getTemperature()
 // For bed temperature measurement.
 static float analog2tempBed(int raw) {
-  #ifdef BED_USES_THERMISTOR
-    float celsius = 0;
-    byte i;
-
-    for (i=1; i<BEDTEMPTABLE_LEN; i++)
-    {
-      if (PGM_RD_W(BEDTEMPTABLE[i][0]) > raw)
-      {
-        celsius  = PGM_RD_W(BEDTEMPTABLE[i-1][1]) + 
-          (raw - PGM_RD_W(BEDTEMPTABLE[i-1][0])) * 
-          (float)(PGM_RD_W(BEDTEMPTABLE[i][1]) - PGM_RD_W(BEDTEMPTABLE[i-1][1])) /
-          (float)(PGM_RD_W(BEDTEMPTABLE[i][0]) - PGM_RD_W(BEDTEMPTABLE[i-1][0]));
-        break;
-      }
-    }
-
-    // Overflow: Set to last value in the table
-    if (i == BEDTEMPTABLE_LEN) celsius = PGM_RD_W(BEDTEMPTABLE[i-1][1]);
-
-    return celsius;
+  #if defined(BED_USES_THERMISTOR) && THERMISTORBED == 1000
+    return temptable_custom_lookup(raw);
+  #elif defined(BED_USES_THERMISTOR)
+    return temptable_lookup(BEDTEMPTABLE, BEDTEMPTABLE_LEN, raw);
   #elif defined BED_USES_AD595
     return ((raw * ((5.0 * 100.0) / 1024.0) / OVERSAMPLENR) * TEMP_SENSOR_AD595_GAIN) + TEMP_SENSOR_AD595_OFFSET;
   #else
@@ -673,6 +1309,79 @@ static float analog2tempBed(int raw) {
   #endif
 }
 
+#ifdef REDUNDANT_SENSORS
+// Raw value of temp in a table sorted by raw value, whichever way the temperatures run. Past the hot or
+// the cold end of the table it is past every raw value.
+static int temptable_raw(const short (*tt)[2], uint8_t len, int temp)
+{
+  bool falling = PGM_RD_W(tt[0][1]) > PGM_RD_W(tt[len-1][1]);
+  uint8_t lo = 0, hi = len; // first entry at or past temp
+  while (lo < hi)
+  {
+    uint8_t mid = (lo + hi) >> 1;
+    short t = PGM_RD_W(tt[mid][1]);
+    if (falling ? t > temp : t < temp)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == 0)
+    return PGM_RD_W(tt[0][1]) == temp ? PGM_RD_W(tt[0][0]) : -1;
+  if (lo == len)
+    return 32767;
+  short raw0 = PGM_RD_W(tt[lo-1][0]), temp0 = PGM_RD_W(tt[lo-1][1]);
+  return raw0 + (long)(temp - temp0) * (PGM_RD_W(tt[lo][0]) - raw0) / (PGM_RD_W(tt[lo][1]) - temp0);
+}
+
+// Whether the second sensor of a heater (REDUNDANT_BED for the bed) reads more than MAX_REDUNDANT_TEMP_SENSOR_DIFF
+// off the first. The sensors are of the same type, so with a thermistor table this is decided on the raw value:
+// it has to lie between the raw values of the first one's temperature less and plus the difference.
+static bool redundant_sensor_off(uint8_t heater)
+{
+  const short (*tt)[2] = NULL;
+  uint8_t len = 0;
+  float temp;
+  if (heater == REDUNDANT_BED) {
+    temp = current_temperature_bed;
+    #if defined(BED_USES_THERMISTOR) && THERMISTORBED != 1000
+      tt = BEDTEMPTABLE;
+      len = BEDTEMPTABLE_LEN;
+    #endif
+  }
+  else {
+    temp = current_temperature[heater];
+    #ifdef CUSTOM_TEMPTABLE_LEN
+    if (heater_ttbl_map[heater] != (void *)temptable_1000)
+    #endif
+    {
+      tt = (const short (*)[2])heater_ttbl_map[heater];
+      len = heater_ttbllen_map[heater];
+    }
+  }
+  if (tt != NULL) {
+    int raw0 = temptable_raw(tt, len, (int)(temp + 0.5) - MAX_REDUNDANT_TEMP_SENSOR_DIFF);
+    int raw1 = temptable_raw(tt, len, (int)(temp + 0.5) + MAX_REDUNDANT_TEMP_SENSOR_DIFF);
+    return redundant_raw[heater] < min(raw0, raw1) || redundant_raw[heater] > max(raw0, raw1);
+  }
+  // Other sensors are compared in degrees
+  float redundant_temp = heater == REDUNDANT_BED ? analog2tempBed(redundant_raw[heater]) : analog2temp(redundant_raw[heater], heater);
+  return fabs(temp - redundant_temp) > MAX_REDUNDANT_TEMP_SENSOR_DIFF;
+}
+
+static void redundant_sensor_error()
+{
+  disable_heater();
+  if(IsStopped() == false) {
+    SERIAL_ERROR_START;
+    SERIAL_ERRORLNPGM("Heaters switched off. Temperature difference between temp sensors is too high !");
+    LCD_ALERTMESSAGEPGM("Err: REDUNDANT TEMP ERROR");
+  }
+  #ifndef BOGUS_TEMPERATURE_FAILSAFE_OVERRIDE
+    Stop();
+  #endif
+}
+#endif
+
 /* Called to get the raw values into the the actual temperatures. The raw values are created in interrupt context,
     and this function is called from normal context as it is too slow to run in interrupts and will block the stepper routine otherwise */
 static void updateTemperaturesFromRawValues()
@@ -682,8 +1391,8 @@ static void updateTemperaturesFromRawValues()
         current_temperature[e] = analog2temp(current_temperature_raw[e], e);
     }
     current_temperature_bed = analog2tempBed(current_temperature_bed_raw);
-    #ifdef TEMP_SENSOR_1_AS_REDUNDANT
-      redundant_temperature = analog2temp(redundant_temperature_raw, 1);
+    #ifdef TEMP_REPORT_CACHE
+    temp_report_stale = true;
     #endif
     //Reset the watchdog after we know we have a temperature measurement.
     watchdog_reset();
@@ -693,6 +1402,103 @@ static void updateTemperaturesFromRawValues()
     CRITICAL_SECTION_END;
 }
 
+#ifdef ADC_FREE_RUNNING
+#if ADC_OVERSAMPLE_HOTEND > 64 || ADC_OVERSAMPLE_BED > 64
+  #error ADC_OVERSAMPLE_HOTEND and ADC_OVERSAMPLE_BED must not exceed 64
+#endif
+
+// ADC channel of each sensor: the hotends, then the bed (-1 if not sampled by the ADC)
+#if defined(TEMP_0_PIN) && (TEMP_0_PIN > -1) && !defined(HEATER_0_USES_MAX6675)
+  #define ADC_PIN_0 TEMP_0_PIN
+#else
+  #define ADC_PIN_0 -1
+#endif
+#if defined(TEMP_1_PIN) && (TEMP_1_PIN > -1)
+  #define ADC_PIN_1 TEMP_1_PIN
+#else
+  #define ADC_PIN_1 -1
+#endif
+#if defined(TEMP_2_PIN) && (TEMP_2_PIN > -1)
+  #define ADC_PIN_2 TEMP_2_PIN
+#else
+  #define ADC_PIN_2 -1
+#endif
+#if defined(TEMP_BED_PIN) && (TEMP_BED_PIN > -1)
+  #define ADC_PIN_BED TEMP_BED_PIN
+#else
+  #define ADC_PIN_BED -1
+#endif
+#define ADC_SENSORS 4
+#define ADC_SENSOR_BED 3
+#define ADC_SCHEDULE_MAX (3 * ADC_SLOTS_HOTEND + ADC_SLOTS_BED)
+
+static const signed char adc_pin[ADC_SENSORS] = { ADC_PIN_0, ADC_PIN_1, ADC_PIN_2, ADC_PIN_BED };
+static unsigned char adc_schedule[ADC_SCHEDULE_MAX];
+static unsigned char adc_schedule_len;
+static unsigned char adc_schedule_pos;
+static unsigned int adc_sum[ADC_SENSORS];
+static unsigned char adc_count[ADC_SENSORS];
+static unsigned int adc_raw[ADC_SENSORS];   // last complete reading, scaled to OVERSAMPLENR samples
+static unsigned char adc_used;              // bit per scheduled sensor
+static unsigned char adc_ready;             // bit per sensor with a complete reading
+
+// n samples summed, rescaled to a sum of OVERSAMPLENR; both are powers of 2 so this folds to a shift
+#define ADC_DECIMATE(sum, n) ((n) >= OVERSAMPLENR ? (sum) / ((n) / OVERSAMPLENR) : (sum) * (OVERSAMPLENR / (n)))
+
+static void adc_select(signed char pin)
+{
+  ADMUX = ((1 << REFS0) | (pin & 0x07));
+  #ifdef MUX5
+    ADCSRB = (1 << ADTS2) | (pin > 7 ? 1 << MUX5 : 0); // trigger on timer0 overflow
+  #else
+    ADCSRB = (1 << ADTS2);
+  #endif
+}
+
+// Interleave the sensors so each one's slots are spread over the round
+static void adc_start()
+{
+  adc_schedule_len = 0;
+  adc_used = 0;
+  for(uint8_t slot = 0; slot < ADC_SLOTS_HOTEND || slot < ADC_SLOTS_BED; slot++) {
+    for(uint8_t s = 0; s < ADC_SENSORS; s++) {
+      if(adc_pin[s] < 0 || slot >= (s == ADC_SENSOR_BED ? ADC_SLOTS_BED : ADC_SLOTS_HOTEND))
+        continue;
+      adc_schedule[adc_schedule_len++] = s;
+      adc_used |= 1 << s;
+    }
+  }
+  adc_schedule_pos = 0;
+  if(adc_schedule_len == 0) return;
+  adc_select(adc_pin[adc_schedule[0]]);
+  ADCSRA = 1<<ADEN | 1<<ADATE | 1<<ADIF | 1<<ADIE | 0x07;
+}
+
+ISR(ADC_vect)
+{
+  unsigned char s = adc_schedule[adc_schedule_pos];
+  adc_sum[s] += ADC;
+  adc_count[s]++;
+  if(s == ADC_SENSOR_BED) {
+    if(adc_count[s] >= ADC_OVERSAMPLE_BED) {
+      adc_raw[s] = ADC_DECIMATE(adc_sum[s], ADC_OVERSAMPLE_BED);
+      adc_sum[s] = 0;
+      adc_count[s] = 0;
+      adc_ready |= 1 << s;
+    }
+  }
+  else if(adc_count[s] >= ADC_OVERSAMPLE_HOTEND) {
+    adc_raw[s] = ADC_DECIMATE(adc_sum[s], ADC_OVERSAMPLE_HOTEND);
+    adc_sum[s] = 0;
+    adc_count[s] = 0;
+    adc_ready |= 1 << s;
+  }
+  if(++adc_schedule_pos >= adc_schedule_len) adc_schedule_pos = 0;
+  // Takes effect for the next conversion, started by the next timer0 overflow
+  adc_select(adc_pin[adc_schedule[adc_schedule_pos]]);
+}
+#endif //ADC_FREE_RUNNING
+
 void tp_init()
 {
 #if (MOTHERBOARD == 80) && ((TEMP_SENSOR_0==-1)||(TEMP_SENSOR_1==-1)||(TEMP_SENSOR_2==-1)||(TEMP_SENSOR_BED==-1))
@@ -706,14 +1512,16 @@ void tp_init()
     // populate with the first value 
     maxttemp[e] = maxttemp[0];
 #ifdef PIDTEMP
-    temp_iState_min[e] = 0.0;
-    temp_iState_max[e] = PID_INTEGRAL_DRIVE_MAX / Ki;
+    temp_iState_min[e] = 0;
+    #ifdef PID_BOOST_HEATUP
+    boost_hold[e] = PID_BOOST_HOLD;
+    #endif
 #endif //PIDTEMP
 #ifdef PIDTEMPBED
     temp_iState_min_bed = 0.0;
-    temp_iState_max_bed = PID_INTEGRAL_DRIVE_MAX / bedKi;
 #endif //PIDTEMPBED
   }
+  updatePID();
 
   #if defined(HEATER_0_PIN) && (HEATER_0_PIN > -1) 
     SET_OUTPUT(HEATER_0_PIN);
@@ -754,7 +1562,11 @@ void tp_init()
   #endif
 
   // Set analog inputs
+  #ifdef ADC_FREE_RUNNING
+    adc_start();
+  #else
   ADCSRA = 1<<ADEN | 1<<ADSC | 1<<ADIF | 0x07;
+  #endif
   DIDR0 = 0;
   #ifdef DIDR2
     DIDR2 = 0;
@@ -909,7 +1721,7 @@ void disable_heater()
    #endif
   #endif
      
-  #if defined(TEMP_1_PIN) && TEMP_1_PIN > -1
+  #if defined(TEMP_1_PIN) && TEMP_1_PIN > -1 && EXTRUDERS > 1
     target_temperature[1]=0;
     soft_pwm[1]=0;
     #if defined(HEATER_1_PIN) && HEATER_1_PIN > -1 
@@ -917,7 +1729,7 @@ void disable_heater()
     #endif
   #endif
       
-  #if defined(TEMP_2_PIN) && TEMP_2_PIN > -1
+  #if defined(TEMP_2_PIN) && TEMP_2_PIN > -1 && EXTRUDERS > 2
     target_temperature[2]=0;
     soft_pwm[2]=0;
     #if defined(HEATER_2_PIN) && HEATER_2_PIN > -1  
@@ -960,6 +1772,22 @@ void min_temp_error(uint8_t e) {
   #endif
 }
 
+#ifdef THERMAL_RUNAWAY_PROTECTION
+static void thermal_runaway_error(uint8_t heater) {
+  disable_heater();
+  if(IsStopped() == false) {
+    SERIAL_ERROR_START;
+    if(heater == RUNAWAY_BED)
+      SERIAL_ERRORPGM("bed");
+    else
+      SERIAL_ERROR((int)heater);
+    SERIAL_ERRORLNPGM(": Heaters switched off. Thermal runaway !");
+    LCD_ALERTMESSAGEPGM("Err: THERMAL RUNAWAY");
+  }
+  Stop();
+}
+#endif
+
 void bed_max_temp_error(void) {
 #if HEATER_BED_PIN > -1
   WRITE(HEATER_BED_PIN, 0);
@@ -976,7 +1804,7 @@ void bed_max_temp_error(void) {
 
 #ifdef HEATER_0_USES_MAX6675
 #define MAX6675_HEAT_INTERVAL 250
-long max6675_previous_millis = -HEAT_INTERVAL;
+long max6675_previous_millis = -MAX6675_HEAT_INTERVAL;
 int max6675_temp = 2000;
 
 int read_max6675()
@@ -985,6 +1813,11 @@ int read_max6675()
     return max6675_temp;
   
   max6675_previous_millis = millis();
+#ifdef SPI_BUS_ARBITER
+  // what the read queued last time brought, this one is picked up next time
+  max6675_temp = spi_bus_max6675_word();
+  spi_bus_read_max6675();
+#else
   max6675_temp = 0;
     
   #ifdef	PRR
@@ -1015,6 +1848,7 @@ int read_max6675()
   
   // disable TT_MAX6675
   WRITE(MAX6675_SS, 1);
+#endif //SPI_BUS_ARBITER
 
   if (max6675_temp & 4) 
   {
@@ -1031,7 +1865,110 @@ int read_max6675()
 #endif
 
 
+#if defined(HEATER_BED_PIN) && HEATER_BED_PIN > -1
+  #ifndef BED_SLOW_PWM
+    #define SOFT_PWM_BED // the interrupt below switches the bed
+  #endif
+#elif defined(BED_SLOW_PWM)
+  #error "BED_SLOW_PWM needs a HEATER_BED_PIN"
+#endif
+
 // Timer 0 is shared with millies
+#ifdef SOFT_PWM_PORTS
+#ifdef SOFT_PWM_DITHER
+  // Latched duty is in pwm_count units: on while pwm_count is below it
+  #define SOFT_PWM_ON(v) ((v) > pwm_count)
+#else
+  // Same as the WRITE() engine: on from pwm_count 0 (if non-zero) until pwm_count passes it
+  #define SOFT_PWM_ON(v) ((v) && (v) >= pwm_count)
+#endif
+
+// Output slots: heater 0, heater 1, heater 2, bed, fan. The port address of a missing slot is 0.
+#define _SOFT_PWM_ADDR(IO) (&(DIO ## IO ## _WPORT))
+#define SOFT_PWM_ADDR(IO) _SOFT_PWM_ADDR(IO)
+#define _SOFT_PWM_BIT(IO) MASK(DIO ## IO ## _PIN)
+#define SOFT_PWM_BIT(IO) _SOFT_PWM_BIT(IO)
+
+#define SOFT_PWM_ADDR_0 SOFT_PWM_ADDR(HEATER_0_PIN)
+#define SOFT_PWM_BIT_0 SOFT_PWM_BIT(HEATER_0_PIN)
+#if (EXTRUDERS > 1) || defined(HEATERS_PARALLEL)
+  #define SOFT_PWM_ADDR_1 SOFT_PWM_ADDR(HEATER_1_PIN)
+  #define SOFT_PWM_BIT_1 SOFT_PWM_BIT(HEATER_1_PIN)
+#else
+  #define SOFT_PWM_ADDR_1 ((volatile uint8_t *)0)
+  #define SOFT_PWM_BIT_1 0
+#endif
+#if EXTRUDERS > 2
+  #define SOFT_PWM_ADDR_2 SOFT_PWM_ADDR(HEATER_2_PIN)
+  #define SOFT_PWM_BIT_2 SOFT_PWM_BIT(HEATER_2_PIN)
+#else
+  #define SOFT_PWM_ADDR_2 ((volatile uint8_t *)0)
+  #define SOFT_PWM_BIT_2 0
+#endif
+#ifdef SOFT_PWM_BED
+  #define SOFT_PWM_ADDR_3 SOFT_PWM_ADDR(HEATER_BED_PIN)
+  #define SOFT_PWM_BIT_3 SOFT_PWM_BIT(HEATER_BED_PIN)
+#else
+  #define SOFT_PWM_ADDR_3 ((volatile uint8_t *)0)
+  #define SOFT_PWM_BIT_3 0
+#endif
+#ifdef FAN_SOFT_PWM
+  #define SOFT_PWM_ADDR_4 SOFT_PWM_ADDR(FAN_PIN)
+  #define SOFT_PWM_BIT_4 SOFT_PWM_BIT(FAN_PIN)
+#else
+  #define SOFT_PWM_ADDR_4 ((volatile uint8_t *)0)
+  #define SOFT_PWM_BIT_4 0
+#endif
+#if defined(HEATERS_PARALLEL) && EXTRUDERS == 1
+  #define SOFT_PWM_PARALLEL 1 // heater 1 follows heater 0
+#else
+  #define SOFT_PWM_PARALLEL 0
+#endif
+
+// The address comparisons are constant, so each of these folds to a fixed mask
+#define SOFT_PWM_SAME(a, n) (SOFT_PWM_ADDR_##a == SOFT_PWM_ADDR_##n)
+#define SOFT_PWM_MASK(n, on) ( \
+    (SOFT_PWM_SAME(0, n) && ((on) & 1) ? SOFT_PWM_BIT_0 : 0) | \
+    (SOFT_PWM_SAME(1, n) && ((on) & 2) ? SOFT_PWM_BIT_1 : 0) | \
+    (SOFT_PWM_SAME(2, n) && ((on) & 4) ? SOFT_PWM_BIT_2 : 0) | \
+    (SOFT_PWM_SAME(3, n) && ((on) & 8) ? SOFT_PWM_BIT_3 : 0) | \
+    (SOFT_PWM_SAME(4, n) && ((on) & 16) ? SOFT_PWM_BIT_4 : 0))
+// Only the lowest slot on each port writes it, covering every slot on that port
+#define SOFT_PWM_FIRST_0 1
+#define SOFT_PWM_FIRST_1 (!SOFT_PWM_SAME(0, 1))
+#define SOFT_PWM_FIRST_2 (!SOFT_PWM_SAME(0, 2) && !SOFT_PWM_SAME(1, 2))
+#define SOFT_PWM_FIRST_3 (!SOFT_PWM_SAME(0, 3) && !SOFT_PWM_SAME(1, 3) && !SOFT_PWM_SAME(2, 3))
+#define SOFT_PWM_FIRST_4 (!SOFT_PWM_SAME(0, 4) && !SOFT_PWM_SAME(1, 4) && !SOFT_PWM_SAME(2, 4) && !SOFT_PWM_SAME(3, 4))
+#define SOFT_PWM_WRITE_PORT(n, on) do { \
+    if(SOFT_PWM_ADDR_##n && SOFT_PWM_FIRST_##n) \
+      *SOFT_PWM_ADDR_##n = (*SOFT_PWM_ADDR_##n & ~SOFT_PWM_MASK(n, 0xff)) | SOFT_PWM_MASK(n, on); \
+  } while(0)
+
+#ifdef HEATER_POWER_BUDGET
+// Each heater slot is on from pwm_start[slot] for its latched length, wrapping around the period
+static unsigned char pwm_start[4];
+#define HEATER_PWM_ON(v, slot) ((unsigned char)((pwm_count - pwm_start[slot]) & 0x7f) < (v))
+#ifdef SOFT_PWM_DITHER
+  #define SOFT_PWM_LENGTH(v) (v)
+#else
+  // pwm_count units the heater is on for, as SOFT_PWM_ON() would have it
+  #define SOFT_PWM_LENGTH(v) ((v) ? (((v) >> SOFT_PWM_SCALE) + 1) << SOFT_PWM_SCALE : 0)
+#endif
+
+// Place the on-time of a heater at start and move start past it. Over the budget the heaters may
+// not overlap, so the part that does not fit in the period is cut.
+FORCE_INLINE void heater_budget_place(unsigned char &len, uint8_t slot, uint8_t &start, bool over)
+{
+  if(over && len > 128 - start)
+    len = 128 - start;
+  pwm_start[slot] = start & 0x7f;
+  start = over ? start + len : (start + len) & 0x7f;
+}
+#else
+#define HEATER_PWM_ON(v, slot) SOFT_PWM_ON(v)
+#endif
+#endif //SOFT_PWM_PORTS
+
 ISR(TIMER0_COMPB_vect)
 {
   //these variables are only accesible from the ISR, but static, so they don't lose their value
@@ -1042,6 +1979,9 @@ ISR(TIMER0_COMPB_vect)
   static unsigned long raw_temp_bed_value = 0;
   static unsigned char temp_state = 8;
   static unsigned char pwm_count = (1 << SOFT_PWM_SCALE);
+  #ifdef SOFT_PWM_DITHER
+  static unsigned char pwm_dither[5];
+  #endif
   static unsigned char soft_pwm_0;
   #if (EXTRUDERS > 1) || defined(HEATERS_PARALLEL)
   static unsigned char soft_pwm_1;
@@ -1049,10 +1989,92 @@ ISR(TIMER0_COMPB_vect)
   #if EXTRUDERS > 2
   static unsigned char soft_pwm_2;
   #endif
-  #if HEATER_BED_PIN > -1
+  #ifdef SOFT_PWM_BED
   static unsigned char soft_pwm_b;
   #endif
   
+#ifdef HEATER_DUTY_STATS
+  if(pwm_count == 0) heater_duty_count();
+#endif
+
+#ifdef SOFT_PWM_PORTS
+  if(pwm_count == 0){
+    #ifdef SOFT_PWM_DITHER
+      // Turn each 7 bit duty into whole steps of this period and carry the rest
+      #define SOFT_PWM_LATCH(var, slot, v) do { \
+          pwm_dither[slot] += (v) ? (v) + 1 : 0; \
+          var = pwm_dither[slot] & ~((1 << SOFT_PWM_SCALE) - 1); \
+          pwm_dither[slot] -= var; \
+        } while(0)
+    #else
+      #define SOFT_PWM_LATCH(var, slot, v) var = (v)
+    #endif
+    SOFT_PWM_LATCH(soft_pwm_0, 0, soft_pwm[0]);
+    #if EXTRUDERS > 1
+    SOFT_PWM_LATCH(soft_pwm_1, 1, soft_pwm[1]);
+    #endif
+    #if EXTRUDERS > 2
+    SOFT_PWM_LATCH(soft_pwm_2, 2, soft_pwm[2]);
+    #endif
+    #ifdef SOFT_PWM_BED
+    SOFT_PWM_LATCH(soft_pwm_b, 3, soft_pwm_bed);
+    #endif
+    #ifdef FAN_SOFT_PWM
+    SOFT_PWM_LATCH(soft_pwm_fan, 4, fanSpeedSoftPwm / 2);
+    #endif
+    #ifdef HEATER_POWER_BUDGET
+    {
+      soft_pwm_0 = SOFT_PWM_LENGTH(soft_pwm_0);
+      uint16_t watts = soft_pwm_0 ? (1 + SOFT_PWM_PARALLEL) * (uint16_t)(EXTRUDER_WATTS) : 0;
+      #if EXTRUDERS > 1
+      soft_pwm_1 = SOFT_PWM_LENGTH(soft_pwm_1);
+      if(soft_pwm_1) watts += (uint16_t)(EXTRUDER_WATTS);
+      #endif
+      #if EXTRUDERS > 2
+      soft_pwm_2 = SOFT_PWM_LENGTH(soft_pwm_2);
+      if(soft_pwm_2) watts += (uint16_t)(EXTRUDER_WATTS);
+      #endif
+      #ifdef SOFT_PWM_BED
+      soft_pwm_b = SOFT_PWM_LENGTH(soft_pwm_b);
+      if(soft_pwm_b) watts += (uint16_t)(BED_WATTS);
+      #endif
+      bool over = watts > HEATER_POWER_BUDGET;
+      uint8_t start = 0;
+      heater_budget_place(soft_pwm_0, 0, start, over);
+      #if EXTRUDERS > 1
+      heater_budget_place(soft_pwm_1, 1, start, over);
+      #endif
+      #if EXTRUDERS > 2
+      heater_budget_place(soft_pwm_2, 2, start, over);
+      #endif
+      #ifdef SOFT_PWM_BED
+      heater_budget_place(soft_pwm_b, 3, start, over);
+      #endif
+    }
+    #endif
+  }
+  {
+    uint8_t on = 0;
+    if(HEATER_PWM_ON(soft_pwm_0, 0)) on |= 1 | 2 * SOFT_PWM_PARALLEL;
+    #if EXTRUDERS > 1
+    if(HEATER_PWM_ON(soft_pwm_1, 1)) on |= 2;
+    #endif
+    #if EXTRUDERS > 2
+    if(HEATER_PWM_ON(soft_pwm_2, 2)) on |= 4;
+    #endif
+    #ifdef SOFT_PWM_BED
+    if(HEATER_PWM_ON(soft_pwm_b, 3)) on |= 8;
+    #endif
+    #ifdef FAN_SOFT_PWM
+    if(SOFT_PWM_ON(soft_pwm_fan)) on |= 16;
+    #endif
+    SOFT_PWM_WRITE_PORT(0, on);
+    SOFT_PWM_WRITE_PORT(1, on);
+    SOFT_PWM_WRITE_PORT(2, on);
+    SOFT_PWM_WRITE_PORT(3, on);
+    SOFT_PWM_WRITE_PORT(4, on);
+  }
+#else
   if(pwm_count == 0){
     soft_pwm_0 = soft_pwm[0];
     if(soft_pwm_0 > 0) { 
@@ -1070,7 +2092,7 @@ ISR(TIMER0_COMPB_vect)
     soft_pwm_2 = soft_pwm[2];
     if(soft_pwm_2 > 0) WRITE(HEATER_2_PIN,1); else WRITE(HEATER_2_PIN,0);
     #endif
-    #if defined(HEATER_BED_PIN) && HEATER_BED_PIN > -1
+    #ifdef SOFT_PWM_BED
     soft_pwm_b = soft_pwm_bed;
     if(soft_pwm_b > 0) WRITE(HEATER_BED_PIN,1); else WRITE(HEATER_BED_PIN,0);
     #endif
@@ -1091,16 +2113,38 @@ ISR(TIMER0_COMPB_vect)
   #if EXTRUDERS > 2
   if(soft_pwm_2 < pwm_count) WRITE(HEATER_2_PIN,0);
   #endif
-  #if defined(HEATER_BED_PIN) && HEATER_BED_PIN > -1
+  #ifdef SOFT_PWM_BED
   if(soft_pwm_b < pwm_count) WRITE(HEATER_BED_PIN,0);
   #endif
   #ifdef FAN_SOFT_PWM
   if(soft_pwm_fan < pwm_count) WRITE(FAN_PIN,0);
   #endif
   
+#endif //SOFT_PWM_PORTS
+  
   pwm_count += (1 << SOFT_PWM_SCALE);
   pwm_count &= 0x7f;
   
+#ifdef TEMP_ISR_SPLIT
+  #if TEMP_ISR_SLOW_DIVIDER > 1
+  static unsigned char slow_count = 0;
+  if(++slow_count < TEMP_ISR_SLOW_DIVIDER)
+    return;
+  slow_count = 0;
+  #endif
+  // Only the PWM edges need the exact tick, the stepper and serial interrupts may cut into the rest
+  TIMSK0 &= ~(1<<OCIE0B);
+  sei();
+#endif
+
+#ifdef ADC_FREE_RUNNING
+  // The ADC interrupt does the sampling; keep the old cadence for the buttons and readings
+  if((temp_state & 1) == 0) lcd_buttons_poll();
+  if(++temp_state >= 8) {
+    temp_state = 0;
+    temp_count++;
+  }
+#else
   switch(temp_state) {
     case 0: // Prepare TEMP_0
       #if defined(TEMP_0_PIN) && (TEMP_0_PIN > -1)
@@ -1112,14 +2156,14 @@ ISR(TIMER0_COMPB_vect)
         ADMUX = ((1 << REFS0) | (TEMP_0_PIN & 0x07));
         ADCSRA |= 1<<ADSC; // Start conversion
       #endif
-      lcd_buttons_update();
+      lcd_buttons_poll();
       temp_state = 1;
       break;
     case 1: // Measure TEMP_0
       #if defined(TEMP_0_PIN) && (TEMP_0_PIN > -1)
         raw_temp_0_value += ADC;
       #endif
-      #ifdef HEATER_0_USES_MAX6675 // TODO remove the blocking
+      #ifdef HEATER_0_USES_MAX6675 // blocks for two SPI bytes without SPI_BUS_ARBITER
         raw_temp_0_value = read_max6675();
       #endif
       temp_state = 2;
@@ -1134,7 +2178,7 @@ ISR(TIMER0_COMPB_vect)
         ADMUX = ((1 << REFS0) | (TEMP_BED_PIN & 0x07));
         ADCSRA |= 1<<ADSC; // Start conversion
       #endif
-      lcd_buttons_update();
+      lcd_buttons_poll();
       temp_state = 3;
       break;
     case 3: // Measure TEMP_BED
@@ -1153,7 +2197,7 @@ ISR(TIMER0_COMPB_vect)
         ADMUX = ((1 << REFS0) | (TEMP_1_PIN & 0x07));
         ADCSRA |= 1<<ADSC; // Start conversion
       #endif
-      lcd_buttons_update();
+      lcd_buttons_poll();
       temp_state = 5;
       break;
     case 5: // Measure TEMP_1
@@ -1172,7 +2216,7 @@ ISR(TIMER0_COMPB_vect)
         ADMUX = ((1 << REFS0) | (TEMP_2_PIN & 0x07));
         ADCSRA |= 1<<ADSC; // Start conversion
       #endif
-      lcd_buttons_update();
+      lcd_buttons_poll();
       temp_state = 7;
       break;
     case 7: // Measure TEMP_2
@@ -1190,17 +2234,43 @@ ISR(TIMER0_COMPB_vect)
 //      SERIAL_ERRORLNPGM("Temp measurement error!");
 //      break;
   }
+#endif //ADC_FREE_RUNNING
     
+#ifdef ADC_FREE_RUNNING
+  // Hold off until every sensor has a full reading, or the zeroed ones would trip MAXTEMP
+  if(temp_count >= OVERSAMPLENR && (adc_ready & adc_used) == adc_used)
+  {
+    #ifdef TEMP_ISR_SPLIT
+    CRITICAL_SECTION_START; // ADC_vect can come in between
+    #endif
+    raw_temp_0_value = adc_raw[0];
+    raw_temp_1_value = adc_raw[1];
+    raw_temp_2_value = adc_raw[2];
+    raw_temp_bed_value = adc_raw[ADC_SENSOR_BED];
+    #ifdef TEMP_ISR_SPLIT
+    CRITICAL_SECTION_END;
+    #endif
+    #ifdef HEATER_0_USES_MAX6675
+      raw_temp_0_value = read_max6675();
+    #endif
+#else
   if(temp_count >= OVERSAMPLENR) // 8 * 16 * 1/(16000000/64/256)  = 131ms.
   {
+#endif
     if (!temp_meas_ready) //Only update the raw values if they have been read. Else we could be updating them during reading.
     {
       current_temperature_raw[0] = raw_temp_0_value;
 #if EXTRUDERS > 1
       current_temperature_raw[1] = raw_temp_1_value;
 #endif
-#ifdef TEMP_SENSOR_1_AS_REDUNDANT
-      redundant_temperature_raw = raw_temp_1_value;
+#ifdef REDUNDANT_SENSOR_0
+      redundant_raw[0] = RAW_TEMP_VALUE(REDUNDANT_SENSOR_0);
+#endif
+#ifdef REDUNDANT_SENSOR_1
+      redundant_raw[1] = RAW_TEMP_VALUE(REDUNDANT_SENSOR_1);
+#endif
+#ifdef REDUNDANT_SENSOR_BED
+      redundant_raw[REDUNDANT_BED] = RAW_TEMP_VALUE(REDUNDANT_SENSOR_BED);
 #endif
 #if EXTRUDERS > 2
       current_temperature_raw[2] = raw_temp_2_value;
@@ -1275,24 +2345,10 @@ ISR(TIMER0_COMPB_vect)
 #endif
   }
   
-#ifdef BABYSTEPPING
-  for(uint8_t axis=0;axis<3;axis++)
-  {
-    int curTodo=babystepsTodo[axis]; //get rid of volatile for performance
-   
-    if(curTodo>0)
-    {
-      babystep(axis,/*fwd*/true);
-      babystepsTodo[axis]--; //less to do next time
-    }
-    else
-    if(curTodo<0)
-    {
-      babystep(axis,/*fwd*/false);
-      babystepsTodo[axis]++; //less to do next time
-    }
-  }
-#endif //BABYSTEPPING
+#ifdef TEMP_ISR_SPLIT
+  cli();
+  TIMSK0 |= (1<<OCIE0B);
+#endif
 }
 
 #ifdef PIDTEMP
@@ -41,9 +41,6 @@ extern float current_temperature[EXTRUDERS];
 #endif
 extern int target_temperature_bed;
 extern float current_temperature_bed;
-#ifdef TEMP_SENSOR_1_AS_REDUNDANT
-  extern float redundant_temperature;
-#endif
 
 #if defined(CONTROLLERFAN_PIN) && CONTROLLERFAN_PIN > -1
   extern unsigned char soft_pwm_bed;
@@ -51,6 +48,9 @@ extern float current_temperature_bed;
 
 #ifdef PIDTEMP
   extern float Kp,Ki,Kd,Kc;
+  #ifdef PID_EXTRUSION_FEEDFORWARD
+    extern unsigned int pid_feedforward_ms;
+  #endif
   float scalePID_i(float i);
   float scalePID_d(float d);
   float unscalePID_i(float i);
@@ -62,10 +62,6 @@ extern float current_temperature_bed;
 #endif
   
   
-#ifdef BABYSTEPPING
-  extern volatile int babystepsTodo[3];
-#endif
-  
 //high level conversion routines, for use outside of temperature.cpp
 //inline so that there is no performance decrease.
 //deg=degreeCelsius
@@ -150,6 +146,10 @@ FORCE_INLINE bool isCoolingBed() {
 
 
 int getHeaterPower(int heater);
+#ifdef TEMP_REPORT_CACHE
+// The M105 fields from " T:" through " B@:" with the first ones for extruder
+const char *temp_report(uint8_t extruder);
+#endif
 void disable_heater();
 void setWatch();
 void updatePID();
@@ -166,6 +166,24 @@ FORCE_INLINE void autotempShutdown(){
 }
 
 void PID_autotune(float temp, int extruder, int ncycles);
+#ifdef PID_AUTOTUNE_CONVERGENCE
+void PID_autotune_all(float temp, float bed_temp, int ncycles); // every hotend and the bed at once, no bed with bed_temp 0
+#endif
+
+#ifdef MATH_BENCHMARK
+float bench_analog2temp(int raw, uint8_t e); // analog2temp() for benchmark_run()
+#endif
+
+#ifdef THERMAL_HISTORY
+void thermal_history_report(); // min/max/mean of each heater over the recorded samples
+void thermal_history_dump();   // the raw samples, oldest first, in binary
+void thermal_history_set_interval(unsigned int ms); // also clears the history
+#endif
+
+#ifdef HEATER_DUTY_STATS
+void heater_duty_reset();  // start a new job: clear the counters and the clock
+void heater_duty_report(); // mean power, time at the limit and energy of each heater since the reset
+#endif
 
 #endif
 
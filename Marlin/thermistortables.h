@@ -922,6 +922,37 @@ const short temptable_1047[][2] PROGMEM = {
 };
 #endif
 
+#if (THERMISTORHEATER_0 == 1000) || (THERMISTORHEATER_1 == 1000) || (THERMISTORHEATER_2 == 1000) || (THERMISTORBED == 1000) // custom thermistor
+// A temperature in 1/16 C for every THERMISTOR_CUSTOM_ADC_STEP ADC counts from 0 to 1024. The ends are taken half a count
+// inside, where the resistance is still finite.
+#define CustomAdc(I) ((I) == 0 ? 0.5 : (I) * THERMISTOR_CUSTOM_ADC_STEP >= 1024 ? 1023.5 : (double)(I) * THERMISTOR_CUSTOM_ADC_STEP)
+#define CustomLnR(I) log(THERMISTOR_CUSTOM_PULLUP * CustomAdc(I) / (1024 - CustomAdc(I)))
+#ifdef THERMISTOR_CUSTOM_SH_A
+  #define CustomInvT(I) (THERMISTOR_CUSTOM_SH_A + THERMISTOR_CUSTOM_SH_B * CustomLnR(I) + THERMISTOR_CUSTOM_SH_C * CustomLnR(I) * CustomLnR(I) * CustomLnR(I))
+#else
+  #define CustomInvT(I) (1.0 / 298.15 + (CustomLnR(I) - log(THERMISTOR_CUSTOM_R25)) / THERMISTOR_CUSTOM_BETA)
+#endif
+#define CustomLine(I) (short)((1.0 / CustomInvT(I) - 273.15) * 16 + 0.5),
+#define CustomLine4(I) CustomLine(I) CustomLine((I) + 1) CustomLine((I) + 2) CustomLine((I) + 3)
+#define CustomLine16(I) CustomLine4(I) CustomLine4((I) + 4) CustomLine4((I) + 8) CustomLine4((I) + 12)
+#define CUSTOM_TEMPTABLE_LEN (1024 / THERMISTOR_CUSTOM_ADC_STEP + 1)
+
+// The compiler folds log() of constants, so the table is filled in at build time like the others
+const short temptable_1000[CUSTOM_TEMPTABLE_LEN] PROGMEM = {
+  CustomLine16(0) CustomLine16(16)
+#if THERMISTOR_CUSTOM_ADC_STEP <= 16
+  CustomLine16(32) CustomLine16(48)
+#endif
+#if THERMISTOR_CUSTOM_ADC_STEP <= 8
+  CustomLine16(64) CustomLine16(80) CustomLine16(96) CustomLine16(112)
+#endif
+  CustomLine(CUSTOM_TEMPTABLE_LEN - 1)
+};
+#if THERMISTOR_CUSTOM_ADC_STEP != 8 && THERMISTOR_CUSTOM_ADC_STEP != 16 && THERMISTOR_CUSTOM_ADC_STEP != 32
+  #error "THERMISTOR_CUSTOM_ADC_STEP must be 8, 16 or 32"
+#endif
+#endif
+
 #define _TT_NAME(_N) temptable_ ## _N
 #define TT_NAME(_N) _TT_NAME(_N)
 
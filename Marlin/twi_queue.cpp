@@ -0,0 +1,110 @@
+#include "Marlin.h"
+
+#ifdef TWI_QUEUE
+#include <util/twi.h>
+
+#include "twi_queue.h"
+
+//===========================================================================
+//=============================private variables  ============================
+//===========================================================================
+
+struct twi_transfer_t
+{
+  uint8_t address;
+  uint8_t length;
+  uint8_t data[TWI_QUEUE_MAX_BYTES];
+};
+
+static twi_transfer_t twi_transfers[TWI_QUEUE_SIZE];
+static volatile uint8_t twi_head = 0; // next free slot, only changed by twi_queue_write()
+static volatile uint8_t twi_tail = 0; // transfer on the bus, only changed by the interrupt
+static volatile bool twi_busy = false;
+static uint8_t twi_index;             // next byte of the current transfer
+static bool twi_initialized = false;
+
+#define TWI_NEXT(i) ((i) + 1 == TWI_QUEUE_SIZE ? 0 : (i) + 1)
+#define TWI_CONTROL(bits) TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWINT) | (bits)
+
+//===========================================================================
+//=============================functions         ============================
+//===========================================================================
+
+void twi_queue_init()
+{
+  if (twi_initialized)
+    return;
+  twi_initialized = true;
+  // internal pull-ups, as the Wire library does
+  digitalWrite(SDA, HIGH);
+  digitalWrite(SCL, HIGH);
+  TWSR &= ~(_BV(TWPS0) | _BV(TWPS1));
+  TWBR = ((F_CPU / TWI_QUEUE_FREQ) - 16) / 2;
+  TWCR = _BV(TWEN);
+}
+
+void twi_queue_write(uint8_t address, const uint8_t *data, uint8_t length)
+{
+  uint8_t next = TWI_NEXT(twi_head);
+  while (next == twi_tail)
+    ; // queue full, a slot frees up when the interrupt finishes the oldest transfer
+  twi_transfer_t &t = twi_transfers[twi_head];
+  t.address = address;
+  t.length = min(length, TWI_QUEUE_MAX_BYTES);
+  memcpy(t.data, data, t.length);
+
+  CRITICAL_SECTION_START
+  twi_head = next;
+  if (!twi_busy)
+  {
+    twi_busy = true;
+    twi_index = 0;
+    while (TWCR & _BV(TWSTO))
+      ; // the stop ending the previous transfer is still going out
+    TWI_CONTROL(_BV(TWSTA));
+  }
+  CRITICAL_SECTION_END
+}
+
+void twi_queue_flush()
+{
+  while (twi_busy)
+    ;
+}
+
+// Master transmitter: START, address, then the data bytes. A transfer the device does not
+// acknowledge is dropped. Between transfers a STOP is sent followed directly by the next START.
+ISR(TWI_vect)
+{
+  twi_transfer_t &t = twi_transfers[twi_tail];
+  switch (TW_STATUS)
+  {
+    case TW_START:
+    case TW_REP_START:
+      TWDR = (t.address << 1) | TW_WRITE;
+      TWI_CONTROL(0);
+      return;
+    case TW_MT_SLA_ACK:
+    case TW_MT_DATA_ACK:
+      if (twi_index < t.length)
+      {
+        TWDR = t.data[twi_index++];
+        TWI_CONTROL(0);
+        return;
+      }
+      break;
+    default: // not acknowledged, arbitration lost or a bus error
+      break;
+  }
+  twi_tail = TWI_NEXT(twi_tail);
+  twi_index = 0;
+  if (twi_tail != twi_head)
+    TWI_CONTROL(_BV(TWSTO) | _BV(TWSTA));
+  else
+  {
+    TWCR = _BV(TWEN) | _BV(TWINT) | _BV(TWSTO);
+    twi_busy = false;
+  }
+}
+
+#endif //TWI_QUEUE
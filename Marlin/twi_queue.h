@@ -0,0 +1,16 @@
+#ifndef TWI_QUEUE_H
+#define TWI_QUEUE_H
+
+#include "Marlin.h"
+
+#ifdef TWI_QUEUE
+  // set up the TWI as bus master, does nothing when it already is
+  void twi_queue_init();
+  // queue writing length bytes (up to TWI_QUEUE_MAX_BYTES) to the device at the 7-bit address. The transfer
+  // is done from the TWI interrupt, this only waits when all TWI_QUEUE_SIZE slots are taken.
+  void twi_queue_write(uint8_t address, const uint8_t *data, uint8_t length);
+  // wait until every queued transfer has been sent
+  void twi_queue_flush();
+#endif
+
+#endif
@@ -6,7 +6,9 @@
 #include "cardreader.h"
 #include "temperature.h"
 #include "stepper.h"
+#include "kinematics.h"
 #include "ConfigurationStore.h"
+#include "event_trace.h"
 
 int8_t encoderDiff; /* encoderDiff is updated from interrupt context and added to encoderPosition every LCD update */
 
@@ -32,6 +34,99 @@ typedef void (*menuFunc_t)();
 uint8_t lcd_status_message_level;
 char lcd_status_message[LCD_WIDTH+1] = WELCOME_MSG;
 
+#ifdef STATUS_SNAPSHOT
+/* The values of the status screen as status_snapshot_take() last took them. Both implementations draw from it */
+static struct {
+    int hotend[EXTRUDERS], hotend_target[EXTRUDERS]; // degrees
+    int bed, bed_target;
+    uint8_t heating;        // bit e for hotend e, bit EXTRUDERS for the bed
+    int fan;
+    int feedmultiply;
+    float position[3];
+    bool sd_printing;
+    uint8_t sd_percent;
+    int eta_minutes;        // -1 while unknown
+    uint16_t print_minutes; // 0xFFFF before the first print
+} status_snapshot;
+
+/* Set by lcd_update() when it starts a frame. On DOGLCD the status screen runs once per u8glib page, only
+   the first page of a frame takes the snapshot and the others draw the same values */
+static bool status_frame_start = false;
+
+/* What status_snapshot_take() found changed */
+#define STATUS_CHANGED_TEMPS    1 // a temperature, target or heater state
+#define STATUS_CHANGED_SETTINGS 2 // fan or feedrate
+#define STATUS_CHANGED_POSITION 4
+#define STATUS_CHANGED_PRINT    8 // SD progress, remaining or printed time
+
+#define STATUS_HOTEND(e) status_snapshot.hotend[e]
+#define STATUS_HOTEND_TARGET(e) status_snapshot.hotend_target[e]
+#define STATUS_HOTEND_HEATING(e) (status_snapshot.heating & (1 << (e)))
+#define STATUS_BED status_snapshot.bed
+#define STATUS_BED_TARGET status_snapshot.bed_target
+#define STATUS_BED_HEATING (status_snapshot.heating & (1 << EXTRUDERS))
+#define STATUS_FAN status_snapshot.fan
+#define STATUS_FEEDMULTIPLY status_snapshot.feedmultiply
+#define STATUS_POSITION(axis) status_snapshot.position[axis]
+#define STATUS_SD_PRINTING status_snapshot.sd_printing
+#define STATUS_SD_PERCENT status_snapshot.sd_percent
+#define STATUS_ETA_MINUTES status_snapshot.eta_minutes
+#define STATUS_PRINT_MINUTES status_snapshot.print_minutes
+
+/* Take the values into the snapshot, returns the STATUS_CHANGED_ flags of those that changed as shown */
+static uint8_t status_snapshot_take()
+{
+    uint8_t changed = 0;
+    #define STATUS_TAKE(field, value, flag) do { if (status_snapshot.field != (value)) { status_snapshot.field = (value); changed |= (flag); } } while(0)
+    uint8_t heating = 0;
+    for (uint8_t e = 0; e < EXTRUDERS; e++)
+    {
+        STATUS_TAKE(hotend[e], int(degHotend(e) + 0.5), STATUS_CHANGED_TEMPS);
+        STATUS_TAKE(hotend_target[e], int(degTargetHotend(e) + 0.5), STATUS_CHANGED_TEMPS);
+        if (isHeatingHotend(e))
+            heating |= 1 << e;
+    }
+    STATUS_TAKE(bed, int(degBed() + 0.5), STATUS_CHANGED_TEMPS);
+    STATUS_TAKE(bed_target, int(degTargetBed() + 0.5), STATUS_CHANGED_TEMPS);
+    if (isHeatingBed())
+        heating |= 1 << EXTRUDERS;
+    STATUS_TAKE(heating, heating, STATUS_CHANGED_TEMPS);
+    STATUS_TAKE(fan, fanSpeed, STATUS_CHANGED_SETTINGS);
+    STATUS_TAKE(feedmultiply, feedmultiply, STATUS_CHANGED_SETTINGS);
+    for (uint8_t axis = X_AXIS; axis <= Z_AXIS; axis++)
+    {
+        // in 1/100 mm, the finest either status screen shows
+        if (lround(status_snapshot.position[axis] * 100) != lround(current_position[axis] * 100))
+            changed |= STATUS_CHANGED_POSITION;
+        status_snapshot.position[axis] = current_position[axis];
+    }
+#ifdef SDSUPPORT
+    STATUS_TAKE(sd_printing, IS_SD_PRINTING, STATUS_CHANGED_PRINT);
+    STATUS_TAKE(sd_percent, card.percentDone(), STATUS_CHANGED_PRINT);
+  #ifdef SD_PRINT_ETA
+    STATUS_TAKE(eta_minutes, card.etaSeconds < 0 ? -1 : int(card.etaSeconds / 60), STATUS_CHANGED_PRINT);
+  #endif
+#endif
+    STATUS_TAKE(print_minutes, starttime != 0 ? uint16_t(millis()/60000 - starttime/60000) : 0xFFFF, STATUS_CHANGED_PRINT);
+    #undef STATUS_TAKE
+    return changed;
+}
+#else
+#define STATUS_HOTEND(e) int(degHotend(e) + 0.5)
+#define STATUS_HOTEND_TARGET(e) int(degTargetHotend(e) + 0.5)
+#define STATUS_HOTEND_HEATING(e) isHeatingHotend(e)
+#define STATUS_BED int(degBed() + 0.5)
+#define STATUS_BED_TARGET int(degTargetBed() + 0.5)
+#define STATUS_BED_HEATING isHeatingBed()
+#define STATUS_FAN fanSpeed
+#define STATUS_FEEDMULTIPLY feedmultiply
+#define STATUS_POSITION(axis) current_position[axis]
+#define STATUS_SD_PRINTING IS_SD_PRINTING
+#define STATUS_SD_PERCENT card.percentDone()
+#define STATUS_ETA_MINUTES (card.etaSeconds < 0 ? -1 : int(card.etaSeconds / 60))
+#define STATUS_PRINT_MINUTES (starttime != 0 ? uint16_t(millis()/60000 - starttime/60000) : 0xFFFF)
+#endif //STATUS_SNAPSHOT
+
 #ifdef DOGLCD
 #include "dogm_lcd_implementation.h"
 #else
@@ -163,6 +258,12 @@ menuFunc_t currentMenu = lcd_status_screen; /* function pointer to the currently
 uint32_t lcd_next_update_millis;
 uint8_t lcd_status_update_delay;
 uint8_t lcdDrawUpdate = 2;                  /* Set to none-zero when the LCD needs to draw, decreased after every draw. Set to 2 in LCD routines so the LCD gets at least 1 full redraw (first redraw is partial) */
+#ifdef LCD_SLICED_UPDATE
+static unsigned long lcd_slice_deadline;    /* drawing is not put off for the planner past this time */
+  #ifdef DOGLCD
+static bool lcd_slice_pending = false;      /* a u8glib frame is partly drawn, its next page follows on the next lcd_update() */
+  #endif
+#endif
 
 //prevMenu and prevEncoderPosition are used to store the previous menu location when editing settings.
 menuFunc_t prevMenu = NULL;
@@ -181,13 +282,30 @@ static void lcd_status_screen()
 {
     if (lcd_status_update_delay)
         lcd_status_update_delay--;
+#ifdef STATUS_SNAPSHOT
+    else if (status_frame_start && status_snapshot_take()) // a second later again when nothing shown changed
+        lcdDrawUpdate = 1;
+    else
+        lcd_status_update_delay = 10;
+#elif defined(DOGLCD_STATUS_DIRTY_CHECK)
+    else if (lcd_implementation_status_changed()) // otherwise checked again on the next update
+        lcdDrawUpdate = 1;
+#else
     else
         lcdDrawUpdate = 1;
+#endif
     if (lcdDrawUpdate)
     {
+#ifdef STATUS_SNAPSHOT
+        if (lcd_status_update_delay && status_frame_start) // drawn for something else, e.g. a new status message
+            status_snapshot_take();
+#endif
         lcd_implementation_status_screen();
         lcd_status_update_delay = 10;   /* redraw the main screen every second. This is easier then trying keep track of all things that change on the screen */
     }
+#ifdef STATUS_SNAPSHOT
+    status_frame_start = false;
+#endif
 #ifdef ULTIPANEL
     if (LCD_CLICKED)
     {
@@ -249,7 +367,7 @@ static void lcd_sdcard_stop()
 {
     card.sdprinting = false;
     card.closefile();
-    quickStop();
+    quickstop_moves();
     if(SD_FINISHED_STEPPERRELEASE)
     {
         enquecommand_P(PSTR(SD_FINISHED_RELEASECOMMAND));
@@ -257,6 +375,132 @@ static void lcd_sdcard_stop()
     autotempShutdown();
 }
 
+/* Menus that are lists of settings are tables in PROGMEM, so a pass draws only the lines in view
+   and a click goes straight to the selected item, where START_MENU() runs the code of every item */
+enum {
+    menu_table_back, menu_table_submenu, menu_table_function, menu_table_gcode, menu_table_bool,
+    menu_table_int3, menu_table_float3, menu_table_float32, menu_table_float5, menu_table_float51,
+    menu_table_float52, menu_table_long5
+};
+typedef struct {
+    uint8_t type;
+    void* data;             // menu or function, G-code in PROGMEM or the value edited
+    float minValue, maxValue;
+    menuFunc_t callback;    // called after an edit, or NULL
+    char label[30];         // last, so drawing a line copies only what is before it
+} menu_table_item_t;
+#define MENU_TABLE_ITEM(type, label, data) { menu_table_ ## type, (void*)(data), 0, 0, NULL, label }
+#define MENU_TABLE_EDIT(type, label, data, minValue, maxValue) { menu_table_ ## type, (void*)(data), minValue, maxValue, NULL, label }
+#define MENU_TABLE_EDIT_CALLBACK(type, label, data, minValue, maxValue, callback) { menu_table_ ## type, (void*)(data), minValue, maxValue, callback, label }
+#define MENU_TABLE(items) lcd_menu_table(items, sizeof(items) / sizeof(items[0]))
+#define MENU_TABLE_ITEM_SIZE offsetof(menu_table_item_t, label)
+
+#define menu_table_draw_edit(_name, _type, _strFunc) \
+    case menu_table_ ## _name: \
+        lcd_implementation_drawmenu_setting_edit_generic(row, pstr, pre_char, _strFunc(*(_type*)item->data)); \
+        break;
+static void menu_table_draw(uint8_t row, const char* pstr, const menu_table_item_t* item, bool selected)
+{
+    char pre_char = selected ? '>' : ' ';
+    switch (item->type)
+    {
+    case menu_table_back:
+        if (selected) lcd_implementation_drawmenu_back_selected(row, pstr, item->data);
+        else lcd_implementation_drawmenu_back(row, pstr, item->data);
+        break;
+    case menu_table_submenu:
+        if (selected) lcd_implementation_drawmenu_submenu_selected(row, pstr, item->data);
+        else lcd_implementation_drawmenu_submenu(row, pstr, item->data);
+        break;
+    case menu_table_function:
+        if (selected) lcd_implementation_drawmenu_function_selected(row, pstr, item->data);
+        else lcd_implementation_drawmenu_function(row, pstr, item->data);
+        break;
+    case menu_table_gcode:
+        if (selected) lcd_implementation_drawmenu_gcode_selected(row, pstr, item->data);
+        else lcd_implementation_drawmenu_gcode(row, pstr, item->data);
+        break;
+    case menu_table_bool:
+        lcd_implementation_drawmenu_setting_edit_generic_P(row, pstr, pre_char, (*(bool*)item->data)?PSTR(MSG_ON):PSTR(MSG_OFF));
+        break;
+    menu_table_draw_edit(int3, int, itostr3)
+    menu_table_draw_edit(float3, float, ftostr3)
+    menu_table_draw_edit(float32, float, ftostr32)
+    menu_table_draw_edit(float5, float, ftostr5)
+    menu_table_draw_edit(float51, float, ftostr51)
+    menu_table_draw_edit(float52, float, ftostr52)
+    menu_table_draw_edit(long5, unsigned long, ftostr5)
+    }
+}
+
+#define menu_table_action_edit(_name, _type) \
+    case menu_table_ ## _name: \
+        if (item->callback) \
+            menu_action_setting_edit_callback_ ## _name (pstr, (_type*)item->data, item->minValue, item->maxValue, item->callback); \
+        else \
+            menu_action_setting_edit_ ## _name (pstr, (_type*)item->data, item->minValue, item->maxValue); \
+        break;
+static void menu_table_action(const char* pstr, const menu_table_item_t* item)
+{
+    switch (item->type)
+    {
+    case menu_table_back:
+        menu_action_back((menuFunc_t)item->data);
+        break;
+    case menu_table_submenu:
+        menu_action_submenu((menuFunc_t)item->data);
+        break;
+    case menu_table_function:
+        menu_action_function((menuFunc_t)item->data);
+        break;
+    case menu_table_gcode:
+        menu_action_gcode((const char*)item->data);
+        break;
+    case menu_table_bool:
+        menu_action_setting_edit_bool(pstr, (bool*)item->data);
+        if (item->callback)
+            (*item->callback)();
+        break;
+    menu_table_action_edit(int3, int)
+    menu_table_action_edit(float3, float)
+    menu_table_action_edit(float32, float)
+    menu_table_action_edit(float5, float)
+    menu_table_action_edit(float51, float)
+    menu_table_action_edit(float52, float)
+    menu_table_action_edit(long5, unsigned long)
+    }
+}
+
+static void lcd_menu_table(const menu_table_item_t* items, uint8_t count)
+{
+    menu_table_item_t item;
+    if (encoderPosition > 0x8000) encoderPosition = 0;
+    if (encoderPosition / ENCODER_STEPS_PER_MENU_ITEM >= count) encoderPosition = count * ENCODER_STEPS_PER_MENU_ITEM - 1;
+    uint8_t selected = encoderPosition / ENCODER_STEPS_PER_MENU_ITEM;
+    if (selected < currentMenuViewOffset)
+        currentMenuViewOffset = selected;
+    else if (selected >= currentMenuViewOffset + LCD_HEIGHT)
+    {
+        currentMenuViewOffset = selected - LCD_HEIGHT + 1;
+        lcdDrawUpdate = 1;
+    }
+    if (LCD_CLICKED)
+    {
+        memcpy_P(&item, &items[selected], MENU_TABLE_ITEM_SIZE);
+        lcd_quick_feedback();
+        menu_table_action(items[selected].label, &item);
+        return;
+    }
+    if (!lcdDrawUpdate)
+        return;
+    for (uint8_t row = 0; row < LCD_HEIGHT && currentMenuViewOffset + row < count; row++)
+    {
+        uint8_t nr = currentMenuViewOffset + row;
+        memcpy_P(&item, &items[nr], MENU_TABLE_ITEM_SIZE);
+        menu_table_draw(row, items[nr].label, &item, nr == selected);
+    }
+}
+
 /* Menu implementation */
 static void lcd_main_menu()
 {
@@ -309,7 +553,9 @@ static void lcd_babystep_x()
 {
     if (encoderPosition != 0)
     {
+        CRITICAL_SECTION_START; // the stepper interrupt takes them
         babystepsTodo[X_AXIS]+=(int)encoderPosition;
+        CRITICAL_SECTION_END;
         encoderPosition=0;
         lcdDrawUpdate = 1;
     }
@@ -329,7 +575,9 @@ static void lcd_babystep_y()
 {
     if (encoderPosition != 0)
     {
+        CRITICAL_SECTION_START; // the stepper interrupt takes them
         babystepsTodo[Y_AXIS]+=(int)encoderPosition;
+        CRITICAL_SECTION_END;
         encoderPosition=0;
         lcdDrawUpdate = 1;
     }
@@ -349,7 +597,9 @@ static void lcd_babystep_z()
 {
     if (encoderPosition != 0)
     {
+        CRITICAL_SECTION_START; // the stepper interrupt takes them
         babystepsTodo[Z_AXIS]+=BABYSTEP_Z_MULTIPLICATOR*(int)encoderPosition;
+        CRITICAL_SECTION_END;
         encoderPosition=0;
         lcdDrawUpdate = 1;
     }
@@ -366,42 +616,47 @@ static void lcd_babystep_z()
 }
 #endif //BABYSTEPPING
 
-static void lcd_tune_menu()
-{
-    START_MENU();
-    MENU_ITEM(back, MSG_MAIN, lcd_main_menu);
-    MENU_ITEM_EDIT(int3, MSG_SPEED, &feedmultiply, 10, 999);
-    MENU_ITEM_EDIT(int3, MSG_NOZZLE, &target_temperature[0], 0, HEATER_0_MAXTEMP - 15);
+#ifdef FILAMENTCHANGEENABLE
+static const char lcd_gcode_filamentchange[] PROGMEM = "M600";
+#endif
+static const menu_table_item_t lcd_tune_items[] PROGMEM = {
+    MENU_TABLE_ITEM(back, MSG_MAIN, lcd_main_menu),
+    MENU_TABLE_EDIT(int3, MSG_SPEED, &feedmultiply, 10, 999),
+    MENU_TABLE_EDIT(int3, MSG_NOZZLE, &target_temperature[0], 0, HEATER_0_MAXTEMP - 15),
 #if TEMP_SENSOR_1 != 0
-    MENU_ITEM_EDIT(int3, MSG_NOZZLE1, &target_temperature[1], 0, HEATER_1_MAXTEMP - 15);
+    MENU_TABLE_EDIT(int3, MSG_NOZZLE1, &target_temperature[1], 0, HEATER_1_MAXTEMP - 15),
 #endif
 #if TEMP_SENSOR_2 != 0
-    MENU_ITEM_EDIT(int3, MSG_NOZZLE2, &target_temperature[2], 0, HEATER_2_MAXTEMP - 15);
+    MENU_TABLE_EDIT(int3, MSG_NOZZLE2, &target_temperature[2], 0, HEATER_2_MAXTEMP - 15),
 #endif
 #if TEMP_SENSOR_BED != 0
-    MENU_ITEM_EDIT(int3, MSG_BED, &target_temperature_bed, 0, BED_MAXTEMP - 15);
+    MENU_TABLE_EDIT(int3, MSG_BED, &target_temperature_bed, 0, BED_MAXTEMP - 15),
 #endif
-    MENU_ITEM_EDIT(int3, MSG_FAN_SPEED, &fanSpeed, 0, 255);
-    MENU_ITEM_EDIT(int3, MSG_FLOW, &extrudemultiply, 10, 999);
-    MENU_ITEM_EDIT(int3, MSG_FLOW0, &extruder_multiply[0], 10, 999);
+    MENU_TABLE_EDIT(int3, MSG_FAN_SPEED, &fanSpeed, 0, 255),
+    MENU_TABLE_EDIT_CALLBACK(int3, MSG_FLOW, &extrudemultiply, 10, 999, reset_extrusion_factors),
+    MENU_TABLE_EDIT(int3, MSG_FLOW0, &extruder_multiply[0], 10, 999),
 #if TEMP_SENSOR_1 != 0
-    MENU_ITEM_EDIT(int3, MSG_FLOW1, &extruder_multiply[1], 10, 999);
+    MENU_TABLE_EDIT(int3, MSG_FLOW1, &extruder_multiply[1], 10, 999),
 #endif
 #if TEMP_SENSOR_2 != 0
-    MENU_ITEM_EDIT(int3, MSG_FLOW2, &extruder_multiply[2], 10, 999);
+    MENU_TABLE_EDIT(int3, MSG_FLOW2, &extruder_multiply[2], 10, 999),
 #endif
 
 #ifdef BABYSTEPPING
     #ifdef BABYSTEP_XY
-      MENU_ITEM(submenu, MSG_BABYSTEP_X, lcd_babystep_x);
-      MENU_ITEM(submenu, MSG_BABYSTEP_Y, lcd_babystep_y);
+      MENU_TABLE_ITEM(submenu, MSG_BABYSTEP_X, lcd_babystep_x),
+      MENU_TABLE_ITEM(submenu, MSG_BABYSTEP_Y, lcd_babystep_y),
     #endif //BABYSTEP_XY
-    MENU_ITEM(submenu, MSG_BABYSTEP_Z, lcd_babystep_z);
+    MENU_TABLE_ITEM(submenu, MSG_BABYSTEP_Z, lcd_babystep_z),
 #endif
 #ifdef FILAMENTCHANGEENABLE
-     MENU_ITEM(gcode, MSG_FILAMENTCHANGE, PSTR("M600"));
+     MENU_TABLE_ITEM(gcode, MSG_FILAMENTCHANGE, lcd_gcode_filamentchange),
 #endif
-    END_MENU();
+};
+
+static void lcd_tune_menu()
+{
+    MENU_TABLE(lcd_tune_items);
 }
 
 void lcd_preheat_pla0()
@@ -589,23 +844,38 @@ static void lcd_prepare_menu()
 float move_menu_scale;
 static void lcd_move_menu_axis();
 
+/* Queue the jog of axis, which was at from before it, to current_position */
+static void lcd_plan_manual_move(uint8_t axis, float from)
+{
+    float feed_rate = manual_feedrate[axis]/60;
+#ifdef SCARA
+    // the planner measures the jog in joint degrees, it takes as long as the jog in mm
+    float start[3] = { current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS] };
+    if (axis < 3)
+        start[axis] = from;
+    float start_motor[3];
+    memcpy(start_motor, kin_motor_position(start), sizeof(start_motor));
+    const float *motor = kin_motor_position(current_position);
+    feed_rate = kin_motor_feedrate(start_motor, motor, fabs(current_position[axis] - from), feed_rate);
+#else
+    const float *motor = kin_motor_position(current_position);
+#endif
+    plan_buffer_line(motor[X_AXIS], motor[Y_AXIS], motor[Z_AXIS], current_position[E_AXIS], feed_rate, active_extruder);
+}
+
 static void lcd_move_x()
 {
     if (encoderPosition != 0)
     {
         refresh_cmd_timeout();
+        float from = current_position[X_AXIS];
         current_position[X_AXIS] += float((int)encoderPosition) * move_menu_scale;
         if (min_software_endstops && current_position[X_AXIS] < X_MIN_POS)
             current_position[X_AXIS] = X_MIN_POS;
         if (max_software_endstops && current_position[X_AXIS] > X_MAX_POS)
             current_position[X_AXIS] = X_MAX_POS;
         encoderPosition = 0;
-        #ifdef DELTA
-        calculate_delta(current_position);
-        plan_buffer_line(delta[X_AXIS], delta[Y_AXIS], delta[Z_AXIS], current_position[E_AXIS], manual_feedrate[X_AXIS]/60, active_extruder);
-        #else
-        plan_buffer_line(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS], manual_feedrate[X_AXIS]/60, active_extruder);
-        #endif
+        lcd_plan_manual_move(X_AXIS, from);
         lcdDrawUpdate = 1;
     }
     if (lcdDrawUpdate)
@@ -624,18 +894,14 @@ static void lcd_move_y()
     if (encoderPosition != 0)
     {
         refresh_cmd_timeout();
+        float from = current_position[Y_AXIS];
         current_position[Y_AXIS] += float((int)encoderPosition) * move_menu_scale;
         if (min_software_endstops && current_position[Y_AXIS] < Y_MIN_POS)
             current_position[Y_AXIS] = Y_MIN_POS;
         if (max_software_endstops && current_position[Y_AXIS] > Y_MAX_POS)
             current_position[Y_AXIS] = Y_MAX_POS;
         encoderPosition = 0;
-        #ifdef DELTA
-        calculate_delta(current_position);
-        plan_buffer_line(delta[X_AXIS], delta[Y_AXIS], delta[Z_AXIS], current_position[E_AXIS], manual_feedrate[Y_AXIS]/60, active_extruder);
-        #else
-        plan_buffer_line(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS], manual_feedrate[Y_AXIS]/60, active_extruder);
-        #endif
+        lcd_plan_manual_move(Y_AXIS, from);
         lcdDrawUpdate = 1;
     }
     if (lcdDrawUpdate)
@@ -654,18 +920,14 @@ static void lcd_move_z()
     if (encoderPosition != 0)
     {
         refresh_cmd_timeout();
+        float from = current_position[Z_AXIS];
         current_position[Z_AXIS] += float((int)encoderPosition) * move_menu_scale;
         if (min_software_endstops && current_position[Z_AXIS] < Z_MIN_POS)
             current_position[Z_AXIS] = Z_MIN_POS;
         if (max_software_endstops && current_position[Z_AXIS] > Z_MAX_POS)
             current_position[Z_AXIS] = Z_MAX_POS;
         encoderPosition = 0;
-        #ifdef DELTA
-        calculate_delta(current_position);
-        plan_buffer_line(delta[X_AXIS], delta[Y_AXIS], delta[Z_AXIS], current_position[E_AXIS], manual_feedrate[Z_AXIS]/60, active_extruder);
-        #else
-        plan_buffer_line(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS], manual_feedrate[Z_AXIS]/60, active_extruder);
-        #endif
+        lcd_plan_manual_move(Z_AXIS, from);
         lcdDrawUpdate = 1;
     }
     if (lcdDrawUpdate)
@@ -683,14 +945,10 @@ static void lcd_move_e()
 {
     if (encoderPosition != 0)
     {
+        float from = current_position[E_AXIS];
         current_position[E_AXIS] += float((int)encoderPosition) * move_menu_scale;
         encoderPosition = 0;
-        #ifdef DELTA
-        calculate_delta(current_position);
-        plan_buffer_line(delta[X_AXIS], delta[Y_AXIS], delta[Z_AXIS], current_position[E_AXIS], manual_feedrate[E_AXIS]/60, active_extruder);
-        #else
-        plan_buffer_line(current_position[X_AXIS], current_position[Y_AXIS], current_position[Z_AXIS], current_position[E_AXIS], manual_feedrate[E_AXIS]/60, active_extruder);
-        #endif
+        lcd_plan_manual_move(E_AXIS, from);
         lcdDrawUpdate = 1;
     }
     if (lcdDrawUpdate)
@@ -767,107 +1025,115 @@ static void lcd_control_menu()
     END_MENU();
 }
 
-static void lcd_control_temperature_menu()
-{
-#ifdef PIDTEMP
-    // set up temp variables - undo the default scaling
-    raw_Ki = unscalePID_i(Ki);
-    raw_Kd = unscalePID_d(Kd);
-#endif
-
-    START_MENU();
-    MENU_ITEM(back, MSG_CONTROL, lcd_control_menu);
-    MENU_ITEM_EDIT(int3, MSG_NOZZLE, &target_temperature[0], 0, HEATER_0_MAXTEMP - 15);
+static const menu_table_item_t lcd_control_temperature_items[] PROGMEM = {
+    MENU_TABLE_ITEM(back, MSG_CONTROL, lcd_control_menu),
+    MENU_TABLE_EDIT(int3, MSG_NOZZLE, &target_temperature[0], 0, HEATER_0_MAXTEMP - 15),
 #if TEMP_SENSOR_1 != 0
-    MENU_ITEM_EDIT(int3, MSG_NOZZLE1, &target_temperature[1], 0, HEATER_1_MAXTEMP - 15);
+    MENU_TABLE_EDIT(int3, MSG_NOZZLE1, &target_temperature[1], 0, HEATER_1_MAXTEMP - 15),
 #endif
 #if TEMP_SENSOR_2 != 0
-    MENU_ITEM_EDIT(int3, MSG_NOZZLE2, &target_temperature[2], 0, HEATER_2_MAXTEMP - 15);
+    MENU_TABLE_EDIT(int3, MSG_NOZZLE2, &target_temperature[2], 0, HEATER_2_MAXTEMP - 15),
 #endif
 #if TEMP_SENSOR_BED != 0
-    MENU_ITEM_EDIT(int3, MSG_BED, &target_temperature_bed, 0, BED_MAXTEMP - 15);
+    MENU_TABLE_EDIT(int3, MSG_BED, &target_temperature_bed, 0, BED_MAXTEMP - 15),
 #endif
-    MENU_ITEM_EDIT(int3, MSG_FAN_SPEED, &fanSpeed, 0, 255);
+    MENU_TABLE_EDIT(int3, MSG_FAN_SPEED, &fanSpeed, 0, 255),
 #ifdef AUTOTEMP
-    MENU_ITEM_EDIT(bool, MSG_AUTOTEMP, &autotemp_enabled);
-    MENU_ITEM_EDIT(float3, MSG_MIN, &autotemp_min, 0, HEATER_0_MAXTEMP - 15);
-    MENU_ITEM_EDIT(float3, MSG_MAX, &autotemp_max, 0, HEATER_0_MAXTEMP - 15);
-    MENU_ITEM_EDIT(float32, MSG_FACTOR, &autotemp_factor, 0.0, 1.0);
+    MENU_TABLE_ITEM(bool, MSG_AUTOTEMP, &autotemp_enabled),
+    MENU_TABLE_EDIT(float3, MSG_MIN, &autotemp_min, 0, HEATER_0_MAXTEMP - 15),
+    MENU_TABLE_EDIT(float3, MSG_MAX, &autotemp_max, 0, HEATER_0_MAXTEMP - 15),
+    MENU_TABLE_EDIT(float32, MSG_FACTOR, &autotemp_factor, 0.0, 1.0),
 #endif
 #ifdef PIDTEMP
-    MENU_ITEM_EDIT(float52, MSG_PID_P, &Kp, 1, 9990);
+    MENU_TABLE_EDIT_CALLBACK(float52, MSG_PID_P, &Kp, 1, 9990, updatePID),
     // i is typically a small value so allows values below 1
-    MENU_ITEM_EDIT_CALLBACK(float52, MSG_PID_I, &raw_Ki, 0.01, 9990, copy_and_scalePID_i);
-    MENU_ITEM_EDIT_CALLBACK(float52, MSG_PID_D, &raw_Kd, 1, 9990, copy_and_scalePID_d);
+    MENU_TABLE_EDIT_CALLBACK(float52, MSG_PID_I, &raw_Ki, 0.01, 9990, copy_and_scalePID_i),
+    MENU_TABLE_EDIT_CALLBACK(float52, MSG_PID_D, &raw_Kd, 1, 9990, copy_and_scalePID_d),
 # ifdef PID_ADD_EXTRUSION_RATE
-    MENU_ITEM_EDIT(float3, MSG_PID_C, &Kc, 1, 9990);
+    MENU_TABLE_EDIT(float3, MSG_PID_C, &Kc, 1, 9990),
 # endif//PID_ADD_EXTRUSION_RATE
 #endif//PIDTEMP
-    MENU_ITEM(submenu, MSG_PREHEAT_PLA_SETTINGS, lcd_control_temperature_preheat_pla_settings_menu);
-    MENU_ITEM(submenu, MSG_PREHEAT_ABS_SETTINGS, lcd_control_temperature_preheat_abs_settings_menu);
-    END_MENU();
-}
+    MENU_TABLE_ITEM(submenu, MSG_PREHEAT_PLA_SETTINGS, lcd_control_temperature_preheat_pla_settings_menu),
+    MENU_TABLE_ITEM(submenu, MSG_PREHEAT_ABS_SETTINGS, lcd_control_temperature_preheat_abs_settings_menu),
+};
 
-static void lcd_control_temperature_preheat_pla_settings_menu()
+static void lcd_control_temperature_menu()
 {
-    START_MENU();
-    MENU_ITEM(back, MSG_TEMPERATURE, lcd_control_temperature_menu);
-    MENU_ITEM_EDIT(int3, MSG_FAN_SPEED, &plaPreheatFanSpeed, 0, 255);
-    MENU_ITEM_EDIT(int3, MSG_NOZZLE, &plaPreheatHotendTemp, 0, HEATER_0_MAXTEMP - 15);
+#ifdef PIDTEMP
+    // set up temp variables - undo the default scaling
+    raw_Ki = unscalePID_i(Ki);
+    raw_Kd = unscalePID_d(Kd);
+#endif
+
+    MENU_TABLE(lcd_control_temperature_items);
+}
+
+static const menu_table_item_t lcd_control_temperature_preheat_pla_settings_items[] PROGMEM = {
+    MENU_TABLE_ITEM(back, MSG_TEMPERATURE, lcd_control_temperature_menu),
+    MENU_TABLE_EDIT(int3, MSG_FAN_SPEED, &plaPreheatFanSpeed, 0, 255),
+    MENU_TABLE_EDIT(int3, MSG_NOZZLE, &plaPreheatHotendTemp, 0, HEATER_0_MAXTEMP - 15),
 #if TEMP_SENSOR_BED != 0
-    MENU_ITEM_EDIT(int3, MSG_BED, &plaPreheatHPBTemp, 0, BED_MAXTEMP - 15);
+    MENU_TABLE_EDIT(int3, MSG_BED, &plaPreheatHPBTemp, 0, BED_MAXTEMP - 15),
 #endif
 #ifdef EEPROM_SETTINGS
-    MENU_ITEM(function, MSG_STORE_EPROM, Config_StoreSettings);
+    MENU_TABLE_ITEM(function, MSG_STORE_EPROM, Config_StoreSettings),
 #endif
-    END_MENU();
-}
+};
 
-static void lcd_control_temperature_preheat_abs_settings_menu()
+static void lcd_control_temperature_preheat_pla_settings_menu()
 {
-    START_MENU();
-    MENU_ITEM(back, MSG_TEMPERATURE, lcd_control_temperature_menu);
-    MENU_ITEM_EDIT(int3, MSG_FAN_SPEED, &absPreheatFanSpeed, 0, 255);
-    MENU_ITEM_EDIT(int3, MSG_NOZZLE, &absPreheatHotendTemp, 0, HEATER_0_MAXTEMP - 15);
+    MENU_TABLE(lcd_control_temperature_preheat_pla_settings_items);
+}
+
+static const menu_table_item_t lcd_control_temperature_preheat_abs_settings_items[] PROGMEM = {
+    MENU_TABLE_ITEM(back, MSG_TEMPERATURE, lcd_control_temperature_menu),
+    MENU_TABLE_EDIT(int3, MSG_FAN_SPEED, &absPreheatFanSpeed, 0, 255),
+    MENU_TABLE_EDIT(int3, MSG_NOZZLE, &absPreheatHotendTemp, 0, HEATER_0_MAXTEMP - 15),
 #if TEMP_SENSOR_BED != 0
-    MENU_ITEM_EDIT(int3, MSG_BED, &absPreheatHPBTemp, 0, BED_MAXTEMP - 15);
+    MENU_TABLE_EDIT(int3, MSG_BED, &absPreheatHPBTemp, 0, BED_MAXTEMP - 15),
 #endif
 #ifdef EEPROM_SETTINGS
-    MENU_ITEM(function, MSG_STORE_EPROM, Config_StoreSettings);
+    MENU_TABLE_ITEM(function, MSG_STORE_EPROM, Config_StoreSettings),
 #endif
-    END_MENU();
-}
+};
 
-static void lcd_control_motion_menu()
+static void lcd_control_temperature_preheat_abs_settings_menu()
 {
-    START_MENU();
-    MENU_ITEM(back, MSG_CONTROL, lcd_control_menu);
+    MENU_TABLE(lcd_control_temperature_preheat_abs_settings_items);
+}
+
+static const menu_table_item_t lcd_control_motion_items[] PROGMEM = {
+    MENU_TABLE_ITEM(back, MSG_CONTROL, lcd_control_menu),
 #ifdef ENABLE_AUTO_BED_LEVELING
-    MENU_ITEM_EDIT(float32, MSG_ZPROBE_ZOFFSET, &zprobe_zoffset, 0.5, 50);
-#endif
-    MENU_ITEM_EDIT(float5, MSG_ACC, &acceleration, 500, 99000);
-    MENU_ITEM_EDIT(float3, MSG_VXY_JERK, &max_xy_jerk, 1, 990);
-    MENU_ITEM_EDIT(float52, MSG_VZ_JERK, &max_z_jerk, 0.1, 990);
-    MENU_ITEM_EDIT(float3, MSG_VE_JERK, &max_e_jerk, 1, 990);
-    MENU_ITEM_EDIT(float3, MSG_VMAX MSG_X, &max_feedrate[X_AXIS], 1, 999);
-    MENU_ITEM_EDIT(float3, MSG_VMAX MSG_Y, &max_feedrate[Y_AXIS], 1, 999);
-    MENU_ITEM_EDIT(float3, MSG_VMAX MSG_Z, &max_feedrate[Z_AXIS], 1, 999);
-    MENU_ITEM_EDIT(float3, MSG_VMAX MSG_E, &max_feedrate[E_AXIS], 1, 999);
-    MENU_ITEM_EDIT(float3, MSG_VMIN, &minimumfeedrate, 0, 999);
-    MENU_ITEM_EDIT(float3, MSG_VTRAV_MIN, &mintravelfeedrate, 0, 999);
-    MENU_ITEM_EDIT_CALLBACK(long5, MSG_AMAX MSG_X, &max_acceleration_units_per_sq_second[X_AXIS], 100, 99000, reset_acceleration_rates);
-    MENU_ITEM_EDIT_CALLBACK(long5, MSG_AMAX MSG_Y, &max_acceleration_units_per_sq_second[Y_AXIS], 100, 99000, reset_acceleration_rates);
-    MENU_ITEM_EDIT_CALLBACK(long5, MSG_AMAX MSG_Z, &max_acceleration_units_per_sq_second[Z_AXIS], 100, 99000, reset_acceleration_rates);
-    MENU_ITEM_EDIT_CALLBACK(long5, MSG_AMAX MSG_E, &max_acceleration_units_per_sq_second[E_AXIS], 100, 99000, reset_acceleration_rates);
-    MENU_ITEM_EDIT(float5, MSG_A_RETRACT, &retract_acceleration, 100, 99000);
-    MENU_ITEM_EDIT(float52, MSG_XSTEPS, &axis_steps_per_unit[X_AXIS], 5, 9999);
-    MENU_ITEM_EDIT(float52, MSG_YSTEPS, &axis_steps_per_unit[Y_AXIS], 5, 9999);
-    MENU_ITEM_EDIT(float51, MSG_ZSTEPS, &axis_steps_per_unit[Z_AXIS], 5, 9999);
-    MENU_ITEM_EDIT(float51, MSG_ESTEPS, &axis_steps_per_unit[E_AXIS], 5, 9999);
+    MENU_TABLE_EDIT(float32, MSG_ZPROBE_ZOFFSET, &zprobe_zoffset, 0.5, 50),
+#endif
+    MENU_TABLE_EDIT(float5, MSG_ACC, &acceleration, 500, 99000),
+    MENU_TABLE_EDIT(float3, MSG_VXY_JERK, &max_xy_jerk, 1, 990),
+    MENU_TABLE_EDIT(float52, MSG_VZ_JERK, &max_z_jerk, 0.1, 990),
+    MENU_TABLE_EDIT(float3, MSG_VE_JERK, &max_e_jerk, 1, 990),
+    MENU_TABLE_EDIT(float3, MSG_VMAX MSG_X, &max_feedrate[X_AXIS], 1, 999),
+    MENU_TABLE_EDIT(float3, MSG_VMAX MSG_Y, &max_feedrate[Y_AXIS], 1, 999),
+    MENU_TABLE_EDIT(float3, MSG_VMAX MSG_Z, &max_feedrate[Z_AXIS], 1, 999),
+    MENU_TABLE_EDIT(float3, MSG_VMAX MSG_E, &max_feedrate[E_AXIS], 1, 999),
+    MENU_TABLE_EDIT(float3, MSG_VMIN, &minimumfeedrate, 0, 999),
+    MENU_TABLE_EDIT(float3, MSG_VTRAV_MIN, &mintravelfeedrate, 0, 999),
+    MENU_TABLE_EDIT_CALLBACK(long5, MSG_AMAX MSG_X, &max_acceleration_units_per_sq_second[X_AXIS], 100, 99000, reset_acceleration_rates),
+    MENU_TABLE_EDIT_CALLBACK(long5, MSG_AMAX MSG_Y, &max_acceleration_units_per_sq_second[Y_AXIS], 100, 99000, reset_acceleration_rates),
+    MENU_TABLE_EDIT_CALLBACK(long5, MSG_AMAX MSG_Z, &max_acceleration_units_per_sq_second[Z_AXIS], 100, 99000, reset_acceleration_rates),
+    MENU_TABLE_EDIT_CALLBACK(long5, MSG_AMAX MSG_E, &max_acceleration_units_per_sq_second[E_AXIS], 100, 99000, reset_acceleration_rates),
+    MENU_TABLE_EDIT(float5, MSG_A_RETRACT, &retract_acceleration, 100, 99000),
+    MENU_TABLE_EDIT(float52, MSG_XSTEPS, &axis_steps_per_unit[X_AXIS], 5, 9999),
+    MENU_TABLE_EDIT(float52, MSG_YSTEPS, &axis_steps_per_unit[Y_AXIS], 5, 9999),
+    MENU_TABLE_EDIT(float51, MSG_ZSTEPS, &axis_steps_per_unit[Z_AXIS], 5, 9999),
+    MENU_TABLE_EDIT_CALLBACK(float51, MSG_ESTEPS, &axis_steps_per_unit[E_AXIS], 5, 9999, reset_extrusion_factors),
 #ifdef ABORT_ON_ENDSTOP_HIT_FEATURE_ENABLED
-    MENU_ITEM_EDIT(bool, MSG_ENDSTOP_ABORT, &abort_on_endstop_hit);
+    MENU_TABLE_ITEM(bool, MSG_ENDSTOP_ABORT, &abort_on_endstop_hit),
 #endif
-    END_MENU();
+};
+
+static void lcd_control_motion_menu()
+{
+    MENU_TABLE(lcd_control_motion_items);
 }
 
 #ifdef DOGLCD
@@ -896,17 +1162,19 @@ static void lcd_set_contrast()
 #endif
 
 #ifdef FWRETRACT
+static const menu_table_item_t lcd_control_retract_items[] PROGMEM = {
+    MENU_TABLE_ITEM(back, MSG_CONTROL, lcd_control_menu),
+    MENU_TABLE_ITEM(bool, MSG_AUTORETRACT, &autoretract_enabled),
+    MENU_TABLE_EDIT(float52, MSG_CONTROL_RETRACT, &retract_length, 0, 100),
+    MENU_TABLE_EDIT(float3, MSG_CONTROL_RETRACTF, &retract_feedrate, 1, 999),
+    MENU_TABLE_EDIT(float52, MSG_CONTROL_RETRACT_ZLIFT, &retract_zlift, 0, 999),
+    MENU_TABLE_EDIT(float52, MSG_CONTROL_RETRACT_RECOVER, &retract_recover_length, 0, 100),
+    MENU_TABLE_EDIT(float3, MSG_CONTROL_RETRACT_RECOVERF, &retract_recover_feedrate, 1, 999),
+};
+
 static void lcd_control_retract_menu()
 {
-    START_MENU();
-    MENU_ITEM(back, MSG_CONTROL, lcd_control_menu);
-    MENU_ITEM_EDIT(bool, MSG_AUTORETRACT, &autoretract_enabled);
-    MENU_ITEM_EDIT(float52, MSG_CONTROL_RETRACT, &retract_length, 0, 100);
-    MENU_ITEM_EDIT(float3, MSG_CONTROL_RETRACTF, &retract_feedrate, 1, 999);
-    MENU_ITEM_EDIT(float52, MSG_CONTROL_RETRACT_ZLIFT, &retract_zlift, 0, 999);
-    MENU_ITEM_EDIT(float52, MSG_CONTROL_RETRACT_RECOVER, &retract_recover_length, 0, 100);
-    MENU_ITEM_EDIT(float3, MSG_CONTROL_RETRACT_RECOVERF, &retract_recover_feedrate, 1, 999);
-    END_MENU();
+    MENU_TABLE(lcd_control_retract_items);
 }
 #endif
 
@@ -944,7 +1212,7 @@ void lcd_sdcard_menu()
     {
         if (_menuItemNr == _lineNr)
         {
-            #ifndef SDCARD_RATHERRECENTFIRST
+            #if !defined(SDCARD_RATHERRECENTFIRST) || defined(SDCARD_SORT)
               card.getfilename(i);
             #else
               card.getfilename(fileCnt-1-i);
@@ -1120,6 +1388,12 @@ static void menu_action_setting_edit_bool(const char* pstr, bool* ptr)
 #endif//ULTIPANEL
 
 /** LCD API **/
+#if defined(ENCODER_INTERRUPTS) && defined(NEWPANEL)
+static bool encoder_polled; // an encoder pin has no pin change interrupt, the temperature ISR reads them
+static void lcd_encoder_read();
+static bool lcd_encoder_interrupt(uint8_t pin);
+#endif
+
 void lcd_init()
 {
     lcd_implementation_init();
@@ -1133,6 +1407,11 @@ void lcd_init()
     pinMode(BTN_ENC,INPUT);
     WRITE(BTN_ENC,HIGH);
   #endif
+  #ifdef ENCODER_INTERRUPTS
+    lcd_encoder_read(); // start from the current position of the encoder
+    encoder_polled = !lcd_encoder_interrupt(BTN_EN1);
+    encoder_polled |= !lcd_encoder_interrupt(BTN_EN2);
+  #endif
   #ifdef REPRAPWORLD_KEYPAD
     pinMode(SHIFT_CLK,OUTPUT);
     pinMode(SHIFT_LD,OUTPUT);
@@ -1166,6 +1445,9 @@ void lcd_init()
 #endif//(SDCARDDETECT > 0)
 #ifdef LCD_HAS_SLOW_BUTTONS
     slow_buttons = 0;
+#endif
+#ifdef FAST_BOOT
+    lcd_next_update_millis = millis() + 1000; // the splash screen stays up while the main loop runs
 #endif
     lcd_buttons_update();
 #ifdef ULTIPANEL
@@ -1173,10 +1455,57 @@ void lcd_init()
 #endif
 }
 
-void lcd_update()
+static unsigned long timeoutToStatus = 0;
+
+#ifdef DOGLCD
+/* Draw one u8glib page of the current menu. Returns true when another page of the frame follows */
+static bool lcd_draw_page()
 {
-    static unsigned long timeoutToStatus = 0;
+    u8g.setFont(u8g_font_6x10_marlin);
+    u8g.setPrintPos(125,0);
+    if (blink % 2) u8g.setColorIndex(1); else u8g.setColorIndex(0); // Set color for the alive dot
+    u8g.drawPixel(127,63); // draw alive dot
+    u8g.setColorIndex(1); // black on white
+    (*currentMenu)();
+    return lcdDrawUpdate && u8g.nextPage(); // Terminate display update, when nothing new to draw. This must be done before the last dogm.next()
+}
+#endif
+
+/* Book-keeping after a whole frame has been drawn */
+static void lcd_update_done()
+{
+#ifdef LCD_HAS_STATUS_INDICATORS
+    lcd_implementation_update_indicators();
+#endif
+
+#ifdef ULTIPANEL
+    if(timeoutToStatus < millis() && currentMenu != lcd_status_screen)
+    {
+        lcd_return_to_status();
+        lcdDrawUpdate = 2;
+    }
+#endif//ULTIPANEL
+    if (lcdDrawUpdate == 2)
+        lcd_implementation_clear();
+    if (lcdDrawUpdate)
+        lcdDrawUpdate--;
+    lcd_next_update_millis = millis() + 100;
+#ifdef LCD_SLICED_UPDATE
+    lcd_slice_deadline = lcd_next_update_millis + LCD_SLICE_MAX_DEFER;
+#endif
+}
 
+#ifdef LCD_SLICED_UPDATE
+/* True while the planner is running low and the next slice of drawing should wait for it */
+static bool lcd_slice_defer()
+{
+    uint8_t moves = movesplanned();
+    return moves > 0 && moves < LCD_SLICE_MIN_PLANNED && millis() < lcd_slice_deadline;
+}
+#endif
+
+void lcd_update()
+{
     #ifdef LCD_HAS_SLOW_BUTTONS
     slow_buttons = lcd_implementation_read_slow_buttons(); // buttons which take too long to read in interrupt context
     #endif
@@ -1203,8 +1532,29 @@ void lcd_update()
     }
     #endif//CARDINSERTED
 
+#ifdef LCD_SLICED_UPDATE
+  #ifdef DOGLCD
+    if (lcd_slice_pending)
+    {
+        TRACE_SPAN(TRACE_LCD_UPDATE);
+        if (!lcd_slice_defer() && !lcd_draw_page())
+        {
+            lcd_slice_pending = false;
+            lcd_update_done();
+        }
+        return;
+    }
+  #endif
+    if (lcd_slice_defer())
+        return;
+#endif
+
     if (lcd_next_update_millis < millis())
     {
+        TRACE_SPAN(TRACE_LCD_UPDATE);
+#ifdef STATUS_SNAPSHOT
+        status_frame_start = true;
+#endif
 #ifdef ULTIPANEL
 		#ifdef REPRAPWORLD_KEYPAD
         	if (REPRAPWORLD_KEYPAD_MOVE_Z_UP) {
@@ -1243,36 +1593,22 @@ void lcd_update()
 #ifdef DOGLCD        // Changes due to different driver architecture of the DOGM display
         blink++;     // Variable for fan animation and alive dot
         u8g.firstPage();
-        do
+  #ifdef LCD_SLICED_UPDATE
+        if (lcd_draw_page())
         {
-            u8g.setFont(u8g_font_6x10_marlin);
-            u8g.setPrintPos(125,0);
-            if (blink % 2) u8g.setColorIndex(1); else u8g.setColorIndex(0); // Set color for the alive dot
-            u8g.drawPixel(127,63); // draw alive dot
-            u8g.setColorIndex(1); // black on white
-            (*currentMenu)();
-            if (!lcdDrawUpdate)  break; // Terminate display update, when nothing new to draw. This must be done before the last dogm.next()
-        } while( u8g.nextPage() );
+            lcd_slice_pending = true; // the remaining pages follow on the next passes
+            return;
+        }
+  #else
+        while (lcd_draw_page());
+  #endif
 #else
         (*currentMenu)();
+  #ifdef LCD_SHADOW_BUFFER
+        lcd_implementation_flush();
+  #endif
 #endif
-
-#ifdef LCD_HAS_STATUS_INDICATORS
-        lcd_implementation_update_indicators();
-#endif
-
-#ifdef ULTIPANEL
-        if(timeoutToStatus < millis() && currentMenu != lcd_status_screen)
-        {
-            lcd_return_to_status();
-            lcdDrawUpdate = 2;
-        }
-#endif//ULTIPANEL
-        if (lcdDrawUpdate == 2)
-            lcd_implementation_clear();
-        if (lcdDrawUpdate)
-            lcdDrawUpdate--;
-        lcd_next_update_millis = millis() + 100;
+        lcd_update_done();
     }
 }
 
@@ -1312,13 +1648,116 @@ void lcd_setcontrast(uint8_t value)
 #endif
 
 #ifdef ULTIPANEL
+/* Count the quadrature steps between the last and the new state of the encoder pins */
+static void lcd_encoder_decode(uint8_t enc)
+{
+    if(enc != lastEncoderBits)
+    {
+        switch(enc)
+        {
+        case encrot0:
+            if(lastEncoderBits==encrot3)
+                encoderDiff++;
+            else if(lastEncoderBits==encrot1)
+                encoderDiff--;
+            break;
+        case encrot1:
+            if(lastEncoderBits==encrot0)
+                encoderDiff++;
+            else if(lastEncoderBits==encrot2)
+                encoderDiff--;
+            break;
+        case encrot2:
+            if(lastEncoderBits==encrot1)
+                encoderDiff++;
+            else if(lastEncoderBits==encrot3)
+                encoderDiff--;
+            break;
+        case encrot3:
+            if(lastEncoderBits==encrot2)
+                encoderDiff++;
+            else if(lastEncoderBits==encrot0)
+                encoderDiff--;
+            break;
+        }
+    }
+    lastEncoderBits = enc;
+}
+
+#if defined(ENCODER_INTERRUPTS) && defined(NEWPANEL)
+static void lcd_encoder_read()
+{
+    uint8_t enc=0;
+    if(READ(BTN_EN1)==0)
+        enc|=(1<<0);
+    if(READ(BTN_EN2)==0)
+        enc|=(1<<1);
+    lcd_encoder_decode(enc);
+}
+
+void lcd_encoder_pin_changed()
+{
+    if(!encoder_polled)
+        lcd_encoder_read();
+}
+
+void lcd_buttons_poll()
+{
+    if(encoder_polled)
+        lcd_encoder_read();
+}
+
+#if !defined(ENDSTOP_INTERRUPTS) && !defined(AXIS_ENCODERS) // otherwise stepper.cpp has the vectors and passes the changes on
+#ifdef PCINT0_vect
+ISR(PCINT0_vect) { lcd_encoder_pin_changed(); }
+#endif
+#ifdef PCINT1_vect
+ISR(PCINT1_vect) { lcd_encoder_pin_changed(); }
+#endif
+#ifdef PCINT2_vect
+ISR(PCINT2_vect) { lcd_encoder_pin_changed(); }
+#endif
+#ifdef PCINT3_vect
+ISR(PCINT3_vect) { lcd_encoder_pin_changed(); }
+#endif
+#endif
+
+// Enable the pin change interrupt of an encoder pin, false if it has none
+static bool lcd_encoder_interrupt(uint8_t pin)
+{
+  #ifdef digitalPinToPCICR
+    if (digitalPinToPCICR(pin) != NULL) {
+      *digitalPinToPCMSK(pin) |= _BV(digitalPinToPCMSKbit(pin));
+      *digitalPinToPCICR(pin) |= _BV(digitalPinToPCICRbit(pin));
+      return true;
+    }
+  #endif
+  return false;
+}
+#elif defined(ENCODER_INTERRUPTS)
+void lcd_encoder_pin_changed() {}
+void lcd_buttons_poll() {}
+#endif
+
+#ifdef ENCODER_INTERRUPTS
+/* Called from lcd_update(), reads the buttons and shift registers every LCD_BUTTONS_READ_MS at most */
+#else
 /* Warning: This function is called from interrupt context */
+#endif
 void lcd_buttons_update()
 {
+#ifdef ENCODER_INTERRUPTS
+    static unsigned long next_read;
+    if((long)(millis() - next_read) < 0)
+        return;
+    next_read = millis() + LCD_BUTTONS_READ_MS;
+#endif
 #ifdef NEWPANEL
     uint8_t newbutton=0;
+  #ifndef ENCODER_INTERRUPTS
     if(READ(BTN_EN1)==0)  newbutton|=EN_A;
     if(READ(BTN_EN2)==0)  newbutton|=EN_B;
+  #endif
   #if BTN_ENC > 0
     if((blocking_enc<millis()) && (READ(BTN_ENC)==0))
         newbutton |= EN_C;
@@ -1357,43 +1796,15 @@ void lcd_buttons_update()
     buttons=~newbutton; //invert it, because a pressed switch produces a logical 0
 #endif//!NEWPANEL
 
+  #if !defined(ENCODER_INTERRUPTS) || !defined(NEWPANEL)
     //manage encoder rotation
     uint8_t enc=0;
     if(buttons&EN_A)
         enc|=(1<<0);
     if(buttons&EN_B)
         enc|=(1<<1);
-    if(enc != lastEncoderBits)
-    {
-        switch(enc)
-        {
-        case encrot0:
-            if(lastEncoderBits==encrot3)
-                encoderDiff++;
-            else if(lastEncoderBits==encrot1)
-                encoderDiff--;
-            break;
-        case encrot1:
-            if(lastEncoderBits==encrot0)
-                encoderDiff++;
-            else if(lastEncoderBits==encrot2)
-                encoderDiff--;
-            break;
-        case encrot2:
-            if(lastEncoderBits==encrot1)
-                encoderDiff++;
-            else if(lastEncoderBits==encrot3)
-                encoderDiff--;
-            break;
-        case encrot3:
-            if(lastEncoderBits==encrot2)
-                encoderDiff++;
-            else if(lastEncoderBits==encrot0)
-                encoderDiff--;
-            break;
-        }
-    }
-    lastEncoderBits = enc;
+    lcd_encoder_decode(enc);
+  #endif
 }
 
 void lcd_buzz(long duration, uint16_t freq)
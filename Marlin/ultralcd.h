@@ -27,12 +27,19 @@
 
   #ifdef ULTIPANEL
   void lcd_buttons_update();
+  #ifdef ENCODER_INTERRUPTS
+  void lcd_buttons_poll();        // from the temperature ISR, reads the encoder pins that have no pin change interrupt
+  void lcd_encoder_pin_changed(); // from the pin change interrupts
+  #else
+  FORCE_INLINE void lcd_buttons_poll() { lcd_buttons_update(); }
+  #endif
   extern volatile uint8_t buttons;  //the last checked buttons in a bit array.
   #ifdef REPRAPWORLD_KEYPAD
     extern volatile uint8_t buttons_reprapworld_keypad; // to store the keypad shift register values
   #endif
   #else
   FORCE_INLINE void lcd_buttons_update() {}
+  FORCE_INLINE void lcd_buttons_poll() {}
   #endif
 
   extern int plaPreheatHotendTemp;
@@ -90,6 +97,7 @@
   FORCE_INLINE void lcd_init() {}
   FORCE_INLINE void lcd_setstatus(const char* message) {}
   FORCE_INLINE void lcd_buttons_update() {}
+  FORCE_INLINE void lcd_buttons_poll() {}
   FORCE_INLINE void lcd_reset_alert_level() {}
   FORCE_INLINE void lcd_buzz(long duration,uint16_t freq) {}
 
@@ -136,6 +136,74 @@ extern volatile uint16_t buttons;  //an extended version of the last checked but
 
 #endif //ULTIPANEL
 
+#ifdef LCD_SHADOW_BUFFER
+// Wraps the LCD class and keeps a copy of the characters on the display. Drawing only changes the copy,
+// sendChanges() then transmits the characters that differ, setting the cursor only at gaps between them.
+template<class Glass> class LcdShadow : public Glass
+{
+public:
+    template<class A> LcdShadow(A a) : Glass(a) { reset(); }
+    template<class A, class B> LcdShadow(A a, B b) : Glass(a, b) { reset(); }
+    template<class A, class B, class C> LcdShadow(A a, B b, C c) : Glass(a, b, c) { reset(); }
+    template<class A, class B, class C, class D, class E, class F> LcdShadow(A a, B b, C c, D d, E e, F f) : Glass(a, b, c, d, e, f) { reset(); }
+    template<class A, class B, class C, class D, class E, class F, class G, class H> LcdShadow(A a, B b, C c, D d, E e, F f, G g, H h) : Glass(a, b, c, d, e, f, g, h) { reset(); }
+
+    void clear() { Glass::clear(); reset(); }
+    void setCursor(uint8_t col, uint8_t row) { cursor_col = col; cursor_row = row; }
+#if defined(ARDUINO) && ARDUINO >= 100
+    virtual size_t write(uint8_t c) { put(c); return 1; }
+    using Print::write;
+#else
+    virtual void write(uint8_t c) { put(c); }
+#endif
+
+    void sendChanges()
+    {
+        for (uint8_t row = 0; row < LCD_HEIGHT; row++)
+        {
+            if (!dirty[row])
+                continue;
+            uint8_t next_col = 0xFF; // where the display cursor is after the last character sent
+            for (uint8_t col = 0; col < LCD_WIDTH; col++)
+            {
+                if (!(dirty[row] & (1UL << col)))
+                    continue;
+                if (col != next_col)
+                    Glass::setCursor(col, row);
+                Glass::write((uint8_t)text[row][col]);
+                next_col = col + 1;
+            }
+            dirty[row] = 0;
+        }
+    }
+
+private:
+    char text[LCD_HEIGHT][LCD_WIDTH];
+    uint32_t dirty[LCD_HEIGHT];  // one bit per column that differs from the display
+    uint8_t cursor_col, cursor_row;
+
+    void reset()
+    {
+        memset(text, ' ', sizeof(text));
+        memset(dirty, 0, sizeof(dirty));
+        cursor_col = cursor_row = 0;
+    }
+    void put(uint8_t c)
+    {
+        // Like the display, characters past the end of the row are not shown
+        if (cursor_row < LCD_HEIGHT && cursor_col < LCD_WIDTH && text[cursor_row][cursor_col] != (char)c)
+        {
+            text[cursor_row][cursor_col] = c;
+            dirty[cursor_row] |= 1UL << cursor_col;
+        }
+        cursor_col++;
+    }
+};
+  #define LCD_INSTANCE_CLASS LcdShadow<LCD_CLASS>
+#else
+  #define LCD_INSTANCE_CLASS LCD_CLASS
+#endif
+
 ////////////////////////////////////
 // Create LCD class instance and chipset-specific information
 #if defined(LCD_I2C_TYPE_PCF8575)
@@ -153,7 +221,7 @@ extern volatile uint16_t buttons;  //an extended version of the last checked but
   #include <LCD.h>
   #include <LiquidCrystal_I2C.h>
   #define LCD_CLASS LiquidCrystal_I2C
-  LCD_CLASS lcd(LCD_I2C_ADDRESS,LCD_I2C_PIN_EN,LCD_I2C_PIN_RW,LCD_I2C_PIN_RS,LCD_I2C_PIN_D4,LCD_I2C_PIN_D5,LCD_I2C_PIN_D6,LCD_I2C_PIN_D7);
+  LCD_INSTANCE_CLASS lcd(LCD_I2C_ADDRESS,LCD_I2C_PIN_EN,LCD_I2C_PIN_RW,LCD_I2C_PIN_RS,LCD_I2C_PIN_D4,LCD_I2C_PIN_D5,LCD_I2C_PIN_D6,LCD_I2C_PIN_D7);
   
 #elif defined(LCD_I2C_TYPE_MCP23017)
   //for the LED indicators (which maybe mapped to different things in lcd_implementation_update_indicators())
@@ -166,18 +234,18 @@ extern volatile uint16_t buttons;  //an extended version of the last checked but
   #include <Wire.h>
   #include <LiquidTWI2.h>
   #define LCD_CLASS LiquidTWI2
-  LCD_CLASS lcd(LCD_I2C_ADDRESS);
+  LCD_INSTANCE_CLASS lcd(LCD_I2C_ADDRESS);
   
 #elif defined(LCD_I2C_TYPE_MCP23008)
   #include <Wire.h>
   #include <LiquidTWI2.h>
   #define LCD_CLASS LiquidTWI2
-  LCD_CLASS lcd(LCD_I2C_ADDRESS);  
+  LCD_INSTANCE_CLASS lcd(LCD_I2C_ADDRESS);  
 
 #elif defined(LCD_I2C_TYPE_PCA8574)
     #include <LiquidCrystal_I2C.h>
     #define LCD_CLASS LiquidCrystal_I2C
-    LCD_CLASS lcd(LCD_I2C_ADDRESS, LCD_WIDTH, LCD_HEIGHT);
+    LCD_INSTANCE_CLASS lcd(LCD_I2C_ADDRESS, LCD_WIDTH, LCD_HEIGHT);
     
 // 2 wire Non-latching LCD SR from:
 // https://bitbucket.org/fmalpartida/new-liquidcrystal/wiki/schematics#!shiftregister-connection 
@@ -186,7 +254,7 @@ extern volatile uint16_t buttons;  //an extended version of the last checked but
   #include <LCD.h>
   #include <LiquidCrystal_SR.h>
   #define LCD_CLASS LiquidCrystal_SR
-  LCD_CLASS lcd(SR_DATA_PIN, SR_CLK_PIN);
+  LCD_INSTANCE_CLASS lcd(SR_DATA_PIN, SR_CLK_PIN);
 
 #else
   // Standard directly connected LCD implementations
@@ -197,7 +265,7 @@ extern volatile uint16_t buttons;  //an extended version of the last checked but
     #include <LiquidCrystal.h>
     #define LCD_CLASS LiquidCrystal
   #endif  
-  LCD_CLASS lcd(LCD_PINS_RS, LCD_PINS_ENABLE, LCD_PINS_D4, LCD_PINS_D5,LCD_PINS_D6,LCD_PINS_D7);  //RS,Enable,D4,D5,D6,D7
+  LCD_INSTANCE_CLASS lcd(LCD_PINS_RS, LCD_PINS_ENABLE, LCD_PINS_D4, LCD_PINS_D5,LCD_PINS_D6,LCD_PINS_D7);  //RS,Enable,D4,D5,D6,D7
 #endif
 
 /* Custom characters defined in the first 8 characters of the LCD */
@@ -335,6 +403,13 @@ static void lcd_implementation_clear()
 {
     lcd.clear();
 }
+#ifdef LCD_SHADOW_BUFFER
+/* Send what the last redraw changed to the display */
+static void lcd_implementation_flush()
+{
+    lcd.sendChanges();
+}
+#endif
 /* Arduino < 1.0.0 is missing a function to print PROGMEM strings, so we need to implement our own */
 static void lcd_printPGM(const char* str)
 {
@@ -374,8 +449,8 @@ Possible status screens:
 */
 static void lcd_implementation_status_screen()
 {
-    int tHotend=int(degHotend(0) + 0.5);
-    int tTarget=int(degTargetHotend(0) + 0.5);
+    int tHotend=STATUS_HOTEND(0);
+    int tTarget=STATUS_HOTEND_TARGET(0);
 
 #if LCD_WIDTH < 20
     lcd.setCursor(0, 0);
@@ -387,12 +462,12 @@ static void lcd_implementation_status_screen()
     //If we have an 2nd extruder or heated bed, show that in the top right corner
     lcd.setCursor(8, 0);
 #  if EXTRUDERS > 1
-    tHotend = int(degHotend(1) + 0.5);
-    tTarget = int(degTargetHotend(1) + 0.5);
+    tHotend = STATUS_HOTEND(1);
+    tTarget = STATUS_HOTEND_TARGET(1);
     lcd.print(LCD_STR_THERMOMETER[0]);
 #  else//Heated bed
-    tHotend=int(degBed() + 0.5);
-    tTarget=int(degTargetBed() + 0.5);
+    tHotend=STATUS_BED;
+    tTarget=STATUS_BED_TARGET;
     lcd.print(LCD_STR_BEDTEMP[0]);
 #  endif
     lcd.print(itostr3(tHotend));
@@ -414,12 +489,12 @@ static void lcd_implementation_status_screen()
     //If we have an 2nd extruder or heated bed, show that in the top right corner
     lcd.setCursor(10, 0);
 #  if EXTRUDERS > 1
-    tHotend = int(degHotend(1) + 0.5);
-    tTarget = int(degTargetHotend(1) + 0.5);
+    tHotend = STATUS_HOTEND(1);
+    tTarget = STATUS_HOTEND_TARGET(1);
     lcd.print(LCD_STR_THERMOMETER[0]);
 #  else//Heated bed
-    tHotend=int(degBed() + 0.5);
-    tTarget=int(degTargetBed() + 0.5);
+    tHotend=STATUS_BED;
+    tTarget=STATUS_BED_TARGET;
     lcd.print(LCD_STR_BEDTEMP[0]);
 #  endif
     lcd.print(itostr3(tHotend));
@@ -437,8 +512,8 @@ static void lcd_implementation_status_screen()
 #  ifdef SDSUPPORT
     lcd.setCursor(0, 2);
     lcd_printPGM(PSTR("SD"));
-    if (IS_SD_PRINTING)
-        lcd.print(itostr3(card.percentDone()));
+    if (STATUS_SD_PRINTING)
+        lcd.print(itostr3(STATUS_SD_PERCENT));
     else
         lcd_printPGM(PSTR("---"));
     lcd.print('%');
@@ -446,8 +521,8 @@ static void lcd_implementation_status_screen()
 # else//LCD_WIDTH > 19
 #  if EXTRUDERS > 1 && TEMP_SENSOR_BED != 0
     //If we both have a 2nd extruder and a heated bed, show the heated bed temp on the 2nd line on the left, as the first line is filled with extruder temps
-    tHotend=int(degBed() + 0.5);
-    tTarget=int(degTargetBed() + 0.5);
+    tHotend=STATUS_BED;
+    tTarget=STATUS_BED_TARGET;
 
     lcd.setCursor(0, 1);
     lcd.print(LCD_STR_BEDTEMP[0]);
@@ -460,43 +535,57 @@ static void lcd_implementation_status_screen()
 #  else
     lcd.setCursor(0,1);
     lcd.print('X');
-    lcd.print(ftostr3(current_position[X_AXIS]));
+    lcd.print(ftostr3(STATUS_POSITION(X_AXIS)));
     lcd_printPGM(PSTR(" Y"));
-    lcd.print(ftostr3(current_position[Y_AXIS]));
+    lcd.print(ftostr3(STATUS_POSITION(Y_AXIS)));
 #  endif//EXTRUDERS > 1 || TEMP_SENSOR_BED != 0
 # endif//LCD_WIDTH > 19
     lcd.setCursor(LCD_WIDTH - 8, 1);
     lcd.print('Z');
-    lcd.print(ftostr32(current_position[Z_AXIS]));
+    lcd.print(ftostr32(STATUS_POSITION(Z_AXIS)));
 #endif//LCD_HEIGHT > 2
 
 #if LCD_HEIGHT > 3
     lcd.setCursor(0, 2);
     lcd.print(LCD_STR_FEEDRATE[0]);
-    lcd.print(itostr3(feedmultiply));
+    lcd.print(itostr3(STATUS_FEEDMULTIPLY));
     lcd.print('%');
 # if LCD_WIDTH > 19
 #  ifdef SDSUPPORT
     lcd.setCursor(7, 2);
     lcd_printPGM(PSTR("SD"));
-    if (IS_SD_PRINTING)
-        lcd.print(itostr3(card.percentDone()));
+    if (STATUS_SD_PRINTING)
+        lcd.print(itostr3(STATUS_SD_PERCENT));
     else
         lcd_printPGM(PSTR("---"));
     lcd.print('%');
 #  endif//SDSUPPORT
 # endif//LCD_WIDTH > 19
     lcd.setCursor(LCD_WIDTH - 6, 2);
+#if defined(SDSUPPORT) && defined(SD_PRINT_ETA)
+    if(STATUS_SD_PRINTING && STATUS_ETA_MINUTES >= 0)
+    {
+        //remaining time instead of the time printed so far
+        uint16_t time = STATUS_ETA_MINUTES;
+        lcd.print('-');
+        lcd.print(itostr2(time/60));
+        lcd.print(':');
+        lcd.print(itostr2(time%60));
+    }
+    else
+#endif
+    {
     lcd.print(LCD_STR_CLOCK[0]);
-    if(starttime != 0)
+    uint16_t time = STATUS_PRINT_MINUTES;
+    if(time != 0xFFFF)
     {
-        uint16_t time = millis()/60000 - starttime/60000;
         lcd.print(itostr2(time/60));
         lcd.print(':');
         lcd.print(itostr2(time%60));
     }else{
         lcd_printPGM(PSTR("--:--"));
     }
+    }
 #endif
 
     //Status message line on the last line
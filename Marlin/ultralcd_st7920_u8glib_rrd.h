@@ -8,8 +8,18 @@
 //set optimization so ARDUINO optimizes this file
 #pragma GCC optimize (3)
 
-#define ST7920_CLK_PIN  LCD_PINS_D4
-#define ST7920_DAT_PIN  LCD_PINS_ENABLE
+#ifdef ST7920_HARDWARE_SPI
+  #if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__)
+    #define ST7920_CLK_PIN  52 // SCK
+    #define ST7920_DAT_PIN  51 // MOSI
+    #define ST7920_SS_PIN   53 // must stay an output for the SPI unit to stay master
+  #else
+    #error "ST7920_HARDWARE_SPI knows the SPI pins of the 1280 and 2560 only"
+  #endif
+#else
+  #define ST7920_CLK_PIN  LCD_PINS_D4
+  #define ST7920_DAT_PIN  LCD_PINS_ENABLE
+#endif
 #define ST7920_CS_PIN   LCD_PINS_RS
 
 //#define PAGE_HEIGHT 8   //128 byte framebuffer
@@ -20,8 +30,44 @@
 #define HEIGHT 64
 
 #include <U8glib.h>
+#ifdef SPI_BUS_ARBITER
+  #include "spi_bus.h"
+#endif
+
+#ifdef ST7920_HARDWARE_SPI
+static uint8_t st7920_spcr, st7920_spsr; // of the SD card, given back when the display lets go of the bus
+
+// SPI mode 3 at F_CPU/8 like the bit-banged clock: idle high, the display takes the data on the rising edge
+static void ST7920_SPI_BEGIN()
+{
+  #ifdef SPI_BUS_ARBITER
+    spi_bus_acquire();
+  #endif
+  st7920_spcr = SPCR;
+  st7920_spsr = SPSR;
+  SPCR = (1<<SPE) | (1<<MSTR) | (1<<CPOL) | (1<<CPHA) | (1<<SPR0);
+  SPSR = (1<<SPI2X);
+}
+
+static void ST7920_SPI_END()
+{
+  SPCR = st7920_spcr;
+  SPSR = st7920_spsr;
+  #ifdef SPI_BUS_ARBITER
+    spi_bus_release();
+  #endif
+}
 
-static void ST7920_SWSPI_SND_8BIT(uint8_t val)
+static void ST7920_SND_8BIT(uint8_t val)
+{
+  SPDR = val;
+  while (!(SPSR & (1<<SPIF)));
+}
+#else
+#define ST7920_SPI_BEGIN()
+#define ST7920_SPI_END()
+
+static void ST7920_SND_8BIT(uint8_t val)
 {
   uint8_t i;
   for( i=0; i<8; i++ )
@@ -32,13 +78,18 @@ static void ST7920_SWSPI_SND_8BIT(uint8_t val)
     WRITE(ST7920_CLK_PIN,1);
   }
 }
+#endif
 
-#define ST7920_CS()              {WRITE(ST7920_CS_PIN,1);u8g_10MicroDelay();}
-#define ST7920_NCS()             {WRITE(ST7920_CS_PIN,0);}
-#define ST7920_SET_CMD()         {ST7920_SWSPI_SND_8BIT(0xf8);u8g_10MicroDelay();}
-#define ST7920_SET_DAT()         {ST7920_SWSPI_SND_8BIT(0xfa);u8g_10MicroDelay();}
-#define ST7920_WRITE_BYTE(a)     {ST7920_SWSPI_SND_8BIT((a)&0xf0);ST7920_SWSPI_SND_8BIT((a)<<4);u8g_10MicroDelay();}
-#define ST7920_WRITE_BYTES(p,l)  {uint8_t i;for(i=0;i<l;i++){ST7920_SWSPI_SND_8BIT(*p&0xf0);ST7920_SWSPI_SND_8BIT(*p<<4);p++;}u8g_10MicroDelay();}
+#ifdef ST7920_FRAME_BUFFER
+static uint8_t st7920_shown[HEIGHT][WIDTH/8]; // what the GDRAM holds, rows that match are not sent again
+#endif
+
+#define ST7920_CS()              {ST7920_SPI_BEGIN();WRITE(ST7920_CS_PIN,1);u8g_10MicroDelay();}
+#define ST7920_NCS()             {WRITE(ST7920_CS_PIN,0);ST7920_SPI_END();}
+#define ST7920_SET_CMD()         {ST7920_SND_8BIT(0xf8);u8g_10MicroDelay();}
+#define ST7920_SET_DAT()         {ST7920_SND_8BIT(0xfa);u8g_10MicroDelay();}
+#define ST7920_WRITE_BYTE(a)     {ST7920_SND_8BIT((a)&0xf0);ST7920_SND_8BIT((a)<<4);u8g_10MicroDelay();}
+#define ST7920_WRITE_BYTES(p,l)  {uint8_t i;for(i=0;i<l;i++){ST7920_SND_8BIT(*p&0xf0);ST7920_SND_8BIT(*p<<4);p++;}u8g_10MicroDelay();}
 
 uint8_t u8g_dev_rrd_st7920_128x64_fn(u8g_t *u8g, u8g_dev_t *dev, uint8_t msg, void *arg)
 {
@@ -53,6 +104,15 @@ uint8_t u8g_dev_rrd_st7920_128x64_fn(u8g_t *u8g, u8g_dev_t *dev, uint8_t msg, vo
         WRITE(ST7920_DAT_PIN,0);
         SET_OUTPUT(ST7920_CLK_PIN);
         WRITE(ST7920_CLK_PIN,1);
+        #ifdef ST7920_SS_PIN
+          if (!GET_OUTPUT(ST7920_SS_PIN)) {
+            WRITE(ST7920_SS_PIN,1);
+            SET_OUTPUT(ST7920_SS_PIN);
+          }
+        #endif
+        #ifdef ST7920_FRAME_BUFFER
+          memset(st7920_shown, 0, sizeof(st7920_shown)); // the GDRAM gets cleared below
+        #endif
 
         ST7920_CS();
         u8g_Delay(90);                 //initial delay for boot up
@@ -87,6 +147,15 @@ uint8_t u8g_dev_rrd_st7920_128x64_fn(u8g_t *u8g, u8g_dev_t *dev, uint8_t msg, vo
         ST7920_CS();
         for( i = 0; i < PAGE_HEIGHT; i ++ )
         {
+          #ifdef ST7920_FRAME_BUFFER
+          if (memcmp(st7920_shown[y], ptr, WIDTH/8) == 0)
+          {
+            ptr += WIDTH/8;
+            y++;
+            continue;
+          }
+          memcpy(st7920_shown[y], ptr, WIDTH/8);
+          #endif
           ST7920_SET_CMD();
           if ( y < 32 )
           {
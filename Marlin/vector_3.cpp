@@ -64,7 +64,7 @@ void vector_3::normalize()
 	z /= length;
 }
 
-void vector_3::apply_rotation(matrix_3x3 matrix)
+void vector_3::apply_rotation(const matrix_3x3 &matrix)
 {
 	float resultX = x * matrix.matrix[3*0+0] + y * matrix.matrix[3*1+0] + z * matrix.matrix[3*2+0];
 	float resultY = x * matrix.matrix[3*0+1] + y * matrix.matrix[3*1+1] + z * matrix.matrix[3*2+1];
@@ -87,7 +87,7 @@ void vector_3::debug(char* title)
 	SERIAL_PROTOCOLPGM("\n");
 }
 
-void apply_rotation_xyz(matrix_3x3 matrix, float &x, float& y, float& z)
+void apply_rotation_xyz(const matrix_3x3 &matrix, float &x, float& y, float& z)
 {
 	vector_3 vector = vector_3(x, y, z);
 	vector.apply_rotation(matrix);
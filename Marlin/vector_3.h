@@ -39,7 +39,7 @@ struct vector_3
 
 	void debug(char* title);
 	
-	void apply_rotation(matrix_3x3 matrix);
+	void apply_rotation(const matrix_3x3 &matrix);
 };
 
 struct matrix_3x3
@@ -56,7 +56,7 @@ struct matrix_3x3
 };
 
 
-void apply_rotation_xyz(matrix_3x3 rotationMatrix, float &x, float& y, float& z);
+void apply_rotation_xyz(const matrix_3x3 &rotationMatrix, float &x, float& y, float& z);
 #endif // ENABLE_AUTO_BED_LEVELING
 
 #endif // VECTOR_3_H